@@ -194,6 +194,11 @@ static void amp_resolve_callback(void *d, int err, struct ub_result *result) {
     }
 
 end:
+    /* tell the caller once every query for the test has been answered */
+    if ( *data->remaining == 0 && data->notify ) {
+        data->notify(data->notify_data);
+    }
+
     /* get outstanding queries for this name while we still have it locked */
     qcount = --data->qcount;
 
@@ -217,6 +222,22 @@ void amp_resolve_add(struct ub_ctx *ctx, struct addrinfo **res,
         pthread_mutex_t *addrlist_lock, char *name, int family, int max,
         int *remaining) {
 
+    amp_resolve_add_notify(ctx, res, addrlist_lock, name, family, max,
+            remaining, NULL, NULL);
+}
+
+
+
+/*
+ * Add a request to the queue in the same way as amp_resolve_add(), calling
+ * notify (with the addrlist lock held) when the last outstanding query for
+ * the test has been answered. This lets the caller be told when it is done
+ * rather than having to keep checking the remaining counter.
+ */
+void amp_resolve_add_notify(struct ub_ctx *ctx, struct addrinfo **res,
+        pthread_mutex_t *addrlist_lock, char *name, int family, int max,
+        int *remaining, void (*notify)(void *), void *notify_data) {
+
     struct amp_resolve_data *data;
     struct addrinfo *addr;
 
@@ -264,6 +285,8 @@ void amp_resolve_add(struct ub_ctx *ctx, struct addrinfo **res,
 
     /* create a mutex to make sure we don't mess up our addrlist */
     data->lock = addrlist_lock;
+    data->notify = notify;
+    data->notify_data = notify_data;
 
     /*
      * Track how many queries we have that are using this data block, if we
@@ -327,6 +350,14 @@ void amp_resolve_wait(struct ub_ctx *ctx, pthread_mutex_t *lock,
     assert(lock);
     assert(remaining);
 
+    /* everything may already have been answered, e.g. from the cache */
+    pthread_mutex_lock(lock);
+    if ( *remaining <= 0 ) {
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    pthread_mutex_unlock(lock);
+
     Log(LOG_DEBUG, "Waiting for outstanding DNS requests");
 
     /* using the file descriptor directly lets us use select() for timeouts */
@@ -499,7 +530,7 @@ struct addrinfo *amp_resolve_get_list(int fd) {
     /* everything we read should be the result of a name lookup */
     while ( 1 ) {
         struct addrinfo *tmp;
-        if ( recv(fd, &item, sizeof(struct addrinfo), 0) <= 0 ) {
+        if ( recv(fd, &item, sizeof(struct addrinfo), MSG_WAITALL) <= 0 ) {
             break;
         }
 
@@ -514,26 +545,26 @@ struct addrinfo *amp_resolve_get_list(int fd) {
         assert(tmp->ai_addrlen > 0);
         assert(tmp->ai_addr);
 
-        if ( recv(fd, tmp->ai_addr, tmp->ai_addrlen, 0) <= 0 ) {
+        if ( recv(fd, tmp->ai_addr, tmp->ai_addrlen, MSG_WAITALL) <= 0 ) {
             free(tmp);
             break;
         }
 
-        if ( recv(fd, &namelen, sizeof(namelen), 0) <= 0 ) {
+        if ( recv(fd, &namelen, sizeof(namelen), MSG_WAITALL) <= 0 ) {
             free(tmp);
             break;
         }
 
         assert(namelen > 1);
 
-        if ( recv(fd, name, namelen, 0) <= 0 ) {
+        if ( recv(fd, name, namelen, MSG_WAITALL) <= 0 ) {
             free(tmp);
             break;
         }
         tmp->ai_canonname = strdup(name);
         assert(tmp->ai_canonname);
 
-        if ( recv(fd, &more, sizeof(more), 0) <= 0 ) {
+        if ( recv(fd, &more, sizeof(more), MSG_WAITALL) <= 0 ) {
             free(tmp->ai_canonname);
             free(tmp);
             break;
@@ -553,3 +584,237 @@ struct addrinfo *amp_resolve_get_list(int fd) {
     return addrlist;
 }
 
+
+
+
+/*
+ * Prepare an empty batch of queries.
+ */
+void amp_resolve_batch_init(amp_resolve_batch_t *batch) {
+    assert(batch);
+
+    memset(batch, 0, sizeof(*batch));
+    batch->header.marker = 0;
+    batch->header.magic = AMP_RESOLVE_MAGIC;
+    batch->header.version = AMP_RESOLVE_VERSION;
+}
+
+
+
+/*
+ * Add a query to a batch that will later be sent to the local resolver with
+ * amp_resolve_batch_send().
+ */
+int amp_resolve_batch_add(amp_resolve_batch_t *batch, resolve_dest_t *resolve) {
+    struct amp_resolve_query info;
+    size_t namelen;
+
+    assert(batch);
+    assert(resolve);
+    assert(resolve->name);
+
+    namelen = strlen(resolve->name);
+
+    if ( namelen == 0 || namelen > UINT8_MAX ) {
+        Log(LOG_WARNING, "Invalid length for name to resolve: %zu", namelen);
+        return -1;
+    }
+
+    if ( batch->header.count >= AMP_RESOLVE_MAX_BATCH ) {
+        Log(LOG_WARNING, "Too many names in resolution batch, ignoring %s",
+                resolve->name);
+        return -1;
+    }
+
+    if ( batch->length + sizeof(info) + namelen > batch->size ) {
+        batch->size = (batch->size * 2) + sizeof(info) + namelen;
+        batch->data = realloc(batch->data, batch->size);
+        assert(batch->data);
+    }
+
+    info.namelen = namelen;
+    info.count = resolve->count;
+    info.family = resolve->family;
+
+    memcpy(batch->data + batch->length, &info, sizeof(info));
+    batch->length += sizeof(info);
+    memcpy(batch->data + batch->length, resolve->name, namelen);
+    batch->length += namelen;
+    batch->header.count++;
+
+    return 0;
+}
+
+
+
+/*
+ * Send a complete batch of queries to the local resolver. There is no need
+ * to flag the end of the queries, the header says how many there are.
+ */
+int amp_resolve_batch_send(int fd, amp_resolve_batch_t *batch) {
+    struct msghdr msg;
+    struct iovec iov[2];
+    ssize_t bytes;
+
+    assert(batch);
+
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = &batch->header;
+    iov[0].iov_len = sizeof(batch->header);
+    iov[1].iov_base = batch->data;
+    iov[1].iov_len = batch->length;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    Log(LOG_DEBUG, "Sending batch of %d resolution queries",
+            batch->header.count);
+
+    /* usually this all goes in one call, but a big batch might not */
+    while ( msg.msg_iovlen > 0 ) {
+        if ( (bytes = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            Log(LOG_WARNING, "Failed to send resolution queries: %s",
+                    strerror(errno));
+            return -1;
+        }
+
+        /* skip past whatever was sent, and try again with the rest */
+        while ( msg.msg_iovlen > 0 && (size_t)bytes >= msg.msg_iov->iov_len ) {
+            bytes -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if ( msg.msg_iovlen > 0 ) {
+            msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + bytes;
+            msg.msg_iov->iov_len -= bytes;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Free the memory used by a batch of queries.
+ */
+void amp_resolve_batch_free(amp_resolve_batch_t *batch) {
+    assert(batch);
+
+    free(batch->data);
+    batch->data = NULL;
+    batch->length = 0;
+    batch->size = 0;
+}
+
+
+
+/*
+ * Decode a single address from a batched reply, returning the number of
+ * bytes used or -1 if it isn't valid.
+ */
+static ssize_t decode_batch_item(uint8_t *data, size_t length,
+        struct addrinfo **addrlist) {
+    struct amp_resolve_reply_item item;
+    struct addrinfo *tmp;
+    size_t used;
+
+    if ( length < sizeof(item) ) {
+        return -1;
+    }
+
+    memcpy(&item, data, sizeof(item));
+    used = sizeof(item) + item.addrlen + item.namelen;
+
+    if ( length < used || item.namelen == 0 ||
+            item.addrlen < sizeof(struct sockaddr) ||
+            item.addrlen > sizeof(struct sockaddr_storage) ) {
+        return -1;
+    }
+
+    tmp = calloc(1, sizeof(struct addrinfo));
+    tmp->ai_flags = item.flags;
+    tmp->ai_family = item.family;
+    tmp->ai_socktype = item.socktype;
+    tmp->ai_protocol = item.protocol;
+    tmp->ai_addrlen = item.addrlen;
+    tmp->ai_addr = calloc(1, tmp->ai_addrlen);
+    memcpy(tmp->ai_addr, data + sizeof(item), item.addrlen);
+    tmp->ai_canonname = calloc(1, item.namelen + 1);
+    memcpy(tmp->ai_canonname, data + sizeof(item) + item.addrlen,
+            item.namelen);
+
+    assert(tmp->ai_addr);
+    assert(tmp->ai_canonname);
+
+    /* add the item to the front of the list once it is complete */
+    tmp->ai_next = *addrlist;
+    *addrlist = tmp;
+
+    return used;
+}
+
+
+
+/*
+ * Get a list of addrinfo structs that is the result of a batch of queries
+ * sent with amp_resolve_batch_send(). The whole reply is read in two calls,
+ * one for the header and one for all the addresses. This will block until
+ * all the queries complete or time out.
+ */
+struct addrinfo *amp_resolve_get_batch_list(int fd) {
+    struct amp_resolve_reply_header header;
+    struct addrinfo *addrlist = NULL;
+    uint8_t *data = NULL;
+    size_t offset;
+    ssize_t used;
+    int i;
+
+    Log(LOG_DEBUG, "Waiting for batched address list");
+
+    if ( recv(fd, &header, sizeof(header), MSG_WAITALL) !=
+            (ssize_t)sizeof(header) ) {
+        Log(LOG_WARNING, "Failed to read resolution reply header");
+        goto end;
+    }
+
+    if ( header.version != AMP_RESOLVE_VERSION ) {
+        Log(LOG_WARNING, "Unknown resolution reply version %d",
+                header.version);
+        goto end;
+    }
+
+    if ( header.count == 0 || header.length == 0 ) {
+        goto end;
+    }
+
+    if ( (data = malloc(header.length)) == NULL ) {
+        Log(LOG_WARNING, "Failed to allocate %u bytes for resolution reply",
+                header.length);
+        goto end;
+    }
+
+    if ( recv(fd, data, header.length, MSG_WAITALL) !=
+            (ssize_t)header.length ) {
+        Log(LOG_WARNING, "Failed to read resolution reply");
+        goto end;
+    }
+
+    for ( i = 0, offset = 0; i < header.count; i++ ) {
+        if ( (used = decode_batch_item(data + offset, header.length - offset,
+                        &addrlist)) < 0 ) {
+            Log(LOG_WARNING, "Invalid address in resolution reply");
+            break;
+        }
+        offset += used;
+    }
+
+end:
+    free(data);
+    close(fd); //XXX do this here or at next level up in the test?
+
+    return addrlist;
+}
@@ -60,6 +60,8 @@ struct amp_resolve_data {
     int qcount;                 /* how many requests for name, shared max */
     int *remaining;             /* total requests for test, shared addrlist */
     struct addrinfo **addrlist; /* list to store the results in */
+    void (*notify)(void *);     /* called when remaining reaches zero */
+    void *notify_data;
 };
 
 /* data block used to transfer information about a query to be performed */
@@ -69,6 +71,58 @@ struct amp_resolve_query {
     uint8_t family;             /* address family to query for or AF_UNSPEC */
 };
 
+/*
+ * A batch of queries starts with this header rather than a query. The first
+ * byte is zero so that it looks like an end marker to a server that only
+ * understands single queries, and the magic value distinguishes it from a
+ * real end marker sent by an old client. The header is followed by "count"
+ * queries, each an amp_resolve_query and namelen bytes of name without the
+ * terminating null.
+ */
+#define AMP_RESOLVE_MAGIC 0xa5
+#define AMP_RESOLVE_VERSION 2
+#define AMP_RESOLVE_MAX_BATCH UINT16_MAX
+
+struct amp_resolve_batch_header {
+    uint8_t marker;             /* always zero */
+    uint8_t magic;              /* AMP_RESOLVE_MAGIC */
+    uint8_t version;            /* AMP_RESOLVE_VERSION */
+    uint8_t reserved;
+    uint16_t count;             /* number of queries that follow */
+    uint16_t reserved2;
+};
+
+/*
+ * A batched reply is this header followed by "length" bytes containing
+ * "count" addresses, each an amp_resolve_reply_item, addrlen bytes of
+ * address and namelen bytes of name without the terminating null.
+ */
+struct amp_resolve_reply_header {
+    uint8_t version;            /* AMP_RESOLVE_VERSION */
+    uint8_t reserved;
+    uint16_t count;             /* number of addresses that follow */
+    uint32_t length;            /* bytes of address data that follow */
+};
+
+struct amp_resolve_reply_item {
+    uint16_t flags;             /* ai_flags */
+    uint8_t family;             /* ai_family */
+    uint8_t socktype;           /* ai_socktype */
+    uint8_t protocol;           /* ai_protocol */
+    uint8_t addrlen;            /* length of the address that follows */
+    uint8_t namelen;            /* length of the name that follows */
+    uint8_t reserved;
+};
+
+/* queries built up to be sent to the local resolver in a single message */
+struct amp_resolve_batch {
+    struct amp_resolve_batch_header header;
+    uint8_t *data;              /* encoded queries */
+    size_t length;              /* bytes of encoded queries */
+    size_t size;                /* space allocated for encoded queries */
+};
+typedef struct amp_resolve_batch amp_resolve_batch_t;
+
 /*
  * XXX may need to rethink this, can it be reconciled with the name table
  * entry? or are they too different?
@@ -87,6 +141,9 @@ struct ub_ctx *amp_resolver_context_init(char *servers[], int nscount,
 void amp_resolve_add(struct ub_ctx *ctx, struct addrinfo **res,
         pthread_mutex_t *addrlist_lock, char *name, int family, int max,
         int *remaining);
+void amp_resolve_add_notify(struct ub_ctx *ctx, struct addrinfo **res,
+        pthread_mutex_t *addrlist_lock, char *name, int family, int max,
+        int *remaining, void (*notify)(void *), void *notify_data);
 void amp_resolve_wait(struct ub_ctx *ctx, pthread_mutex_t *lock,
         int *remaining);
 void amp_resolve_freeaddr(struct addrinfo *addrlist);
@@ -95,5 +152,10 @@ void amp_resolver_context_delete(struct ub_ctx *ctx);
 struct addrinfo *amp_resolve_get_list(int fd);
 int amp_resolve_add_new(int fd, resolve_dest_t *resolve);
 int amp_resolve_flag_done(int fd);
+void amp_resolve_batch_init(amp_resolve_batch_t *batch);
+int amp_resolve_batch_add(amp_resolve_batch_t *batch, resolve_dest_t *resolve);
+int amp_resolve_batch_send(int fd, amp_resolve_batch_t *batch);
+void amp_resolve_batch_free(amp_resolve_batch_t *batch);
+struct addrinfo *amp_resolve_get_batch_list(int fd);
 int amp_resolver_connect(char *path);
 #endif
@@ -48,6 +48,7 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "debug.h"
 #include "asn.h"
@@ -97,10 +98,17 @@ void add_parsed_line(struct iptrie *result, char *line,
     /* add to the result set */
     iptrie_add(result, (struct sockaddr*)&addr, prefix, as);
 
-    /* add to the global cache */
+    /*
+     * Add to the cache, entries expire at slightly different times. Lookups
+     * read the cache without the mutex, so existing nodes can't be changed.
+     */
     if ( info != NULL ) {
+        time_t expires = time(NULL) + MIN_ASN_CACHE_LIFETIME +
+            (rand() % MAX_ASN_CACHE_LIFETIME_OFFSET);
+
         pthread_mutex_lock(info->mutex);
-        iptrie_add(info->trie, (struct sockaddr*)&addr, prefix, as);
+        iptrie_add_copying(info->trie, (struct sockaddr*)&addr, prefix, as,
+                expires);
         pthread_mutex_unlock(info->mutex);
     }
 }
@@ -158,15 +166,15 @@ static struct iptrie *amp_asn_fetch_results_local(int fd,
         size_t addrlen;
         struct sockaddr_storage addr;
 
-        if ( recv(fd, &asn, sizeof(asn), 0) <= 0 ) {
+        if ( recv(fd, &asn, sizeof(asn), MSG_WAITALL) <= 0 ) {
             break;
         }
 
-        if ( recv(fd, &prefix, sizeof(prefix), 0) <= 0 ) {
+        if ( recv(fd, &prefix, sizeof(prefix), MSG_WAITALL) <= 0 ) {
             break;
         }
 
-        if ( recv(fd, &family, sizeof(family), 0) <= 0 ) {
+        if ( recv(fd, &family, sizeof(family), MSG_WAITALL) <= 0 ) {
             break;
         }
 
@@ -178,7 +186,7 @@ static struct iptrie *amp_asn_fetch_results_local(int fd,
             break;
         }
 
-        if ( recv(fd, &addr, addrlen, 0) <= 0 ) {
+        if ( recv(fd, &addr, addrlen, MSG_WAITALL) <= 0 ) {
             break;
         }
 
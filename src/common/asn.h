@@ -44,12 +44,18 @@
 
 #define WHOIS_UNAVAILABLE -2
 
+/*
+ * Cached ASNs are valid for a day, plus up to an hour of jitter so that
+ * entries looked up at the same time don't all need refreshing together.
+ */
+#define MIN_ASN_CACHE_LIFETIME 86400
+#define MAX_ASN_CACHE_LIFETIME_OFFSET 3600
+
 /* data block given to each resolving thread */
 struct amp_asn_info {
     int fd;                     /* file descriptor to the test process */
     struct iptrie *trie;        /* shared ASN data (with the cache) */
     pthread_mutex_t *mutex;     /* protect the shared cache */
-    time_t *refresh;            /* time the cache should be refreshed */
 };
 
 int connect_to_whois_server(void);
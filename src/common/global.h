@@ -60,8 +60,10 @@ struct amp_global_t {
     struct ub_ctx *ctx;
     char *asnsock;
     char *nssock;
+    char *brokersock;
     int nssock_fd;
     int asnsock_fd;
+    int brokersock_fd;
     char **argv;
     int argc;
 };
@@ -0,0 +1,79 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * FNV-1a hashes, used wherever a quick non-cryptographic hash or checksum
+ * is needed. Hashes can be built up over several pieces of data by passing
+ * the result of one call in as the starting hash of the next.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "hash.h"
+
+
+
+/*
+ * Add some bytes to a 32 bit FNV-1a hash. Start with FNV1A_32_INIT.
+ */
+uint32_t fnv1a_32(uint32_t hash, const void *data, size_t length) {
+    const uint8_t *byte;
+
+    for ( byte = data; byte < (const uint8_t *)data + length; byte++ ) {
+        hash = (hash ^ *byte) * 16777619U;
+    }
+
+    return hash;
+}
+
+
+
+/*
+ * Add some bytes to a 64 bit FNV-1a hash. Start with FNV1A_64_INIT.
+ */
+uint64_t fnv1a_64(uint64_t hash, const void *data, size_t length) {
+    const uint8_t *byte;
+
+    for ( byte = data; byte < (const uint8_t *)data + length; byte++ ) {
+        hash = (hash ^ *byte) * 1099511628211ULL;
+    }
+
+    return hash;
+}
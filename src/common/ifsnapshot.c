@@ -0,0 +1,362 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <sys/mman.h>
+
+#include "ifsnapshot.h"
+#include "debug.h"
+
+/*
+ * The snapshot maintained by measured. This is inherited by any tests that
+ * measured forks (including through the test runners), and stays NULL in
+ * standalone tests so that they go straight to getifaddrs().
+ */
+static struct amp_ifsnapshot *ifsnapshot = NULL;
+
+/* how many times to try for a consistent copy before giving up */
+#define MAX_SNAPSHOT_READ_ATTEMPTS 100
+
+
+
+/*
+ * Create the shared memory to hold the interface snapshot, and make it the
+ * snapshot that this process (and all its children) will read from. This
+ * needs to be done before any long lived children are forked.
+ */
+struct amp_ifsnapshot *amp_ifsnapshot_create(void) {
+    struct amp_ifsnapshot *snapshot;
+
+    snapshot = mmap(NULL, sizeof(struct amp_ifsnapshot),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if ( snapshot == MAP_FAILED ) {
+        Log(LOG_WARNING, "Failed to map interface snapshot: %s",
+                strerror(errno));
+        return NULL;
+    }
+
+    /* anonymous mappings are zeroed, so the snapshot starts invalid */
+    ifsnapshot = snapshot;
+
+    return snapshot;
+}
+
+
+
+/*
+ * Remove the shared interface snapshot.
+ */
+void amp_ifsnapshot_destroy(struct amp_ifsnapshot *snapshot) {
+    if ( snapshot == NULL ) {
+        return;
+    }
+
+    if ( snapshot == ifsnapshot ) {
+        ifsnapshot = NULL;
+    }
+
+    munmap(snapshot, sizeof(struct amp_ifsnapshot));
+}
+
+
+
+/*
+ * Replace the contents of the snapshot with a new list of addresses. Only
+ * measured should call this, and only from a single thread.
+ */
+void amp_ifsnapshot_publish(struct amp_ifsnapshot *snapshot,
+        struct amp_if_address *addresses, int count, int truncated) {
+    uint32_t sequence;
+
+    assert(snapshot);
+    assert(count >= 0 && count <= AMP_IFSNAPSHOT_MAX_ADDRESSES);
+
+    sequence = __atomic_load_n(&snapshot->sequence, __ATOMIC_RELAXED);
+
+    /* odd sequence numbers tell readers an update is in progress */
+    __atomic_store_n(&snapshot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if ( count > 0 ) {
+        memcpy(snapshot->addresses, addresses,
+                count * sizeof(struct amp_if_address));
+    }
+    snapshot->count = count;
+    snapshot->truncated = truncated;
+    snapshot->valid = 1;
+
+    __atomic_store_n(&snapshot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+
+
+/*
+ * Mark the snapshot as unusable, so that tests ask the kernel for the
+ * interfaces until a complete list is published again.
+ */
+void amp_ifsnapshot_invalidate(struct amp_ifsnapshot *snapshot) {
+    uint32_t sequence;
+
+    assert(snapshot);
+
+    sequence = __atomic_load_n(&snapshot->sequence, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&snapshot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    snapshot->valid = 0;
+
+    __atomic_store_n(&snapshot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+
+
+/*
+ * Take a consistent copy of the shared interface snapshot. Returns -1 if
+ * there is no usable snapshot and the caller should ask the kernel directly.
+ */
+int amp_ifsnapshot_read(struct amp_ifsnapshot *copy) {
+    uint32_t before, after;
+    int attempts;
+
+    assert(copy);
+
+    if ( ifsnapshot == NULL ) {
+        return -1;
+    }
+
+    for ( attempts = 0; attempts < MAX_SNAPSHOT_READ_ATTEMPTS; attempts++ ) {
+        before = __atomic_load_n(&ifsnapshot->sequence, __ATOMIC_ACQUIRE);
+
+        if ( before & 1 ) {
+            continue;
+        }
+
+        copy->valid = ifsnapshot->valid;
+        copy->truncated = ifsnapshot->truncated;
+        copy->count = ifsnapshot->count;
+
+        if ( copy->count > AMP_IFSNAPSHOT_MAX_ADDRESSES ) {
+            continue;
+        }
+
+        memcpy(copy->addresses, ifsnapshot->addresses,
+                copy->count * sizeof(struct amp_if_address));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&ifsnapshot->sequence, __ATOMIC_RELAXED);
+
+        if ( before == after ) {
+            copy->sequence = before;
+            return (copy->valid && !copy->truncated) ? 0 : -1;
+        }
+    }
+
+    Log(LOG_DEBUG, "Interface snapshot kept changing, ignoring it");
+    return -1;
+}
+
+
+
+/*
+ * Determine which address families have addresses on the given interface,
+ * or on any interface if ifname is NULL. If the families can't be
+ * determined then both are assumed to be available.
+ */
+int amp_interface_families(char *ifname, int *seen_ipv4, int *seen_ipv6) {
+    struct amp_ifsnapshot *snapshot;
+    struct ifaddrs *ifaddrlist, *ifa;
+    uint32_t i;
+
+    assert(seen_ipv4);
+    assert(seen_ipv6);
+
+    *seen_ipv4 = 0;
+    *seen_ipv6 = 0;
+
+    snapshot = malloc(sizeof(struct amp_ifsnapshot));
+
+    if ( snapshot != NULL && amp_ifsnapshot_read(snapshot) == 0 ) {
+        for ( i = 0; i < snapshot->count; i++ ) {
+            struct amp_if_address *addr = &snapshot->addresses[i];
+
+            /* ignore other interfaces if the source interface is set */
+            if ( ifname != NULL && strcmp(ifname, addr->name) != 0 ) {
+                continue;
+            }
+
+            if ( addr->family == AF_INET ) {
+                *seen_ipv4 = 1;
+            } else if ( addr->family == AF_INET6 ) {
+                *seen_ipv6 = 1;
+            }
+        }
+        free(snapshot);
+        return 0;
+    }
+
+    free(snapshot);
+
+    /* no snapshot available, ask the kernel */
+    if ( getifaddrs(&ifaddrlist) < 0 ) {
+        /* error getting interfaces, assume we can do both IPv4 and 6 */
+        *seen_ipv4 = 1;
+        *seen_ipv6 = 1;
+        return -1;
+    }
+
+    for ( ifa = ifaddrlist; ifa != NULL; ifa = ifa->ifa_next ) {
+        /* some interfaces (e.g. ppp) sometimes won't have an address */
+        if ( ifa->ifa_addr == NULL ) {
+            continue;
+        }
+
+        /* ignore other interfaces if the source interface is set */
+        if ( ifname != NULL && strcmp(ifname, ifa->ifa_name) != 0 ) {
+            continue;
+        }
+
+        /* otherwise, flag the family as one that we can use */
+        if ( ifa->ifa_addr->sa_family == AF_INET ) {
+            *seen_ipv4 = 1;
+        } else if ( ifa->ifa_addr->sa_family == AF_INET6 ) {
+            *seen_ipv6 = 1;
+        }
+    }
+
+    freeifaddrs(ifaddrlist);
+
+    return 0;
+}
+
+
+
+/*
+ * Check if an interface address is the same as the given address.
+ */
+static int address_matches(struct sockaddr *address, int family, void *addr) {
+    if ( address->sa_family != family ) {
+        return 0;
+    }
+
+    switch ( family ) {
+        case AF_INET:
+            return memcmp(&((struct sockaddr_in *)address)->sin_addr, addr,
+                    sizeof(struct in_addr)) == 0;
+        case AF_INET6:
+            return memcmp(&((struct sockaddr_in6 *)address)->sin6_addr, addr,
+                    sizeof(struct in6_addr)) == 0;
+        default: return 0;
+    };
+}
+
+
+
+/*
+ * Determine which interface a given address belongs to, writing the name
+ * into the buffer. Returns -1 if no interface has that address.
+ */
+int amp_interface_name(struct sockaddr *address, char *name, size_t len) {
+    struct amp_ifsnapshot *snapshot;
+    struct ifaddrs *ifaddrlist, *ifa;
+    uint32_t i;
+    int found = -1;
+
+    assert(address);
+    assert(name);
+
+    snapshot = malloc(sizeof(struct amp_ifsnapshot));
+
+    if ( snapshot != NULL && amp_ifsnapshot_read(snapshot) == 0 ) {
+        for ( i = 0; i < snapshot->count; i++ ) {
+            struct amp_if_address *addr = &snapshot->addresses[i];
+
+            if ( address_matches(address, addr->family, &addr->addr) ) {
+                snprintf(name, len, "%s", addr->name);
+                found = 0;
+                break;
+            }
+        }
+        free(snapshot);
+        return found;
+    }
+
+    free(snapshot);
+
+    /* no snapshot available, ask the kernel */
+    if ( getifaddrs(&ifaddrlist) < 0 ) {
+        Log(LOG_WARNING, "Unable to fetch interface addresses: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    for ( ifa = ifaddrlist; ifa != NULL; ifa = ifa->ifa_next ) {
+        void *addr;
+
+        if ( ifa->ifa_addr == NULL ) {
+            continue;
+        }
+
+        switch ( ifa->ifa_addr->sa_family ) {
+            case AF_INET:
+                addr = &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+                break;
+            case AF_INET6:
+                addr = &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+                break;
+            default: continue;
+        };
+
+        if ( address_matches(address, ifa->ifa_addr->sa_family, addr) ) {
+            snprintf(name, len, "%s", ifa->ifa_name);
+            found = 0;
+            break;
+        }
+    }
+
+    freeifaddrs(ifaddrlist);
+
+    return found;
+}
@@ -0,0 +1,86 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COMMON_IFSNAPSHOT_H
+#define _COMMON_IFSNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/* addresses beyond this aren't stored, readers fall back to getifaddrs() */
+#define AMP_IFSNAPSHOT_MAX_ADDRESSES 256
+
+/* one address belonging to an interface */
+struct amp_if_address {
+    char name[IF_NAMESIZE];     /* name of the interface */
+    int index;                  /* index of the interface */
+    unsigned int flags;         /* interface flags, IFF_UP etc */
+    uint8_t family;             /* AF_INET or AF_INET6 */
+    uint8_t prefixlen;          /* length of the network prefix */
+    union {
+        struct in_addr in;
+        struct in6_addr in6;
+    } addr;
+};
+
+/*
+ * Interface addresses shared between measured and the tests it forks. There
+ * is a single writer (measured), and readers use the sequence number to
+ * make sure they see a consistent copy - it is odd while being updated.
+ */
+struct amp_ifsnapshot {
+    uint32_t sequence;          /* incremented before and after updates */
+    uint32_t valid;             /* non-zero once populated */
+    uint32_t truncated;         /* too many addresses to store them all */
+    uint32_t count;             /* number of valid addresses */
+    struct amp_if_address addresses[AMP_IFSNAPSHOT_MAX_ADDRESSES];
+};
+
+struct amp_ifsnapshot *amp_ifsnapshot_create(void);
+void amp_ifsnapshot_destroy(struct amp_ifsnapshot *snapshot);
+void amp_ifsnapshot_publish(struct amp_ifsnapshot *snapshot,
+        struct amp_if_address *addresses, int count, int truncated);
+void amp_ifsnapshot_invalidate(struct amp_ifsnapshot *snapshot);
+int amp_ifsnapshot_read(struct amp_ifsnapshot *copy);
+int amp_interface_families(char *ifname, int *seen_ipv4, int *seen_ipv6);
+int amp_interface_name(struct sockaddr *address, char *name, size_t len);
+#endif
@@ -37,51 +37,113 @@
  * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Path compressed binary trie of IPv4 and IPv6 prefixes. Each node stores
+ * the prefix length at which its children diverge, so chains of single
+ * child nodes never exist. Addresses are also kept as a pair of 64 bit words
+ * in host byte order so that prefix matching and finding where two prefixes
+ * diverge only take a few word operations, rather than testing a bit at a
+ * time. Nodes are allocated from blocks owned by the trie, which keeps them
+ * close together in memory and lets the whole trie be freed at once.
+ *
+ * Tries that are read without a lock can be updated with copying inserts,
+ * which never modify a node that is already reachable from the roots.
+ */
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <endian.h>
 
 #include "iptrie.h"
-#include "testlib.h"
 
+/* size of the first block of nodes, later blocks double in size */
+#define IPTRIE_POOL_MIN_NODES 16
+/* largest number of nodes allocated at once */
+#define IPTRIE_POOL_MAX_NODES 4096
+/* longest path from the root to a leaf, one node per bit plus the root */
+#define IPTRIE_MAX_DEPTH 130
 
 /*
- * Get the bit in the address at the given zero-based index. Expects either
- * an IPv4 or IPv6 address in network byte order.
+ * A block of nodes, allocated in one go.
  */
-static int get_bit_at_index(struct sockaddr *address, int index) {
-    int offset;
+struct iptrie_pool_block {
+    struct iptrie_pool_block *next;
+    uint32_t size;
+    uint32_t used;
+    iptrie_node_t nodes[];
+};
 
-    if ( address == NULL || index < 0 ) {
-        return -1;
+/*
+ * All the node blocks used by a trie.
+ */
+struct iptrie_pool {
+    struct iptrie_pool_block *blocks;
+    uint64_t allocated;
+    uint64_t replaced;          /* nodes no longer reachable from the roots */
+};
+
+
+
+/*
+ * Get a new node from the pool belonging to the trie, creating the pool or
+ * adding a new block to it if needed.
+ */
+static iptrie_node_t *iptrie_alloc_node(struct iptrie *root) {
+    struct iptrie_pool_block *block;
+    uint32_t size;
+
+    if ( root->pool == NULL ) {
+        root->pool = calloc(1, sizeof(struct iptrie_pool));
     }
 
-    if ( address->sa_family == AF_INET ) {
-        if ( index > 31 ) {
-            return -1;
+    block = root->pool->blocks;
+
+    if ( block == NULL || block->used == block->size ) {
+        size = block ? block->size * 2 : IPTRIE_POOL_MIN_NODES;
+        if ( size > IPTRIE_POOL_MAX_NODES ) {
+            size = IPTRIE_POOL_MAX_NODES;
         }
 
-        /* line up the one set bit with the index we want */
-        offset = ntohl(0x80000000 >> index);
-        return (((struct sockaddr_in*)address)->sin_addr.s_addr & offset)?1:0;
+        block = malloc(sizeof(struct iptrie_pool_block) +
+                (size * sizeof(iptrie_node_t)));
+        block->size = size;
+        block->used = 0;
+        block->next = root->pool->blocks;
+        root->pool->blocks = block;
+    }
 
-    } else if ( address->sa_family == AF_INET6 ) {
-        int field;
-        if ( index > 127 ) {
-            return -1;
-        }
+    root->pool->allocated++;
 
-        /* determine which 32bit block of the IPv6 address we need to check */
-        field = index / 32;
+    return &block->nodes[block->used++];
+}
 
-        /* line up the one set bit with the index we want within the block */
-        offset = ntohl(0x80000000 >> (index % 32));
-        return (((struct sockaddr_in6*)
-                address)->sin6_addr.s6_addr32[field] & offset)?1:0;
 
-    }
+
+/*
+ * Convert an address into the pair of host order words used as the key.
+ * IPv4 addresses occupy the top 32 bits of the first word. Returns the
+ * number of bits in the address, or -1 if the family isn't supported.
+ */
+static int get_address_key(struct sockaddr *address, uint64_t *key) {
+    uint64_t words[2];
+
+    switch ( address->sa_family ) {
+        case AF_INET:
+            key[0] = ((uint64_t)ntohl(
+                    ((struct sockaddr_in*)address)->sin_addr.s_addr)) << 32;
+            key[1] = 0;
+            return 32;
+
+        case AF_INET6:
+            memcpy(words, &((struct sockaddr_in6*)address)->sin6_addr,
+                    sizeof(words));
+            key[0] = be64toh(words[0]);
+            key[1] = be64toh(words[1]);
+            return 128;
+    };
 
     return -1;
 }
@@ -89,59 +151,97 @@ static int get_bit_at_index(struct sockaddr *address, int index) {
 
 
 /*
- * Count the number of initial bits that match in a pair of addresses. Accepts
- * either IPv4 or IPv6 addresses, in network byte order.
+ * Check if the first bits of two keys are the same.
  */
-static int get_matching_prefix_length(struct sockaddr *a, struct sockaddr *b) {
-    int count = 0;
+static inline int keys_match(const uint64_t *a, const uint64_t *b, int bits) {
+    if ( bits <= 0 ) {
+        return 1;
+    }
 
-    if ( a == NULL || b == NULL ) {
-        return -1;
+    if ( bits < 64 ) {
+        return ((a[0] ^ b[0]) >> (64 - bits)) == 0;
+    }
+
+    if ( a[0] != b[0] ) {
+        return 0;
+    }
+
+    if ( bits == 64 ) {
+        return 1;
     }
 
-    if ( a->sa_family != b->sa_family ) {
+    return ((a[1] ^ b[1]) >> (128 - bits)) == 0;
+}
+
+
+
+/*
+ * Count the number of initial bits that match in a pair of keys.
+ */
+static inline int get_matching_prefix_length(const uint64_t *a,
+        const uint64_t *b, int maxlen) {
+    uint64_t diff;
+    int count;
+
+    if ( (diff = a[0] ^ b[0]) != 0 ) {
+        count = __builtin_clzll(diff);
+    } else if ( (diff = a[1] ^ b[1]) != 0 ) {
+        count = 64 + __builtin_clzll(diff);
+    } else {
+        count = 128;
+    }
+
+    return (count < maxlen) ? count : maxlen;
+}
+
+
+
+/*
+ * Get the bit in the key at the given zero-based index, or -1 if the index
+ * is beyond the end of the address.
+ */
+static inline int get_bit_at_index(const uint64_t *key, int index,
+        int maxlen) {
+    if ( index < 0 || index >= maxlen ) {
         return -1;
     }
 
-    if ( a->sa_family == AF_INET ) {
-        struct sockaddr_in *a4 = (struct sockaddr_in*)a;
-        struct sockaddr_in *b4 = (struct sockaddr_in*)b;
-        int mask = 0x80000000;
-        int maxlen = 32;
-
-        /* count bits that are the same, from the left, stop when different */
-        while ( count < maxlen &&
-                (a4->sin_addr.s_addr & ntohl(mask)) ==
-                (b4->sin_addr.s_addr & ntohl(mask)) ) {
-            count++;
-            mask = (mask >> 1) | 0x80000000;
-        }
+    if ( index < 64 ) {
+        return (key[0] >> (63 - index)) & 1;
+    }
 
-    } else if ( a->sa_family == AF_INET6 ) {
-        struct sockaddr_in6 *a6 = (struct sockaddr_in6*)a;
-        struct sockaddr_in6 *b6 = (struct sockaddr_in6*)b;
-        int mask = 0x80000000;
-        int maxlen = 128;
-        int i;
-
-        for ( i = 0; i < 4; i++ ) {
-            if ( a6->sin6_addr.s6_addr32[i] == b6->sin6_addr.s6_addr32[i] ) {
-                /* skip a whole block if it's the same, don't need to count */
-                count += 32;
-            } else {
-                /* count bits that are the same, from the left */
-                while ( count < maxlen &&
-                        (a6->sin6_addr.s6_addr32[i] & ntohl(mask)) ==
-                        (b6->sin6_addr.s6_addr32[i] & ntohl(mask)) ) {
-                    count++;
-                    mask = (mask >> 1) | 0x80000000;
-                }
-                break;
-            }
-        }
+    return (key[1] >> (127 - index)) & 1;
+}
+
+
+
+/*
+ * Create a node holding a copy of the address.
+ */
+static iptrie_node_t *iptrie_new_node(struct iptrie *root,
+        struct sockaddr *address, const uint64_t *key, uint8_t prefix,
+        int64_t as, time_t expires) {
+
+    iptrie_node_t *node = iptrie_alloc_node(root);
+
+    node->as = as;
+    node->prefix = prefix;
+    node->expires = expires;
+    node->key[0] = key[0];
+    node->key[1] = key[1];
+    node->left = NULL;
+    node->right = NULL;
+    node->next = NULL;
+
+    memset(&node->storage, 0, sizeof(node->storage));
+    if ( address->sa_family == AF_INET ) {
+        memcpy(&node->storage.in, address, sizeof(struct sockaddr_in));
+    } else {
+        memcpy(&node->storage.in6, address, sizeof(struct sockaddr_in6));
     }
+    node->address = (struct sockaddr *)&node->storage;
 
-    return count;
+    return node;
 }
 
 
@@ -149,231 +249,372 @@ static int get_matching_prefix_length(struct sockaddr *a, struct sockaddr *b) {
 /*
  * Add or update an address with ASN in the trie. If the address does not
  * exist then it will be added at the appropriate location, if it does exist
- * then it will be updated.
+ * then it will be updated. The expiry time is stored alongside the value for
+ * callers that use the trie as a cache.
  */
-static iptrie_node_t *iptrie_add_internal(iptrie_node_t *root,
-        struct sockaddr *address, uint8_t prefix, int64_t as) {
+void iptrie_add_expiring(struct iptrie *root, struct sockaddr *address,
+        uint8_t prefix, int64_t as, time_t expires) {
 
-    int cmp, len;
+    iptrie_node_t **link;
+    iptrie_node_t *node, *branch, *leaf;
+    uint64_t key[2];
+    int maxlen, len, cmp;
 
-    /* missing address, return the trie unchanged */
+    /* missing address, leave the trie unchanged */
     if ( address == NULL ) {
-        return root;
+        return;
     }
 
-    /* empty trie, add this address at the root */
-    if ( root == NULL ) {
-        iptrie_node_t *node = malloc(sizeof(iptrie_node_t));
-        node->as = as;
-        node->prefix = prefix;
-        if ( address->sa_family == AF_INET ) {
-            node->address = malloc(sizeof(struct sockaddr_in));
-            memcpy(node->address, address, sizeof(struct sockaddr_in));
-        } else {
-            node->address = malloc(sizeof(struct sockaddr_in6));
-            memcpy(node->address, address, sizeof(struct sockaddr_in6));
+    /* we keep separate tries for ipv4 and ipv6 */
+    switch ( address->sa_family ) {
+        case AF_INET: link = &root->ipv4; break;
+        case AF_INET6: link = &root->ipv6; break;
+        default: return;
+    };
+
+    maxlen = get_address_key(address, key);
+
+    while ( (node = *link) != NULL ) {
+        /* there is a prefix set and this address matches, update the ASN */
+        if ( prefix == node->prefix && keys_match(node->key, key, prefix) ) {
+            node->as = as;
+            node->expires = expires;
+            return;
         }
-        node->left = NULL;
-        node->right = NULL;
-        node->next = NULL;
-        return node;
-    }
 
-    /* there is a prefix set and this address matches, update the ASN */
-    if ( prefix == root->prefix &&
-            compare_addresses(root->address, address, prefix) == 0 ) {
-        root->as = as;
-        return root;
+        /*
+         * Prefix and address don't match, see how similar this node actually
+         * is. If it matches more than the node prefix, limit it... we have
+         * more nodes that we have to check below for a better match first.
+         */
+        len = get_matching_prefix_length(node->key, key, node->prefix);
+
+        /* get the first bit that didn't match */
+        cmp = get_bit_at_index(key, len, maxlen);
+
+        /*
+         * If the matching prefix length is shorter than the prefix length
+         * already at this node, then we need to insert a new branching node
+         * at this location. The address we are trying to add and the node
+         * currently here will become children of this new branching node.
+         */
+        if ( len < node->prefix ) {
+            branch = iptrie_new_node(root, address, key, len, 0, 0);
+            leaf = iptrie_new_node(root, address, key, prefix, as, expires);
+
+            if ( cmp == 0 ) {
+                /* the next bit is a zero, add it down the left branch */
+                branch->left = leaf;
+                branch->right = node;
+            } else {
+                /* the next bit is a one, add it down the right branch */
+                branch->right = leaf;
+                branch->left = node;
+            }
+
+            *link = branch;
+            return;
+        }
+
+        /*
+         * otherwise, we match the address here so far but it isn't the end,
+         * keep looking down the appropriate branch for where we should insert.
+         */
+        link = (cmp == 0) ? &node->left : &node->right;
     }
 
+    /* reached an empty branch, add the address here */
+    *link = iptrie_new_node(root, address, key, prefix, as, expires);
+}
+
+
+
+/*
+ * Create a copy of a node that can be changed without affecting the original.
+ */
+static iptrie_node_t *iptrie_clone_node(struct iptrie *root,
+        iptrie_node_t *node) {
+
+    iptrie_node_t *copy = iptrie_alloc_node(root);
+
+    memcpy(copy, node, sizeof(iptrie_node_t));
+    copy->address = (struct sockaddr *)&copy->storage;
+    copy->next = NULL;
+
+    return copy;
+}
+
+
+
+/*
+ * Add or update an address with ASN in the same way as iptrie_add_expiring(),
+ * but without changing any node that is already in the trie. Every node on
+ * the path from the root down to the change is copied and the new root is
+ * only published once the path is complete, so readers that don't hold a lock
+ * always see either the old or the new trie. The nodes that were replaced
+ * stay in the pool until the trie is copied or cleared. Writers still need to
+ * be serialised by the caller.
+ */
+void iptrie_add_copying(struct iptrie *root, struct sockaddr *address,
+        uint8_t prefix, int64_t as, time_t expires) {
+
+    iptrie_node_t **family, **link;
+    iptrie_node_t *node, *top, *copy, *branch, *leaf;
+    uint64_t key[2];
+    uint64_t replaced = 0;
+    int maxlen, len, cmp;
 
-    /*
-     * Prefix and address don't match, see how similar this node actually is.
-     * If it matches more than the node prefix, limit it... we have more
-     * nodes that we have to check below for a better match first.
-     */
-    if ( (len = get_matching_prefix_length(root->address, address)) >
-            root->prefix ) {
-        len = root->prefix;
+    if ( address == NULL ) {
+        return;
     }
 
-    /* get the first bit that didn't match */
-    cmp = get_bit_at_index(address, len);
-
-    /*
-     * If the matching prefix length is shorter than the prefix length already
-     * at this node, then we need to insert a new branching node at this
-     * location. The address we are trying to add and the node currently here
-     * will become children of this new branching node.
-     */
-    if ( len < root->prefix ) {
-        iptrie_node_t *node = malloc(sizeof(iptrie_node_t));
-        node->as = 0;
-        node->prefix = len;
-        if ( address->sa_family == AF_INET ) {
-            node->address = malloc(sizeof(struct sockaddr_in));
-            memcpy(node->address, address, sizeof(struct sockaddr_in));
-        } else {
-            node->address = malloc(sizeof(struct sockaddr_in6));
-            memcpy(node->address, address, sizeof(struct sockaddr_in6));
+    switch ( address->sa_family ) {
+        case AF_INET: family = &root->ipv4; break;
+        case AF_INET6: family = &root->ipv6; break;
+        default: return;
+    };
+
+    maxlen = get_address_key(address, key);
+
+    /* build the new path starting from a private copy of the root pointer */
+    top = *family;
+    link = &top;
+
+    while ( (node = *link) != NULL ) {
+        /* the prefix is already present, replace the node with the update */
+        if ( prefix == node->prefix && keys_match(node->key, key, prefix) ) {
+            copy = iptrie_clone_node(root, node);
+            copy->as = as;
+            copy->expires = expires;
+            *link = copy;
+            replaced++;
+            break;
         }
-        node->left = NULL;
-        node->right = NULL;
-        node->next = NULL;
-
-        if ( cmp == 0 ) {
-            /* the next bit is a zero, add it down the left branch */
-            node->left = iptrie_add_internal(node->left, address, prefix, as);
-            /* and put the existing node on the right branch */
-            node->right = root;
-        } else if ( cmp != 0 ) {
-            /* the next bit is a one, add it down the right branch */
-            node->right = iptrie_add_internal(node->right, address, prefix, as);
-            /* and put the existing node on the left branch */
-            node->left = root;
+
+        len = get_matching_prefix_length(node->key, key, node->prefix);
+        cmp = get_bit_at_index(key, len, maxlen);
+
+        /* new branching node, the existing node is shared as a child */
+        if ( len < node->prefix ) {
+            branch = iptrie_new_node(root, address, key, len, 0, 0);
+            leaf = iptrie_new_node(root, address, key, prefix, as, expires);
+
+            if ( cmp == 0 ) {
+                branch->left = leaf;
+                branch->right = node;
+            } else {
+                branch->right = leaf;
+                branch->left = node;
+            }
+
+            *link = branch;
+            break;
         }
 
-        return node;
+        /* copy this node so the branch below it can be changed */
+        copy = iptrie_clone_node(root, node);
+        *link = copy;
+        replaced++;
+        link = (cmp == 0) ? &copy->left : &copy->right;
     }
 
-    /*
-     * otherwise, we match the address here so far but it isn't the end,
-     * keep looking down the appropriate branch for where we should insert.
-     */
-    if ( cmp == 0 ) {
-        /* the next bit is a zero, go down the left branch */
-        root->left = iptrie_add_internal(root->left, address, prefix, as);
-    } else if ( cmp != 0 ) {
-        /* the next bit is a one, go down the right branch */
-        root->right = iptrie_add_internal(root->right, address, prefix, as);
+    /* reached an empty branch, add the address here */
+    if ( node == NULL ) {
+        *link = iptrie_new_node(root, address, key, prefix, as, expires);
     }
 
-    return root;
+    root->pool->replaced += replaced;
+
+    /* the new nodes must be visible before readers can reach them */
+    __atomic_store_n(family, top, __ATOMIC_RELEASE);
 }
 
 
 
 /*
- * We keep separate tries for ipv4 and ipv6, so figure out which one we should
- * use based on the address we've been given to add.
+ * Add an address with ASN that never expires.
  */
 void iptrie_add(struct iptrie *root, struct sockaddr *address,
         uint8_t prefix, int64_t as) {
-
-    switch ( address->sa_family ) {
-        case AF_INET:
-            root->ipv4 = iptrie_add_internal(root->ipv4, address, prefix, as);
-            break;
-        case AF_INET6:
-            root->ipv6 = iptrie_add_internal(root->ipv6, address, prefix, as);
-            break;
-    };
+    iptrie_add_expiring(root, address, prefix, as, 0);
 }
 
 
 
 /*
- *
+ * Find the leaf node that contains the given address. We keep separate
+ * tries for ipv4 and ipv6, so figure out which one we should use based on
+ * the address we've been given to look up.
  */
-static int64_t iptrie_lookup_as_internal(iptrie_node_t *root,
-        struct sockaddr *address) {
-    int next;
+iptrie_node_t *iptrie_lookup(struct iptrie *root, struct sockaddr *address) {
+    iptrie_node_t **family;
+    iptrie_node_t *node;
+    uint64_t key[2];
+    int maxlen, next;
 
-    /* empty trie or missing address, can't return a useful AS number */
-    if ( root == NULL || address == NULL ) {
-        return -1;
+    /* missing address, can't return a useful node */
+    if ( address == NULL ) {
+        return NULL;
     }
 
-    /* if the address doesn't match at this prefix, it isn't present */
-    if ( compare_addresses(root->address, address, root->prefix) != 0 ) {
-        return -1;
-    }
+    switch ( address->sa_family ) {
+        case AF_INET: family = &root->ipv4; break;
+        case AF_INET6: family = &root->ipv6; break;
+        default: return NULL;
+    };
 
-    /* if this is a leaf node, then it matches what we were looking for */
-    if ( root->left == NULL && root->right == NULL ) {
-        return root->as;
-    }
+    maxlen = get_address_key(address, key);
+
+    /* roots can be swapped by copying inserts while lookups are running */
+    node = __atomic_load_n(family, __ATOMIC_ACQUIRE);
+
+    while ( node != NULL ) {
+        /* if the address doesn't match at this prefix, it isn't present */
+        if ( !keys_match(node->key, key, node->prefix) ) {
+            return NULL;
+        }
+
+        /* if this is a leaf node, then it matches what we were looking for */
+        if ( node->left == NULL && node->right == NULL ) {
+            return node;
+        }
 
-    /* compare the next bit in the address to see which branch we should take */
-    next = get_bit_at_index(address, root->prefix);
+        /* compare the next bit in the address to see which branch to take */
+        next = get_bit_at_index(key, node->prefix, maxlen);
 
-    /* non-leaf node, continue down the trie and try the next branch */
-    if ( next == 0 && root->left ) {
-        return iptrie_lookup_as_internal(root->left, address);
-    } else if ( next == 1 && root->right ) {
-        return iptrie_lookup_as_internal(root->right, address);
+        if ( next == 0 ) {
+            node = node->left;
+        } else if ( next == 1 ) {
+            node = node->right;
+        } else {
+            return NULL;
+        }
     }
 
-    /* no branch where expected, the ASN isn't here */
-    return -1;
+    /* no branch where expected, the address isn't here */
+    return NULL;
 }
 
 
 
 /*
- * We keep separate tries for ipv4 and ipv6, so figure out which one we should
- * use based on the address we've been given to look up.
+ * Look up the AS number for an address, returning -1 if it isn't present.
  */
 int64_t iptrie_lookup_as(struct iptrie *root, struct sockaddr *address) {
+    iptrie_node_t *node = iptrie_lookup(root, address);
 
-    switch ( address->sa_family ) {
-        case AF_INET:
-            return iptrie_lookup_as_internal(root->ipv4, address);
-        case AF_INET6:
-            return iptrie_lookup_as_internal(root->ipv6, address);
-    };
+    if ( node == NULL ) {
+        return -1;
+    }
 
-    return -1;
+    return node->as;
 }
 
 
 
 /*
- * Post-order traversal, free each node after freeing all the children.
+ * All the nodes belong to the pool, so free it rather than walking the trie.
  */
-static void iptrie_clear_internal(iptrie_node_t *root) {
-    if ( root == NULL ) {
-        return;
+void iptrie_clear(struct iptrie *root) {
+    struct iptrie_pool_block *block;
+
+    if ( root->pool != NULL ) {
+        while ( (block = root->pool->blocks) != NULL ) {
+            root->pool->blocks = block->next;
+            free(block);
+        }
+        free(root->pool);
     }
 
-    iptrie_clear_internal(root->left);
-    iptrie_clear_internal(root->right);
+    root->ipv4 = NULL;
+    root->ipv6 = NULL;
+    root->pool = NULL;
+}
+
+
+
+/*
+ * Copy a node and everything below it into the pool belonging to another
+ * trie.
+ */
+static iptrie_node_t *iptrie_copy_internal(struct iptrie *root,
+        iptrie_node_t *node) {
+
+    iptrie_node_t *copy;
+
+    if ( node == NULL ) {
+        return NULL;
+    }
 
-    free(root->address);
-    free(root);
+    copy = iptrie_clone_node(root, node);
+    copy->left = iptrie_copy_internal(root, node->left);
+    copy->right = iptrie_copy_internal(root, node->right);
+
+    return copy;
 }
 
 
 
-void iptrie_clear(struct iptrie *root) {
-    iptrie_clear_internal(root->ipv4);
-    iptrie_clear_internal(root->ipv6);
+/*
+ * Make a copy of a trie that shares no nodes with the original. The copy has
+ * exactly the same shape, so no keys need to be compared while building it.
+ * Anything already in the destination trie is freed first.
+ */
+void iptrie_copy(struct iptrie *dst, struct iptrie *src) {
+    iptrie_clear(dst);
+    dst->ipv4 = iptrie_copy_internal(dst, src->ipv4);
+    dst->ipv6 = iptrie_copy_internal(dst, src->ipv6);
+}
 
-    root->ipv4 = NULL;
-    root->ipv6 = NULL;
+
+
+/*
+ * Get the number of nodes allocated by the trie, and how many of those have
+ * been replaced by copying inserts. Copying the trie frees the replaced nodes.
+ */
+void iptrie_get_node_counts(struct iptrie *root, uint64_t *allocated,
+        uint64_t *replaced) {
+
+    *allocated = root->pool ? root->pool->allocated : 0;
+    *replaced = root->pool ? root->pool->replaced : 0;
 }
 
 
 
 /*
- * Apply the user function to each of the leaves (only the leaves contain
- * values that were added, internal nodes have been created as a by-product).
+ * Apply the user function to each of the leaves in order, left branches
+ * first. The trie is never deeper than one node per bit, so a fixed size
+ * stack is enough to hold the right branches that still need visiting.
  */
 static int iptrie_on_all_leaves_internal(iptrie_node_t *root,
         int (*func)(iptrie_node_t *node, void *data), void *data) {
 
+    iptrie_node_t *stack[IPTRIE_MAX_DEPTH];
+    iptrie_node_t *node;
+    int depth = 0;
+
     if ( root == NULL ) {
         return 0;
     }
 
-    if ( root->left == NULL && root->right == NULL ) {
-        return func(root, data);
-    } else {
-        if ( iptrie_on_all_leaves_internal(root->left, func, data) < 0 ) {
-            return -1;
+    stack[depth++] = root;
+
+    while ( depth > 0 ) {
+        node = stack[--depth];
+
+        if ( node->left == NULL && node->right == NULL ) {
+            if ( func(node, data) < 0 ) {
+                return -1;
+            }
+            continue;
         }
-        if ( iptrie_on_all_leaves_internal(root->right, func, data) < 0 ) {
-            return -1;
+
+        if ( node->right ) {
+            stack[depth++] = node->right;
+        }
+
+        if ( node->left ) {
+            stack[depth++] = node->left;
         }
     }
 
@@ -41,33 +41,55 @@
 #define _COMMON_IPTRIE_H
 
 #include <stdint.h>
+#include <time.h>
 #include <netinet/in.h>
 
 
 #define iptrie_node_t struct iptrie_node
 #define iplist_t struct iptrie_node
 struct iptrie_node {
-    /* ASNs are only 32bit, but we can use the extra space as markers */
-    int64_t as;
-    uint8_t prefix;
-    struct sockaddr *address;
-
+    /* address as two host order words, so prefixes compare a word at a time */
+    uint64_t key[2];
     iptrie_node_t *left;
     iptrie_node_t *right;
+    uint8_t prefix;
+
+    /* ASNs are only 32bit, but we can use the extra space as markers */
+    int64_t as;
+    struct sockaddr *address;   /* points at storage within this node */
+    time_t expires;             /* time a cached value is stale, or zero */
     iptrie_node_t *next;
+
+    union {
+        struct sockaddr_in in;
+        struct sockaddr_in6 in6;
+    } storage;
 };
 
+/* nodes are allocated in blocks, and all freed together when cleared */
+struct iptrie_pool;
+
+/* initialise a trie with this, or zero it before use */
 struct iptrie {
     iptrie_node_t *ipv4;
     iptrie_node_t *ipv6;
+    struct iptrie_pool *pool;
 };
 
 
 
 void iptrie_add(struct iptrie *root, struct sockaddr *address,
         uint8_t prefix, int64_t as);
+void iptrie_add_expiring(struct iptrie *root, struct sockaddr *address,
+        uint8_t prefix, int64_t as, time_t expires);
+void iptrie_add_copying(struct iptrie *root, struct sockaddr *address,
+        uint8_t prefix, int64_t as, time_t expires);
 int64_t iptrie_lookup_as(struct iptrie *root, struct sockaddr *address);
+iptrie_node_t *iptrie_lookup(struct iptrie *root, struct sockaddr *address);
 void iptrie_clear(struct iptrie *root);
+void iptrie_copy(struct iptrie *dst, struct iptrie *src);
+void iptrie_get_node_counts(struct iptrie *root, uint64_t *allocated,
+        uint64_t *replaced);
 int iptrie_on_all_leaves(struct iptrie *root,
         int (*func)(iptrie_node_t*, void*), void *data);
 iplist_t *iptrie_to_list(struct iptrie *root);
@@ -0,0 +1,68 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include "hash.h"
+
+/*
+ * Check the FNV-1a hashes against the published test vectors, and that a
+ * hash can be built up a piece at a time.
+ */
+int main(void) {
+    uint32_t hash32;
+    uint64_t hash64;
+
+    assert(fnv1a_32(FNV1A_32_INIT, "", 0) == 0x811c9dc5U);
+    assert(fnv1a_32(FNV1A_32_INIT, "a", 1) == 0xe40c292cU);
+    assert(fnv1a_32(FNV1A_32_INIT, "foobar", 6) == 0xbf9cf968U);
+
+    assert(fnv1a_64(FNV1A_64_INIT, "", 0) == 0xcbf29ce484222325ULL);
+    assert(fnv1a_64(FNV1A_64_INIT, "a", 1) == 0xaf63dc4c8601ec8cULL);
+    assert(fnv1a_64(FNV1A_64_INIT, "foobar", 6) == 0x85944171f73967e8ULL);
+
+    hash32 = fnv1a_32(FNV1A_32_INIT, "foo", 3);
+    assert(fnv1a_32(hash32, "bar", 3) == 0xbf9cf968U);
+
+    hash64 = fnv1a_64(FNV1A_64_INIT, "foo", 3);
+    assert(fnv1a_64(hash64, "bar", 3) == 0x85944171f73967e8ULL);
+
+    return 0;
+}
@@ -0,0 +1,471 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compare the cost of building and searching a large ASN cache using the
+ * path compressed trie against the original bit at a time binary trie that
+ * allocated every node and address separately. Both tries are given the
+ * same prefixes and must give the same answers. This isn't run as part of
+ * the test suite, run it by hand:
+ *
+ *   ./iptrie_bench [prefix count] [lookup count]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include "iptrie.h"
+#include "testlib.h"
+
+#define DEFAULT_PREFIX_COUNT 250000
+#define DEFAULT_LOOKUP_COUNT 1000000
+
+/*
+ * Node used by the original trie.
+ */
+struct ref_node {
+    int64_t as;
+    uint8_t prefix;
+    struct sockaddr *address;
+    time_t expires;
+    struct ref_node *left;
+    struct ref_node *right;
+};
+
+
+
+/*
+ * Get the bit in the address at the given zero-based index, as the original
+ * trie did.
+ */
+static int ref_get_bit_at_index(struct sockaddr *address, int index) {
+    int offset;
+
+    if ( address->sa_family == AF_INET ) {
+        if ( index > 31 ) {
+            return -1;
+        }
+        offset = ntohl(0x80000000 >> index);
+        return (((struct sockaddr_in*)address)->sin_addr.s_addr & offset)?1:0;
+    }
+
+    if ( index > 127 ) {
+        return -1;
+    }
+    offset = ntohl(0x80000000 >> (index % 32));
+    return (((struct sockaddr_in6*)
+                address)->sin6_addr.s6_addr32[index / 32] & offset)?1:0;
+}
+
+
+
+/*
+ * Count the initial bits that match in a pair of addresses, a bit at a time.
+ */
+static int ref_get_matching_prefix_length(struct sockaddr *a,
+        struct sockaddr *b) {
+    int count = 0;
+    int mask = 0x80000000;
+    int i;
+
+    if ( a->sa_family == AF_INET ) {
+        struct sockaddr_in *a4 = (struct sockaddr_in*)a;
+        struct sockaddr_in *b4 = (struct sockaddr_in*)b;
+
+        while ( count < 32 && (a4->sin_addr.s_addr & ntohl(mask)) ==
+                (b4->sin_addr.s_addr & ntohl(mask)) ) {
+            count++;
+            mask = (mask >> 1) | 0x80000000;
+        }
+        return count;
+    }
+
+    for ( i = 0; i < 4; i++ ) {
+        struct sockaddr_in6 *a6 = (struct sockaddr_in6*)a;
+        struct sockaddr_in6 *b6 = (struct sockaddr_in6*)b;
+
+        if ( a6->sin6_addr.s6_addr32[i] == b6->sin6_addr.s6_addr32[i] ) {
+            count += 32;
+        } else {
+            while ( count < 128 && (a6->sin6_addr.s6_addr32[i] & ntohl(mask))
+                    == (b6->sin6_addr.s6_addr32[i] & ntohl(mask)) ) {
+                count++;
+                mask = (mask >> 1) | 0x80000000;
+            }
+            break;
+        }
+    }
+
+    return count;
+}
+
+
+
+/*
+ * Allocate a node and a copy of the address, as the original trie did.
+ */
+static struct ref_node *ref_new_node(struct sockaddr *address, uint8_t prefix,
+        int64_t as) {
+    struct ref_node *node = malloc(sizeof(struct ref_node));
+    size_t len = (address->sa_family == AF_INET) ?
+        sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+
+    node->as = as;
+    node->prefix = prefix;
+    node->expires = 0;
+    node->address = malloc(len);
+    memcpy(node->address, address, len);
+    node->left = NULL;
+    node->right = NULL;
+
+    return node;
+}
+
+
+
+/*
+ * Recursively add a prefix to the original trie.
+ */
+static struct ref_node *ref_add(struct ref_node *root,
+        struct sockaddr *address, uint8_t prefix, int64_t as) {
+    struct ref_node *node;
+    int cmp, len;
+
+    if ( root == NULL ) {
+        return ref_new_node(address, prefix, as);
+    }
+
+    if ( prefix == root->prefix &&
+            compare_addresses(root->address, address, prefix) == 0 ) {
+        root->as = as;
+        return root;
+    }
+
+    if ( (len = ref_get_matching_prefix_length(root->address, address)) >
+            root->prefix ) {
+        len = root->prefix;
+    }
+
+    cmp = ref_get_bit_at_index(address, len);
+
+    if ( len < root->prefix ) {
+        node = ref_new_node(address, len, 0);
+        if ( cmp == 0 ) {
+            node->left = ref_add(NULL, address, prefix, as);
+            node->right = root;
+        } else {
+            node->right = ref_add(NULL, address, prefix, as);
+            node->left = root;
+        }
+        return node;
+    }
+
+    if ( cmp == 0 ) {
+        root->left = ref_add(root->left, address, prefix, as);
+    } else {
+        root->right = ref_add(root->right, address, prefix, as);
+    }
+
+    return root;
+}
+
+
+
+/*
+ * Recursively look up an address in the original trie.
+ */
+static int64_t ref_lookup(struct ref_node *root, struct sockaddr *address) {
+    int next;
+
+    if ( root == NULL ||
+            compare_addresses(root->address, address, root->prefix) != 0 ) {
+        return -1;
+    }
+
+    if ( root->left == NULL && root->right == NULL ) {
+        return root->as;
+    }
+
+    next = ref_get_bit_at_index(address, root->prefix);
+
+    if ( next == 0 && root->left ) {
+        return ref_lookup(root->left, address);
+    } else if ( next == 1 && root->right ) {
+        return ref_lookup(root->right, address);
+    }
+
+    return -1;
+}
+
+
+
+/*
+ * Recursively apply a function to the leaves in the original trie.
+ */
+static int ref_on_all_leaves(struct ref_node *root,
+        int (*func)(struct ref_node*, void*), void *data) {
+    if ( root == NULL ) {
+        return 0;
+    }
+
+    if ( root->left == NULL && root->right == NULL ) {
+        return func(root, data);
+    }
+
+    if ( ref_on_all_leaves(root->left, func, data) < 0 ) {
+        return -1;
+    }
+
+    return ref_on_all_leaves(root->right, func, data);
+}
+
+
+
+/*
+ * Count a leaf in the original trie.
+ */
+static int ref_count_leaf(struct ref_node *node, void *data) {
+    (void)node;
+    (*(uint64_t*)data)++;
+    return 0;
+}
+
+
+
+/*
+ * Recursively free the original trie.
+ */
+static void ref_clear(struct ref_node *root) {
+    if ( root == NULL ) {
+        return;
+    }
+
+    ref_clear(root->left);
+    ref_clear(root->right);
+    free(root->address);
+    free(root);
+}
+
+
+
+/*
+ * Count a leaf in the new trie.
+ */
+static int count_leaf(iptrie_node_t *node, void *data) {
+    (void)node;
+    (*(uint64_t*)data)++;
+    return 0;
+}
+
+
+
+/*
+ * Number of nanoseconds between two timespecs.
+ */
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return ((end->tv_sec - start->tv_sec) * 1000000000.0) +
+        (end->tv_nsec - start->tv_nsec);
+}
+
+
+
+/*
+ * Fill in a random address, either IPv4 or IPv6.
+ */
+static void random_address(struct sockaddr_storage *addr, int ipv6) {
+    int i;
+
+    memset(addr, 0, sizeof(*addr));
+
+    if ( ipv6 ) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6*)addr;
+        in6->sin6_family = AF_INET6;
+        /* mostly global unicast, like real traceroute paths */
+        in6->sin6_addr.s6_addr[0] = 0x20 | (rand() & 0x03);
+        for ( i = 1; i < 16; i++ ) {
+            in6->sin6_addr.s6_addr[i] = rand() & 0xff;
+        }
+    } else {
+        struct sockaddr_in *in = (struct sockaddr_in*)addr;
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = ((uint32_t)rand() << 1) ^ rand();
+    }
+}
+
+
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_storage *prefixes, *lookups;
+    struct iptrie trie = { NULL, NULL, NULL };
+    struct ref_node *ref4 = NULL, *ref6 = NULL;
+    struct timespec start, end;
+    double ref_ns, new_ns;
+    uint64_t ref_leaves = 0, new_leaves = 0;
+    int64_t checksum_ref = 0, checksum_new = 0;
+    int prefix_count = DEFAULT_PREFIX_COUNT;
+    int lookup_count = DEFAULT_LOOKUP_COUNT;
+    int i;
+
+    if ( argc > 1 ) {
+        prefix_count = atoi(argv[1]);
+    }
+
+    if ( argc > 2 ) {
+        lookup_count = atoi(argv[2]);
+    }
+
+    if ( prefix_count <= 0 || lookup_count <= 0 ) {
+        fprintf(stderr, "Usage: %s [prefix count] [lookup count]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    srand(1);
+
+    /* a quarter of the prefixes are IPv6, as the cache forces /24 and /64 */
+    prefixes = calloc(prefix_count, sizeof(struct sockaddr_storage));
+    for ( i = 0; i < prefix_count; i++ ) {
+        random_address(&prefixes[i], (i % 4) == 0);
+    }
+
+    /* half the lookups are for cached prefixes, half are misses */
+    lookups = calloc(lookup_count, sizeof(struct sockaddr_storage));
+    for ( i = 0; i < lookup_count; i++ ) {
+        if ( i % 2 ) {
+            memcpy(&lookups[i], &prefixes[rand() % prefix_count],
+                    sizeof(struct sockaddr_storage));
+        } else {
+            random_address(&lookups[i], (i % 8) == 0);
+        }
+    }
+
+    printf("%d prefixes, %d lookups\n", prefix_count, lookup_count);
+    printf("%-10s %14s %14s %8s\n", "operation", "original ns", "new ns",
+            "speedup");
+
+    /* add all the prefixes */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < prefix_count; i++ ) {
+        struct sockaddr *addr = (struct sockaddr*)&prefixes[i];
+        if ( addr->sa_family == AF_INET ) {
+            ref4 = ref_add(ref4, addr, 24, i);
+        } else {
+            ref6 = ref_add(ref6, addr, 64, i);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ref_ns = elapsed_ns(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < prefix_count; i++ ) {
+        struct sockaddr *addr = (struct sockaddr*)&prefixes[i];
+        iptrie_add(&trie, addr, (addr->sa_family == AF_INET) ? 24 : 64, i);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    new_ns = elapsed_ns(&start, &end);
+
+    printf("%-10s %14.1f %14.1f %7.2fx\n", "add", ref_ns / prefix_count,
+            new_ns / prefix_count, ref_ns / new_ns);
+
+    /* look up a mix of cached and uncached addresses */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < lookup_count; i++ ) {
+        struct sockaddr *addr = (struct sockaddr*)&lookups[i];
+        checksum_ref += ref_lookup((addr->sa_family == AF_INET) ? ref4 : ref6,
+                addr);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ref_ns = elapsed_ns(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < lookup_count; i++ ) {
+        checksum_new += iptrie_lookup_as(&trie,
+                (struct sockaddr*)&lookups[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    new_ns = elapsed_ns(&start, &end);
+
+    printf("%-10s %14.1f %14.1f %7.2fx\n", "lookup", ref_ns / lookup_count,
+            new_ns / lookup_count, ref_ns / new_ns);
+
+    /* walk all the leaves */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ref_on_all_leaves(ref4, ref_count_leaf, &ref_leaves);
+    ref_on_all_leaves(ref6, ref_count_leaf, &ref_leaves);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ref_ns = elapsed_ns(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    iptrie_on_all_leaves(&trie, count_leaf, &new_leaves);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    new_ns = elapsed_ns(&start, &end);
+
+    printf("%-10s %14.1f %14.1f %7.2fx\n", "walk", ref_ns / prefix_count,
+            new_ns / prefix_count, ref_ns / new_ns);
+
+    /*
+     * Free everything, new trie first so that it isn't charged for the
+     * allocator tidying up after all the small frees from the original.
+     */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    iptrie_clear(&trie);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    new_ns = elapsed_ns(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ref_clear(ref4);
+    ref_clear(ref6);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ref_ns = elapsed_ns(&start, &end);
+
+    printf("%-10s %14.1f %14.1f %7.2fx\n", "clear", ref_ns / prefix_count,
+            new_ns / prefix_count, ref_ns / new_ns);
+
+    /* both tries should have held the same data */
+    assert(ref_leaves == new_leaves);
+    assert(checksum_ref == checksum_new);
+
+    free(prefixes);
+    free(lookups);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,270 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include "iptrie.h"
+
+#define PREFIX_COUNT 5000
+
+
+
+/*
+ * Build an IPv4 address from a host order integer.
+ */
+static struct sockaddr *make_ipv4(struct sockaddr_in *addr, uint32_t value) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(value);
+    return (struct sockaddr*)addr;
+}
+
+
+
+/*
+ * Build an IPv6 address from a pair of host order integers.
+ */
+static struct sockaddr *make_ipv6(struct sockaddr_in6 *addr, uint64_t high,
+        uint64_t low) {
+    int i;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin6_family = AF_INET6;
+    for ( i = 0; i < 8; i++ ) {
+        addr->sin6_addr.s6_addr[i] = (high >> (56 - (i * 8))) & 0xff;
+        addr->sin6_addr.s6_addr[i + 8] = (low >> (56 - (i * 8))) & 0xff;
+    }
+
+    return (struct sockaddr*)addr;
+}
+
+
+
+/*
+ * Check that leaves are visited in address order, and count them.
+ */
+struct walk_data {
+    int count;
+    int family;
+    uint8_t last[16];
+};
+
+static int check_leaf(iptrie_node_t *node, void *data) {
+    struct walk_data *walk = (struct walk_data *)data;
+    uint8_t *bytes;
+    int len;
+
+    if ( node->address->sa_family == AF_INET ) {
+        bytes = (uint8_t*)&((struct sockaddr_in*)node->address)->sin_addr;
+        len = 4;
+    } else {
+        bytes = (uint8_t*)&((struct sockaddr_in6*)node->address)->sin6_addr;
+        len = 16;
+    }
+
+    /* ipv4 leaves all come before ipv6 leaves */
+    if ( walk->count > 0 && walk->family == node->address->sa_family ) {
+        assert(memcmp(walk->last, bytes, len) < 0);
+    }
+    assert(walk->family != AF_INET6 || node->address->sa_family == AF_INET6);
+
+    walk->family = node->address->sa_family;
+    memcpy(walk->last, bytes, len);
+    walk->count++;
+
+    return 0;
+}
+
+
+
+/*
+ * Stop walking the trie after the first leaf.
+ */
+static int stop_walk(iptrie_node_t *node, void *data) {
+    (void)node;
+    (*(int*)data)++;
+    return -1;
+}
+
+
+
+/*
+ * Check that prefixes can be added, updated and found in the trie.
+ */
+int main(void) {
+    struct iptrie trie = { NULL, NULL, NULL };
+    struct iptrie copy = { NULL, NULL, NULL };
+    struct iptrie old;
+    struct sockaddr_in addr4;
+    struct sockaddr_in6 addr6;
+    struct walk_data walk;
+    uint32_t *prefixes4;
+    uint64_t *prefixes6;
+    uint64_t allocated, replaced, live, garbage;
+    iplist_t *list;
+    int count;
+    int i;
+
+    /* empty trie finds nothing */
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, 0x0a000001)) == -1);
+    assert(iptrie_lookup(&trie, make_ipv6(&addr6, 1, 1)) == NULL);
+    assert(iptrie_to_list(&trie) == NULL);
+
+    /* a single prefix matches any address within it */
+    iptrie_add(&trie, make_ipv4(&addr4, 0x0a000000), 24, 64512);
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, 0x0a000001)) == 64512);
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, 0x0a0000ff)) == 64512);
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, 0x0a000100)) == -1);
+
+    /* adding the same prefix again updates it */
+    iptrie_add_expiring(&trie, make_ipv4(&addr4, 0x0a000080), 24, 64513, 100);
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, 0x0a000001)) == 64513);
+    assert(iptrie_lookup(&trie, (struct sockaddr*)&addr4)->expires == 100);
+
+    /* neighbouring prefixes split the trie, and both are found */
+    iptrie_add(&trie, make_ipv4(&addr4, 0x0a000100), 24, 64514);
+    iptrie_add(&trie, make_ipv4(&addr4, 0xc0a80000), 24, 64515);
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, 0x0a000001)) == 64513);
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, 0x0a000101)) == 64514);
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, 0xc0a80001)) == 64515);
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, 0x0a000201)) == -1);
+
+    /* host routes use every bit of the address */
+    iptrie_add(&trie, make_ipv4(&addr4, 0xffffffff), 32, 64516);
+    iptrie_add(&trie, make_ipv6(&addr6, ~0ULL, ~0ULL), 128, 64517);
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, 0xffffffff)) == 64516);
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, 0xfffffffe)) == -1);
+    assert(iptrie_lookup_as(&trie, make_ipv6(&addr6, ~0ULL, ~0ULL)) == 64517);
+    assert(iptrie_lookup_as(&trie, make_ipv6(&addr6, ~0ULL, ~1ULL)) == -1);
+
+    iptrie_clear(&trie);
+    assert(trie.ipv4 == NULL && trie.ipv6 == NULL && trie.pool == NULL);
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, 0x0a000001)) == -1);
+
+    /* lots of random /24 and /64 prefixes, like the ASN cache */
+    srand(1);
+    prefixes4 = malloc(PREFIX_COUNT * sizeof(uint32_t));
+    prefixes6 = malloc(PREFIX_COUNT * sizeof(uint64_t));
+
+    for ( i = 0; i < PREFIX_COUNT; i++ ) {
+        /* use the index as part of the prefix so they are all unique */
+        prefixes4[i] = ((uint32_t)(rand() & 0xff) << 24) | (i << 8);
+        prefixes6[i] = ((uint64_t)rand() << 32) | i;
+        iptrie_add(&trie, make_ipv4(&addr4, prefixes4[i]), 24, i);
+        iptrie_add(&trie, make_ipv6(&addr6, prefixes6[i], 0), 64, i);
+    }
+
+    for ( i = 0; i < PREFIX_COUNT; i++ ) {
+        assert(iptrie_lookup_as(&trie,
+                    make_ipv4(&addr4, prefixes4[i] | (rand() & 0xff))) == i);
+        assert(iptrie_lookup_as(&trie,
+                    make_ipv6(&addr6, prefixes6[i], rand())) == i);
+        /* a different top byte is a different prefix */
+        assert(iptrie_lookup_as(&trie, make_ipv6(&addr6,
+                        prefixes6[i] ^ (1ULL << 63), 0)) != i);
+    }
+
+    /* every prefix is a leaf, visited in order */
+    memset(&walk, 0, sizeof(walk));
+    assert(iptrie_on_all_leaves(&trie, check_leaf, &walk) == 0);
+    assert(walk.count == PREFIX_COUNT * 2);
+
+    /* the walk stops early if asked to */
+    count = 0;
+    assert(iptrie_on_all_leaves(&trie, stop_walk, &count) < 0);
+    assert(count == 1);
+
+    /* the list holds every leaf */
+    for ( count = 0, list = iptrie_to_list(&trie); list != NULL;
+            list = list->next ) {
+        count++;
+    }
+    assert(count == PREFIX_COUNT * 2);
+
+    /* a copy finds the same prefixes, and is independent of the original */
+    iptrie_copy(&copy, &trie);
+    iptrie_clear(&trie);
+    for ( i = 0; i < PREFIX_COUNT; i++ ) {
+        assert(iptrie_lookup_as(&copy,
+                    make_ipv4(&addr4, prefixes4[i] | (rand() & 0xff))) == i);
+        assert(iptrie_lookup_as(&copy,
+                    make_ipv6(&addr6, prefixes6[i], rand())) == i);
+    }
+
+    memset(&walk, 0, sizeof(walk));
+    assert(iptrie_on_all_leaves(&copy, check_leaf, &walk) == 0);
+    assert(walk.count == PREFIX_COUNT * 2);
+
+    /* copying inserts leave the old roots seeing the old trie */
+    old = copy;
+    iptrie_add_copying(&copy, make_ipv4(&addr4, prefixes4[0]), 24, 64520, 0);
+    iptrie_add_copying(&copy, make_ipv6(&addr6, ~0ULL, 0), 64, 64521, 0);
+    assert(iptrie_lookup_as(&old, make_ipv4(&addr4, prefixes4[0])) == 0);
+    assert(iptrie_lookup_as(&old, make_ipv6(&addr6, ~0ULL, 1)) == -1);
+    assert(iptrie_lookup_as(&copy, make_ipv4(&addr4, prefixes4[0])) == 64520);
+    assert(iptrie_lookup_as(&copy, make_ipv6(&addr6, ~0ULL, 1)) == 64521);
+    assert(iptrie_lookup_as(&copy, make_ipv4(&addr4, prefixes4[1])) == 1);
+    assert(old.ipv4 != copy.ipv4 && old.ipv6 != copy.ipv6);
+
+    /* only the path to the updated leaf was replaced */
+    iptrie_get_node_counts(&copy, &live, &garbage);
+    assert(garbage > 0 && garbage <= 32);
+
+    /* copying the trie keeps only the nodes that are still reachable */
+    iptrie_copy(&trie, &copy);
+    iptrie_get_node_counts(&trie, &allocated, &replaced);
+    assert(allocated == live - garbage);
+    assert(replaced == 0);
+    assert(iptrie_lookup_as(&trie, make_ipv4(&addr4, prefixes4[0])) == 64520);
+    assert(iptrie_lookup_as(&trie, make_ipv6(&addr6, ~0ULL, 1)) == 64521);
+
+    memset(&walk, 0, sizeof(walk));
+    assert(iptrie_on_all_leaves(&trie, check_leaf, &walk) == 0);
+    assert(walk.count == (PREFIX_COUNT * 2) + 1);
+
+    iptrie_clear(&trie);
+    iptrie_clear(&copy);
+    free(prefixes4);
+    free(prefixes6);
+
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+
+#include "testlib.h"
+
+#define TEST_PACKETS 10000
+#define MAX_PACKET_LEN 512
+
+
+/*
+ * Check that batches of packets are sent and received correctly, and that
+ * the batch size used to send them still respects the minimum inter-packet
+ * delay on average.
+ */
+int main(void) {
+    struct addrinfo dest;
+    int sockets[2];
+    char out_packet[MAX_PACKET_BATCH][MAX_PACKET_LEN];
+    char in_packet[MAX_PACKET_BATCH][MAX_PACKET_LEN];
+    struct batch_packet_t outgoing[MAX_PACKET_BATCH];
+    struct batch_packet_t incoming[MAX_PACKET_BATCH];
+    struct pacer_t pacer;
+    int delay, length, count, sent, received, maxwait, i, j;
+    struct timeval start, end;
+    int64_t duration;
+
+    /*
+     * use a pair of unix sockets to test sending data without relying on
+     * the network being present/sane/etc.
+     */
+    if ( socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) < 0 ) {
+        fprintf(stderr, "Failed to create socket pair: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* we don't need a real address for testing, our socket pair is connected */
+    dest.ai_addr = NULL;
+    dest.ai_addrlen = 0;
+
+    /* nothing has been sent yet, so receiving should time out */
+    incoming[0].buf = in_packet[0];
+    incoming[0].size = MAX_PACKET_LEN;
+    maxwait = 1;
+    assert(get_packet_batch(sockets[1], incoming, 1, &maxwait) == 0);
+
+    /* allow the whole batch to be sent if the sender falls behind */
+    pacer_init(&pacer, MIN_INTER_PACKET_DELAY, MAX_PACKET_BATCH);
+
+    gettimeofday(&start, NULL);
+
+    for ( sent = 0; sent < TEST_PACKETS; sent += count ) {
+        /* wait until at least one packet is allowed to be sent */
+        while ( (count = pacer_get_batch(&pacer, MAX_PACKET_BATCH,
+                        &delay)) == 0 ) {
+            assert(delay > 0);
+            usleep(delay);
+        }
+
+        assert(count <= MAX_PACKET_BATCH);
+        if ( count > TEST_PACKETS - sent ) {
+            count = TEST_PACKETS - sent;
+        }
+
+        /* fill the packets with some data we can check later */
+        for ( i = 0; i < count; i++ ) {
+            length = (sent + i) % MAX_PACKET_LEN;
+            out_packet[i][length++] = (sent + i) % 255;
+            outgoing[i].buf = out_packet[i];
+            outgoing[i].length = length;
+            outgoing[i].dest = &dest;
+            memset(&outgoing[i].time, 0, sizeof(struct timespec));
+        }
+
+        if ( send_packet_batch(sockets[0], outgoing, count) != count ) {
+            fprintf(stderr, "Failed to send packets: %s\n", strerror(errno));
+            return -1;
+        }
+        pacer_sent(&pacer, count);
+
+        /* read back the whole batch, possibly across multiple calls */
+        for ( i = 0; i < count; i += received ) {
+            for ( j = 0; j < count - i; j++ ) {
+                incoming[j].buf = in_packet[j];
+                incoming[j].size = MAX_PACKET_LEN;
+                incoming[j].length = 0;
+            }
+
+            maxwait = 1000000;
+            received = get_packet_batch(sockets[1], incoming, count - i,
+                    &maxwait);
+            assert(received > 0);
+
+            /* confirm that they match what we sent, in the same order */
+            for ( j = 0; j < received; j++ ) {
+                assert(outgoing[i + j].time.tv_sec != 0);
+                assert(incoming[j].time.tv_sec != 0);
+                assert(incoming[j].length == outgoing[i + j].length);
+                assert(memcmp(outgoing[i + j].buf, incoming[j].buf,
+                            incoming[j].length) == 0);
+            }
+        }
+    }
+
+    gettimeofday(&end, NULL);
+
+    /*
+     * check that we took longer than the minimum possible time, allowing
+     * for the very first packet being sent without any delay
+     */
+    duration = DIFF_TV_US(end, start);
+    assert(duration > ((TEST_PACKETS - 1) * MIN_INTER_PACKET_DELAY));
+    assert(pacer.packets == TEST_PACKETS);
+
+    close(sockets[0]);
+    close(sockets[1]);
+
+    return 0;
+}
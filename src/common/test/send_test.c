@@ -50,6 +50,10 @@
 
 #define TEST_PACKETS 10000
 #define MAX_PACKET_LEN 512
+#define TEST_BURST 4
+
+/* gap used when checking that processing time doesn't add to the spacing */
+#define PROCESSING_INTERVAL 2000
 
 
 /*
@@ -62,27 +66,15 @@
  * loaded then this check becomes less useful, but I think it's still
  * worthwhile.
  */
-int main(void) {
-    struct addrinfo dest;
-    int sockets[2];
+static void check_spacing(int sockets[2]) {
     char out_packet[MAX_PACKET_LEN];
     char in_packet[MAX_PACKET_LEN];
-    int delay, length, i;
+    struct pacer_t pacer;
+    int length, i;
     struct timeval start, end;
     int64_t duration;
 
-    /*
-     * use a pair of unix sockets to test sending data without relying on
-     * the network being present/sane/etc.
-     */
-    if ( socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) < 0 ) {
-        fprintf(stderr, "Failed to create socket pair: %s\n", strerror(errno));
-        return -1;
-    }
-
-    /* we don't need a real address for testing, our socket pair is connected */
-    dest.ai_addr = NULL;
-    dest.ai_addrlen = 0;
+    pacer_init(&pacer, MIN_INTER_PACKET_DELAY, 1);
 
     gettimeofday(&start, NULL);
 
@@ -91,23 +83,13 @@ int main(void) {
         length = i % MAX_PACKET_LEN;
         out_packet[length++] = i % 255;
 
-        /* loop until the packet is allowed to be sent or errors */
-        while ( (delay = delay_send_packet(sockets[0], out_packet, length,
-                        &dest, MIN_INTER_PACKET_DELAY, NULL)) > 0 ) {
-            assert(delay <= MIN_INTER_PACKET_DELAY);
-            usleep(delay);
-        }
-
-        if ( delay < 0 ) {
-            fprintf(stderr, "Failed to send packet: %s\n", strerror(errno));
-            return -1;
-        }
+        /* wait until the packet is allowed to be sent */
+        pacer_wait(&pacer);
+        assert(send(sockets[0], out_packet, length, 0) == length);
+        pacer_sent(&pacer, 1);
 
         /* try to read the packet that we just sent */
-        if ( recv(sockets[1], in_packet, MAX_PACKET_LEN, 0) != length ) {
-            fprintf(stderr, "Failed to receive packet: %s\n", strerror(errno));
-            return -1;
-        }
+        assert(recv(sockets[1], in_packet, MAX_PACKET_LEN, 0) == length);
 
         /* confirm that it matches what we sent */
         assert(memcmp(out_packet, in_packet, length) == 0);
@@ -117,7 +99,99 @@ int main(void) {
 
     /* check that we took longer than the minimum possible time */
     duration = DIFF_TV_US(end, start);
-    assert(duration > (TEST_PACKETS * MIN_INTER_PACKET_DELAY));
+    assert(duration > ((TEST_PACKETS - 1) * MIN_INTER_PACKET_DELAY));
+
+    /* and that the pacer agrees with us */
+    assert(pacer.packets == TEST_PACKETS);
+    assert(pacer.min_gap >= 0);
+    assert(pacer_get_mean_gap(&pacer) >= MIN_INTER_PACKET_DELAY);
+}
+
+
+
+/*
+ * Check that time spent doing other work between packets doesn't get added
+ * to the gap, as the deadlines are absolute rather than relative to when
+ * the previous packet was sent.
+ */
+static void check_deadlines(void) {
+    struct pacer_t pacer;
+    int delay, i;
+
+    pacer_init(&pacer, PROCESSING_INTERVAL, 1);
+
+    for ( i = 0; i < 500; i++ ) {
+        while ( pacer_get_batch(&pacer, 1, &delay) == 0 ) {
+            usleep(delay);
+        }
+        pacer_sent(&pacer, 1);
+
+        /* pretend to do some work that takes half the interval */
+        usleep(PROCESSING_INTERVAL / 2);
+    }
+
+    /* relative scheduling would give a mean gap of at least 1.5 intervals */
+    assert(pacer_get_mean_gap(&pacer) < PROCESSING_INTERVAL * 1.25);
+
+    /* lateness is never negative, and the mean can't exceed the maximum */
+    assert(pacer_get_mean_lateness(&pacer) >= 0);
+    assert(pacer_get_mean_lateness(&pacer) <= pacer.max_lateness);
+}
+
+
+
+/*
+ * Check that after falling behind at most the burst size of packets can be
+ * sent together, and that older missed deadlines are skipped.
+ */
+static void check_burst(void) {
+    struct pacer_t pacer;
+    int delay;
+
+    pacer_init(&pacer, MIN_INTER_PACKET_DELAY, TEST_BURST);
+
+    /* the very first packet is always allowed, but only the one */
+    assert(pacer_get_batch(&pacer, TEST_BURST * 2, &delay) == 1);
+    pacer_sent(&pacer, 1);
+
+    /* fall a long way behind, only the burst size should be allowed */
+    usleep(MIN_INTER_PACKET_DELAY * TEST_BURST * 10);
+    assert(pacer_get_batch(&pacer, TEST_BURST * 2, &delay) == TEST_BURST);
+    assert(pacer_get_batch(&pacer, 2, &delay) == 2);
+    pacer_sent(&pacer, TEST_BURST);
+    assert(pacer.packets == TEST_BURST + 1);
+    assert(pacer.min_gap == 0);
+
+    /* having used the burst, the next packet should be back on schedule */
+    assert(pacer_get_delay(&pacer) <= MIN_INTER_PACKET_DELAY);
+
+    /* with no interval, everything is allowed at once */
+    pacer_init(&pacer, 0, 1);
+    assert(pacer_get_batch(&pacer, TEST_BURST * 2, &delay) == TEST_BURST * 2);
+    assert(delay == 0);
+}
+
+
+
+/*
+ * Check that the pacer spaces packets correctly, keeps to absolute
+ * deadlines and honours the burst size.
+ */
+int main(void) {
+    int sockets[2];
+
+    /*
+     * use a pair of unix sockets to test sending data without relying on
+     * the network being present/sane/etc.
+     */
+    if ( socketpair(AF_UNIX, SOCK_DGRAM, 0, sockets) < 0 ) {
+        fprintf(stderr, "Failed to create socket pair: %s\n", strerror(errno));
+        return -1;
+    }
+
+    check_spacing(sockets);
+    check_deadlines();
+    check_burst();
 
     close(sockets[0]);
     close(sockets[1]);
@@ -0,0 +1,152 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+
+#include "testlib.h"
+
+#define TEST_BATCHES 100
+#define TEST_PACKET_LEN 64
+
+
+/*
+ * Check that packets sent over loopback are given send and receive times
+ * in the right order, and that the kernel timestamps are used when they
+ * are available.
+ */
+int main(void) {
+    struct addrinfo *dest, hints;
+    struct socket_t sender, receiver;
+    socklen_t addrlen;
+    char out_packet[MAX_PACKET_BATCH][TEST_PACKET_LEN];
+    char in_packet[MAX_PACKET_BATCH][TEST_PACKET_LEN];
+    struct batch_packet_t outgoing[MAX_PACKET_BATCH];
+    struct batch_packet_t incoming[MAX_PACKET_BATCH];
+    int tx_enabled, batch, received, maxwait, i, j;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_NUMERICHOST;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if ( getaddrinfo("127.0.0.1", NULL, &hints, &dest) != 0 ) {
+        fprintf(stderr, "Failed to get address info\n");
+        return -1;
+    }
+
+    sender.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    sender.socket6 = -1;
+    receiver.socket = socket(AF_INET, SOCK_DGRAM, 0);
+    receiver.socket6 = -1;
+
+    if ( sender.socket < 0 || receiver.socket < 0 ) {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* bind the receiver to any port on loopback and send packets to it */
+    if ( bind_socket_to_address(receiver.socket, dest) < 0 ) {
+        fprintf(stderr, "Failed to bind socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    addrlen = dest->ai_addrlen;
+    if ( getsockname(receiver.socket, dest->ai_addr, &addrlen) < 0 ) {
+        fprintf(stderr, "Failed to get socket info: %s\n", strerror(errno));
+        return -1;
+    }
+
+    set_default_socket_options(&sender);
+    set_default_socket_options(&receiver);
+
+    /* older kernels won't have transmit timestamps, which is fine */
+    tx_enabled = (set_tx_timestamp_socket_options(&sender) == 0);
+
+    for ( i = 0; i < TEST_BATCHES; i++ ) {
+        batch = (i % MAX_PACKET_BATCH) + 1;
+
+        for ( j = 0; j < batch; j++ ) {
+            memset(out_packet[j], i, TEST_PACKET_LEN);
+            outgoing[j].buf = out_packet[j];
+            outgoing[j].length = TEST_PACKET_LEN;
+            outgoing[j].dest = dest;
+            incoming[j].buf = in_packet[j];
+            incoming[j].size = TEST_PACKET_LEN;
+        }
+
+        assert(send_packet_batch(sender.socket, outgoing, batch) == batch);
+
+        for ( j = 0; j < batch; j += received ) {
+            maxwait = 1000000;
+            received = get_packet_batch(receiver.socket, &incoming[j],
+                    batch - j, &maxwait);
+            assert(received > 0);
+        }
+
+        for ( j = 0; j < batch; j++ ) {
+            /* loopback should always give kernel transmit timestamps */
+            if ( tx_enabled ) {
+                assert(outgoing[j].time_source == TIMESTAMP_SOURCE_KERNEL);
+            }
+            assert(incoming[j].time_source == TIMESTAMP_SOURCE_KERNEL);
+            assert(incoming[j].length == TEST_PACKET_LEN);
+            assert(memcmp(incoming[j].buf, out_packet[j],
+                        TEST_PACKET_LEN) == 0);
+            /* a packet can't arrive before it was sent */
+            assert(DIFF_TS_US(incoming[j].time, outgoing[j].time) >= 0);
+        }
+    }
+
+    /* nothing should be left waiting, including on the error queue */
+    maxwait = 1000;
+    assert(get_packet_batch(sender.socket, incoming, 1, &maxwait) == 0);
+    maxwait = 1000;
+    assert(get_packet_batch(receiver.socket, incoming, 1, &maxwait) == 0);
+
+    close(sender.socket);
+    close(receiver.socket);
+    freeaddrinfo(dest);
+
+    return 0;
+}
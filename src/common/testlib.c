@@ -43,6 +43,8 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <sys/time.h>
+#include <time.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <assert.h>
 #include <string.h>
@@ -50,6 +52,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 
 #include <google/protobuf-c/protobuf-c.h>
 
@@ -60,6 +64,19 @@
 
 
 
+/*
+ * Sockets that have software transmit timestamps enabled, and the id the
+ * kernel will give the timestamp of the next packet sent on each. The ids
+ * count up from zero as packets are sent, so we track them here to match
+ * timestamps read from the error queue to the packets that were sent.
+ */
+static struct {
+    uint8_t enabled;
+    uint32_t next_id;
+} tx_timestamps[FD_SETSIZE];
+
+
+
 /*
  * The ELF binary layout means we should have all of the command line
  * arguments and the environment all contiguous in the stack. We can take
@@ -213,36 +230,137 @@ int unblock_signals(void) {
 
 /*
  * Try to get the best timestamp that is available to us, in order of
- * preference: SO_TIMESTAMP, SIOCGSTAMP, gettimeofday().
+ * preference: SO_TIMESTAMPING, SO_TIMESTAMP, SIOCGSTAMPNS, clock_gettime().
+ * Returns where the timestamp came from.
  */
-static void get_timestamp(int sock, struct msghdr *msg, struct timeval *now) {
+static int get_timestamp(int sock, struct msghdr *msg, struct timespec *now) {
     struct cmsghdr *c;
-    struct timeval *tv;
 
     assert(msg);
     assert(now);
 
-#ifdef SO_TIMESTAMP
-    /* try getting the timestamp using SO_TIMESTAMP if available */
     for ( c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c) ) {
-        if ( c->cmsg_level != SOL_SOCKET || c->cmsg_type != SO_TIMESTAMP ) {
+        if ( c->cmsg_level != SOL_SOCKET ) {
             continue;
         }
-        if ( c->cmsg_len < CMSG_LEN(sizeof(struct timeval)) ) {
-            continue;
+
+#ifdef SO_TIMESTAMPING
+        /* nanosecond software timestamp from SO_TIMESTAMPING if enabled */
+        if ( c->cmsg_type == SCM_TIMESTAMPING &&
+                c->cmsg_len >= CMSG_LEN(sizeof(struct scm_timestamping)) ) {
+            struct scm_timestamping *stamps =
+                (struct scm_timestamping*)CMSG_DATA(c);
+            if ( stamps->ts[0].tv_sec != 0 ) {
+                *now = stamps->ts[0];
+                return TIMESTAMP_SOURCE_KERNEL;
+            }
+        }
+#endif
+
+#ifdef SO_TIMESTAMP
+        /* otherwise a microsecond timestamp from SO_TIMESTAMP */
+        if ( c->cmsg_type == SO_TIMESTAMP &&
+                c->cmsg_len >= CMSG_LEN(sizeof(struct timeval)) ) {
+            struct timeval *tv = (struct timeval*)CMSG_DATA(c);
+            now->tv_sec = tv->tv_sec;
+            now->tv_nsec = tv->tv_usec * 1000;
+            return TIMESTAMP_SOURCE_KERNEL;
         }
-        tv = ((struct timeval*)CMSG_DATA(c));
-        now->tv_sec = tv->tv_sec;
-        now->tv_usec = tv->tv_usec;
-        return;
-    }
 #endif
+    }
 
-    /* next try using SIOCGSTAMP to get a timestamp */
-    if ( ioctl(sock, SIOCGSTAMP, now) < 0 ) {
-        /* failing that, call gettimeofday() which we know will work */
-        gettimeofday(now, NULL);
+    /* next try using SIOCGSTAMPNS to get a timestamp */
+    if ( ioctl(sock, SIOCGSTAMPNS, now) == 0 ) {
+        return TIMESTAMP_SOURCE_KERNEL;
     }
+
+    /* failing that, take the time now which we know will work */
+    clock_gettime(CLOCK_REALTIME, now);
+
+    return TIMESTAMP_SOURCE_USERSPACE;
+}
+
+
+
+/*
+ * Read any transmit timestamps waiting in the error queue of the socket.
+ * Timestamps for packets that were given the ids first onwards are used to
+ * set the send time of the matching packet (indices maps from id order to
+ * the packet array), the rest are discarded. Kernel timestamps are only
+ * trusted if they are later than the time recorded just before sending.
+ * Returns the number of packets that had their send time updated.
+ */
+static int get_tx_timestamps(int sock, uint32_t first,
+        struct batch_packet_t *packets, int *indices, int count) {
+
+#if defined(SO_TIMESTAMPING) && defined(SO_EE_ORIGIN_TIMESTAMPING)
+    char control[PACKET_CONTROL_LEN];
+    struct msghdr msg;
+    struct cmsghdr *c;
+    struct scm_timestamping *stamps;
+    struct sock_extended_err *err;
+    struct batch_packet_t *packet;
+    uint32_t offset;
+    int found = 0;
+
+    for ( ;; ) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if ( recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            /* EAGAIN, there are no more timestamps waiting */
+            break;
+        }
+
+        stamps = NULL;
+        err = NULL;
+
+        for ( c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c) ) {
+            if ( c->cmsg_level == SOL_SOCKET &&
+                    c->cmsg_type == SCM_TIMESTAMPING &&
+                    c->cmsg_len >= CMSG_LEN(sizeof(*stamps)) ) {
+                stamps = (struct scm_timestamping*)CMSG_DATA(c);
+            } else if ( ((c->cmsg_level == SOL_IP &&
+                                c->cmsg_type == IP_RECVERR) ||
+                            (c->cmsg_level == SOL_IPV6 &&
+                             c->cmsg_type == IPV6_RECVERR)) &&
+                    c->cmsg_len >= CMSG_LEN(sizeof(*err)) ) {
+                err = (struct sock_extended_err*)CMSG_DATA(c);
+            }
+        }
+
+        if ( stamps == NULL || err == NULL || err->ee_errno != ENOMSG ||
+                err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ) {
+            continue;
+        }
+
+        /* ignore timestamps for packets that aren't part of this batch */
+        offset = err->ee_data - first;
+        if ( offset >= (uint32_t)count ) {
+            continue;
+        }
+
+        packet = &packets[indices[offset]];
+        if ( packet->length < 0 ||
+                stamps->ts[0].tv_sec < packet->time.tv_sec ||
+                (stamps->ts[0].tv_sec == packet->time.tv_sec &&
+                 stamps->ts[0].tv_nsec < packet->time.tv_nsec) ) {
+            continue;
+        }
+
+        packet->time = stamps->ts[0];
+        packet->time_source = TIMESTAMP_SOURCE_KERNEL;
+        found++;
+    }
+
+    return found;
+#else
+    return 0;
+#endif
 }
 
 
@@ -363,106 +481,458 @@ int get_packet(struct socket_t *sockets, char *buf, int buflen,
     assert(sockets->socket || sockets->socket6);
     assert(timeout);
 
-    /* wait for data to be ready, up to timeout (wait will update it) */
-    if ( (family = wait_for_data(sockets, timeout)) <= 0 ) {
+    do {
+        /* wait for data to be ready, up to timeout (wait will update it) */
+        if ( (family = wait_for_data(sockets, timeout)) <= 0 ) {
+            return 0;
+        }
+
+        /* determine which socket we have received data on and read from it */
+        switch ( family ) {
+            case AF_INET: sock = sockets->socket;
+                          addrlen = sizeof(struct sockaddr_in);
+                          break;
+            case AF_INET6: sock = sockets->socket6;
+                           addrlen = sizeof(struct sockaddr_in6);
+                           break;
+            default: return 0;
+        };
+
+        /* set up the message structure, including the user supplied packet */
+        iov.iov_base = buf;
+        iov.iov_len = buflen;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = saddr;
+        msg.msg_namelen = saddr ? addrlen : 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ans_data;
+        msg.msg_controllen = sizeof(ans_data);
+
+        /*
+         * Receive the packet that should be ready on one of our sockets. The
+         * socket can also wake us for late transmit timestamps, so discard
+         * those and go back to waiting if there is no packet after all.
+         */
+        if ( (bytes = recvmsg(sock, &msg, MSG_DONTWAIT)) < 0 ) {
+            if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+                Log(LOG_ERR, "Failed to recvmsg()");
+                exit(-1);
+            }
+            get_tx_timestamps(sock, 0, NULL, NULL, 0);
+        }
+    } while ( bytes < 0 );
+
+    /* populate the timestamp argument with the receive time of packet */
+    if ( now ) {
+        struct timespec ts;
+        get_timestamp(sock, &msg, &ts);
+        *now = TV_FROM_TS(ts);
+    }
+
+    return bytes;
+}
+
+
+
+/*
+ * Receive up to count packets that are already waiting on the socket using
+ * a single recvmmsg() call, waiting up to timeout microseconds for the
+ * first to arrive. Each packet must have a buffer and size set by the
+ * caller, its length, source address and receive time will be filled in.
+ * Returns the number of packets received, 0 on timeout or -1 on error.
+ */
+int get_packet_batch(int sock, struct batch_packet_t *packets, int count,
+        int *timeout) {
+
+    struct socket_t sockets;
+    struct mmsghdr msgs[MAX_PACKET_BATCH];
+    struct iovec iov[MAX_PACKET_BATCH];
+    char control[MAX_PACKET_BATCH][PACKET_CONTROL_LEN];
+    int received;
+    int i;
+
+    assert(sock > 0);
+    assert(packets);
+    assert(count > 0 && count <= MAX_PACKET_BATCH);
+    assert(timeout);
+
+    sockets.socket = sock;
+    sockets.socket6 = -1;
+
+    /* set up a message structure for each of the user supplied packets */
+    memset(msgs, 0, sizeof(struct mmsghdr) * count);
+    for ( i = 0; i < count; i++ ) {
+        iov[i].iov_base = packets[i].buf;
+        iov[i].iov_len = packets[i].size;
+        msgs[i].msg_hdr.msg_name = &packets[i].source;
+        msgs[i].msg_hdr.msg_namelen = sizeof(packets[i].source);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = PACKET_CONTROL_LEN;
+    }
+
+    do {
+        /* wait for data to be ready, up to timeout (wait will update it) */
+        if ( wait_for_data(&sockets, timeout) <= 0 ) {
+            return 0;
+        }
+
+        /* read everything that is ready, but don't block waiting for more */
+        received = recvmmsg(sock, msgs, count, MSG_DONTWAIT, NULL);
+        if ( received < 0 ) {
+            if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+                Log(LOG_WARNING, "Failed to recvmmsg(): %s", strerror(errno));
+                return -1;
+            }
+            /* woken by late transmit timestamps rather than a packet */
+            get_tx_timestamps(sock, 0, NULL, NULL, 0);
+        }
+    } while ( received < 0 );
+
+    /* populate the length and receive time of each packet */
+    for ( i = 0; i < received; i++ ) {
+        packets[i].length = msgs[i].msg_len;
+        packets[i].time_source =
+            get_timestamp(sock, &msgs[i].msg_hdr, &packets[i].time);
+    }
+
+    return received;
+}
+
+
+
+/*
+ * Get the current time on the monotonic clock in microseconds. The pacer
+ * uses this rather than gettimeofday() so that clock adjustments can't
+ * stall or burst the packets being sent.
+ */
+static int64_t get_monotonic_us(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((int64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+
+
+/*
+ * Initialise a pacer to send packets no closer than interval microseconds
+ * apart on average. Up to burst packets may be sent back to back if the
+ * sender has fallen behind, so that one late timer doesn't push every
+ * following packet back.
+ */
+void pacer_init(struct pacer_t *pacer, uint32_t interval, uint32_t burst) {
+    assert(pacer);
+
+    memset(pacer, 0, sizeof(struct pacer_t));
+    pacer->interval = interval;
+    pacer->burst = (burst > 0) ? burst : 1;
+}
+
+
+
+/*
+ * Count how many packet deadlines have passed (up to the burst size) at the
+ * given time. Deadlines are absolute, so time spent processing between
+ * packets doesn't add to the gap, but any deadlines missed beyond the burst
+ * size are skipped rather than being caught up.
+ */
+static int64_t get_due_packets(struct pacer_t *pacer, int64_t now) {
+    int64_t due;
+
+    /* the very first packet can always be sent immediately */
+    if ( pacer->next == 0 ) {
+        pacer->next = now;
+    }
+
+    if ( now < pacer->next ) {
         return 0;
     }
 
-    /* determine which socket we have received data on and read from it */
-    switch ( family ) {
-        case AF_INET: sock = sockets->socket;
-                      addrlen = sizeof(struct sockaddr_in);
-                      break;
-        case AF_INET6: sock = sockets->socket6;
-                       addrlen = sizeof(struct sockaddr_in6);
-                       break;
-        default: return 0;
-    };
+    if ( pacer->interval == 0 ) {
+        return pacer->burst;
+    }
 
-    /* set up the message structure, including the user supplied packet */
-    iov.iov_base = buf;
-    iov.iov_len = buflen;
-    memset(&msg, 0, sizeof(msg));
-    msg.msg_name = saddr;
-    msg.msg_namelen = saddr ? addrlen : 0;
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = ans_data;
-    msg.msg_controllen = sizeof(ans_data);
+    due = ((now - pacer->next) / pacer->interval) + 1;
+    if ( due > pacer->burst ) {
+        pacer->next += (due - pacer->burst) * pacer->interval;
+        due = pacer->burst;
+    }
+
+    return due;
+}
+
+
+
+/*
+ * Determine how many packets (up to max) the pacer allows to be sent right
+ * now. If the next deadline is close then sleep until it, otherwise set
+ * delay to the time to wait (in microseconds) and return zero.
+ */
+int pacer_get_batch(struct pacer_t *pacer, int max, int *delay) {
+    int64_t now;
+    int64_t due;
 
-    /* receive the packet that we know is ready on one of our sockets */
-    if ( (bytes = recvmsg(sock, &msg, 0)) < 0 ) {
-        Log(LOG_ERR, "Failed to recvmsg()");
-        exit(-1);
+    assert(pacer);
+    assert(max > 0);
+    assert(delay);
+
+    *delay = 0;
+    now = get_monotonic_us();
+
+    if ( (due = get_due_packets(pacer, now)) == 0 ) {
+        if ( pacer->next - now > PACER_MAX_SLEEP ) {
+            *delay = pacer->next - now;
+            return 0;
+        }
+        pacer_wait(pacer);
+        due = get_due_packets(pacer, get_monotonic_us());
     }
 
-    /* populate the timestamp argument with the receive time of packet */
-    if ( now ) {
-        get_timestamp(sock, &msg, now);
+    /* with no interval to enforce, everything is due at once */
+    if ( pacer->interval == 0 ) {
+        return max;
     }
 
-    return bytes;
+    return (due < max) ? due : max;
 }
 
 
 
 /*
- * Enforce a minimum inter-packet delay for test traffic. Try to send a packet
- * but if it is too soon for the test to be sending again then return a delay
- * time to wait (in microseconds).
+ * Sleep until the pacer will allow the next packet to be sent, using an
+ * absolute deadline so that being woken early or late doesn't accumulate.
+ * Returns immediately if a packet is already due.
  */
-int delay_send_packet(int sock, char *packet, int size, struct addrinfo *dest,
-        uint32_t inter_packet_delay, struct timeval *sent) {
+void pacer_wait(struct pacer_t *pacer) {
+    struct timespec deadline;
 
-    int bytes_sent;
-    static struct timeval last = {0, 0};
-    struct timeval now;
-    int delay, diff;
+    assert(pacer);
 
-    assert(sock > 0);
-    assert(size > 0);
-    assert(packet);
-    assert(dest);
+    if ( pacer->next == 0 ) {
+        return;
+    }
 
-    gettimeofday(&now, NULL);
+    deadline.tv_sec = pacer->next / 1000000;
+    deadline.tv_nsec = (pacer->next % 1000000) * 1000;
 
-    /* if time has gone backwards then cap it at the last time */
-    if ( (diff = DIFF_TV_US(now, last)) < 0 ) {
-        diff = 0;
+    while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                NULL) == EINTR ) {
+        /* keep sleeping till the deadline if interrupted by a signal */
     }
+}
+
+
+
+/*
+ * Record that count packets were just sent, moving the deadline for the
+ * next packet and updating the statistics about achieved spacing.
+ */
+void pacer_sent(struct pacer_t *pacer, int count) {
+    int64_t now;
+    int64_t late;
+    int64_t gap;
+    int i;
+
+    assert(pacer);
+    assert(count > 0);
+
+    now = get_monotonic_us();
 
-    /* determine how much time is left to wait until the minimum delay */
-    if ( last.tv_sec != 0 && diff < (int)inter_packet_delay ) {
-	delay = inter_packet_delay - diff;
-    } else {
-	delay = 0;
-	last.tv_sec = now.tv_sec;
-	last.tv_usec = now.tv_usec;
+    /* make sure a long idle period doesn't leave a backlog of deadlines */
+    get_due_packets(pacer, now);
 
-        /* populate sent timestamp as well, if not null */
-        if ( sent ) {
-            sent->tv_sec = now.tv_sec;
-            sent->tv_usec = now.tv_usec;
+    for ( i = 0; i < count; i++ ) {
+        /* how long after its deadline was this packet sent */
+        late = now - pacer->next;
+        if ( late > 0 ) {
+            pacer->lateness += late;
+            if ( late > pacer->max_lateness ) {
+                pacer->max_lateness = late;
+            }
+        }
+
+        /* the gap since the previous packet, back to back within a batch */
+        if ( pacer->packets > 0 ) {
+            gap = (i == 0) ? now - pacer->last : 0;
+            if ( pacer->packets == 1 || gap < pacer->min_gap ) {
+                pacer->min_gap = gap;
+            }
+            if ( gap > pacer->max_gap ) {
+                pacer->max_gap = gap;
+            }
+        } else {
+            pacer->first = now;
         }
+
+        pacer->packets++;
+        pacer->next += pacer->interval;
     }
 
-    /*
-     * if there is still time to wait before the next packet then return
-     * control to the caller, in case they want to do more work while waiting
-     */
-    if ( delay != 0 ) {
-	return delay;
+    pacer->last = now;
+}
+
+
+
+/*
+ * Determine the time (in microseconds) until the pacer will allow the next
+ * packet to be sent, suitable for scheduling a timer.
+ */
+int pacer_get_delay(struct pacer_t *pacer) {
+    int64_t now;
+
+    assert(pacer);
+
+    now = get_monotonic_us();
+
+    if ( pacer->next == 0 || now >= pacer->next ) {
+        return 0;
     }
 
-    bytes_sent = sendto(sock, packet, size, 0, dest->ai_addr, dest->ai_addrlen);
+    return pacer->next - now;
+}
 
-    /* TODO determine error and/or send any unsent bytes */
-    if ( bytes_sent != size ) {
-        Log(LOG_DEBUG, "Only sent %d of %d bytes", bytes_sent, size);
-        return -1;
+
+
+/*
+ * Get the average gap (in microseconds) actually achieved between packets.
+ */
+double pacer_get_mean_gap(struct pacer_t *pacer) {
+    assert(pacer);
+
+    if ( pacer->packets < 2 ) {
+        return 0;
     }
 
-    return 0;
+    return (double)(pacer->last - pacer->first) / (pacer->packets - 1);
+}
+
+
+
+/*
+ * Get the average time (in microseconds) that packets were sent after their
+ * deadlines.
+ */
+double pacer_get_mean_lateness(struct pacer_t *pacer) {
+    assert(pacer);
+
+    if ( pacer->packets == 0 ) {
+        return 0;
+    }
+
+    return (double)pacer->lateness / pacer->packets;
+}
+
+
+
+/*
+ * Log how closely the achieved gap between packets matched the target.
+ */
+void pacer_report(struct pacer_t *pacer, char *name) {
+    assert(pacer);
+    assert(name);
+
+    if ( pacer->packets == 0 ) {
+        return;
+    }
+
+    Log(LOG_DEBUG, "%s sent %" PRIu64 " packets, target gap %uus, "
+            "achieved mean %.1fus (min %" PRId64 "us, max %" PRId64 "us), "
+            "mean lateness %.1fus (max %" PRId64 "us)", name, pacer->packets,
+            pacer->interval, pacer_get_mean_gap(pacer), pacer->min_gap,
+            pacer->max_gap, pacer_get_mean_lateness(pacer),
+            pacer->max_lateness);
+}
+
+
+
+/*
+ * Send a batch of packets in a single sendmmsg() call, without checking
+ * the inter-packet delay - use pacer_get_batch() first to determine how
+ * many packets may be sent. Each packet must have a buffer, length and
+ * destination set by the caller, the time it was sent will be filled in
+ * (using the kernel transmit timestamp if the socket has them enabled).
+ * The length of any packet that fails to send is set to -1. Returns the
+ * number of packets that were sent successfully.
+ */
+int send_packet_batch(int sock, struct batch_packet_t *packets, int count) {
+    struct mmsghdr msgs[MAX_PACKET_BATCH];
+    struct iovec iov[MAX_PACKET_BATCH];
+    int indices[MAX_PACKET_BATCH];
+    struct timespec now;
+    uint32_t first;
+    int accepted;
+    int success;
+    int sent;
+    int result;
+    int i;
+
+    assert(sock > 0);
+    assert(packets);
+    assert(count > 0 && count <= MAX_PACKET_BATCH);
+
+    memset(msgs, 0, sizeof(struct mmsghdr) * count);
+    for ( i = 0; i < count; i++ ) {
+        assert(packets[i].buf);
+        assert(packets[i].length > 0);
+        assert(packets[i].dest);
+        iov[i].iov_base = packets[i].buf;
+        iov[i].iov_len = packets[i].length;
+        msgs[i].msg_hdr.msg_name = packets[i].dest->ai_addr;
+        msgs[i].msg_hdr.msg_namelen = packets[i].dest->ai_addrlen;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    success = 0;
+    sent = 0;
+    accepted = 0;
+
+    while ( sent < count ) {
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        result = sendmmsg(sock, &msgs[sent], count - sent, 0);
+
+        if ( result < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            /* the first remaining packet failed, skip it and try the rest */
+            Log(LOG_DEBUG, "Failed to send packet: %s", strerror(errno));
+            packets[sent].length = -1;
+            sent++;
+            continue;
+        }
+
+        for ( i = sent; i < sent + result; i++ ) {
+            /* the kernel gives every accepted packet a timestamp id */
+            indices[accepted++] = i;
+            /* TODO determine error and/or send any unsent bytes */
+            if ( msgs[i].msg_len != (unsigned int)packets[i].length ) {
+                Log(LOG_DEBUG, "Only sent %d of %d bytes", msgs[i].msg_len,
+                        packets[i].length);
+                packets[i].length = -1;
+                continue;
+            }
+            packets[i].time = now;
+            packets[i].time_source = TIMESTAMP_SOURCE_USERSPACE;
+            success++;
+        }
+
+        sent += result;
+    }
+
+    /* replace the userspace send times with kernel ones where possible */
+    if ( sock < FD_SETSIZE && tx_timestamps[sock].enabled ) {
+        first = tx_timestamps[sock].next_id;
+        tx_timestamps[sock].next_id += accepted;
+        get_tx_timestamps(sock, first, packets, indices, accepted);
+    }
+
+    return success;
 }
 
 
@@ -692,18 +1162,71 @@ int bind_sockets_to_address(struct socket_t *sockets,
 
 
 /*
- * Enable socket timestamping if it is available.
+ * Enable socket timestamping if it is available, preferring nanosecond
+ * software receive timestamps from SO_TIMESTAMPING.
  */
 static void set_timestamp_socket_option(int sock) {
     assert(sock >= 0);
+
+    if ( sock < FD_SETSIZE ) {
+        tx_timestamps[sock].enabled = 0;
+        tx_timestamps[sock].next_id = 0;
+    }
+
+#ifdef SO_TIMESTAMPING
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    /* try to enable socket timestamping using SO_TIMESTAMPING */
+    if ( setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                sizeof(flags)) == 0 ) {
+        return;
+    }
+    Log(LOG_DEBUG, "No SO_TIMESTAMPING support, trying SO_TIMESTAMP");
+#endif
+
 #ifdef SO_TIMESTAMP
     int one = 1;
     /* try to enable socket timestamping using SO_TIMESTAMP */
     if ( setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &one, sizeof(one)) < 0 ) {
-        Log(LOG_DEBUG, "No SO_TIMESTAMP support, using SIOCGSTAMP");
+        Log(LOG_DEBUG, "No SO_TIMESTAMP support, using SIOCGSTAMPNS");
     }
 #else
-    Log(LOG_DEBUG, "No SO_TIMESTAMP support, using SIOCGSTAMP");
+    Log(LOG_DEBUG, "No SO_TIMESTAMP support, using SIOCGSTAMPNS");
+#endif
+}
+
+
+
+/*
+ * Enable software transmit timestamps on a socket, so that packets sent
+ * with send_packet_batch() are given the time the kernel passed them to the
+ * network device rather than the time the test asked for them to be sent.
+ */
+static int set_tx_timestamp_socket_option(int sock) {
+    assert(sock >= 0);
+
+#if defined(SO_TIMESTAMPING) && defined(SO_EE_ORIGIN_TIMESTAMPING)
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE |
+        SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+        SOF_TIMESTAMPING_OPT_TSONLY;
+
+    if ( sock >= FD_SETSIZE ) {
+        return -1;
+    }
+
+    if ( setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+                sizeof(flags)) < 0 ) {
+        Log(LOG_DEBUG, "No transmit timestamp support, using gettimeofday");
+        return -1;
+    }
+
+    /* setting OPT_ID restarts the timestamp ids from zero */
+    tx_timestamps[sock].enabled = 1;
+    tx_timestamps[sock].next_id = 0;
+
+    return 0;
+#else
+    Log(LOG_DEBUG, "No transmit timestamp support, using gettimeofday");
+    return -1;
 #endif
 }
 
@@ -737,6 +1260,33 @@ int set_default_socket_options(struct socket_t *sockets) {
 
 
 
+/*
+ * Enable kernel transmit timestamps on the test sockets. Tests that use
+ * this should send with send_packet_batch() to make use of them. Returns
+ * -1 if they couldn't be enabled on any socket, in which case the send
+ * times will be taken in userspace.
+ */
+int set_tx_timestamp_socket_options(struct socket_t *sockets) {
+    int result = -1;
+
+    assert(sockets);
+    assert(sockets->socket >= 0 || sockets->socket6 >= 0);
+
+    if ( sockets->socket >= 0 &&
+            set_tx_timestamp_socket_option(sockets->socket) == 0 ) {
+        result = 0;
+    }
+
+    if ( sockets->socket6 >= 0 &&
+            set_tx_timestamp_socket_option(sockets->socket6) == 0 ) {
+        result = 0;
+    }
+
+    return result;
+}
+
+
+
 /*
  * TODO should this be part of the default socket options?
  * Should it be in common/dscp.c?
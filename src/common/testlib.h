@@ -41,6 +41,8 @@
 #define _COMMON_TESTLIB_H
 
 #include <netdb.h>
+#include <stdint.h>
+#include <sys/time.h>
 #include <openssl/bio.h>
 #include <google/protobuf-c/protobuf-c.h>
 
@@ -54,6 +56,12 @@
 /* minimum time in usec allowed between sending test packets */
 #define MIN_INTER_PACKET_DELAY 100
 
+/* default number of packets that may be sent back to back when behind */
+#define DEFAULT_PACKET_BURST 1
+
+/* longest time in usec the pacer will sleep rather than ask for a timer */
+#define PACER_MAX_SLEEP 1000
+
 #define DEFAULT_DSCP_VALUE 0
 
 /* max number of attempts to make when retrying control connections */
@@ -61,12 +69,27 @@
 /* time in seconds to wait between attempts to establish control connects */
 #define CONTROL_CONNECT_DELAY 2
 
+/* maximum number of packets sent or received in a single batch */
+#define MAX_PACKET_BATCH 32
+/* space for ancillary data (e.g. timestamps) received with each packet */
+#define PACKET_CONTROL_LEN 256
+
+/* where the send or receive time of a packet was taken */
+#define TIMESTAMP_SOURCE_USERSPACE 0
+#define TIMESTAMP_SOURCE_KERNEL 1
+
 #define US_FROM_US(x) ((x) % 1000000)
 #define S_FROM_US(x)  ((int)((x)/1000000))
 #define DIFF_TV_US(tva, tvb) ( \
         (int64_t) ( (((tva).tv_sec - (tvb).tv_sec) * 1000000) + \
             ((tva).tv_usec - (tvb).tv_usec) ) \
         )
+#define DIFF_TS_US(tsa, tsb) ( \
+        (int64_t) ( (((tsa).tv_sec - (tsb).tv_sec) * 1000000) + \
+            (((tsa).tv_nsec - (tsb).tv_nsec) / 1000) ) \
+        )
+#define TV_FROM_TS(ts) \
+    ((struct timeval) { (ts).tv_sec, (ts).tv_nsec / 1000 })
 
 
 /*
@@ -78,14 +101,61 @@ struct socket_t {
     int socket6;                /* ipv6 socket, if available */
 };
 
+
+
+/*
+ * A single packet sent or received as part of a batch. When sending, the
+ * caller sets the buffer, length and destination; when receiving, the
+ * caller sets the buffer and size. The time the packet was sent or received
+ * is filled in (with where that time came from), along with the length and
+ * source of received packets.
+ */
+struct batch_packet_t {
+    char *buf;                      /* packet contents */
+    int size;                       /* space available in buf (bytes) */
+    int length;                     /* packet length (bytes), -1 on error */
+    struct addrinfo *dest;          /* destination address, if sending */
+    struct sockaddr_storage source; /* source address, if received */
+    struct timespec time;           /* time the packet was sent/received */
+    int time_source;                /* TIMESTAMP_SOURCE_* of the time */
+};
+
+/*
+ * Paces packets being sent against absolute deadlines on the monotonic
+ * clock, and keeps track of how closely the target spacing was achieved.
+ */
+struct pacer_t {
+    uint32_t interval;              /* target gap between packets (usec) */
+    uint32_t burst;                 /* most packets allowed back to back */
+    int64_t next;                   /* deadline for the next packet (usec) */
+    int64_t first;                  /* time the first packet was sent */
+    int64_t last;                   /* time the latest packet was sent */
+    uint64_t packets;               /* number of packets sent */
+    int64_t min_gap;                /* smallest gap between packets (usec) */
+    int64_t max_gap;                /* largest gap between packets (usec) */
+    int64_t lateness;               /* total time sent after deadlines */
+    int64_t max_lateness;           /* most time sent after a deadline */
+};
+
+
+
 void set_proc_name(char *testname);
 void free_duped_environ(void);
 int unblock_signals(void);
 int wait_for_data(struct socket_t *sockets, int *maxwait);
 int get_packet(struct socket_t *sockets, char *buf, int len,
 	struct sockaddr *saddr, int *timeout, struct timeval *now);
-int delay_send_packet(int sock, char *packet, int size, struct addrinfo *dest,
-        uint32_t inter_packet_delay, struct timeval *sent);
+int get_packet_batch(int sock, struct batch_packet_t *packets, int count,
+        int *timeout);
+int send_packet_batch(int sock, struct batch_packet_t *packets, int count);
+void pacer_init(struct pacer_t *pacer, uint32_t interval, uint32_t burst);
+int pacer_get_batch(struct pacer_t *pacer, int max, int *delay);
+void pacer_wait(struct pacer_t *pacer);
+void pacer_sent(struct pacer_t *pacer, int count);
+int pacer_get_delay(struct pacer_t *pacer);
+double pacer_get_mean_gap(struct pacer_t *pacer);
+double pacer_get_mean_lateness(struct pacer_t *pacer);
+void pacer_report(struct pacer_t *pacer, char *name);
 char *address_to_name(struct addrinfo *address);
 int compare_addresses(const struct sockaddr *a,
         const struct sockaddr *b, int len);
@@ -96,6 +166,7 @@ int bind_socket_to_address(int sock, struct addrinfo *address);
 int bind_sockets_to_address(struct socket_t *sockets,
         struct addrinfo *sourcev4, struct addrinfo *sourcev6);
 int set_default_socket_options(struct socket_t *sockets);
+int set_tx_timestamp_socket_options(struct socket_t *sockets);
 int set_dscp_socket_options(struct socket_t *sockets, uint8_t dscp);
 int check_exists(char *path, int strict);
 int copy_address_to_protobuf(ProtobufCBinaryData *dst,
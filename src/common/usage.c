@@ -60,6 +60,8 @@ void print_package_version(char *prog) {
 void print_probe_usage(void) {
     fprintf(stderr, "  -Z, --interpacketgap <usec>    "
             "Minimum number of microseconds between packets\n");
+    fprintf(stderr, "  -B, --burst          <count>   "
+            "Packets that may be sent together when behind\n");
 }
 
 
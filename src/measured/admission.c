@@ -0,0 +1,436 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <inttypes.h>
+#include <libwandevent.h>
+
+#include "admission.h"
+#include "run.h"
+#include "watchdog.h"
+#include "modules.h"
+#include "debug.h"
+
+/* configured limits, unlimited if not set */
+static amp_admission_t *admission = NULL;
+static wand_event_handler_t *admission_ev_hdl = NULL;
+
+/* tests that are currently running */
+static test_slot_t *slots = NULL;
+static int slot_count = 0;
+static int slot_size = 0;
+static uint32_t next_slot_id = 1;
+
+/* tests that are waiting for a slot, oldest first */
+static deferred_test_t *queue = NULL;
+static int queue_count = 0;
+static int queue_size = 0;
+
+static struct wand_timer_t *retry_timer = NULL;
+static admission_stats_t stats;
+
+
+
+/*
+ * Get the current monotonic time. Can't use the libwandevent time here as
+ * it isn't updated while callbacks are running.
+ */
+static struct timeval get_monotonic_time(void) {
+    struct timespec ts;
+    struct timeval now;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now.tv_sec = ts.tv_sec;
+    now.tv_usec = ts.tv_nsec / 1000;
+
+    return now;
+}
+
+
+
+/*
+ * Find the per test concurrency limit for the given test, or 0 if there is
+ * no limit for this test.
+ */
+static int get_test_limit(test_type_t test_id) {
+    amp_test_limit_t *limit;
+
+    if ( admission == NULL || amp_tests[test_id] == NULL ) {
+        return 0;
+    }
+
+    for ( limit = admission->limits; limit != NULL; limit = limit->next ) {
+        if ( strcmp(limit->name, amp_tests[test_id]->name) == 0 ) {
+            return limit->max_running;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Release any slots held by tests that must have finished by now. The test
+ * watchdog will have killed anything that has run for this long, even if
+ * we never heard about it finishing.
+ */
+static void expire_test_slots(void) {
+    struct timeval now = get_monotonic_time();
+    int i = 0;
+
+    while ( i < slot_count ) {
+        if ( timercmp(&slots[i].expire, &now, <) ) {
+            Log(LOG_DEBUG, "Releasing slot for test run %" PRIu32
+                    " after watchdog timeout", slots[i].id);
+            slots[i] = slots[--slot_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+
+
+/*
+ * Check if there is a free slot to run a test of the given type.
+ */
+static int has_free_slot(test_type_t test_id) {
+    int limit = get_test_limit(test_id);
+    int running = 0;
+    int i;
+
+    if ( admission != NULL && admission->max_running > 0 &&
+            slot_count >= admission->max_running ) {
+        return 0;
+    }
+
+    if ( limit == 0 ) {
+        return 1;
+    }
+
+    for ( i = 0; i < slot_count; i++ ) {
+        if ( slots[i].test_id == test_id ) {
+            running++;
+        }
+    }
+
+    return running < limit;
+}
+
+
+
+/*
+ * Start the test and record the slot that it is using. The slot is held for
+ * at most the maximum duration of the test, plus the watchdog grace period.
+ */
+static void start_test_in_slot(test_schedule_item_t *item) {
+    test_slot_t *slot;
+    uint32_t id;
+    pid_t pid;
+
+    id = next_slot_id++;
+
+    if ( (pid = fork_test(item, id)) < 0 ) {
+        return;
+    }
+
+    if ( slot_count == slot_size ) {
+        slot_size = slot_size == 0 ? 16 : slot_size * 2;
+        slots = realloc(slots, sizeof(test_slot_t) * slot_size);
+    }
+
+    slot = &slots[slot_count++];
+    slot->id = id;
+    slot->pid = pid;
+    slot->test_id = item->test_id;
+    slot->expire = get_monotonic_time();
+    slot->expire.tv_sec += amp_tests[item->test_id]->max_duration +
+        WATCHDOG_GRACE_PERIOD;
+
+    stats.started++;
+}
+
+
+
+static void retry_deferred_tests(wand_event_handler_t *ev_hdl, void *data);
+
+/*
+ * Start as many of the waiting tests as there are free slots for, oldest
+ * first. Tests that are limited by their per test limit don't block other
+ * types of test from running.
+ */
+static void start_deferred_tests(void) {
+    struct timeval now, delay;
+    test_schedule_item_t *item;
+    uint64_t delay_us;
+    int i = 0;
+
+    expire_test_slots();
+
+    while ( i < queue_count ) {
+        if ( !has_free_slot(queue[i].item->test_id) ) {
+            i++;
+            continue;
+        }
+
+        item = queue[i].item;
+        now = get_monotonic_time();
+        timersub(&now, &queue[i].queued, &delay);
+
+        memmove(&queue[i], &queue[i + 1],
+                sizeof(deferred_test_t) * (queue_count - i - 1));
+        queue_count--;
+
+        delay_us = US_FROM_TV(delay);
+        stats.total_delay += delay_us;
+        if ( delay_us > stats.max_delay ) {
+            stats.max_delay = delay_us;
+        }
+
+        Log(LOG_DEBUG, "Starting deferred %s test after %" PRIu64 "us",
+                amp_tests[item->test_id]->name, delay_us);
+
+        start_test_in_slot(item);
+    }
+
+    /* tests are still waiting, make sure we try again in case slots expire */
+    if ( queue_count > 0 && retry_timer == NULL && admission_ev_hdl ) {
+        retry_timer = wand_add_timer(admission_ev_hdl, DEFERRED_RETRY_INTERVAL,
+                0, NULL, retry_deferred_tests);
+    }
+}
+
+
+
+/*
+ * Periodically try to start deferred tests, in case slots held by tests we
+ * didn't hear finish have timed out.
+ */
+static void retry_deferred_tests(__attribute__((unused))wand_event_handler_t
+        *ev_hdl, __attribute__((unused))void *data) {
+    retry_timer = NULL;
+    start_deferred_tests();
+}
+
+
+
+/*
+ * Set the concurrency limits for scheduled tests. Passing NULL removes all
+ * the limits.
+ */
+void set_admission_config(wand_event_handler_t *ev_hdl,
+        amp_admission_t *config) {
+
+    admission_ev_hdl = ev_hdl;
+    admission = config;
+
+    if ( admission != NULL && admission->max_queue > queue_size ) {
+        queue_size = admission->max_queue;
+        queue = realloc(queue, sizeof(deferred_test_t) * queue_size);
+    }
+
+    memset(&stats, 0, sizeof(stats));
+}
+
+
+
+/*
+ * Free the concurrency limit configuration.
+ */
+void free_admission_config(amp_admission_t *config) {
+    amp_test_limit_t *limit;
+
+    if ( config == NULL ) {
+        return;
+    }
+
+    if ( config == admission ) {
+        admission = NULL;
+    }
+
+    while ( config->limits != NULL ) {
+        limit = config->limits;
+        config->limits = limit->next;
+        free(limit->name);
+        free(limit);
+    }
+
+    free(config);
+}
+
+
+
+/*
+ * Start a scheduled test if there is a free slot for it, otherwise add it to
+ * the queue to start when a slot becomes available.
+ */
+void admit_scheduled_test(test_schedule_item_t *item) {
+    int i;
+
+    assert(item);
+
+    expire_test_slots();
+
+    /* only start straight away if nothing of this type is already waiting */
+    for ( i = 0; i < queue_count; i++ ) {
+        if ( queue[i].item->test_id == item->test_id ) {
+            break;
+        }
+    }
+
+    if ( i == queue_count && has_free_slot(item->test_id) ) {
+        start_test_in_slot(item);
+        return;
+    }
+
+    /* the previous run of this test is still waiting, don't queue it twice */
+    for ( i = 0; i < queue_count; i++ ) {
+        if ( queue[i].item == item ) {
+            Log(LOG_WARNING, "%s test still waiting from previous run, "
+                    "skipping this run", amp_tests[item->test_id]->name);
+            stats.dropped++;
+            return;
+        }
+    }
+
+    if ( admission == NULL || queue_count >= admission->max_queue ) {
+        Log(LOG_WARNING, "Too many tests waiting to run, skipping %s test",
+                amp_tests[item->test_id]->name);
+        stats.dropped++;
+        return;
+    }
+
+    Log(LOG_DEBUG, "Concurrency limit reached, deferring %s test",
+            amp_tests[item->test_id]->name);
+
+    queue[queue_count].item = item;
+    queue[queue_count].queued = get_monotonic_time();
+    queue_count++;
+    stats.deferred++;
+
+    start_deferred_tests();
+}
+
+
+
+/*
+ * Release the slot held by a test that measured forked directly.
+ */
+void release_test_slot_by_pid(pid_t pid) {
+    int i;
+
+    for ( i = 0; i < slot_count; i++ ) {
+        if ( slots[i].pid == pid ) {
+            slots[i] = slots[--slot_count];
+            start_deferred_tests();
+            return;
+        }
+    }
+}
+
+
+
+/*
+ * Release the slot held by a test that was started by a test runner.
+ */
+void release_test_slot_by_id(uint32_t id) {
+    int i;
+
+    for ( i = 0; i < slot_count; i++ ) {
+        if ( slots[i].id == id ) {
+            slots[i] = slots[--slot_count];
+            start_deferred_tests();
+            return;
+        }
+    }
+}
+
+
+
+/*
+ * Remove a test from the queue of deferred tests, it is being removed from
+ * the schedule and will be freed.
+ */
+void cancel_deferred_test(test_schedule_item_t *item) {
+    int i = 0;
+
+    while ( i < queue_count ) {
+        if ( queue[i].item == item ) {
+            memmove(&queue[i], &queue[i + 1],
+                    sizeof(deferred_test_t) * (queue_count - i - 1));
+            queue_count--;
+        } else {
+            i++;
+        }
+    }
+}
+
+
+
+/*
+ * Get a copy of the admission counters.
+ */
+void get_admission_stats(admission_stats_t *out) {
+    assert(out);
+    memcpy(out, &stats, sizeof(admission_stats_t));
+}
+
+
+
+/*
+ * Dump the current state of the concurrency limits for debug purposes.
+ */
+void dump_admission_stats(FILE *out) {
+    assert(out);
+
+    fprintf(out, "===== TEST CONCURRENCY =====\n");
+    fprintf(out, "running: %d/%d queued: %d/%d\n", slot_count,
+            admission ? admission->max_running : 0, queue_count,
+            admission ? admission->max_queue : 0);
+    fprintf(out, "started: %" PRIu64 " deferred: %" PRIu64 " dropped: %"
+            PRIu64 "\n", stats.started, stats.deferred, stats.dropped);
+    fprintf(out, "queue delay total: %" PRIu64 "us max: %" PRIu64 "us\n",
+            stats.total_delay, stats.max_delay);
+    fprintf(out, "\n");
+}
@@ -0,0 +1,115 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_ADMISSION_H
+#define _MEASURED_ADMISSION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <libwandevent.h>
+
+#include "schedule.h"
+
+/* default maximum number of tests that can be waiting to run */
+#define DEFAULT_DEFERRED_QUEUE_LENGTH 128
+/* how often to check if deferred tests can be run (in seconds) */
+#define DEFERRED_RETRY_INTERVAL 1
+
+/*
+ * Limit on how many of a particular test can run at the same time.
+ */
+typedef struct amp_test_limit {
+    char *name;                     /* name of the test being limited */
+    int max_running;                /* maximum concurrent instances */
+    struct amp_test_limit *next;
+} amp_test_limit_t;
+
+/*
+ * Concurrency limits for scheduled tests. A maximum of 0 means unlimited.
+ */
+typedef struct amp_admission {
+    int max_running;                /* maximum tests running at once */
+    int max_queue;                  /* maximum tests waiting for a slot */
+    amp_test_limit_t *limits;       /* per test limits, by name */
+} amp_admission_t;
+
+/*
+ * A running test, holding one of the available slots. The slot is released
+ * when the test is known to have finished, or once the watchdog would have
+ * killed it.
+ */
+typedef struct test_slot {
+    uint32_t id;                    /* unique id for this test run */
+    pid_t pid;                      /* pid if forked by measured, else 0 */
+    test_type_t test_id;            /* type of test running */
+    struct timeval expire;          /* latest time the test can finish */
+} test_slot_t;
+
+/*
+ * A scheduled test waiting for a slot to become free.
+ */
+typedef struct deferred_test {
+    test_schedule_item_t *item;     /* test to run */
+    struct timeval queued;          /* monotonic time it was deferred */
+} deferred_test_t;
+
+/*
+ * Counters describing how often tests were delayed by the limits.
+ */
+typedef struct admission_stats {
+    uint64_t started;               /* tests started */
+    uint64_t deferred;              /* tests that had to wait for a slot */
+    uint64_t dropped;               /* tests not run, the queue was full */
+    uint64_t total_delay;           /* total time deferred tests waited (us) */
+    uint64_t max_delay;             /* longest time a test waited (us) */
+} admission_stats_t;
+
+void set_admission_config(wand_event_handler_t *ev_hdl,
+        amp_admission_t *admission);
+void free_admission_config(amp_admission_t *admission);
+void admit_scheduled_test(test_schedule_item_t *item);
+void release_test_slot_by_pid(pid_t pid);
+void release_test_slot_by_id(uint32_t id);
+void cancel_deferred_test(test_schedule_item_t *item);
+void get_admission_stats(admission_stats_t *stats);
+void dump_admission_stats(FILE *out);
+
+#endif
@@ -41,26 +41,119 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <pthread.h>
 #include <assert.h>
 #include <errno.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include "asn.h"
 #include "asnsock.h"
+#include "asnstore.h"
+#include "asntable.h"
+#include "whoissession.h"
 #include "ampresolv.h"
 #include "debug.h"
 
+/* the cache shared by all the asn threads */
+static struct amp_asn_info *asn_cache = NULL;
+/* counters describing the cache, protected by the cache mutex */
+static asn_cache_stats_t stats;
+
+/* prefixes with stale entries, waiting to be refreshed in the background */
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+static struct iptrie refresh_queue = { NULL, NULL, NULL };
+static uint32_t refresh_queued = 0;
+static pthread_t refresh_thread;
+static int refresh_running = 0;
+static int refresh_stop = 0;
+
+/* snapshot of the cache that is saved to disk, if enabled */
+static char *snapshot_file = NULL;
+static uint32_t checkpoint_interval = 0;
+
+/* connection to the whois server shared by everything making lookups */
+static whois_session_t *whois_session = NULL;
+
+/* prefix to AS table loaded from a local file, replaced like the cache */
+static asn_table_t *prefix_table = NULL;
+static char *table_file = NULL;
+static uint32_t table_refresh = 0;
+
+/* offset applied to the clock, used by unit tests to expire entries */
+static int time_offset = 0;
+
+/* the ways a lookup can end, used to index the lookup counters */
+enum {
+    ASN_LOOKUP_MISS = 0,
+    ASN_LOOKUP_HIT,
+    ASN_LOOKUP_STALE,
+    ASN_LOOKUP_TABLE,
+    ASN_LOOKUP_RESULTS,
+};
+
+/*
+ * Lookups never need to take the cache mutex. Writers only ever add to the
+ * cache with copying inserts, which leave existing nodes unchanged, and the
+ * whole trie is only replaced when it is pruned or compacted. Each reading
+ * thread has a slot recording the epoch it started reading in (zero while it
+ * isn't reading), and a replaced trie is only freed once every reader has
+ * either finished or started again in a later epoch. The slot also holds the lookup
+ * counters for the thread, and is kept on its own cache line.
+ */
+struct asn_reader {
+    uint64_t epoch;
+    uint64_t lookups[ASN_LOOKUP_RESULTS];
+    int in_use;
+} __attribute__((aligned(64)));
+
+static struct asn_reader readers[ASN_CACHE_MAX_READERS];
+static __thread struct asn_reader *reader = NULL;
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static uint64_t current_epoch = 1;
+/* the same trie as the cache, loaded atomically by lookups */
+static struct iptrie *published = NULL;
+/* lookups made under the cache mutex when there are no free reader slots */
+static uint64_t locked_lookups[ASN_LOOKUP_RESULTS];
+
+/*
+ * Data that was replaced in a given epoch, waiting for the readers that might
+ * still be using it to finish. The list is protected by the cache mutex.
+ */
+struct asn_retired {
+    void *data;
+    void (*free_data)(void *data);
+    uint64_t epoch;
+    struct asn_retired *next;
+};
+static struct asn_retired *retired = NULL;
+
+/* set when the cache should be compacted, uses refresh_lock */
+static int compact_pending = 0;
+
+
+
+/*
+ * Get the current time, as used for cache expiry.
+ */
+static time_t get_asn_time(void) {
+    return time(NULL) + time_offset;
+}
+
 
 
 /*
- * Send back all the results of ASN resolution
+ * Queue a single ASN result to be sent back to the test process.
  */
 static int return_asn_list(iptrie_node_t *root, void *data) {
 
     int addrlen;
-    int fd = *(int*)data;
+    worker_buffer_t *output = (worker_buffer_t *)data;
 
     switch ( root->address->sa_family ) {
         case AF_INET: addrlen = sizeof(struct sockaddr_in); break;
@@ -69,165 +162,200 @@ static int return_asn_list(iptrie_node_t *root, void *data) {
                  return -1;
     };
 
-    if ( send(fd, &root->as, sizeof(root->as), MSG_NOSIGNAL) < 0 ) {
-        Log(LOG_WARNING, "Failed to return ASN number: %s", strerror(errno));
-        return -1;
-    }
+    worker_buffer_append(output, &root->as, sizeof(root->as));
+    worker_buffer_append(output, &root->prefix, sizeof(root->prefix));
+    worker_buffer_append(output, &root->address->sa_family, sizeof(uint16_t));
+    worker_buffer_append(output, root->address, addrlen);
 
-    if ( send(fd, &root->prefix, sizeof(root->prefix), MSG_NOSIGNAL) < 0 ) {
-        Log(LOG_WARNING, "Failed to return prefix: %s", strerror(errno));
-        return -1;
-    }
+    return 0;
+}
 
-    if ( send(fd, &root->address->sa_family, sizeof(uint16_t),
-                MSG_NOSIGNAL) < 0 ) {
-        Log(LOG_WARNING, "Failed to return family: %s", strerror(errno));
-        return -1;
-    }
 
-    if ( send(fd, root->address, addrlen, MSG_NOSIGNAL) < 0 ) {
-        Log(LOG_WARNING, "Failed to return address: %s", strerror(errno));
-        return -1;
+
+/*
+ * Add the prefix containing an address to the queue of entries that should
+ * be refreshed in the background. Each prefix is only queued once.
+ */
+static void queue_refresh(struct sockaddr *address) {
+    uint8_t prefix = (address->sa_family == AF_INET) ? 24 : 64;
+
+    pthread_mutex_lock(&refresh_lock);
+    if ( refresh_queued < ASN_REFRESH_MAX_QUEUE &&
+            iptrie_lookup(&refresh_queue, address) == NULL ) {
+        iptrie_add(&refresh_queue, address, prefix, 0);
+        refresh_queued++;
+        pthread_cond_signal(&refresh_cond);
     }
+    pthread_mutex_unlock(&refresh_lock);
+}
 
-    return 0;
+
+
+/*
+ * Give up a reader slot when the thread that was using it exits. The
+ * counters are kept, the next thread to claim the slot adds to them.
+ */
+static void release_asn_reader(void *data) {
+    struct asn_reader *slot = (struct asn_reader *)data;
+
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
 }
 
 
 
 /*
- * Write an IP address in plain text to the socket connected to the whois
- * server, asking it to look up the AS number.
+ * Create the key used to release reader slots as threads exit.
  */
-static int write_asn_request(int fd, struct sockaddr *address) {
-    char addrstr[INET6_ADDRSTRLEN + 1];
-    unsigned int sent, left;
-    int bytes;
-    void *addrptr;
+static void create_reader_key(void) {
+    pthread_key_create(&reader_key, release_asn_reader);
+}
 
-    Log(LOG_DEBUG, "Sending whois request");
 
-    /* convert IP address into a string for the query */
-    switch ( address->sa_family ) {
-        case AF_INET: addrptr = &((struct sockaddr_in*)address)->sin_addr;
-                      break;
-        case AF_INET6: addrptr = &((struct sockaddr_in6*)address)->sin6_addr;
-                       break;
-        default: Log(LOG_WARNING, "Invalid address family"); return -1;
-    };
 
-    inet_ntop(address->sa_family, addrptr, addrstr, INET6_ADDRSTRLEN);
+/*
+ * Get the reader slot belonging to this thread, claiming a free one the
+ * first time the thread reads the cache. Returns NULL if they are all taken.
+ */
+static struct asn_reader *get_asn_reader(void) {
+    int expected;
+    int i;
 
-    /* need a newline between addresses, null terminate too */
-    addrstr[strlen(addrstr) + 1] = '\0';
-    addrstr[strlen(addrstr)] = '\n';
+    if ( reader != NULL ) {
+        return reader;
+    }
 
-    sent = 0;
-    left = strlen(addrstr);
+    pthread_once(&reader_once, create_reader_key);
 
-    /* deal with annoying partial sends, make sure the whole buffer goes */
-    while ( sent < strlen(addrstr) ) {
-        if ( (bytes = send(fd, addrstr + sent, left, 0)) < 0 ) {
-            Log(LOG_WARNING, "Error writing to whois socket: %s",
-                    strerror(errno));
-            return -1;
+    for ( i = 0; i < ASN_CACHE_MAX_READERS; i++ ) {
+        expected = 0;
+        if ( __atomic_compare_exchange_n(&readers[i].in_use, &expected, 1, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) ) {
+            reader = &readers[i];
+            pthread_setspecific(reader_key, reader);
+            return reader;
         }
-        sent += bytes;
-        left -= bytes;
     }
 
-    return 0;
+    return NULL;
 }
 
 
 
 /*
- * Read the available ASN data (up to one less than the available
- * space, so we have room to null terminate the buffer).
+ * Find the ASN for an address in the prefix table or a copy of the cache,
+ * returning which of them it was found in (if any). Expired cache entries
+ * are still used for a while, but entries that expired too long ago aren't.
  */
-static int read_asn_request(int fd, char *buffer, int buflen, int *offset) {
-    int bytes;
+static int lookup_asn(struct iptrie *trie, asn_table_t *table,
+        struct sockaddr *address, time_t now, int64_t *asn) {
+    iptrie_node_t *node;
 
-    if ( (bytes = recv(fd, buffer + *offset, buflen - *offset - 1, 0)) < 1 ) {
-        /* error or end of file */
-        if ( bytes == 0 ) {
-            Log(LOG_DEBUG, "Finished receiving data from whois server");
-        } else {
-            Log(LOG_WARNING, "Error receiving data from whois server: %s",
-                    strerror(errno));
-        }
-        return -1;
+    /* the prefix table is complete, no need to ever ask whois about these */
+    if ( table != NULL && (*asn = asn_table_lookup(table, address)) >= 0 ) {
+        return ASN_LOOKUP_TABLE;
     }
 
-    *offset += bytes;
+    if ( trie == NULL || (node = iptrie_lookup(trie, address)) == NULL ||
+            (node->expires > 0 && now > node->expires + ASN_CACHE_MAX_STALE) ) {
+        return ASN_LOOKUP_MISS;
+    }
 
-    /*
-     * We use string functions looking for newlines in the buffer,
-     * so null terminate it in case we end up travelling off the end.
-     */
-    buffer[*offset] = '\0';
+    *asn = node->as;
 
-    return 0;
+    if ( node->expires > 0 && now >= node->expires ) {
+        return ASN_LOOKUP_STALE;
+    }
+
+    return ASN_LOOKUP_HIT;
 }
 
 
 
 /*
- *
+ * Look up an address in the cache without taking any locks. The epoch is
+ * announced before the trie is loaded, so the refresh thread can't free it
+ * until the reader is finished with it, even if it is replaced.
  */
-static int check_whois_connection(int *whois_fd) {
-    /* if we haven't already tried, connect to the whois server */
-    if ( *whois_fd == -1 ) {
-        *whois_fd = connect_to_whois_server();
-    }
+static int lookup_asn_published(struct asn_reader *slot,
+        struct sockaddr *address, time_t now, int64_t *asn) {
+    int found;
 
-    /* we've tried and failed to connect, don't bother any more */
-    if ( *whois_fd < 0 ) {
-        Log(LOG_DEBUG, "whois connection unavailable, ignoring");
-        return -1;
-    }
+    __atomic_store_n(&slot->epoch,
+            __atomic_load_n(&current_epoch, __ATOMIC_ACQUIRE),
+            __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-    return 0;
+    found = lookup_asn(__atomic_load_n(&published, __ATOMIC_ACQUIRE),
+            __atomic_load_n(&prefix_table, __ATOMIC_ACQUIRE), address, now,
+            asn);
+
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+
+    /* only this thread writes to the slot counters */
+    __atomic_store_n(&slot->lookups[found], slot->lookups[found] + 1,
+            __ATOMIC_RELAXED);
+
+    return found;
 }
 
 
 
 /*
- * TODO be smarter about this, we don't need to dump the whole thing
+ * Look up an address in the cache itself while holding the cache mutex,
+ * for threads that couldn't get a reader slot.
  */
-static void check_refresh_cache(struct amp_asn_info *info) {
+static int lookup_asn_locked(struct amp_asn_info *info,
+        struct sockaddr *address, time_t now, int64_t *asn) {
+    int found;
+
     pthread_mutex_lock(info->mutex);
-    if ( time(NULL) > *info->refresh ) {
-        Log(LOG_DEBUG, "Clearing ASN cache");
-        iptrie_clear(info->trie);
-        *info->refresh = time(NULL) + MIN_ASN_CACHE_REFRESH +
-            (rand() % MAX_ASN_CACHE_REFRESH_OFFSET);
-        Log(LOG_DEBUG, "Next refresh at %d", *info->refresh);
-    }
+    found = lookup_asn(info->trie, prefix_table, address, now, asn);
+    locked_lookups[found]++;
     pthread_mutex_unlock(info->mutex);
+
+    return found;
 }
 
 
 
 /*
- * Try to look up the ASN for an address in the local cache.
+ * Try to look up the ASN for an address in the local prefix table or the
+ * cache. Cache entries that have expired are still used, but are queued to
+ * be refreshed so that the cache stays warm. Entries that expired too long
+ * ago are ignored.
  */
 static int check_asn_cache(struct amp_asn_info *info, struct iptrie *result,
         struct sockaddr *address) {
-    int asn;
+    struct asn_reader *slot;
+    time_t now = get_asn_time();
+    int64_t asn = -1;
     int prefix;
+    int found;
 
     Log(LOG_DEBUG, "Checking ASN cache for address");
 
-    pthread_mutex_lock(info->mutex);
-    if ( (asn = iptrie_lookup_as(info->trie, address)) < 0 ) {
-        pthread_mutex_unlock(info->mutex);
-        Log(LOG_DEBUG, "Address not found in ASN cache");
-        return -1;
+    if ( (slot = get_asn_reader()) != NULL ) {
+        found = lookup_asn_published(slot, address, now, &asn);
+    } else {
+        found = lookup_asn_locked(info, address, now, &asn);
     }
-    pthread_mutex_unlock(info->mutex);
 
-    Log(LOG_DEBUG, "Address found in ASN cache");
+    switch ( found ) {
+        case ASN_LOOKUP_MISS:
+            Log(LOG_DEBUG, "Address not found in ASN cache");
+            return -1;
+        case ASN_LOOKUP_TABLE:
+            Log(LOG_DEBUG, "Address found in ASN prefix table");
+            break;
+        case ASN_LOOKUP_STALE:
+            Log(LOG_DEBUG, "Address found in ASN cache (stale)");
+            queue_refresh(address);
+            break;
+        default:
+            Log(LOG_DEBUG, "Address found in ASN cache");
+            break;
+    };
 
     if ( address->sa_family == AF_INET ) {
         prefix = 24;
@@ -243,240 +371,811 @@ static int check_asn_cache(struct amp_asn_info *info, struct iptrie *result,
 
 
 /*
- * Read all the addresses from the local socket (from an AMP test) and build
- * them into a trie.
+ * Count a cache entry.
  */
-static int fill_request_trie(int fd, struct iptrie *requests) {
-    fd_set readset;
-    int ready;
-    struct sockaddr_storage addr;
-    int length = 0;
-    void *target = NULL;
-    int prefix;
-    struct timeval timeout;
-    int bytes;
+static int count_asn_entry(__attribute__((unused))iptrie_node_t *node,
+        void *data) {
+    (*(uint32_t *)data)++;
+    return 0;
+}
+
 
-    while ( 1 ) {
-        do {
-            FD_ZERO(&readset);
 
-            /* just in case the test process talking to us gets killed */
-            timeout.tv_sec = 10;
-            timeout.tv_usec = 0;
+/*
+ * Free a trie that has been replaced as the cache.
+ */
+static void free_replaced_trie(void *data) {
+    iptrie_clear((struct iptrie *)data);
+    free(data);
+}
 
-            /* read addresses to lookup from this descriptor */
-            FD_SET(fd, &readset);
 
-            ready = select(fd + 1, &readset, NULL, NULL, &timeout);
-        } while ( ready < 0 && errno == EINTR );
 
-        if ( ready == 0 ) {
-            Log(LOG_WARNING, "Timeout during select() for ASN data");
-            return -1;
+/*
+ * Free a replaced prefix table.
+ */
+static void free_replaced_table(void *data) {
+    free_asn_table((asn_table_t *)data);
+}
+
+
+
+/*
+ * Hold on to data that readers might still be using until they are done
+ * with it. This must be called with the cache mutex held, after the data
+ * has been replaced, so that the epoch it is retired in is a later one.
+ */
+static void retire_asn_data(void *data, void (*free_data)(void *data)) {
+    struct asn_retired *item;
+
+    if ( data == NULL ) {
+        return;
+    }
+
+    item = malloc(sizeof(struct asn_retired));
+    item->data = data;
+    item->free_data = free_data;
+    item->epoch = __atomic_add_fetch(&current_epoch, 1, __ATOMIC_SEQ_CST);
+    item->next = retired;
+    retired = item;
+}
+
+
+
+/*
+ * Free any retired data that no reader can still be using, because every
+ * reader is either idle or started reading after it was replaced. Returns
+ * the number of items that are still waiting.
+ */
+static int reclaim_asn_data(struct amp_asn_info *info) {
+    struct asn_retired *item, **prev, *done = NULL;
+    uint64_t oldest = UINT64_MAX;
+    uint64_t epoch;
+    int waiting = 0;
+    int i;
+
+    /* nothing can be retired while the readers are being checked */
+    pthread_mutex_lock(info->mutex);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for ( i = 0; i < ASN_CACHE_MAX_READERS; i++ ) {
+        epoch = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+        if ( epoch != 0 && epoch < oldest ) {
+            oldest = epoch;
         }
+    }
 
-        if ( ready < 0 ) {
-            Log(LOG_WARNING, "Error in select() for ASN data: %s",
-                    strerror(errno));
-            return -1;
+    prev = &retired;
+    while ( (item = *prev) != NULL ) {
+        if ( item->epoch <= oldest ) {
+            *prev = item->next;
+            item->next = done;
+            done = item;
+        } else {
+            prev = &item->next;
+            waiting++;
         }
+    }
+    pthread_mutex_unlock(info->mutex);
 
-        if ( FD_ISSET(fd, &readset) ) {
-            /* read address family */
-            if ( recv(fd, &addr.ss_family, sizeof(uint16_t), 0) <= 0 ) {
-                Log(LOG_WARNING, "Error reading address family: %s",
-                        strerror(errno));
-                return -1;
-            }
+    while ( (item = done) != NULL ) {
+        done = item->next;
+        item->free_data(item->data);
+        free(item);
+    }
 
-            /* figure out how much we need to read to get the address */
-            switch ( addr.ss_family ) {
-                case AF_INET:
-                    length = sizeof(struct in_addr);
-                    target = &((struct sockaddr_in*)&addr)->sin_addr;
-                    prefix = 24;
-                    break;
-                case AF_INET6:
-                    length = sizeof(struct in6_addr);
-                    target = &((struct sockaddr_in6*)&addr)->sin6_addr;
-                    prefix = 64;
-                    break;
-                default:
-                    /* if it's not INET or INET6 assume it is the end marker */
-                    Log(LOG_DEBUG, "Got last address required for ASN lookups");
-                    return 0;
-            };
-
-            /* read the right number of bytes for the address */
-            if ( (bytes = recv(fd, target, length, 0)) <= 0 ) {
-                Log(LOG_WARNING, "Error reading address: %s", strerror(errno));
-                return -1;
-            }
+    return waiting;
+}
+
+
+
+/*
+ * Swap in a new trie as the cache. This must be called with the cache mutex
+ * held. Lookups might still be reading the old trie, so it is only freed
+ * once they have finished.
+ */
+static void replace_asn_trie(struct amp_asn_info *info, struct iptrie *trie) {
+    struct iptrie *old = info->trie;
+
+    info->trie = trie;
+    __atomic_store_n(&published, trie, __ATOMIC_RELEASE);
+    retire_asn_data(old, free_replaced_trie);
+}
 
-            Log(LOG_DEBUG, "Read %d bytes for address", bytes);
 
-            /* add the address to the trie to be looked up later */
-            iptrie_add(requests, (struct sockaddr*)&addr, prefix, 0);
+
+/*
+ * Check if enough of the cache has been replaced by copying inserts that it
+ * is worth compacting. This must be called with the cache mutex held.
+ */
+static int asn_cache_needs_compacting(struct amp_asn_info *info) {
+    uint64_t allocated, replaced;
+
+    iptrie_get_node_counts(info->trie, &allocated, &replaced);
+
+    return replaced >= ASN_CACHE_COMPACT_MIN_NODES &&
+        replaced >= allocated - replaced;
+}
+
+
+
+/*
+ * Replace the cache with a copy that only holds the nodes that are still in
+ * use. Nodes are never changed once they are in the cache and only this
+ * thread frees them, so the copy is made from a snapshot of the roots
+ * without holding the mutex. If new results were added while copying then
+ * the copy is thrown away and tried again, and the last attempt is made with
+ * the mutex held so that it always finishes.
+ */
+static void compact_asn_cache(struct amp_asn_info *info) {
+    struct iptrie snapshot;
+    struct iptrie *copy;
+    int attempt;
+
+    for ( attempt = 0; attempt < ASN_CACHE_COMPACT_ATTEMPTS; attempt++ ) {
+        pthread_mutex_lock(info->mutex);
+        snapshot = *info->trie;
+        pthread_mutex_unlock(info->mutex);
+
+        copy = calloc(1, sizeof(struct iptrie));
+        iptrie_copy(copy, &snapshot);
+
+        pthread_mutex_lock(info->mutex);
+        if ( info->trie->ipv4 == snapshot.ipv4 &&
+                info->trie->ipv6 == snapshot.ipv6 ) {
+            replace_asn_trie(info, copy);
+            stats.compactions++;
+            pthread_mutex_unlock(info->mutex);
+            return;
         }
+        pthread_mutex_unlock(info->mutex);
+
+        free_replaced_trie(copy);
     }
 
-    /* never reached */
-    Log(LOG_WARNING, "Broke out of fill_request_trie() loop unexpectedly");
-    return -1;
+    copy = calloc(1, sizeof(struct iptrie));
+    pthread_mutex_lock(info->mutex);
+    iptrie_copy(copy, info->trie);
+    replace_asn_trie(info, copy);
+    stats.compactions++;
+    pthread_mutex_unlock(info->mutex);
 }
 
 
 
-static void *amp_asn_worker_thread(void *thread_data) {
-    struct amp_asn_info *info = (struct amp_asn_info*)thread_data;
-    struct iptrie result = { NULL, NULL };
-    struct iptrie requests = { NULL, NULL };
+/*
+ * Called by the whois session after new results have been added to the
+ * cache. Ask the refresh thread to compact the cache if too much of it has
+ * been replaced.
+ */
+static void check_asn_cache_garbage(void) {
+    int compact;
 
-    fd_set readset, writeset;
-    int whois_fd = -1;
-    int ready;
-    int offset = 0;
-    int buflen = 1024;//XXX define? and bigger
-    char *buffer = calloc(1, buflen);
-    int outstanding = 0;
-    struct timeval timeout;
-    iplist_t *list;
+    if ( asn_cache == NULL ) {
+        return;
+    }
 
-    Log(LOG_DEBUG, "Starting new asn resolution thread");
+    pthread_mutex_lock(asn_cache->mutex);
+    compact = asn_cache_needs_compacting(asn_cache);
+    pthread_mutex_unlock(asn_cache->mutex);
 
-    /* periodically clear out the cache */
-    check_refresh_cache(info);
+    if ( compact ) {
+        pthread_mutex_lock(&refresh_lock);
+        compact_pending = 1;
+        pthread_cond_signal(&refresh_cond);
+        pthread_mutex_unlock(&refresh_lock);
+    }
+}
 
-    /* read all the addresses from the socket and build a trie from them */
-    if ( fill_request_trie(info->fd, &requests) < 0 ) {
-        Log(LOG_WARNING, "asn resolution thread failed to create request trie");
-        goto end;
+
+
+/*
+ * Look up all the queued prefixes using the shared whois session, which
+ * updates the cache (with new expiry times) as the answers arrive.
+ */
+static void refresh_asn_entries(struct amp_asn_info *info,
+        struct iptrie *pending, uint32_t count) {
+    struct iptrie result = { NULL, NULL, NULL };
+    whois_waiter_t *waiter;
+    uint32_t answered = 0;
+
+    Log(LOG_DEBUG, "Refreshing %d stale ASN cache entries", count);
+
+    if ( whois_session != NULL &&
+            (waiter = whois_session_lookup(whois_session, pending)) != NULL ) {
+        whois_waiter_wait(waiter, ASN_REFRESH_TIMEOUT);
+        whois_waiter_collect(waiter, &result);
+        whois_waiter_release(waiter);
+        iptrie_on_all_leaves(&result, count_asn_entry, &answered);
+        iptrie_clear(&result);
     }
 
-    /* look up all the addresses in the cache or the whois server */
-    for ( list = iptrie_to_list(&requests), outstanding = 0;
-            list != NULL || outstanding > 0; /* no increment statement*/ ) {
+    if ( answered > count ) {
+        answered = count;
+    }
 
-        if ( list ) {
-            /* first try to find address in cache */
-            if ( check_asn_cache(info, &result, list->address) == 0 ) {
-                list = list->next;
-                continue;
-            }
+    pthread_mutex_lock(info->mutex);
+    stats.refreshed += answered;
+    stats.refresh_failures += count - answered;
+    pthread_mutex_unlock(info->mutex);
+}
+
+
+
+/*
+ * Add a cache entry to the new trie if it is fresh enough to keep.
+ */
+struct prune_data {
+    struct iptrie *trie;
+    time_t cutoff;
+    uint32_t kept;
+    uint32_t removed;
+};
+
+static int keep_fresh_entry(iptrie_node_t *node, void *data) {
+    struct prune_data *prune = (struct prune_data *)data;
+
+    if ( node->expires > 0 && node->expires < prune->cutoff ) {
+        prune->removed++;
+        return 0;
+    }
+
+    if ( prune->trie ) {
+        iptrie_add_expiring(prune->trie, node->address, node->prefix,
+                node->as, node->expires);
+    }
+    prune->kept++;
+
+    return 0;
+}
+
+
+
+/*
+ * Remove all the entries that expired too long ago to be used, so that
+ * addresses that are never seen again don't stay in the cache forever.
+ * Lookups might be reading the cache, so it is rebuilt and swapped rather
+ * than changed in place. Returns the number of entries removed.
+ */
+static uint32_t prune_asn_cache(struct amp_asn_info *info) {
+    struct prune_data prune;
+
+    memset(&prune, 0, sizeof(prune));
+    prune.cutoff = get_asn_time() - ASN_CACHE_MAX_STALE;
+
+    pthread_mutex_lock(info->mutex);
+
+    /* count first, most of the time there will be nothing to remove */
+    iptrie_on_all_leaves(info->trie, keep_fresh_entry, &prune);
+
+    if ( prune.removed > 0 ) {
+        Log(LOG_DEBUG, "Pruning %d stale entries from ASN cache",
+                prune.removed);
+        prune.trie = calloc(1, sizeof(struct iptrie));
+        prune.kept = 0;
+        prune.removed = 0;
+        iptrie_on_all_leaves(info->trie, keep_fresh_entry, &prune);
+        replace_asn_trie(info, prune.trie);
+        stats.pruned += prune.removed;
+    }
 
-            /* if not in cache, check if can connect to the whois server */
-            if ( check_whois_connection(&whois_fd) < 0 ) {
-                list = list->next;
-                continue;
+    pthread_mutex_unlock(info->mutex);
+
+    return prune.removed;
+}
+
+
+
+/*
+ * Save the cache to disk so that it can be loaded again after a restart.
+ * Entries that are too stale to be used are left out.
+ */
+static int checkpoint_asn_cache(struct amp_asn_info *info) {
+    int count;
+
+    if ( snapshot_file == NULL ) {
+        return -1;
+    }
+
+    count = save_asn_snapshot(info, snapshot_file,
+            get_asn_time() - ASN_CACHE_MAX_STALE);
+
+    pthread_mutex_lock(info->mutex);
+    if ( count < 0 ) {
+        stats.checkpoint_failures++;
+    } else {
+        stats.checkpoints++;
+    }
+    pthread_mutex_unlock(info->mutex);
+
+    return count;
+}
+
+
+
+/*
+ * Load the prefix table again if the file has changed since it was last
+ * loaded. The old table is kept if the new one can't be read.
+ */
+static void reload_asn_table(struct amp_asn_info *info, int force) {
+    struct stat statbuf;
+    asn_table_t *table, *old;
+
+    if ( table_file == NULL ) {
+        return;
+    }
+
+    if ( stat(table_file, &statbuf) < 0 ) {
+        Log(LOG_WARNING, "Failed to stat ASN prefix table %s: %s", table_file,
+                strerror(errno));
+        return;
+    }
+
+    old = __atomic_load_n(&prefix_table, __ATOMIC_ACQUIRE);
+    if ( !force && old != NULL && statbuf.st_mtime == old->mtime ) {
+        return;
+    }
+
+    /* build the new table without holding up any lookups */
+    if ( (table = load_asn_table(table_file)) == NULL ) {
+        pthread_mutex_lock(info->mutex);
+        stats.table_failures++;
+        pthread_mutex_unlock(info->mutex);
+        return;
+    }
+
+    /* lookups may still be using the old table, it can't be freed yet */
+    pthread_mutex_lock(info->mutex);
+    retire_asn_data(__atomic_exchange_n(&prefix_table, table,
+                __ATOMIC_ACQ_REL), free_replaced_table);
+    stats.table_loads++;
+    pthread_mutex_unlock(info->mutex);
+}
+
+
+
+/*
+ * Refresh stale cache entries in the background, batching together all the
+ * prefixes that are queued within a short time of each other. Also compact
+ * the cache when updates have replaced too much of it, and prune and
+ * checkpoint the cache, and reload the prefix table, occasionally.
+ */
+static void *amp_asn_refresh_thread(void *data) {
+    struct amp_asn_info *info = (struct amp_asn_info *)data;
+    struct iptrie pending;
+    struct timespec deadline;
+    time_t next_prune = get_asn_time() + ASN_CACHE_PRUNE_INTERVAL;
+    time_t next_checkpoint = get_asn_time() + checkpoint_interval;
+    time_t next_table = get_asn_time() + table_refresh;
+    uint32_t idle = ASN_CACHE_PRUNE_INTERVAL;
+    uint32_t count;
+    int waiting = 0;
+    int compact;
+
+    /* checkpoints may need to happen more often than pruning */
+    if ( snapshot_file != NULL && checkpoint_interval > 0 &&
+            checkpoint_interval < idle ) {
+        idle = checkpoint_interval;
+    }
+
+    if ( table_file != NULL && table_refresh > 0 && table_refresh < idle ) {
+        idle = table_refresh;
+    }
+
+    pthread_mutex_lock(&refresh_lock);
+    while ( !refresh_stop ) {
+        memset(&pending, 0, sizeof(pending));
+        count = 0;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+
+        if ( compact_pending ) {
+            /* replaced nodes are using too much memory, don't wait */
+        } else if ( refresh_queued == 0 ) {
+            /*
+             * Nothing to do, but wake up in time to prune the cache, or
+             * sooner if old copies of the cache are waiting to be freed.
+             */
+            deadline.tv_sec += waiting ? ASN_REFRESH_DELAY : idle;
+            pthread_cond_timedwait(&refresh_cond, &refresh_lock, &deadline);
+        } else {
+            /* give other stale prefixes a chance to join this batch */
+            deadline.tv_sec += ASN_REFRESH_DELAY;
+            while ( !refresh_stop && pthread_cond_timedwait(&refresh_cond,
+                        &refresh_lock, &deadline) != ETIMEDOUT ) {
+                /* keep waiting */
             }
+
+            pending = refresh_queue;
+            count = refresh_queued;
+            memset(&refresh_queue, 0, sizeof(refresh_queue));
+            refresh_queued = 0;
         }
 
-        /* we have a connection, try looking up the ASN for the address */
-        do {
-            FD_ZERO(&readset);
-            FD_ZERO(&writeset);
+        if ( refresh_stop ) {
+            iptrie_clear(&pending);
+            break;
+        }
 
-            if ( outstanding > 0 ) {
-                FD_SET(whois_fd, &readset);
-            }
+        compact = compact_pending;
+        compact_pending = 0;
+        pthread_mutex_unlock(&refresh_lock);
 
-            if ( list ) {
-                FD_SET(whois_fd, &writeset);
-            }
+        if ( count > 0 ) {
+            refresh_asn_entries(info, &pending, count);
+            iptrie_clear(&pending);
+        }
 
-            /* it should never take 30s and we don't want to wait forever */
-            timeout.tv_sec = 30;
-            timeout.tv_usec = 0;
-            ready = select(whois_fd + 1, &readset, &writeset, NULL, &timeout);
-
-        } while ( ready < 0 && errno == EINTR );
-
-        /* error, close the whois connection and just use the cache */
-        if ( ready <= 0 ) {
-            if ( ready < 0 ) {
-                Log(LOG_WARNING,
-                        "Error while waiting for ASN data (r:%d w:%d): %s",
-                        outstanding, list ? 1 : 0, strerror(errno));
-            } else {
-                Log(LOG_WARNING,
-                        "Timeout while waiting for ASN data (r:%d w:%d)",
-                        outstanding, list ? 1 : 0);
+        /* pruning rebuilds the cache, which also compacts it */
+        if ( get_asn_time() >= next_prune ) {
+            if ( prune_asn_cache(info) > 0 ) {
+                compact = 0;
             }
-            close(whois_fd);
-            whois_fd = WHOIS_UNAVAILABLE;
-            if ( list ) list = list->next;
-            outstanding = 0;
-            continue;
+            next_prune = get_asn_time() + ASN_CACHE_PRUNE_INTERVAL;
         }
 
-        /* we can write a new request, do so */
-        if ( FD_ISSET(whois_fd, &writeset) ) {
+        if ( compact ) {
+            compact_asn_cache(info);
+        }
 
-            /* send the asn request to the whois server */
-            if ( write_asn_request(whois_fd, list->address) < 0 ) {
-                close(whois_fd);
-                whois_fd = WHOIS_UNAVAILABLE;
-                list = list->next;
-                outstanding = 0;
-                continue;
-            }
+        if ( snapshot_file != NULL && checkpoint_interval > 0 &&
+                get_asn_time() >= next_checkpoint ) {
+            checkpoint_asn_cache(info);
+            next_checkpoint = get_asn_time() + checkpoint_interval;
+        }
 
-            /* successfully sent, we expect to get a reply for it */
-            outstanding++;
-            list = list->next;
+        if ( table_file != NULL && table_refresh > 0 &&
+                get_asn_time() >= next_table ) {
+            reload_asn_table(info, 0);
+            next_table = get_asn_time() + table_refresh;
         }
 
-        /* here is a result we previously asked for, read it */
-        if ( FD_ISSET(whois_fd, &readset) ) {
+        waiting = reclaim_asn_data(info);
 
-            /* Read the available ASN data */
-            if ( read_asn_request(whois_fd, buffer, buflen, &offset) < 0 ) {
-                close(whois_fd);
-                whois_fd = WHOIS_UNAVAILABLE;
-                if ( list ) list = list->next;
-                outstanding = 0;
-                continue;
-            }
+        pthread_mutex_lock(&refresh_lock);
+    }
+    pthread_mutex_unlock(&refresh_lock);
+
+    return NULL;
+}
+
+
+
+/*
+ * Read all the complete addresses from the data sent by the test process
+ * and add them to the request trie. Returns 1 once the marker saying there
+ * are no more addresses has been read.
+ */
+static int parse_asn_requests(struct amp_asn_conn *state) {
+    struct sockaddr_storage addr;
+    uint16_t family;
+    size_t length;
+    void *target;
+    int prefix;
 
-            /* try to read any completed ASN results from the buffer */
-            process_buffer(&result, buffer, buflen, &offset, info,&outstanding);
+    while ( state->inlen >= sizeof(family) ) {
+        memcpy(&family, state->input, sizeof(family));
+
+        /* figure out how much we need to read to get the address */
+        switch ( family ) {
+            case AF_INET:
+                length = sizeof(struct in_addr);
+                target = &((struct sockaddr_in*)&addr)->sin_addr;
+                prefix = 24;
+                break;
+            case AF_INET6:
+                length = sizeof(struct in6_addr);
+                target = &((struct sockaddr_in6*)&addr)->sin6_addr;
+                prefix = 64;
+                break;
+            default:
+                /* if it's not INET or INET6 assume it is the end marker */
+                Log(LOG_DEBUG, "Got last address required for ASN lookups");
+                return 1;
+        };
+
+        if ( state->inlen < sizeof(family) + length ) {
+            return 0;
         }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.ss_family = family;
+        memcpy(target, state->input + sizeof(family), length);
+
+        /* add the address to the trie to be looked up later */
+        iptrie_add(&state->requests, (struct sockaddr*)&addr, prefix, 0);
+
+        length += sizeof(family);
+        memmove(state->input, state->input + length, state->inlen - length);
+        state->inlen -= length;
     }
 
-    if ( whois_fd != -1 ) {
-        close(whois_fd);
+    return 0;
+}
+
+
+
+/*
+ * Send as much of the reply as possible, closing the connection once it
+ * has all been sent.
+ */
+static int send_asn_reply(worker_conn_t *conn) {
+    struct amp_asn_conn *state = (struct amp_asn_conn *)conn->state;
+
+    switch ( worker_buffer_send(&state->output, conn->fd) ) {
+        case 0: return WORKER_CONN_KEEP;
+        case 1: Log(LOG_DEBUG, "Finished sending ASN results");
+                return WORKER_CONN_CLOSE;
+        default: Log(LOG_WARNING, "Failed to send ASN results: %s",
+                         strerror(errno));
+                 return WORKER_CONN_CLOSE;
+    };
+}
+
+
+
+/*
+ * Stop waiting on the whois session, and start sending all the results we
+ * have back to the test process.
+ */
+static int finish_asn_lookups(worker_conn_t *conn) {
+    struct amp_asn_conn *state = (struct amp_asn_conn *)conn->state;
+
+    if ( state->waiter != NULL ) {
+        whois_waiter_collect(state->waiter, &state->result);
+        whois_waiter_release(state->waiter);
+        state->waiter = NULL;
     }
+
+    conn->polling = 0;
+
     Log(LOG_DEBUG, "Got all responses, sending them back");
 
-    iptrie_on_all_leaves(&result, return_asn_list, &info->fd);
+    iptrie_on_all_leaves(&state->result, return_asn_list, &state->output);
+
+    state->state = ASN_SENDING;
+    conn->deadline = 0;
+
+    if ( worker_watch_fd(conn, conn->fd, EPOLLOUT) < 0 ) {
+        return WORKER_CONN_CLOSE;
+    }
+
+    return send_asn_reply(conn);
+}
+
+
+
+/*
+ * Check if the whois session has answered all our queries yet.
+ */
+static int asn_poll(worker_conn_t *conn) {
+    struct amp_asn_conn *state = (struct amp_asn_conn *)conn->state;
+
+    assert(state->state == ASN_QUERYING);
+
+    state->outstanding = whois_waiter_collect(state->waiter, &state->result);
+
+    if ( state->outstanding > 0 ) {
+        return WORKER_CONN_KEEP;
+    }
+
+    return finish_asn_lookups(conn);
+}
+
+
+
+/*
+ * Look up all the requested addresses in the cache, and ask the shared
+ * whois session about anything that isn't cached.
+ */
+static int start_asn_lookups(worker_conn_t *conn) {
+    struct amp_asn_conn *state = (struct amp_asn_conn *)conn->state;
+    struct iptrie missing = { NULL, NULL, NULL };
+    iplist_t *list;
+    int count = 0;
+
+    for ( list = iptrie_to_list(&state->requests); list != NULL;
+            list = list->next ) {
+        /* first try to find address in cache */
+        if ( check_asn_cache(state->info, &state->result,
+                    list->address) == 0 ) {
+            continue;
+        }
+
+        iptrie_add(&missing, list->address, list->prefix, 0);
+        count++;
+    }
+
+    if ( count > 0 && whois_session != NULL ) {
+        Log(LOG_DEBUG, "Asking whois session about %d addresses", count);
+        state->waiter = whois_session_lookup(whois_session, &missing);
+    }
+
+    iptrie_clear(&missing);
+
+    if ( state->waiter == NULL ) {
+        return finish_asn_lookups(conn);
+    }
+
+    /* the test process shouldn't send anything else, only watch for errors */
+    if ( worker_watch_fd(conn, conn->fd, 0) < 0 ) {
+        return finish_asn_lookups(conn);
+    }
+
+    state->state = ASN_QUERYING;
+    conn->polling = 1;
+    conn->deadline = worker_get_time() + ASN_WHOIS_TIMEOUT;
+
+    return asn_poll(conn);
+}
+
+
+
+/*
+ * Deal with activity on the connection to the test process.
+ */
+static int asn_ready(worker_conn_t *conn, int fd, uint32_t events) {
+    struct amp_asn_conn *state = (struct amp_asn_conn *)conn->state;
+    ssize_t bytes;
+
+    switch ( state->state ) {
+        case ASN_READING:
+            bytes = recv(fd, state->input + state->inlen,
+                    sizeof(state->input) - state->inlen, MSG_DONTWAIT);
+
+            if ( bytes < 0 && (errno == EAGAIN || errno == EINTR) ) {
+                return WORKER_CONN_KEEP;
+            }
+
+            if ( bytes <= 0 ) {
+                Log(LOG_WARNING, "Error reading address family: %s",
+                        bytes < 0 ? strerror(errno) : "connection closed");
+                return WORKER_CONN_CLOSE;
+            }
+
+            state->inlen += bytes;
+            conn->deadline = worker_get_time() + ASN_READ_TIMEOUT;
+
+            if ( parse_asn_requests(state) == 0 ) {
+                return WORKER_CONN_KEEP;
+            }
+
+            return start_asn_lookups(conn);
+
+        case ASN_QUERYING:
+            /* only errors are reported while querying, the test went away */
+            Log(LOG_WARNING, "Test went away while looking up ASNs");
+            return WORKER_CONN_CLOSE;
+
+        case ASN_SENDING:
+            if ( events & (EPOLLERR | EPOLLHUP) ) {
+                Log(LOG_WARNING, "Test went away before ASNs were sent");
+                return WORKER_CONN_CLOSE;
+            }
+            return send_asn_reply(conn);
+    };
+
+    return WORKER_CONN_CLOSE;
+}
+
+
+
+/*
+ * Give up waiting on the test process or the whois server.
+ */
+static int asn_expire(worker_conn_t *conn) {
+    struct amp_asn_conn *state = (struct amp_asn_conn *)conn->state;
+
+    if ( state->state == ASN_READING ) {
+        /* just in case the test process talking to us gets killed */
+        Log(LOG_WARNING, "Timeout waiting for ASN data");
+        return WORKER_CONN_CLOSE;
+    }
+
+    /* it should never take 30s, just use whatever results we have */
+    Log(LOG_WARNING, "Timeout while waiting for ASN data (outstanding:%d)",
+            state->outstanding);
+    return finish_asn_lookups(conn);
+}
+
+
+
+/*
+ * Set up the state for a new connection from a test process.
+ */
+static int asn_start(worker_conn_t *conn) {
+    struct amp_asn_conn *state;
+
+    Log(LOG_DEBUG, "Starting new asn resolution connection");
 
-end:
-    Log(LOG_DEBUG, "Tidying up after asn resolution thread");
+    state = calloc(1, sizeof(struct amp_asn_conn));
+    state->state = ASN_READING;
+    state->info = (struct amp_asn_info *)conn->service_data;
+    conn->state = state;
+    conn->deadline = worker_get_time() + ASN_READ_TIMEOUT;
+
+    return WORKER_CONN_KEEP;
+}
+
+
+
+/*
+ * Free the state for a finished connection.
+ */
+static void asn_finish(worker_conn_t *conn) {
+    struct amp_asn_conn *state = (struct amp_asn_conn *)conn->state;
+
+    if ( state == NULL ) {
+        return;
+    }
+
+    Log(LOG_DEBUG, "Tidying up after asn resolution connection");
+
+    /* the session still answers the queries, and caches the answers */
+    whois_waiter_release(state->waiter);
+
+    iptrie_clear(&state->requests);
+    iptrie_clear(&state->result);
+    worker_buffer_free(&state->output);
+    free(state);
+}
 
-    close(info->fd);
-    iptrie_clear(&requests);
-    iptrie_clear(&result);
-    free(thread_data);
-    free(buffer);
 
-    Log(LOG_DEBUG, "asn resolution thread completed, exiting");
 
-    pthread_exit(NULL);
+/*
+ * Start the pool of threads that answer ASN requests from test processes,
+ * sharing the ASN cache.
+ */
+worker_pool_t *start_asn_pool(struct amp_asn_info *info, int threads) {
+    worker_service_t service;
+
+    assert(info);
+
+    memset(&service, 0, sizeof(service));
+    service.name = "asn";
+    service.data = info;
+    service.shared_fd = -1;
+    service.poll_interval = ASN_POLL_INTERVAL;
+    service.start = asn_start;
+    service.ready = asn_ready;
+    service.poll = asn_poll;
+    service.expire = asn_expire;
+    service.finish = asn_finish;
+
+    /* one connection to the whois server is shared by everything */
+    if ( whois_session == NULL &&
+            (whois_session = whois_session_start(info,
+                check_asn_cache_garbage)) == NULL ) {
+        Log(LOG_WARNING, "Failed to start whois session");
+        return NULL;
+    }
+
+    /* stale entries are refreshed by their own thread, not the pool */
+    if ( !refresh_running ) {
+        refresh_stop = 0;
+        if ( pthread_create(&refresh_thread, NULL, amp_asn_refresh_thread,
+                    info) != 0 ) {
+            Log(LOG_WARNING, "Failed to start ASN refresh thread");
+            return NULL;
+        }
+        refresh_running = 1;
+    }
+
+    return create_worker_pool(&service, threads);
 }
 
 
 
 /*
  * Accept a new connection on the local autonomous system resolution socket
- * and spawn a new thread to deal with the queries from the test process.
+ * and hand it to one of the asn threads to deal with the queries from the
+ * test process.
  */
 void asn_socket_event_callback(
         __attribute__((unused))wand_event_handler_t *ev_hdl, int eventfd,
         void *data, __attribute__((unused))enum wand_eventtype_t ev) {
 
     int fd;
-    pthread_t thread;
-    struct amp_asn_info *info;
 
     Log(LOG_DEBUG, "Accepting for new asn connection");
 
@@ -488,63 +1187,310 @@ void asn_socket_event_callback(
 
     Log(LOG_DEBUG, "Accepted new asn connection on fd %d", fd);
 
-    info = calloc(1, sizeof(struct amp_asn_info));
-    info->trie = ((struct amp_asn_info*)data)->trie;
-    info->mutex = ((struct amp_asn_info*)data)->mutex;
-    info->refresh = ((struct amp_asn_info*)data)->refresh;
-    info->fd = fd;
-
-    /* create the thread and detach, we don't need to look after it */
-    pthread_create(&thread, NULL, amp_asn_worker_thread, info);
-    pthread_detach(thread);
+    if ( worker_pool_add_connection((worker_pool_t *)data, fd) < 0 ) {
+        Log(LOG_WARNING, "No asn threads available, closing connection");
+        close(fd);
+    }
 }
 
 
 
 /*
- *
+ * Create the ASN cache that will be shared by all the asn threads.
  */
 struct amp_asn_info* initialise_asn_info(void) {
     struct amp_asn_info *info;
+    int i;
 
     info = (struct amp_asn_info *) malloc(sizeof(struct amp_asn_info));
 
     info->fd = -1;
 
-    info->refresh = malloc(sizeof(time_t));
-    *info->refresh = time(NULL) + MIN_ASN_CACHE_REFRESH +
-        (rand() % MAX_ASN_CACHE_REFRESH_OFFSET);
-
-    Log(LOG_DEBUG, "ASN cache will be refreshed at %d", *info->refresh);
-
-    info->trie = malloc(sizeof(struct iptrie));
-    info->trie->ipv4 = NULL;
-    info->trie->ipv6 = NULL;
+    info->trie = calloc(1, sizeof(struct iptrie));
+    __atomic_store_n(&published, info->trie, __ATOMIC_RELEASE);
 
     info->mutex = malloc(sizeof(pthread_mutex_t));
     pthread_mutex_init(info->mutex, NULL);
 
+    memset(&stats, 0, sizeof(stats));
+    memset(locked_lookups, 0, sizeof(locked_lookups));
+    for ( i = 0; i < ASN_CACHE_MAX_READERS; i++ ) {
+        memset(readers[i].lookups, 0, sizeof(readers[i].lookups));
+    }
+    asn_cache = info;
+
     return info;
 }
 
 
 
 /*
- *
+ * Stop refreshing the ASN cache and free it.
  */
 void amp_asn_info_delete(struct amp_asn_info *info) {
     if ( info == NULL ) {
         return;
     }
 
+    if ( refresh_running ) {
+        pthread_mutex_lock(&refresh_lock);
+        refresh_stop = 1;
+        pthread_cond_signal(&refresh_cond);
+        pthread_mutex_unlock(&refresh_lock);
+
+        /* the refresh thread might be waiting on the session, stop it too */
+        whois_session_stop(whois_session);
+        pthread_join(refresh_thread, NULL);
+        refresh_running = 0;
+    }
+
+    whois_session_free(whois_session);
+    whois_session = NULL;
+
+    /* save everything we know, so we don't have to look it up again */
+    if ( snapshot_file != NULL ) {
+        checkpoint_asn_cache(info);
+        free(snapshot_file);
+        snapshot_file = NULL;
+    }
+
+    free(table_file);
+    table_file = NULL;
+
+    /* the asn threads should have stopped, so nobody is reading these */
+    pthread_mutex_lock(info->mutex);
+    retire_asn_data(__atomic_exchange_n(&prefix_table, NULL,
+                __ATOMIC_ACQ_REL), free_replaced_table);
+    __atomic_store_n(&published, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(info->mutex);
+
+    if ( reclaim_asn_data(info) > 0 ) {
+        Log(LOG_WARNING, "ASN cache still in use, not freeing old copies");
+    }
+
+    pthread_mutex_lock(&refresh_lock);
+    iptrie_clear(&refresh_queue);
+    refresh_queued = 0;
+    compact_pending = 0;
+    pthread_mutex_unlock(&refresh_lock);
+
+    if ( info == asn_cache ) {
+        asn_cache = NULL;
+    }
+
     pthread_mutex_lock(info->mutex);
     iptrie_clear(info->trie);
     pthread_mutex_unlock(info->mutex);
     pthread_mutex_destroy(info->mutex);
 
     if ( info->mutex ) free(info->mutex);
-    if ( info->refresh ) free(info->refresh);
     if ( info->trie ) free(info->trie);
 
     free(info);
 }
+
+
+
+/*
+ * Set where the ASN cache is saved on disk and how often, and load anything
+ * that was saved previously. This should be called before the cache is used.
+ */
+void set_asn_cache_config(struct amp_asn_info *info, amp_asn_cache_t *config) {
+    struct iptrie *loaded;
+    struct prune_data merge;
+    int count;
+
+    assert(info);
+
+    free(snapshot_file);
+    snapshot_file = NULL;
+    checkpoint_interval = 0;
+
+    free(table_file);
+    table_file = NULL;
+    table_refresh = 0;
+
+    /* a local prefix table can be used whether the cache is saved or not */
+    if ( config != NULL && config->table != NULL ) {
+        table_file = strdup(config->table);
+        table_refresh = config->table_refresh;
+        reload_asn_table(info, 1);
+    }
+
+    if ( config == NULL || !config->enabled || config->filename == NULL ) {
+        Log(LOG_DEBUG, "ASN cache will not be saved to disk");
+        return;
+    }
+
+    snapshot_file = strdup(config->filename);
+    checkpoint_interval = config->checkpoint;
+
+    /* load into a new trie, so lookups never see a partly loaded cache */
+    loaded = calloc(1, sizeof(struct iptrie));
+    count = load_asn_snapshot(loaded, snapshot_file,
+            get_asn_time() - ASN_CACHE_MAX_STALE);
+
+    if ( count > 0 ) {
+        pthread_mutex_lock(info->mutex);
+        /* anything already in the cache is newer than the snapshot */
+        memset(&merge, 0, sizeof(merge));
+        merge.trie = loaded;
+        iptrie_on_all_leaves(info->trie, keep_fresh_entry, &merge);
+        replace_asn_trie(info, loaded);
+        stats.loaded += count;
+        pthread_mutex_unlock(info->mutex);
+    } else {
+        free_replaced_trie(loaded);
+    }
+
+    Log(LOG_DEBUG, "Saving ASN cache to %s every %us", snapshot_file,
+            checkpoint_interval);
+}
+
+
+
+/*
+ * Free the ASN cache configuration.
+ */
+void free_asn_cache_config(amp_asn_cache_t *config) {
+    if ( config == NULL ) {
+        return;
+    }
+
+    free(config->filename);
+    free(config->table);
+    free(config);
+}
+
+
+
+/*
+ * Get a copy of the current ASN cache statistics.
+ */
+void get_asn_cache_stats(asn_cache_stats_t *out) {
+    uint64_t lookups[ASN_LOOKUP_RESULTS];
+    asn_table_t *table;
+    int i, j;
+
+    assert(out);
+
+    memset(out, 0, sizeof(*out));
+
+    if ( asn_cache == NULL ) {
+        return;
+    }
+
+    /* the table can't be freed while the mutex is held */
+    pthread_mutex_lock(asn_cache->mutex);
+    memcpy(out, &stats, sizeof(stats));
+    memcpy(lookups, locked_lookups, sizeof(lookups));
+    out->entries = 0;
+    iptrie_on_all_leaves(asn_cache->trie, count_asn_entry, &out->entries);
+    iptrie_get_node_counts(asn_cache->trie, &out->nodes, &out->replaced_nodes);
+    table = __atomic_load_n(&prefix_table, __ATOMIC_ACQUIRE);
+    out->table_prefixes = table ? table->prefixes : 0;
+    pthread_mutex_unlock(asn_cache->mutex);
+
+    /* each reader counts its own lookups */
+    for ( i = 0; i < ASN_CACHE_MAX_READERS; i++ ) {
+        for ( j = 0; j < ASN_LOOKUP_RESULTS; j++ ) {
+            lookups[j] += __atomic_load_n(&readers[i].lookups[j],
+                    __ATOMIC_RELAXED);
+        }
+    }
+
+    out->hits = lookups[ASN_LOOKUP_HIT] + lookups[ASN_LOOKUP_STALE];
+    out->stale_hits = lookups[ASN_LOOKUP_STALE];
+    out->misses = lookups[ASN_LOOKUP_MISS];
+    out->table_hits = lookups[ASN_LOOKUP_TABLE];
+
+    pthread_mutex_lock(&refresh_lock);
+    out->queued = refresh_queued;
+    pthread_mutex_unlock(&refresh_lock);
+}
+
+
+
+/*
+ * Dump the current state of the ASN cache for debug purposes.
+ */
+void dump_asn_cache_stats(FILE *out) {
+    whois_session_stats_t session;
+    asn_cache_stats_t current;
+    uint64_t lookups;
+
+    assert(out);
+
+    fprintf(out, "===== ASN CACHE =====\n");
+
+    get_asn_cache_stats(&current);
+    lookups = current.hits + current.misses;
+
+    fprintf(out, "Entries: %u, waiting for refresh: %u\n", current.entries,
+            current.queued);
+    fprintf(out, "Hits: %" PRIu64 " (%" PRIu64 " stale), misses: %" PRIu64
+            " (hit rate %.1f%%)\n", current.hits, current.stale_hits,
+            current.misses,
+            lookups ? (100.0 * current.hits / lookups) : 0.0);
+    fprintf(out, "Refreshed: %" PRIu64 ", failed: %" PRIu64 ", pruned: %"
+            PRIu64 "\n", current.refreshed, current.refresh_failures,
+            current.pruned);
+    fprintf(out, "Prefix table: %u prefixes, hits: %" PRIu64 ", loads: %"
+            PRIu64 " (%" PRIu64 " failed)\n", current.table_prefixes,
+            current.table_hits, current.table_loads, current.table_failures);
+    fprintf(out, "Loaded from disk: %" PRIu64 ", checkpoints: %" PRIu64
+            " (%" PRIu64 " failed)\n", current.loaded, current.checkpoints,
+            current.checkpoint_failures);
+    fprintf(out, "Compacted: %" PRIu64 " times, %" PRIu64 " of %" PRIu64
+            " nodes replaced\n", current.compactions, current.replaced_nodes,
+            current.nodes);
+
+    whois_session_get_stats(whois_session, &session);
+    fprintf(out, "whois connections: %" PRIu64 " (%" PRIu64 " failed, %"
+            PRIu64 " lost)\n", session.connects, session.connect_failures,
+            session.disconnects);
+    fprintf(out, "whois queries: %" PRIu64 " sent, %" PRIu64 " answered, %"
+            PRIu64 " failed, %" PRIu64 " deduplicated, %" PRIu64
+            " dropped\n", session.queries, session.answers, session.failures,
+            session.deduplicated, session.dropped);
+}
+
+
+
+#if UNIT_TEST
+int amp_test_asn_cache_check(struct amp_asn_info *info, struct iptrie *result,
+        struct sockaddr *address) {
+    return check_asn_cache(info, result, address);
+}
+
+void amp_test_asn_cache_advance(int seconds) {
+    time_offset += seconds;
+}
+
+void amp_test_asn_cache_prune(struct amp_asn_info *info) {
+    prune_asn_cache(info);
+}
+
+int amp_test_asn_cache_checkpoint(struct amp_asn_info *info) {
+    return checkpoint_asn_cache(info);
+}
+
+void amp_test_asn_cache_compact(struct amp_asn_info *info) {
+    compact_asn_cache(info);
+    reclaim_asn_data(info);
+}
+
+int64_t amp_test_asn_cache_lookup(struct amp_asn_info *info,
+        struct sockaddr *address, int locked) {
+    struct asn_reader *slot;
+    int64_t asn = -1;
+
+    if ( !locked && (slot = get_asn_reader()) != NULL ) {
+        lookup_asn_published(slot, address, get_asn_time(), &asn);
+    } else {
+        lookup_asn_locked(info, address, get_asn_time(), &asn);
+    }
+
+    return asn;
+}
+#endif
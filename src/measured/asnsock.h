@@ -40,25 +40,125 @@
 #ifndef _MEASURED_ASNSOCK_H
 #define _MEASURED_ASNSOCK_H
 
+#include <stdio.h>
 #include <time.h>
 #include <pthread.h>
 #include <libwandevent.h>
 
 #include "iptrie.h"
 #include "asn.h"
+#include "workerpool.h"
+#include "whoissession.h"
 
 /*
- * Ideally the cache could refresh individual items and expunge those
- * that haven't been used for a while. In the meantime, lets just empty
- * the whole cache and start again every 24 hours + 0-60 minutes.
+ * Expired entries are still used for up to a day while they are refreshed
+ * in the background, after that they have to be looked up again.
  */
-#define MIN_ASN_CACHE_REFRESH 86400
-#define MAX_ASN_CACHE_REFRESH_OFFSET 3600
+#define ASN_CACHE_MAX_STALE 86400
+/* how often to remove entries that are too stale to use (seconds) */
+#define ASN_CACHE_PRUNE_INTERVAL 3600
+/* time to wait for more stale entries to refresh in the same batch (seconds) */
+#define ASN_REFRESH_DELAY 1
+/* replaced nodes to allow before compacting, if most of the cache is garbage */
+#define ASN_CACHE_COMPACT_MIN_NODES 4096
+/* times to try compacting without the mutex before copying while holding it */
+#define ASN_CACHE_COMPACT_ATTEMPTS 3
+/* maximum number of prefixes waiting to be refreshed */
+#define ASN_REFRESH_MAX_QUEUE 4096
+/* time to wait for the whois server while refreshing (seconds) */
+#define ASN_REFRESH_TIMEOUT 30
+/* threads that can read the cache without locking, any more take the lock */
+#define ASN_CACHE_MAX_READERS (MAX_WORKER_THREADS + 8)
 
+/* default interval between saving snapshots of the cache (seconds) */
+#define DEFAULT_ASN_CACHE_CHECKPOINT 3600
+/* default interval between checking the prefix table for changes (seconds) */
+#define DEFAULT_ASN_TABLE_REFRESH 3600
+
+/* time to wait for a test process to send all its addresses (ms) */
+#define ASN_READ_TIMEOUT 10000
+/* time to wait for the whois session to answer all the queries (ms) */
+#define ASN_WHOIS_TIMEOUT 30000
+/* max wait between checking if the whois session has answered (ms) */
+#define ASN_POLL_INTERVAL 20
+
+/* progress of a connection from a test process looking up addresses */
+typedef enum {
+    ASN_READING,                /* reading addresses to look up */
+    ASN_QUERYING,               /* waiting for the whois session */
+    ASN_SENDING,                /* sending the AS numbers back */
+} asn_conn_state_t;
+
+/*
+ * State kept for each connection from a test process.
+ */
+struct amp_asn_conn {
+    asn_conn_state_t state;
+    struct amp_asn_info *info;  /* shared ASN cache */
+    uint8_t input[sizeof(uint16_t) + sizeof(struct in6_addr)];
+    size_t inlen;               /* bytes of partially read address */
+    struct iptrie requests;     /* addresses to look up */
+    struct iptrie result;       /* AS numbers found so far */
+    whois_waiter_t *waiter;     /* answers from the shared whois session */
+    int outstanding;            /* requests still waiting for a response */
+    worker_buffer_t output;     /* AS numbers waiting to be sent */
+};
+
+/*
+ * Configuration for keeping a copy of the ASN cache on disk.
+ */
+typedef struct amp_asn_cache {
+    int enabled;
+    char *filename;                 /* snapshot to load and save */
+    uint32_t checkpoint;            /* how often to save the snapshot */
+    char *table;                    /* local prefix to AS table, if any */
+    uint32_t table_refresh;         /* how often to check it for changes */
+} amp_asn_cache_t;
+
+/*
+ * Counters describing how well the ASN cache is working.
+ */
+typedef struct asn_cache_stats {
+    uint64_t hits;                  /* addresses found in the cache */
+    uint64_t stale_hits;            /* of those, expired but still used */
+    uint64_t misses;                /* addresses that had to be looked up */
+    uint64_t refreshed;             /* prefixes refreshed in the background */
+    uint64_t refresh_failures;      /* prefixes that failed to refresh */
+    uint64_t pruned;                /* entries too stale to keep */
+    uint64_t loaded;                /* entries loaded from the snapshot */
+    uint64_t checkpoints;           /* snapshots saved to disk */
+    uint64_t checkpoint_failures;   /* snapshots that couldn't be saved */
+    uint64_t table_hits;            /* addresses found in the prefix table */
+    uint64_t table_loads;           /* times the prefix table was loaded */
+    uint64_t table_failures;        /* times it couldn't be loaded */
+    uint64_t compactions;           /* times replaced nodes were freed */
+    uint64_t nodes;                 /* trie nodes allocated by the cache */
+    uint64_t replaced_nodes;        /* of those, replaced by later updates */
+    uint32_t table_prefixes;        /* prefixes in the current table */
+    uint32_t entries;               /* current number of cached prefixes */
+    uint32_t queued;                /* prefixes waiting to be refreshed */
+} asn_cache_stats_t;
+
+worker_pool_t *start_asn_pool(struct amp_asn_info *info, int threads);
 void asn_socket_event_callback(
         __attribute__((unused))wand_event_handler_t *ev_hdl, int eventfd,
         void *data, __attribute__((unused))enum wand_eventtype_t ev);
 
 struct amp_asn_info* initialise_asn_info(void);
 void amp_asn_info_delete(struct amp_asn_info *info);
+void set_asn_cache_config(struct amp_asn_info *info, amp_asn_cache_t *config);
+void free_asn_cache_config(amp_asn_cache_t *config);
+void get_asn_cache_stats(asn_cache_stats_t *stats);
+void dump_asn_cache_stats(FILE *out);
+
+#if UNIT_TEST
+int amp_test_asn_cache_check(struct amp_asn_info *info, struct iptrie *result,
+        struct sockaddr *address);
+void amp_test_asn_cache_advance(int seconds);
+void amp_test_asn_cache_prune(struct amp_asn_info *info);
+int amp_test_asn_cache_checkpoint(struct amp_asn_info *info);
+void amp_test_asn_cache_compact(struct amp_asn_info *info);
+int64_t amp_test_asn_cache_lookup(struct amp_asn_info *info,
+        struct sockaddr *address, int locked);
+#endif
 #endif
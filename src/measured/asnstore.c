@@ -0,0 +1,443 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Snapshots of the ASN cache, so that it survives measured being restarted.
+ * The cache is written out as a sorted array of fixed size entries behind a
+ * versioned and checksummed header. New snapshots are written to a temporary
+ * file and renamed over the old one, so a crash part way through writing
+ * leaves the previous snapshot intact. Snapshots are mapped read-only when
+ * they are loaded, and are ignored entirely if anything about them looks
+ * wrong - the cache will simply be rebuilt from whois.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "asnstore.h"
+#include "iptrie.h"
+#include "debug.h"
+#include "hash.h"
+
+/*
+ * Entries copied out of the cache trie, waiting to be written.
+ */
+struct snapshot_data {
+    asn_snapshot_entry_t *entries;
+    uint64_t count;
+    uint64_t size;
+    time_t cutoff;
+};
+
+
+
+/*
+ * Checksum a snapshot, including its header.
+ */
+static uint32_t snapshot_checksum(asn_snapshot_header_t *header,
+        const asn_snapshot_entry_t *entries) {
+    asn_snapshot_header_t copy = *header;
+    uint32_t hash;
+
+    copy.checksum = 0;
+    hash = fnv1a_32(FNV1A_32_INIT, &copy, sizeof(copy));
+
+    return fnv1a_32(hash, entries,
+            header->count * sizeof(asn_snapshot_entry_t));
+}
+
+
+
+/*
+ * Order entries by family, then address, then prefix length.
+ */
+static int compare_entries(const void *a, const void *b) {
+    const asn_snapshot_entry_t *first = (const asn_snapshot_entry_t *)a;
+    const asn_snapshot_entry_t *second = (const asn_snapshot_entry_t *)b;
+    int diff;
+
+    if ( first->family != second->family ) {
+        return (first->family > second->family) ? 1 : -1;
+    }
+
+    if ( (diff = memcmp(first->address, second->address,
+                    sizeof(first->address))) != 0 ) {
+        return diff;
+    }
+
+    if ( first->prefix != second->prefix ) {
+        return (first->prefix > second->prefix) ? 1 : -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Copy a single cache entry into the snapshot, unless it is too stale to
+ * be worth keeping.
+ */
+static int copy_entry(iptrie_node_t *node, void *data) {
+    struct snapshot_data *snapshot = (struct snapshot_data *)data;
+    asn_snapshot_entry_t *entry;
+
+    if ( node->expires > 0 && node->expires < snapshot->cutoff ) {
+        return 0;
+    }
+
+    if ( snapshot->count >= ASN_SNAPSHOT_MAX_ENTRIES ) {
+        return 0;
+    }
+
+    if ( snapshot->count == snapshot->size ) {
+        snapshot->size = snapshot->size ? snapshot->size * 2 : 1024;
+        snapshot->entries = realloc(snapshot->entries,
+                snapshot->size * sizeof(asn_snapshot_entry_t));
+    }
+
+    entry = &snapshot->entries[snapshot->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->family = node->address->sa_family;
+    entry->prefix = node->prefix;
+    entry->as = node->as;
+    entry->expires = node->expires;
+
+    if ( entry->family == AF_INET ) {
+        memcpy(entry->address,
+                &((struct sockaddr_in*)node->address)->sin_addr,
+                sizeof(struct in_addr));
+    } else {
+        memcpy(entry->address,
+                &((struct sockaddr_in6*)node->address)->sin6_addr,
+                sizeof(struct in6_addr));
+    }
+
+    snapshot->count++;
+
+    return 0;
+}
+
+
+
+/*
+ * Write the whole buffer to a file, retrying after partial writes.
+ */
+static int write_all(int fd, const void *data, size_t length) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    ssize_t written;
+
+    while ( length > 0 ) {
+        if ( (written = write(fd, bytes, length)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Make sure that a renamed snapshot will still be there after a crash.
+ */
+static void sync_snapshot_directory(char *filename) {
+    char *copy = strdup(filename);
+    int fd;
+
+    if ( (fd = open(dirname(copy), O_RDONLY | O_DIRECTORY)) >= 0 ) {
+        fsync(fd);
+        close(fd);
+    }
+
+    free(copy);
+}
+
+
+
+/*
+ * Write all the cache entries that haven't expired before the cutoff time
+ * to a snapshot file. The cache is only locked while the entries are copied.
+ * Returns the number of entries written, or -1 on error.
+ */
+int save_asn_snapshot(struct amp_asn_info *info, char *filename,
+        time_t cutoff) {
+    struct snapshot_data snapshot;
+    asn_snapshot_header_t header;
+    char *tmpname = NULL;
+    int fd = -1;
+    int result = -1;
+
+    assert(info);
+    assert(filename);
+
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.cutoff = cutoff;
+
+    pthread_mutex_lock(info->mutex);
+    iptrie_on_all_leaves(info->trie, copy_entry, &snapshot);
+    pthread_mutex_unlock(info->mutex);
+
+    if ( snapshot.count > 0 ) {
+        qsort(snapshot.entries, snapshot.count, sizeof(asn_snapshot_entry_t),
+                compare_entries);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ASN_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = ASN_SNAPSHOT_VERSION;
+    header.entry_size = sizeof(asn_snapshot_entry_t);
+    header.count = snapshot.count;
+    header.created = time(NULL);
+    header.checksum = snapshot_checksum(&header, snapshot.entries);
+
+    if ( asprintf(&tmpname, "%s.tmp", filename) < 0 ) {
+        tmpname = NULL;
+        goto end;
+    }
+
+    if ( (fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644)) < 0 ) {
+        Log(LOG_WARNING, "Failed to create ASN snapshot %s: %s", tmpname,
+                strerror(errno));
+        goto end;
+    }
+
+    if ( write_all(fd, &header, sizeof(header)) < 0 ||
+            write_all(fd, snapshot.entries,
+                snapshot.count * sizeof(asn_snapshot_entry_t)) < 0 ||
+            fsync(fd) < 0 ) {
+        Log(LOG_WARNING, "Failed to write ASN snapshot %s: %s", tmpname,
+                strerror(errno));
+        unlink(tmpname);
+        goto end;
+    }
+
+    close(fd);
+    fd = -1;
+
+    if ( rename(tmpname, filename) < 0 ) {
+        Log(LOG_WARNING, "Failed to replace ASN snapshot %s: %s", filename,
+                strerror(errno));
+        unlink(tmpname);
+        goto end;
+    }
+
+    sync_snapshot_directory(filename);
+
+    Log(LOG_DEBUG, "Saved %" PRIu64 " ASN cache entries to %s",
+            snapshot.count, filename);
+
+    result = snapshot.count;
+
+end:
+    if ( fd >= 0 ) {
+        close(fd);
+    }
+
+    free(tmpname);
+    free(snapshot.entries);
+
+    return result;
+}
+
+
+
+/*
+ * Check that the header describes a snapshot we know how to read, and that
+ * the contents haven't been damaged.
+ */
+static int check_snapshot(asn_snapshot_header_t *header, off_t size) {
+    const asn_snapshot_entry_t *entries;
+    uint64_t i;
+
+    if ( memcmp(header->magic, ASN_SNAPSHOT_MAGIC,
+                sizeof(header->magic)) != 0 ) {
+        Log(LOG_WARNING, "ASN snapshot has bad magic");
+        return -1;
+    }
+
+    if ( header->version != ASN_SNAPSHOT_VERSION ||
+            header->entry_size != sizeof(asn_snapshot_entry_t) ) {
+        Log(LOG_INFO, "ASN snapshot is version %u, expected %u, ignoring",
+                header->version, ASN_SNAPSHOT_VERSION);
+        return -1;
+    }
+
+    if ( header->count > ASN_SNAPSHOT_MAX_ENTRIES ||
+            (uint64_t)size != sizeof(asn_snapshot_header_t) +
+            header->count * sizeof(asn_snapshot_entry_t) ) {
+        Log(LOG_WARNING, "ASN snapshot is truncated or has bad length");
+        return -1;
+    }
+
+    entries = (const asn_snapshot_entry_t *)(header + 1);
+
+    if ( snapshot_checksum(header, entries) != header->checksum ) {
+        Log(LOG_WARNING, "ASN snapshot has bad checksum");
+        return -1;
+    }
+
+    for ( i = 0; i < header->count; i++ ) {
+        if ( (entries[i].family != AF_INET || entries[i].prefix > 32) &&
+                (entries[i].family != AF_INET6 || entries[i].prefix > 128) ) {
+            Log(LOG_WARNING, "ASN snapshot has bad entry");
+            return -1;
+        }
+
+        if ( i > 0 && compare_entries(&entries[i - 1], &entries[i]) >= 0 ) {
+            Log(LOG_WARNING, "ASN snapshot entries are out of order");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Add all the entries in a snapshot file that haven't expired before the
+ * cutoff time to a trie. This should be a new trie that nothing else is
+ * using yet, the caller can then swap it in as the cache. Returns the number
+ * of entries loaded, or -1 if the snapshot doesn't exist or can't be used.
+ */
+int load_asn_snapshot(struct iptrie *trie, char *filename, time_t cutoff) {
+    asn_snapshot_header_t *header;
+    const asn_snapshot_entry_t *entries;
+    struct sockaddr_storage addr;
+    struct stat statbuf;
+    void *map = MAP_FAILED;
+    uint64_t i;
+    int loaded = 0;
+    int result = -1;
+    int fd;
+
+    assert(trie);
+    assert(filename);
+
+    if ( (fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0 ) {
+        if ( errno == ENOENT ) {
+            Log(LOG_DEBUG, "No ASN snapshot at %s", filename);
+        } else {
+            Log(LOG_WARNING, "Failed to open ASN snapshot %s: %s", filename,
+                    strerror(errno));
+        }
+        return -1;
+    }
+
+    if ( fstat(fd, &statbuf) < 0 ) {
+        Log(LOG_WARNING, "Failed to stat ASN snapshot %s: %s", filename,
+                strerror(errno));
+        goto end;
+    }
+
+    if ( statbuf.st_size < (off_t)sizeof(asn_snapshot_header_t) ) {
+        Log(LOG_WARNING, "ASN snapshot %s is too short", filename);
+        goto end;
+    }
+
+    if ( (map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd,
+                    0)) == MAP_FAILED ) {
+        Log(LOG_WARNING, "Failed to map ASN snapshot %s: %s", filename,
+                strerror(errno));
+        goto end;
+    }
+
+    header = (asn_snapshot_header_t *)map;
+
+    if ( check_snapshot(header, statbuf.st_size) < 0 ) {
+        goto end;
+    }
+
+    entries = (const asn_snapshot_entry_t *)(header + 1);
+
+    for ( i = 0; i < header->count; i++ ) {
+        if ( entries[i].expires > 0 && entries[i].expires < cutoff ) {
+            continue;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.ss_family = entries[i].family;
+
+        if ( entries[i].family == AF_INET ) {
+            memcpy(&((struct sockaddr_in*)&addr)->sin_addr,
+                    entries[i].address, sizeof(struct in_addr));
+        } else {
+            memcpy(&((struct sockaddr_in6*)&addr)->sin6_addr,
+                    entries[i].address, sizeof(struct in6_addr));
+        }
+
+        iptrie_add_expiring(trie, (struct sockaddr*)&addr,
+                entries[i].prefix, entries[i].as, entries[i].expires);
+        loaded++;
+    }
+
+    Log(LOG_INFO, "Loaded %d of %" PRIu64 " ASN cache entries from %s",
+            loaded, header->count, filename);
+
+    result = loaded;
+
+end:
+    if ( map != MAP_FAILED ) {
+        munmap(map, statbuf.st_size);
+    }
+
+    close(fd);
+
+    return result;
+}
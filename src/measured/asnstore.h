@@ -0,0 +1,88 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_ASNSTORE_H
+#define _MEASURED_ASNSTORE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "asn.h"
+#include "iptrie.h"
+
+/* "AMPASNC" */
+#define ASN_SNAPSHOT_MAGIC "AMPASNC"
+/* bump this whenever the layout of the header or entries changes */
+#define ASN_SNAPSHOT_VERSION 1
+/* largest number of entries a snapshot is allowed to hold */
+#define ASN_SNAPSHOT_MAX_ENTRIES (4 * 1024 * 1024)
+
+/*
+ * Header at the start of a snapshot file. Snapshots are only read by the
+ * machine that wrote them, so values are stored in host byte order. The
+ * checksum covers the header (with the checksum set to zero) and all the
+ * entries.
+ */
+typedef struct asn_snapshot_header {
+    char magic[8];                  /* ASN_SNAPSHOT_MAGIC */
+    uint32_t version;               /* ASN_SNAPSHOT_VERSION */
+    uint32_t entry_size;            /* size of each entry */
+    uint64_t count;                 /* number of entries following */
+    int64_t created;                /* time the snapshot was written */
+    uint32_t reserved;
+    uint32_t checksum;
+} asn_snapshot_header_t;
+
+/*
+ * A single cached prefix. Entries are sorted by family, address and prefix
+ * length, so the file can be searched in place if needed.
+ */
+typedef struct asn_snapshot_entry {
+    uint8_t family;                 /* AF_INET or AF_INET6 */
+    uint8_t prefix;                 /* prefix length in bits */
+    uint8_t reserved[6];
+    int64_t as;                     /* AS number */
+    int64_t expires;                /* time the entry becomes stale */
+    uint8_t address[16];            /* network address, padded with zeroes */
+} asn_snapshot_entry_t;
+
+int save_asn_snapshot(struct amp_asn_info *info, char *filename,
+        time_t cutoff);
+int load_asn_snapshot(struct iptrie *trie, char *filename, time_t cutoff);
+#endif
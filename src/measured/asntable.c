@@ -0,0 +1,735 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Prefix to AS tables loaded from a local file, so that AS numbers can be
+ * found without asking a whois server. Both the CAIDA pfx2as format
+ * ("prefix length AS", whitespace separated) and the one line per route MRT
+ * text format produced by "bgpdump -m" are understood, optionally gzipped.
+ * Where a prefix is announced by more than one AS, the first one listed is
+ * used; for MRT routes the origin is the last AS in the path. A RIB dump
+ * lists every prefix once for each peer, so repeated prefixes are merged as
+ * they are read (the last one listed wins) rather than stored and removed
+ * later. Only RIB entries are used from MRT dumps, not updates.
+ *
+ * Rather than storing the prefixes themselves, overlapping prefixes are
+ * flattened into a sorted list of address ranges that each map to the AS of
+ * the longest prefix covering them. Finding the longest matching prefix is
+ * then a binary search through a compact array.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <errno.h>
+#include <endian.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "asntable.h"
+#include "debug.h"
+
+/*
+ * A single prefix read from the file. IPv4 addresses are stored in the low
+ * 32 bits of the key so that both families share the same arithmetic.
+ */
+struct asn_prefix {
+    uint64_t key[2];
+    uint8_t length;
+    uint32_t as;
+};
+
+/*
+ * Growable list of prefixes for a single address family, with an open
+ * addressed hash index used to find repeated prefixes while reading.
+ */
+struct prefix_list {
+    struct asn_prefix *prefixes;
+    uint32_t count;
+    uint32_t size;
+    int maxlen;
+    uint32_t *index;            /* position in the list plus one, or zero */
+    uint32_t index_size;        /* always a power of two */
+};
+
+/*
+ * Growable list of flattened ranges, before they are packed into the table.
+ */
+struct range_list {
+    struct asn_table_range6 *ranges;
+    uint32_t count;
+    uint32_t size;
+};
+
+
+
+/*
+ * Compare two keys as 128 bit unsigned integers.
+ */
+static int compare_keys(const uint64_t *a, const uint64_t *b) {
+    if ( a[0] != b[0] ) {
+        return (a[0] > b[0]) ? 1 : -1;
+    }
+
+    if ( a[1] != b[1] ) {
+        return (a[1] > b[1]) ? 1 : -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Get a mask with the lowest bits set.
+ */
+static void get_host_mask(int bits, uint64_t *mask) {
+    if ( bits <= 0 ) {
+        mask[0] = 0;
+        mask[1] = 0;
+    } else if ( bits < 64 ) {
+        mask[0] = 0;
+        mask[1] = (1ULL << bits) - 1;
+    } else if ( bits < 128 ) {
+        mask[0] = (bits == 64) ? 0 : (1ULL << (bits - 64)) - 1;
+        mask[1] = ~0ULL;
+    } else {
+        mask[0] = ~0ULL;
+        mask[1] = ~0ULL;
+    }
+}
+
+
+
+/*
+ * Order prefixes by address, and then by length so that any prefix comes
+ * before the more specific prefixes within it.
+ */
+static int compare_prefixes(const void *a, const void *b) {
+    const struct asn_prefix *first = (const struct asn_prefix *)a;
+    const struct asn_prefix *second = (const struct asn_prefix *)b;
+    int cmp;
+
+    if ( (cmp = compare_keys(first->key, second->key)) != 0 ) {
+        return cmp;
+    }
+
+    if ( first->length != second->length ) {
+        return (first->length > second->length) ? 1 : -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Hash a prefix for the index.
+ */
+static uint32_t hash_prefix(const uint64_t *key, uint8_t length) {
+    uint64_t hash;
+
+    hash = (key[0] * 0x9e3779b97f4a7c15ULL) ^ key[1] ^ length;
+    hash *= 0x9e3779b97f4a7c15ULL;
+
+    return (uint32_t)(hash >> 32);
+}
+
+
+
+/*
+ * Find the slot in the index for a prefix. The slot either refers to the
+ * same prefix already in the list, or is empty if it hasn't been seen.
+ */
+static uint32_t *find_prefix_slot(struct prefix_list *list,
+        const uint64_t *key, uint8_t length) {
+    struct asn_prefix *prefix;
+    uint32_t mask = list->index_size - 1;
+    uint32_t slot = hash_prefix(key, length) & mask;
+
+    while ( list->index[slot] != 0 ) {
+        prefix = &list->prefixes[list->index[slot] - 1];
+
+        if ( prefix->length == length && prefix->key[0] == key[0] &&
+                prefix->key[1] == key[1] ) {
+            break;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    return &list->index[slot];
+}
+
+
+
+/*
+ * Double the size of the index and add all the prefixes to it again.
+ */
+static void grow_prefix_index(struct prefix_list *list) {
+    uint32_t i;
+
+    free(list->index);
+    list->index_size = list->index_size ? list->index_size * 2 : 2048;
+    list->index = calloc(list->index_size, sizeof(uint32_t));
+
+    for ( i = 0; i < list->count; i++ ) {
+        *find_prefix_slot(list, list->prefixes[i].key,
+                list->prefixes[i].length) = i + 1;
+    }
+}
+
+
+
+/*
+ * Parse an AS number, ignoring the brackets around AS sets and anything
+ * after the first AS of a multi-origin prefix. Returns 0 if it isn't valid.
+ */
+static uint32_t parse_as(char *field) {
+    unsigned long as;
+    char *end;
+
+    while ( *field == '{' || isspace(*field) ) {
+        field++;
+    }
+
+    if ( !isdigit(*field) ) {
+        return 0;
+    }
+
+    errno = 0;
+    as = strtoul(field, &end, 10);
+
+    if ( errno != 0 || as > UINT32_MAX ||
+            (*end != '\0' && *end != '_' && *end != ',' && *end != '}' &&
+             !isspace(*end)) ) {
+        return 0;
+    }
+
+    return (uint32_t)as;
+}
+
+
+
+/*
+ * Add a prefix to the list for the appropriate family, clearing any host
+ * bits. If the prefix is already in the list then its AS is updated instead.
+ * Returns -1 if the prefix isn't valid.
+ */
+static int add_prefix(struct prefix_list *ipv4, struct prefix_list *ipv6,
+        char *address, char *lenstr, uint32_t as) {
+    struct prefix_list *list;
+    struct asn_prefix *prefix;
+    struct in6_addr addr6;
+    struct in_addr addr4;
+    uint64_t words[2], mask[2], key[2];
+    uint32_t *slot;
+    unsigned long length;
+    char *end;
+
+    if ( as == 0 || lenstr == NULL || !isdigit(*lenstr) ) {
+        return -1;
+    }
+
+    length = strtoul(lenstr, &end, 10);
+    if ( *end != '\0' && !isspace(*end) ) {
+        return -1;
+    }
+
+    if ( inet_pton(AF_INET, address, &addr4) == 1 ) {
+        list = ipv4;
+        words[0] = 0;
+        words[1] = ntohl(addr4.s_addr);
+    } else if ( inet_pton(AF_INET6, address, &addr6) == 1 ) {
+        list = ipv6;
+        memcpy(words, &addr6, sizeof(words));
+        words[0] = be64toh(words[0]);
+        words[1] = be64toh(words[1]);
+    } else {
+        return -1;
+    }
+
+    if ( length > (unsigned long)list->maxlen ) {
+        return -1;
+    }
+
+    get_host_mask(list->maxlen - length, mask);
+    key[0] = words[0] & ~mask[0];
+    key[1] = words[1] & ~mask[1];
+
+    /* keep the index at most half full */
+    if ( (list->count + 1) * 2 > list->index_size ) {
+        grow_prefix_index(list);
+    }
+
+    /* the same prefix listed again, the last one wins */
+    slot = find_prefix_slot(list, key, length);
+    if ( *slot != 0 ) {
+        list->prefixes[*slot - 1].as = as;
+        return 0;
+    }
+
+    if ( list->count == list->size ) {
+        list->size = list->size ? list->size * 2 : 1024;
+        list->prefixes = realloc(list->prefixes,
+                list->size * sizeof(struct asn_prefix));
+    }
+
+    prefix = &list->prefixes[list->count++];
+    prefix->key[0] = key[0];
+    prefix->key[1] = key[1];
+    prefix->length = length;
+    prefix->as = as;
+    *slot = list->count;
+
+    return 0;
+}
+
+
+
+/*
+ * Parse a line from a CAIDA pfx2as file: "address length AS".
+ */
+static int parse_pfx2as_line(struct prefix_list *ipv4,
+        struct prefix_list *ipv6, char *line) {
+    char *address, *length, *as;
+    char *saveptr = NULL;
+
+    address = strtok_r(line, " \t", &saveptr);
+    length = strtok_r(NULL, " \t", &saveptr);
+    as = strtok_r(NULL, " \t", &saveptr);
+
+    if ( address == NULL || length == NULL || as == NULL ) {
+        return -1;
+    }
+
+    return add_prefix(ipv4, ipv6, address, length, parse_as(as));
+}
+
+
+
+/*
+ * Parse a route from "bgpdump -m" output, taking the origin from the end
+ * of the AS path:
+ * TABLE_DUMP2|time|B|peer address|peer AS|prefix|AS path|origin|...
+ * Anything that isn't a RIB entry (such as BGP4MP announcements and
+ * withdrawals from an update dump) is skipped without being counted as
+ * invalid.
+ */
+static int parse_mrt_line(struct prefix_list *ipv4, struct prefix_list *ipv6,
+        char *line) {
+    char *fields[7];
+    char *saveptr = NULL;
+    char *origin, *length;
+    int i;
+
+    for ( i = 0; i < 7; i++ ) {
+        /* empty fields are possible, so don't use strtok */
+        fields[i] = strsep(&line, "|");
+        if ( fields[i] == NULL ) {
+            return -1;
+        }
+
+        /* only table dumps describe routes that are currently in use */
+        if ( i == 2 && ((strcmp(fields[0], "TABLE_DUMP") != 0 &&
+                    strcmp(fields[0], "TABLE_DUMP2") != 0) ||
+                    strcmp(fields[2], "W") == 0) ) {
+            return 0;
+        }
+    }
+
+    if ( (length = strchr(fields[5], '/')) == NULL ) {
+        return -1;
+    }
+    *length++ = '\0';
+
+    /* the origin is the last AS in the path, which may be a set */
+    origin = NULL;
+    for ( line = strtok_r(fields[6], " ", &saveptr); line != NULL;
+            line = strtok_r(NULL, " ", &saveptr) ) {
+        origin = line;
+    }
+
+    if ( origin == NULL ) {
+        return -1;
+    }
+
+    return add_prefix(ipv4, ipv6, fields[5], length, parse_as(origin));
+}
+
+
+
+/*
+ * Start a new range of addresses, replacing any range that started at the
+ * same address and skipping it if the AS hasn't changed.
+ */
+static void add_range(struct range_list *list, const uint64_t *start,
+        uint32_t as) {
+    struct asn_table_range6 *last;
+
+    if ( list->count > 0 ) {
+        last = &list->ranges[list->count - 1];
+
+        if ( compare_keys(last->start, start) == 0 ) {
+            last->as = as;
+            return;
+        }
+
+        if ( last->as == as ) {
+            return;
+        }
+    } else if ( as == 0 ) {
+        /* addresses before the first range are never covered anyway */
+        return;
+    }
+
+    if ( list->count == list->size ) {
+        list->size = list->size ? list->size * 2 : 1024;
+        list->ranges = realloc(list->ranges,
+                list->size * sizeof(struct asn_table_range6));
+    }
+
+    last = &list->ranges[list->count++];
+    last->start[0] = start[0];
+    last->start[1] = start[1];
+    last->as = as;
+}
+
+
+
+/*
+ * Start a new range at the address after the end of a prefix, which belongs
+ * to the enclosing prefix (if any).
+ */
+static void end_prefix(struct range_list *ranges, struct asn_prefix *prefix,
+        int maxlen, uint32_t as) {
+    uint64_t mask[2], next[2], last[2];
+
+    get_host_mask(maxlen - prefix->length, mask);
+    next[0] = prefix->key[0] | mask[0];
+    next[1] = prefix->key[1] | mask[1];
+
+    /* the prefix reaches the end of the address space */
+    get_host_mask(maxlen, last);
+    if ( compare_keys(next, last) == 0 ) {
+        return;
+    }
+
+    if ( ++next[1] == 0 ) {
+        next[0]++;
+    }
+
+    add_range(ranges, next, as);
+}
+
+
+
+/*
+ * Check if an address is within a prefix.
+ */
+static int prefix_contains(struct asn_prefix *prefix, const uint64_t *key,
+        int maxlen) {
+    uint64_t mask[2];
+
+    get_host_mask(maxlen - prefix->length, mask);
+
+    return (key[0] & ~mask[0]) == prefix->key[0] &&
+        (key[1] & ~mask[1]) == prefix->key[1];
+}
+
+
+
+/*
+ * Flatten a sorted list of possibly overlapping (but never repeated)
+ * prefixes into ranges that belong to the longest prefix covering them. Prefixes that enclose the
+ * current one are kept on a stack, which can be no deeper than the number
+ * of bits in an address.
+ */
+static void flatten_prefixes(struct prefix_list *list,
+        struct range_list *ranges) {
+    struct asn_prefix *stack[129];
+    struct asn_prefix *prefix;
+    int depth = 0;
+    uint32_t i;
+
+    for ( i = 0; i < list->count; i++ ) {
+        prefix = &list->prefixes[i];
+
+        /* close any prefixes that don't contain this one */
+        while ( depth > 0 && !prefix_contains(stack[depth - 1], prefix->key,
+                    list->maxlen) ) {
+            depth--;
+            end_prefix(ranges, stack[depth], list->maxlen,
+                    depth > 0 ? stack[depth - 1]->as : 0);
+        }
+
+        stack[depth++] = prefix;
+        add_range(ranges, prefix->key, prefix->as);
+    }
+
+    while ( depth > 0 ) {
+        depth--;
+        end_prefix(ranges, stack[depth], list->maxlen,
+                depth > 0 ? stack[depth - 1]->as : 0);
+    }
+}
+
+
+
+/*
+ * Read every prefix from the file, skipping lines that can't be parsed.
+ */
+static int read_prefixes(char *filename, struct prefix_list *ipv4,
+        struct prefix_list *ipv6, uint32_t *invalid) {
+    char line[ASN_TABLE_MAX_LINE];
+    gzFile file;
+    size_t length;
+    int truncated = 0;
+    int status;
+
+    if ( (file = gzopen(filename, "rb")) == NULL ) {
+        Log(LOG_WARNING, "Failed to open ASN prefix table %s: %s", filename,
+                strerror(errno));
+        return -1;
+    }
+
+    while ( gzgets(file, line, sizeof(line)) != NULL ) {
+        length = strlen(line);
+
+        /* skip the rest of any line too long to be a real prefix */
+        if ( length > 0 && line[length - 1] != '\n' && !gzeof(file) ) {
+            truncated = 1;
+            continue;
+        }
+
+        if ( truncated ) {
+            truncated = 0;
+            (*invalid)++;
+            continue;
+        }
+
+        while ( length > 0 && isspace(line[length - 1]) ) {
+            line[--length] = '\0';
+        }
+
+        if ( length == 0 || line[0] == '#' ) {
+            continue;
+        }
+
+        if ( strchr(line, '|') != NULL ) {
+            status = parse_mrt_line(ipv4, ipv6, line);
+        } else {
+            status = parse_pfx2as_line(ipv4, ipv6, line);
+        }
+
+        if ( status < 0 ) {
+            (*invalid)++;
+        }
+    }
+
+    if ( !gzeof(file) ) {
+        Log(LOG_WARNING, "Failed to read ASN prefix table %s", filename);
+        gzclose(file);
+        return -1;
+    }
+
+    gzclose(file);
+
+    return 0;
+}
+
+
+
+/*
+ * Load a prefix table from a file. Returns NULL if the file can't be read.
+ */
+asn_table_t *load_asn_table(char *filename) {
+    struct prefix_list ipv4 = { NULL, 0, 0, 32, NULL, 0 };
+    struct prefix_list ipv6 = { NULL, 0, 0, 128, NULL, 0 };
+    struct range_list ranges = { NULL, 0, 0 };
+    struct stat statbuf;
+    asn_table_t *table;
+    uint32_t i;
+
+    assert(filename);
+
+    if ( stat(filename, &statbuf) < 0 ) {
+        Log(LOG_WARNING, "Failed to stat ASN prefix table %s: %s", filename,
+                strerror(errno));
+        return NULL;
+    }
+
+    table = calloc(1, sizeof(asn_table_t));
+    table->mtime = statbuf.st_mtime;
+
+    if ( read_prefixes(filename, &ipv4, &ipv6, &table->invalid) < 0 ) {
+        free(ipv4.prefixes);
+        free(ipv6.prefixes);
+        free(ipv4.index);
+        free(ipv6.index);
+        free(table);
+        return NULL;
+    }
+
+    /* the index is only needed while reading */
+    free(ipv4.index);
+    free(ipv6.index);
+
+    table->prefixes = ipv4.count + ipv6.count;
+
+    /* flatten the IPv4 prefixes and pack them into a smaller array */
+    if ( ipv4.count > 0 ) {
+        qsort(ipv4.prefixes, ipv4.count, sizeof(struct asn_prefix),
+                compare_prefixes);
+        flatten_prefixes(&ipv4, &ranges);
+
+        table->ipv4 = malloc(ranges.count * sizeof(struct asn_table_range4));
+        table->ipv4_count = ranges.count;
+        for ( i = 0; i < ranges.count; i++ ) {
+            table->ipv4[i].start = ranges.ranges[i].start[1];
+            table->ipv4[i].as = ranges.ranges[i].as;
+        }
+
+        free(ranges.ranges);
+        memset(&ranges, 0, sizeof(ranges));
+    }
+
+    /* IPv6 ranges are already the right shape, just trim them */
+    if ( ipv6.count > 0 ) {
+        qsort(ipv6.prefixes, ipv6.count, sizeof(struct asn_prefix),
+                compare_prefixes);
+        flatten_prefixes(&ipv6, &ranges);
+
+        table->ipv6 = realloc(ranges.ranges,
+                ranges.count * sizeof(struct asn_table_range6));
+        table->ipv6_count = ranges.count;
+    }
+
+    free(ipv4.prefixes);
+    free(ipv6.prefixes);
+
+    Log(LOG_INFO, "Loaded %u prefixes (%u IPv4 and %u IPv6 ranges) from %s, "
+            "%u invalid lines", table->prefixes, table->ipv4_count,
+            table->ipv6_count, filename, table->invalid);
+
+    return table;
+}
+
+
+
+/*
+ * Find the AS of the longest prefix containing the address, returning -1
+ * if no prefix covers it.
+ */
+int64_t asn_table_lookup(asn_table_t *table, struct sockaddr *address) {
+    uint32_t low, high, mid;
+
+    if ( table == NULL || address == NULL ) {
+        return -1;
+    }
+
+    if ( address->sa_family == AF_INET ) {
+        uint32_t key = ntohl(((struct sockaddr_in*)address)->sin_addr.s_addr);
+
+        /* find the first range starting after the address */
+        low = 0;
+        high = table->ipv4_count;
+        while ( low < high ) {
+            mid = low + ((high - low) / 2);
+            if ( table->ipv4[mid].start <= key ) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        if ( low == 0 || table->ipv4[low - 1].as == 0 ) {
+            return -1;
+        }
+
+        return table->ipv4[low - 1].as;
+    }
+
+    if ( address->sa_family == AF_INET6 ) {
+        uint64_t key[2];
+
+        memcpy(key, &((struct sockaddr_in6*)address)->sin6_addr, sizeof(key));
+        key[0] = be64toh(key[0]);
+        key[1] = be64toh(key[1]);
+
+        low = 0;
+        high = table->ipv6_count;
+        while ( low < high ) {
+            mid = low + ((high - low) / 2);
+            if ( compare_keys(table->ipv6[mid].start, key) <= 0 ) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+
+        if ( low == 0 || table->ipv6[low - 1].as == 0 ) {
+            return -1;
+        }
+
+        return table->ipv6[low - 1].as;
+    }
+
+    return -1;
+}
+
+
+
+/*
+ * Free a prefix table.
+ */
+void free_asn_table(asn_table_t *table) {
+    if ( table == NULL ) {
+        return;
+    }
+
+    free(table->ipv4);
+    free(table->ipv6);
+    free(table);
+}
@@ -0,0 +1,84 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_ASNTABLE_H
+#define _MEASURED_ASNTABLE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+
+/* longest line expected in a prefix table file */
+#define ASN_TABLE_MAX_LINE 4096
+
+/*
+ * The start of a range of IPv4 addresses that all belong to the same AS,
+ * continuing until the start of the next range.
+ */
+struct asn_table_range4 {
+    uint32_t start;
+    uint32_t as;                    /* zero if no prefix covers the range */
+};
+
+/*
+ * The start of a range of IPv6 addresses that all belong to the same AS.
+ */
+struct asn_table_range6 {
+    uint64_t start[2];
+    uint32_t as;
+};
+
+/*
+ * Prefix to AS mappings loaded from a file, flattened into sorted ranges so
+ * that the longest matching prefix is found with a binary search.
+ */
+typedef struct asn_table {
+    struct asn_table_range4 *ipv4;
+    uint32_t ipv4_count;
+    struct asn_table_range6 *ipv6;
+    uint32_t ipv6_count;
+    uint32_t prefixes;              /* distinct prefixes read from the file */
+    uint32_t invalid;               /* lines that couldn't be parsed */
+    time_t mtime;                   /* modification time of the file */
+} asn_table_t;
+
+asn_table_t *load_asn_table(char *filename);
+int64_t asn_table_lookup(asn_table_t *table, struct sockaddr *address);
+void free_asn_table(asn_table_t *table);
+#endif
@@ -0,0 +1,317 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "brokersock.h"
+#include "messaging.h"
+#include "debug.h"
+
+
+
+/*
+ * Set the send and receive timeouts on the test end of a relay socket, so
+ * that a test can't block forever waiting for measured to publish.
+ */
+static void set_relay_timeout(int fd) {
+    struct timeval timeout;
+
+    timeout.tv_sec = BROKER_RELAY_TIMEOUT;
+    timeout.tv_usec = 0;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+
+
+/*
+ * Read as much of a result as is available from a test process without
+ * blocking. Returns 1 if the complete result has now been read, 0 if more
+ * data is still to come, or -1 on error.
+ */
+static int read_relayed_result(struct relay_connection_t *conn) {
+    ssize_t bytes;
+
+    /* read the fixed size header first, it describes the rest */
+    while ( conn->header_read < sizeof(conn->header) ) {
+        bytes = recv(conn->fd, ((char*)&conn->header) + conn->header_read,
+                sizeof(conn->header) - conn->header_read, MSG_DONTWAIT);
+
+        if ( bytes == 0 ) {
+            Log(LOG_WARNING, "Relay closed before sending result header");
+            return -1;
+        }
+
+        if ( bytes < 0 ) {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return 0;
+            }
+            if ( errno == EINTR ) {
+                continue;
+            }
+            Log(LOG_WARNING, "Failed to read relayed result header: %s",
+                    strerror(errno));
+            return -1;
+        }
+
+        conn->header_read += bytes;
+
+        if ( conn->header_read < sizeof(conn->header) ) {
+            continue;
+        }
+
+        if ( conn->header.type >= AMP_TEST_LAST ||
+                conn->header.type <= AMP_TEST_INVALID ||
+                conn->header.length > BROKER_RELAY_MAX_LENGTH ) {
+            Log(LOG_WARNING, "Invalid relayed result, type %d length %d",
+                    conn->header.type, conn->header.length);
+            return -1;
+        }
+
+        conn->result.timestamp = conn->header.timestamp;
+        conn->result.len = conn->header.length;
+        conn->result.data = malloc(conn->header.length);
+    }
+
+    /* then the result data, which may take many reads if it is large */
+    while ( conn->data_read < conn->header.length ) {
+        bytes = recv(conn->fd, conn->result.data + conn->data_read,
+                conn->header.length - conn->data_read, MSG_DONTWAIT);
+
+        if ( bytes == 0 ) {
+            Log(LOG_WARNING, "Relay closed before sending all result data");
+            return -1;
+        }
+
+        if ( bytes < 0 ) {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return 0;
+            }
+            if ( errno == EINTR ) {
+                continue;
+            }
+            Log(LOG_WARNING, "Failed to read relayed result data: %s",
+                    strerror(errno));
+            return -1;
+        }
+
+        conn->data_read += bytes;
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Stop watching a relay connection, close it and free any partial result.
+ */
+static void close_relay_connection(wand_event_handler_t *ev_hdl,
+        struct relay_connection_t *conn) {
+
+    wand_del_fd(ev_hdl, conn->fd);
+
+    if ( conn->timeout ) {
+        wand_del_timer(ev_hdl, conn->timeout);
+    }
+
+    close(conn->fd);
+    free(conn->result.data);
+    free(conn);
+}
+
+
+
+/*
+ * A test process took too long to send its result, give up on it so that
+ * it can't hold resources in the main process forever.
+ */
+static void relay_timeout_callback(wand_event_handler_t *ev_hdl, void *data) {
+    struct relay_connection_t *conn = (struct relay_connection_t*)data;
+
+    Log(LOG_WARNING, "Timed out waiting for relayed result");
+
+    /* the timer has fired, so it is no longer ours to delete */
+    conn->timeout = NULL;
+    close_relay_connection(ev_hdl, conn);
+}
+
+
+
+/*
+ * Read more of a result from a test process as it arrives. Once the whole
+ * result has been read it is queued to be published using the connection
+ * that the main process keeps open to the broker. The test process is told
+ * if the result couldn't be queued so that it can report it itself.
+ */
+static void relay_connection_callback(wand_event_handler_t *ev_hdl,
+        __attribute__((unused))int fd, void *data,
+        __attribute__((unused))enum wand_eventtype_t ev) {
+
+    struct relay_connection_t *conn = (struct relay_connection_t*)data;
+    int8_t status = -1;
+    int complete;
+
+    if ( (complete = read_relayed_result(conn)) == 0 ) {
+        return;
+    }
+
+    if ( complete > 0 ) {
+        /* once queued the result data belongs to the publishing queue */
+        if ( queue_result_for_broker(conn->header.type, &conn->result) == 0 ) {
+            conn->result.data = NULL;
+            status = 0;
+        }
+
+        /* a single byte always fits in the empty send buffer */
+        if ( send(conn->fd, &status, sizeof(status), MSG_NOSIGNAL) < 0 ) {
+            Log(LOG_WARNING, "Failed to send relay status: %s",
+                    strerror(errno));
+        }
+    }
+
+    close_relay_connection(ev_hdl, conn);
+}
+
+
+
+/*
+ * Accept a connection from a test process on the local broker socket. The
+ * result it sends is read as it arrives by relay_connection_callback(), so
+ * a slow test can't stall the main event loop.
+ */
+void broker_socket_event_callback(wand_event_handler_t *ev_hdl, int eventfd,
+        __attribute__((unused))void *data,
+        __attribute__((unused))enum wand_eventtype_t ev) {
+
+    struct relay_connection_t *conn;
+    int fd;
+
+    if ( (fd = accept4(eventfd, NULL, NULL,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0 ) {
+        Log(LOG_WARNING, "Failed to accept on broker socket: %s",
+                strerror(errno));
+        return;
+    }
+
+    conn = calloc(1, sizeof(struct relay_connection_t));
+    conn->fd = fd;
+
+    wand_add_fd(ev_hdl, fd, EV_READ, conn, relay_connection_callback);
+    conn->timeout = wand_add_timer(ev_hdl, BROKER_RELAY_TIMEOUT, 0, conn,
+            relay_timeout_callback);
+}
+
+
+
+/*
+ * Send a test result to the main measured process, to be published on its
+ * long lived broker connection. Returns 0 if the result was accepted, or
+ * -1 if the caller needs to report the result some other way.
+ */
+int relay_result_to_parent(char *path, test_type_t type,
+        amp_test_result_t *result) {
+    struct sockaddr_un addr;
+    struct amp_relay_header header;
+    int8_t status;
+    int fd;
+
+    if ( path == NULL || result->len > BROKER_RELAY_MAX_LENGTH ) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) {
+        Log(LOG_WARNING, "Failed to create broker relay socket: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    if ( connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ) {
+        Log(LOG_DEBUG, "Failed to connect to broker relay %s: %s", path,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    set_relay_timeout(fd);
+
+    memset(&header, 0, sizeof(header));
+    header.type = type;
+    header.length = result->len;
+    header.timestamp = result->timestamp;
+
+    if ( send(fd, &header, sizeof(header), MSG_NOSIGNAL) != sizeof(header) ||
+            (result->len > 0 && send(fd, result->data, result->len,
+                MSG_NOSIGNAL) != (ssize_t)result->len) ) {
+        Log(LOG_WARNING, "Failed to relay result: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* wait to hear if it was published before returning */
+    if ( recv(fd, &status, sizeof(status), MSG_WAITALL) != sizeof(status) ) {
+        Log(LOG_WARNING, "No status for relayed result");
+        status = -1;
+    }
+
+    close(fd);
+
+    return status;
+}
+
+
+
+#if UNIT_TEST
+int amp_test_read_relayed_result(struct relay_connection_t *conn) {
+    return read_relayed_result(conn);
+}
+#endif
@@ -0,0 +1,85 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_BROKERSOCK_H
+#define _MEASURED_BROKERSOCK_H
+
+#include <stdint.h>
+#include <libwandevent.h>
+#include "tests.h"
+
+/* how long to wait for a test to send a result, or measured to publish it */
+#define BROKER_RELAY_TIMEOUT 10
+/* largest result that will be accepted from a test process, 64MB */
+#define BROKER_RELAY_MAX_LENGTH (64 * 1024 * 1024)
+
+/*
+ * Header sent by a test process before the packed result data, describing
+ * the result that should be published.
+ */
+struct amp_relay_header {
+    uint32_t type;              /* test type the result belongs to */
+    uint32_t length;            /* length of the packed result data */
+    uint64_t timestamp;         /* timestamp of the result */
+};
+
+/*
+ * A connection from a test process that is part way through sending a
+ * result. The header and data are read as they arrive, so that a slow test
+ * process can't block the main event loop.
+ */
+struct relay_connection_t {
+    int fd;                             /* connection to the test process */
+    struct amp_relay_header header;     /* header, valid once fully read */
+    size_t header_read;                 /* bytes of header read so far */
+    amp_test_result_t result;           /* result being read */
+    size_t data_read;                   /* bytes of result data read so far */
+    struct wand_timer_t *timeout;       /* closes the connection if stalled */
+};
+
+void broker_socket_event_callback(wand_event_handler_t *ev_hdl, int eventfd,
+        void *data, __attribute__((unused))enum wand_eventtype_t ev);
+int relay_result_to_parent(char *path, test_type_t type,
+        amp_test_result_t *result);
+
+#if UNIT_TEST
+int amp_test_read_relayed_result(struct relay_connection_t *conn);
+#endif
+
+#endif
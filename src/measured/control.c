@@ -436,6 +436,7 @@ static void control_read_callback(wand_event_handler_t *ev_hdl, int fd,
          */
         close(vars.asnsock_fd);
         close(vars.nssock_fd);
+        close(vars.brokersock_fd);
 
         /* unblock signals and remove handlers that the parent process added */
         if ( unblock_signals() < 0 ) {
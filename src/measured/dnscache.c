@@ -0,0 +1,849 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cache of name resolution results, shared by all the resolver threads that
+ * answer queries from test processes. Answers are kept for as long as their
+ * TTL allows (up to a configured limit), and names that don't exist or have
+ * no addresses of a type are remembered for a short time too.
+ *
+ * Names used by scheduled tests are refreshed shortly before the tests are
+ * due to run, so that in the common case the test process gets its
+ * destinations straight from memory and resolver latency isn't included in
+ * the time taken to run the test.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "hash.h"
+#include "dnscache.h"
+#include "schedule.h"
+
+/* DNS record types that hold addresses */
+#define DNS_TYPE_A 0x01
+#define DNS_TYPE_AAAA 0x1c
+/* DNS class for internet queries */
+#define DNS_CLASS_IN 0x01
+
+static int cache_enabled = 0;
+
+static amp_dns_cache_t cache_config = {
+    0,
+    DEFAULT_DNS_CACHE_MAX_ENTRIES,
+    DEFAULT_DNS_CACHE_MAX_TTL,
+    DEFAULT_DNS_CACHE_NEGATIVE_TTL,
+    DEFAULT_DNS_CACHE_PREFETCH,
+};
+
+/* protects the cached answers and counters, used by all resolver threads */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static dns_cache_entry_t *buckets[DNS_CACHE_BUCKETS];
+static dns_cache_stats_t stats;
+
+static wand_event_handler_t *cache_ev_hdl = NULL;
+static struct ub_ctx *cache_ctx = NULL;
+static struct wand_timer_t *sweep_timer = NULL;
+
+#if UNIT_TEST
+static int time_offset = 0;
+#endif
+
+
+
+/*
+ * Get the current time in seconds, used to expire cached answers. This can
+ * be called from any resolver thread so doesn't use the libwandevent time.
+ */
+static time_t get_cache_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+#if UNIT_TEST
+    return ts.tv_sec + time_offset;
+#else
+    return ts.tv_sec;
+#endif
+}
+
+
+
+/*
+ * FNV-1a hash of a name (ignoring case) and record type.
+ */
+static uint32_t hash_answer(const char *name, int qtype) {
+    uint32_t hash = FNV1A_32_INIT;
+    uint8_t lower;
+
+    for ( ; *name != '\0'; name++ ) {
+        lower = tolower((unsigned char)*name);
+        hash = fnv1a_32(hash, &lower, sizeof(lower));
+    }
+
+    return fnv1a_32(hash, &qtype, sizeof(qtype));
+}
+
+
+
+/*
+ * Names that are already addresses never need to be looked up. Anything with
+ * a colon can't be a hostname, and might be a scoped IPv6 address.
+ */
+static int is_numeric_address(const char *name) {
+    struct in_addr addr;
+
+    return strchr(name, ':') != NULL || inet_pton(AF_INET, name, &addr) == 1;
+}
+
+
+
+/*
+ * Length of the addresses held in an answer of the given record type.
+ */
+static uint16_t get_address_length(int qtype) {
+    switch ( qtype ) {
+        case DNS_TYPE_A: return sizeof(struct in_addr);
+        case DNS_TYPE_AAAA: return sizeof(struct in6_addr);
+        default: return 0;
+    };
+}
+
+
+
+/*
+ * Check if a query has been sent to refresh an answer, and it is recent
+ * enough that it is still worth waiting for the response.
+ */
+static int query_pending(dns_cache_entry_t *entry, time_t now) {
+    return entry->pending != 0 &&
+        now - entry->pending < DNS_CACHE_QUERY_TIMEOUT;
+}
+
+
+
+/*
+ * Find the cached answer for a name and record type. The cache lock must be
+ * held.
+ */
+static dns_cache_entry_t *find_entry(const char *name, int qtype,
+        uint32_t hash) {
+    dns_cache_entry_t *entry;
+
+    for ( entry = buckets[hash % DNS_CACHE_BUCKETS]; entry != NULL;
+            entry = entry->next ) {
+        if ( entry->hash == hash && entry->qtype == qtype &&
+                strcasecmp(entry->name, name) == 0 ) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Free a cached answer.
+ */
+static void free_entry(dns_cache_entry_t *entry) {
+    free(entry->name);
+    free(entry->addrs);
+    free(entry);
+}
+
+
+
+/*
+ * Remove all the answers that have expired and aren't waiting on a query
+ * to refresh them. The cache lock must be held.
+ */
+static uint32_t remove_expired_entries(time_t now) {
+    dns_cache_entry_t **prev, *entry;
+    uint32_t removed = 0;
+    int i;
+
+    for ( i = 0; i < DNS_CACHE_BUCKETS; i++ ) {
+        prev = &buckets[i];
+        while ( (entry = *prev) != NULL ) {
+            if ( entry->expires <= now && !query_pending(entry, now) ) {
+                *prev = entry->next;
+                free_entry(entry);
+                removed++;
+            } else {
+                prev = &entry->next;
+            }
+        }
+    }
+
+    stats.expired += removed;
+    stats.entries -= removed;
+
+    return removed;
+}
+
+
+
+/*
+ * Add an empty answer for a name and record type, making room for it if the
+ * cache is full. The cache lock must be held.
+ */
+static dns_cache_entry_t *add_entry(const char *name, int qtype,
+        uint32_t hash, time_t now) {
+    dns_cache_entry_t *entry;
+
+    if ( stats.entries >= cache_config.max_entries &&
+            remove_expired_entries(now) == 0 ) {
+        stats.full++;
+        return NULL;
+    }
+
+    entry = calloc(1, sizeof(dns_cache_entry_t));
+    entry->name = strdup(name);
+    entry->qtype = qtype;
+    entry->hash = hash;
+    entry->addrlen = get_address_length(qtype);
+    entry->next = buckets[hash % DNS_CACHE_BUCKETS];
+    buckets[hash % DNS_CACHE_BUCKETS] = entry;
+
+    stats.entries++;
+
+    return entry;
+}
+
+
+
+/*
+ * Remember the addresses (or lack of them) in a query answer. Server
+ * failures and the like aren't stored, the next query might work.
+ */
+static void store_answer(struct ub_result *result) {
+    dns_cache_entry_t *entry;
+    uint8_t *addrs = NULL;
+    uint16_t addrlen, count = 0;
+    uint32_t hash;
+    time_t now, ttl;
+    int i;
+
+    if ( (addrlen = get_address_length(result->qtype)) == 0 ) {
+        return;
+    }
+
+    if ( result->havedata ) {
+        for ( i = 0; result->data[i] != NULL; i++ ) {
+            /* nothing to do, just counting the addresses */
+        }
+
+        addrs = malloc(i * addrlen);
+
+        for ( i = 0; result->data[i] != NULL && count < UINT16_MAX; i++ ) {
+            if ( result->len[i] != addrlen ) {
+                continue;
+            }
+            memcpy(addrs + (count * addrlen), result->data[i], addrlen);
+            count++;
+        }
+
+        ttl = result->ttl > 0 ? result->ttl : 0;
+        if ( ttl > (time_t)cache_config.max_ttl ) {
+            ttl = cache_config.max_ttl;
+        }
+    } else if ( result->nxdomain || result->rcode == 0 ) {
+        ttl = cache_config.negative_ttl;
+    } else {
+        ttl = 0;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+
+    /* the cache may have been shut down while the query was outstanding */
+    if ( !cache_enabled ) {
+        goto end;
+    }
+
+    now = get_cache_time();
+    hash = hash_answer(result->qname, result->qtype);
+    entry = find_entry(result->qname, result->qtype, hash);
+
+    if ( ttl == 0 ) {
+        if ( entry != NULL ) {
+            entry->pending = 0;
+        }
+        goto end;
+    }
+
+    if ( entry == NULL &&
+            (entry = add_entry(result->qname, result->qtype, hash, now)) ==
+            NULL ) {
+        goto end;
+    }
+
+    free(entry->addrs);
+    entry->addrs = addrs;
+    entry->count = count;
+    entry->expires = now + ttl;
+    entry->pending = 0;
+    addrs = NULL;
+
+    stats.stored++;
+
+end:
+    pthread_mutex_unlock(&cache_lock);
+    free(addrs);
+}
+
+
+
+/*
+ * Build an addrinfo struct for an address from an answer.
+ */
+static struct addrinfo *new_address(int qtype, const char *name,
+        const void *addr) {
+    struct addrinfo *item = calloc(1, sizeof(struct addrinfo));
+
+    switch ( qtype ) {
+        case DNS_TYPE_A: item->ai_family = AF_INET;
+                         item->ai_addrlen = sizeof(struct sockaddr_in);
+                         item->ai_addr = calloc(1, item->ai_addrlen);
+                         item->ai_addr->sa_family = AF_INET;
+                         memcpy(&((struct sockaddr_in*)item->ai_addr)->sin_addr,
+                                 addr, sizeof(struct in_addr));
+                         break;
+        case DNS_TYPE_AAAA: item->ai_family = AF_INET6;
+                         item->ai_addrlen = sizeof(struct sockaddr_in6);
+                         item->ai_addr = calloc(1, item->ai_addrlen);
+                         item->ai_addr->sa_family = AF_INET6;
+                         memcpy(&((struct sockaddr_in6*)item->ai_addr)->sin6_addr,
+                                 addr, sizeof(struct in6_addr));
+                         break;
+        default: assert(0);
+                 break;
+    };
+
+    item->ai_canonname = strdup(name);
+
+    return item;
+}
+
+
+
+/*
+ * Give the addresses from a query answer to the test that asked for them,
+ * in the same way that amp_resolve_add() would. The answer may be NULL if
+ * the query failed, it still counts towards the queries being waited on.
+ */
+static void answer_request(struct amp_resolve_data *data,
+        struct ub_result *result) {
+    struct addrinfo *item;
+    uint16_t addrlen;
+    int qcount;
+    int i;
+
+    pthread_mutex_lock(data->lock);
+
+    assert(data->qcount > 0);
+    assert(*data->remaining > 0);
+
+    /* shared counter to track outstanding queries for this test */
+    (*data->remaining)--;
+
+    if ( result != NULL && result->havedata &&
+            (addrlen = get_address_length(result->qtype)) > 0 ) {
+        /* max is shared between the A and AAAA queries for the name */
+        for ( i = 0; result->data[i] != NULL &&
+                (data->max == -1 || data->max > 0); i++ ) {
+            if ( result->len[i] != addrlen ) {
+                continue;
+            }
+
+            item = new_address(result->qtype, result->qname, result->data[i]);
+            item->ai_next = *data->addrlist;
+            *data->addrlist = item;
+
+            if ( data->max > 0 ) {
+                data->max--;
+            }
+        }
+    }
+
+    /* tell the caller once every query for the test has been answered */
+    if ( *data->remaining == 0 && data->notify ) {
+        data->notify(data->notify_data);
+    }
+
+    /* get outstanding queries for this name while we still have it locked */
+    qcount = --data->qcount;
+
+    pthread_mutex_unlock(data->lock);
+
+    /* no outstanding queries for this name, can free the data block */
+    if ( qcount <= 0 ) {
+        free(data);
+    }
+}
+
+
+
+/*
+ * Deal with a DNS response being returned - store it in the cache and, if a
+ * test is waiting on it, add the addresses to the list for that test. Any
+ * thread could end up calling this for incoming data.
+ */
+static void dns_cache_callback(void *d, int err, struct ub_result *result) {
+    struct amp_resolve_data *data = (struct amp_resolve_data *)d;
+
+    if ( err != 0 || result == NULL ) {
+        Log(LOG_DEBUG, "resolve error: %s", ub_strerror(err));
+        ub_resolve_free(result);
+        result = NULL;
+    } else {
+        Log(LOG_DEBUG, "Got a DNS response for %s (%x)", result->qname,
+                result->qtype);
+        store_answer(result);
+    }
+
+    if ( data != NULL ) {
+        answer_request(data, result);
+    }
+
+    ub_resolve_free(result);
+}
+
+
+
+/*
+ * Send a query for a name and record type. If the data block is NULL then
+ * the answer is only used to refresh the cache.
+ */
+static int query_answer(struct ub_ctx *ctx, char *name, int qtype,
+        struct amp_resolve_data *data) {
+#if UNIT_TEST
+    /* tests don't have a resolver, they give the cache answers themselves */
+    if ( ctx == NULL ) {
+        return -1;
+    }
+#endif
+
+    return ub_resolve_async(ctx, name, qtype, DNS_CLASS_IN, (void*)data,
+            dns_cache_callback, NULL);
+}
+
+
+
+/*
+ * Copy the addresses from a cached answer onto a list, up to the maximum
+ * number of addresses allowed. Returns 1 if a current answer was found, or
+ * 0 if the name needs to be queried for. The cache lock must be held.
+ */
+static int copy_cached_answer(const char *name, int qtype, time_t now,
+        struct addrinfo **list, int *max) {
+    dns_cache_entry_t *entry;
+    struct addrinfo *item;
+    int i;
+
+    entry = find_entry(name, qtype, hash_answer(name, qtype));
+
+    if ( entry == NULL || entry->expires <= now ) {
+        stats.misses++;
+        return 0;
+    }
+
+    stats.hits++;
+
+    if ( entry->count == 0 ) {
+        stats.negative_hits++;
+    }
+
+    for ( i = 0; i < entry->count && (*max == -1 || *max > 0); i++ ) {
+        item = new_address(qtype, name, entry->addrs + (i * entry->addrlen));
+        item->ai_next = *list;
+        *list = item;
+
+        if ( *max > 0 ) {
+            (*max)--;
+        }
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Add a request for the addresses of a name, answering it from the cache
+ * where possible and otherwise querying for it. Takes the same arguments as
+ * amp_resolve_add_notify(), and uses the addrlist lock, remaining counter
+ * and notify function in the same way.
+ */
+void dns_cache_resolve_add(struct ub_ctx *ctx, struct addrinfo **res,
+        pthread_mutex_t *addrlist_lock, char *name, int family, int max,
+        int *remaining, void (*notify)(void *), void *notify_data) {
+
+    struct amp_resolve_data *data;
+    struct addrinfo *cached = NULL, *item;
+    int qtypes[2], missing[2];
+    int count = 0, nmissing = 0;
+    int i;
+    time_t now;
+
+    assert(res);
+    assert(name);
+
+    /* numeric addresses and disabled caches are dealt with as normal */
+    if ( !cache_enabled || is_numeric_address(name) ) {
+        amp_resolve_add_notify(ctx, res, addrlist_lock, name, family, max,
+                remaining, notify, notify_data);
+        return;
+    }
+
+    if ( max <= 0 ) {
+        max = -1;
+    }
+
+    if ( family == AF_UNSPEC || family == AF_INET ) {
+        qtypes[count++] = DNS_TYPE_A;
+    }
+
+    if ( family == AF_UNSPEC || family == AF_INET6 ) {
+        qtypes[count++] = DNS_TYPE_AAAA;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    now = get_cache_time();
+    for ( i = 0; i < count; i++ ) {
+        if ( !copy_cached_answer(name, qtypes[i], now, &cached, &max) ) {
+            missing[nmissing++] = qtypes[i];
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    /* prepend any cached addresses to the result list */
+    if ( cached != NULL ) {
+        pthread_mutex_lock(addrlist_lock);
+        for ( item = cached; item->ai_next != NULL; item = item->ai_next ) {
+            /* nothing to do, just finding the end of the list */
+        }
+        item->ai_next = *res;
+        *res = cached;
+        pthread_mutex_unlock(addrlist_lock);
+    }
+
+    /* everything was cached, or the cache has already filled the maximum */
+    if ( nmissing == 0 || max == 0 ) {
+        Log(LOG_DEBUG, "Answered request for %s from cache", name);
+        return;
+    }
+
+    Log(LOG_DEBUG, "Adding resolve request for %s", name);
+
+    data = calloc(1, sizeof(struct amp_resolve_data));
+    data->addrlist = res;
+    data->lock = addrlist_lock;
+    data->max = max;
+    data->qcount = nmissing;
+    data->notify = notify;
+    data->notify_data = notify_data;
+
+    pthread_mutex_lock(data->lock);
+    data->remaining = remaining;
+    *data->remaining += data->qcount;
+    pthread_mutex_unlock(data->lock);
+
+    /* data may be freed once the last query is answered, don't touch it */
+    for ( i = 0; i < nmissing; i++ ) {
+        if ( query_answer(ctx, name, missing[i], data) != 0 ) {
+            Log(LOG_WARNING, "Failed to send query for %s", name);
+            answer_request(data, NULL);
+        }
+    }
+}
+
+
+
+/*
+ * Query for an answer that won't still be current when a test runs, unless
+ * a query for it is already outstanding. The cache lock must be held.
+ */
+static void refresh_answer(char *name, int qtype, time_t now, time_t fire) {
+    dns_cache_entry_t *entry;
+    uint32_t hash;
+
+    hash = hash_answer(name, qtype);
+    entry = find_entry(name, qtype, hash);
+
+    if ( entry != NULL &&
+            (entry->expires > fire || query_pending(entry, now)) ) {
+        return;
+    }
+
+    if ( entry == NULL &&
+            (entry = add_entry(name, qtype, hash, now)) == NULL ) {
+        return;
+    }
+
+    entry->pending = now;
+    stats.prefetches++;
+
+    if ( query_answer(cache_ctx, name, qtype, NULL) != 0 ) {
+        Log(LOG_WARNING, "Failed to send query to refresh %s", name);
+        entry->pending = 0;
+    }
+}
+
+
+
+/*
+ * Refresh the names used by any scheduled test that will run within the
+ * prefetch interval, so they are cached by the time the test needs them.
+ */
+static void prefetch_scheduled_names(amp_timer_heap_t *heap,
+        struct timeval *mono) {
+    schedule_item_t *item;
+    test_schedule_item_t *test;
+    resolve_dest_t *resolve;
+    struct timeval offset;
+    time_t now, fire;
+    uint32_t i;
+
+    if ( !cache_enabled || cache_config.prefetch == 0 ) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    now = get_cache_time();
+
+    for ( i = 0; i < heap->count; i++ ) {
+        item = (schedule_item_t *)heap->timers[i]->data;
+        if ( item == NULL || item->type != EVENT_RUN_TEST ||
+                item->data.test->resolve == NULL ) {
+            continue;
+        }
+
+        timersub(&heap->timers[i]->expire, mono, &offset);
+        if ( offset.tv_sec >= (time_t)cache_config.prefetch ) {
+            continue;
+        }
+
+        /* answers need to last until the (rounded up) time the test runs */
+        fire = now + (offset.tv_sec >= 0 ? offset.tv_sec + 1 : 0);
+        test = item->data.test;
+
+        for ( resolve = test->resolve; resolve != NULL;
+                resolve = resolve->next ) {
+            if ( resolve->name == NULL || is_numeric_address(resolve->name) ) {
+                continue;
+            }
+
+            if ( resolve->family == AF_UNSPEC || resolve->family == AF_INET ) {
+                refresh_answer(resolve->name, DNS_TYPE_A, now, fire);
+            }
+
+            if ( resolve->family == AF_UNSPEC || resolve->family == AF_INET6 ) {
+                refresh_answer(resolve->name, DNS_TYPE_AAAA, now, fire);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+
+/*
+ * Regularly refresh names for tests that are about to run, and throw away
+ * any answers that have expired.
+ */
+static void sweep_timer_callback(wand_event_handler_t *ev_hdl,
+        __attribute__((unused))void *data) {
+    struct timeval mono;
+
+    sweep_timer = NULL;
+
+    mono = wand_get_monotonictime(ev_hdl);
+    prefetch_scheduled_names(get_schedule_timers(ev_hdl), &mono);
+
+    pthread_mutex_lock(&cache_lock);
+    remove_expired_entries(get_cache_time());
+    pthread_mutex_unlock(&cache_lock);
+
+    sweep_timer = wand_add_timer(ev_hdl, DNS_CACHE_SWEEP_INTERVAL, 0, NULL,
+            sweep_timer_callback);
+}
+
+
+
+/*
+ * Set how the name resolution cache behaves, and start refreshing names
+ * used by scheduled tests. This should be called by the main process once
+ * the resolver context has been created.
+ */
+void set_dns_cache_config(wand_event_handler_t *ev_hdl, struct ub_ctx *ctx,
+        amp_dns_cache_t *config) {
+
+    cache_enabled = 0;
+    cache_ev_hdl = ev_hdl;
+    cache_ctx = ctx;
+
+    if ( config == NULL || !config->enabled || config->max_entries == 0 ) {
+        Log(LOG_DEBUG, "Name resolution cache is disabled");
+        return;
+    }
+
+    cache_config.max_entries = config->max_entries;
+    cache_config.max_ttl = config->max_ttl;
+    cache_config.negative_ttl = config->negative_ttl;
+    cache_config.prefetch = config->prefetch;
+
+    /* a test could slip between two sweeps if the interval is too short */
+    if ( cache_config.prefetch > 0 &&
+            cache_config.prefetch <= DNS_CACHE_SWEEP_INTERVAL ) {
+        cache_config.prefetch = DNS_CACHE_SWEEP_INTERVAL + 1;
+    }
+
+    Log(LOG_DEBUG, "Caching up to %u names, resolving %us before tests run",
+            cache_config.max_entries, cache_config.prefetch);
+
+    cache_enabled = 1;
+
+    /* answers to refresh queries are processed by the resolver threads */
+    if ( cache_ev_hdl != NULL && sweep_timer == NULL ) {
+        sweep_timer = wand_add_timer(cache_ev_hdl, DNS_CACHE_SWEEP_INTERVAL, 0,
+                NULL, sweep_timer_callback);
+    }
+}
+
+
+
+/*
+ * Stop caching answers and free everything in the cache. Should only be
+ * called when measured is terminating, before the resolver context is
+ * deleted.
+ */
+void close_dns_cache(void) {
+    dns_cache_entry_t *entry;
+    int i;
+
+    if ( sweep_timer != NULL ) {
+        wand_del_timer(cache_ev_hdl, sweep_timer);
+        sweep_timer = NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+
+    cache_enabled = 0;
+    cache_ev_hdl = NULL;
+    cache_ctx = NULL;
+
+    for ( i = 0; i < DNS_CACHE_BUCKETS; i++ ) {
+        while ( (entry = buckets[i]) != NULL ) {
+            buckets[i] = entry->next;
+            free_entry(entry);
+        }
+    }
+
+    stats.entries = 0;
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+
+/*
+ * Get a copy of the cache counters.
+ */
+void get_dns_cache_stats(dns_cache_stats_t *out) {
+    assert(out);
+
+    pthread_mutex_lock(&cache_lock);
+    memcpy(out, &stats, sizeof(dns_cache_stats_t));
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+
+/*
+ * Dump the current state of the cache for debug purposes.
+ */
+void dump_dns_cache_stats(FILE *out) {
+    dns_cache_stats_t current;
+
+    assert(out);
+
+    fprintf(out, "===== DNS CACHE =====\n");
+
+    if ( !cache_enabled ) {
+        fprintf(out, "Disabled\n");
+        return;
+    }
+
+    get_dns_cache_stats(&current);
+
+    fprintf(out, "Entries: %u of %u\n", current.entries,
+            cache_config.max_entries);
+    fprintf(out, "Hits: %" PRIu64 " (%" PRIu64 " negative), misses: %"
+            PRIu64 "\n", current.hits, current.negative_hits, current.misses);
+    fprintf(out, "Prefetches: %" PRIu64 ", stored: %" PRIu64 "\n",
+            current.prefetches, current.stored);
+    fprintf(out, "Expired: %" PRIu64 ", not stored (full): %" PRIu64 "\n",
+            current.expired, current.full);
+}
+
+
+
+#if UNIT_TEST
+void amp_test_dns_cache_answer(struct ub_result *result) {
+    store_answer(result);
+}
+
+void amp_test_dns_cache_advance(int seconds) {
+    time_offset += seconds;
+}
+
+void amp_test_dns_cache_prefetch(amp_timer_heap_t *heap, struct timeval *now) {
+    prefetch_scheduled_names(heap, now);
+}
+#endif
@@ -0,0 +1,126 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_DNSCACHE_H
+#define _MEASURED_DNSCACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <unbound.h>
+#include <libwandevent.h>
+
+#include "ampresolv.h"
+#include "timerheap.h"
+
+/* number of hash buckets used to index the cached answers */
+#define DNS_CACHE_BUCKETS 1024
+/* default maximum number of answers (a name and record type) to cache */
+#define DEFAULT_DNS_CACHE_MAX_ENTRIES 8192
+/* default longest time to keep an answer, regardless of its TTL (seconds) */
+#define DEFAULT_DNS_CACHE_MAX_TTL 3600
+/* default time to remember that a name has no addresses (seconds) */
+#define DEFAULT_DNS_CACHE_NEGATIVE_TTL 60
+/* default time before a test runs that its names are resolved (seconds) */
+#define DEFAULT_DNS_CACHE_PREFETCH 30
+/* how often to look for tests that are about to run (seconds) */
+#define DNS_CACHE_SWEEP_INTERVAL 5
+/* time after which an unanswered refresh query is tried again (seconds) */
+#define DNS_CACHE_QUERY_TIMEOUT 30
+
+/*
+ * Configuration for caching name resolution results in measured.
+ */
+typedef struct amp_dns_cache {
+    int enabled;
+    uint32_t max_entries;           /* maximum number of answers to cache */
+    uint32_t max_ttl;               /* longest time to keep an answer */
+    uint32_t negative_ttl;          /* time to keep an empty answer */
+    uint32_t prefetch;              /* resolve names this long before tests */
+} amp_dns_cache_t;
+
+/*
+ * A single cached answer, holding all the addresses of one record type
+ * (A or AAAA) for a name. An answer with no addresses records that the
+ * name doesn't exist or has no records of that type.
+ */
+typedef struct dns_cache_entry {
+    char *name;                     /* name that was queried */
+    int qtype;                      /* record type that was queried */
+    uint32_t hash;                  /* hash of the name and record type */
+    time_t expires;                 /* time the answer is no longer valid */
+    time_t pending;                 /* time a refresh query was sent, or 0 */
+    uint16_t addrlen;               /* length of each address */
+    uint16_t count;                 /* number of addresses in the answer */
+    uint8_t *addrs;                 /* all the addresses, back to back */
+    struct dns_cache_entry *next;
+} dns_cache_entry_t;
+
+/*
+ * Counters describing how well the cache is working.
+ */
+typedef struct dns_cache_stats {
+    uint64_t hits;                  /* answers found in the cache */
+    uint64_t negative_hits;         /* of those, answers with no addresses */
+    uint64_t misses;                /* answers that had to be queried for */
+    uint64_t prefetches;            /* queries made ahead of tests running */
+    uint64_t stored;                /* answers added to or updated in cache */
+    uint64_t expired;               /* stale answers removed from the cache */
+    uint64_t full;                  /* answers not stored, cache was full */
+    uint32_t entries;               /* current number of cached answers */
+} dns_cache_stats_t;
+
+void set_dns_cache_config(wand_event_handler_t *ev_hdl, struct ub_ctx *ctx,
+        amp_dns_cache_t *config);
+void close_dns_cache(void);
+void dns_cache_resolve_add(struct ub_ctx *ctx, struct addrinfo **res,
+        pthread_mutex_t *addrlist_lock, char *name, int family, int max,
+        int *remaining, void (*notify)(void *), void *notify_data);
+void get_dns_cache_stats(dns_cache_stats_t *stats);
+void dump_dns_cache_stats(FILE *out);
+
+#if UNIT_TEST
+void amp_test_dns_cache_answer(struct ub_result *result);
+void amp_test_dns_cache_advance(int seconds);
+void amp_test_dns_cache_prefetch(amp_timer_heap_t *heap, struct timeval *now);
+#endif
+
+#endif
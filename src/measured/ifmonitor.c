@@ -0,0 +1,652 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Keep a snapshot of all the interfaces and addresses on the machine, so
+ * that tests don't each have to ask the kernel for them. The snapshot lives
+ * in shared memory created before any tests or test runners are forked, and
+ * is kept up to date by listening for rtnetlink link and address changes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_addr.h>
+#include <linux/if_link.h>
+
+#include "ifmonitor.h"
+#include "debug.h"
+
+static struct amp_ifsnapshot *snapshot = NULL;
+static wand_event_handler_t *monitor_ev_hdl = NULL;
+static int monitor_fd = -1;
+
+static ifmonitor_link_t *links = NULL;
+static int link_count = 0;
+static int link_size = 0;
+
+static struct amp_if_address *addresses = NULL;
+static int address_count = 0;
+static int address_size = 0;
+
+/* set when a dump failed, the lists are incomplete until another succeeds */
+static int needs_resync = 0;
+
+static ifmonitor_stats_t stats;
+
+
+
+/*
+ * Find the interface with the given index.
+ */
+static ifmonitor_link_t *find_link(int index) {
+    int i;
+
+    for ( i = 0; i < link_count; i++ ) {
+        if ( links[i].index == index ) {
+            return &links[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Find an address on an interface.
+ */
+static struct amp_if_address *find_address(int index, int family,
+        void *addr) {
+    size_t addrlen = (family == AF_INET) ?
+        sizeof(struct in_addr) : sizeof(struct in6_addr);
+    int i;
+
+    for ( i = 0; i < address_count; i++ ) {
+        if ( addresses[i].index == index && addresses[i].family == family &&
+                memcmp(&addresses[i].addr, addr, addrlen) == 0 ) {
+            return &addresses[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Remove all the addresses belonging to an interface.
+ */
+static void remove_link_addresses(int index) {
+    int i;
+
+    for ( i = 0; i < address_count; /* no increment */ ) {
+        if ( addresses[i].index == index ) {
+            addresses[i] = addresses[--address_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+
+
+/*
+ * Update the list of interfaces from a RTM_NEWLINK or RTM_DELLINK message.
+ */
+static int update_link(struct nlmsghdr *nh) {
+    struct ifinfomsg *ifi = NLMSG_DATA(nh);
+    struct rtattr *rta;
+    ifmonitor_link_t *link;
+    char *name = NULL;
+    int length;
+
+    if ( nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)) ) {
+        return -1;
+    }
+
+    link = find_link(ifi->ifi_index);
+
+    if ( nh->nlmsg_type == RTM_DELLINK ) {
+        if ( link != NULL ) {
+            Log(LOG_DEBUG, "Interface %s removed", link->name);
+            remove_link_addresses(ifi->ifi_index);
+            *link = links[--link_count];
+        }
+        return 0;
+    }
+
+    length = IFLA_PAYLOAD(nh);
+    for ( rta = IFLA_RTA(ifi); RTA_OK(rta, length);
+            rta = RTA_NEXT(rta, length) ) {
+        if ( rta->rta_type == IFLA_IFNAME ) {
+            name = RTA_DATA(rta);
+        }
+    }
+
+    if ( link == NULL ) {
+        if ( link_count >= link_size ) {
+            link_size = (link_size * 2) + 8;
+            links = realloc(links, link_size * sizeof(ifmonitor_link_t));
+            assert(links);
+        }
+        link = &links[link_count++];
+        memset(link, 0, sizeof(*link));
+        link->index = ifi->ifi_index;
+    }
+
+    link->flags = ifi->ifi_flags;
+
+    if ( name != NULL ) {
+        snprintf(link->name, sizeof(link->name), "%s", name);
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Update the list of addresses from a RTM_NEWADDR or RTM_DELADDR message.
+ */
+static int update_address(struct nlmsghdr *nh) {
+    struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+    struct amp_if_address *address;
+    struct rtattr *rta;
+    void *local = NULL, *addr = NULL;
+    char *label = NULL;
+    size_t addrlen;
+    int length;
+
+    if ( nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)) ) {
+        return -1;
+    }
+
+    switch ( ifa->ifa_family ) {
+        case AF_INET: addrlen = sizeof(struct in_addr); break;
+        case AF_INET6: addrlen = sizeof(struct in6_addr); break;
+        default: return 0;
+    };
+
+    length = IFA_PAYLOAD(nh);
+    for ( rta = IFA_RTA(ifa); RTA_OK(rta, length);
+            rta = RTA_NEXT(rta, length) ) {
+        if ( RTA_PAYLOAD(rta) < addrlen &&
+                (rta->rta_type == IFA_LOCAL || rta->rta_type == IFA_ADDRESS) ) {
+            continue;
+        }
+
+        switch ( rta->rta_type ) {
+            case IFA_LOCAL: local = RTA_DATA(rta); break;
+            case IFA_ADDRESS: addr = RTA_DATA(rta); break;
+            case IFA_LABEL: label = RTA_DATA(rta); break;
+            default: break;
+        };
+    }
+
+    /* on point to point links the local address is in IFA_LOCAL */
+    if ( local != NULL ) {
+        addr = local;
+    }
+
+    if ( addr == NULL ) {
+        return 0;
+    }
+
+    address = find_address(ifa->ifa_index, ifa->ifa_family, addr);
+
+    if ( nh->nlmsg_type == RTM_DELADDR ) {
+        if ( address != NULL ) {
+            *address = addresses[--address_count];
+        }
+        return 0;
+    }
+
+    if ( address == NULL ) {
+        if ( address_count >= address_size ) {
+            address_size = (address_size * 2) + 8;
+            addresses = realloc(addresses,
+                    address_size * sizeof(struct amp_if_address));
+            assert(addresses);
+        }
+        address = &addresses[address_count++];
+        memset(address, 0, sizeof(*address));
+        address->index = ifa->ifa_index;
+        address->family = ifa->ifa_family;
+        memcpy(&address->addr, addr, addrlen);
+    }
+
+    address->prefixlen = ifa->ifa_prefixlen;
+
+    /*
+     * IPv4 addresses have their own label (e.g. "eth0:1"), which is the name
+     * getifaddrs() gives them, so use it instead of the interface name.
+     */
+    if ( label != NULL ) {
+        snprintf(address->name, sizeof(address->name), "%s", label);
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Apply all the link and address changes in a buffer of netlink messages.
+ * Returns 1 if the end of a dump was reached, -1 if there was an error,
+ * otherwise 0.
+ */
+static int process_messages(void *buffer, int length) {
+    struct nlmsghdr *nh;
+
+    for ( nh = (struct nlmsghdr *)buffer; NLMSG_OK(nh, length);
+            nh = NLMSG_NEXT(nh, length) ) {
+        switch ( nh->nlmsg_type ) {
+            case NLMSG_DONE:
+                return 1;
+
+            case NLMSG_ERROR: {
+                struct nlmsgerr *err = NLMSG_DATA(nh);
+                if ( err->error != 0 ) {
+                    Log(LOG_WARNING, "Netlink error: %s",
+                            strerror(-err->error));
+                    return -1;
+                }
+                break;
+            }
+
+            case RTM_NEWLINK:
+            case RTM_DELLINK:
+                update_link(nh);
+                break;
+
+            case RTM_NEWADDR:
+            case RTM_DELADDR:
+                update_address(nh);
+                break;
+
+            default:
+                break;
+        };
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Copy all the current addresses into the shared snapshot, naming them
+ * after the interface they belong to unless they have their own label.
+ */
+static void publish_snapshot(void) {
+    struct amp_if_address current[AMP_IFSNAPSHOT_MAX_ADDRESSES];
+    ifmonitor_link_t *link;
+    int count, i;
+
+    /* partial lists would hide addresses, tests should ask the kernel */
+    if ( snapshot == NULL || needs_resync ) {
+        return;
+    }
+
+    count = address_count;
+    if ( count > AMP_IFSNAPSHOT_MAX_ADDRESSES ) {
+        Log(LOG_WARNING, "Too many addresses (%d) to share with tests, they "
+                "will have to look them up", address_count);
+        count = AMP_IFSNAPSHOT_MAX_ADDRESSES;
+    }
+
+    for ( i = 0; i < count; i++ ) {
+        current[i] = addresses[i];
+        if ( (link = find_link(addresses[i].index)) != NULL ) {
+            current[i].flags = link->flags;
+            if ( current[i].name[0] == '\0' ) {
+                memcpy(current[i].name, link->name, sizeof(current[i].name));
+            }
+        }
+    }
+
+    amp_ifsnapshot_publish(snapshot, current, count,
+            address_count > AMP_IFSNAPSHOT_MAX_ADDRESSES);
+
+    stats.updates++;
+    stats.links = link_count;
+    stats.addresses = address_count;
+}
+
+
+
+/*
+ * Ask the kernel to dump all the links or addresses it knows about, and add
+ * them to our lists. This uses a separate socket so that the responses
+ * can't be confused with any change notifications.
+ */
+static int dump_request(int type) {
+    struct {
+        struct nlmsghdr nh;
+        struct rtgenmsg gen;
+    } request;
+    char buffer[IFMONITOR_BUFFER_SIZE]
+        __attribute__((aligned(__alignof__(struct nlmsghdr))));
+    int sock, bytes, ret = -1;
+
+    if ( (sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+                    NETLINK_ROUTE)) < 0 ) {
+        Log(LOG_WARNING, "Failed to create netlink socket: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg));
+    request.nh.nlmsg_type = type;
+    request.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.nh.nlmsg_seq = 1;
+    request.gen.rtgen_family = AF_UNSPEC;
+
+    if ( send(sock, &request, request.nh.nlmsg_len, 0) < 0 ) {
+        Log(LOG_WARNING, "Failed to send netlink dump request: %s",
+                strerror(errno));
+        goto end;
+    }
+
+    while ( (bytes = recv(sock, buffer, sizeof(buffer), 0)) > 0 ) {
+        if ( (ret = process_messages(buffer, bytes)) != 0 ) {
+            break;
+        }
+    }
+
+    if ( bytes < 0 ) {
+        Log(LOG_WARNING, "Failed to read netlink dump: %s", strerror(errno));
+        ret = -1;
+    }
+
+end:
+    close(sock);
+    return ret < 0 ? -1 : 0;
+}
+
+
+
+/*
+ * The lists are incomplete after a failed dump, so stop tests from using
+ * the snapshot until a later dump succeeds.
+ */
+static void resync_failed(void) {
+    needs_resync = 1;
+    stats.resync_failures++;
+
+    if ( snapshot != NULL ) {
+        amp_ifsnapshot_invalidate(snapshot);
+    }
+}
+
+
+
+/*
+ * Throw away everything we know and get a complete new view of the links
+ * and addresses from the kernel.
+ */
+static int resync_interfaces(void) {
+    Log(LOG_DEBUG, "Fetching all interfaces and addresses");
+
+    link_count = 0;
+    address_count = 0;
+    stats.resyncs++;
+
+    if ( dump_request(RTM_GETLINK) < 0 || dump_request(RTM_GETADDR) < 0 ) {
+        resync_failed();
+        return -1;
+    }
+
+    needs_resync = 0;
+    publish_snapshot();
+
+    return 0;
+}
+
+
+
+/*
+ * Read all the available link and address change notifications, and update
+ * the snapshot once they have been applied.
+ */
+static void monitor_callback(
+        __attribute__((unused))wand_event_handler_t *ev_hdl, int fd,
+        __attribute__((unused))void *data,
+        __attribute__((unused))enum wand_eventtype_t ev) {
+
+    char buffer[IFMONITOR_BUFFER_SIZE]
+        __attribute__((aligned(__alignof__(struct nlmsghdr))));
+    int bytes;
+    int changed = 0;
+
+    while ( (bytes = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) != 0 ) {
+        if ( bytes < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+
+            /* we missed some notifications, fetch everything again */
+            if ( errno == ENOBUFS ) {
+                Log(LOG_INFO, "Missed interface updates, fetching them all");
+                if ( resync_interfaces() < 0 ) {
+                    Log(LOG_WARNING, "Failed to fetch interfaces");
+                }
+                changed = 0;
+                continue;
+            }
+
+            if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+                Log(LOG_WARNING, "Failed to read interface updates: %s",
+                        strerror(errno));
+            }
+            break;
+        }
+
+        process_messages(buffer, bytes);
+        changed = 1;
+    }
+
+    /* changes can't be applied to incomplete lists, try fetching again */
+    if ( changed && needs_resync ) {
+        Log(LOG_INFO, "Interface list is incomplete, fetching them all");
+        if ( resync_interfaces() < 0 ) {
+            Log(LOG_WARNING, "Failed to fetch interfaces");
+        }
+        return;
+    }
+
+    if ( changed ) {
+        publish_snapshot();
+    }
+}
+
+
+
+/*
+ * Create the shared interface snapshot, fill it with the current state of
+ * the interfaces and start listening for changes. This needs to happen
+ * before the test runners are started so that they share the snapshot.
+ */
+int start_interface_monitor(wand_event_handler_t *ev_hdl) {
+    struct sockaddr_nl addr;
+
+    assert(ev_hdl);
+    assert(monitor_fd < 0);
+
+    memset(&stats, 0, sizeof(stats));
+
+    if ( (snapshot = amp_ifsnapshot_create()) == NULL ) {
+        return -1;
+    }
+
+    if ( (monitor_fd = socket(AF_NETLINK,
+                    SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    NETLINK_ROUTE)) < 0 ) {
+        Log(LOG_WARNING, "Failed to create netlink socket: %s",
+                strerror(errno));
+        goto error;
+    }
+
+    /* subscribe before dumping so that no changes can be missed */
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+
+    if ( bind(monitor_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ) {
+        Log(LOG_WARNING, "Failed to bind netlink socket: %s",
+                strerror(errno));
+        goto error;
+    }
+
+    if ( resync_interfaces() < 0 ) {
+        goto error;
+    }
+
+    monitor_ev_hdl = ev_hdl;
+    wand_add_fd(ev_hdl, monitor_fd, EV_READ, NULL, monitor_callback);
+
+    Log(LOG_DEBUG, "Monitoring %d interfaces with %d addresses", link_count,
+            address_count);
+
+    return 0;
+
+error:
+    stop_interface_monitor();
+    return -1;
+}
+
+
+
+/*
+ * Stop listening for interface changes and remove the snapshot, after which
+ * tests will look up the interfaces themselves.
+ */
+void stop_interface_monitor(void) {
+    if ( monitor_fd >= 0 ) {
+        if ( monitor_ev_hdl ) {
+            wand_del_fd(monitor_ev_hdl, monitor_fd);
+        }
+        close(monitor_fd);
+        monitor_fd = -1;
+    }
+
+    monitor_ev_hdl = NULL;
+
+    amp_ifsnapshot_destroy(snapshot);
+    snapshot = NULL;
+
+    free(links);
+    links = NULL;
+    link_count = link_size = 0;
+
+    free(addresses);
+    addresses = NULL;
+    address_count = address_size = 0;
+
+    needs_resync = 0;
+}
+
+
+
+/*
+ * Get a copy of the current interface monitor statistics.
+ */
+void get_interface_monitor_stats(ifmonitor_stats_t *out) {
+    assert(out);
+    memcpy(out, &stats, sizeof(stats));
+}
+
+
+
+/*
+ * Dump the current state of the interface monitor for debug purposes.
+ */
+void dump_interface_monitor_stats(FILE *out) {
+    int i;
+
+    assert(out);
+
+    fprintf(out, "===== INTERFACES =====\n");
+
+    if ( snapshot == NULL ) {
+        fprintf(out, "Not monitored\n");
+        return;
+    }
+
+    fprintf(out, "Links: %u, addresses: %u\n", stats.links, stats.addresses);
+    fprintf(out, "Updates: %" PRIu64 ", full fetches: %" PRIu64 " (%" PRIu64
+            " failed)%s\n", stats.updates, stats.resyncs, stats.resync_failures,
+            needs_resync ? ", snapshot unusable" : "");
+
+    for ( i = 0; i < link_count; i++ ) {
+        fprintf(out, "%d: %s%s\n", links[i].index, links[i].name,
+                (links[i].flags & IFF_UP) ? "" : " (down)");
+    }
+}
+
+
+
+#if UNIT_TEST
+int amp_test_ifmonitor_process(void *buffer, int length) {
+    int ret;
+
+    if ( snapshot == NULL ) {
+        snapshot = amp_ifsnapshot_create();
+    }
+
+    ret = process_messages(buffer, length);
+    publish_snapshot();
+
+    return ret;
+}
+
+void amp_test_ifmonitor_resync_failed(void) {
+    link_count = 0;
+    address_count = 0;
+    resync_failed();
+}
+#endif
@@ -0,0 +1,83 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_IFMONITOR_H
+#define _MEASURED_IFMONITOR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <net/if.h>
+#include <libwandevent.h>
+
+#include "ifsnapshot.h"
+
+/* size of the buffer used to receive netlink messages */
+#define IFMONITOR_BUFFER_SIZE 32768
+
+/*
+ * An interface known to the monitor, used to name the addresses on it.
+ */
+typedef struct ifmonitor_link {
+    int index;                      /* index of the interface */
+    unsigned int flags;             /* interface flags, IFF_UP etc */
+    char name[IF_NAMESIZE];         /* name of the interface */
+} ifmonitor_link_t;
+
+/*
+ * Counters describing how often the snapshot has changed.
+ */
+typedef struct ifmonitor_stats {
+    uint64_t updates;               /* times the snapshot was published */
+    uint64_t resyncs;               /* full dumps of the kernel state */
+    uint64_t resync_failures;       /* dumps that didn't complete */
+    uint32_t links;                 /* current number of interfaces */
+    uint32_t addresses;             /* current number of addresses */
+} ifmonitor_stats_t;
+
+int start_interface_monitor(wand_event_handler_t *ev_hdl);
+void stop_interface_monitor(void);
+void get_interface_monitor_stats(ifmonitor_stats_t *stats);
+void dump_interface_monitor_stats(FILE *out);
+
+#if UNIT_TEST
+int amp_test_ifmonitor_process(void *buffer, int length);
+void amp_test_ifmonitor_resync_failed(void);
+#endif
+
+#endif
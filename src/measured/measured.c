@@ -52,6 +52,7 @@
 
 #include "config.h"
 #include "schedule.h"
+#include "schedule_cache.h"
 #include "watchdog.h"
 #include "nametable.h"
 #include "debug.h"
@@ -63,9 +64,16 @@
 #include "rabbitcfg.h"
 #include "nssock.h"
 #include "asnsock.h"
+#include "ifmonitor.h"
+#include "brokersock.h"
+#include "messaging.h"
+#include "spool.h"
+#include "dnscache.h"
 #include "localsock.h"
 #include "certs.h"
 #include "parseconfig.h"
+#include "testrunner.h"
+#include "admission.h"
 
 #define AMP_CLIENT_CONFIG_DIR AMP_CONFIG_DIR "/clients"
 
@@ -213,14 +221,21 @@ static void reload(wand_event_handler_t *ev_hdl, int signum, void *data) {
     if ( signum > 0 ) {
         Log(LOG_INFO, "Received signal %d, reloading all configuration",signum);
 
-        /* cancel all scheduled tests (let running ones finish) */
-        clear_test_schedule(ev_hdl, 0);
+        /*
+         * Remember the currently scheduled tests so that any which are
+         * unchanged by the reload can keep their place in the schedule.
+         * This has to happen before the nametable they refer to is cleared.
+         */
+        begin_schedule_reload(ev_hdl);
 
-        /* empty the nametable */
-        clear_nametable();
+        /* only nametable files that have changed will be read again */
+        begin_nametable_reload();
 
         /* unload all the test modules */
         unregister_tests();
+
+        /* the test runners also need to reload the test modules */
+        reload_test_runners();
     }
 
     /* load all test modules again, they may have changed */
@@ -234,10 +249,20 @@ static void reload(wand_event_handler_t *ev_hdl, int signum, void *data) {
     snprintf((char*)&nametable, PATH_MAX, "%s/%s", NAMETABLE_DIR,meta->ampname);
     read_nametable_dir(nametable);
 
+    /* remove names from any nametable files that have gone away */
+    if ( signum > 0 ) {
+        finish_nametable_reload();
+    }
+
     /* re-read schedule files from the global and client specific dirs */
     read_schedule_dir(ev_hdl, SCHEDULE_DIR, meta);
     snprintf((char*)&schedule, PATH_MAX, "%s/%s", SCHEDULE_DIR, meta->ampname);
     read_schedule_dir(ev_hdl, schedule, meta);
+
+    /* keep unchanged tests, remove any that are no longer scheduled */
+    if ( signum > 0 ) {
+        finish_schedule_reload(ev_hdl);
+    }
 }
 
 
@@ -280,6 +305,12 @@ static void debug_dump(wand_event_handler_t *ev_hdl, int signum,
     }
 
     dump_schedule(ev_hdl, out);
+    dump_admission_stats(out);
+    dump_publish_stats(out);
+    dump_spool_stats(out);
+    dump_dns_cache_stats(out);
+    dump_asn_cache_stats(out);
+    dump_interface_monitor_stats(out);
 
     fclose(out);
     free(filename);
@@ -325,6 +356,7 @@ static void free_global_vars(struct amp_global_t *vars) {
     if ( vars->amqp_ssl.key ) free(vars->amqp_ssl.key);
     if ( vars->asnsock ) free(vars->asnsock);
     if ( vars->nssock ) free(vars->nssock);
+    if ( vars->brokersock ) free(vars->brokersock);
 }
 
 
@@ -339,10 +371,19 @@ int main(int argc, char *argv[]) {
     int fetch_remote = 1;
     int backgrounded = 0;
     struct amp_asn_info *asn_info;
+    worker_pool_t *resolver_pool;
+    worker_pool_t *asn_pool;
     amp_test_meta_t meta;
     amp_control_t *control;
     fetch_schedule_item_t *fetch;
+    amp_admission_t *admission;
+    amp_publisher_t *publisher;
+    amp_spool_t *spool;
+    amp_dns_cache_t *dnscache;
+    amp_asn_cache_t *asncache;
     cfg_t *cfg;
+    int test_runners;
+    int resolver_threads;
     int opt;
 
     memset(&meta, 0, sizeof(meta));
@@ -573,6 +614,14 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    /* construct our custom, per-client socket for reporting test results */
+    if ( asprintf(&vars.brokersock, "%s/%s.broker", AMP_RUN_DIR,
+                vars.ampname) < 0 ) {
+        Log(LOG_ALERT, "Failed to build local broker socket path");
+	cfg_free(cfg);
+        return -1;
+    }
+
     /* if remote fetching is enabled, try to get the config for it */
     if ( fetch_remote && (fetch = get_remote_schedule_config(cfg)) ) {
         /* TODO fetch gets leaked, has lots of parts needing to be freed */
@@ -596,14 +645,15 @@ int main(int argc, char *argv[]) {
     /* set up handler to deal with SIGCHLD so we can tidy up after tests */
     wand_add_signal(SIGCHLD, NULL, child_reaper);
 
+    /* number of threads answering name and ASN lookups from tests */
+    resolver_threads = get_resolver_thread_config(cfg);
+
     /* create the resolver/cache unix socket and add event listener for it */
     if ( (vars.nssock_fd = initialise_local_socket(vars.nssock)) < 0 ) {
         Log(LOG_ALERT, "Failed to initialise local resolver, aborting");
 	cfg_free(cfg);
         return -1;
     }
-    wand_add_fd(ev_hdl, vars.nssock_fd, EV_READ, vars.ctx,
-            resolver_socket_event_callback);
 
     /* create the asn lookup unix socket and add event listener for it */
     Log(LOG_DEBUG, "Creating local socket for ASN lookups");
@@ -613,10 +663,17 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    asn_info = initialise_asn_info();
-    //XXX can we move this and socket creation off into the function too?
-    wand_add_fd(ev_hdl, vars.asnsock_fd, EV_READ, asn_info,
-            asn_socket_event_callback);
+    /* where the ASN cache is saved, loaded once the test runners exist */
+    asncache = get_asn_cache_config(cfg);
+
+    /* create the socket tests use to hand results to us for publishing */
+    if ( (vars.brokersock_fd = initialise_local_socket(vars.brokersock)) < 0 ) {
+        Log(LOG_ALERT, "Failed to initialise local broker socket, aborting");
+	cfg_free(cfg);
+        return -1;
+    }
+    wand_add_fd(ev_hdl, vars.brokersock_fd, EV_READ, NULL,
+            broker_socket_event_callback);
 
     /* save the port, tests need to know where to connect */
     control = get_control_config(cfg, &meta);
@@ -633,6 +690,31 @@ int main(int argc, char *argv[]) {
         Log(LOG_DEBUG, "Control socket is disabled, skipping");
     }
 
+    /* number of pre-forked processes to use when starting tests */
+    test_runners = get_test_runner_config(cfg);
+
+    /* spread tests across their window rather than all starting together */
+    set_schedule_spread(should_spread_schedule(cfg));
+
+    /* limits on how many scheduled tests can run at the same time */
+    admission = get_admission_config(cfg);
+    set_admission_config(ev_hdl, admission);
+
+    /* how results are batched when publishing them to the collector */
+    publisher = get_publisher_config(cfg);
+    set_publisher_config(ev_hdl, publisher);
+    free(publisher);
+
+    /* where to keep results that can't be published straight away */
+    spool = get_spool_config(cfg);
+    set_spool_config(ev_hdl, spool);
+    free_spool_config(spool);
+
+    /* cache resolved names, and resolve them before tests need them */
+    dnscache = get_dns_cache_config(cfg);
+    set_dns_cache_config(ev_hdl, vars.ctx, dnscache);
+    free(dnscache);
+
     /* configuration is done, free the object */
     cfg_free(cfg);
 
@@ -650,6 +732,51 @@ int main(int argc, char *argv[]) {
     /* SIGRTMAX is a debug signal to dump internal state */
     wand_add_signal(SIGRTMAX, NULL, debug_dump);
 
+    /*
+     * Keep a snapshot of the interfaces and addresses that tests can use
+     * rather than asking the kernel themselves. This is shared memory, so
+     * it needs to exist before the test runners are started.
+     */
+    if ( start_interface_monitor(ev_hdl) < 0 ) {
+        Log(LOG_WARNING, "Failed to monitor interfaces, tests will look up "
+                "interfaces themselves");
+    }
+
+    /*
+     * Start the test runners before loading anything large, so that they
+     * stay small and are cheap to fork new tests from. This also has to
+     * happen before any threads are started, so that the runners can't be
+     * forked while another thread holds a lock they might need.
+     */
+    if ( test_runners > 0 && start_test_runners(ev_hdl, test_runners) < 0 ) {
+        Log(LOG_WARNING, "Failed to start test runners, forking tests directly");
+    }
+
+    if ( (resolver_pool = start_resolver_pool(vars.ctx,
+                    resolver_threads)) == NULL ) {
+        Log(LOG_ALERT, "Failed to start local resolver threads, aborting");
+        return -1;
+    }
+    wand_add_fd(ev_hdl, vars.nssock_fd, EV_READ, resolver_pool,
+            resolver_socket_event_callback);
+
+    asn_info = initialise_asn_info();
+
+    /* reload what we knew about ASNs before the last restart */
+    set_asn_cache_config(asn_info, asncache);
+    free_asn_cache_config(asncache);
+
+    if ( (asn_pool = start_asn_pool(asn_info, resolver_threads)) == NULL ) {
+        Log(LOG_ALERT, "Failed to start local asn threads, aborting");
+        return -1;
+    }
+    //XXX can we move this and socket creation off into the function too?
+    wand_add_fd(ev_hdl, vars.asnsock_fd, EV_READ, asn_pool,
+            asn_socket_event_callback);
+
+    /* keep compiled schedules where they can be found after a restart */
+    set_schedule_cache_dir(AMP_CACHE_DIR);
+
     /* register all test modules, load nametable, load schedules */
     load_tests_and_schedules(ev_hdl, &meta);
 
@@ -660,12 +787,28 @@ int main(int argc, char *argv[]) {
     Log(LOG_INFO, "Shutting down");
 
     /* if we get control back then it's time to tidy up */
+    Log(LOG_DEBUG, "Stopping test runners");
+    stop_test_runners();
+
     Log(LOG_DEBUG, "Clearing test schedules");
     clear_test_schedule(ev_hdl, 1);
+    set_schedule_cache_dir(NULL);
 
     Log(LOG_DEBUG, "Clearing name table");
     clear_nametable();
 
+    /* publish anything still queued while the event handler exists */
+    Log(LOG_DEBUG, "Closing broker connection");
+    close(vars.brokersock_fd);
+    close_persistent_broker_connection();
+    close_spool();
+
+    Log(LOG_DEBUG, "Clearing DNS cache");
+    close_dns_cache();
+
+    Log(LOG_DEBUG, "Stopping interface monitor");
+    stop_interface_monitor();
+
     /* destroying event handler will also clear all signal handlers etc */
     Log(LOG_DEBUG, "Clearing event handlers");
     wand_destroy_event_handler(ev_hdl);
@@ -673,16 +816,20 @@ int main(int argc, char *argv[]) {
     //TODO shutdown control socket?
     free_control_config(control);
 
+    free_admission_config(admission);
+
     free_local_meta_vars(&meta);
     free_global_vars(&vars);
 
     /* clean up the ASN socket, mutex, storage */
     Log(LOG_DEBUG, "Shutting down ASN lookup");
     close(vars.asnsock_fd);
+    destroy_worker_pool(asn_pool);
     amp_asn_info_delete(asn_info);
 
     Log(LOG_DEBUG, "Shutting down DNS resolver");
     close(vars.nssock_fd);
+    destroy_worker_pool(resolver_pool);
     amp_resolver_context_delete(vars.ctx);
 
     Log(LOG_DEBUG, "Cleaning up SSL");
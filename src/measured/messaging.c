@@ -41,51 +41,111 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/time.h>
 #include <amqp_ssl_socket.h>
 #include <amqp_tcp_socket.h>
+#include <zlib.h>
 
 #include "messaging.h"
+#include "brokersock.h"
+#include "spool.h"
 #include "debug.h"
 #include "modules.h"
 #include "global.h"
 
 
 
+/*
+ * Connection to the broker held open by the main measured process, which
+ * publishes results on behalf of all the test processes.
+ */
+static amqp_connection_state_t broker_conn = NULL;
+
+/* earliest time that a failed persistent connection should be retried */
+static time_t broker_retry_time = 0;
+
+/* socket underneath the persistent connection, watched for confirms */
+static int broker_fd = -1;
+
+/* delivery tag of the last result published on the persistent channel */
+static uint64_t next_delivery_tag = 0;
+
+/* event handler used to watch for confirms and schedule batches */
+static wand_event_handler_t *publish_ev_hdl = NULL;
+
+/* how results are batched before being published */
+static amp_publisher_t publisher = {
+    DEFAULT_PUBLISH_BATCH_SIZE,
+    DEFAULT_PUBLISH_BATCH_DELAY,
+    DEFAULT_PUBLISH_WINDOW,
+    0,
+    DEFAULT_COMPRESS_THRESHOLD,
+    DEFAULT_COMPRESS_LEVEL,
+};
+
+/* results waiting to be published, oldest first */
+static queued_result_t *pending_head = NULL;
+static queued_result_t *pending_tail = NULL;
+
+/* results published but not yet confirmed, in delivery tag order */
+static queued_result_t *inflight_head = NULL;
+static queued_result_t *inflight_tail = NULL;
+
+/* timer to publish a partial batch once the batch delay is up */
+static struct wand_timer_t *flush_timer = NULL;
+
+static publish_stats_t stats;
+
+
+
 /*
  * Create a connection to the broker (local or remote) that measured can use
- * to report data from tests. Each test *should* use a different channel within
- * this connection but they currently all create their own individual
- * connections as sharing connections/channels becomes tricky when multiple
- * processes are involved.
- * TODO create a connection that persists for the lifetime of the main process
- * that allocates channels within it for each test process.
+ * to report data from tests. The main process keeps a single connection
+ * open and publishes results relayed to it from tests. Tests only create
+ * their own connection if the main process can't publish for them.
+ *
+ * The main process calls this from its event loop, so the connect, TLS
+ * handshake and login are all limited to BROKER_CONNECT_TIMEOUT rather than
+ * waiting on the kernel connect timeout if the broker is unreachable.
  */
-static int connect_to_broker(void) {
+static int connect_to_broker(amqp_connection_state_t *connection) {
     amqp_socket_t *sock;
     char *collector = vars.vialocal ? vars.local : vars.collector;
     int port = vars.vialocal ? AMQP_PORT : vars.port;
     char *vhost = vars.vialocal ? vars.ampname : vars.vhost;
+    struct timeval timeout = { BROKER_CONNECT_TIMEOUT, 0 };
 
     Log(LOG_DEBUG, "Opening new connection to broker %s:%d\n", collector, port);
 
-    conn = amqp_new_connection();
+    *connection = amqp_new_connection();
+
+#if AMQP_VERSION >= AMQP_VERSION_CODE(0, 11, 0, 0)
+    amqp_set_handshake_timeout(*connection, &timeout);
+#endif
+#if AMQP_VERSION >= AMQP_VERSION_CODE(0, 9, 0, 0)
+    amqp_set_rpc_timeout(*connection, &timeout);
+#endif
 
     if ( !vars.vialocal && vars.ssl ) {
 
-        if ( (sock = amqp_ssl_socket_new(conn)) == NULL ) {
+        if ( (sock = amqp_ssl_socket_new(*connection)) == NULL ) {
             Log(LOG_ERR, "Failed to create SSL socket\n");
-            return -1;
+            goto error;
         }
 
         if ( amqp_ssl_socket_set_cacert(sock, vars.amqp_ssl.cacert) != 0 ) {
             Log(LOG_ERR, "Failed to set CA certificate\n");
-            return -1;
+            goto error;
         }
 
         if ( amqp_ssl_socket_set_key(sock, vars.amqp_ssl.cert,
                     vars.amqp_ssl.key) != 0 ) {
             Log(LOG_ERR, "Failed to set client certificate\n");
-            return -1;
+            goto error;
         }
 
 #if AMQP_VERSION >= AMQP_VERSION_CODE(0, 8, 0, 0)
@@ -95,120 +155,177 @@ static int connect_to_broker(void) {
         amqp_ssl_socket_set_verify(sock, 1);
 #endif
 
-        if ( amqp_socket_open(sock, collector, port) != 0 ) {
+        if ( amqp_socket_open_noblock(sock, collector, port, &timeout) != 0 ) {
             Log(LOG_ERR, "Failed to open connection to %s:%d", collector, port);
-            return -1;
+            goto error;
         }
 
         Log(LOG_DEBUG, "Logging in to vhost '%s' with EXTERNAL auth", vhost);
 
         /* login using EXTERNAL, still need to specify user name though */
-        if ( (amqp_login(conn, vhost, 0, AMQP_FRAME_MAX, 0,
+        if ( (amqp_login(*connection, vhost, 0, AMQP_FRAME_MAX, 0,
                         AMQP_SASL_METHOD_EXTERNAL, vars.ampname)
              ).reply_type != AMQP_RESPONSE_NORMAL ) {
             Log(LOG_ERR, "Failed to login to broker %s:%s using EXTERNAL auth",
                     collector, port);
-            return -1;
+            goto error;
         }
 
     } else {
 
-        if ( (sock = amqp_tcp_socket_new(conn)) == NULL ) {
+        if ( (sock = amqp_tcp_socket_new(*connection)) == NULL ) {
             Log(LOG_ERR, "Failed to create TCP socket\n");
-            return -1;
+            goto error;
         }
 
-        if ( amqp_socket_open(sock, collector, port) != 0 ) {
+        if ( amqp_socket_open_noblock(sock, collector, port, &timeout) != 0 ) {
             Log(LOG_ERR, "Failed to open connection to %s:%d", collector, port);
-            return -1;
+            goto error;
         }
 
         Log(LOG_DEBUG, "Logging in to vhost '%s' as '%s' with PLAIN auth",
                 vhost, vars.ampname);
 
         /* login using PLAIN, must specify username and password */
-        if ( (amqp_login(conn, vhost, 0, AMQP_FRAME_MAX,0,
+        if ( (amqp_login(*connection, vhost, 0, AMQP_FRAME_MAX,0,
                         AMQP_SASL_METHOD_PLAIN, vars.ampname, vars.ampname)
              ).reply_type != AMQP_RESPONSE_NORMAL ) {
             Log(LOG_ERR, "Failed to login to broker %s:%s using PLAIN AUTH",
                     collector, port);
-            return -1;
+            goto error;
         }
     }
 
     return 0;
+
+error:
+    amqp_destroy_connection(*connection);
+    *connection = NULL;
+    return -1;
+}
+
+
+
+/*
+ * Close a connection to the broker.
+ */
+static void close_broker_connection(amqp_connection_state_t connection) {
+    amqp_connection_close(connection, AMQP_REPLY_SUCCESS);
+    amqp_destroy_connection(connection);
 }
 
 
 
 /*
- * Close the connection to the local broker. Should only be called when
- * measured is terminating.
+ * Compress a result if compression is enabled and the result is large
+ * enough to be worth it. Returns the compressed data, which the caller must
+ * free, or NULL if the result should be published as it is.
  */
-static void close_broker_connection(void) {
-    amqp_connection_close(conn, AMQP_REPLY_SUCCESS);
-    amqp_destroy_connection(conn);
+static void *compress_result(amp_test_result_t *result, size_t *length) {
+    uLongf compressed_length;
+    void *compressed;
+    int status;
+
+    if ( !publisher.compress || result->len == 0 ||
+            result->len < (size_t)publisher.compress_threshold ) {
+        return NULL;
+    }
+
+    compressed_length = compressBound(result->len);
+    compressed = malloc(compressed_length);
+
+    if ( (status = compress2(compressed, &compressed_length, result->data,
+                result->len, publisher.compress_level)) != Z_OK ) {
+        Log(LOG_WARNING, "Failed to compress result: %s", zError(status));
+        free(compressed);
+        return NULL;
+    }
+
+    /* no point making the other end decompress it if it didn't help */
+    if ( compressed_length >= result->len ) {
+        free(compressed);
+        return NULL;
+    }
+
+    stats.compressed++;
+    stats.uncompressed_bytes += result->len;
+    stats.compressed_bytes += compressed_length;
+
+    *length = compressed_length;
+    return compressed;
 }
 
 
 
 /*
- * Report results for a single test to the broker.
+ * Fill in the headers and body used to publish the results for a single
+ * test. Large results may be compressed, in which case the compression
+ * headers are set so that the other end knows to decompress them. The
+ * entries must have room for AMQP_RESULT_HEADER_COUNT headers. Returns the
+ * compressed data that the body points to, which the caller must free, or
+ * NULL if the body points at the original result.
  *
  * example amqp_table_t stuff:
  * https://groups.google.com/forum/?fromgroups=#!topic/rabbitmq-discuss/M_8I12gWxbQ
  * rabbitmq-c/tests/test_tables.c
  */
-int report_to_broker(test_type_t type, amp_test_result_t *result) {
+static void *build_result_message(test_type_t type, amp_test_result_t *result,
+        amqp_table_t *headers, amqp_table_entry_t *entries,
+        amqp_bytes_t *body) {
+    void *compressed;
+    size_t compressed_length = 0;
 
-    amqp_basic_properties_t props;
-    amqp_bytes_t data;
-    amqp_table_t headers;
-    amqp_table_entry_t table_entries;
-    char *exchange = vars.vialocal ? AMQP_LOCAL_EXCHANGE : vars.exchange;
-    char *routingkey = vars.vialocal ? AMQP_LOCAL_ROUTING_KEY : vars.routingkey;
+    /* The name of the test data is being reported for */
+    entries[0].key = amqp_cstring_bytes("x-amp-test-type");
+    entries[0].value.kind = AMQP_FIELD_KIND_UTF8;
+    entries[0].value.value.bytes = amqp_cstring_bytes(amp_tests[type]->name);
 
-    /* check the test id is valid */
-    if ( type >= AMP_TEST_LAST || type <= AMP_TEST_INVALID ) {
-	Log(LOG_WARNING, "Invalid test type %d, not reporting\n", type);
-	return -1;
-    }
+    /* Add all the individual headers to the header table */
+    headers->num_entries = 1;
+    headers->entries = entries;
 
-    /*
-     * Ideally this would only happen once and the same connection would be
-     * reused for all tests, but with their own channel. A connection can't
-     * be shared by multiple processes/threads however, so they can't just
-     * create themselves a new channel using the single connection object -
-     * they need to make their own connection, or the master parent process
-     * needs to create the channel and somehow tell the child which channel
-     * to use.
-     * TODO how to make this work with a single connection, multiple channels.
-     */
-    if ( connect_to_broker() < 0 ) {
-	return -1;
-    }
+    /* Describe how the body was compressed, if it was */
+    if ( (compressed = compress_result(result, &compressed_length)) ) {
+        entries[1].key = amqp_cstring_bytes(AMQP_COMPRESSION_HEADER);
+        entries[1].value.kind = AMQP_FIELD_KIND_UTF8;
+        entries[1].value.value.bytes =
+            amqp_cstring_bytes(AMQP_COMPRESSION_ZLIB);
 
-    /*
-     * open a new channel for every reporting process, there may be multiple
-     * of these going on at once so they need individual channels
-     */
-    Log(LOG_DEBUG, "Opening new channel %d to broker\n", getpid());
-    amqp_channel_open(conn, getpid());
+        entries[2].key = amqp_cstring_bytes(AMQP_UNCOMPRESSED_LENGTH_HEADER);
+        entries[2].value.kind = AMQP_FIELD_KIND_I64;
+        entries[2].value.value.i64 = result->len;
 
-    if ( (amqp_get_rpc_reply(conn).reply_type) != AMQP_RESPONSE_NORMAL ) {
-	Log(LOG_ERR, "Failed to open channel");
-	close_broker_connection();
-	return -1;
+        headers->num_entries = 3;
+
+        body->len = compressed_length;
+        body->bytes = compressed;
+    } else {
+        body->len = result->len;
+        body->bytes = result->data;
     }
 
-    /* The name of the test data is being reported for */
-    table_entries.key = amqp_cstring_bytes("x-amp-test-type");
-    table_entries.value.kind = AMQP_FIELD_KIND_UTF8;
-    table_entries.value.value.bytes = amqp_cstring_bytes(amp_tests[type]->name);
+    return compressed;
+}
 
-    /* Add all the individual headers to the header table - only test type */
-    headers.num_entries = 1;
-    headers.entries = &table_entries;
+
+
+/*
+ * Publish the results for a single test on an open channel.
+ */
+static int publish_result(amqp_connection_state_t connection, int channel,
+        test_type_t type, amp_test_result_t *result) {
+
+    amqp_basic_properties_t props;
+    amqp_bytes_t data;
+    amqp_table_t headers;
+    amqp_table_entry_t table_entries[AMQP_RESULT_HEADER_COUNT];
+    char *exchange = vars.vialocal ? AMQP_LOCAL_EXCHANGE : vars.exchange;
+    char *routingkey = vars.vialocal ? AMQP_LOCAL_ROUTING_KEY : vars.routingkey;
+    void *compressed;
+    int status = 0;
+
+    compressed = build_result_message(type, result, &headers, table_entries,
+            &data);
 
     /* Mark the flags that will be present */
     props._flags =
@@ -229,16 +346,12 @@ int report_to_broker(test_type_t type, amp_test_result_t *result) {
      */
     props.user_id = amqp_cstring_bytes(vars.ampname);
 
-    /* Add the binary blob, the other end will know how to unpack it */
-    data.len = result->len;
-    data.bytes = result->data;
-
     /* publish the message */
     Log(LOG_DEBUG, "Publishing message to exchange '%s', routingkey '%s'\n",
             exchange, routingkey);
 
-    if ( amqp_basic_publish(conn,
-	    getpid(),				    /* channel, our pid */
+    if ( amqp_basic_publish(connection,
+	    channel,				    /* channel */
 	    amqp_cstring_bytes(exchange),           /* exchange name */
 	    amqp_cstring_bytes(routingkey),         /* routing key */
 	    0,					    /* mandatory */
@@ -247,14 +360,756 @@ int report_to_broker(test_type_t type, amp_test_result_t *result) {
 	    data) < 0 ) {			    /* body */
 
 	Log(LOG_ERR, "Failed to publish message");
+	status = -1;
+    }
+
+    free(compressed);
+
+    return status;
+}
+
+
+
+/*
+ * Add a result to the end of a queue.
+ */
+static void append_result(queued_result_t **head, queued_result_t **tail,
+        queued_result_t *item) {
+    item->next = NULL;
+
+    if ( *tail != NULL ) {
+        (*tail)->next = item;
+    } else {
+        *head = item;
+    }
+
+    *tail = item;
+}
+
+
+
+/*
+ * Free a queued result and the result data it holds.
+ */
+static void free_queued_result(queued_result_t *item) {
+    free(item->result.data);
+    free(item);
+}
+
+
+
+/*
+ * Put every unconfirmed result back at the front of the pending queue, so
+ * they are published again (in the same order) on the next connection. The
+ * broker may have received some of them, so they could be duplicated.
+ */
+static void requeue_in_flight_results(void) {
+    if ( inflight_head == NULL ) {
+        return;
+    }
+
+    stats.requeued += stats.in_flight;
+    stats.pending += stats.in_flight;
+    stats.in_flight = 0;
+
+    inflight_tail->next = pending_head;
+    if ( pending_tail == NULL ) {
+        pending_tail = inflight_tail;
+    }
+    pending_head = inflight_head;
+    inflight_head = NULL;
+    inflight_tail = NULL;
+}
+
+
+
+/*
+ * Throw away a broken persistent connection without trying to talk to the
+ * broker, and put anything that wasn't confirmed back in the queue.
+ */
+static void drop_persistent_connection(void) {
+    if ( broker_conn == NULL ) {
+        return;
+    }
+
+    if ( publish_ev_hdl != NULL && broker_fd >= 0 ) {
+        wand_del_fd(publish_ev_hdl, broker_fd);
+    }
+
+    amqp_destroy_connection(broker_conn);
+    broker_conn = NULL;
+    broker_fd = -1;
+    broker_retry_time = time(NULL) + BROKER_RECONNECT_DELAY;
+
+    requeue_in_flight_results();
+}
+
+
+
+static void flush_timer_callback(wand_event_handler_t *ev_hdl, void *data);
+static void broker_confirm_callback(wand_event_handler_t *ev_hdl, int fd,
+        void *data, enum wand_eventtype_t ev);
+
+
+
+/*
+ * Make sure the queue will be flushed in at most the given number of
+ * milliseconds.
+ */
+static void arm_flush_timer(int delay) {
+    if ( flush_timer != NULL || publish_ev_hdl == NULL ) {
+        return;
+    }
+
+    flush_timer = wand_add_timer(publish_ev_hdl, delay / 1000,
+            (delay % 1000) * 1000, NULL, flush_timer_callback);
+}
+
+
+
+/*
+ * Mark results up to the given delivery tag as confirmed by the broker. If
+ * the broker rejected them then they are put back in the queue to be tried
+ * again later.
+ */
+static void confirm_results(uint64_t tag, int multiple, int ack) {
+    queued_result_t **prev, *item;
+    struct timeval now;
+    uint64_t latency;
+    int removed_tail = 0;
+
+    gettimeofday(&now, NULL);
+
+    prev = &inflight_head;
+    while ( (item = *prev) != NULL && item->tag <= tag ) {
+        if ( item->tag != tag && !multiple ) {
+            prev = &item->next;
+            continue;
+        }
+
+        *prev = item->next;
+        if ( item == inflight_tail ) {
+            removed_tail = 1;
+        }
+        stats.in_flight--;
+
+        if ( ack ) {
+            latency = ((now.tv_sec - item->published.tv_sec) * 1000000) +
+                (now.tv_usec - item->published.tv_usec);
+            stats.total_confirm_latency += latency;
+            if ( latency > stats.max_confirm_latency ) {
+                stats.max_confirm_latency = latency;
+            }
+            stats.acked++;
+            if ( item->spool_seq > 0 ) {
+                confirm_spooled_result(item->spool_seq, item->spool_offset);
+            }
+            free_queued_result(item);
+        } else {
+            Log(LOG_WARNING, "Broker rejected %s result, will try again",
+                    amp_tests[item->type] ? amp_tests[item->type]->name :
+                    "unknown");
+            stats.nacked++;
+            stats.pending++;
+            append_result(&pending_head, &pending_tail, item);
+        }
+    }
+
+    /* the tail was confirmed, find the new one (if there is one) */
+    if ( removed_tail ) {
+        for ( inflight_tail = inflight_head;
+                inflight_tail != NULL && inflight_tail->next != NULL;
+                inflight_tail = inflight_tail->next ) {
+            /* nothing */
+        }
+    }
+}
+
+
+
+/*
+ * Read and act on any frames the broker has sent on the persistent
+ * connection, waiting up to the given timeout for the first one. Returns
+ * -1 if the connection has failed.
+ */
+static int read_broker_frames(struct timeval *timeout) {
+    amqp_frame_t frame;
+    amqp_basic_ack_t *ack;
+    amqp_basic_nack_t *nack;
+    struct timeval poll;
+    int status;
+
+    while ( broker_conn != NULL ) {
+        status = amqp_simple_wait_frame_noblock(broker_conn, &frame, timeout);
+
+        if ( status == AMQP_STATUS_TIMEOUT ) {
+            break;
+        }
+
+        if ( status != AMQP_STATUS_OK ) {
+            Log(LOG_WARNING, "Failed to read from broker: %s",
+                    amqp_error_string2(status));
+            return -1;
+        }
+
+        /* only wait for the first frame, then read what's already arrived */
+        poll.tv_sec = 0;
+        poll.tv_usec = 0;
+        timeout = &poll;
+
+        if ( frame.frame_type != AMQP_FRAME_METHOD ) {
+            continue;
+        }
+
+        switch ( frame.payload.method.id ) {
+            case AMQP_BASIC_ACK_METHOD:
+                ack = (amqp_basic_ack_t *)frame.payload.method.decoded;
+                confirm_results(ack->delivery_tag, ack->multiple, 1);
+                break;
+
+            case AMQP_BASIC_NACK_METHOD:
+                nack = (amqp_basic_nack_t *)frame.payload.method.decoded;
+                confirm_results(nack->delivery_tag, nack->multiple, 0);
+                break;
+
+            case AMQP_CHANNEL_CLOSE_METHOD:
+            case AMQP_CONNECTION_CLOSE_METHOD:
+                Log(LOG_WARNING, "Broker closed the persistent connection");
+                return -1;
+
+            default:
+                break;
+        };
+    }
+
+    if ( broker_conn != NULL ) {
+        amqp_maybe_release_buffers(broker_conn);
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Move results waiting to be published into the spool on disk, so they
+ * aren't held in memory while the broker is unreachable or lost if measured
+ * stops. Results that were replayed from the spool are still on disk, so
+ * they are thrown away and the spool goes back to read them again. Other
+ * results that can't be spooled stay in the queue.
+ */
+static void spool_pending_results(void) {
+    queued_result_t **prev, *item;
+    int replayed = 0;
+    int failed = 0;
+
+    prev = &pending_head;
+    while ( (item = *prev) != NULL ) {
+        if ( item->spool_seq == 0 &&
+                (failed || spool_result(item->type, &item->result) < 0) ) {
+            failed = 1;
+            pending_tail = item;
+            prev = &item->next;
+            continue;
+        }
+
+        if ( item->spool_seq > 0 ) {
+            replayed++;
+        } else {
+            stats.spooled++;
+        }
+
+        *prev = item->next;
+        stats.pending--;
+        free_queued_result(item);
+    }
+
+    if ( pending_head == NULL ) {
+        pending_tail = NULL;
+    }
+
+    if ( replayed > 0 ) {
+        rewind_spool();
+    }
+}
+
+
+
+/*
+ * Open the long lived connection and channel used by the main process to
+ * publish results, and put the channel into confirm mode. If the broker
+ * couldn't be reached recently then don't try again straight away.
+ */
+static int open_persistent_connection(void) {
+    time_t now = time(NULL);
+
+    if ( broker_conn != NULL ) {
+        return 0;
+    }
+
+    if ( now < broker_retry_time ) {
+        return -1;
+    }
+
+    if ( connect_to_broker(&broker_conn) < 0 ) {
+        broker_retry_time = now + BROKER_RECONNECT_DELAY;
+        return -1;
+    }
+
+    Log(LOG_DEBUG, "Opening persistent channel %d to broker",
+            BROKER_PERSISTENT_CHANNEL);
+    amqp_channel_open(broker_conn, BROKER_PERSISTENT_CHANNEL);
+
+    if ( (amqp_get_rpc_reply(broker_conn).reply_type) !=
+            AMQP_RESPONSE_NORMAL ) {
+        Log(LOG_ERR, "Failed to open persistent channel");
+        goto error;
+    }
+
+    /* have the broker acknowledge every message it takes responsibility for */
+    amqp_confirm_select(broker_conn, BROKER_PERSISTENT_CHANNEL);
+
+    if ( (amqp_get_rpc_reply(broker_conn).reply_type) !=
+            AMQP_RESPONSE_NORMAL ) {
+        Log(LOG_ERR, "Failed to enable publisher confirms");
+        goto error;
+    }
+
+    /* delivery tags start again from 1 on every new channel */
+    next_delivery_tag = 0;
+    broker_retry_time = 0;
+
+    /* confirms arrive asynchronously, read them when they are available */
+    broker_fd = amqp_get_sockfd(broker_conn);
+    if ( publish_ev_hdl != NULL ) {
+        wand_add_fd(publish_ev_hdl, broker_fd, EV_READ, NULL,
+                broker_confirm_callback);
+    }
+
+    return 0;
+
+error:
+    close_broker_connection(broker_conn);
+    broker_conn = NULL;
+    broker_retry_time = now + BROKER_RECONNECT_DELAY;
+    return -1;
+}
+
+
+
+/*
+ * Publish as many queued results as the window of unconfirmed results will
+ * allow, back to back on the persistent connection.
+ */
+static void flush_results(void) {
+    queued_result_t *item;
+    uint32_t count = 0;
+
+    if ( pending_head == NULL ) {
+        return;
+    }
+
+    if ( open_persistent_connection() < 0 ) {
+        /* keep them on disk until the broker is reachable again */
+        spool_pending_results();
+        if ( pending_head != NULL ) {
+            arm_flush_timer(BROKER_RECONNECT_DELAY * 1000);
+        }
+        return;
+    }
+
+    while ( pending_head != NULL &&
+            stats.in_flight < (uint32_t)publisher.window ) {
+        item = pending_head;
+
+        if ( publish_result(broker_conn, BROKER_PERSISTENT_CHANNEL,
+                    item->type, &item->result) < 0 ) {
+            Log(LOG_WARNING, "Persistent broker connection failed");
+            drop_persistent_connection();
+            arm_flush_timer(BROKER_RECONNECT_DELAY * 1000);
+            break;
+        }
+
+        pending_head = item->next;
+        if ( pending_head == NULL ) {
+            pending_tail = NULL;
+        }
+        stats.pending--;
+
+        item->tag = ++next_delivery_tag;
+        gettimeofday(&item->published, NULL);
+        append_result(&inflight_head, &inflight_tail, item);
+        stats.in_flight++;
+        stats.published++;
+        count++;
+    }
+
+    if ( count > 0 ) {
+        stats.batches++;
+        if ( count > stats.max_batch ) {
+            stats.max_batch = count;
+        }
+        if ( stats.in_flight > stats.max_in_flight ) {
+            stats.max_in_flight = stats.in_flight;
+        }
+        Log(LOG_DEBUG, "Published batch of %d results, %d unconfirmed",
+                count, stats.in_flight);
+    }
+}
+
+
+
+/*
+ * Publish whatever has been queued once the batch delay has passed.
+ */
+static void flush_timer_callback(
+        __attribute__((unused))wand_event_handler_t *ev_hdl,
+        __attribute__((unused))void *data) {
+    flush_timer = NULL;
+    flush_results();
+}
+
+
+
+/*
+ * Read publisher confirms from the broker when they arrive on the persistent
+ * connection. Confirmed results free up space in the window, so more of the
+ * queue might be able to be published.
+ */
+static void broker_confirm_callback(
+        __attribute__((unused))wand_event_handler_t *ev_hdl,
+        __attribute__((unused))int fd,
+        __attribute__((unused))void *data,
+        __attribute__((unused))enum wand_eventtype_t ev) {
+    struct timeval timeout = {0, 0};
+
+    if ( read_broker_frames(&timeout) < 0 ) {
+        drop_persistent_connection();
+        arm_flush_timer(BROKER_RECONNECT_DELAY * 1000);
+        return;
+    }
+
+    if ( stats.pending >= (uint32_t)publisher.batch_size ) {
+        flush_results();
+    } else if ( stats.pending > 0 ) {
+        arm_flush_timer(publisher.batch_delay);
+    }
+}
+
+
+
+/*
+ * Set how results are batched when they are published by the main process.
+ */
+void set_publisher_config(wand_event_handler_t *ev_hdl,
+        amp_publisher_t *config) {
+    publish_ev_hdl = ev_hdl;
+
+    if ( config != NULL ) {
+        publisher.batch_size = config->batch_size > 0 ?
+            config->batch_size : 1;
+        publisher.batch_delay = config->batch_delay >= 0 ?
+            config->batch_delay : 0;
+        publisher.window = config->window > 0 ? config->window : 1;
+        if ( publisher.window > MAX_PUBLISH_QUEUE_LENGTH ) {
+            publisher.window = MAX_PUBLISH_QUEUE_LENGTH;
+        }
+        publisher.compress = config->compress;
+        publisher.compress_threshold = config->compress_threshold >= 0 ?
+            config->compress_threshold : 0;
+        publisher.compress_level = config->compress_level;
+        if ( publisher.compress_level < Z_BEST_SPEED ) {
+            publisher.compress_level = Z_BEST_SPEED;
+        } else if ( publisher.compress_level > Z_BEST_COMPRESSION ) {
+            publisher.compress_level = Z_BEST_COMPRESSION;
+        }
+    }
+
+    Log(LOG_DEBUG, "Publishing batches of %d results every %dms, %d in flight",
+            publisher.batch_size, publisher.batch_delay, publisher.window);
+
+    if ( publisher.compress ) {
+        Log(LOG_DEBUG, "Compressing results of %d bytes or more at level %d",
+                publisher.compress_threshold, publisher.compress_level);
+    }
+}
+
+
+
+/*
+ * Add a result to the queue of results waiting to be published. The queue
+ * takes ownership of the result data. Results are published once enough
+ * have arrived to make a batch, or the batch delay has passed. Results that
+ * came from the spool are never spooled again while the queue is full, as
+ * they are still on disk. Returns 0 if the result was queued, -1 if not.
+ */
+static int queue_result(test_type_t type, amp_test_result_t *result,
+        uint64_t seq, uint64_t offset) {
+    queued_result_t *item;
+
+    /* check the test id is valid */
+    if ( type >= AMP_TEST_LAST || type <= AMP_TEST_INVALID ||
+            amp_tests[type] == NULL ) {
+	Log(LOG_WARNING, "Invalid test type %d, not reporting\n", type);
+	return -1;
+    }
+
+    /* don't hold on to too much, put it on disk if possible */
+    if ( stats.pending + stats.in_flight >= MAX_PUBLISH_QUEUE_LENGTH ) {
+        if ( seq > 0 ) {
+            return -1;
+        }
+        if ( spool_result(type, result) == 0 ) {
+            stats.spooled++;
+            free(result->data);
+            result->data = NULL;
+            return 0;
+        }
+        stats.dropped++;
+        return -1;
+    }
+
+    item = (queued_result_t *)calloc(1, sizeof(queued_result_t));
+    item->type = type;
+    item->result = *result;
+    item->spool_seq = seq;
+    item->spool_offset = offset;
+    append_result(&pending_head, &pending_tail, item);
+    stats.pending++;
+    stats.queued++;
+
+    if ( stats.pending >= (uint32_t)publisher.batch_size ) {
+        flush_results();
+    } else {
+        arm_flush_timer(publisher.batch_delay);
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Take a result from a test process to be published by the main process.
+ * Returns 0 if the result was queued, -1 if it wasn't.
+ */
+int queue_result_for_broker(test_type_t type, amp_test_result_t *result) {
+    return queue_result(type, result, 0, 0);
+}
+
+
+
+/*
+ * Take a result replayed from the spool to be published. The spool is told
+ * once the broker confirms it, using the segment and offset it came from.
+ * Returns 0 if the result was queued, -1 if it wasn't.
+ */
+int queue_spooled_result_for_broker(test_type_t type,
+        amp_test_result_t *result, uint64_t seq, uint64_t offset) {
+    return queue_result(type, result, seq, offset);
+}
+
+
+
+/*
+ * Get the number of results that could be queued right now and published
+ * straight away, used to limit how quickly spooled results are replayed.
+ * Returns 0 if the broker can't be reached.
+ */
+int get_publish_capacity(void) {
+    int capacity;
+
+    if ( open_persistent_connection() < 0 ) {
+        return 0;
+    }
+
+    capacity = publisher.window - (int)(stats.pending + stats.in_flight);
+
+    return capacity > 0 ? capacity : 0;
+}
+
+
+
+/*
+ * Publish anything still queued and wait a short time for the broker to
+ * confirm it, then close the persistent connection. Should only be called
+ * when measured is terminating.
+ */
+void close_persistent_broker_connection(void) {
+    struct timeval timeout;
+    time_t deadline = time(NULL) + PUBLISH_SHUTDOWN_TIMEOUT;
+    queued_result_t *item;
+
+    if ( flush_timer != NULL ) {
+        wand_del_timer(publish_ev_hdl, flush_timer);
+        flush_timer = NULL;
+    }
+
+    /* nothing is going to arrive from the event loop any more */
+    if ( broker_conn != NULL && publish_ev_hdl != NULL && broker_fd >= 0 ) {
+        wand_del_fd(publish_ev_hdl, broker_fd);
+    }
+    publish_ev_hdl = NULL;
+
+    flush_results();
+
+    while ( broker_conn != NULL && inflight_head != NULL &&
+            time(NULL) < deadline ) {
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+        if ( read_broker_frames(&timeout) < 0 ) {
+            drop_persistent_connection();
+            break;
+        }
+        flush_results();
+    }
+
+    /* anything left over can be published next time measured starts */
+    requeue_in_flight_results();
+    spool_pending_results();
+
+    if ( stats.pending > 0 ) {
+        Log(LOG_WARNING, "Discarding %d unpublished results at shutdown",
+                stats.pending);
+    }
+
+    while ( pending_head != NULL ) {
+        item = pending_head;
+        pending_head = item->next;
+        free_queued_result(item);
+    }
+    pending_tail = NULL;
+    stats.pending = 0;
+
+    if ( broker_conn != NULL ) {
+        amqp_channel_close(broker_conn, BROKER_PERSISTENT_CHANNEL,
+                AMQP_REPLY_SUCCESS);
+        close_broker_connection(broker_conn);
+        broker_conn = NULL;
+    }
+}
+
+
+
+/*
+ * Get a copy of the publishing counters.
+ */
+void get_publish_stats(publish_stats_t *out) {
+    assert(out);
+    memcpy(out, &stats, sizeof(publish_stats_t));
+}
+
+
+
+/*
+ * Dump the current state of result publishing for debug purposes.
+ */
+void dump_publish_stats(FILE *out) {
+    assert(out);
+
+    fprintf(out, "===== RESULT PUBLISHING =====\n");
+    fprintf(out, "Connected: %s\n", broker_conn != NULL ? "yes" : "no");
+    fprintf(out, "Batch size: %d, delay: %dms, window: %d\n",
+            publisher.batch_size, publisher.batch_delay, publisher.window);
+    fprintf(out, "Pending: %u, in flight: %u (max %u)\n", stats.pending,
+            stats.in_flight, stats.max_in_flight);
+    fprintf(out, "Queued: %" PRIu64 ", spooled: %" PRIu64 ", dropped: %"
+            PRIu64 "\n", stats.queued, stats.spooled, stats.dropped);
+    fprintf(out, "Batches: %" PRIu64 " (average %.1f, max %u results)\n",
+            stats.batches, stats.batches > 0 ?
+            (double)stats.published / stats.batches : 0.0, stats.max_batch);
+    fprintf(out, "Published: %" PRIu64 ", acked: %" PRIu64 ", nacked: %"
+            PRIu64 ", requeued: %" PRIu64 "\n", stats.published, stats.acked,
+            stats.nacked, stats.requeued);
+    fprintf(out, "Confirm latency: average %" PRIu64 "us, max %" PRIu64 "us\n",
+            stats.acked > 0 ? stats.total_confirm_latency / stats.acked : 0,
+            stats.max_confirm_latency);
+    fprintf(out, "Compressed: %" PRIu64 " results, %" PRIu64 " bytes to %"
+            PRIu64 " bytes\n", stats.compressed, stats.uncompressed_bytes,
+            stats.compressed_bytes);
+}
+
+
+
+/*
+ * Publish a result using a connection made just for this process. A
+ * connection can't be shared by multiple processes, so this is used when
+ * the main process can't publish the result.
+ */
+static int report_directly_to_broker(test_type_t type,
+        amp_test_result_t *result) {
+
+    if ( connect_to_broker(&conn) < 0 ) {
+	return -1;
+    }
+
+    /*
+     * open a new channel for every reporting process, there may be multiple
+     * of these going on at once so they need individual channels
+     */
+    Log(LOG_DEBUG, "Opening new channel %d to broker\n", getpid());
+    amqp_channel_open(conn, getpid());
+
+    if ( (amqp_get_rpc_reply(conn).reply_type) != AMQP_RESPONSE_NORMAL ) {
+	Log(LOG_ERR, "Failed to open channel");
+	close_broker_connection(conn);
+	return -1;
+    }
+
+    if ( publish_result(conn, getpid(), type, result) < 0 ) {
 	amqp_channel_close(conn, getpid(), AMQP_REPLY_SUCCESS);
-	close_broker_connection();
+	close_broker_connection(conn);
 	return -1;
     }
 
     Log(LOG_DEBUG, "Closing channel %d\n", getpid());
     amqp_channel_close(conn, getpid(), AMQP_REPLY_SUCCESS);
 
-    close_broker_connection();
+    close_broker_connection(conn);
     return 0;
 }
+
+
+
+/*
+ * Report results for a single test to the broker. Results are handed to
+ * the main measured process to publish if possible, otherwise this process
+ * makes its own connection to the broker. If neither works then the result
+ * is spooled to disk, to be published once the broker is reachable.
+ */
+int report_to_broker(test_type_t type, amp_test_result_t *result) {
+
+    /* check the test id is valid */
+    if ( type >= AMP_TEST_LAST || type <= AMP_TEST_INVALID ) {
+	Log(LOG_WARNING, "Invalid test type %d, not reporting\n", type);
+	return -1;
+    }
+
+    /* let the main process publish it on the connection it already has */
+    if ( relay_result_to_parent(vars.brokersock, type, result) == 0 ) {
+        return 0;
+    }
+
+    Log(LOG_DEBUG, "Unable to relay result, reporting directly to broker");
+
+    if ( report_directly_to_broker(type, result) == 0 ) {
+        return 0;
+    }
+
+    if ( spool_result(type, result) == 0 ) {
+        Log(LOG_INFO, "Unable to report result, spooled it for later");
+        return 0;
+    }
+
+    return -1;
+}
+
+
+
+#if UNIT_TEST
+void *amp_test_build_result_message(test_type_t type,
+        amp_test_result_t *result, amqp_table_t *headers,
+        amqp_table_entry_t *entries, amqp_bytes_t *body) {
+    return build_result_message(type, result, headers, entries, body);
+}
+#endif
@@ -40,7 +40,11 @@
 #ifndef _MEASURED_MESSAGING_H
 #define _MEASURED_MESSAGING_H
 
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
 #include <amqp.h>
+#include <libwandevent.h>
 #include "tests.h"
 
 
@@ -60,12 +64,108 @@
 #define AMQP_LOCAL_EXCHANGE ""
 #define AMQP_LOCAL_ROUTING_KEY "report"
 
+/* channel used on the connection held open by the main process */
+#define BROKER_PERSISTENT_CHANNEL 1
+
+/* seconds to wait before trying to reconnect to an unreachable broker */
+#define BROKER_RECONNECT_DELAY 30
+
+/* seconds to wait for the broker to accept a connection and let us log in */
+#define BROKER_CONNECT_TIMEOUT 3
+
+/* default maximum number of results to wait for before publishing them */
+#define DEFAULT_PUBLISH_BATCH_SIZE 50
+/* default maximum time (ms) to wait for more results before publishing */
+#define DEFAULT_PUBLISH_BATCH_DELAY 100
+/* default maximum number of published results waiting to be confirmed */
+#define DEFAULT_PUBLISH_WINDOW 500
+/* maximum number of results held by the main process, published or not */
+#define MAX_PUBLISH_QUEUE_LENGTH 10000
+/* seconds to wait for outstanding results to be confirmed at shutdown */
+#define PUBLISH_SHUTDOWN_TIMEOUT 5
+
+/* default size a result must be before it is compressed (bytes) */
+#define DEFAULT_COMPRESS_THRESHOLD 1024
+/* default zlib compression level, from 1 (fastest) to 9 (smallest) */
+#define DEFAULT_COMPRESS_LEVEL 6
+/* headers describing how the result body was compressed */
+#define AMQP_COMPRESSION_HEADER "x-amp-compression"
+#define AMQP_UNCOMPRESSED_LENGTH_HEADER "x-amp-uncompressed-length"
+/* value of the compression header when the body is zlib compressed */
+#define AMQP_COMPRESSION_ZLIB "zlib"
+/* most headers that can be set on a published result */
+#define AMQP_RESULT_HEADER_COUNT 3
+
 /*
- * TODO: this should be maintained for the lifetime of the main process, but
- * is currently just created and set by the individual test processes.
+ * Connection used by a test process reporting its own results, when they
+ * can't be published by the main process.
  */
 amqp_connection_state_t conn;
 
+/*
+ * Configuration for batching results published by the main process.
+ */
+typedef struct amp_publisher {
+    int batch_size;                 /* results to wait for before publishing */
+    int batch_delay;                /* time to wait for more results (ms) */
+    int window;                     /* maximum unconfirmed results */
+    int compress;                   /* should large results be compressed */
+    int compress_threshold;         /* smallest result to compress (bytes) */
+    int compress_level;             /* zlib compression level */
+} amp_publisher_t;
+
+/*
+ * A result held by the main process until the broker confirms that it has
+ * taken responsibility for it.
+ */
+typedef struct queued_result {
+    test_type_t type;               /* test that the result is from */
+    amp_test_result_t result;       /* result data, owned by the queue */
+    uint64_t tag;                   /* delivery tag once published */
+    struct timeval published;       /* time it was last published */
+    uint64_t spool_seq;             /* segment it was replayed from, if any */
+    uint64_t spool_offset;          /* offset just after it in the segment */
+    struct queued_result *next;
+} queued_result_t;
+
+/*
+ * Counters describing how results have been published by the main process.
+ */
+typedef struct publish_stats {
+    uint64_t queued;                /* results accepted from tests */
+    uint64_t spooled;               /* results written to the spool */
+    uint64_t dropped;               /* results refused, the queue was full */
+    uint64_t batches;               /* number of batches published */
+    uint64_t published;             /* results published, including retries */
+    uint64_t acked;                 /* results confirmed by the broker */
+    uint64_t nacked;                /* results rejected by the broker */
+    uint64_t requeued;              /* unconfirmed results after a failure */
+    uint32_t max_batch;             /* largest batch published */
+    uint32_t pending;               /* results waiting to be published */
+    uint32_t in_flight;             /* results waiting to be confirmed */
+    uint32_t max_in_flight;         /* most results waiting to be confirmed */
+    uint64_t total_confirm_latency; /* total time waiting for confirms (us) */
+    uint64_t max_confirm_latency;   /* longest time waiting for confirm (us) */
+    uint64_t compressed;            /* results published compressed */
+    uint64_t uncompressed_bytes;    /* size of those results before */
+    uint64_t compressed_bytes;      /* size of those results after */
+} publish_stats_t;
+
 int report_to_broker(test_type_t type, amp_test_result_t *result);
+void set_publisher_config(wand_event_handler_t *ev_hdl,
+        amp_publisher_t *publisher);
+int queue_result_for_broker(test_type_t type, amp_test_result_t *result);
+int queue_spooled_result_for_broker(test_type_t type,
+        amp_test_result_t *result, uint64_t seq, uint64_t offset);
+int get_publish_capacity(void);
+void close_persistent_broker_connection(void);
+void get_publish_stats(publish_stats_t *stats);
+void dump_publish_stats(FILE *out);
+
+#if UNIT_TEST
+void *amp_test_build_result_message(test_type_t type,
+        amp_test_result_t *result, amqp_table_t *headers,
+        amqp_table_entry_t *entries, amqp_bytes_t *body);
+#endif
 
 #endif
@@ -41,6 +41,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netdb.h>
 #include <assert.h>
 #include <arpa/inet.h>
@@ -51,31 +52,95 @@
 #include "schedule.h"
 #include "nametable.h"
 #include "debug.h"
+#include "hash.h"
 
 
-nametable_t *name_table = NULL;
+/* hash table of names, each bucket is a list of nametable items */
+static nametable_t **name_buckets = NULL;
+static uint32_t name_bucket_count = 0;
+static uint32_t name_count = 0;
+
+/* files that have been loaded, in the order they were loaded */
+static nametable_file_t *nametable_files = NULL;
+static nametable_file_t **nametable_files_tail = &nametable_files;
+
+/* files loaded before a reload started that haven't been seen again yet */
+static nametable_file_t *reload_files = NULL;
+
+/* set when addresses have been freed, and the index needs to be rebuilt */
+static int index_dirty = 0;
+
+/* counts of what happened to the files during a reload */
+static uint32_t files_kept = 0;
+static uint32_t files_read = 0;
+
+
+
+/*
+ * FNV-1a hash of a name, used to find the bucket it belongs in.
+ */
+static uint32_t hash_name(const char *name) {
+    return fnv1a_32(FNV1A_32_INIT, name, strlen(name));
+}
+
+
+
+/*
+ * Double the number of hash buckets, moving every item to its new bucket.
+ */
+static void grow_name_buckets(void) {
+    nametable_t **buckets;
+    nametable_t *item, *next;
+    uint32_t count;
+    uint32_t i, index;
+
+    count = name_bucket_count == 0 ?
+        NAMETABLE_INITIAL_BUCKETS : name_bucket_count * 2;
+    buckets = (nametable_t **)calloc(count, sizeof(nametable_t *));
+
+    for ( i = 0; i < name_bucket_count; i++ ) {
+        for ( item = name_buckets[i]; item != NULL; item = next ) {
+            next = item->next;
+            index = hash_name(item->addr->ai_canonname) & (count - 1);
+            item->next = buckets[index];
+            buckets[index] = item;
+        }
+    }
+
+    free(name_buckets);
+    name_buckets = buckets;
+    name_bucket_count = count;
+}
 
 
 
 /*
- * Insert a new nametable entry on to the front of the list and set the
- * canonical name to the name we use for it.
+ * Insert a new nametable entry into the index. If the name already exists
+ * then the address is added to the front of its list of addresses.
  */
 static void insert_nametable_entry(char *name, struct addrinfo *info) {
     nametable_t *item;
+    uint32_t index;
+
     assert(name);
     assert(info);
     assert(info->ai_next == NULL);
-
-    info->ai_canonname = strdup(name);
+    assert(info->ai_canonname);
 
     if ( (item = name_to_address(name)) == NULL ) {
+        /* keep the average chain length below one */
+        if ( name_count >= name_bucket_count ) {
+            grow_name_buckets();
+        }
+
         /* if it doesn't exist, create it with the single struct addrinfo */
+        index = hash_name(name) & (name_bucket_count - 1);
         item = (nametable_t *)malloc(sizeof(nametable_t));
         item->addr = info;
-        item->next = name_table;
+        item->next = name_buckets[index];
         item->count = 1;
-        name_table = item;
+        name_buckets[index] = item;
+        name_count++;
     } else {
         /* if it does exist, add this struct addrinfo to the list */
         info->ai_next = item->addr;
@@ -86,6 +151,126 @@ static void insert_nametable_entry(char *name, struct addrinfo *info) {
 
 
 
+/*
+ * Empty the index of names. The addresses belong to the files they were
+ * loaded from, so they are left alone.
+ */
+static void clear_name_index(void) {
+    nametable_t *item, *next;
+    uint32_t i;
+
+    for ( i = 0; i < name_bucket_count; i++ ) {
+        for ( item = name_buckets[i]; item != NULL; item = next ) {
+            next = item->next;
+            free(item);
+        }
+        name_buckets[i] = NULL;
+    }
+
+    name_count = 0;
+}
+
+
+
+/*
+ * Add all the addresses from a file into the index.
+ */
+static void index_nametable_file(nametable_file_t *file) {
+    uint32_t i;
+
+    for ( i = 0; i < file->count; i++ ) {
+        file->addrs[i]->ai_next = NULL;
+        insert_nametable_entry(file->addrs[i]->ai_canonname, file->addrs[i]);
+    }
+}
+
+
+
+/*
+ * Build the index again from every file that is loaded, in the order they
+ * were loaded so that addresses for each name stay in the same order.
+ */
+static void rebuild_name_index(void) {
+    nametable_file_t *file;
+
+    /* nothing freed can be reached once the index is empty */
+    clear_name_index();
+    index_dirty = 0;
+
+    for ( file = nametable_files; file != NULL; file = file->next ) {
+        index_nametable_file(file);
+    }
+
+    /* files from before a reload that haven't been checked yet */
+    for ( file = reload_files; file != NULL; file = file->next ) {
+        index_nametable_file(file);
+    }
+}
+
+
+
+/*
+ * Free a nametable file and all the addresses that were read from it. The
+ * addresses may be chained to addresses from other files in the index, so
+ * they are unlinked before being freed.
+ */
+static void free_nametable_file(nametable_file_t *file) {
+    uint32_t i;
+
+    for ( i = 0; i < file->count; i++ ) {
+        file->addrs[i]->ai_next = NULL;
+        freeaddrinfo(file->addrs[i]);
+    }
+
+    /* the index now points at freed addresses */
+    if ( file->count > 0 ) {
+        index_dirty = 1;
+    }
+
+    free(file->addrs);
+    free(file->filename);
+    free(file);
+}
+
+
+
+/*
+ * Add a loaded file to the end of the list of loaded files.
+ */
+static void append_nametable_file(nametable_file_t *file) {
+    file->next = NULL;
+    *nametable_files_tail = file;
+    nametable_files_tail = &file->next;
+}
+
+
+
+/*
+ * Record that an address was read from a file, set the canonical name to the
+ * name we use for it and add it to the index.
+ */
+static void add_nametable_address(nametable_file_t *file, char *name,
+        struct addrinfo *info) {
+    assert(info->ai_next == NULL);
+
+    info->ai_canonname = strdup(name);
+
+    if ( file->count == 0 || (file->count & (file->count - 1)) == 0 ) {
+        file->addrs = (struct addrinfo **)realloc(file->addrs,
+                sizeof(struct addrinfo *) *
+                (file->count == 0 ? 1 : file->count * 2));
+    }
+
+    file->addrs[file->count++] = info;
+
+    /* if the index needs rebuilding it will be added then */
+    if ( !index_dirty ) {
+        insert_nametable_entry(name, info);
+    }
+}
+
+
+
 /*
  * Dump the entire contents of the nametable for debugging.
  */
@@ -93,30 +278,33 @@ static void dump_nametable(void) {
     struct addrinfo *tmp;
     nametable_t *item;
     char address[INET6_ADDRSTRLEN];
+    uint32_t i;
 
     Log(LOG_DEBUG, "====== NAMETABLE ======");
 
-    for ( item=name_table; item != NULL; item=item->next ) {
-        for ( tmp=item->addr; tmp != NULL; tmp=tmp->ai_next ) {
-            assert(tmp);
-            assert(tmp->ai_addr);
-            assert(tmp->ai_canonname);
-            if ( tmp->ai_addr->sa_family == AF_INET ) {
-                inet_ntop(AF_INET,
-                        &((struct sockaddr_in*)tmp->ai_addr)->sin_addr,
-                        address, INET6_ADDRSTRLEN);
-
-            } else if ( tmp->ai_addr->sa_family == AF_INET6 ) {
-                inet_ntop(AF_INET6,
-                        &((struct sockaddr_in6*)tmp->ai_addr)->sin6_addr,
-                        address, INET6_ADDRSTRLEN);
-
-            } else {
-                Log(LOG_WARNING, "unknown address family: %d\n",
-                        tmp->ai_addr->sa_family);
-                continue;
+    for ( i = 0; i < name_bucket_count; i++ ) {
+        for ( item=name_buckets[i]; item != NULL; item=item->next ) {
+            for ( tmp=item->addr; tmp != NULL; tmp=tmp->ai_next ) {
+                assert(tmp);
+                assert(tmp->ai_addr);
+                assert(tmp->ai_canonname);
+                if ( tmp->ai_addr->sa_family == AF_INET ) {
+                    inet_ntop(AF_INET,
+                            &((struct sockaddr_in*)tmp->ai_addr)->sin_addr,
+                            address, INET6_ADDRSTRLEN);
+
+                } else if ( tmp->ai_addr->sa_family == AF_INET6 ) {
+                    inet_ntop(AF_INET6,
+                            &((struct sockaddr_in6*)tmp->ai_addr)->sin6_addr,
+                            address, INET6_ADDRSTRLEN);
+
+                } else {
+                    Log(LOG_WARNING, "unknown address family: %d\n",
+                            tmp->ai_addr->sa_family);
+                    continue;
+                }
+                Log(LOG_DEBUG, "%s %s\n", tmp->ai_canonname, address);
             }
-            Log(LOG_DEBUG, "%s %s\n", tmp->ai_canonname, address);
         }
     }
 }
@@ -124,45 +312,50 @@ static void dump_nametable(void) {
 
 
 /*
- * Empty the nametable. It's a list of addrinfo structs, so freeaddrinfo()
- * will do all the hard work.
+ * Empty the nametable, freeing the index and every file that was loaded
+ * along with all their addresses.
  */
 void clear_nametable() {
-    if ( name_table != NULL ) {
-        nametable_t *item;
-        nametable_t *tmp;
-
-        for ( item=name_table; item != NULL; /* increment in body */ ) {
-            /* free addresses for current item */
-            if ( item->addr != NULL ) {
-                freeaddrinfo(item->addr);
-            }
+    nametable_file_t *file, *next;
 
-            /* free current item */
-            tmp = item;
-            item = item->next;
-            free(tmp);
-        }
-	name_table = NULL;
+    clear_name_index();
+    free(name_buckets);
+    name_buckets = NULL;
+    name_bucket_count = 0;
+
+    for ( file = nametable_files; file != NULL; file = next ) {
+        next = file->next;
+        free_nametable_file(file);
+    }
+
+    for ( file = reload_files; file != NULL; file = next ) {
+        next = file->next;
+        free_nametable_file(file);
     }
+
+    nametable_files = NULL;
+    nametable_files_tail = &nametable_files;
+    reload_files = NULL;
+    index_dirty = 0;
 }
 
 
 
 /*
- * Traverse the list and return the first address structure that has the
- * given name.
+ * Find the addresses that have the given name.
  */
 nametable_t *name_to_address(char *name) {
     nametable_t *item;
 
     assert(name);
+    assert(!index_dirty);
 
-    if ( name_table == NULL ) {
+    if ( name_count == 0 ) {
 	return NULL;
     }
 
-    for ( item=name_table; item != NULL; item=item->next ) {
+    for ( item = name_buckets[hash_name(name) & (name_bucket_count - 1)];
+            item != NULL; item = item->next ) {
         assert(item->addr);
         assert(item->addr->ai_canonname);
         if ( strcmp(name, item->addr->ai_canonname) == 0 ) {
@@ -176,17 +369,17 @@ nametable_t *name_to_address(char *name) {
 
 
 /*
- *
+ * Read all the name and address pairs from a nametable file.
  */
-static void read_nametable_file(char *filename) {
+static void read_nametable_file(nametable_file_t *file) {
     FILE *in;
     char line[MAX_NAMETABLE_LINE];
     struct addrinfo hint;
     struct addrinfo *addrinfo;
 
-    Log(LOG_INFO, "Loading nametable from %s", filename);
+    Log(LOG_INFO, "Loading nametable from %s", file->filename);
 
-    if ( (in = fopen(filename, "r")) == NULL ) {
+    if ( (in = fopen(file->filename, "r")) == NULL ) {
 	Log(LOG_WARNING, "Skipping nametable file: %s\n", strerror(errno));
 	return;
     }
@@ -222,7 +415,7 @@ static void read_nametable_file(char *filename) {
 		    name, address);
 	    continue;
 	}
-	insert_nametable_entry(name, addrinfo);
+	add_nametable_address(file, name, addrinfo);
     }
 
     fclose(in);
@@ -231,7 +424,119 @@ static void read_nametable_file(char *filename) {
 
 
 /*
- *
+ * Take a file that was loaded before the reload started out of the list of
+ * files waiting to be checked.
+ */
+static nametable_file_t *take_reload_file(char *filename) {
+    nametable_file_t **prev, *file;
+
+    for ( prev = &reload_files; *prev != NULL; prev = &(*prev)->next ) {
+        if ( strcmp((*prev)->filename, filename) == 0 ) {
+            file = *prev;
+            *prev = file->next;
+            file->next = NULL;
+            return file;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Load a nametable file, unless it was loaded before the reload started and
+ * hasn't changed since, in which case the addresses already read are kept.
+ */
+static void load_nametable_file(char *filename) {
+    nametable_file_t *file;
+    struct stat statbuf;
+
+    if ( stat(filename, &statbuf) < 0 ) {
+	Log(LOG_WARNING, "Skipping nametable file %s: %s\n", filename,
+                strerror(errno));
+	return;
+    }
+
+    if ( (file = take_reload_file(filename)) != NULL ) {
+        if ( file->dev == statbuf.st_dev && file->ino == statbuf.st_ino &&
+                file->size == statbuf.st_size &&
+                file->mtime.tv_sec == statbuf.st_mtim.tv_sec &&
+                file->mtime.tv_nsec == statbuf.st_mtim.tv_nsec ) {
+            Log(LOG_DEBUG, "Nametable file %s is unchanged", filename);
+            append_nametable_file(file);
+            files_kept++;
+            return;
+        }
+
+        free_nametable_file(file);
+    }
+
+    file = (nametable_file_t *)calloc(1, sizeof(nametable_file_t));
+    file->filename = strdup(filename);
+    file->dev = statbuf.st_dev;
+    file->ino = statbuf.st_ino;
+    file->size = statbuf.st_size;
+    file->mtime = statbuf.st_mtim;
+
+    read_nametable_file(file);
+    append_nametable_file(file);
+    files_read++;
+}
+
+
+
+/*
+ * Prepare to reload the nametable. Every file currently loaded is set aside
+ * so that read_nametable_dir() can keep the ones that haven't changed, and
+ * finish_nametable_reload() can remove the ones that no longer exist. The
+ * index stays usable until then.
+ */
+void begin_nametable_reload(void) {
+    /* anything not checked in a previous reload can be checked again */
+    if ( nametable_files != NULL ) {
+        *nametable_files_tail = reload_files;
+        reload_files = nametable_files;
+    }
+
+    nametable_files = NULL;
+    nametable_files_tail = &nametable_files;
+    files_kept = 0;
+    files_read = 0;
+}
+
+
+
+/*
+ * Finish reloading the nametable, removing any files that weren't seen
+ * during the reload and rebuilding the index if anything was removed.
+ */
+void finish_nametable_reload(void) {
+    nametable_file_t *file, *next;
+    uint32_t removed = 0;
+
+    for ( file = reload_files; file != NULL; file = next ) {
+        next = file->next;
+        Log(LOG_DEBUG, "Nametable file %s has been removed", file->filename);
+        free_nametable_file(file);
+        removed++;
+    }
+
+    reload_files = NULL;
+
+    if ( index_dirty ) {
+        rebuild_name_index();
+    }
+
+    Log(LOG_INFO, "Reloaded nametable: %u files kept, %u read, %u removed",
+            files_kept, files_read, removed);
+}
+
+
+
+/*
+ * Load all the nametable files in a directory. Files that were loaded before
+ * a reload and haven't changed are not read again.
  */
 void read_nametable_dir(char *directory) {
     glob_t glob_buf;
@@ -254,7 +559,12 @@ void read_nametable_dir(char *directory) {
 	    directory, glob_buf.gl_pathc);
 
     for ( i = 0; i < glob_buf.gl_pathc; i++ ) {
-	read_nametable_file(glob_buf.gl_pathv[i]);
+	load_nametable_file(glob_buf.gl_pathv[i]);
+    }
+
+    /* changed files had their old addresses freed, so rebuild the index */
+    if ( index_dirty ) {
+        rebuild_name_index();
     }
 
     dump_nametable();
@@ -268,6 +578,19 @@ void read_nametable_dir(char *directory) {
 
 #if UNIT_TEST
 void nametable_test_insert_nametable_entry(char *name, struct addrinfo *info) {
-    insert_nametable_entry(name, info);
+    static nametable_file_t *test_file = NULL;
+
+    /* addresses inserted by tests belong to a file that doesn't exist */
+    if ( test_file == NULL || nametable_files == NULL ) {
+        test_file = (nametable_file_t *)calloc(1, sizeof(nametable_file_t));
+        test_file->filename = strdup("<test>");
+        append_nametable_file(test_file);
+    }
+
+    add_nametable_address(test_file, name, info);
+}
+
+uint32_t nametable_test_get_count(void) {
+    return name_count;
 }
 #endif
@@ -41,6 +41,8 @@
 #define _MEASURED_NAMETABLE_H
 
 #include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
 #include <libwandevent.h>
 
 #define MAX_NAMETABLE_LINE 128
@@ -49,6 +51,13 @@
 
 #define MAX_NAMETABLE_HOSTS 1024
 
+/* initial number of hash buckets, doubled whenever it gets full */
+#define NAMETABLE_INITIAL_BUCKETS 256
+
+/*
+ * All the addresses for a single name. The item is linked into a hash
+ * bucket, and the addresses are chained together with ai_next.
+ */
 struct nametable_item {
     struct addrinfo *addr;
     struct nametable_item *next;
@@ -56,12 +65,31 @@ struct nametable_item {
 };
 typedef struct nametable_item nametable_t;
 
+/*
+ * A nametable file that has been loaded, along with enough information to
+ * tell if it has changed. The file owns the addresses that were read from it,
+ * so unchanged files can keep their addresses across a reload.
+ */
+typedef struct nametable_file {
+    char *filename;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct addrinfo **addrs;        /* addresses read from this file */
+    uint32_t count;                 /* number of addresses */
+    struct nametable_file *next;
+} nametable_file_t;
+
 void read_nametable_dir(char *directory);
+void begin_nametable_reload(void);
+void finish_nametable_reload(void);
 void setup_nametable_refresh(wand_event_handler_t *ev_hdl);
 nametable_t *name_to_address(char *name);
 void clear_nametable(void);
 #if UNIT_TEST
 void nametable_test_insert_nametable_entry(char *name, struct addrinfo *info);
+uint32_t nametable_test_get_count(void);
 #endif
 
 #endif
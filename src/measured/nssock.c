@@ -41,6 +41,7 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <unbound.h>
 #include <pthread.h>
 #include <assert.h>
@@ -49,111 +50,401 @@
 
 #include "nssock.h"
 #include "ampresolv.h"
+#include "dnscache.h"
 #include "debug.h"
 
 
 
 /*
- * Receive all the queries from the local socket and wait for them to resolve
- * before sending them back to the test process.
+ * Queue all the resolved addresses to be sent back to a test process using
+ * the original protocol, one raw addrinfo struct at a time.
  */
-static void *amp_resolver_worker_thread(void *thread_data) {
-    struct amp_resolve_info *data = (struct amp_resolve_info *)thread_data;
-    struct addrinfo *addrlist = NULL, *item;
-    char name[MAX_DNS_NAME_LEN];
-    struct amp_resolve_query info;
+static void build_legacy_reply(struct amp_resolve_conn *state) {
+    struct addrinfo *item;
     uint8_t more;
     uint8_t namelen;
-    int bytes;
-    pthread_mutex_t addrlist_lock;
-    int remaining = 0;
 
-    Log(LOG_DEBUG, "Starting new name resolution thread");
+    for ( item = state->addrlist; item != NULL; item = item->ai_next ) {
+        assert(item->ai_canonname);
+        namelen = strlen(item->ai_canonname) + 1;
+        assert(namelen > 1);
+        more = (item->ai_next) ? 1 : 0;
 
-    pthread_mutex_init(&addrlist_lock, NULL);
+        worker_buffer_append(&state->output, item, sizeof(*item));
+        worker_buffer_append(&state->output, item->ai_addr, item->ai_addrlen);
+        worker_buffer_append(&state->output, &namelen, sizeof(namelen));
+        worker_buffer_append(&state->output, item->ai_canonname, namelen);
+        worker_buffer_append(&state->output, &more, sizeof(uint8_t));
+    }
+}
 
-    /* everything we read should be a name to lookup */
-    while ( 1 ) {
 
-        /* read name length, address count, family etc */
-        if ( recv(data->fd, &info, sizeof(info), 0) <= 0 ) {
-            Log(LOG_WARNING, "Error reading name info, aborting");
-            break;
-        }
 
-        /* zero here is a marker - no more names need to be resolved */
-        if ( info.namelen == 0 ) {
-            break;
-        }
+/*
+ * Queue all the resolved addresses to be sent back to a test process as a
+ * single batch, with a header describing how much data follows.
+ */
+static void build_batch_reply(struct amp_resolve_conn *state) {
+    struct amp_resolve_reply_header header;
+    struct amp_resolve_reply_item info;
+    struct addrinfo *item;
+    size_t namelen;
 
-        if ( (bytes = recv(data->fd, name, info.namelen, 0)) <= 0 ) {
-            Log(LOG_WARNING, "Error reading name, aborting");
-            break;
+    memset(&header, 0, sizeof(header));
+    header.version = AMP_RESOLVE_VERSION;
+
+    /* reserve space for the header, it gets filled in at the end */
+    worker_buffer_append(&state->output, &header, sizeof(header));
+
+    for ( item = state->addrlist; item != NULL &&
+            header.count < UINT16_MAX; item = item->ai_next ) {
+        assert(item->ai_canonname);
+        namelen = strlen(item->ai_canonname);
+
+        if ( namelen == 0 || namelen > UINT8_MAX ||
+                item->ai_addrlen > UINT8_MAX ) {
+            Log(LOG_WARNING, "Can't send address for '%s', skipping",
+                    item->ai_canonname);
+            continue;
         }
 
-        Log(LOG_DEBUG, "Read %d bytes for name '%s'", bytes, name);
+        memset(&info, 0, sizeof(info));
+        info.flags = item->ai_flags;
+        info.family = item->ai_family;
+        info.socktype = item->ai_socktype;
+        info.protocol = item->ai_protocol;
+        info.addrlen = item->ai_addrlen;
+        info.namelen = namelen;
+
+        worker_buffer_append(&state->output, &info, sizeof(info));
+        worker_buffer_append(&state->output, item->ai_addr, item->ai_addrlen);
+        worker_buffer_append(&state->output, item->ai_canonname, namelen);
+        header.count++;
+    }
+
+    header.length = state->output.length - sizeof(header);
+    memcpy(state->output.data, &header, sizeof(header));
+}
+
 
-        /* add it to the list of names to resolve and go back for more */
-        amp_resolve_add(data->ctx, &addrlist, &addrlist_lock, name,
-                info.family, info.count, &remaining);
+
+/*
+ * Queue all the resolved addresses to be sent back to the test process,
+ * using the same protocol version that the queries arrived in.
+ */
+static void build_address_reply(struct amp_resolve_conn *state) {
+    if ( state->version == AMP_RESOLVE_VERSION ) {
+        build_batch_reply(state);
+    } else {
+        build_legacy_reply(state);
     }
+}
+
+
+
+/*
+ * Send as much of the reply as possible, closing the connection once it
+ * has all been sent.
+ */
+static int send_address_reply(worker_conn_t *conn) {
+    struct amp_resolve_conn *state = (struct amp_resolve_conn *)conn->state;
+
+    switch ( worker_buffer_send(&state->output, conn->fd) ) {
+        case 0: return WORKER_CONN_KEEP;
+        case 1: Log(LOG_DEBUG, "Finished sending resolved addresses");
+                return WORKER_CONN_CLOSE;
+        default: Log(LOG_WARNING, "Failed to send resolved addresses: %s",
+                         strerror(errno));
+                 return WORKER_CONN_CLOSE;
+    };
+}
+
+
+
+/*
+ * Called with the addrlist lock held once all the names for a connection
+ * have been resolved. The answers could have been processed by any worker,
+ * so wake up the one that owns the connection to send them back.
+ */
+static void resolver_answered(void *data) {
+    worker_conn_wake((worker_conn_t *)data);
+}
+
+
+
+/*
+ * Check if all the names have been resolved, and if so start sending the
+ * addresses back to the test process.
+ */
+static int resolver_poll(worker_conn_t *conn) {
+    struct amp_resolve_conn *state = (struct amp_resolve_conn *)conn->state;
+    int remaining;
 
-    Log(LOG_DEBUG, "Got all requests, waiting for responses");
+    assert(state->state == RESOLVER_WAITING);
 
-    /* when the remote end has finished sending names, wait for resolution */
-    amp_resolve_wait(data->ctx, &addrlist_lock, &remaining);
+    pthread_mutex_lock(&state->lock);
+    remaining = state->remaining;
+    pthread_mutex_unlock(&state->lock);
+
+    if ( remaining > 0 ) {
+        return WORKER_CONN_KEEP;
+    }
 
     /* once we have all the responses then we don't need the addrlist lock */
-    pthread_mutex_lock(&addrlist_lock);
+    conn->polling = 0;
+
+    if ( state->abandoned ) {
+        return WORKER_CONN_CLOSE;
+    }
 
     Log(LOG_DEBUG, "Got all responses, sending them back");
 
-    /* send back all the results of name resolution */
-    for ( item = addrlist; item != NULL; item = item->ai_next) {
-        if ( send(data->fd, item, sizeof(*item), MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send resolved address info: %s",
-                    strerror(errno));
-            goto end;
-        }
+    build_address_reply(state);
+    state->state = RESOLVER_SENDING;
 
-        if ( send(data->fd, item->ai_addr,item->ai_addrlen,MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send resolved address: %s",
-                    strerror(errno));
-            goto end;
-        }
+    if ( worker_watch_fd(conn, conn->fd, EPOLLOUT) < 0 ) {
+        return WORKER_CONN_CLOSE;
+    }
 
-        namelen = strlen(item->ai_canonname) + 1;
-        assert(namelen > 1);
-        if ( send(data->fd, &namelen, sizeof(namelen), MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send resolved canonical name: %s",
-                    strerror(errno));
-            goto end;
+    return send_address_reply(conn);
+}
+
+
+
+/*
+ * Work out which protocol version the test process is using. A batch starts
+ * with a header that would look like an end marker to older servers, but
+ * has the magic value set.
+ */
+static int parse_protocol_version(struct amp_resolve_conn *state) {
+    struct amp_resolve_batch_header header;
+
+    if ( state->inlen < sizeof(struct amp_resolve_query) ) {
+        return 0;
+    }
+
+    memcpy(&header, state->input, sizeof(struct amp_resolve_query));
+
+    if ( header.marker != 0 || header.magic != AMP_RESOLVE_MAGIC ) {
+        state->version = 1;
+        return 1;
+    }
+
+    if ( state->inlen < sizeof(header) ) {
+        return 0;
+    }
+
+    memcpy(&header, state->input, sizeof(header));
+
+    if ( header.version != AMP_RESOLVE_VERSION ) {
+        Log(LOG_WARNING, "Unknown resolver protocol version %d",
+                header.version);
+        return -1;
+    }
+
+    Log(LOG_DEBUG, "Reading batch of %d names", header.count);
+
+    state->version = header.version;
+    state->queries = header.count;
+
+    memmove(state->input, state->input + sizeof(header),
+            state->inlen - sizeof(header));
+    state->inlen -= sizeof(header);
+
+    return 1;
+}
+
+
+
+/*
+ * Parse as many complete queries as possible out of the data that has been
+ * read, adding each name to be resolved. Returns 1 once the marker saying
+ * there are no more names has been read (or the whole batch has been read),
+ * 0 if more data is needed and -1 if the data isn't valid.
+ */
+static int parse_name_queries(struct amp_resolve_conn *state) {
+    struct amp_resolve_query info;
+    char name[MAX_DNS_NAME_LEN + 1];
+    size_t length;
+    int ret;
+
+    if ( state->version == 0 &&
+            (ret = parse_protocol_version(state)) <= 0 ) {
+        return ret;
+    }
+
+    while ( state->inlen >= sizeof(info) ) {
+        /* a batch says how many names it has, there is no end marker */
+        if ( state->version == AMP_RESOLVE_VERSION && state->queries <= 0 ) {
+            break;
         }
 
-        assert(item->ai_canonname);
-        if ( send(data->fd, item->ai_canonname, namelen, MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send resolved canonical name: %s",
-                    strerror(errno));
-            goto end;
+        memcpy(&info, state->input, sizeof(info));
+
+        /* zero here is a marker - no more names need to be resolved */
+        if ( info.namelen == 0 ) {
+            if ( state->version == AMP_RESOLVE_VERSION ) {
+                Log(LOG_WARNING, "Empty name in resolver batch");
+                return -1;
+            }
+            return 1;
         }
 
-        more = (item->ai_next) ? 1 : 0;
-        if ( send(data->fd, &more, sizeof(uint8_t), MSG_NOSIGNAL) < 0 ) {
-            Log(LOG_WARNING, "Failed to send more flag: %s", strerror(errno));
-            goto end;
+        length = sizeof(info) + info.namelen;
+        if ( state->inlen < length ) {
+            return 0;
         }
+
+        /* names in a batch don't include the terminating null */
+        memcpy(name, state->input + sizeof(info), info.namelen);
+        name[info.namelen] = '\0';
+
+        Log(LOG_DEBUG, "Read %d bytes for name '%s'", info.namelen, name);
+
+        /*
+         * Add it to the list of names to resolve and go back for more. Names
+         * that are cached will be added to the address list straight away.
+         */
+        dns_cache_resolve_add(state->ctx, &state->addrlist, &state->lock,
+                name, info.family, info.count, &state->remaining,
+                resolver_answered, state->conn);
+
+        memmove(state->input, state->input + length, state->inlen - length);
+        state->inlen -= length;
+        state->queries--;
+    }
+
+    if ( state->version == AMP_RESOLVE_VERSION && state->queries <= 0 ) {
+        return 1;
     }
 
-    Log(LOG_DEBUG, "Name resolution thread completed, exiting");
+    return 0;
+}
+
+
+
+/*
+ * Deal with activity on the connection to a test process. While reading
+ * names they are resolved as they arrive, and the connection waits until
+ * they are all answered before sending back the addresses.
+ */
+static int resolver_ready(worker_conn_t *conn, int fd, uint32_t events) {
+    struct amp_resolve_conn *state = (struct amp_resolve_conn *)conn->state;
+    ssize_t bytes;
+    int ret;
+
+    assert(fd == conn->fd);
+
+    switch ( state->state ) {
+        case RESOLVER_READING:
+            bytes = recv(fd, state->input + state->inlen,
+                    sizeof(state->input) - state->inlen, MSG_DONTWAIT);
+
+            if ( bytes < 0 && (errno == EAGAIN || errno == EINTR) ) {
+                return WORKER_CONN_KEEP;
+            }
 
-end:
-    close(data->fd);
-    amp_resolve_freeaddr(addrlist);
-    pthread_mutex_unlock(&addrlist_lock);
-    pthread_mutex_destroy(&addrlist_lock);
-    free(data);
+            if ( bytes <= 0 ) {
+                Log(LOG_WARNING, "Error reading name info, aborting");
+                state->abandoned = 1;
+                break;
+            }
 
-    pthread_exit(NULL);
+            state->inlen += bytes;
+
+            if ( (ret = parse_name_queries(state)) == 0 ) {
+                return WORKER_CONN_KEEP;
+            }
+
+            if ( ret < 0 ) {
+                Log(LOG_WARNING, "Invalid name info, aborting");
+                state->abandoned = 1;
+                break;
+            }
+
+            Log(LOG_DEBUG, "Got all requests, waiting for responses");
+            break;
+
+        case RESOLVER_WAITING:
+            /* only errors are reported while waiting, the test went away */
+            state->abandoned = 1;
+            worker_unwatch_fd(conn, fd);
+            return WORKER_CONN_KEEP;
+
+        case RESOLVER_SENDING:
+            if ( events & (EPOLLERR | EPOLLHUP) ) {
+                Log(LOG_WARNING, "Test went away before addresses were sent");
+                return WORKER_CONN_CLOSE;
+            }
+            return send_address_reply(conn);
+    };
+
+    /*
+     * Outstanding queries still refer to the address list, so even if the
+     * test has gone away the connection has to wait for them to finish.
+     */
+    state->state = RESOLVER_WAITING;
+    conn->polling = 1;
+
+    if ( state->abandoned ) {
+        worker_unwatch_fd(conn, fd);
+    } else if ( worker_watch_fd(conn, fd, 0) < 0 ) {
+        state->abandoned = 1;
+        worker_unwatch_fd(conn, fd);
+    }
+
+    return resolver_poll(conn);
+}
+
+
+
+/*
+ * Set up the state for a new connection from a test process.
+ */
+static int resolver_start(worker_conn_t *conn) {
+    struct amp_resolve_conn *state;
+
+    Log(LOG_DEBUG, "Starting new name resolution connection");
+
+    state = calloc(1, sizeof(struct amp_resolve_conn));
+    state->state = RESOLVER_READING;
+    state->conn = conn;
+    state->ctx = (struct ub_ctx *)conn->service_data;
+    pthread_mutex_init(&state->lock, NULL);
+    conn->state = state;
+
+    return WORKER_CONN_KEEP;
+}
+
+
+
+/*
+ * Free the state for a finished connection.
+ */
+static void resolver_finish(worker_conn_t *conn) {
+    struct amp_resolve_conn *state = (struct amp_resolve_conn *)conn->state;
+
+    if ( state == NULL ) {
+        return;
+    }
+
+    Log(LOG_DEBUG, "Name resolution connection completed");
+
+    amp_resolve_freeaddr(state->addrlist);
+    pthread_mutex_destroy(&state->lock);
+    worker_buffer_free(&state->output);
+    free(state);
+}
+
+
+
+/*
+ * Process any answers that are waiting on the resolver. These could belong
+ * to any connection, the worker that owns a connection is woken up once all
+ * of its answers have arrived.
+ */
+static void resolver_shared_ready(void *data) {
+    ub_process((struct ub_ctx *)data);
 }
 
 
@@ -169,16 +460,45 @@ void amp_resolver_context_delete(struct ub_ctx *ctx) {
 
 
 /*
- * Accept a new connection on the local name resolution socket and spawn
- * a new thread to deal with the queries from the test process.
+ * Start the pool of threads that answer name resolution requests from test
+ * processes. All the threads share the unbound context and process answers
+ * from it as they arrive, including those used to refresh the cache.
+ */
+worker_pool_t *start_resolver_pool(struct ub_ctx *ctx, int threads) {
+    worker_service_t service;
+
+    assert(ctx);
+
+    memset(&service, 0, sizeof(service));
+    service.name = "resolver";
+    service.data = ctx;
+    service.shared_fd = ub_fd(ctx);
+    service.poll_interval = 0;
+    service.start = resolver_start;
+    service.ready = resolver_ready;
+    service.poll = resolver_poll;
+    service.shared_ready = resolver_shared_ready;
+    service.finish = resolver_finish;
+
+    if ( service.shared_fd < 0 ) {
+        Log(LOG_WARNING, "Failed to get resolver file descriptor");
+        return NULL;
+    }
+
+    return create_worker_pool(&service, threads);
+}
+
+
+
+/*
+ * Accept a new connection on the local name resolution socket and hand it
+ * to one of the resolver threads to deal with the queries from the test.
  */
 void resolver_socket_event_callback(
         __attribute__((unused))wand_event_handler_t *ev_hdl, int eventfd,
         void *data, __attribute__((unused))enum wand_eventtype_t ev) {
 
     int fd;
-    pthread_t thread;
-    struct amp_resolve_info *info;
 
     Log(LOG_DEBUG, "Accepting for new resolver connection");
 
@@ -190,11 +510,8 @@ void resolver_socket_event_callback(
 
     Log(LOG_DEBUG, "Accepted new resolver connection on fd %d", fd);
 
-    info = calloc(1, sizeof(struct amp_resolve_info));
-    info->ctx = data;
-    info->fd = fd;
-
-    /* create the thread and detach, we don't need to look after it */
-    pthread_create(&thread, NULL, amp_resolver_worker_thread, info);
-    pthread_detach(thread);
+    if ( worker_pool_add_connection((worker_pool_t *)data, fd) < 0 ) {
+        Log(LOG_WARNING, "No resolver threads available, closing connection");
+        close(fd);
+    }
 }
@@ -40,16 +40,40 @@
 #ifndef _MEASURED_NSSOCK_H
 #define _MEASURED_NSSOCK_H
 
+#include <pthread.h>
+#include <netdb.h>
 #include <unbound.h>
 #include <libwandevent.h>
 
+#include "ampresolv.h"
+#include "workerpool.h"
 
-/* data block given to each resolving thread */
-struct amp_resolve_info {
-    int fd;                     /* file descriptor to the test process */
-    struct ub_ctx *ctx;         /* shared unbound context (with the cache) */
+/* progress of a connection from a test process asking for names */
+typedef enum {
+    RESOLVER_READING,           /* reading names to resolve */
+    RESOLVER_WAITING,           /* waiting for the names to be resolved */
+    RESOLVER_SENDING,           /* sending the addresses back */
+} resolver_conn_state_t;
+
+/*
+ * State kept for each connection from a test process.
+ */
+struct amp_resolve_conn {
+    resolver_conn_state_t state;
+    worker_conn_t *conn;        /* worker connection this state belongs to */
+    struct ub_ctx *ctx;         /* shared unbound context */
+    int version;                /* protocol version used by the test */
+    int queries;                /* queries in the batch still to be read */
+    uint8_t input[sizeof(struct amp_resolve_query) + MAX_DNS_NAME_LEN];
+    size_t inlen;               /* bytes of partially read query */
+    struct addrinfo *addrlist;  /* addresses resolved so far */
+    pthread_mutex_t lock;       /* protects addrlist and remaining */
+    int remaining;              /* queries still to be answered */
+    int abandoned;              /* test process went away while waiting */
+    worker_buffer_t output;     /* addresses waiting to be sent */
 };
 
+worker_pool_t *start_resolver_pool(struct ub_ctx *ctx, int threads);
 void resolver_socket_event_callback(wand_event_handler_t *ev_hdl, int eventfd,
         void *data, __attribute__((unused))enum wand_eventtype_t ev);
 
@@ -54,6 +54,9 @@
 #include "acl.h"
 #include "dscp.h"
 #include "rabbitcfg.h"
+#include "testrunner.h"
+#include "admission.h"
+#include "workerpool.h"
 
 
 
@@ -110,6 +113,41 @@ static int callback_verify_packet_delay(cfg_t *cfg, cfg_opt_t *opt) {
 
 
 
+/*
+ * Ensure that the number of test runners is within the allowed range.
+ */
+static int callback_verify_test_runners(cfg_t *cfg, cfg_opt_t *opt) {
+    int value = cfg_opt_getnint(opt, cfg_opt_size(opt) - 1);
+
+    if ( value < 0 || value > MAX_TEST_RUNNERS ) {
+        cfg_error(cfg, "Invalid value for option %s: %d\n"
+                "Number of test runners must be between 0 and %d\n",
+                opt->name, value, MAX_TEST_RUNNERS);
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/*
+ * Callback to verify that the number of threads answering local resolver
+ * requests is within the allowed range.
+ */
+static int callback_verify_resolver_threads(cfg_t *cfg, cfg_opt_t *opt) {
+    int value = cfg_opt_getnint(opt, cfg_opt_size(opt) - 1);
+
+    if ( value < 1 || value > MAX_WORKER_THREADS ) {
+        cfg_error(cfg, "Invalid value for option %s: %d\n"
+                "Number of resolver threads must be between 1 and %d\n",
+                opt->name, value, MAX_WORKER_THREADS);
+        return -1;
+    }
+    return 0;
+}
+
+
+
 /*
  * Callback to verify that the DSCP value given in the configuration is a
  * valid name of a differentiated services code point, or a numeric value
@@ -197,6 +235,26 @@ int get_loglevel_config(cfg_t *cfg) {
 
 
 
+/*
+ * Get the number of pre-forked test runner processes to use.
+ */
+int get_test_runner_config(cfg_t *cfg) {
+    assert(cfg);
+    return cfg_getint(cfg, "testrunners");
+}
+
+
+
+/*
+ * Get the number of threads to use answering name and ASN lookups for tests.
+ */
+int get_resolver_thread_config(cfg_t *cfg) {
+    assert(cfg);
+    return cfg_getint(cfg, "resolverthreads");
+}
+
+
+
 /*
  * Should rabbitmq be configured on start up?
  */
@@ -217,6 +275,16 @@ int should_config_rabbit(cfg_t *cfg) {
 
 
 
+/*
+ * Should test start times be spread across their frequency window?
+ */
+int should_spread_schedule(cfg_t *cfg) {
+    assert(cfg);
+    return cfg_getbool(cfg, "schedulespread");
+}
+
+
+
 /*
  * Should the client wait to receive an SSL certificate, or terminate if it
  * is missing?
@@ -293,6 +361,124 @@ static int get_ssl_config(cfg_t *cfg_sub, amp_ssl_opt_t *amqp_ssl) {
 
 
 
+/*
+ * Parse the config for how results are batched when they are published to
+ * the collector, how many can be waiting for confirmation at once, and if
+ * large results should be compressed.
+ */
+amp_publisher_t* get_publisher_config(cfg_t *cfg) {
+    amp_publisher_t *publisher;
+    cfg_t *cfg_sub;
+
+    assert(cfg);
+
+    publisher = (amp_publisher_t *) calloc(1, sizeof(amp_publisher_t));
+    publisher->batch_size = DEFAULT_PUBLISH_BATCH_SIZE;
+    publisher->batch_delay = DEFAULT_PUBLISH_BATCH_DELAY;
+    publisher->window = DEFAULT_PUBLISH_WINDOW;
+    publisher->compress = 0;
+    publisher->compress_threshold = DEFAULT_COMPRESS_THRESHOLD;
+    publisher->compress_level = DEFAULT_COMPRESS_LEVEL;
+
+    cfg_sub = cfg_getsec(cfg, "collector");
+
+    if ( cfg_sub ) {
+        publisher->batch_size = cfg_getint(cfg_sub, "batchsize");
+        publisher->batch_delay = cfg_getint(cfg_sub, "batchdelay");
+        publisher->window = cfg_getint(cfg_sub, "window");
+        publisher->compress = cfg_getbool(cfg_sub, "compress");
+        publisher->compress_threshold =
+            cfg_getint(cfg_sub, "compressthreshold");
+        publisher->compress_level = cfg_getint(cfg_sub, "compresslevel");
+    }
+
+    return publisher;
+}
+
+
+
+/*
+ * Parse the config for spooling results to disk when they can't be
+ * published. Spooling is enabled by default, with each amplet client using
+ * its own directory.
+ */
+amp_spool_t* get_spool_config(cfg_t *cfg) {
+    amp_spool_t *spool;
+    cfg_t *cfg_sub;
+
+    assert(cfg);
+
+    spool = (amp_spool_t *) calloc(1, sizeof(amp_spool_t));
+    spool->enabled = 1;
+    spool->max_size = DEFAULT_SPOOL_MAX_SIZE;
+    spool->segment_size = DEFAULT_SPOOL_SEGMENT_SIZE;
+    spool->sync_records = DEFAULT_SPOOL_SYNC_RECORDS;
+    spool->drain_rate = DEFAULT_SPOOL_DRAIN_RATE;
+
+    cfg_sub = cfg_getsec(cfg, "spool");
+
+    if ( cfg_sub ) {
+        spool->enabled = cfg_getbool(cfg_sub, "enabled");
+        spool->max_size = (uint64_t)cfg_getint(cfg_sub, "maxsize") * 1024;
+        spool->segment_size =
+            (uint64_t)cfg_getint(cfg_sub, "segmentsize") * 1024;
+        spool->sync_records = cfg_getint(cfg_sub, "syncrecords");
+        spool->drain_rate = cfg_getint(cfg_sub, "drainrate");
+
+        if ( cfg_getstr(cfg_sub, "directory") != NULL ) {
+            spool->directory = strdup(cfg_getstr(cfg_sub, "directory"));
+        }
+    }
+
+    if ( spool->directory == NULL && asprintf(&spool->directory, "%s/%s",
+                AMP_SPOOL_DIR, vars.ampname) < 0 ) {
+        Log(LOG_WARNING, "Failed to build spool directory path");
+        spool->directory = NULL;
+        spool->enabled = 0;
+    }
+
+    return spool;
+}
+
+
+
+/*
+ * Parse the config for limiting how many scheduled tests can run at once.
+ * Limits can be set for all tests, and for individual tests by name.
+ */
+amp_admission_t* get_admission_config(cfg_t *cfg) {
+    amp_admission_t *admission;
+    amp_test_limit_t *limit;
+    cfg_t *cfg_sub, *cfg_test;
+    unsigned int i;
+
+    assert(cfg);
+
+    admission = (amp_admission_t *) calloc(1, sizeof(amp_admission_t));
+    admission->max_queue = DEFAULT_DEFERRED_QUEUE_LENGTH;
+
+    cfg_sub = cfg_getsec(cfg, "concurrency");
+
+    if ( cfg_sub ) {
+        admission->max_running = cfg_getint(cfg_sub, "max");
+        admission->max_queue = cfg_getint(cfg_sub, "queue");
+
+        for ( i = 0; i < cfg_size(cfg_sub, "test"); i++ ) {
+            cfg_test = cfg_getnsec(cfg_sub, "test", i);
+
+            limit = (amp_test_limit_t *) malloc(sizeof(amp_test_limit_t));
+            limit->name = strdup(cfg_title(cfg_test));
+            limit->max_running = cfg_getint(cfg_test, "max");
+            limit->next = admission->limits;
+            admission->limits = limit;
+        }
+    }
+
+    return admission;
+}
+
+
+
 /*
  * Parse the config for the control socket. It will only start if enabled
  * and SSL gets set up properly. It uses the same SSL settings as for
@@ -520,6 +706,79 @@ struct ub_ctx* get_dns_context_config(cfg_t *cfg, amp_test_meta_t *meta) {
 
 
 
+/*
+ * Parse the config for caching name resolution results, and how long
+ * before a test runs that its names should be resolved.
+ */
+amp_dns_cache_t* get_dns_cache_config(cfg_t *cfg) {
+    amp_dns_cache_t *cache;
+    cfg_t *cfg_sub;
+
+    assert(cfg);
+
+    cache = (amp_dns_cache_t *) calloc(1, sizeof(amp_dns_cache_t));
+    cache->enabled = 1;
+    cache->max_entries = DEFAULT_DNS_CACHE_MAX_ENTRIES;
+    cache->max_ttl = DEFAULT_DNS_CACHE_MAX_TTL;
+    cache->negative_ttl = DEFAULT_DNS_CACHE_NEGATIVE_TTL;
+    cache->prefetch = DEFAULT_DNS_CACHE_PREFETCH;
+
+    cfg_sub = cfg_getsec(cfg, "dnscache");
+
+    if ( cfg_sub ) {
+        cache->enabled = cfg_getbool(cfg_sub, "enabled");
+        cache->max_entries = cfg_getint(cfg_sub, "maxentries");
+        cache->max_ttl = cfg_getint(cfg_sub, "maxttl");
+        cache->negative_ttl = cfg_getint(cfg_sub, "negativettl");
+        cache->prefetch = cfg_getint(cfg_sub, "prefetch");
+    }
+
+    return cache;
+}
+
+
+
+/*
+ * Parse the config for saving the ASN cache to disk, so that it can be
+ * used again after a restart, and for a local prefix to AS table.
+ */
+amp_asn_cache_t* get_asn_cache_config(cfg_t *cfg) {
+    amp_asn_cache_t *cache;
+    cfg_t *cfg_sub;
+
+    assert(cfg);
+
+    cache = (amp_asn_cache_t *) calloc(1, sizeof(amp_asn_cache_t));
+    cache->enabled = 1;
+    cache->checkpoint = DEFAULT_ASN_CACHE_CHECKPOINT;
+    cache->table_refresh = DEFAULT_ASN_TABLE_REFRESH;
+
+    cfg_sub = cfg_getsec(cfg, "asncache");
+
+    if ( cfg_sub ) {
+        cache->enabled = cfg_getbool(cfg_sub, "enabled");
+        cache->checkpoint = cfg_getint(cfg_sub, "checkpoint");
+        if ( cfg_getstr(cfg_sub, "file") != NULL ) {
+            cache->filename = strdup(cfg_getstr(cfg_sub, "file"));
+        }
+        if ( cfg_getstr(cfg_sub, "prefixtable") != NULL ) {
+            cache->table = strdup(cfg_getstr(cfg_sub, "prefixtable"));
+        }
+        cache->table_refresh = cfg_getint(cfg_sub, "prefixrefresh");
+    }
+
+    if ( cache->filename == NULL && asprintf(&cache->filename, "%s/%s.asn",
+                AMP_SPOOL_DIR, vars.ampname) < 0 ) {
+        Log(LOG_WARNING, "Failed to build ASN cache file path");
+        cache->filename = NULL;
+        cache->enabled = 0;
+    }
+
+    return cache;
+}
+
+
+
 /*
  * Parse the config and set the generic options that we know are always
  * required. These options to into the global vars structure, which is slowly
@@ -567,6 +826,12 @@ cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
         CFG_STR("key", NULL, CFGF_NONE),
         CFG_STR("cert", NULL, CFGF_NONE),
         CFG_BOOL("waitforcert", -1, CFGF_NONE),
+        CFG_INT("batchsize", DEFAULT_PUBLISH_BATCH_SIZE, CFGF_NONE),
+        CFG_INT("batchdelay", DEFAULT_PUBLISH_BATCH_DELAY, CFGF_NONE),
+        CFG_INT("window", DEFAULT_PUBLISH_WINDOW, CFGF_NONE),
+        CFG_BOOL("compress", cfg_false, CFGF_NONE),
+        CFG_INT("compressthreshold", DEFAULT_COMPRESS_THRESHOLD, CFGF_NONE),
+        CFG_INT("compresslevel", DEFAULT_COMPRESS_LEVEL, CFGF_NONE),
         CFG_END()
     };
 
@@ -597,6 +862,46 @@ cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
         CFG_END()
     };
 
+    cfg_opt_t opt_test_limit[] = {
+        CFG_INT("max", 0, CFGF_NONE),
+        CFG_END()
+    };
+
+    cfg_opt_t opt_concurrency[] = {
+        CFG_INT("max", 0, CFGF_NONE),
+        CFG_INT("queue", DEFAULT_DEFERRED_QUEUE_LENGTH, CFGF_NONE),
+        CFG_SEC("test", opt_test_limit, CFGF_TITLE | CFGF_MULTI),
+        CFG_END()
+    };
+
+    cfg_opt_t opt_spool[] = {
+        CFG_BOOL("enabled", cfg_true, CFGF_NONE),
+        CFG_STR("directory", NULL, CFGF_NONE),
+        CFG_INT("maxsize", DEFAULT_SPOOL_MAX_SIZE / 1024, CFGF_NONE),
+        CFG_INT("segmentsize", DEFAULT_SPOOL_SEGMENT_SIZE / 1024, CFGF_NONE),
+        CFG_INT("syncrecords", DEFAULT_SPOOL_SYNC_RECORDS, CFGF_NONE),
+        CFG_INT("drainrate", DEFAULT_SPOOL_DRAIN_RATE, CFGF_NONE),
+        CFG_END()
+    };
+
+    cfg_opt_t opt_dnscache[] = {
+        CFG_BOOL("enabled", cfg_true, CFGF_NONE),
+        CFG_INT("maxentries", DEFAULT_DNS_CACHE_MAX_ENTRIES, CFGF_NONE),
+        CFG_INT("maxttl", DEFAULT_DNS_CACHE_MAX_TTL, CFGF_NONE),
+        CFG_INT("negativettl", DEFAULT_DNS_CACHE_NEGATIVE_TTL, CFGF_NONE),
+        CFG_INT("prefetch", DEFAULT_DNS_CACHE_PREFETCH, CFGF_NONE),
+        CFG_END()
+    };
+
+    cfg_opt_t opt_asncache[] = {
+        CFG_BOOL("enabled", cfg_true, CFGF_NONE),
+        CFG_STR("file", NULL, CFGF_NONE),
+        CFG_INT("checkpoint", DEFAULT_ASN_CACHE_CHECKPOINT, CFGF_NONE),
+        CFG_STR("prefixtable", NULL, CFGF_NONE),
+        CFG_INT("prefixrefresh", DEFAULT_ASN_TABLE_REFRESH, CFGF_NONE),
+        CFG_END()
+    };
+
     cfg_opt_t measured_opts[] = {
 	CFG_STR("ampname", NULL, CFGF_NONE),
 	CFG_STR("interface", NULL, CFGF_NONE),
@@ -606,10 +911,17 @@ cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
         CFG_INT_CB("loglevel", LOG_INFO, CFGF_NONE, &callback_verify_loglevel),
         CFG_INT_CB("dscp", DEFAULT_DSCP_VALUE, CFGF_NONE,&callback_verify_dscp),
         CFG_STR_LIST("nameservers", NULL, CFGF_NONE),
+        CFG_INT("testrunners", DEFAULT_TEST_RUNNERS, CFGF_NONE),
+        CFG_INT("resolverthreads", DEFAULT_WORKER_THREADS, CFGF_NONE),
+        CFG_BOOL("schedulespread", cfg_false, CFGF_NONE),
 	CFG_SEC("ssl", opt_ssl, CFGF_NONE),
 	CFG_SEC("collector", opt_collector, CFGF_NONE),
         CFG_SEC("remotesched", opt_remotesched, CFGF_NONE),
         CFG_SEC("control", opt_control, CFGF_NONE),
+        CFG_SEC("concurrency", opt_concurrency, CFGF_NONE),
+        CFG_SEC("spool", opt_spool, CFGF_NONE),
+        CFG_SEC("dnscache", opt_dnscache, CFGF_NONE),
+        CFG_SEC("asncache", opt_asncache, CFGF_NONE),
 	CFG_END()
     };
 
@@ -617,6 +929,9 @@ cfg_t* parse_config(char *filename, struct amp_global_t *vars) {
 
     cfg = cfg_init(measured_opts, CFGF_NONE);
     cfg_set_validate_func(cfg, "packetdelay", callback_verify_packet_delay);
+    cfg_set_validate_func(cfg, "testrunners", callback_verify_test_runners);
+    cfg_set_validate_func(cfg, "resolverthreads",
+            callback_verify_resolver_threads);
 
     ret = cfg_parse(cfg, filename);
 
@@ -46,14 +46,27 @@
 #include "global.h"
 #include "control.h"
 #include "schedule.h"
+#include "admission.h"
+#include "messaging.h"
+#include "spool.h"
+#include "dnscache.h"
+#include "asnsock.h"
 
 int get_loglevel_config(cfg_t *cfg);
+int get_test_runner_config(cfg_t *cfg);
+int get_resolver_thread_config(cfg_t *cfg);
 int should_config_rabbit(cfg_t *cfg);
 int should_wait_for_cert(cfg_t *cfg);
+int should_spread_schedule(cfg_t *cfg);
 amp_control_t* get_control_config(cfg_t *cfg, amp_test_meta_t *meta);
 fetch_schedule_item_t* get_remote_schedule_config(cfg_t *cfg);
+amp_admission_t* get_admission_config(cfg_t *cfg);
+amp_publisher_t* get_publisher_config(cfg_t *cfg);
+amp_spool_t* get_spool_config(cfg_t *cfg);
 amp_test_meta_t* get_interface_config(cfg_t *cfg, amp_test_meta_t *meta);
 struct ub_ctx* get_dns_context_config(cfg_t *cfg, amp_test_meta_t *meta);
+amp_dns_cache_t* get_dns_cache_config(cfg_t *cfg);
+amp_asn_cache_t* get_asn_cache_config(cfg_t *cfg);
 cfg_t* parse_config(char *filename, struct amp_global_t *vars);
 
 #endif
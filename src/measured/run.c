@@ -44,11 +44,13 @@
 #include <time.h>
 #include <string.h>
 #include <sys/types.h>
-#include <ifaddrs.h>
 #include <libwandevent.h>
 
 #include "config.h"
 #include "schedule.h"
+#include "timerheap.h"
+#include "testrunner.h"
+#include "admission.h"
 #include "watchdog.h"
 #include "run.h"
 #include "control.h"
@@ -57,6 +59,7 @@
 #include "modules.h"
 #include "global.h" /* hopefully temporary */
 #include "ampresolv.h"
+#include "ifsnapshot.h"
 #include "ssl.h"
 #include "messaging.h"
 #include "serverlib.h" /* only for send_measured_response() */
@@ -200,7 +203,7 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
     if ( item->resolve != NULL ) {
 	struct addrinfo *tmp;
         int resolver_fd;
-        struct ifaddrs *ifaddrlist;
+        amp_resolve_batch_t batch;
         int seen_ipv4, seen_ipv6;
 
 	Log(LOG_DEBUG, "test has destinations to resolve!\n");
@@ -211,36 +214,11 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
          * a lot like __check_pf() from libc that is used by getaddrinfo
          * when AI_ADDRCONFIG is set. Might be nice to do this inside the
          * amp_resolve_add() function, but then it's harder to keep state.
+         * The interfaces come from the snapshot that measured keeps up to
+         * date, so this doesn't need to ask the kernel every test.
          */
-        if ( getifaddrs(&ifaddrlist) < 0 ) {
-            /* error getting interfaces, assume we can do both IPv4 and 6 */
-            seen_ipv4 = 1;
-            seen_ipv6 = 1;
-        } else {
-            struct ifaddrs *ifa;
-            seen_ipv4 = 0;
-            seen_ipv6 = 0;
-            for ( ifa = ifaddrlist; ifa != NULL; ifa = ifa->ifa_next ) {
-                /* some interfaces (e.g. ppp) sometimes won't have an address */
-                if ( ifa->ifa_addr == NULL ) {
-                    continue;
-                }
-
-                /* ignore other interfaces if the source interface is set */
-                if ( item->meta->interface != NULL &&
-                        strcmp(item->meta->interface, ifa->ifa_name) != 0 ) {
-                    continue;
-                }
-
-                /* otherwise, flag the family as one that we can use */
-                if ( ifa->ifa_addr->sa_family == AF_INET ) {
-                    seen_ipv4 = 1;
-                } else if ( ifa->ifa_addr->sa_family == AF_INET6 ) {
-                    seen_ipv6 = 1;
-                }
-            }
-            freeifaddrs(ifaddrlist);
-        }
+        amp_interface_families(item->meta->interface, &seen_ipv4,
+                &seen_ipv6);
 
         /* connect to the local amp resolver/cache */
         if ( (resolver_fd = amp_resolver_connect(vars.nssock)) < 0 ) {
@@ -249,6 +227,7 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
         }
 
         /* add all the names that we need to resolve */
+        amp_resolve_batch_init(&batch);
         for ( resolve=item->resolve; resolve != NULL; resolve=resolve->next ) {
             /* remove any address families that we can't use */
             if ( seen_ipv4 == 0 && resolve->family != AF_INET6 ) {
@@ -265,14 +244,15 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
                 resolve->family = AF_INET;
             }
 
-            amp_resolve_add_new(resolver_fd, resolve);
+            amp_resolve_batch_add(&batch, resolve);
         }
 
-        /* send the flag to mark the end of the list */
-        amp_resolve_flag_done(resolver_fd);
+        /* send all the names in one go */
+        amp_resolve_batch_send(resolver_fd, &batch);
+        amp_resolve_batch_free(&batch);
 
         /* get the list of all the addresses the names resolved to (blocking) */
-        addrlist = amp_resolve_get_list(resolver_fd);
+        addrlist = amp_resolve_get_batch_list(resolver_fd);
 
         /* create the destination list from all the resolved addresses */
         for ( tmp = addrlist; tmp != NULL; tmp = tmp->ai_next ) {
@@ -365,12 +345,33 @@ void run_test(const test_schedule_item_t * const item, BIO *ctrl) {
 
 
 /*
- * Test function to investigate forking, rescheduling, setting maximum
- * execution timers etc.
- * TODO maybe just move the contents of this into run_scheduled_test()?
+ * Check if a scheduled test has fired too early to be run - the monotonic
+ * clock and the system time don't generally keep in sync very well (and the
+ * system time can get updated from other sources).
  */
-static int fork_test(test_schedule_item_t *item) {
+static int test_triggered_early(test_schedule_item_t *item) {
     struct timeval now;
+
+    gettimeofday(&now, NULL);
+    if ( timercmp(&now, &item->abstime, <) ) {
+        timersub(&item->abstime, &now, &now);
+        /* run too soon, don't run it now - let it get rescheduled */
+        if ( now.tv_sec != 0 || now.tv_usec > SCHEDULE_CLOCK_FUDGE ) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Start a test running, either using one of the test runners or by forking
+ * measured. Returns the pid of the test process if measured forked it, 0 if
+ * it was given to a test runner (identified by id), or -1 on error.
+ */
+pid_t fork_test(test_schedule_item_t *item, uint32_t id) {
     pid_t pid;
     test_t *test;
 
@@ -381,23 +382,13 @@ static int fork_test(test_schedule_item_t *item) {
     test = amp_tests[item->test_id];
 
     /*
-     * Make sure this isn't being run too soon - the monotonic clock and
-     * the system time don't generally keep in sync very well (and the system
-     * time can get updated from other sources). If we are too early, return
-     * without running the test (which will be rescheduled).
+     * Hand the test to one of the pre-forked test runners if possible, it
+     * is much cheaper than forking all of measured.
      */
-    gettimeofday(&now, NULL);
-    if ( timercmp(&now, &item->abstime, <) ) {
-        timersub(&item->abstime, &now, &now);
-        /* run too soon, don't run it now - let it get rescheduled */
-        if ( now.tv_sec != 0 || now.tv_usec > SCHEDULE_CLOCK_FUDGE ) {
-            Log(LOG_DEBUG, "%s test triggered early, will reschedule",
-                    test->name);
-            return 0;
-        }
+    if ( run_test_on_runner(item, id) ) {
+        return 0;
     }
 
-
     /*
      * man fork:
      * "Under Linux, fork() is implemented using copy-on-write pages..."
@@ -407,7 +398,7 @@ static int fork_test(test_schedule_item_t *item) {
      */
     if ( (pid = fork()) < 0 ) {
 	perror("fork");
-	return 0;
+	return -1;
     } else if ( pid == 0 ) {
         /*
          * close the unix domain sockets the parent had, if we keep them open
@@ -416,6 +407,7 @@ static int fork_test(test_schedule_item_t *item) {
          */
         close(vars.asnsock_fd);
         close(vars.nssock_fd);
+        close(vars.brokersock_fd);
 
         /* unblock signals and remove handlers that the parent process added */
         if ( unblock_signals() < 0 ) {
@@ -429,7 +421,7 @@ static int fork_test(test_schedule_item_t *item) {
 	exit(1);
     }
 
-    return 1;
+    return pid;
 }
 
 
@@ -454,17 +446,24 @@ void run_scheduled_test(wand_event_handler_t *ev_hdl, void *data) {
 
     /*
      * run the test as soon as we know what it is, so it happens as close to
-     * the right time as we can get it.
+     * the right time as we can get it. If too many tests are already running
+     * then it will be queued to run once there is space.
      */
-    run = fork_test(test_item);
+    if ( test_triggered_early(test_item) ) {
+        Log(LOG_DEBUG, "%s test triggered early, will reschedule", name);
+        run = 0;
+    } else {
+        admit_scheduled_test(test_item);
+        run = 1;
+    }
 
     /* while the test runs, reschedule it again */
     next = get_next_schedule_time(item->ev_hdl, test_item->period,
             test_item->start, test_item->end, US_FROM_TV(test_item->interval),
             run, &test_item->abstime);
 
-    if ( wand_add_timer(ev_hdl, next.tv_sec, next.tv_usec, data,
-                run_scheduled_test) == NULL ) {
+    if ( amp_add_timer(get_schedule_timers(ev_hdl), next.tv_sec,
+                next.tv_usec, data, run_scheduled_test) == NULL ) {
         /* this should never happen if we properly check the next time */
         Log(LOG_ALERT, "Failed to reschedule %s test", name);
     }
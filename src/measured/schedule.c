@@ -63,6 +63,217 @@
 #include "debug.h"
 #include "modules.h"
 #include "testlib.h"
+#include "timerheap.h"
+#include "admission.h"
+#include "schedule_cache.h"
+#include "hash.h"
+
+
+
+/* all scheduled tests and schedule fetches live in this timer heap */
+static amp_timer_heap_t *schedule_timers = NULL;
+
+/* scheduled tests that still have room for more destinations, by hash */
+static merge_index_entry_t *merge_index[MERGE_INDEX_SIZE];
+
+/* should tests be spread across their frequency window rather than aligned */
+static int schedule_spread = 0;
+
+/* tests scheduled before the current reload started, by fingerprint */
+static reload_index_entry_t *reload_index[RELOAD_INDEX_SIZE];
+
+/* timers added after this sequence number were created by the reload */
+static uint64_t reload_sequence = 0;
+
+
+
+/*
+ * Get the timer heap used to schedule tests, creating it if this is the
+ * first time it has been used.
+ */
+amp_timer_heap_t *get_schedule_timers(wand_event_handler_t *ev_hdl) {
+    if ( schedule_timers == NULL ) {
+        schedule_timers = amp_timer_heap_create(ev_hdl);
+    }
+
+    return schedule_timers;
+}
+
+
+
+/*
+ * Compare timers by expiry time so the schedule can be printed in order.
+ */
+static int compare_timer_expiry(const void *a, const void *b) {
+    amp_timer_t *x = *(amp_timer_t **)a;
+    amp_timer_t *y = *(amp_timer_t **)b;
+
+    if ( timercmp(&x->expire, &y->expire, !=) ) {
+        return timercmp(&x->expire, &y->expire, <) ? -1 : 1;
+    }
+
+    return (x->sequence < y->sequence) ? -1 : 1;
+}
+
+
+
+/*
+ * Hash all the parts of a test schedule item that compare_test_items() looks
+ * at, so that tests which could be merged will end up with the same hash.
+ * Uses 32 bit FNV-1a.
+ */
+static uint32_t hash_test_item(test_schedule_item_t *item) {
+    uint64_t fields[6];
+    uint32_t hash;
+    unsigned int i;
+
+    fields[0] = item->test_id;
+    fields[1] = item->period;
+    fields[2] = item->start;
+    fields[3] = item->end;
+    fields[4] = item->interval.tv_sec;
+    fields[5] = item->interval.tv_usec;
+
+    hash = fnv1a_32(FNV1A_32_INIT, fields, sizeof(fields));
+
+    if ( item->params != NULL ) {
+        for ( i = 0; item->params[i] != NULL; i++ ) {
+            /* include the terminator so "ab","c" differs from "a","bc" */
+            hash = fnv1a_32(hash, item->params[i],
+                    strlen(item->params[i]) + 1);
+        }
+    }
+
+    return hash;
+}
+
+
+
+/*
+ * Add a scheduled test to the merge index so that later tests with the same
+ * schedule and parameters can be merged into it.
+ */
+static void add_merge_index_entry(test_schedule_item_t *item) {
+    merge_index_entry_t *entry;
+
+    entry = (merge_index_entry_t *)malloc(sizeof(merge_index_entry_t));
+    entry->hash = hash_test_item(item);
+    entry->test = item;
+    entry->next = merge_index[entry->hash % MERGE_INDEX_SIZE];
+    merge_index[entry->hash % MERGE_INDEX_SIZE] = entry;
+}
+
+
+
+/*
+ * Remove every entry from the merge index. The tests themselves are owned
+ * by the schedule and aren't freed here.
+ */
+static void clear_merge_index(void) {
+    merge_index_entry_t *entry;
+    int i;
+
+    for ( i = 0; i < MERGE_INDEX_SIZE; i++ ) {
+        while ( merge_index[i] != NULL ) {
+            entry = merge_index[i];
+            merge_index[i] = entry->next;
+            free(entry);
+        }
+    }
+}
+
+
+
+/*
+ * Fingerprint everything about a scheduled test that affects how it runs:
+ * the schedule, parameters, and every destination. Addresses are hashed by
+ * value rather than by pointer, as they will all be freed and read again
+ * from the nametable during a reload.
+ */
+static uint64_t fingerprint_test_item(test_schedule_item_t *item) {
+    uint64_t hash = FNV1A_64_INIT;
+    resolve_dest_t *resolve;
+    uint32_t hash32;
+    uint32_t i;
+
+    /* the schedule and parameters are already hashed for merging */
+    hash32 = hash_test_item(item);
+    hash = fnv1a_64(hash, &hash32, sizeof(hash32));
+
+    for ( i = 0; i < item->dest_count; i++ ) {
+        hash = fnv1a_64(hash, &item->dests[i]->ai_family,
+                sizeof(item->dests[i]->ai_family));
+        hash = fnv1a_64(hash, item->dests[i]->ai_addr,
+                item->dests[i]->ai_addrlen);
+        if ( item->dests[i]->ai_canonname != NULL ) {
+            hash = fnv1a_64(hash, item->dests[i]->ai_canonname,
+                    strlen(item->dests[i]->ai_canonname) + 1);
+        }
+    }
+
+    for ( resolve = item->resolve; resolve != NULL; resolve = resolve->next ) {
+        hash = fnv1a_64(hash, resolve->name, strlen(resolve->name)+1);
+        hash = fnv1a_64(hash, &resolve->family,
+                sizeof(resolve->family));
+        hash = fnv1a_64(hash, &resolve->count, sizeof(resolve->count));
+    }
+
+    return hash;
+}
+
+
+
+/*
+ * Enable or disable spreading test start times across their window.
+ */
+void set_schedule_spread(int enabled) {
+    schedule_spread = enabled;
+}
+
+
+
+/*
+ * Calculate how far (in usec) to move the start time of a test so that tests
+ * with the same frequency don't all start at the same time. The offset is
+ * based on a hash of the test schedule and the name of this client, so it
+ * is the same every time the schedule is loaded. Tests that could be merged
+ * get the same offset, so they can still be merged. Tests that can't be
+ * merged (single target tests, or the full instances of a test split up
+ * by max_targets) also hash their destinations, so that they are spread
+ * out rather than all starting together.
+ */
+static uint64_t get_spread_offset(test_schedule_item_t *item, int mergeable) {
+    uint64_t window;
+    uint64_t fingerprint;
+    uint32_t hash;
+
+    /* spread over the time between repeats, or the whole allowed range */
+    window = item->end - item->start;
+    if ( US_FROM_TV(item->interval) > 0 &&
+            (uint64_t)US_FROM_TV(item->interval) < window ) {
+        window = US_FROM_TV(item->interval);
+    }
+
+    /* only spread in whole seconds, so tests stay on second boundaries */
+    window /= 1000000;
+    if ( window == 0 ) {
+        return 0;
+    }
+
+    if ( mergeable ) {
+        hash = hash_test_item(item);
+    } else {
+        fingerprint = fingerprint_test_item(item);
+        hash = (uint32_t)(fingerprint ^ (fingerprint >> 32));
+    }
+
+    if ( item->meta != NULL && item->meta->ampname != NULL ) {
+        hash = fnv1a_32(hash, item->meta->ampname,
+                strlen(item->meta->ampname));
+    }
+
+    return (hash % window) * 1000000;
+}
 
 
 
@@ -106,19 +317,28 @@ static void dump_event_fetch_schedule(fetch_schedule_item_t *item, FILE *out) {
  * Dump the current schedule for debug purposes
  */
 void dump_schedule(wand_event_handler_t *ev_hdl, FILE *out) {
-    struct wand_timer_t *timer;
+    amp_timer_heap_t *heap = get_schedule_timers(ev_hdl);
+    amp_timer_t **timers;
+    amp_timer_t *timer;
     schedule_item_t *item;
     struct timeval mono, wall, offset;
+    uint32_t i;
 
     assert(out);
 
+    /* the heap is only partially ordered, sort a copy to print it in order */
+    timers = malloc(sizeof(amp_timer_t *) * (heap->count + 1));
+    memcpy(timers, heap->timers, sizeof(amp_timer_t *) * heap->count);
+    qsort(timers, heap->count, sizeof(amp_timer_t *), compare_timer_expiry);
+
     mono = wand_get_monotonictime(ev_hdl);
     wall = wand_get_walltime(ev_hdl);
 
     fprintf(out, "===== SCHEDULE at %d.%d =====\n", (int)wall.tv_sec,
             (int)wall.tv_usec);
 
-    for ( timer=ev_hdl->timers; timer != NULL; timer=timer->next ) {
+    for ( i = 0; i < heap->count; i++ ) {
+        timer = timers[i];
         timersub(&timer->expire, &mono, &offset);
 	fprintf(out, "%d.%.6d ", (int)offset.tv_sec, (int)offset.tv_usec);
 	if ( timer->data == NULL ) {
@@ -139,6 +359,8 @@ void dump_schedule(wand_event_handler_t *ev_hdl, FILE *out) {
     }
     fprintf(out, "\n");
 
+    free(timers);
+
 }
 
 
@@ -210,43 +432,67 @@ static void free_fetch_schedule_item(fetch_schedule_item_t *item) {
  * fetches in the list.
  */
 void clear_test_schedule(wand_event_handler_t *ev_hdl, int all) {
-    struct wand_timer_t *timer = ev_hdl->timers;
-    struct wand_timer_t *tmp;
+    amp_timer_heap_t *heap = get_schedule_timers(ev_hdl);
+    amp_timer_t **remove;
+    uint32_t count = 0;
+    uint32_t i;
     schedule_item_t *item;
 
-    while ( timer != NULL ) {
-	tmp = timer;
-	timer = timer->next;
+    /*
+     * Deleting timers reorders the heap array, so find all the timers that
+     * need to be removed before removing any of them.
+     */
+    remove = malloc(sizeof(amp_timer_t *) * (heap->count + 1));
+    for ( i = 0; i < heap->count; i++ ) {
 	/* only remove future scheduled tests */
-	if ( tmp->data != NULL ) {
-	    item = (schedule_item_t *)tmp->data;
+	if ( heap->timers[i]->data != NULL ) {
+	    item = (schedule_item_t *)heap->timers[i]->data;
 
             /* We can clear just the test schedule, or all timer events */
             if ( !all && item->type != EVENT_RUN_TEST ) {
                 continue;
             }
 
-            wand_del_timer(ev_hdl, tmp);
+            remove[count++] = heap->timers[i];
+        }
+    }
 
-            switch ( item->type ) {
-                case EVENT_RUN_TEST:
-                    if ( item->data.test != NULL ) {
-                        free_test_schedule_item(item->data.test);
-                    }
-                    break;
-                case EVENT_FETCH_SCHEDULE:
-                    if ( item->data.fetch != NULL ) {
-                        free_fetch_schedule_item(item->data.fetch);
-                    }
-                    break;
-                default:
-                    Log(LOG_WARNING, "Freeing unknown schedule item type %d",
-                            item->type);
-                    break;
-            };
+    for ( i = 0; i < count; i++ ) {
+        item = (schedule_item_t *)remove[i]->data;
 
-            free(item);
-	}
+        amp_del_timer(heap, remove[i]);
+
+        switch ( item->type ) {
+            case EVENT_RUN_TEST:
+                if ( item->data.test != NULL ) {
+                    /* it shouldn't run later if it was waiting for a slot */
+                    cancel_deferred_test(item->data.test);
+                    free_test_schedule_item(item->data.test);
+                }
+                break;
+            case EVENT_FETCH_SCHEDULE:
+                if ( item->data.fetch != NULL ) {
+                    free_fetch_schedule_item(item->data.fetch);
+                }
+                break;
+            default:
+                Log(LOG_WARNING, "Freeing unknown schedule item type %d",
+                        item->type);
+                break;
+        };
+
+        free(item);
+    }
+
+    free(remove);
+
+    /* every test has been freed, so none of them can be merged with */
+    clear_merge_index();
+
+    /* nothing should be left, so get rid of the heap too */
+    if ( all ) {
+        amp_timer_heap_destroy(heap);
+        schedule_timers = NULL;
     }
 }
 
@@ -381,6 +627,33 @@ char **parse_param_string(char *param_string) {
 
 
 
+/*
+ * Duplicate a NULL terminated test parameter list, so that every scheduled
+ * test owns (and can free) its own parameters.
+ */
+static char **copy_param_list(char **params) {
+    char **result;
+    int i;
+
+    if ( params == NULL ) {
+        return NULL;
+    }
+
+    for ( i = 0; params[i] != NULL; i++ ) {
+        /* count the parameters */
+    }
+
+    result = (char**)malloc(sizeof(char*) * (i + 1));
+    for ( i = 0; params[i] != NULL; i++ ) {
+        result[i] = strdup(params[i]);
+    }
+    result[i] = NULL;
+
+    return result;
+}
+
+
+
 /*
  * Calculate the next time that a test is due to be run and return a timeval
  * with an offset appropriate for use with libwandevent scheduling. We have to
@@ -518,6 +791,24 @@ struct timeval get_next_schedule_time(wand_event_handler_t *ev_hdl,
 
 
 
+/*
+ * Add a pre-resolved address to the list of test destinations. The space
+ * available doubles whenever the count reaches a power of two, so the
+ * allocated size never needs to be stored.
+ */
+static void add_test_dest(test_schedule_item_t *item, struct addrinfo *addr) {
+    if ( item->dest_count == 0 ||
+            (item->dest_count & (item->dest_count - 1)) == 0 ) {
+        item->dests = (struct addrinfo **)realloc(item->dests,
+                sizeof(struct addrinfo*) *
+                (item->dest_count == 0 ? 1 : item->dest_count * 2));
+    }
+
+    item->dests[item->dest_count++] = addr;
+}
+
+
+
 /*
  * Compare two test schedule items to see if they are similar enough to
  * merge together to make one scheduled test with multiple destinations.
@@ -568,71 +859,49 @@ static int compare_test_items(test_schedule_item_t *a, test_schedule_item_t *b){
  * destinations. If the tests can be merged that helps to limit the number of
  * active timers and tests that need to be run.
  */
-static int merge_scheduled_tests(struct wand_event_handler_t *ev_hdl,
-	test_schedule_item_t *item) {
-
-    struct wand_timer_t *timer;
-    schedule_item_t *sched_item;
+static int merge_scheduled_tests(test_schedule_item_t *item) {
+    merge_index_entry_t *entry, **prev;
     test_schedule_item_t *sched_test;
-    struct timeval when, expire;
-
-    /* find the time that the timer for this test should expire */
-    when = get_next_schedule_time(ev_hdl, item->period, item->start, item->end,
-	    US_FROM_TV(item->interval), 0, NULL);
-    expire = wand_calc_expire(ev_hdl, when.tv_sec, when.tv_usec);
+    uint32_t hash;
+    uint16_t max_targets;
 
-    /* search all existing scheduled test timers for a test that matches */
-    for ( timer=ev_hdl->timers; timer != NULL; timer=timer->next ) {
+    hash = hash_test_item(item);
+    max_targets = amp_tests[item->test_id]->max_targets;
 
-	/* give up if we get past the time the test should occur */
-	if ( timercmp(&(timer->expire), &expire, >) ) {
-	    return 0;
-	}
+    /* only tests that still have room for more destinations are indexed */
+    for ( prev = &merge_index[hash % MERGE_INDEX_SIZE]; *prev != NULL;
+            prev = &(*prev)->next ) {
+        entry = *prev;
 
-	/* all our timers should have data, but maybe not... */
-	if ( timer->data == NULL ) {
-	    continue;
-	}
+	/* check if these tests are the same */
+        if ( entry->hash != hash ||
+                !compare_test_items(entry->test, item) ) {
+            continue;
+        }
 
-	sched_item = (schedule_item_t *)timer->data;
+        sched_test = entry->test;
+        assert(max_targets == 0 ||
+                (sched_test->dest_count + sched_test->resolve_count) <
+                max_targets);
 
-	/* ignore non-test timers, we can't match them */
-	if ( sched_item->type != EVENT_RUN_TEST ) {
-	    continue;
-	}
+        if ( item->dest_count > 0 ) {
+            /* add a new pre-resolved address */
+            add_test_dest(sched_test, item->dests[0]);
+        } else {
+            /* add a new address we will need to resolve later */
+            item->resolve->next = sched_test->resolve;
+            sched_test->resolve = item->resolve;
+            sched_test->resolve_count++;
+        }
 
-	assert(sched_item->data.test);
-	sched_test = sched_item->data.test;
+        /* stop offering this test for merging once it is full */
+        if ( max_targets > 0 && (sched_test->dest_count +
+                    sched_test->resolve_count) >= max_targets ) {
+            *prev = entry->next;
+            free(entry);
+        }
 
-	/* check if these tests are the same */
-	if ( compare_test_items(sched_test, item) ) {
-
-	    /* check if there is room for more destinations */
-	    if ( amp_tests[item->test_id]->max_targets == 0 ||
-		    (sched_test->dest_count + sched_test->resolve_count) <
-		    amp_tests[item->test_id]->max_targets ) {
-
-		/*
-	 	 * resize the dests pointers to make room for the new dest
-		 * TODO be smarter about resizing
-		 */
-		if ( item->dest_count > 0 ) {
-		    /* add a new pre-resolved address */
-		    sched_test->dests = realloc(sched_test->dests,
-			    (sched_test->dest_count+1) *
-			    sizeof(struct addrinfo *));
-		    sched_test->dests[sched_test->dest_count++] =
-			item->dests[0];
-		} else {
-		    /* add a new address we will need to resolve later */
-		    item->resolve->next = sched_test->resolve;
-		    sched_test->resolve = item->resolve;
-		    sched_test->resolve_count++;
-		}
-
-		return 1;
-	    }
-	}
+        return 1;
     }
 
     return 0;
@@ -640,6 +909,166 @@ static int merge_scheduled_tests(struct wand_event_handler_t *ev_hdl,
 
 
 
+/*
+ * Point the merge index at a different copy of a test, used when a reloaded
+ * test is replaced by the identical one that was already scheduled.
+ */
+static void replace_merge_index_entry(test_schedule_item_t *old,
+        test_schedule_item_t *new) {
+    merge_index_entry_t *entry;
+
+    for ( entry = merge_index[hash_test_item(old) % MERGE_INDEX_SIZE];
+            entry != NULL; entry = entry->next ) {
+        if ( entry->test == old ) {
+            entry->test = new;
+        }
+    }
+}
+
+
+
+/*
+ * Prepare to reload the test schedule. Every currently scheduled test is
+ * fingerprinted and left in place, so that once the new schedule is loaded
+ * finish_schedule_reload() can keep the timers for tests that are unchanged.
+ * This needs to be called before the nametable is cleared, as the test
+ * destinations point into it.
+ */
+void begin_schedule_reload(wand_event_handler_t *ev_hdl) {
+    amp_timer_heap_t *heap = get_schedule_timers(ev_hdl);
+    reload_index_entry_t *entry;
+    schedule_item_t *item;
+    uint32_t i;
+
+    for ( i = 0; i < heap->count; i++ ) {
+        item = (schedule_item_t *)heap->timers[i]->data;
+
+        if ( item == NULL || item->type != EVENT_RUN_TEST ) {
+            continue;
+        }
+
+        entry = (reload_index_entry_t *)malloc(sizeof(reload_index_entry_t));
+        entry->fingerprint = fingerprint_test_item(item->data.test);
+        entry->timer = heap->timers[i];
+        entry->next = reload_index[entry->fingerprint % RELOAD_INDEX_SIZE];
+        reload_index[entry->fingerprint % RELOAD_INDEX_SIZE] = entry;
+    }
+
+    /* any timers with a later sequence number are from the new schedule */
+    reload_sequence = heap->sequence;
+
+    /* new tests should only be merged with other new tests */
+    clear_merge_index();
+}
+
+
+
+/*
+ * Compare the newly loaded test schedule with the one that was scheduled
+ * when begin_schedule_reload() was called. Tests that are unchanged keep
+ * their existing timer (and so don't lose their place in the schedule or
+ * any pending run), tests that are no longer present are removed, and
+ * anything new stays scheduled as it was loaded.
+ */
+void finish_schedule_reload(wand_event_handler_t *ev_hdl) {
+    amp_timer_heap_t *heap = get_schedule_timers(ev_hdl);
+    reload_index_entry_t *entry, **prev;
+    schedule_item_t *item, *old_item;
+    test_schedule_item_t *test, *old;
+    amp_timer_t **loaded;
+    struct addrinfo **dests;
+    resolve_dest_t *resolve;
+    uint64_t fingerprint;
+    uint32_t count = 0;
+    uint32_t kept = 0, added = 0, removed = 0;
+    uint32_t i, tmp;
+
+    /* deleting timers reorders the heap, so find the new tests first */
+    loaded = malloc(sizeof(amp_timer_t *) * (heap->count + 1));
+    for ( i = 0; i < heap->count; i++ ) {
+        item = (schedule_item_t *)heap->timers[i]->data;
+        if ( item != NULL && item->type == EVENT_RUN_TEST &&
+                heap->timers[i]->sequence >= reload_sequence ) {
+            loaded[count++] = heap->timers[i];
+        }
+    }
+
+    for ( i = 0; i < count; i++ ) {
+        item = (schedule_item_t *)loaded[i]->data;
+        test = item->data.test;
+        fingerprint = fingerprint_test_item(test);
+
+        /* look for an identical test that was already scheduled */
+        for ( prev = &reload_index[fingerprint % RELOAD_INDEX_SIZE];
+                *prev != NULL; prev = &(*prev)->next ) {
+            old_item = (schedule_item_t *)(*prev)->timer->data;
+            if ( (*prev)->fingerprint == fingerprint &&
+                    compare_test_items(old_item->data.test, test) ) {
+                break;
+            }
+        }
+
+        if ( *prev == NULL ) {
+            added++;
+            continue;
+        }
+
+        entry = *prev;
+        *prev = entry->next;
+        old = old_item->data.test;
+
+        /*
+         * Keep the old test, which might also be waiting for a slot to run,
+         * but give it the freshly loaded destinations as the old ones have
+         * been freed along with the old nametable.
+         */
+        dests = old->dests;
+        old->dests = test->dests;
+        test->dests = dests;
+        tmp = old->dest_count;
+        old->dest_count = test->dest_count;
+        test->dest_count = tmp;
+        resolve = old->resolve;
+        old->resolve = test->resolve;
+        test->resolve = resolve;
+        tmp = old->resolve_count;
+        old->resolve_count = test->resolve_count;
+        test->resolve_count = tmp;
+
+        replace_merge_index_entry(test, old);
+
+        amp_del_timer(heap, loaded[i]);
+        free_test_schedule_item(test);
+        free(item);
+        free(entry);
+        kept++;
+    }
+
+    free(loaded);
+
+    /* anything left over is no longer in the schedule */
+    for ( i = 0; i < RELOAD_INDEX_SIZE; i++ ) {
+        while ( reload_index[i] != NULL ) {
+            entry = reload_index[i];
+            reload_index[i] = entry->next;
+
+            item = (schedule_item_t *)entry->timer->data;
+            amp_del_timer(heap, entry->timer);
+            /* it shouldn't run later if it was waiting for a slot */
+            cancel_deferred_test(item->data.test);
+            free_test_schedule_item(item->data.test);
+            free(item);
+            free(entry);
+            removed++;
+        }
+    }
+
+    Log(LOG_INFO, "Reloaded test schedule: %u kept, %u added, %u removed",
+            kept, added, removed);
+}
+
+
+
 /*
  * Get all of the target names from the "target" node in the test
  * configuration. They could be a single scalar, a sequence of scalars, or
@@ -739,10 +1168,7 @@ char **populate_target_lists(test_schedule_item_t *test, char **targets) {
                 }
 
                 if ( family == AF_UNSPEC || family == addr->ai_family ) {
-                    test->dests = (struct addrinfo **)realloc(test->dests,
-                            sizeof(struct addrinfo*) * (test->dest_count + 1));
-                    test->dests[test->dest_count] = addr;
-                    test->dest_count++;
+                    add_test_dest(test, addr);
                 }
             }
 
@@ -773,30 +1199,25 @@ char **populate_target_lists(test_schedule_item_t *test, char **targets) {
 
 
 /*
- * Create a new test schedule item and fill in the test configuration.
- * All the times are given by the user in seconds, but we'll use milliseconds
- * because it makes scheduling easier.
+ * Read the configuration for a single test from a schedule file. None of the
+ * strings are copied, they still belong to the yaml document. Returns 0 if
+ * the entry was read, or -1 if it isn't a test description.
  */
-static test_schedule_item_t *create_and_schedule_test(
-        wand_event_handler_t *ev_hdl, yaml_document_t *document,
-        yaml_node_item_t index, amp_test_meta_t *meta) {
+static int parse_schedule_entry(yaml_document_t *document,
+        yaml_node_item_t index, schedule_entry_t *entry) {
 
-    test_schedule_item_t *test = NULL;
-    schedule_item_t *sched;
     yaml_node_t *node, *key, *value;
     yaml_node_pair_t *pair;
-    test_type_t test_id;
-    int64_t start = 0, end = -1, frequency = -1;
-    char *period_str = NULL, *testname = NULL, **params = NULL;
-    schedule_period_t period;
-    char **targets = NULL, **remaining = NULL;
     int target_len;
-    struct timeval next;
+
+    memset(entry, 0, sizeof(schedule_entry_t));
+    entry->end = -1;
+    entry->frequency = -1;
 
     /* make sure the node exists and is of the right type */
     if ( (node = yaml_document_get_node(document, index)) == NULL ||
             node->type != YAML_MAPPING_NODE ) {
-        return NULL;
+        return -1;
     }
 
     for ( pair = node->data.mapping.pairs.start;
@@ -808,47 +1229,76 @@ static test_schedule_item_t *create_and_schedule_test(
 
         /* key has to be a scalar node, if it's not then this isn't for us */
         if ( key->type != YAML_SCALAR_NODE ) {
-            goto end;
+            free(entry->targets);
+            entry->targets = NULL;
+            return -1;
         }
 
         /* read the appropriate value based on the key, could be in any order */
         if ( strcmp((char*)key->data.scalar.value, "test") == 0 ) {
             assert(value->type == YAML_SCALAR_NODE);
-            testname = (char*)value->data.scalar.value;
+            entry->test = (char*)value->data.scalar.value;
         } else if ( strcmp((char*)key->data.scalar.value, "frequency") == 0 ) {
             assert(value->type == YAML_SCALAR_NODE);
-            frequency = atoi((char*)value->data.scalar.value);
-            frequency *= 1000000;
+            entry->frequency = atoi((char*)value->data.scalar.value);
+            entry->frequency *= 1000000;
         } else if ( strcmp((char*)key->data.scalar.value, "start") == 0 ) {
             assert(value->type == YAML_SCALAR_NODE);
-            start = atoi((char*)value->data.scalar.value);
-            start *= 1000000;
+            entry->start = atoi((char*)value->data.scalar.value);
+            entry->start *= 1000000;
         } else if ( strcmp((char*)key->data.scalar.value, "end") == 0 ) {
             assert(value->type == YAML_SCALAR_NODE);
-            end = atoi((char*)value->data.scalar.value);
-            end *= 1000000;
+            entry->end = atoi((char*)value->data.scalar.value);
+            entry->end *= 1000000;
         } else if ( strcmp((char*)key->data.scalar.value, "period") == 0 ) {
             assert(value->type == YAML_SCALAR_NODE);
-            period_str = (char*)value->data.scalar.value;
+            entry->period = (char*)value->data.scalar.value;
         } else if ( strcmp((char*)key->data.scalar.value, "args") == 0 ) {
             assert(value->type == YAML_SCALAR_NODE);
-            params = parse_param_string((char*)value->data.scalar.value);
+            entry->args = (char*)value->data.scalar.value;
         } else if ( strcmp((char*)key->data.scalar.value, "target") == 0 ) {
             /* it's possible "target" could be defined multiple times */
-            if ( targets == NULL ) {
-                targets = (char**)malloc(sizeof(char*));
-                targets[0] = NULL;
+            if ( entry->targets == NULL ) {
+                entry->targets = (char**)malloc(sizeof(char*));
+                entry->targets[0] = NULL;
                 target_len = 1;
             }
-            targets = parse_test_targets(document, value, targets, &target_len);
+            entry->targets = parse_test_targets(document, value,
+                    entry->targets, &target_len);
         }
     }
 
+    return 0;
+}
+
+
+
+/*
+ * Create a new test schedule item and fill in the test configuration.
+ * All the times are given by the user in seconds, but we'll use milliseconds
+ * because it makes scheduling easier.
+ */
+static test_schedule_item_t *create_and_schedule_test(
+        wand_event_handler_t *ev_hdl, schedule_entry_t *entry,
+        amp_test_meta_t *meta) {
+
+    test_schedule_item_t *test = NULL;
+    schedule_item_t *sched;
+    test_type_t test_id;
+    int64_t start = entry->start, end = entry->end;
+    int64_t frequency = entry->frequency;
+    char *period_str = entry->period, *testname = entry->test;
+    char **params = NULL;
+    schedule_period_t period;
+    char **remaining = NULL;
+    int mergeable;
+    struct timeval next;
+
     /* confirm the test name is valid */
     if ( testname == NULL ||
             (test_id = get_test_id(testname)) == AMP_TEST_INVALID ) {
         Log(LOG_WARNING, "Unknown test '%s'", testname);
-        goto end;
+        return NULL;
     }
 
     /* need to figure out the period before we can do much else */
@@ -857,14 +1307,14 @@ static test_schedule_item_t *create_and_schedule_test(
     } else if ( (period =
                 get_period_label(period_str)) == SCHEDULE_PERIOD_INVALID ) {
         Log(LOG_WARNING, "Invalid period: '%s'", period_str);
-        goto end;
+        return NULL;
     }
 
     /* now that the period is determined, we can validate the other values */
     if ( check_time_range(start, period) < 0 ) {
         Log(LOG_WARNING, "Invalid start value %" PRId64 " for period %s\n",
                 start, period_str);
-        goto end;
+        return NULL;
     }
 
     /* default to the end of the period if not set */
@@ -873,7 +1323,7 @@ static test_schedule_item_t *create_and_schedule_test(
     } else if ( check_time_range(end, period) < 0 ) {
         Log(LOG_WARNING, "Invalid end value %" PRId64 " for period %s\n",
                 end, period_str);
-        goto end;
+        return NULL;
     }
 
     /* default to a vaguely sensible frequency if not set */
@@ -882,13 +1332,14 @@ static test_schedule_item_t *create_and_schedule_test(
     } else if ( check_time_range(frequency, period) < 0 ) {
         Log(LOG_WARNING, "Invalid frequency value %d for period %s\n",
                 frequency, period_str);
-        goto end;
+        return NULL;
     }
 
     Log(LOG_DEBUG, "start:%" PRId64 " end:%" PRId64 " freq:%" PRId64
             " period:%" PRId64, start, end, frequency, period);
 
-    remaining = targets;
+    params = parse_param_string(entry->args);
+    remaining = entry->targets;
 
     do {
         Log(LOG_DEBUG, "Creating test schedule instance for %s test", testname);
@@ -900,8 +1351,11 @@ static test_schedule_item_t *create_and_schedule_test(
         test->start = start;
         test->end = end;
         test->test_id = test_id;
-        test->params = params;
+        /* tests split across multiple instances each need their own params */
+        test->params = (remaining == entry->targets) ? params :
+            copy_param_list(params);
         test->meta = meta;
+
         /*
          * Convert the list of targets into actual dests and ones to resolve.
          * We update the list to only point at the remainder (if there are
@@ -919,14 +1373,22 @@ static test_schedule_item_t *create_and_schedule_test(
         }
 
         /*
-         * See if we can merge this test with an existing one. Obviously if
-         * there are still outstanding targets then the test is maxed out and
-         * there is no room for more destinations.
+         * Only tests with room for more destinations can be merged with
+         * others. Obviously if there are still outstanding targets then the
+         * test is maxed out and there is no room for more destinations.
          */
-        if ( remaining != NULL && *remaining == NULL &&
-                amp_tests[test->test_id]->max_targets != 1 ) {
+        mergeable = remaining != NULL && *remaining == NULL &&
+            amp_tests[test->test_id]->max_targets != 1;
+
+        /* move the start time somewhere within the window if spreading */
+        if ( schedule_spread ) {
+            test->start += get_spread_offset(test, mergeable);
+        }
+
+        /* see if we can merge this test with an existing one */
+        if ( mergeable ) {
             /* check if this test at this time already exists */
-            if ( merge_scheduled_tests(ev_hdl, test) ) {
+            if ( merge_scheduled_tests(test) ) {
                 /* remove pointer to names, merged test owns it */
                 test->resolve = NULL;
                 /* free this test, it has now merged */
@@ -944,30 +1406,80 @@ static test_schedule_item_t *create_and_schedule_test(
         next = get_next_schedule_time(ev_hdl, test->period, test->start,
                 test->end, US_FROM_TV(test->interval), 0, &test->abstime);
 
-        if ( wand_add_timer(ev_hdl, next.tv_sec, next.tv_usec, sched,
-                run_scheduled_test) == NULL ) {
+        if ( amp_add_timer(get_schedule_timers(ev_hdl), next.tv_sec,
+                    next.tv_usec, sched, run_scheduled_test) == NULL ) {
             Log(LOG_ALERT, "Failed to schedule %s test", testname);
         }
 
+        /* let later tests merge with this one if it has space for them */
+        if ( amp_tests[test->test_id]->max_targets == 0 ||
+                (test->dest_count + test->resolve_count) <
+                amp_tests[test->test_id]->max_targets ) {
+            add_merge_index_entry(test);
+        }
+
     } while ( remaining != NULL && *remaining != NULL );
 
-end:
-    if ( targets ) {
-        free(targets);
+    return test;
+}
+
+
+
+/*
+ * Read the entire contents of a schedule file into memory, so that it can be
+ * hashed and compared with the cached schedule before it is parsed.
+ */
+static char *read_schedule_contents(char *filename, struct stat *statbuf) {
+    char *contents;
+    FILE *in;
+
+    if ( (in = fopen(filename, "r")) == NULL ) {
+	Log(LOG_WARNING, "Failed to open schedule file %s: %s\n",
+                filename, strerror(errno));
+        return NULL;
     }
 
-    return test;
+    if ( fstat(fileno(in), statbuf) < 0 ) {
+        Log(LOG_WARNING, "Failed to stat schedule file %s: %s\n",
+                filename, strerror(errno));
+        fclose(in);
+        return NULL;
+    }
+
+    contents = malloc(statbuf->st_size + 1);
+
+    if ( fread(contents, 1, statbuf->st_size, in) !=
+            (size_t)statbuf->st_size ) {
+        Log(LOG_WARNING, "Failed to read schedule file %s", filename);
+        free(contents);
+        fclose(in);
+        return NULL;
+    }
+
+    contents[statbuf->st_size] = '\0';
+    fclose(in);
+
+    return contents;
 }
 
 
 
 /*
- * Read in the schedule file and create events for each test.
+ * Read in the schedule file and create events for each test. If there is an
+ * up to date compiled copy of the schedule then that is used instead of
+ * parsing the yaml, otherwise the yaml is parsed and the compiled copy is
+ * updated for next time.
  */
 static void read_schedule_file(wand_event_handler_t *ev_hdl, char *filename,
         amp_test_meta_t *meta) {
 
-    FILE *in;
+    char *contents;
+    struct stat statbuf;
+    uint64_t hash;
+    schedule_cache_t *cache;
+    schedule_entry_t *entries = NULL;
+    uint32_t count = 0;
+    uint32_t i;
     yaml_parser_t parser;
     yaml_document_t document;
     yaml_node_t *root;
@@ -978,14 +1490,27 @@ static void read_schedule_file(wand_event_handler_t *ev_hdl, char *filename,
 
     Log(LOG_INFO, "Loading schedule from %s", filename);
 
-    if ( (in = fopen(filename, "r")) == NULL ) {
-	Log(LOG_WARNING, "Failed to open schedule file %s: %s\n",
-                filename, strerror(errno));
+    if ( (contents = read_schedule_contents(filename, &statbuf)) == NULL ) {
+        return;
+    }
+
+    hash = hash_schedule_contents(contents, statbuf.st_size);
+
+    /* use the compiled schedule if it was built from this exact file */
+    if ( (cache = load_schedule_cache(filename, &statbuf, hash)) != NULL ) {
+        Log(LOG_DEBUG, "Using compiled schedule for %s (%u tests)", filename,
+                cache->count);
+        for ( i = 0; i < cache->count; i++ ) {
+            create_and_schedule_test(ev_hdl, &cache->entries[i], meta);
+        }
+        free_schedule_cache(cache);
+        free(contents);
         return;
     }
 
     yaml_parser_initialize(&parser);
-    yaml_parser_set_input_file(&parser, in);
+    yaml_parser_set_input_string(&parser, (unsigned char*)contents,
+            statbuf.st_size);
 
     /* make sure that the schedule file is valid yaml */
     if ( !yaml_parser_load(&parser, &document) ) {
@@ -1018,21 +1543,40 @@ static void read_schedule_file(wand_event_handler_t *ev_hdl, char *filename,
         if ( key->type == YAML_SCALAR_NODE &&
                 value->type == YAML_SEQUENCE_NODE &&
                 strcmp((char*)key->data.scalar.value, "tests") == 0 ) {
-            /* for each item in the tests array, create the test */
+            /* for each item in the tests array, read the test */
             yaml_node_item_t *item;
+            entries = realloc(entries, sizeof(schedule_entry_t) *
+                    (count + (value->data.sequence.items.top -
+                              value->data.sequence.items.start)));
             for ( item = value->data.sequence.items.start;
                     item != value->data.sequence.items.top; item++ ) {
-                create_and_schedule_test(ev_hdl, &document, *item, meta);
+                if ( parse_schedule_entry(&document, *item,
+                            &entries[count]) == 0 ) {
+                    count++;
+                }
             }
         }
      }
 
+     /*
+      * Save the compiled schedule before creating the tests, as setting up
+      * the targets modifies the strings in place.
+      */
+     save_schedule_cache(filename, &statbuf, hash, entries, count);
+
+     for ( i = 0; i < count; i++ ) {
+         create_and_schedule_test(ev_hdl, &entries[i], meta);
+         free(entries[i].targets);
+     }
+
+     free(entries);
+
 parser_format_error:
      yaml_document_delete(&document);
-     yaml_parser_delete(&parser);
 
 parser_load_error:
-     fclose(in);
+     yaml_parser_delete(&parser);
+     free(contents);
 }
 
 
@@ -1069,6 +1613,9 @@ void read_schedule_dir(wand_event_handler_t *ev_hdl, char *directory,
 	read_schedule_file(ev_hdl, glob_buf.gl_pathv[i], meta);
     }
 
+    /* don't keep compiled copies of schedule files that have gone away */
+    prune_schedule_cache(directory, glob_buf.gl_pathv, glob_buf.gl_pathc);
+
     globfree(&glob_buf);
     return;
 }
@@ -1335,8 +1882,8 @@ static void timer_fetch_callback(wand_event_handler_t *ev_hdl, void *data) {
     fork_and_fetch(fetch, 0);
 
     /* reschedule checking for schedule updates */
-    if ( wand_add_timer(ev_hdl, fetch->frequency, 0, data,
-                timer_fetch_callback) == NULL ) {
+    if ( amp_add_timer(get_schedule_timers(ev_hdl), fetch->frequency, 0,
+                data, timer_fetch_callback) == NULL ) {
         Log(LOG_ALERT, "Failed to reschedule remote update check");
     }
 }
@@ -1373,8 +1920,8 @@ int enable_remote_schedule_fetch(wand_event_handler_t *ev_hdl,
     item->data.fetch = fetch;
 
     /* create the timer event for fetching schedules */
-    if ( wand_add_timer(ev_hdl, fetch->frequency, 0, item,
-                timer_fetch_callback) == NULL ) {
+    if ( amp_add_timer(get_schedule_timers(ev_hdl), fetch->frequency, 0,
+                item, timer_fetch_callback) == NULL ) {
         Log(LOG_ALERT, "Failed to schedule remote update check");
         return -1;
     }
@@ -1394,4 +1941,8 @@ int64_t amp_test_check_time_range(int64_t value, schedule_period_t period) {
 time_t amp_test_get_period_start(char repeat, time_t *now) {
     return get_period_start(repeat, now);
 }
+uint64_t amp_test_get_spread_offset(test_schedule_item_t *item,
+        int mergeable) {
+    return get_spread_offset(item, mergeable);
+}
 #endif
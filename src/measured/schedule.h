@@ -44,6 +44,7 @@
 #include <libwandevent.h>
 #include "tests.h"
 #include "ampresolv.h"
+#include "timerheap.h"
 
 /* debug schedule output file location */
 #define DEBUG_SCHEDULE_DUMP_FILE "/tmp/amplet2.schedule.dump"
@@ -60,6 +61,10 @@
 #define SCHEDULE_FETCH_FREQUENCY 3600
 #define SCHEDULE_FETCH_TIMEOUT 30
 #define MAX_TEST_ARGS 128
+/* number of buckets in the index used to find tests to merge with */
+#define MERGE_INDEX_SIZE 1024
+/* number of buckets in the index of tests kept while reloading schedules */
+#define RELOAD_INDEX_SIZE 1024
 
 /* tests can start at most 100ms (in usec) early, otherwise reschedule them */
 #define SCHEDULE_CLOCK_FUDGE ( 100 * 1000 )
@@ -103,6 +108,21 @@ typedef struct amp_test_meta {
 } amp_test_meta_t;
 
 
+/*
+ * A single test as described in a schedule file, before it is validated and
+ * turned into scheduled tests. Times are in usec, and are -1 if not set.
+ */
+typedef struct schedule_entry {
+    char *test;                     /* name of the test to run */
+    char *period;                   /* repeat cycle name, NULL for default */
+    char *args;                     /* test parameter string, may be NULL */
+    int64_t start;                  /* first time in period test can run */
+    int64_t end;                    /* last time in period test can run */
+    int64_t frequency;              /* time between test runs */
+    char **targets;                 /* NULL terminated list of targets */
+} schedule_entry_t;
+
+
 /*
  * Data block for scheduled test events.
  */
@@ -125,6 +145,29 @@ typedef struct test_schedule_item {
 
 
 
+/*
+ * Entry in the hash index of scheduled tests that can be merged with.
+ */
+typedef struct merge_index_entry {
+    uint32_t hash;                  /* hash of schedule timing and params */
+    test_schedule_item_t *test;     /* scheduled test with room for dests */
+    struct merge_index_entry *next;
+} merge_index_entry_t;
+
+
+
+/*
+ * Entry in the hash index of tests that were scheduled before a reload,
+ * which are kept if the new schedule contains an identical test.
+ */
+typedef struct reload_index_entry {
+    uint64_t fingerprint;           /* hash of schedule, params and targets */
+    amp_timer_t *timer;             /* timer for the previously loaded test */
+    struct reload_index_entry *next;
+} reload_index_entry_t;
+
+
+
 /*
  * Data block for fetching remote schedule files.
  */
@@ -160,8 +203,12 @@ typedef struct schedule_item {
 
 char **parse_param_string(char *param_string);
 char **populate_target_lists(test_schedule_item_t *test, char **targets);
+amp_timer_heap_t *get_schedule_timers(wand_event_handler_t *ev_hdl);
+void set_schedule_spread(int enabled);
 void dump_schedule(wand_event_handler_t *ev_hdl, FILE *out);
 void clear_test_schedule(wand_event_handler_t *ev_hdl, int all);
+void begin_schedule_reload(wand_event_handler_t *ev_hdl);
+void finish_schedule_reload(wand_event_handler_t *ev_hdl);
 void read_schedule_dir(wand_event_handler_t *ev_hdl, char *directory,
         amp_test_meta_t *meta);
 struct timeval get_next_schedule_time(wand_event_handler_t *ev_hdl,
@@ -174,6 +221,8 @@ int enable_remote_schedule_fetch(wand_event_handler_t *ev_hdl,
 time_t amp_test_get_period_max_value(char repeat);
 int64_t amp_test_check_time_range(int64_t value, schedule_period_t period);
 time_t amp_test_get_period_start(char repeat, time_t *now);
+uint64_t amp_test_get_spread_offset(test_schedule_item_t *item,
+        int mergeable);
 #endif
 
 #endif
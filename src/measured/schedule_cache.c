@@ -0,0 +1,556 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compiled copies of schedule files. Parsing large yaml schedules is slow,
+ * so after a schedule file has been parsed the tests in it are written out
+ * in a simple binary format that can be mapped straight back into memory.
+ * The compiled copy is only used while the modification time, size and
+ * contents hash all match the schedule file it was built from.
+ *
+ * Compiled schedules are kept in a cache directory rather than alongside the
+ * schedule files, which may be read only or managed by something else. Each
+ * is named after the schedule file and a hash of the directory it is in, so
+ * that several schedule directories can share the cache directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "hash.h"
+#include "schedule_cache.h"
+
+/* initial size of the string table buffer when saving a compiled schedule */
+#define SCHEDULE_CACHE_STRINGS_SIZE 4096
+
+/* directory that compiled schedules are kept in, NULL if not being kept */
+static char *cache_dir = NULL;
+
+
+
+/*
+ * Set the directory that compiled schedules are kept in, creating it if it
+ * doesn't exist. Setting it to NULL stops schedules from being compiled.
+ */
+void set_schedule_cache_dir(char *directory) {
+    free(cache_dir);
+    cache_dir = NULL;
+
+    if ( directory == NULL ) {
+        return;
+    }
+
+    if ( mkdir(directory, 0755) < 0 && errno != EEXIST ) {
+        Log(LOG_WARNING, "Failed to create schedule cache directory %s: %s",
+                directory, strerror(errno));
+    }
+
+    cache_dir = strdup(directory);
+}
+
+
+
+/*
+ * Get the prefix used by all the compiled schedules built from files in the
+ * given schedule directory.
+ */
+static int get_schedule_cache_prefix(char *directory, char *prefix,
+        size_t length) {
+    int result;
+
+    result = snprintf(prefix, length, "%016" PRIx64 "-",
+            hash_schedule_contents(directory, strlen(directory)));
+
+    if ( result < 0 || (size_t)result >= length ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Get the name of the compiled schedule for a schedule file, without the
+ * path to the cache directory.
+ */
+static int get_schedule_cache_basename(char *filename, char *cachename,
+        size_t length) {
+    char prefix[SCHEDULE_CACHE_PREFIX_LENGTH];
+    char *dircopy, *basecopy;
+    int result;
+
+    dircopy = strdup(filename);
+    basecopy = strdup(filename);
+
+    if ( get_schedule_cache_prefix(dirname(dircopy), prefix,
+                sizeof(prefix)) < 0 ) {
+        result = -1;
+    } else {
+        result = snprintf(cachename, length, "%s%s.cache", prefix,
+                basename(basecopy));
+    }
+
+    free(dircopy);
+    free(basecopy);
+
+    if ( result < 0 || (size_t)result >= length ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Get the full path of the compiled schedule for a schedule file. Fails if
+ * there is no cache directory to keep it in.
+ */
+static int get_schedule_cache_name(char *filename, char *cachename,
+        size_t length) {
+    char name[MAX_PATH_LENGTH];
+    int result;
+
+    if ( cache_dir == NULL ||
+            get_schedule_cache_basename(filename, name, sizeof(name)) < 0 ) {
+        return -1;
+    }
+
+    result = snprintf(cachename, length, "%s/%s", cache_dir, name);
+
+    if ( result < 0 || (size_t)result >= length ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Hash the contents of a schedule file, using 64 bit FNV-1a.
+ */
+uint64_t hash_schedule_contents(const void *data, size_t length) {
+    return fnv1a_64(FNV1A_64_INIT, data, length);
+}
+
+
+
+/*
+ * Check that a string offset points inside the string table. The table is
+ * known to end with a nul, so every valid offset is a terminated string.
+ */
+static int check_string_offset(uint32_t offset, uint64_t length, int optional) {
+    if ( offset == SCHEDULE_CACHE_NO_STRING ) {
+        return optional ? 0 : -1;
+    }
+
+    return offset < length ? 0 : -1;
+}
+
+
+
+/*
+ * Map the compiled copy of a schedule file into memory, if it exists and
+ * matches the current contents of the schedule file. Returns NULL if the
+ * compiled schedule is missing, stale or invalid, in which case the yaml
+ * schedule needs to be parsed.
+ */
+schedule_cache_t *load_schedule_cache(char *filename, struct stat *source,
+        uint64_t hash) {
+    char cachename[MAX_PATH_LENGTH];
+    schedule_cache_header_t *header;
+    schedule_cache_entry_t *records;
+    schedule_cache_t *cache;
+    schedule_entry_t *entry;
+    uint32_t *offsets;
+    char *strings;
+    char **targets;
+    struct stat statbuf;
+    void *map;
+    uint64_t expected;
+    uint32_t i, j;
+    int fd;
+
+    assert(filename);
+    assert(source);
+
+    if ( get_schedule_cache_name(filename, cachename, sizeof(cachename)) < 0 ) {
+        return NULL;
+    }
+
+    if ( (fd = open(cachename, O_RDONLY)) < 0 ) {
+        return NULL;
+    }
+
+    if ( fstat(fd, &statbuf) < 0 ||
+            (size_t)statbuf.st_size < sizeof(schedule_cache_header_t) ) {
+        close(fd);
+        return NULL;
+    }
+
+    /* private and writable, as scheduling tests modifies the target strings */
+    map = mmap(NULL, statbuf.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+            fd, 0);
+    close(fd);
+
+    if ( map == MAP_FAILED ) {
+        Log(LOG_WARNING, "Failed to map compiled schedule %s: %s", cachename,
+                strerror(errno));
+        return NULL;
+    }
+
+    header = (schedule_cache_header_t *)map;
+
+    /* make sure it was built from the current version of the schedule */
+    if ( header->magic != SCHEDULE_CACHE_MAGIC ||
+            header->version != SCHEDULE_CACHE_VERSION ||
+            header->mtime_sec != source->st_mtim.tv_sec ||
+            header->mtime_nsec != source->st_mtim.tv_nsec ||
+            header->size != (uint64_t)source->st_size ||
+            header->hash != hash ) {
+        Log(LOG_DEBUG, "Compiled schedule %s is out of date", cachename);
+        goto invalid;
+    }
+
+    expected = sizeof(schedule_cache_header_t) +
+        ((uint64_t)header->count * sizeof(schedule_cache_entry_t)) +
+        ((uint64_t)header->target_count * sizeof(uint32_t)) +
+        header->strings_length;
+
+    if ( expected != (uint64_t)statbuf.st_size ) {
+        Log(LOG_WARNING, "Compiled schedule %s has the wrong length",
+                cachename);
+        goto invalid;
+    }
+
+    records = (schedule_cache_entry_t *)(header + 1);
+    offsets = (uint32_t *)(records + header->count);
+    strings = (char *)(offsets + header->target_count);
+
+    if ( header->strings_length > 0 &&
+            strings[header->strings_length - 1] != '\0' ) {
+        Log(LOG_WARNING, "Compiled schedule %s is corrupt", cachename);
+        goto invalid;
+    }
+
+    cache = (schedule_cache_t *)malloc(sizeof(schedule_cache_t));
+    cache->map = map;
+    cache->length = statbuf.st_size;
+    cache->count = header->count;
+    cache->entries = calloc(header->count, sizeof(schedule_entry_t));
+    /* every target list also needs a NULL terminator */
+    cache->targets = calloc(header->target_count + header->count,
+            sizeof(char *));
+
+    for ( i = 0, targets = cache->targets; i < header->count; i++ ) {
+        entry = &cache->entries[i];
+
+        if ( check_string_offset(records[i].test,
+                    header->strings_length, 1) < 0 ||
+                check_string_offset(records[i].period,
+                    header->strings_length, 1) < 0 ||
+                check_string_offset(records[i].args,
+                    header->strings_length, 1) < 0 ||
+                (uint64_t)records[i].targets + records[i].target_count >
+                header->target_count ) {
+            Log(LOG_WARNING, "Compiled schedule %s is corrupt", cachename);
+            free_schedule_cache(cache);
+            return NULL;
+        }
+
+        entry->test = records[i].test == SCHEDULE_CACHE_NO_STRING ?
+            NULL : strings + records[i].test;
+        entry->period = records[i].period == SCHEDULE_CACHE_NO_STRING ?
+            NULL : strings + records[i].period;
+        entry->args = records[i].args == SCHEDULE_CACHE_NO_STRING ?
+            NULL : strings + records[i].args;
+        entry->start = records[i].start;
+        entry->end = records[i].end;
+        entry->frequency = records[i].frequency;
+        entry->targets = targets;
+
+        for ( j = 0; j < records[i].target_count; j++ ) {
+            if ( check_string_offset(offsets[records[i].targets + j],
+                        header->strings_length, 0) < 0 ) {
+                Log(LOG_WARNING, "Compiled schedule %s is corrupt", cachename);
+                free_schedule_cache(cache);
+                return NULL;
+            }
+            *targets++ = strings + offsets[records[i].targets + j];
+        }
+
+        *targets++ = NULL;
+    }
+
+    return cache;
+
+invalid:
+    munmap(map, statbuf.st_size);
+    return NULL;
+}
+
+
+
+/*
+ * Unmap a compiled schedule and free the entries that point into it.
+ */
+void free_schedule_cache(schedule_cache_t *cache) {
+    if ( cache == NULL ) {
+        return;
+    }
+
+    munmap(cache->map, cache->length);
+    free(cache->entries);
+    free(cache->targets);
+    free(cache);
+}
+
+
+
+/*
+ * Append a string to the string table being built, returning its offset.
+ */
+static uint32_t add_cache_string(char **strings, uint64_t *length,
+        uint64_t *size, char *string) {
+    uint64_t offset = *length;
+    size_t string_length;
+
+    if ( string == NULL ) {
+        return SCHEDULE_CACHE_NO_STRING;
+    }
+
+    string_length = strlen(string) + 1;
+
+    while ( *length + string_length > *size ) {
+        *size *= 2;
+        *strings = realloc(*strings, *size);
+    }
+
+    memcpy(*strings + offset, string, string_length);
+    *length += string_length;
+
+    return (uint32_t)offset;
+}
+
+
+
+/*
+ * Write out a compiled copy of the tests parsed from a schedule file. The
+ * file is written under a temporary name and renamed into place, so a
+ * partially written copy is never used. Failing to write it isn't fatal,
+ * the yaml will just be parsed again next time. Returns 0 on success, -1
+ * on failure.
+ */
+int save_schedule_cache(char *filename, struct stat *source, uint64_t hash,
+        schedule_entry_t *entries, uint32_t count) {
+    char cachename[MAX_PATH_LENGTH];
+    char tmpname[MAX_PATH_LENGTH];
+    schedule_cache_header_t header;
+    schedule_cache_entry_t *records;
+    uint32_t *offsets = NULL;
+    uint32_t target_count = 0;
+    char *strings;
+    uint64_t length = 0, size = SCHEDULE_CACHE_STRINGS_SIZE;
+    uint32_t i;
+    char **target;
+    FILE *out;
+    int fd;
+    int result = -1;
+
+    assert(filename);
+    assert(source);
+
+    if ( get_schedule_cache_name(filename, cachename, sizeof(cachename)) < 0 ||
+            snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", cachename) >=
+            (int)sizeof(tmpname) ) {
+        return -1;
+    }
+
+    records = calloc(count + 1, sizeof(schedule_cache_entry_t));
+    strings = malloc(size);
+
+    for ( i = 0; i < count; i++ ) {
+        records[i].start = entries[i].start;
+        records[i].end = entries[i].end;
+        records[i].frequency = entries[i].frequency;
+        records[i].test = add_cache_string(&strings, &length, &size,
+                entries[i].test);
+        records[i].period = add_cache_string(&strings, &length, &size,
+                entries[i].period);
+        records[i].args = add_cache_string(&strings, &length, &size,
+                entries[i].args);
+        records[i].targets = target_count;
+
+        for ( target = entries[i].targets; target != NULL && *target != NULL;
+                target++ ) {
+            offsets = realloc(offsets, sizeof(uint32_t) * (target_count + 1));
+            offsets[target_count++] = add_cache_string(&strings, &length,
+                    &size, *target);
+            records[i].target_count++;
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SCHEDULE_CACHE_MAGIC;
+    header.version = SCHEDULE_CACHE_VERSION;
+    header.mtime_sec = source->st_mtim.tv_sec;
+    header.mtime_nsec = source->st_mtim.tv_nsec;
+    header.size = source->st_size;
+    header.hash = hash;
+    header.count = count;
+    header.target_count = target_count;
+    header.strings_length = length;
+
+    if ( (fd = mkstemp(tmpname)) < 0 ) {
+        Log(LOG_DEBUG, "Can't create compiled schedule %s: %s", tmpname,
+                strerror(errno));
+        goto end;
+    }
+
+    if ( (out = fdopen(fd, "w")) == NULL ) {
+        close(fd);
+        unlink(tmpname);
+        goto end;
+    }
+
+    if ( fwrite(&header, sizeof(header), 1, out) != 1 ||
+            fwrite(records, sizeof(schedule_cache_entry_t), count, out) !=
+            count ||
+            (target_count > 0 && fwrite(offsets, sizeof(uint32_t),
+                target_count, out) != target_count) ||
+            fwrite(strings, 1, length, out) != length ) {
+        Log(LOG_WARNING, "Failed to write compiled schedule %s", tmpname);
+        fclose(out);
+        unlink(tmpname);
+        goto end;
+    }
+
+    if ( fclose(out) != 0 || rename(tmpname, cachename) < 0 ) {
+        Log(LOG_WARNING, "Failed to save compiled schedule %s: %s", cachename,
+                strerror(errno));
+        unlink(tmpname);
+        goto end;
+    }
+
+    Log(LOG_DEBUG, "Saved compiled schedule %s (%u tests)", cachename, count);
+    result = 0;
+
+end:
+    free(records);
+    free(offsets);
+    free(strings);
+
+    return result;
+}
+
+
+
+/*
+ * Remove any compiled schedules for files in the schedule directory that
+ * aren't in the list of current schedule files, along with any temporary
+ * files left behind while saving them. Compiled schedules that belong to
+ * other schedule directories are left alone.
+ */
+void prune_schedule_cache(char *directory, char **filenames, size_t count) {
+    char prefix[SCHEDULE_CACHE_PREFIX_LENGTH];
+    char name[MAX_PATH_LENGTH];
+    char path[MAX_PATH_LENGTH];
+    struct dirent *entry;
+    DIR *dir;
+    size_t i;
+
+    assert(directory);
+
+    if ( cache_dir == NULL ||
+            get_schedule_cache_prefix(directory, prefix, sizeof(prefix)) < 0 ) {
+        return;
+    }
+
+    if ( (dir = opendir(cache_dir)) == NULL ) {
+        Log(LOG_DEBUG, "Can't open schedule cache directory %s: %s",
+                cache_dir, strerror(errno));
+        return;
+    }
+
+    while ( (entry = readdir(dir)) != NULL ) {
+        if ( strncmp(entry->d_name, prefix, strlen(prefix)) != 0 ) {
+            continue;
+        }
+
+        for ( i = 0; i < count; i++ ) {
+            if ( get_schedule_cache_basename(filenames[i], name,
+                        sizeof(name)) == 0 &&
+                    strcmp(entry->d_name, name) == 0 ) {
+                break;
+            }
+        }
+
+        if ( i < count ) {
+            continue;
+        }
+
+        if ( snprintf(path, sizeof(path), "%s/%s", cache_dir,
+                    entry->d_name) >= (int)sizeof(path) ) {
+            continue;
+        }
+
+        Log(LOG_DEBUG, "Removing unused compiled schedule %s", path);
+
+        if ( unlink(path) < 0 ) {
+            Log(LOG_WARNING, "Failed to remove compiled schedule %s: %s",
+                    path, strerror(errno));
+        }
+    }
+
+    closedir(dir);
+}
@@ -0,0 +1,112 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_SCHEDULE_CACHE_H
+#define _MEASURED_SCHEDULE_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "schedule.h"
+
+/* "AMPS" */
+#define SCHEDULE_CACHE_MAGIC 0x414d5053
+/* change this whenever the layout of the compiled schedule changes */
+#define SCHEDULE_CACHE_VERSION 1
+/* string offset used when an optional string wasn't set */
+#define SCHEDULE_CACHE_NO_STRING UINT32_MAX
+/* space for the hex directory hash and separator that start cache names */
+#define SCHEDULE_CACHE_PREFIX_LENGTH 18
+
+/*
+ * Header at the start of a compiled schedule file, describing the schedule
+ * file it was built from. It is followed by an array of entries, an array of
+ * target string offsets and a table of nul terminated strings.
+ */
+typedef struct schedule_cache_header {
+    uint32_t magic;                 /* SCHEDULE_CACHE_MAGIC */
+    uint32_t version;               /* SCHEDULE_CACHE_VERSION */
+    int64_t mtime_sec;              /* modification time of the source file */
+    int64_t mtime_nsec;
+    uint64_t size;                  /* size of the source file */
+    uint64_t hash;                  /* hash of the source file contents */
+    uint32_t count;                 /* number of entries */
+    uint32_t target_count;          /* total number of targets */
+    uint64_t strings_length;        /* length of the string table */
+} schedule_cache_header_t;
+
+/*
+ * A single test in a compiled schedule file. Strings are stored as offsets
+ * into the string table.
+ */
+typedef struct schedule_cache_entry {
+    int64_t start;
+    int64_t end;
+    int64_t frequency;
+    uint32_t test;                  /* offset of the test name */
+    uint32_t period;                /* offset of the period name, if any */
+    uint32_t args;                  /* offset of the test arguments, if any */
+    uint32_t targets;               /* index of the first target offset */
+    uint32_t target_count;          /* number of targets */
+    uint32_t reserved;
+} schedule_cache_entry_t;
+
+/*
+ * A compiled schedule that has been mapped into memory. The entries point
+ * into a private mapping of the file, so the strings can be modified
+ * without changing the file.
+ */
+typedef struct schedule_cache {
+    void *map;                      /* mapping of the compiled schedule */
+    size_t length;                  /* length of the mapping */
+    uint32_t count;                 /* number of entries */
+    schedule_entry_t *entries;      /* entries, ready to be scheduled */
+    char **targets;                 /* NULL terminated target lists */
+} schedule_cache_t;
+
+void set_schedule_cache_dir(char *directory);
+uint64_t hash_schedule_contents(const void *data, size_t length);
+schedule_cache_t *load_schedule_cache(char *filename, struct stat *source,
+        uint64_t hash);
+void free_schedule_cache(schedule_cache_t *cache);
+int save_schedule_cache(char *filename, struct stat *source, uint64_t hash,
+        schedule_entry_t *entries, uint32_t count);
+void prune_schedule_cache(char *directory, char **filenames, size_t count);
+
+#endif
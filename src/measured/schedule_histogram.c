@@ -0,0 +1,255 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load a schedule directory the same way amplet2 does and print how many
+ * test runs start in each part of the schedule period, to show how bunched
+ * up test start times are with and without schedule spreading enabled.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <libwandevent.h>
+
+#include "debug.h"
+#include "modules.h"
+#include "schedule.h"
+#include "timerheap.h"
+
+#define DEFAULT_BUCKET_SIZE 1
+
+
+struct option long_options[] = {
+    {"ampname", required_argument, 0, 'n'},
+    {"bucket", required_argument, 0, 'b'},
+    {"spread", no_argument, 0, 's'},
+    {"tests", required_argument, 0, 't'},
+    {"debug", no_argument, 0, 'x'},
+    {"help", no_argument, 0, 'h'},
+    {NULL, 0, 0, 0},
+};
+
+static void usage(char *prog) {
+    printf("usage: %s [options] <schedule directory>\n", prog);
+    printf("  --ampname, -n <name>       ampname to load the schedule as\n");
+    printf("  --bucket, -b  <seconds>    width of each histogram bucket "
+            "(default %d)\n", DEFAULT_BUCKET_SIZE);
+    printf("  --spread, -s               spread test start times as the "
+            "client would\n");
+    printf("  --tests, -t   <directory>  test module directory (default %s)\n",
+            AMP_TEST_DIRECTORY);
+    printf("  --debug, -x                enable debug output\n");
+}
+
+
+
+/*
+ * Length of a schedule period in seconds.
+ */
+static uint32_t get_period_length(schedule_period_t period) {
+    switch ( period ) {
+        case SCHEDULE_PERIOD_HOURLY: return 60 * 60;
+        case SCHEDULE_PERIOD_DAILY: return 60 * 60 * 24;
+        case SCHEDULE_PERIOD_WEEKLY: return 60 * 60 * 24 * 7;
+        default: return 0;
+    };
+}
+
+
+
+/*
+ * Add every run of a test within the histogram length to the histogram.
+ * Tests with a shorter period than the histogram repeat in every period.
+ * Returns the number of runs added.
+ */
+static uint64_t add_test_runs(test_schedule_item_t *test, uint32_t *histogram,
+        uint32_t length) {
+    uint64_t interval;
+    uint64_t period_us;
+    uint64_t offset;
+    uint32_t period;
+    uint32_t base;
+    uint64_t runs = 0;
+
+    if ( (period = get_period_length(test->period)) == 0 ) {
+        return 0;
+    }
+
+    interval = (test->interval.tv_sec * 1000000) + test->interval.tv_usec;
+    period_us = (uint64_t)period * 1000000;
+
+    for ( base = 0; base < length; base += period ) {
+        for ( offset = test->start; offset <= test->end && offset < period_us;
+                offset += interval ) {
+            histogram[base + (offset / 1000000)]++;
+            runs++;
+
+            /* a test with no interval only runs once per period */
+            if ( interval == 0 ) {
+                break;
+            }
+        }
+    }
+
+    return runs;
+}
+
+
+
+/*
+ *
+ */
+int main(int argc, char *argv[]) {
+    wand_event_handler_t *ev_hdl;
+    amp_timer_heap_t *heap;
+    amp_test_meta_t meta;
+    schedule_item_t *item;
+    uint32_t *histogram;
+    uint32_t length = 0;
+    uint32_t bucket_size = DEFAULT_BUCKET_SIZE;
+    uint32_t count, max = 0, max_offset = 0;
+    uint32_t busy = 0;
+    uint64_t runs = 0;
+    uint32_t tests = 0;
+    uint32_t i, j;
+    char *test_dir = AMP_TEST_DIRECTORY;
+    int spread = 0;
+    int opt;
+
+    memset(&meta, 0, sizeof(meta));
+    meta.ampname = "localhost";
+
+    /* quieten down log messages while loading, we don't need to see them */
+    log_level = LOG_WARNING;
+
+    while ( (opt = getopt_long(argc, argv, "?hb:n:st:x",
+                    long_options, NULL)) != -1 ) {
+        switch ( opt ) {
+            case 'b': bucket_size = atoi(optarg); break;
+            case 'n': meta.ampname = optarg; break;
+            case 's': spread = 1; break;
+            case 't': test_dir = optarg; break;
+            case 'x': log_level = LOG_DEBUG; break;
+            case 'h':
+            case '?':
+            default: usage(argv[0]); exit(1);
+        };
+    }
+
+    if ( optind >= argc || bucket_size == 0 ) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* the test modules are needed to recognise the tests in the schedule */
+    if ( register_tests(test_dir) == -1 ) {
+        fprintf(stderr, "Failed to register tests in %s\n", test_dir);
+        return 1;
+    }
+
+    wand_event_init();
+    ev_hdl = wand_create_event_handler();
+
+    set_schedule_spread(spread);
+    read_schedule_dir(ev_hdl, argv[optind], &meta);
+
+    heap = get_schedule_timers(ev_hdl);
+
+    /* the histogram covers the longest period of any scheduled test */
+    for ( i = 0; i < heap->count; i++ ) {
+        item = (schedule_item_t *)heap->timers[i]->data;
+        if ( item->type == EVENT_RUN_TEST &&
+                get_period_length(item->data.test->period) > length ) {
+            length = get_period_length(item->data.test->period);
+        }
+    }
+
+    if ( length == 0 ) {
+        printf("No tests scheduled in %s\n", argv[optind]);
+        clear_test_schedule(ev_hdl, 1);
+        wand_destroy_event_handler(ev_hdl);
+        unregister_tests();
+        return 0;
+    }
+
+    histogram = calloc(length, sizeof(uint32_t));
+
+    for ( i = 0; i < heap->count; i++ ) {
+        item = (schedule_item_t *)heap->timers[i]->data;
+        if ( item->type == EVENT_RUN_TEST ) {
+            runs += add_test_runs(item->data.test, histogram, length);
+            tests++;
+        }
+    }
+
+    printf("# offset(s) runs\n");
+    for ( i = 0; i < length; i += bucket_size ) {
+        for ( count = 0, j = i; j < i + bucket_size && j < length; j++ ) {
+            count += histogram[j];
+        }
+
+        if ( count == 0 ) {
+            continue;
+        }
+
+        printf("%u %u\n", i, count);
+
+        busy++;
+        if ( count > max ) {
+            max = count;
+            max_offset = i;
+        }
+    }
+
+    printf("# %u tests, %llu runs over %u seconds\n", tests,
+            (unsigned long long)runs, length);
+    printf("# %u of %u buckets (%us) busy, at most %u runs at offset %u\n",
+            busy, (length + bucket_size - 1) / bucket_size, bucket_size,
+            max, max_offset);
+
+    free(histogram);
+    clear_test_schedule(ev_hdl, 1);
+    wand_destroy_event_handler(ev_hdl);
+    unregister_tests();
+
+    return 0;
+}
@@ -0,0 +1,1156 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Spool for results that can't be published to the broker. Results are
+ * appended to a directory of segment files, each result written with a
+ * single write so that test processes and the main process can share the
+ * newest segment. Segments are only ever appended to, and every result
+ * carries a checksum so a partial write left by a crash is detected rather
+ * than replayed. Writes by the main process are synced in batches to keep
+ * the amount of flash wear on small devices down.
+ *
+ * Once the broker is reachable again, the main process replays the oldest
+ * segments at a limited rate. A segment is only removed once the broker has
+ * confirmed every result in it, and the confirmed position within it is
+ * saved so that a restart doesn't replay the whole segment again. If the
+ * spool grows too large then the oldest segments are thrown away.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "debug.h"
+#include "hash.h"
+#include "spool.h"
+#include "messaging.h"
+
+/* maximum length of the path to a segment file */
+#define SPOOL_PATH_LENGTH 1024
+/* number of digits in the sequence number that names each segment */
+#define SPOOL_SEQUENCE_DIGITS 20
+/* times a test process will look for a segment that it can append to */
+#define SPOOL_OPEN_ATTEMPTS 5
+
+static int spool_enabled = 0;
+
+/* spool configuration, the directory belongs to this module */
+static amp_spool_t spool = {
+    0,
+    NULL,
+    DEFAULT_SPOOL_MAX_SIZE,
+    DEFAULT_SPOOL_SEGMENT_SIZE,
+    DEFAULT_SPOOL_SYNC_RECORDS,
+    DEFAULT_SPOOL_DRAIN_RATE,
+};
+
+/* the main process, anything else is a test process spooling its result */
+static pid_t spool_pid = 0;
+
+static wand_event_handler_t *spool_ev_hdl = NULL;
+static struct wand_timer_t *drain_timer = NULL;
+
+/* segment the main process is currently appending to */
+static int active_fd = -1;
+static uint64_t active_seq = 0;
+static int unsynced = 0;
+
+/* segment being replayed, and the offset of the next result to replay */
+static uint64_t drain_seq = 0;
+static off_t drain_offset = 0;
+
+/* every result before this offset has been confirmed by the broker */
+static off_t confirmed_offset = 0;
+static int position_dirty = 0;
+
+/* replayed results waiting to be confirmed, in the order they were read */
+static spool_replay_t *unconfirmed = NULL;
+static int unconfirmed_count = 0;
+static int unconfirmed_size = 0;
+
+/* set when unconfirmed results were thrown away and must be read again */
+static int drain_rewound = 0;
+
+static spool_stats_t stats;
+
+
+
+/*
+ * Checksum a spooled result, including its header.
+ */
+static uint32_t record_checksum(spool_record_header_t *header, void *data) {
+    spool_record_header_t copy = *header;
+    uint32_t hash;
+
+    copy.checksum = 0;
+    hash = fnv1a_32(FNV1A_32_INIT, &copy, sizeof(copy));
+
+    return fnv1a_32(hash, data, header->length);
+}
+
+
+
+/*
+ * Get the full path to the segment with the given sequence number. They are
+ * zero padded so that they sort in the order they were created.
+ */
+static void get_segment_name(uint64_t seq, char *name, size_t length) {
+    snprintf(name, length, "%s/%0*" PRIu64 "%s", spool.directory,
+            SPOOL_SEQUENCE_DIGITS, seq, SPOOL_SEGMENT_SUFFIX);
+}
+
+
+
+/*
+ * Start replaying a segment from the given offset, forgetting about any
+ * results from the previous segment that are still waiting to be confirmed.
+ */
+static void reset_drain_position(uint64_t seq, off_t offset) {
+    drain_seq = seq;
+    drain_offset = offset;
+    confirmed_offset = offset;
+    unconfirmed_count = 0;
+    position_dirty = 1;
+}
+
+
+
+/*
+ * Save the confirmed position in the segment being replayed, if it has
+ * changed. It is written to a temporary file first so that a crash leaves
+ * either the old position or the new one.
+ */
+static void save_drain_position(void) {
+    char name[SPOOL_PATH_LENGTH];
+    char tmpname[SPOOL_PATH_LENGTH];
+    spool_position_t position;
+    int fd;
+
+    if ( !position_dirty || spool.directory == NULL ) {
+        return;
+    }
+
+    memset(&position, 0, sizeof(position));
+    position.magic = SPOOL_POSITION_MAGIC;
+    position.seq = drain_seq;
+    position.offset = confirmed_offset;
+    position.checksum = fnv1a_32(FNV1A_32_INIT, &position, sizeof(position));
+
+    snprintf(name, sizeof(name), "%s/%s", spool.directory,
+            SPOOL_POSITION_FILE);
+    snprintf(tmpname, sizeof(tmpname), "%s/%s.tmp", spool.directory,
+            SPOOL_POSITION_FILE);
+
+    if ( (fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0600)) < 0 ) {
+        Log(LOG_WARNING, "Failed to save spool position %s: %s", tmpname,
+                strerror(errno));
+        return;
+    }
+
+    if ( write(fd, &position, sizeof(position)) != sizeof(position) ||
+            fdatasync(fd) < 0 ) {
+        Log(LOG_WARNING, "Failed to save spool position %s: %s", tmpname,
+                strerror(errno));
+        close(fd);
+        unlink(tmpname);
+        return;
+    }
+
+    close(fd);
+
+    if ( rename(tmpname, name) < 0 ) {
+        Log(LOG_WARNING, "Failed to save spool position %s: %s", name,
+                strerror(errno));
+        unlink(tmpname);
+        return;
+    }
+
+    position_dirty = 0;
+}
+
+
+
+/*
+ * Load the confirmed position saved by a previous run, so that replaying
+ * carries on after the last result the broker confirmed.
+ */
+static void load_drain_position(void) {
+    char name[SPOOL_PATH_LENGTH];
+    spool_position_t position;
+    uint32_t checksum;
+    int fd;
+
+    reset_drain_position(0, 0);
+    position_dirty = 0;
+
+    snprintf(name, sizeof(name), "%s/%s", spool.directory,
+            SPOOL_POSITION_FILE);
+
+    if ( (fd = open(name, O_RDONLY | O_CLOEXEC)) < 0 ) {
+        return;
+    }
+
+    if ( read(fd, &position, sizeof(position)) != sizeof(position) ) {
+        Log(LOG_WARNING, "Ignoring incomplete spool position %s", name);
+        close(fd);
+        return;
+    }
+
+    close(fd);
+
+    checksum = position.checksum;
+    position.checksum = 0;
+
+    if ( position.magic != SPOOL_POSITION_MAGIC ||
+            checksum != fnv1a_32(FNV1A_32_INIT, &position, sizeof(position)) ) {
+        Log(LOG_WARNING, "Ignoring corrupt spool position %s", name);
+        return;
+    }
+
+    reset_drain_position(position.seq, position.offset);
+    position_dirty = 0;
+
+    if ( position.seq > 0 ) {
+        Log(LOG_DEBUG, "Resuming spool replay at offset %" PRIu64
+                " in segment %" PRIu64, position.offset, position.seq);
+    }
+}
+
+
+
+/*
+ * Get the sequence number from the name of a segment file. Returns -1 if
+ * the name doesn't belong to a segment.
+ */
+static int parse_segment_name(const char *name, uint64_t *seq) {
+    int i;
+
+    if ( strlen(name) != SPOOL_SEQUENCE_DIGITS + strlen(SPOOL_SEGMENT_SUFFIX) ||
+            strcmp(name + SPOOL_SEQUENCE_DIGITS, SPOOL_SEGMENT_SUFFIX) != 0 ) {
+        return -1;
+    }
+
+    *seq = 0;
+    for ( i = 0; i < SPOOL_SEQUENCE_DIGITS; i++ ) {
+        if ( name[i] < '0' || name[i] > '9' ) {
+            return -1;
+        }
+        *seq = (*seq * 10) + (name[i] - '0');
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Find the oldest and newest segments in the spool directory, and update
+ * the current number and size of segments. Returns -1 if the directory
+ * can't be read.
+ */
+static int scan_segments(uint64_t *oldest, uint64_t *oldest_size,
+        uint64_t *newest) {
+    DIR *dir;
+    struct dirent *entry;
+    struct stat statbuf;
+    uint64_t seq;
+    uint32_t count = 0;
+    uint64_t size = 0;
+
+    if ( (dir = opendir(spool.directory)) == NULL ) {
+        Log(LOG_WARNING, "Failed to open spool directory %s: %s",
+                spool.directory, strerror(errno));
+        return -1;
+    }
+
+    if ( oldest ) {
+        *oldest = 0;
+    }
+
+    if ( oldest_size ) {
+        *oldest_size = 0;
+    }
+
+    if ( newest ) {
+        *newest = 0;
+    }
+
+    while ( (entry = readdir(dir)) != NULL ) {
+        if ( parse_segment_name(entry->d_name, &seq) < 0 ) {
+            continue;
+        }
+
+        /* it might have just been removed after being replayed */
+        if ( fstatat(dirfd(dir), entry->d_name, &statbuf, 0) < 0 ) {
+            continue;
+        }
+
+        if ( oldest && (count == 0 || seq < *oldest) ) {
+            *oldest = seq;
+            if ( oldest_size ) {
+                *oldest_size = statbuf.st_size;
+            }
+        }
+
+        if ( newest && seq > *newest ) {
+            *newest = seq;
+        }
+
+        count++;
+        size += statbuf.st_size;
+    }
+
+    closedir(dir);
+
+    stats.segments = count;
+    stats.size = size;
+
+    return 0;
+}
+
+
+
+/*
+ * Make sure that a newly created or removed segment will still be there
+ * (or not) after a crash.
+ */
+static void sync_spool_directory(void) {
+    int fd;
+
+    if ( (fd = open(spool.directory, O_RDONLY | O_DIRECTORY)) < 0 ) {
+        return;
+    }
+
+    if ( fsync(fd) < 0 ) {
+        Log(LOG_WARNING, "Failed to sync spool directory %s: %s",
+                spool.directory, strerror(errno));
+    }
+
+    close(fd);
+}
+
+
+
+/*
+ * Append a result to a segment with a single write, so that it can't be
+ * interleaved with results written by other processes. The segment should
+ * already be locked. If only part of the result was written then it is
+ * removed again, so it doesn't hide any results written after it.
+ */
+static int append_record(int fd, spool_record_header_t *header, void *data,
+        uint64_t *size) {
+    struct stat statbuf;
+    struct iovec iov[2];
+    ssize_t expected, written;
+
+    if ( fstat(fd, &statbuf) < 0 ) {
+        return -1;
+    }
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(spool_record_header_t);
+    iov[1].iov_base = data;
+    iov[1].iov_len = header->length;
+    expected = sizeof(spool_record_header_t) + header->length;
+
+    written = writev(fd, iov, header->length > 0 ? 2 : 1);
+
+    if ( written != expected ) {
+        Log(LOG_WARNING, "Failed to write spooled result: %s",
+                written < 0 ? strerror(errno) : "short write");
+        if ( written > 0 && ftruncate(fd, statbuf.st_size) < 0 ) {
+            Log(LOG_WARNING, "Failed to remove partial spooled result: %s",
+                    strerror(errno));
+        }
+        return -1;
+    }
+
+    if ( size ) {
+        *size = statbuf.st_size + written;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Flush results written by the main process to disk.
+ */
+static void sync_active_segment(void) {
+    if ( active_fd < 0 || unsynced == 0 ) {
+        return;
+    }
+
+    if ( fdatasync(active_fd) < 0 ) {
+        Log(LOG_WARNING, "Failed to sync spool segment: %s", strerror(errno));
+    }
+
+    unsynced = 0;
+    stats.syncs++;
+}
+
+
+
+/*
+ * Stop appending to the current segment, new results will go into a new one.
+ */
+static void close_active_segment(void) {
+    if ( active_fd < 0 ) {
+        return;
+    }
+
+    sync_active_segment();
+    close(active_fd);
+    active_fd = -1;
+}
+
+
+
+/*
+ * Start a new segment for the main process to append results to, after
+ * any that already exist.
+ */
+static int open_active_segment(void) {
+    char name[SPOOL_PATH_LENGTH];
+    uint64_t newest;
+    int attempts;
+
+    if ( scan_segments(NULL, NULL, &newest) < 0 ) {
+        return -1;
+    }
+
+    if ( newest < active_seq ) {
+        newest = active_seq;
+    }
+
+    /* test processes can create a segment too, so it might already exist */
+    for ( attempts = 0; attempts < SPOOL_OPEN_ATTEMPTS; attempts++ ) {
+        active_seq = ++newest;
+        get_segment_name(active_seq, name, sizeof(name));
+        active_fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND |
+                O_CLOEXEC, 0600);
+
+        if ( active_fd >= 0 ) {
+            sync_spool_directory();
+            stats.segments++;
+            unsynced = 0;
+            return 0;
+        }
+
+        if ( errno != EEXIST ) {
+            break;
+        }
+    }
+
+    Log(LOG_WARNING, "Failed to create spool segment %s: %s", name,
+            strerror(errno));
+    return -1;
+}
+
+
+
+/*
+ * Throw away the oldest segment. Results are spooled in order, so these
+ * are the oldest results and the least useful to keep.
+ */
+static int evict_segment(uint64_t seq, uint64_t size) {
+    char name[SPOOL_PATH_LENGTH];
+
+    if ( seq == active_seq ) {
+        close_active_segment();
+    }
+
+    get_segment_name(seq, name, sizeof(name));
+
+    if ( unlink(name) < 0 && errno != ENOENT ) {
+        Log(LOG_WARNING, "Failed to remove spool segment %s: %s", name,
+                strerror(errno));
+        return -1;
+    }
+
+    Log(LOG_WARNING, "Spool is full, discarded %" PRIu64
+            " bytes of results in %s", size, name);
+
+    if ( seq == drain_seq ) {
+        reset_drain_position(0, 0);
+    }
+
+    sync_spool_directory();
+    stats.evicted_segments++;
+    stats.evicted_bytes += size;
+
+    return 0;
+}
+
+
+
+/*
+ * Make sure there is room in the spool to add a result of the given size,
+ * removing the oldest segments until it fits. Returns -1 if there is no way
+ * that the result can fit.
+ */
+static int make_room(uint64_t length) {
+    uint64_t oldest, oldest_size;
+
+    if ( length > spool.max_size ) {
+        return -1;
+    }
+
+    if ( stats.size + length <= spool.max_size ) {
+        return 0;
+    }
+
+    /* test processes may have added results, so find out the real size */
+    if ( scan_segments(NULL, NULL, NULL) < 0 ) {
+        return -1;
+    }
+
+    while ( stats.segments > 0 && stats.size + length > spool.max_size ) {
+        if ( scan_segments(&oldest, &oldest_size, NULL) < 0 ||
+                stats.segments == 0 ) {
+            break;
+        }
+
+        if ( evict_segment(oldest, oldest_size) < 0 ) {
+            return -1;
+        }
+
+        if ( scan_segments(NULL, NULL, NULL) < 0 ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Append a result to the segment owned by the main process. The segment is
+ * only synced after a number of results, or when the drain timer fires.
+ */
+static int spool_result_locally(spool_record_header_t *header, void *data) {
+    uint64_t length = sizeof(spool_record_header_t) + header->length;
+    uint64_t size;
+    int status;
+
+    if ( make_room(length) < 0 ) {
+        return -1;
+    }
+
+    if ( active_fd < 0 && open_active_segment() < 0 ) {
+        return -1;
+    }
+
+    /* test processes might be appending to the same segment */
+    if ( flock(active_fd, LOCK_EX) < 0 ) {
+        return -1;
+    }
+
+    status = append_record(active_fd, header, data, &size);
+    flock(active_fd, LOCK_UN);
+
+    if ( status < 0 ) {
+        return -1;
+    }
+
+    stats.size += length;
+
+    if ( ++unsynced >= spool.sync_records ) {
+        sync_active_segment();
+    }
+
+    if ( size >= spool.segment_size ) {
+        close_active_segment();
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Append a result from a test process to the newest segment. The main
+ * process might replay and remove the segment while waiting for the lock,
+ * in which case look for the newest segment again. Test processes only
+ * write a single result, so it is synced straight away.
+ */
+static int spool_result_from_test(spool_record_header_t *header,
+        void *data) {
+    char name[SPOOL_PATH_LENGTH];
+    struct stat statbuf;
+    uint64_t newest;
+    int attempts;
+    int flags;
+    int status;
+    int fd;
+
+    for ( attempts = 0; attempts < SPOOL_OPEN_ATTEMPTS; attempts++ ) {
+        if ( scan_segments(NULL, NULL, &newest) < 0 ) {
+            return -1;
+        }
+
+        flags = O_WRONLY | O_APPEND | O_CLOEXEC;
+
+        /* there are no segments, so start the first one */
+        if ( newest == 0 ) {
+            newest = 1;
+            flags |= O_CREAT | O_EXCL;
+        }
+
+        get_segment_name(newest, name, sizeof(name));
+
+        if ( (fd = open(name, flags, 0600)) < 0 ) {
+            continue;
+        }
+
+        if ( flock(fd, LOCK_EX) < 0 ) {
+            close(fd);
+            return -1;
+        }
+
+        /* the segment was removed after it was opened, try another */
+        if ( fstat(fd, &statbuf) < 0 || statbuf.st_nlink == 0 ) {
+            flock(fd, LOCK_UN);
+            close(fd);
+            continue;
+        }
+
+        status = append_record(fd, header, data, NULL);
+
+        if ( status == 0 && fdatasync(fd) < 0 ) {
+            Log(LOG_WARNING, "Failed to sync spool segment %s: %s", name,
+                    strerror(errno));
+        }
+
+        flock(fd, LOCK_UN);
+        close(fd);
+
+        if ( status == 0 && (flags & O_CREAT) ) {
+            sync_spool_directory();
+        }
+
+        return status;
+    }
+
+    Log(LOG_WARNING, "Failed to find a spool segment to write to");
+    return -1;
+}
+
+
+
+/*
+ * Write a result to the spool so that it can be published later. This can
+ * be called by the main process or by test processes, and the caller keeps
+ * ownership of the result. Returns 0 if the result was spooled, -1 if not.
+ */
+int spool_result(test_type_t type, amp_test_result_t *result) {
+    spool_record_header_t header;
+    int status;
+
+    if ( !spool_enabled ) {
+        return -1;
+    }
+
+    if ( result->len > SPOOL_MAX_RECORD_LENGTH ) {
+        Log(LOG_WARNING, "Result is too large to spool (%zu bytes)",
+                result->len);
+        stats.failed++;
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SPOOL_RECORD_MAGIC;
+    header.type = type;
+    header.timestamp = result->timestamp;
+    header.length = result->len;
+    header.checksum = record_checksum(&header, result->data);
+
+    if ( getpid() == spool_pid ) {
+        status = spool_result_locally(&header, result->data);
+    } else {
+        status = spool_result_from_test(&header, result->data);
+    }
+
+    if ( status < 0 ) {
+        stats.failed++;
+        return -1;
+    }
+
+    stats.spooled++;
+    return 0;
+}
+
+
+
+/*
+ * Read the spooled result at the given offset in a segment. Returns -1 if
+ * the result is incomplete or doesn't match its checksum.
+ */
+static int read_record(int fd, off_t offset, off_t size, test_type_t *type,
+        amp_test_result_t *result) {
+    spool_record_header_t header;
+
+    if ( size - offset < (off_t)sizeof(header) ) {
+        return -1;
+    }
+
+    if ( pread(fd, &header, sizeof(header), offset) != sizeof(header) ) {
+        return -1;
+    }
+
+    if ( header.magic != SPOOL_RECORD_MAGIC ||
+            header.length > SPOOL_MAX_RECORD_LENGTH ||
+            size - offset - (off_t)sizeof(header) < (off_t)header.length ||
+            header.type >= AMP_TEST_LAST || header.type <= AMP_TEST_INVALID ) {
+        return -1;
+    }
+
+    result->timestamp = header.timestamp;
+    result->len = header.length;
+    result->data = malloc(header.length);
+
+    if ( header.length > 0 && pread(fd, result->data, header.length,
+                offset + sizeof(header)) != (ssize_t)header.length ) {
+        free(result->data);
+        return -1;
+    }
+
+    if ( record_checksum(&header, result->data) != header.checksum ) {
+        free(result->data);
+        return -1;
+    }
+
+    *type = header.type;
+    return 0;
+}
+
+
+
+/*
+ * Remember a result that has been replayed, until the broker confirms it.
+ */
+static void add_unconfirmed(off_t offset) {
+    if ( unconfirmed_count >= unconfirmed_size ) {
+        unconfirmed_size = unconfirmed_size > 0 ? unconfirmed_size * 2 : 64;
+        unconfirmed = realloc(unconfirmed,
+                unconfirmed_size * sizeof(spool_replay_t));
+    }
+
+    unconfirmed[unconfirmed_count].offset = offset;
+    unconfirmed[unconfirmed_count].confirmed = 0;
+    unconfirmed_count++;
+}
+
+
+
+/*
+ * Mark a replayed result as confirmed by the broker. Results can be
+ * confirmed out of order if the broker rejects some of them, so the
+ * confirmed position only moves past results once all of those before
+ * them have been confirmed as well.
+ */
+void confirm_spooled_result(uint64_t seq, uint64_t offset) {
+    int i;
+
+    /* the segment could have been thrown away while it was being replayed */
+    if ( seq != drain_seq ) {
+        return;
+    }
+
+    for ( i = 0; i < unconfirmed_count; i++ ) {
+        if ( unconfirmed[i].offset == (off_t)offset ) {
+            unconfirmed[i].confirmed = 1;
+            break;
+        }
+    }
+
+    for ( i = 0; i < unconfirmed_count && unconfirmed[i].confirmed; i++ ) {
+        confirmed_offset = unconfirmed[i].offset;
+    }
+
+    if ( i > 0 ) {
+        memmove(unconfirmed, unconfirmed + i,
+                (unconfirmed_count - i) * sizeof(spool_replay_t));
+        unconfirmed_count -= i;
+        position_dirty = 1;
+    }
+}
+
+
+
+/*
+ * Go back to the first replayed result that hasn't been confirmed. This is
+ * used when replayed results are thrown away by the publishing queue rather
+ * than being spooled a second time, they are still in the segment and will
+ * be read from there again.
+ */
+void rewind_spool(void) {
+    drain_offset = confirmed_offset;
+    unconfirmed_count = 0;
+    drain_rewound = 1;
+}
+
+
+
+/*
+ * Replay up to limit results from the oldest segment, removing it once
+ * every result in it has been confirmed by the broker. The segment is
+ * locked so that test processes can't append to it while checking if it is
+ * finished. Returns the number of results replayed, or -1 if no more results
+ * can be queued.
+ */
+static int drain_segment(uint64_t seq, int limit) {
+    char name[SPOOL_PATH_LENGTH];
+    struct stat statbuf;
+    test_type_t type;
+    amp_test_result_t result;
+    off_t length;
+    int replayed = 0;
+    int full = 0;
+    int fd;
+
+    if ( seq != drain_seq ) {
+        reset_drain_position(seq, 0);
+    }
+
+    get_segment_name(seq, name, sizeof(name));
+
+    if ( (fd = open(name, O_RDONLY | O_CLOEXEC)) < 0 ) {
+        return 0;
+    }
+
+    if ( flock(fd, LOCK_SH) < 0 || fstat(fd, &statbuf) < 0 ) {
+        close(fd);
+        return -1;
+    }
+
+    drain_rewound = 0;
+
+    while ( replayed < limit && drain_offset < statbuf.st_size ) {
+        if ( read_record(fd, drain_offset, statbuf.st_size, &type,
+                    &result) < 0 ) {
+            /* the rest of the segment can't be trusted, most likely a crash */
+            Log(LOG_WARNING, "Spool segment %s is corrupt at offset %lld, "
+                    "discarding %lld bytes", name, (long long)drain_offset,
+                    (long long)(statbuf.st_size - drain_offset));
+            stats.corrupt++;
+            drain_offset = statbuf.st_size;
+            break;
+        }
+
+        length = sizeof(spool_record_header_t) + result.len;
+        add_unconfirmed(drain_offset + length);
+
+        /* the publishing queue takes ownership of the result data */
+        if ( queue_spooled_result_for_broker(type, &result, seq,
+                    drain_offset + length) < 0 ) {
+            free(result.data);
+            unconfirmed_count--;
+            full = 1;
+            break;
+        }
+
+        /* the broker went away and the queue threw the result out again */
+        if ( drain_rewound ) {
+            break;
+        }
+
+        drain_offset += length;
+        replayed++;
+        stats.replayed++;
+    }
+
+    /* results still waiting to be confirmed might need to be read again */
+    if ( drain_offset >= statbuf.st_size && unconfirmed_count == 0 ) {
+        if ( unlink(name) < 0 && errno != ENOENT ) {
+            Log(LOG_WARNING, "Failed to remove spool segment %s: %s", name,
+                    strerror(errno));
+        } else {
+            Log(LOG_DEBUG, "Finished replaying spool segment %s", name);
+            sync_spool_directory();
+        }
+        reset_drain_position(0, 0);
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    return full ? -1 : replayed;
+}
+
+
+
+/*
+ * Replay up to limit spooled results, oldest first. Returns the number of
+ * results that were replayed.
+ */
+static int drain_spool(int limit) {
+    uint64_t oldest;
+    int replayed = 0;
+    int count;
+
+    if ( !spool_enabled ) {
+        return 0;
+    }
+
+    while ( replayed < limit ) {
+        if ( scan_segments(&oldest, NULL, NULL) < 0 || stats.segments == 0 ) {
+            break;
+        }
+
+        /* don't read the segment being written, start a new one instead */
+        if ( oldest == active_seq && active_fd >= 0 ) {
+            close_active_segment();
+        }
+
+        if ( (count = drain_segment(oldest, limit - replayed)) < 0 ) {
+            break;
+        }
+
+        replayed += count;
+
+        /* the segment isn't finished, so it must have reached the limit */
+        if ( drain_seq == oldest ) {
+            break;
+        }
+    }
+
+    if ( replayed > 0 ) {
+        Log(LOG_DEBUG, "Replayed %d spooled results", replayed);
+    }
+
+    return replayed;
+}
+
+
+
+/*
+ * Regularly sync anything written by the main process, and replay spooled
+ * results if they can be published.
+ */
+static void drain_timer_callback(wand_event_handler_t *ev_hdl,
+        __attribute__((unused))void *data) {
+    int capacity;
+
+    drain_timer = NULL;
+
+    sync_active_segment();
+
+    /* test processes may have grown the spool past the limit */
+    if ( scan_segments(NULL, NULL, NULL) == 0 ) {
+        make_room(0);
+    }
+
+    if ( stats.segments > 0 ) {
+        capacity = get_publish_capacity();
+        if ( capacity > spool.drain_rate ) {
+            capacity = spool.drain_rate;
+        }
+
+        if ( capacity > 0 ) {
+            drain_spool(capacity);
+        }
+    }
+
+    save_drain_position();
+
+    drain_timer = wand_add_timer(ev_hdl, SPOOL_DRAIN_INTERVAL, 0, NULL,
+            drain_timer_callback);
+}
+
+
+
+/*
+ * Set where and how results are spooled. This should be called by the main
+ * process before any test processes are started, so that they know where
+ * to spool their results.
+ */
+void set_spool_config(wand_event_handler_t *ev_hdl, amp_spool_t *config) {
+    spool_enabled = 0;
+    spool_pid = getpid();
+    spool_ev_hdl = ev_hdl;
+
+    if ( config == NULL || !config->enabled || config->directory == NULL ) {
+        Log(LOG_DEBUG, "Result spooling is disabled");
+        return;
+    }
+
+    free(spool.directory);
+    spool.directory = strdup(config->directory);
+    spool.max_size = config->max_size;
+    spool.segment_size = config->segment_size;
+    spool.sync_records = config->sync_records > 0 ? config->sync_records : 1;
+    spool.drain_rate = config->drain_rate > 0 ? config->drain_rate : 1;
+
+    /* make sure there are always a few segments, so eviction is gradual */
+    if ( spool.segment_size == 0 || spool.segment_size > spool.max_size / 4 ) {
+        spool.segment_size = spool.max_size / 4;
+    }
+
+    if ( mkdir(spool.directory, 0700) < 0 && errno != EEXIST ) {
+        Log(LOG_WARNING, "Failed to create spool directory %s: %s",
+                spool.directory, strerror(errno));
+        return;
+    }
+
+    if ( scan_segments(NULL, NULL, &active_seq) < 0 ) {
+        return;
+    }
+
+    load_drain_position();
+
+    if ( stats.segments > 0 ) {
+        Log(LOG_INFO, "Found %" PRIu64 " bytes of spooled results to replay",
+                stats.size);
+    }
+
+    Log(LOG_DEBUG, "Spooling results to %s, up to %" PRIu64 " bytes",
+            spool.directory, spool.max_size);
+
+    spool_enabled = 1;
+
+    if ( spool_ev_hdl != NULL && drain_timer == NULL ) {
+        drain_timer = wand_add_timer(spool_ev_hdl, SPOOL_DRAIN_INTERVAL, 0,
+                NULL, drain_timer_callback);
+    }
+}
+
+
+
+/*
+ * Free a spool configuration.
+ */
+void free_spool_config(amp_spool_t *config) {
+    if ( config == NULL ) {
+        return;
+    }
+
+    free(config->directory);
+    free(config);
+}
+
+
+
+/*
+ * Stop spooling results, making sure anything already written is on disk.
+ * Should only be called when measured is terminating.
+ */
+void close_spool(void) {
+    if ( drain_timer != NULL ) {
+        wand_del_timer(spool_ev_hdl, drain_timer);
+        drain_timer = NULL;
+    }
+
+    close_active_segment();
+    save_drain_position();
+
+    free(unconfirmed);
+    unconfirmed = NULL;
+    unconfirmed_count = 0;
+    unconfirmed_size = 0;
+
+    if ( spool_enabled && stats.size > 0 ) {
+        Log(LOG_INFO, "Leaving %" PRIu64 " bytes of spooled results",
+                stats.size);
+    }
+
+    spool_enabled = 0;
+    spool_ev_hdl = NULL;
+    free(spool.directory);
+    spool.directory = NULL;
+}
+
+
+
+/*
+ * Get a copy of the spool counters.
+ */
+void get_spool_stats(spool_stats_t *out) {
+    assert(out);
+    memcpy(out, &stats, sizeof(spool_stats_t));
+}
+
+
+
+/*
+ * Dump the current state of the spool for debug purposes.
+ */
+void dump_spool_stats(FILE *out) {
+    assert(out);
+
+    fprintf(out, "===== RESULT SPOOL =====\n");
+
+    if ( !spool_enabled ) {
+        fprintf(out, "Disabled\n");
+        return;
+    }
+
+    fprintf(out, "Directory: %s\n", spool.directory);
+    fprintf(out, "Size: %" PRIu64 " of %" PRIu64 " bytes in %u segments\n",
+            stats.size, spool.max_size, stats.segments);
+    fprintf(out, "Spooled: %" PRIu64 ", replayed: %" PRIu64 ", failed: %"
+            PRIu64 "\n", stats.spooled, stats.replayed, stats.failed);
+    fprintf(out, "Evicted: %" PRIu64 " segments (%" PRIu64 " bytes)\n",
+            stats.evicted_segments, stats.evicted_bytes);
+    fprintf(out, "Corrupt segments: %" PRIu64 ", syncs: %" PRIu64 "\n",
+            stats.corrupt, stats.syncs);
+}
+
+
+
+#if UNIT_TEST
+int amp_test_drain_spool(int limit) {
+    return drain_spool(limit);
+}
+#endif
@@ -0,0 +1,144 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_SPOOL_H
+#define _MEASURED_SPOOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <libwandevent.h>
+
+#include "tests.h"
+
+/* "AMPR" */
+#define SPOOL_RECORD_MAGIC 0x414d5052
+/* "AMPP" */
+#define SPOOL_POSITION_MAGIC 0x414d5050
+/* suffix used for spool segment files */
+#define SPOOL_SEGMENT_SUFFIX ".spool"
+/* file recording how much of the oldest segment the broker has confirmed */
+#define SPOOL_POSITION_FILE "replay.position"
+/* default maximum size of all spooled results (bytes) */
+#define DEFAULT_SPOOL_MAX_SIZE (64 * 1024 * 1024)
+/* default size a segment can grow to before a new one is started (bytes) */
+#define DEFAULT_SPOOL_SEGMENT_SIZE (1024 * 1024)
+/* default number of results written before the segment is synced to disk */
+#define DEFAULT_SPOOL_SYNC_RECORDS 20
+/* default number of spooled results to replay each second */
+#define DEFAULT_SPOOL_DRAIN_RATE 50
+/* how often to sync and replay the spool (in seconds) */
+#define SPOOL_DRAIN_INTERVAL 1
+/* largest single result that will be spooled (bytes) */
+#define SPOOL_MAX_RECORD_LENGTH (16 * 1024 * 1024)
+
+/*
+ * Configuration for spooling results to disk while they can't be published.
+ */
+typedef struct amp_spool {
+    int enabled;
+    char *directory;                /* directory to store segments in */
+    uint64_t max_size;              /* maximum size of all segments */
+    uint64_t segment_size;          /* size to start a new segment at */
+    int sync_records;               /* results to write before syncing */
+    int drain_rate;                 /* results to replay per second */
+} amp_spool_t;
+
+/*
+ * Header written before every spooled result. The checksum covers the
+ * header (with the checksum set to zero) and the result data, so that a
+ * partially written result at the end of a segment can be detected.
+ */
+typedef struct spool_record_header {
+    uint32_t magic;                 /* SPOOL_RECORD_MAGIC */
+    uint32_t type;                  /* test that the result is from */
+    uint64_t timestamp;             /* timestamp of the result */
+    uint32_t length;                /* length of the result data */
+    uint32_t checksum;
+} spool_record_header_t;
+
+/*
+ * Position in the segment being replayed, up to which every result has
+ * been confirmed by the broker. It is saved so that a restart carries on
+ * from here rather than replaying the whole segment again.
+ */
+typedef struct spool_position {
+    uint32_t magic;                 /* SPOOL_POSITION_MAGIC */
+    uint32_t checksum;
+    uint64_t seq;                   /* segment being replayed, or zero */
+    uint64_t offset;                /* offset of the first unconfirmed result */
+} spool_position_t;
+
+/*
+ * A result that has been replayed but not yet confirmed by the broker.
+ */
+typedef struct spool_replay {
+    off_t offset;                   /* offset just after the result */
+    int confirmed;                  /* set once the broker confirms it */
+} spool_replay_t;
+
+/*
+ * Counters describing how the spool has been used.
+ */
+typedef struct spool_stats {
+    uint64_t spooled;               /* results written to the spool */
+    uint64_t replayed;              /* results read back to be published */
+    uint64_t failed;                /* results that couldn't be written */
+    uint64_t evicted_segments;      /* segments removed to save space */
+    uint64_t evicted_bytes;         /* size of the removed segments */
+    uint64_t corrupt;               /* segments with unreadable results */
+    uint64_t syncs;                 /* number of times data was synced */
+    uint32_t segments;              /* current number of segments */
+    uint64_t size;                  /* current size of all segments */
+} spool_stats_t;
+
+void set_spool_config(wand_event_handler_t *ev_hdl, amp_spool_t *config);
+void free_spool_config(amp_spool_t *config);
+int spool_result(test_type_t type, amp_test_result_t *result);
+void confirm_spooled_result(uint64_t seq, uint64_t offset);
+void rewind_spool(void);
+void close_spool(void);
+void get_spool_stats(spool_stats_t *stats);
+void dump_spool_stats(FILE *out);
+
+#if UNIT_TEST
+int amp_test_drain_spool(int limit);
+#endif
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include "admission.h"
+#include "modules.h"
+
+#define MAX_STARTED 32
+
+/* record of every test that was started, in order */
+static test_schedule_item_t *started[MAX_STARTED];
+static uint32_t started_ids[MAX_STARTED];
+static int started_count = 0;
+static pid_t next_pid = 1000;
+static int use_runner = 0;
+
+
+/*
+ * Replace the real function that starts the tests, just record the test.
+ * Tests are either "forked" (returning a pid), or given to a "test runner".
+ */
+pid_t fork_test(test_schedule_item_t *item, uint32_t id) {
+    assert(started_count < MAX_STARTED);
+    started[started_count] = item;
+    started_ids[started_count] = id;
+    started_count++;
+    return use_runner ? 0 : next_pid++;
+}
+
+
+
+/*
+ * Check that the global limit and per test limits are applied, and that
+ * deferred tests start in order as slots are released.
+ */
+int main(void) {
+    test_t icmp, udpstream;
+    test_schedule_item_t a, b, c, d;
+    amp_admission_t *admission;
+    amp_test_limit_t *limit;
+    admission_stats_t stats;
+
+    memset(&icmp, 0, sizeof(icmp));
+    icmp.name = "icmp";
+    icmp.max_duration = 120;
+    memset(&udpstream, 0, sizeof(udpstream));
+    udpstream.name = "udpstream";
+    udpstream.max_duration = 120;
+    amp_tests[AMP_TEST_ICMP] = &icmp;
+    amp_tests[AMP_TEST_UDPSTREAM] = &udpstream;
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    memset(&c, 0, sizeof(c));
+    memset(&d, 0, sizeof(d));
+    a.test_id = AMP_TEST_ICMP;
+    b.test_id = AMP_TEST_ICMP;
+    c.test_id = AMP_TEST_UDPSTREAM;
+    d.test_id = AMP_TEST_UDPSTREAM;
+
+    /* allow two tests at once, only one of which can be udpstream */
+    limit = calloc(1, sizeof(amp_test_limit_t));
+    limit->name = strdup("udpstream");
+    limit->max_running = 1;
+    admission = calloc(1, sizeof(amp_admission_t));
+    admission->max_running = 2;
+    admission->max_queue = 2;
+    admission->limits = limit;
+    set_admission_config(NULL, admission);
+
+    /* first two tests should start immediately (pids 1000 and 1001) */
+    admit_scheduled_test(&c);
+    admit_scheduled_test(&a);
+    assert(started_count == 2);
+    assert(started[0] == &c && started[1] == &a);
+
+    /* no slots left, these need to wait */
+    admit_scheduled_test(&d);
+    admit_scheduled_test(&b);
+    assert(started_count == 2);
+
+    /* queue is full, this run should be dropped */
+    admit_scheduled_test(&a);
+    assert(started_count == 2);
+
+    /* icmp finishing frees a slot, but udpstream is still at its limit */
+    release_test_slot_by_pid(1001);
+    assert(started_count == 3);
+    assert(started[2] == &b);
+
+    /* udpstream finishing lets the other udpstream test run */
+    use_runner = 1;
+    release_test_slot_by_pid(1000);
+    assert(started_count == 4);
+    assert(started[3] == &d);
+
+    /* tests started by a test runner are released by id */
+    release_test_slot_by_id(started_ids[3]);
+    admit_scheduled_test(&c);
+    assert(started_count == 5);
+    assert(started[4] == &c);
+
+    /* unknown pids and ids shouldn't release anything */
+    release_test_slot_by_pid(1);
+    release_test_slot_by_id(12345);
+    admit_scheduled_test(&a);
+    admit_scheduled_test(&d);
+    assert(started_count == 5);
+
+    /* cancelling a deferred test removes it from the queue */
+    cancel_deferred_test(&a);
+    cancel_deferred_test(&d);
+    release_test_slot_by_id(started_ids[4]);
+    assert(started_count == 5);
+
+    get_admission_stats(&stats);
+    assert(stats.started == 5);
+    assert(stats.deferred == 4);
+    assert(stats.dropped == 1);
+
+    free_admission_config(admission);
+
+    return 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measure how ASN cache lookup throughput grows with the number of threads
+ * reading the cache, comparing lookups made under the cache mutex against
+ * lookups made without it. A writer keeps adding entries to the cache the
+ * whole time, like whois results arriving, and reports how long each insert
+ * takes and how long compacting the cache takes at this size. This isn't run
+ * as part of the test suite, run it by hand:
+ *
+ *   ./asncache_bench [max threads] [prefix count]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "asnsock.h"
+#include "asn.h"
+#include "iptrie.h"
+
+#define DEFAULT_MAX_THREADS 8
+#define DEFAULT_PREFIX_COUNT 100000
+/* lookups made by each thread in each run */
+#define LOOKUPS_PER_THREAD 2000000
+
+struct bench_data {
+    struct amp_asn_info *info;
+    struct sockaddr_in *addresses;
+    int count;
+    int locked;
+    int stop;
+    double insert_ns;               /* total time spent adding entries */
+    uint64_t inserts;
+    double compact_ns;              /* total time spent compacting */
+    uint64_t compactions;
+};
+
+
+
+/*
+ * Number of nanoseconds between two timespecs.
+ */
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return ((end->tv_sec - start->tv_sec) * 1000000000.0) +
+        (end->tv_nsec - start->tv_nsec);
+}
+
+
+
+/*
+ * Add a /24 to the cache itself, as the whois results are added.
+ */
+static void add_prefix(struct amp_asn_info *info, struct sockaddr_in *addr,
+        int64_t as) {
+    pthread_mutex_lock(info->mutex);
+    iptrie_add_copying(info->trie, (struct sockaddr *)addr, 24, as, 0);
+    pthread_mutex_unlock(info->mutex);
+}
+
+
+
+/*
+ * Compact the cache if the refresh thread would, timing how long it takes.
+ */
+static void compact_cache(struct bench_data *bench, int force) {
+    struct timespec start, end;
+    uint64_t allocated, replaced;
+
+    pthread_mutex_lock(bench->info->mutex);
+    iptrie_get_node_counts(bench->info->trie, &allocated, &replaced);
+    pthread_mutex_unlock(bench->info->mutex);
+
+    if ( !force && (replaced < ASN_CACHE_COMPACT_MIN_NODES ||
+                replaced < allocated - replaced) ) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    amp_test_asn_cache_compact(bench->info);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    bench->compact_ns += elapsed_ns(&start, &end);
+    bench->compactions++;
+}
+
+
+
+/*
+ * Look up addresses from the list, starting at a different place in each
+ * thread.
+ */
+static void *reader_thread(void *data) {
+    struct bench_data *bench = (struct bench_data *)data;
+    int index = random() % bench->count;
+    int found = 0;
+    int i;
+
+    for ( i = 0; i < LOOKUPS_PER_THREAD; i++ ) {
+        if ( amp_test_asn_cache_lookup(bench->info,
+                    (struct sockaddr *)&bench->addresses[index],
+                    bench->locked) >= 0 ) {
+            found++;
+        }
+
+        if ( ++index == bench->count ) {
+            index = 0;
+        }
+    }
+
+    if ( found != LOOKUPS_PER_THREAD ) {
+        fprintf(stderr, "Only found %d of %d addresses\n", found,
+                LOOKUPS_PER_THREAD);
+        abort();
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Keep adding new prefixes to the cache until the readers are finished.
+ */
+static void *writer_thread(void *data) {
+    struct bench_data *bench = (struct bench_data *)data;
+    struct sockaddr_in addr;
+    struct timespec start, end;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    while ( !__atomic_load_n(&bench->stop, __ATOMIC_ACQUIRE) ) {
+        /* 10.0.0.0/8 isn't used by the readers */
+        addr.sin_addr.s_addr = htonl(0x0a000000 | (random() & 0xffff00));
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        add_prefix(bench->info, &addr, 64512);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        bench->insert_ns += elapsed_ns(&start, &end);
+        bench->inserts++;
+
+        compact_cache(bench, 0);
+
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Run the readers and the writer, returning millions of lookups per second.
+ */
+static double run_bench(struct bench_data *bench, int threads) {
+    pthread_t readers[threads];
+    pthread_t writer;
+    struct timespec start, end;
+    int i;
+
+    bench->stop = 0;
+    bench->insert_ns = 0;
+    bench->inserts = 0;
+    pthread_create(&writer, NULL, writer_thread, bench);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < threads; i++ ) {
+        pthread_create(&readers[i], NULL, reader_thread, bench);
+    }
+
+    for ( i = 0; i < threads; i++ ) {
+        pthread_join(readers[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    __atomic_store_n(&bench->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+
+    return ((double)threads * LOOKUPS_PER_THREAD * 1000.0) /
+        elapsed_ns(&start, &end);
+}
+
+
+
+/*
+ * Average time taken by each insert in the last run, in microseconds.
+ */
+static double insert_us(struct bench_data *bench) {
+    return bench->inserts ? (bench->insert_ns / bench->inserts / 1000.0) : 0;
+}
+
+
+
+/*
+ *
+ */
+int main(int argc, char *argv[]) {
+    struct bench_data bench;
+    struct timespec start, end;
+    double locked, unlocked;
+    double locked_insert;
+    int max_threads = DEFAULT_MAX_THREADS;
+    int count = DEFAULT_PREFIX_COUNT;
+    int threads;
+    int i;
+
+    if ( argc > 1 ) {
+        max_threads = atoi(argv[1]);
+    }
+
+    if ( argc > 2 ) {
+        count = atoi(argv[2]);
+    }
+
+    if ( max_threads <= 0 || max_threads > ASN_CACHE_MAX_READERS - 1 ||
+            count <= 0 ) {
+        fprintf(stderr, "usage: %s [max threads] [prefix count]\n", argv[0]);
+        return 1;
+    }
+
+    srandom(time(NULL));
+
+    memset(&bench, 0, sizeof(bench));
+    bench.info = initialise_asn_info();
+    bench.count = count;
+    bench.addresses = calloc(count, sizeof(struct sockaddr_in));
+
+    /* random /24s outside 10.0.0.0/8, which the writer uses */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < count; i++ ) {
+        bench.addresses[i].sin_family = AF_INET;
+        bench.addresses[i].sin_addr.s_addr = htonl(
+                (((random() % 245) + 11) << 24) | (random() & 0xffffff));
+        add_prefix(bench.info, &bench.addresses[i], 64513);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    compact_cache(&bench, 1);
+
+    printf("%d prefixes, %d lookups per thread\n", count, LOOKUPS_PER_THREAD);
+    printf("filling the cache: %.2fus per insert, compacting took %.2fms\n",
+            elapsed_ns(&start, &end) / count / 1000.0,
+            bench.compact_ns / 1000000.0);
+    printf("threads  locked (M/s)  insert (us)  unlocked (M/s)  insert (us)\n");
+
+    bench.compact_ns = 0;
+    bench.compactions = 0;
+
+    for ( threads = 1; threads <= max_threads; threads *= 2 ) {
+        bench.locked = 1;
+        locked = run_bench(&bench, threads);
+        locked_insert = insert_us(&bench);
+        bench.locked = 0;
+        unlocked = run_bench(&bench, threads);
+        printf("%7d  %12.2f  %11.2f  %14.2f  %11.2f\n", threads, locked,
+                locked_insert, unlocked, insert_us(&bench));
+    }
+
+    printf("compacted %" PRIu64 " times while running", bench.compactions);
+    if ( bench.compactions > 0 ) {
+        printf(", %.2fms each", bench.compact_ns / bench.compactions /
+                1000000.0);
+    }
+    printf("\n");
+
+    amp_asn_info_delete(bench.info);
+    free(bench.addresses);
+
+    return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include "asnsock.h"
+#include "asn.h"
+#include "iptrie.h"
+
+
+
+/*
+ * Add a whois response line to the cache, as if it came from the server.
+ */
+static void add_response(struct amp_asn_info *info, char *text) {
+    struct iptrie result = { NULL, NULL, NULL };
+    char line[128];
+
+    strncpy(line, text, sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+    add_parsed_line(&result, line, info);
+    iptrie_clear(&result);
+}
+
+
+
+/*
+ * Fill in an IPv4 address.
+ */
+static struct sockaddr *make_address(struct sockaddr_in *addr, char *address) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    assert(inet_pton(AF_INET, address, &addr->sin_addr) == 1);
+    return (struct sockaddr *)addr;
+}
+
+
+
+/*
+ * Check if an address is in the cache, returning the ASN that was found.
+ */
+static int64_t check_address(struct amp_asn_info *info, char *address) {
+    struct iptrie result = { NULL, NULL, NULL };
+    struct sockaddr_in addr;
+    int64_t asn;
+
+    if ( amp_test_asn_cache_check(info, &result,
+                make_address(&addr, address)) < 0 ) {
+        assert(result.ipv4 == NULL);
+        return -1;
+    }
+
+    asn = iptrie_lookup_as(&result, (struct sockaddr*)&addr);
+    iptrie_clear(&result);
+
+    return asn;
+}
+
+
+
+/*
+ * Check that cached ASNs expire individually, are still used (and queued
+ * for refresh) for a while after expiring, and are then removed.
+ */
+int main(void) {
+    struct amp_asn_info *info;
+    struct sockaddr_in addr;
+    asn_cache_stats_t stats;
+
+    info = initialise_asn_info();
+
+    add_response(info, "15169   | 8.8.8.8          | GOOGLE, US");
+    add_response(info, "13335   | 1.1.1.1          | CLOUDFLARENET, US");
+
+    /* lookups see new entries straight away, with or without the mutex */
+    assert(amp_test_asn_cache_lookup(info, make_address(&addr, "8.8.8.8"),
+                0) == 15169);
+    assert(amp_test_asn_cache_lookup(info, make_address(&addr, "8.8.8.8"),
+                1) == 15169);
+
+    /* fresh entries are hits, anything else is a miss */
+    assert(check_address(info, "8.8.8.8") == 15169);
+    assert(check_address(info, "8.8.8.200") == 15169);
+    assert(check_address(info, "1.1.1.1") == 13335);
+    assert(check_address(info, "9.9.9.9") == -1);
+
+    get_asn_cache_stats(&stats);
+    assert(stats.hits == 5);
+    assert(stats.stale_hits == 0);
+    assert(stats.misses == 1);
+    assert(stats.entries == 2);
+    assert(stats.queued == 0);
+    assert(stats.nodes == 3);
+    assert(stats.replaced_nodes == 0);
+
+    /* updating an entry replaces the nodes on the path to it */
+    add_response(info, "15169   | 8.8.8.8          | GOOGLE, US");
+    get_asn_cache_stats(&stats);
+    assert(stats.entries == 2);
+    assert(stats.nodes == 5);
+    assert(stats.replaced_nodes == 2);
+
+    /* compacting frees the replaced nodes, and lookups still work */
+    amp_test_asn_cache_compact(info);
+    assert(amp_test_asn_cache_lookup(info, make_address(&addr, "8.8.8.8"),
+                0) == 15169);
+    assert(amp_test_asn_cache_lookup(info, make_address(&addr, "1.1.1.1"),
+                0) == 13335);
+    get_asn_cache_stats(&stats);
+    assert(stats.entries == 2);
+    assert(stats.nodes == 3);
+    assert(stats.replaced_nodes == 0);
+    assert(stats.compactions == 1);
+
+    amp_test_asn_cache_advance(MIN_ASN_CACHE_LIFETIME +
+            MAX_ASN_CACHE_LIFETIME_OFFSET);
+
+    /* expired entries are still used, but only queued for refresh once */
+    assert(check_address(info, "8.8.8.8") == 15169);
+    assert(check_address(info, "8.8.8.1") == 15169);
+    assert(check_address(info, "1.1.1.1") == 13335);
+
+    get_asn_cache_stats(&stats);
+    assert(stats.hits == 10);
+    assert(stats.stale_hits == 3);
+    assert(stats.queued == 2);
+    assert(stats.entries == 2);
+
+    /* nothing is old enough to be removed yet */
+    amp_test_asn_cache_prune(info);
+    get_asn_cache_stats(&stats);
+    assert(stats.entries == 2);
+    assert(stats.pruned == 0);
+
+    /* entries that expired long ago aren't used, and get pruned */
+    amp_test_asn_cache_advance(ASN_CACHE_MAX_STALE + 1);
+    assert(check_address(info, "8.8.8.8") == -1);
+    assert(check_address(info, "1.1.1.1") == -1);
+
+    amp_test_asn_cache_prune(info);
+    get_asn_cache_stats(&stats);
+    assert(stats.misses == 3);
+    assert(stats.pruned == 2);
+    assert(stats.entries == 0);
+
+    /* a new response puts the entry back in the cache */
+    add_response(info, "15169   | 8.8.8.8          | GOOGLE, US");
+    get_asn_cache_stats(&stats);
+    assert(stats.entries == 1);
+
+    amp_asn_info_delete(info);
+
+    return EXIT_SUCCESS;
+}
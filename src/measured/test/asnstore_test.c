@@ -0,0 +1,243 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include "asnstore.h"
+#include "asnsock.h"
+#include "iptrie.h"
+
+
+
+/*
+ * Add a prefix to the cache with the given expiry time.
+ */
+static void add_prefix(struct amp_asn_info *info, int family, char *address,
+        uint8_t prefix, int64_t as, time_t expires) {
+    struct sockaddr_storage addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.ss_family = family;
+
+    if ( family == AF_INET ) {
+        assert(inet_pton(AF_INET, address,
+                    &((struct sockaddr_in*)&addr)->sin_addr) == 1);
+    } else {
+        assert(inet_pton(AF_INET6, address,
+                    &((struct sockaddr_in6*)&addr)->sin6_addr) == 1);
+    }
+
+    iptrie_add_expiring(info->trie, (struct sockaddr*)&addr, prefix, as,
+            expires);
+}
+
+
+
+/*
+ * Find the cache entry for an address, returning the ASN or -1.
+ */
+static int64_t lookup(struct amp_asn_info *info, int family, char *address,
+        time_t *expires) {
+    struct sockaddr_storage addr;
+    iptrie_node_t *node;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.ss_family = family;
+
+    if ( family == AF_INET ) {
+        assert(inet_pton(AF_INET, address,
+                    &((struct sockaddr_in*)&addr)->sin_addr) == 1);
+    } else {
+        assert(inet_pton(AF_INET6, address,
+                    &((struct sockaddr_in6*)&addr)->sin6_addr) == 1);
+    }
+
+    node = iptrie_lookup(info->trie, (struct sockaddr*)&addr);
+    if ( node == NULL ) {
+        return -1;
+    }
+
+    if ( expires ) {
+        *expires = node->expires;
+    }
+
+    return node->as;
+}
+
+
+
+/*
+ * Change a single byte in the snapshot file.
+ */
+static void corrupt_file(char *filename, off_t offset, uint8_t value) {
+    int fd;
+
+    assert((fd = open(filename, O_WRONLY)) >= 0);
+    assert(pwrite(fd, &value, sizeof(value), offset) == sizeof(value));
+    close(fd);
+}
+
+
+
+/*
+ * Copy a snapshot file, so that damaged versions can be tested.
+ */
+static void copy_file(char *from, char *to) {
+    char buffer[4096];
+    ssize_t bytes;
+    int in, out;
+
+    assert((in = open(from, O_RDONLY)) >= 0);
+    assert((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600)) >= 0);
+
+    while ( (bytes = read(in, buffer, sizeof(buffer))) > 0 ) {
+        assert(write(out, buffer, bytes) == bytes);
+    }
+
+    close(in);
+    close(out);
+}
+
+
+
+/*
+ * Check that a snapshot file can't be loaded.
+ */
+static void check_rejected(char *filename) {
+    struct amp_asn_info *info = initialise_asn_info();
+
+    assert(load_asn_snapshot(info->trie, filename, 0) < 0);
+    assert(info->trie->ipv4 == NULL && info->trie->ipv6 == NULL);
+
+    amp_asn_info_delete(info);
+}
+
+
+
+/*
+ * Check that the ASN cache can be saved to disk and loaded again, and that
+ * damaged or incompatible snapshots are ignored.
+ */
+int main(void) {
+    struct amp_asn_info *saved, *loaded;
+    char filename[] = "/tmp/amp-asnstore-test-XXXXXX";
+    char damaged[sizeof(filename) + 8];
+    asn_snapshot_header_t header;
+    time_t now = time(NULL);
+    time_t expires;
+    int fd;
+
+    assert((fd = mkstemp(filename)) >= 0);
+    close(fd);
+    snprintf(damaged, sizeof(damaged), "%s.bad", filename);
+
+    saved = initialise_asn_info();
+    add_prefix(saved, AF_INET, "8.8.8.0", 24, 15169, now + 100);
+    add_prefix(saved, AF_INET, "1.1.1.0", 24, 13335, now + 200);
+    add_prefix(saved, AF_INET, "10.0.0.0", 24, 64512, now - 1000);
+    add_prefix(saved, AF_INET6, "2001:4860::", 64, 15169, now + 300);
+    add_prefix(saved, AF_INET6, "2606:4700::", 64, 13335, 0);
+
+    /* entries that expired before the cutoff aren't written */
+    assert(save_asn_snapshot(saved, filename, now - 500) == 4);
+
+    loaded = initialise_asn_info();
+    assert(load_asn_snapshot(loaded->trie, filename, now - 500) == 4);
+    assert(lookup(loaded, AF_INET, "8.8.8.8", &expires) == 15169);
+    assert(expires == now + 100);
+    assert(lookup(loaded, AF_INET, "1.1.1.1", &expires) == 13335);
+    assert(expires == now + 200);
+    assert(lookup(loaded, AF_INET, "10.0.0.1", NULL) == -1);
+    assert(lookup(loaded, AF_INET6, "2001:4860::8888", &expires) == 15169);
+    assert(expires == now + 300);
+    assert(lookup(loaded, AF_INET6, "2606:4700::1111", &expires) == 13335);
+    assert(expires == 0);
+    amp_asn_info_delete(loaded);
+
+    /* entries that expired before the cutoff aren't loaded */
+    loaded = initialise_asn_info();
+    assert(load_asn_snapshot(loaded->trie, filename, now + 150) == 3);
+    assert(lookup(loaded, AF_INET, "8.8.8.8", NULL) == -1);
+    assert(lookup(loaded, AF_INET, "1.1.1.1", NULL) == 13335);
+    amp_asn_info_delete(loaded);
+
+    /* a missing snapshot loads nothing */
+    check_rejected("/tmp/amp-asnstore-test-missing");
+
+    /* any change to the entries should be caught by the checksum */
+    copy_file(filename, damaged);
+    corrupt_file(damaged, sizeof(header) + sizeof(asn_snapshot_entry_t) + 9,
+            0xff);
+    check_rejected(damaged);
+
+    /* bad magic */
+    copy_file(filename, damaged);
+    corrupt_file(damaged, 0, 'X');
+    check_rejected(damaged);
+
+    /* snapshots written by a different version are ignored */
+    copy_file(filename, damaged);
+    corrupt_file(damaged, offsetof(asn_snapshot_header_t, version),
+            ASN_SNAPSHOT_VERSION + 1);
+    check_rejected(damaged);
+
+    /* a partially written snapshot is ignored */
+    copy_file(filename, damaged);
+    assert(truncate(damaged, sizeof(header) + 10) == 0);
+    check_rejected(damaged);
+
+    /* an empty cache is still a valid snapshot */
+    loaded = initialise_asn_info();
+    assert(save_asn_snapshot(loaded, damaged, 0) == 0);
+    assert(load_asn_snapshot(loaded->trie, damaged, 0) == 0);
+    amp_asn_info_delete(loaded);
+
+    amp_asn_info_delete(saved);
+    unlink(damaged);
+    unlink(filename);
+
+    return EXIT_SUCCESS;
+}
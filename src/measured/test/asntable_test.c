@@ -0,0 +1,217 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <arpa/inet.h>
+
+#include "asntable.h"
+#include "asnsock.h"
+
+/* CAIDA pfx2as lines, with nested, repeated and multi-origin prefixes */
+static char *pfx2as =
+    "# comment lines and blank lines are ignored\n"
+    "\n"
+    "10.0.0.0\t8\t100\n"
+    "10.1.0.0\t16\t200\n"
+    "10.1.2.0\t24\t300\n"
+    "10.1.2.0\t24\t301\n"
+    "10.2.0.0\t16\t100\n"
+    "192.168.0.0\t16\t400_401\n"
+    "172.16.0.0\t12\t500,501\n"
+    "255.255.255.0\t24\t600\n"
+    "2001:db8::\t32\t700\n"
+    "2001:db8:1::\t48\t{800}\n"
+    "ffff::\t16\t900\n"
+    "this line isn't a prefix\n"
+    "10.3.0.0\t40\t1\n";
+
+/*
+ * Routes from "bgpdump -m", the origin is the end of the AS path. Every peer
+ * lists the same prefix, and updates are ignored.
+ */
+static char *mrt =
+    "TABLE_DUMP2|1600000000|B|192.0.2.1|65000|203.0.113.0/24|"
+        "65000 3356 64496|IGP|192.0.2.1|0|0||NAG||\n"
+    "TABLE_DUMP2|1600000000|B|192.0.2.2|65001|203.0.113.0/24|"
+        "65001 174 64496|IGP|192.0.2.2|0|0||NAG||\n"
+    "TABLE_DUMP2|1600000000|B|192.0.2.1|65000|198.51.100.0/24|"
+        "65000 {64497,64498}|IGP|192.0.2.1|0|0||NAG||\n"
+    "TABLE_DUMP|1600000000|B|192.0.2.1|65000|100.64.0.0/10|"
+        "65000 64511|IGP|192.0.2.1|0|0||NAG||\n"
+    "BGP4MP|1600000000|A|192.0.2.1|65000|192.0.2.0/24|"
+        "65000 64499|IGP|192.0.2.1|0|0||NAG||\n"
+    "BGP4MP|1600000000|W|192.0.2.1|65000|203.0.113.0/24\n";
+
+
+
+/*
+ * Look up the AS for an address in the table.
+ */
+static int64_t lookup(asn_table_t *table, char *address) {
+    struct sockaddr_storage addr;
+
+    memset(&addr, 0, sizeof(addr));
+
+    if ( inet_pton(AF_INET, address,
+                &((struct sockaddr_in*)&addr)->sin_addr) == 1 ) {
+        addr.ss_family = AF_INET;
+    } else {
+        assert(inet_pton(AF_INET6, address,
+                    &((struct sockaddr_in6*)&addr)->sin6_addr) == 1);
+        addr.ss_family = AF_INET6;
+    }
+
+    return asn_table_lookup(table, (struct sockaddr*)&addr);
+}
+
+
+
+/*
+ * Check the longest matching prefix is found for every address.
+ */
+static void check_table(asn_table_t *table) {
+    assert(table);
+    /* repeated prefixes are only counted once */
+    assert(table->prefixes == 13);
+    assert(table->invalid == 2);
+
+    assert(lookup(table, "9.255.255.255") == -1);
+    assert(lookup(table, "10.0.0.1") == 100);
+    assert(lookup(table, "10.1.0.1") == 200);
+    assert(lookup(table, "10.1.2.5") == 301);
+    assert(lookup(table, "10.1.3.0") == 200);
+    assert(lookup(table, "10.1.255.255") == 200);
+    assert(lookup(table, "10.2.3.4") == 100);
+    assert(lookup(table, "10.255.255.255") == 100);
+    assert(lookup(table, "11.0.0.0") == -1);
+    assert(lookup(table, "172.31.255.255") == 500);
+    assert(lookup(table, "172.32.0.0") == -1);
+    assert(lookup(table, "192.168.1.1") == 400);
+    assert(lookup(table, "203.0.113.7") == 64496);
+    assert(lookup(table, "198.51.100.1") == 64497);
+    assert(lookup(table, "100.127.255.255") == 64511);
+    assert(lookup(table, "192.0.2.1") == -1);
+    assert(lookup(table, "255.255.254.255") == -1);
+    assert(lookup(table, "255.255.255.255") == 600);
+
+    assert(lookup(table, "2001:db7:ffff::") == -1);
+    assert(lookup(table, "2001:db8::1") == 700);
+    assert(lookup(table, "2001:db8:1::5") == 800);
+    assert(lookup(table, "2001:db8:2::") == 700);
+    assert(lookup(table, "2001:db9::") == -1);
+    assert(lookup(table, "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff") == 900);
+}
+
+
+
+/*
+ * Check that prefix tables are parsed from both formats, plain or gzipped,
+ * and that measured answers from them before using the cache.
+ */
+int main(void) {
+    char filename[] = "/tmp/amp-asntable-test-XXXXXX";
+    struct amp_asn_info *info;
+    struct iptrie result = { NULL, NULL, NULL };
+    struct sockaddr_in addr;
+    amp_asn_cache_t config;
+    asn_cache_stats_t stats;
+    asn_table_t *table;
+    gzFile gz;
+    FILE *out;
+    int fd;
+
+    /* missing files can't be loaded */
+    assert(load_asn_table("/tmp/amp-asntable-test-missing") == NULL);
+
+    /* plain text */
+    assert((fd = mkstemp(filename)) >= 0);
+    assert((out = fdopen(fd, "w")) != NULL);
+    fputs(pfx2as, out);
+    fputs(mrt, out);
+    fclose(out);
+
+    table = load_asn_table(filename);
+    check_table(table);
+    free_asn_table(table);
+
+    /* the same data gzipped */
+    assert((gz = gzopen(filename, "wb")) != NULL);
+    gzputs(gz, pfx2as);
+    gzputs(gz, mrt);
+    gzclose(gz);
+
+    table = load_asn_table(filename);
+    check_table(table);
+    free_asn_table(table);
+
+    /* addresses in the table are answered without using the cache */
+    info = initialise_asn_info();
+    memset(&config, 0, sizeof(config));
+    config.table = filename;
+    set_asn_cache_config(info, &config);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "10.1.2.5", &addr.sin_addr);
+    assert(amp_test_asn_cache_check(info, &result,
+                (struct sockaddr*)&addr) == 0);
+    assert(iptrie_lookup_as(&result, (struct sockaddr*)&addr) == 301);
+
+    inet_pton(AF_INET, "11.0.0.1", &addr.sin_addr);
+    assert(amp_test_asn_cache_check(info, &result,
+                (struct sockaddr*)&addr) < 0);
+
+    get_asn_cache_stats(&stats);
+    assert(stats.table_hits == 1);
+    assert(stats.table_loads == 1);
+    assert(stats.table_prefixes == 13);
+    assert(stats.hits == 0);
+    assert(stats.misses == 1);
+
+    iptrie_clear(&result);
+    amp_asn_info_delete(info);
+    unlink(filename);
+
+    return EXIT_SUCCESS;
+}
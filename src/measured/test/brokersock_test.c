@@ -0,0 +1,239 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+
+#include "brokersock.h"
+#include "tests.h"
+
+
+/*
+ * Relay a result from a child process, exiting with the relay status.
+ */
+static pid_t relay_in_child(char *path, amp_test_result_t *result) {
+    pid_t pid;
+
+    if ( (pid = fork()) == 0 ) {
+        exit(relay_result_to_parent(path, AMP_TEST_ICMP, result) == 0 ? 0 : 1);
+    }
+
+    assert(pid > 0);
+    return pid;
+}
+
+
+
+/*
+ * Read a relayed result as it arrives, the same way the event loop would
+ * each time the connection becomes readable.
+ */
+static int read_until_complete(struct relay_connection_t *conn) {
+    struct pollfd pfd;
+    int result;
+
+    pfd.fd = conn->fd;
+    pfd.events = POLLIN;
+
+    while ( (result = amp_test_read_relayed_result(conn)) == 0 ) {
+        assert(poll(&pfd, 1, 5000) == 1);
+    }
+
+    return result;
+}
+
+
+
+/*
+ * Accept a relayed result and check it matches what was sent, then reply
+ * with the given status and check the child saw the same status.
+ */
+static void check_relay(int sock, char *path, amp_test_result_t *result,
+        int8_t status) {
+    struct relay_connection_t conn;
+    int child_status;
+    pid_t pid;
+
+    pid = relay_in_child(path, result);
+
+    memset(&conn, 0, sizeof(conn));
+    assert((conn.fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK)) >= 0);
+    assert(read_until_complete(&conn) == 1);
+    assert(conn.header.type == AMP_TEST_ICMP);
+    assert(conn.result.timestamp == result->timestamp);
+    assert(conn.result.len == result->len);
+    assert(memcmp(conn.result.data, result->data, result->len) == 0);
+    assert(send(conn.fd, &status, sizeof(status), 0) == sizeof(status));
+    close(conn.fd);
+    free(conn.result.data);
+
+    assert(waitpid(pid, &child_status, 0) == pid);
+    assert(WIFEXITED(child_status));
+    assert(WEXITSTATUS(child_status) == (status == 0 ? 0 : 1));
+}
+
+
+
+/*
+ * Check that a result trickling in doesn't block the reader, and that bad
+ * or truncated results are rejected.
+ */
+static void check_partial_relay(void) {
+    struct relay_connection_t conn;
+    struct amp_relay_header header;
+    char data[] = "partial";
+    int sv[2];
+
+    memset(&header, 0, sizeof(header));
+    header.type = AMP_TEST_ICMP;
+    header.length = sizeof(data);
+    header.timestamp = 1234567890;
+
+    /* nothing sent yet, so there is nothing to read but no error */
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    memset(&conn, 0, sizeof(conn));
+    conn.fd = sv[0];
+    assert(amp_test_read_relayed_result(&conn) == 0);
+
+    /* half the header, then the rest plus some of the data */
+    assert(send(sv[1], &header, 4, 0) == 4);
+    assert(amp_test_read_relayed_result(&conn) == 0);
+    assert(conn.header_read == 4);
+    assert(send(sv[1], ((char*)&header) + 4, sizeof(header) - 4, 0) ==
+            sizeof(header) - 4);
+    assert(send(sv[1], data, 3, 0) == 3);
+    assert(amp_test_read_relayed_result(&conn) == 0);
+    assert(conn.data_read == 3);
+
+    /* the rest of the data completes the result */
+    assert(send(sv[1], data + 3, sizeof(data) - 3, 0) == sizeof(data) - 3);
+    assert(amp_test_read_relayed_result(&conn) == 1);
+    assert(memcmp(conn.result.data, data, sizeof(data)) == 0);
+    free(conn.result.data);
+    close(sv[0]);
+    close(sv[1]);
+
+    /* closing part way through a result is an error */
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    memset(&conn, 0, sizeof(conn));
+    conn.fd = sv[0];
+    assert(send(sv[1], &header, sizeof(header), 0) == sizeof(header));
+    close(sv[1]);
+    assert(amp_test_read_relayed_result(&conn) < 0);
+    free(conn.result.data);
+    close(sv[0]);
+
+    /* results that are too large are rejected before reading the data */
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    memset(&conn, 0, sizeof(conn));
+    conn.fd = sv[0];
+    header.length = BROKER_RELAY_MAX_LENGTH + 1;
+    assert(send(sv[1], &header, sizeof(header), 0) == sizeof(header));
+    assert(amp_test_read_relayed_result(&conn) < 0);
+    assert(conn.result.data == NULL);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+
+
+/*
+ * Check that test results can be handed to the main process to publish.
+ */
+int main(void) {
+    char dir[] = "/tmp/amp-broker-XXXXXX";
+    char path[sizeof(dir) + 16];
+    struct sockaddr_un addr;
+    amp_test_result_t result;
+    char small[] = "result";
+    char *large;
+    int sock;
+    int i;
+
+    assert(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/test.broker", dir);
+
+    /* without anything listening, the result can't be relayed */
+    result.timestamp = 1234567890;
+    result.len = sizeof(small);
+    result.data = small;
+    assert(relay_result_to_parent(path, AMP_TEST_ICMP, &result) < 0);
+    assert(relay_result_to_parent(NULL, AMP_TEST_ICMP, &result) < 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    assert((sock = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+    assert(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    assert(listen(sock, 1) == 0);
+
+    /* results are only accepted if they were queued to be published */
+    check_relay(sock, path, &result, 0);
+    check_relay(sock, path, &result, -1);
+
+    /* larger results take multiple reads */
+    large = malloc(1024 * 1024);
+    for ( i = 0; i < 1024 * 1024; i++ ) {
+        large[i] = i % 251;
+    }
+    result.len = 1024 * 1024;
+    result.data = large;
+    check_relay(sock, path, &result, 0);
+
+    /* an empty result is still a valid result */
+    result.len = 0;
+    check_relay(sock, path, &result, 0);
+
+    check_partial_relay();
+
+    free(large);
+    close(sock);
+    unlink(path);
+    rmdir(dir);
+
+    return 0;
+}
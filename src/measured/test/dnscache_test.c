@@ -0,0 +1,351 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "dnscache.h"
+#include "schedule.h"
+
+#define MAX_ADDRESSES 8
+#define DNS_TYPE_A 0x01
+#define DNS_TYPE_AAAA 0x1c
+
+
+
+/*
+ * The cache normally refreshes names from the schedule timers, but the sweep
+ * timer is never started by this test.
+ */
+amp_timer_heap_t *get_schedule_timers(
+        __attribute__((unused))wand_event_handler_t *ev_hdl) {
+    assert(0);
+    return NULL;
+}
+
+
+
+/*
+ * Give the cache an answer for a name, as if it had come from the resolver.
+ */
+static void answer(char *name, int qtype, int count, int ttl, int rcode) {
+    struct ub_result result;
+    char *data[MAX_ADDRESSES + 1];
+    int len[MAX_ADDRESSES + 1];
+    char addrs[MAX_ADDRESSES][16];
+    int i;
+
+    assert(count <= MAX_ADDRESSES);
+
+    for ( i = 0; i < count; i++ ) {
+        memset(addrs[i], i + 1, sizeof(addrs[i]));
+        data[i] = addrs[i];
+        len[i] = (qtype == DNS_TYPE_A) ? 4 : 16;
+    }
+    data[count] = NULL;
+
+    memset(&result, 0, sizeof(result));
+    result.qname = name;
+    result.qtype = qtype;
+    result.qclass = 1;
+    result.data = data;
+    result.len = len;
+    result.havedata = (count > 0);
+    result.rcode = rcode;
+    result.nxdomain = (rcode == 3);
+    result.ttl = ttl;
+
+    amp_test_dns_cache_answer(&result);
+}
+
+
+
+/*
+ * Resolve a name through the cache and return how many addresses it has.
+ * There is no resolver, so anything not cached fails straight away.
+ */
+static int resolve(char *name, int family, int max) {
+    struct addrinfo *addrlist = NULL, *item;
+    pthread_mutex_t lock;
+    int remaining = 0;
+    int count = 0;
+
+    pthread_mutex_init(&lock, NULL);
+
+    dns_cache_resolve_add(NULL, &addrlist, &lock, name, family, max,
+            &remaining, NULL, NULL);
+    assert(remaining == 0);
+
+    for ( item = addrlist; item != NULL; item = item->ai_next ) {
+        assert(family == AF_UNSPEC || item->ai_family == family);
+        assert(item->ai_addr->sa_family == item->ai_family);
+        assert(strcmp(item->ai_canonname, name) == 0);
+        count++;
+    }
+
+    amp_resolve_freeaddr(addrlist);
+    pthread_mutex_destroy(&lock);
+
+    return count;
+}
+
+
+
+/*
+ * Check that answers are cached for the right amount of time, and the hit
+ * and miss counters are updated.
+ */
+static void check_cache(void) {
+    dns_cache_stats_t before, after;
+
+    get_dns_cache_stats(&before);
+
+    /* nothing is cached yet */
+    assert(resolve("www.example.com", AF_UNSPEC, 0) == 0);
+    get_dns_cache_stats(&after);
+    assert(after.misses == before.misses + 2);
+    assert(after.hits == before.hits);
+
+    answer("www.example.com", DNS_TYPE_A, 3, 300, 0);
+    answer("www.example.com", DNS_TYPE_AAAA, 2, 100, 0);
+
+    /* both address families are answered from the cache */
+    get_dns_cache_stats(&before);
+    assert(resolve("www.example.com", AF_UNSPEC, 0) == 5);
+    assert(resolve("www.example.com", AF_INET, 0) == 3);
+    assert(resolve("www.example.com", AF_INET6, 0) == 2);
+    assert(resolve("WWW.Example.COM", AF_UNSPEC, 0) == 5);
+    get_dns_cache_stats(&after);
+    assert(after.hits == before.hits + 6);
+    assert(after.misses == before.misses);
+    assert(after.entries == 2);
+
+    /* the maximum is shared between address families */
+    assert(resolve("www.example.com", AF_UNSPEC, 4) == 4);
+    assert(resolve("www.example.com", AF_UNSPEC, 2) == 2);
+
+    /* the AAAA answer expires first */
+    amp_test_dns_cache_advance(101);
+    get_dns_cache_stats(&before);
+    assert(resolve("www.example.com", AF_UNSPEC, 0) == 3);
+    get_dns_cache_stats(&after);
+    assert(after.hits == before.hits + 1);
+    assert(after.misses == before.misses + 1);
+
+    /* long TTLs are limited to the maximum */
+    answer("long.example.com", DNS_TYPE_A, 1, 100000, 0);
+    assert(resolve("long.example.com", AF_INET, 0) == 1);
+    amp_test_dns_cache_advance(601);
+    assert(resolve("long.example.com", AF_INET, 0) == 0);
+}
+
+
+
+/*
+ * Check that names without addresses are remembered, but failures aren't.
+ */
+static void check_negative(void) {
+    dns_cache_stats_t before, after;
+
+    answer("missing.example.com", DNS_TYPE_A, 0, 0, 3);
+    answer("missing.example.com", DNS_TYPE_AAAA, 0, 0, 3);
+    answer("v4only.example.com", DNS_TYPE_A, 1, 300, 0);
+    answer("v4only.example.com", DNS_TYPE_AAAA, 0, 0, 0);
+
+    get_dns_cache_stats(&before);
+    assert(resolve("missing.example.com", AF_UNSPEC, 0) == 0);
+    assert(resolve("v4only.example.com", AF_UNSPEC, 0) == 1);
+    get_dns_cache_stats(&after);
+    assert(after.hits == before.hits + 4);
+    assert(after.negative_hits == before.negative_hits + 3);
+    assert(after.misses == before.misses);
+
+    /* negative answers expire after the negative TTL */
+    amp_test_dns_cache_advance(61);
+    get_dns_cache_stats(&before);
+    assert(resolve("missing.example.com", AF_UNSPEC, 0) == 0);
+    assert(resolve("v4only.example.com", AF_UNSPEC, 0) == 1);
+    get_dns_cache_stats(&after);
+    assert(after.misses == before.misses + 3);
+
+    /* server failures aren't cached */
+    get_dns_cache_stats(&before);
+    answer("broken.example.com", DNS_TYPE_A, 0, 0, 2);
+    get_dns_cache_stats(&after);
+    assert(after.stored == before.stored);
+    assert(after.entries == before.entries);
+}
+
+
+
+/*
+ * Check that the cache doesn't grow past the maximum size, and that expired
+ * answers are thrown away to make room for new ones.
+ */
+static void check_full(void) {
+    dns_cache_stats_t before, after;
+    char name[64];
+    int i;
+
+    get_dns_cache_stats(&before);
+    for ( i = 0; i < 10; i++ ) {
+        snprintf(name, sizeof(name), "host%d.example.com", i);
+        answer(name, DNS_TYPE_A, 1, 10, 0);
+    }
+    get_dns_cache_stats(&after);
+    assert(after.entries == 8);
+    assert(after.full == before.full + 2);
+    assert(resolve("host7.example.com", AF_INET, 0) == 1);
+    assert(resolve("host8.example.com", AF_INET, 0) == 0);
+
+    amp_test_dns_cache_advance(11);
+    answer("host8.example.com", DNS_TYPE_A, 1, 10, 0);
+    get_dns_cache_stats(&after);
+    assert(after.entries == 1);
+    assert(after.expired >= before.expired + 8);
+    assert(resolve("host8.example.com", AF_INET, 0) == 1);
+}
+
+
+
+/*
+ * Check that only names used by tests that are about to run are refreshed,
+ * and only if the cached answer won't last until the test runs.
+ */
+static void check_prefetch(void) {
+    amp_timer_heap_t heap;
+    amp_timer_t timers[2];
+    amp_timer_t *timer_list[2];
+    schedule_item_t items[2];
+    test_schedule_item_t tests[2];
+    resolve_dest_t soon, later;
+    struct timeval now = {1000, 0};
+    dns_cache_stats_t before, after;
+
+    memset(&heap, 0, sizeof(heap));
+    memset(timers, 0, sizeof(timers));
+    memset(items, 0, sizeof(items));
+    memset(tests, 0, sizeof(tests));
+    memset(&soon, 0, sizeof(soon));
+    memset(&later, 0, sizeof(later));
+
+    soon.name = "soon.example.com";
+    soon.family = AF_UNSPEC;
+    later.name = "later.example.com";
+    later.family = AF_INET;
+
+    /* one test runs in 10 seconds, the other in 60 */
+    tests[0].resolve = &soon;
+    tests[1].resolve = &later;
+    items[0].type = items[1].type = EVENT_RUN_TEST;
+    items[0].data.test = &tests[0];
+    items[1].data.test = &tests[1];
+    timers[0].expire.tv_sec = now.tv_sec + 10;
+    timers[0].data = &items[0];
+    timers[1].expire.tv_sec = now.tv_sec + 60;
+    timers[1].data = &items[1];
+    timer_list[0] = &timers[0];
+    timer_list[1] = &timers[1];
+    heap.timers = timer_list;
+    heap.count = 2;
+
+    /* only the test that is about to run has its names refreshed */
+    get_dns_cache_stats(&before);
+    amp_test_dns_cache_prefetch(&heap, &now);
+    get_dns_cache_stats(&after);
+    assert(after.prefetches == before.prefetches + 2);
+
+    /* answers that last until the test runs aren't refreshed again */
+    answer("soon.example.com", DNS_TYPE_A, 1, 300, 0);
+    answer("soon.example.com", DNS_TYPE_AAAA, 1, 5, 0);
+    get_dns_cache_stats(&before);
+    amp_test_dns_cache_prefetch(&heap, &now);
+    get_dns_cache_stats(&after);
+    assert(after.prefetches == before.prefetches + 1);
+
+    /* the test finds its names in the cache when it runs */
+    get_dns_cache_stats(&before);
+    assert(resolve("soon.example.com", AF_UNSPEC, 0) == 2);
+    get_dns_cache_stats(&after);
+    assert(after.hits == before.hits + 2);
+    assert(after.misses == before.misses);
+
+    /* the other test is refreshed once it gets close enough */
+    now.tv_sec += 40;
+    get_dns_cache_stats(&before);
+    amp_test_dns_cache_prefetch(&heap, &now);
+    get_dns_cache_stats(&after);
+    assert(after.prefetches == before.prefetches + 1);
+}
+
+
+
+/*
+ *
+ */
+int main(void) {
+    amp_dns_cache_t config;
+
+    config.enabled = 1;
+    config.max_entries = 8;
+    config.max_ttl = 600;
+    config.negative_ttl = 60;
+    config.prefetch = 30;
+    set_dns_cache_config(NULL, NULL, &config);
+
+    check_cache();
+    check_negative();
+
+    close_dns_cache();
+    set_dns_cache_config(NULL, NULL, &config);
+    check_full();
+
+    close_dns_cache();
+    set_dns_cache_config(NULL, NULL, &config);
+    check_prefetch();
+
+    close_dns_cache();
+
+    return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_addr.h>
+#include <linux/if_link.h>
+
+#include "ifmonitor.h"
+#include "ifsnapshot.h"
+
+#define BUFFER_SIZE 4096
+
+
+
+/*
+ * Add an attribute to the end of a netlink message.
+ */
+static void add_attribute(struct nlmsghdr *nh, int type, void *data, int len) {
+    struct rtattr *rta;
+
+    rta = (struct rtattr *)(((char *)nh) + NLMSG_ALIGN(nh->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+
+
+/*
+ * Tell the monitor that an interface was added or removed.
+ */
+static void send_link(int type, int index, char *name, unsigned int flags) {
+    char buffer[BUFFER_SIZE] __attribute__((aligned(4)));
+    struct nlmsghdr *nh = (struct nlmsghdr *)buffer;
+    struct ifinfomsg *ifi;
+
+    memset(buffer, 0, sizeof(buffer));
+    nh->nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    nh->nlmsg_type = type;
+    ifi = NLMSG_DATA(nh);
+    ifi->ifi_family = AF_UNSPEC;
+    ifi->ifi_index = index;
+    ifi->ifi_flags = flags;
+    add_attribute(nh, IFLA_IFNAME, name, strlen(name) + 1);
+
+    assert(amp_test_ifmonitor_process(buffer, nh->nlmsg_len) == 0);
+}
+
+
+
+/*
+ * Tell the monitor that an address was added or removed, optionally with
+ * an IPv4 label.
+ */
+static void send_address(int type, int index, int family, char *address,
+        int prefixlen, char *label) {
+    char buffer[BUFFER_SIZE] __attribute__((aligned(4)));
+    struct nlmsghdr *nh = (struct nlmsghdr *)buffer;
+    struct ifaddrmsg *ifa;
+    struct in6_addr addr;
+
+    assert(inet_pton(family, address, &addr) == 1);
+
+    memset(buffer, 0, sizeof(buffer));
+    nh->nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+    nh->nlmsg_type = type;
+    ifa = NLMSG_DATA(nh);
+    ifa->ifa_family = family;
+    ifa->ifa_index = index;
+    ifa->ifa_prefixlen = prefixlen;
+    add_attribute(nh, IFA_ADDRESS, &addr, family == AF_INET ?
+            sizeof(struct in_addr) : sizeof(struct in6_addr));
+    if ( label != NULL ) {
+        add_attribute(nh, IFA_LABEL, label, strlen(label) + 1);
+    }
+
+    assert(amp_test_ifmonitor_process(buffer, nh->nlmsg_len) == 0);
+}
+
+
+
+/*
+ * Find the name of the interface with the given address.
+ */
+static char *lookup_name(int family, char *address, char *name, size_t len) {
+    struct sockaddr_storage ss;
+
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_family = family;
+
+    if ( family == AF_INET ) {
+        inet_pton(AF_INET, address, &((struct sockaddr_in *)&ss)->sin_addr);
+    } else {
+        inet_pton(AF_INET6, address, &((struct sockaddr_in6 *)&ss)->sin6_addr);
+    }
+
+    if ( amp_interface_name((struct sockaddr *)&ss, name, len) < 0 ) {
+        return NULL;
+    }
+
+    return name;
+}
+
+
+
+/*
+ * Check that the families available on an interface are as expected.
+ */
+static void check_families(char *ifname, int ipv4, int ipv6) {
+    int seen_ipv4, seen_ipv6;
+
+    assert(amp_interface_families(ifname, &seen_ipv4, &seen_ipv6) == 0);
+    assert(seen_ipv4 == ipv4);
+    assert(seen_ipv6 == ipv6);
+}
+
+
+
+/*
+ * Check that netlink link and address messages are reflected in the shared
+ * interface snapshot, including in processes forked from the writer.
+ */
+int main(void) {
+    struct amp_ifsnapshot *copy;
+    ifmonitor_stats_t stats;
+    char name[IF_NAMESIZE];
+    pid_t pid;
+    int status;
+
+    copy = malloc(sizeof(struct amp_ifsnapshot));
+
+    /* two interfaces, one with both families, one with only IPv6 */
+    send_link(RTM_NEWLINK, 1, "lo", IFF_UP | IFF_LOOPBACK);
+    send_link(RTM_NEWLINK, 2, "eth0", IFF_UP);
+    send_link(RTM_NEWLINK, 3, "eth1", 0);
+    send_address(RTM_NEWADDR, 1, AF_INET, "127.0.0.1", 8, NULL);
+    send_address(RTM_NEWADDR, 2, AF_INET, "192.0.2.1", 24, NULL);
+    send_address(RTM_NEWADDR, 2, AF_INET6, "2001:db8::1", 64, NULL);
+    send_address(RTM_NEWADDR, 3, AF_INET6, "2001:db8:1::1", 64, NULL);
+
+    assert(amp_ifsnapshot_read(copy) == 0);
+    assert(copy->count == 4);
+    assert(copy->truncated == 0);
+
+    check_families(NULL, 1, 1);
+    check_families("eth0", 1, 1);
+    check_families("eth1", 0, 1);
+    check_families("lo", 1, 0);
+    check_families("eth2", 0, 0);
+
+    assert(strcmp(lookup_name(AF_INET, "192.0.2.1", name, sizeof(name)),
+                "eth0") == 0);
+    assert(strcmp(lookup_name(AF_INET6, "2001:db8:1::1", name, sizeof(name)),
+                "eth1") == 0);
+    assert(lookup_name(AF_INET, "192.0.2.2", name, sizeof(name)) == NULL);
+
+    /* repeating an address doesn't add it twice */
+    send_address(RTM_NEWADDR, 2, AF_INET, "192.0.2.1", 24, NULL);
+    assert(amp_ifsnapshot_read(copy) == 0);
+    assert(copy->count == 4);
+
+    /* removing an address updates the families */
+    send_address(RTM_DELADDR, 2, AF_INET, "192.0.2.1", 24, NULL);
+    check_families("eth0", 0, 1);
+    assert(lookup_name(AF_INET, "192.0.2.1", name, sizeof(name)) == NULL);
+
+    /* renaming an interface renames all its addresses */
+    send_link(RTM_NEWLINK, 3, "wan0", IFF_UP);
+    check_families("eth1", 0, 0);
+    check_families("wan0", 0, 1);
+
+    /* labelled IPv4 addresses keep their label, like getifaddrs() */
+    send_address(RTM_NEWADDR, 3, AF_INET, "203.0.113.1", 24, "wan0:1");
+    assert(strcmp(lookup_name(AF_INET, "203.0.113.1", name, sizeof(name)),
+                "wan0:1") == 0);
+    check_families("wan0:1", 1, 0);
+    check_families("wan0", 0, 1);
+    send_address(RTM_DELADDR, 3, AF_INET, "203.0.113.1", 24, "wan0:1");
+
+    /* removing an interface removes all its addresses */
+    send_link(RTM_DELLINK, 2, "eth0", 0);
+    assert(amp_ifsnapshot_read(copy) == 0);
+    assert(copy->count == 2);
+    check_families("eth0", 0, 0);
+
+    /* a forked child sees changes made after it was forked */
+    if ( (pid = fork()) == 0 ) {
+        while ( lookup_name(AF_INET, "198.51.100.1", name,
+                    sizeof(name)) == NULL ) {
+            usleep(1000);
+        }
+        exit(strcmp(name, "wan0") == 0 ? 0 : 1);
+    }
+
+    assert(pid > 0);
+    send_address(RTM_NEWADDR, 3, AF_INET, "198.51.100.1", 24, NULL);
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    get_interface_monitor_stats(&stats);
+    assert(stats.links == 2);
+    assert(stats.addresses == 3);
+    assert(stats.resync_failures == 0);
+
+    /* after a failed dump the partial lists are never published */
+    amp_test_ifmonitor_resync_failed();
+    assert(amp_ifsnapshot_read(copy) < 0);
+    send_link(RTM_NEWLINK, 4, "eth2", IFF_UP);
+    send_address(RTM_NEWADDR, 4, AF_INET, "203.0.113.1", 24, NULL);
+    assert(amp_ifsnapshot_read(copy) < 0);
+    assert(copy->valid == 0);
+
+    get_interface_monitor_stats(&stats);
+    assert(stats.resync_failures == 1);
+
+    stop_interface_monitor();
+
+    /* without a snapshot there is nothing to read */
+    assert(amp_ifsnapshot_read(copy) < 0);
+
+    free(copy);
+
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <zlib.h>
+
+#include "messaging.h"
+#include "modules.h"
+#include "tests.h"
+
+#define LARGE_RESULT_LENGTH (64 * 1024)
+
+
+
+/*
+ * Check that a header has the expected key and string value.
+ */
+static void check_string_header(amqp_table_entry_t *entry, char *key,
+        char *value) {
+    assert(entry->key.len == strlen(key));
+    assert(memcmp(entry->key.bytes, key, entry->key.len) == 0);
+    assert(entry->value.kind == AMQP_FIELD_KIND_UTF8);
+    assert(entry->value.value.bytes.len == strlen(value));
+    assert(memcmp(entry->value.value.bytes.bytes, value,
+                entry->value.value.bytes.len) == 0);
+}
+
+
+
+/*
+ * Build the message for a result, and check that it was only compressed if
+ * it was expected to be. Compressed messages must have both compression
+ * headers, and must decompress back to the original result.
+ */
+static void check_message(amp_test_result_t *result, int compressed) {
+    amqp_table_t headers;
+    amqp_table_entry_t entries[AMQP_RESULT_HEADER_COUNT];
+    amqp_bytes_t body;
+    uLongf length;
+    char *uncompressed;
+    void *data;
+
+    data = amp_test_build_result_message(AMP_TEST_ICMP, result, &headers,
+            entries, &body);
+
+    check_string_header(&headers.entries[0], "x-amp-test-type", "icmp");
+
+    if ( !compressed ) {
+        assert(data == NULL);
+        assert(headers.num_entries == 1);
+        assert(body.bytes == result->data);
+        assert(body.len == result->len);
+        return;
+    }
+
+    assert(data != NULL);
+    assert(body.bytes == data);
+    assert(body.len < result->len);
+    assert(headers.num_entries == 3);
+
+    check_string_header(&headers.entries[1], AMQP_COMPRESSION_HEADER,
+            AMQP_COMPRESSION_ZLIB);
+
+    assert(headers.entries[2].key.len ==
+            strlen(AMQP_UNCOMPRESSED_LENGTH_HEADER));
+    assert(memcmp(headers.entries[2].key.bytes,
+                AMQP_UNCOMPRESSED_LENGTH_HEADER,
+                headers.entries[2].key.len) == 0);
+    assert(headers.entries[2].value.kind == AMQP_FIELD_KIND_I64);
+    assert(headers.entries[2].value.value.i64 == (int64_t)result->len);
+
+    /* the other end should get back exactly what the test reported */
+    length = result->len;
+    uncompressed = malloc(length);
+    assert(uncompress((Bytef *)uncompressed, &length, body.bytes,
+                body.len) == Z_OK);
+    assert(length == result->len);
+    assert(memcmp(uncompressed, result->data, length) == 0);
+
+    free(uncompressed);
+    free(data);
+}
+
+
+
+/*
+ * Check that large results are compressed before they are published, and
+ * that anything else is published as it is.
+ */
+int main(void) {
+    amp_publisher_t config;
+    amp_test_result_t result;
+    publish_stats_t stats;
+    test_t icmp;
+    char *large;
+    int i;
+
+    memset(&icmp, 0, sizeof(icmp));
+    icmp.name = "icmp";
+    amp_tests[AMP_TEST_ICMP] = &icmp;
+
+    memset(&config, 0, sizeof(config));
+    config.batch_size = DEFAULT_PUBLISH_BATCH_SIZE;
+    config.batch_delay = DEFAULT_PUBLISH_BATCH_DELAY;
+    config.window = DEFAULT_PUBLISH_WINDOW;
+    config.compress = 1;
+    config.compress_threshold = DEFAULT_COMPRESS_THRESHOLD;
+    config.compress_level = DEFAULT_COMPRESS_LEVEL;
+    set_publisher_config(NULL, &config);
+
+    /* a large result that compresses well */
+    large = malloc(LARGE_RESULT_LENGTH);
+    for ( i = 0; i < LARGE_RESULT_LENGTH; i++ ) {
+        large[i] = "abcdefgh"[i % 8];
+    }
+    result.timestamp = 1234567890;
+    result.data = large;
+    result.len = LARGE_RESULT_LENGTH;
+    check_message(&result, 1);
+
+    /* a result exactly at the threshold is compressed too */
+    result.len = DEFAULT_COMPRESS_THRESHOLD;
+    check_message(&result, 1);
+
+    /* anything smaller than the threshold isn't */
+    result.len = DEFAULT_COMPRESS_THRESHOLD - 1;
+    check_message(&result, 0);
+
+    /* a result that doesn't get any smaller is sent uncompressed */
+    srandom(1);
+    for ( i = 0; i < LARGE_RESULT_LENGTH; i++ ) {
+        large[i] = random() & 0xff;
+    }
+    result.len = LARGE_RESULT_LENGTH;
+    check_message(&result, 0);
+
+    get_publish_stats(&stats);
+    assert(stats.compressed == 2);
+    assert(stats.uncompressed_bytes ==
+            LARGE_RESULT_LENGTH + DEFAULT_COMPRESS_THRESHOLD);
+
+    /* nothing is compressed when compression is turned off */
+    for ( i = 0; i < LARGE_RESULT_LENGTH; i++ ) {
+        large[i] = "abcdefgh"[i % 8];
+    }
+    config.compress = 0;
+    set_publisher_config(NULL, &config);
+    check_message(&result, 0);
+
+    free(large);
+
+    return 0;
+}
@@ -38,8 +38,13 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include "nametable.h"
@@ -134,11 +139,108 @@ static struct addrinfo *get_addr(char *address) {
 }
 
 
+/*
+ * Write out a nametable file with the given contents. The modification time
+ * is moved forward each time, so that rewriting a file within the same clock
+ * tick is still seen as a change.
+ */
+static void write_nametable(char *dir, char *name, char *contents) {
+    static time_t mtime = 1000000000;
+    char filename[256];
+    struct timespec times[2];
+    FILE *out;
+
+    snprintf(filename, sizeof(filename), "%s/%s", dir, name);
+    assert((out = fopen(filename, "w")) != NULL);
+    fprintf(out, "%s", contents);
+    fclose(out);
+
+    times[0].tv_sec = times[1].tv_sec = mtime++;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    assert(utimensat(AT_FDCWD, filename, times, 0) == 0);
+}
+
+
+
+/*
+ * Check that reloading nametable files only reads the files that have
+ * changed, keeping the addresses from the files that haven't.
+ */
+static void check_reload(void) {
+    char dir[] = "/tmp/amp-nametable-XXXXXX";
+    char filename[256];
+    struct addrinfo *kept;
+    nametable_t *item;
+    FILE *out;
+    int i;
+
+    assert(mkdtemp(dir) != NULL);
+    write_nametable(dir, "a.name", "alpha 192.0.2.1\nshared 192.0.2.10\n");
+    write_nametable(dir, "b.name", "beta 192.0.2.2\nshared 192.0.2.20\n");
+    write_nametable(dir, "c.name", "gamma 192.0.2.3\n");
+
+    read_nametable_dir(dir);
+    assert(nametable_test_get_count() == 4);
+    assert((item = name_to_address("shared")) != NULL);
+    assert(item->count == 2);
+    assert((item = name_to_address("alpha")) != NULL);
+    kept = item->addr;
+
+    /* nothing changed, so the same addresses should still be there */
+    begin_nametable_reload();
+    read_nametable_dir(dir);
+    finish_nametable_reload();
+    assert(nametable_test_get_count() == 4);
+    assert(name_to_address("alpha")->addr == kept);
+    assert(name_to_address("shared")->count == 2);
+
+    /* change one file and remove another, leaving the first one alone */
+    write_nametable(dir, "b.name", "delta 192.0.2.4\nshared 192.0.2.30\n");
+    snprintf(filename, sizeof(filename), "%s/c.name", dir);
+    unlink(filename);
+    begin_nametable_reload();
+    read_nametable_dir(dir);
+    finish_nametable_reload();
+    assert(nametable_test_get_count() == 3);
+    assert(name_to_address("alpha")->addr == kept);
+    assert(name_to_address("beta") == NULL);
+    assert(name_to_address("gamma") == NULL);
+    assert(name_to_address("delta") != NULL);
+    assert((item = name_to_address("shared")) != NULL);
+    assert(item->count == 2);
+    assert(item->addr->ai_next != NULL);
+    assert(item->addr->ai_next->ai_next == NULL);
+
+    /* lots of names should still all be found */
+    clear_nametable();
+    snprintf(filename, sizeof(filename), "%s/a.name", dir);
+    assert((out = fopen(filename, "w")) != NULL);
+    for ( i = 0; i < 5000; i++ ) {
+        fprintf(out, "host%d 10.%d.%d.1\n", i, i / 256, i % 256);
+    }
+    fclose(out);
+    snprintf(filename, sizeof(filename), "%s/b.name", dir);
+    unlink(filename);
+    read_nametable_dir(dir);
+    assert(nametable_test_get_count() == 5000);
+    assert(name_to_address("host0") != NULL);
+    assert(name_to_address("host4999") != NULL);
+    assert(name_to_address("host5000") == NULL);
+
+    clear_nametable();
+    assert(nametable_test_get_count() == 0);
+
+    snprintf(filename, sizeof(filename), "%s/a.name", dir);
+    unlink(filename);
+    rmdir(dir);
+}
+
+
+
 /*
  *
  */
 int main(void) {
-    extern nametable_t *name_table;
     struct addrinfo *addr1, *addr2, *addr3;
     char *name1 = "test.target.name1";
     char *name2 = "test.target.name2";
@@ -149,15 +251,15 @@ int main(void) {
     addr3 = get_addr("8.8.8.8");
 
     /* nametable is defined in nametable.c and should start empty */
-    assert(name_table == NULL);
+    assert(nametable_test_get_count() == 0);
 
     /* clearing an empty nametable should result in an empty nametable */
     clear_nametable();
-    assert(name_table == NULL);
+    assert(nametable_test_get_count() == 0);
 
     /* check that if we insert a name, it appears in the list */
     nametable_test_insert_nametable_entry(name1, addr1);
-    assert(name_table != NULL);
+    assert(nametable_test_get_count() == 1);
     name_item = name_to_address(name1);
     check_name_response(name_item, name1, 1, addr1, NULL);
 
@@ -180,7 +282,10 @@ int main(void) {
 
     /* clearing the nametable should result in an empty nametable */
     clear_nametable();
-    assert(name_table == NULL);
+    assert(nametable_test_get_count() == 0);
+    assert(name_to_address(name1) == NULL);
+
+    check_reload();
 
     return 0;
 }
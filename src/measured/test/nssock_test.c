@@ -0,0 +1,280 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "nssock.h"
+#include "dnscache.h"
+#include "ampresolv.h"
+
+#define BIG_BATCH 1000
+
+
+
+/*
+ * Pretend to resolve a name, giving it "max" addresses of the requested
+ * family straight away. Names starting with "none" have no addresses.
+ */
+void dns_cache_resolve_add(__attribute__((unused))struct ub_ctx *ctx,
+        struct addrinfo **res, pthread_mutex_t *addrlist_lock, char *name,
+        int family, int max, __attribute__((unused))int *remaining,
+        __attribute__((unused))void (*notify)(void *),
+        __attribute__((unused))void *notify_data) {
+
+    struct addrinfo *item;
+    int i;
+
+    if ( strncmp(name, "none", 4) == 0 ) {
+        return;
+    }
+
+    pthread_mutex_lock(addrlist_lock);
+    for ( i = 0; i < max; i++ ) {
+        item = calloc(1, sizeof(struct addrinfo));
+        item->ai_family = family;
+        item->ai_canonname = strdup(name);
+
+        if ( family == AF_INET ) {
+            struct sockaddr_in *addr = calloc(1, sizeof(struct sockaddr_in));
+            addr->sin_family = AF_INET;
+            addr->sin_addr.s_addr = htonl(0x0a000001 + i);
+            item->ai_addr = (struct sockaddr *)addr;
+            item->ai_addrlen = sizeof(struct sockaddr_in);
+        } else {
+            struct sockaddr_in6 *addr = calloc(1, sizeof(struct sockaddr_in6));
+            addr->sin6_family = AF_INET6;
+            addr->sin6_addr.s6_addr[15] = i + 1;
+            item->ai_addr = (struct sockaddr *)addr;
+            item->ai_addrlen = sizeof(struct sockaddr_in6);
+        }
+
+        item->ai_next = *res;
+        *res = item;
+    }
+    pthread_mutex_unlock(addrlist_lock);
+}
+
+
+
+/*
+ * Create a connection to the resolver threads, returning the client end.
+ */
+static int connect_resolver(worker_pool_t *pool) {
+    int sockets[2];
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    assert(worker_pool_add_connection(pool, sockets[1]) == 0);
+
+    return sockets[0];
+}
+
+
+
+/*
+ * Count the addresses in a list that match the name and family.
+ */
+static int count_addresses(struct addrinfo *addrlist, char *name, int family) {
+    struct addrinfo *item;
+    int count = 0;
+
+    for ( item = addrlist; item != NULL; item = item->ai_next ) {
+        assert(item->ai_addr);
+        assert(item->ai_canonname);
+        assert(item->ai_addr->sa_family == item->ai_family);
+        assert(item->ai_addrlen == (item->ai_family == AF_INET ?
+                    sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6)));
+
+        if ( strcmp(item->ai_canonname, name) == 0 &&
+                item->ai_family == family ) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+
+
+/*
+ * Count all the addresses in a list.
+ */
+static int list_length(struct addrinfo *addrlist) {
+    int count = 0;
+
+    for ( ; addrlist != NULL; addrlist = addrlist->ai_next ) {
+        count++;
+    }
+
+    return count;
+}
+
+
+
+/*
+ * Send some names to the resolver threads using the batched protocol.
+ */
+static struct addrinfo *resolve_batch(worker_pool_t *pool,
+        resolve_dest_t *resolve) {
+    amp_resolve_batch_t batch;
+    int fd = connect_resolver(pool);
+
+    amp_resolve_batch_init(&batch);
+    for ( ; resolve != NULL; resolve = resolve->next ) {
+        assert(amp_resolve_batch_add(&batch, resolve) == 0);
+    }
+    assert(amp_resolve_batch_send(fd, &batch) == 0);
+    amp_resolve_batch_free(&batch);
+
+    return amp_resolve_get_batch_list(fd);
+}
+
+
+
+/*
+ * Send some names to the resolver threads using the original protocol.
+ */
+static struct addrinfo *resolve_legacy(worker_pool_t *pool,
+        resolve_dest_t *resolve) {
+    int fd = connect_resolver(pool);
+
+    for ( ; resolve != NULL; resolve = resolve->next ) {
+        assert(amp_resolve_add_new(fd, resolve) == 0);
+    }
+    assert(amp_resolve_flag_done(fd) == 0);
+
+    return amp_resolve_get_list(fd);
+}
+
+
+
+/*
+ * Check that the resolver threads answer both the batched and the original
+ * protocols, and that the batch encoding survives being split up.
+ */
+int main(void) {
+    struct ub_ctx *ctx;
+    worker_pool_t *pool;
+    struct addrinfo *addrlist;
+    resolve_dest_t dests[3], *big;
+    char names[BIG_BATCH][16];
+    char longname[MAX_DNS_NAME_LEN + 1];
+    amp_resolve_batch_t batch;
+    int i;
+
+    ctx = ub_ctx_create();
+    assert(ctx);
+    pool = start_resolver_pool(ctx, 2);
+    assert(pool);
+
+    memset(dests, 0, sizeof(dests));
+    dests[0].name = "www.example.com";
+    dests[0].count = 2;
+    dests[0].family = AF_INET;
+    dests[0].next = &dests[1];
+    dests[1].name = "www.example.org";
+    dests[1].count = 3;
+    dests[1].family = AF_INET6;
+    dests[1].next = &dests[2];
+    dests[2].name = "none.example.net";
+    dests[2].count = 1;
+    dests[2].family = AF_INET;
+
+    /* both protocols should give the same answers */
+    addrlist = resolve_batch(pool, dests);
+    assert(list_length(addrlist) == 5);
+    assert(count_addresses(addrlist, "www.example.com", AF_INET) == 2);
+    assert(count_addresses(addrlist, "www.example.org", AF_INET6) == 3);
+    amp_resolve_freeaddr(addrlist);
+
+    addrlist = resolve_legacy(pool, dests);
+    assert(list_length(addrlist) == 5);
+    assert(count_addresses(addrlist, "www.example.com", AF_INET) == 2);
+    assert(count_addresses(addrlist, "www.example.org", AF_INET6) == 3);
+    amp_resolve_freeaddr(addrlist);
+
+    /* names that don't resolve give an empty list */
+    addrlist = resolve_batch(pool, &dests[2]);
+    assert(addrlist == NULL);
+    addrlist = resolve_legacy(pool, &dests[2]);
+    assert(addrlist == NULL);
+
+    /* as does an empty batch */
+    addrlist = resolve_batch(pool, NULL);
+    assert(addrlist == NULL);
+
+    /* names that are too long can't be added to a batch */
+    memset(longname, 'a', MAX_DNS_NAME_LEN);
+    longname[MAX_DNS_NAME_LEN] = '\0';
+    dests[0].name = longname;
+    amp_resolve_batch_init(&batch);
+    assert(amp_resolve_batch_add(&batch, &dests[0]) < 0);
+    assert(batch.header.count == 0);
+    amp_resolve_batch_free(&batch);
+
+    /* a batch bigger than the socket buffers still arrives intact */
+    big = calloc(BIG_BATCH, sizeof(resolve_dest_t));
+    for ( i = 0; i < BIG_BATCH; i++ ) {
+        snprintf(names[i], sizeof(names[i]), "host%d.example", i);
+        big[i].name = names[i];
+        big[i].count = 4;
+        big[i].family = (i % 2) ? AF_INET6 : AF_INET;
+        big[i].next = (i + 1 < BIG_BATCH) ? &big[i + 1] : NULL;
+    }
+
+    addrlist = resolve_batch(pool, big);
+    assert(list_length(addrlist) == BIG_BATCH * 4);
+    for ( i = 0; i < BIG_BATCH; i++ ) {
+        assert(count_addresses(addrlist, names[i], big[i].family) == 4);
+    }
+    amp_resolve_freeaddr(addrlist);
+    free(big);
+
+    destroy_worker_pool(pool);
+    amp_resolver_context_delete(ctx);
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compare the cost of scheduling tests using the libwandevent timer list
+ * against the timer heap, with a large number of synthetic tests. This
+ * isn't run as part of the test suite, run it by hand:
+ *
+ *   ./schedule_bench.test [timer count]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <libwandevent.h>
+#include "timerheap.h"
+
+#define DEFAULT_TIMER_COUNT 10000
+/* tests are spread randomly across an hour, like an hourly schedule */
+#define SCHEDULE_SPREAD 3600
+
+
+/*
+ * Empty callback, we only care about the cost of scheduling.
+ */
+static void bench_callback(wand_event_handler_t *ev_hdl, void *data) {
+    (void)ev_hdl;
+    (void)data;
+}
+
+
+
+/*
+ * Number of nanoseconds between two timespecs.
+ */
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+    return ((end->tv_sec - start->tv_sec) * 1000000000.0) +
+        (end->tv_nsec - start->tv_nsec);
+}
+
+
+
+/*
+ *
+ */
+int main(int argc, char *argv[]) {
+    wand_event_handler_t *ev_hdl;
+    amp_timer_heap_t *heap;
+    struct wand_timer_t *timer;
+    struct timespec start, end;
+    struct timeval now;
+    int *offsets;
+    int count = DEFAULT_TIMER_COUNT;
+    int fired;
+    int i;
+
+    if ( argc > 1 ) {
+        count = atoi(argv[1]);
+    }
+
+    if ( count <= 0 ) {
+        fprintf(stderr, "usage: %s [timer count]\n", argv[0]);
+        return 1;
+    }
+
+    srandom(time(NULL));
+    offsets = malloc(sizeof(int) * count);
+    for ( i = 0; i < count; i++ ) {
+        offsets[i] = random() % SCHEDULE_SPREAD;
+    }
+
+    wand_event_init();
+    ev_hdl = wand_create_event_handler();
+
+    /* libwandevent keeps a sorted list, so every insert is a linear walk */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < count; i++ ) {
+        wand_add_timer(ev_hdl, offsets[i], 0, NULL, bench_callback);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%d timers\n", count);
+    printf("wand_add_timer: %.0f ns per insert\n",
+            elapsed_ns(&start, &end) / count);
+
+    while ( (timer = ev_hdl->timers) != NULL ) {
+        wand_del_timer(ev_hdl, timer);
+    }
+
+    /* the timer heap keeps a single libwandevent timer for the earliest */
+    heap = amp_timer_heap_create(ev_hdl);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for ( i = 0; i < count; i++ ) {
+        amp_add_timer(heap, offsets[i], 0, NULL, bench_callback);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("amp_add_timer: %.0f ns per insert\n",
+            elapsed_ns(&start, &end) / count);
+
+    /* pretend the whole period has passed and fire everything */
+    now = wand_calc_expire(ev_hdl, SCHEDULE_SPREAD, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fired = amp_timer_heap_run_expired(heap, &now);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("amp_timer_heap_run_expired: %.0f ns per fire (%d fired)\n",
+            elapsed_ns(&start, &end) / fired, fired);
+
+    amp_timer_heap_destroy(heap);
+    wand_destroy_event_handler(ev_hdl);
+    free(offsets);
+
+    return 0;
+}
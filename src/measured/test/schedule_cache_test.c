@@ -0,0 +1,207 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/stat.h>
+
+#include "schedule_cache.h"
+
+
+/*
+ * Write some contents to a file and get the details of it.
+ */
+static uint64_t write_file(char *filename, char *contents,
+        struct stat *statbuf) {
+    FILE *out;
+
+    assert((out = fopen(filename, "w")) != NULL);
+    fputs(contents, out);
+    fclose(out);
+    assert(stat(filename, statbuf) == 0);
+
+    return hash_schedule_contents(contents, strlen(contents));
+}
+
+
+
+/*
+ * Check that a compiled schedule entry matches the original entry.
+ */
+static void check_entry(schedule_entry_t *a, schedule_entry_t *b) {
+    int i;
+
+    assert((a->test == NULL && b->test == NULL) ||
+            strcmp(a->test, b->test) == 0);
+    assert((a->period == NULL && b->period == NULL) ||
+            strcmp(a->period, b->period) == 0);
+    assert((a->args == NULL && b->args == NULL) ||
+            strcmp(a->args, b->args) == 0);
+    assert(a->start == b->start);
+    assert(a->end == b->end);
+    assert(a->frequency == b->frequency);
+
+    for ( i = 0; a->targets != NULL && a->targets[i] != NULL; i++ ) {
+        assert(strcmp(a->targets[i], b->targets[i]) == 0);
+    }
+    assert(b->targets[i] == NULL);
+}
+
+
+
+/*
+ * Get the name that the compiled copy of a schedule file should have in the
+ * cache directory.
+ */
+static void get_cache_name(char *cachedir, char *schedule_dir, char *name,
+        char *cachename, size_t length) {
+    snprintf(cachename, length, "%s/%016" PRIx64 "-%s.cache", cachedir,
+            hash_schedule_contents(schedule_dir, strlen(schedule_dir)), name);
+}
+
+
+
+/*
+ * Check that compiled schedules can be saved and loaded again, that they
+ * are only used while they match the schedule file, and that they are
+ * removed once the schedule file has gone.
+ */
+int main(void) {
+    char dir[] = "/tmp/amp-cache-XXXXXX";
+    char cachedir[] = "/tmp/amp-cache-XXXXXX";
+    char filename[sizeof(dir) + 16];
+    char other[sizeof(dir) + 16];
+    char cachename[sizeof(cachedir) + 64];
+    char othername[sizeof(cachedir) + 64];
+    char *current[] = { filename };
+    char *targets1[] = { "www.example.com", "192.0.2.1!v4", NULL };
+    char *targets2[] = { "www.example.org!1", NULL };
+    schedule_entry_t entries[] = {
+        { "icmp", NULL, "-s 84", 0, -1, 60000000, targets1 },
+        { "dns", "hourly", NULL, 5000000, 3000000000LL, -1, targets2 },
+        { "trace", "weekly", "", 0, -1, -1, NULL },
+        { NULL, NULL, NULL, 0, -1, -1, NULL },
+    };
+    schedule_cache_t *cache;
+    struct stat statbuf;
+    uint64_t hash;
+    uint32_t i;
+    FILE *out;
+
+    assert(mkdtemp(dir) != NULL);
+    assert(mkdtemp(cachedir) != NULL);
+    snprintf(filename, sizeof(filename), "%s/test.sched", dir);
+    snprintf(other, sizeof(other), "%s/other.sched", dir);
+    get_cache_name(cachedir, dir, "test.sched", cachename, sizeof(cachename));
+    get_cache_name(cachedir, dir, "other.sched", othername, sizeof(othername));
+
+    hash = write_file(filename, "tests: []\n", &statbuf);
+
+    /* nothing is compiled without somewhere to keep it */
+    assert(save_schedule_cache(filename, &statbuf, hash, entries, 4) < 0);
+    set_schedule_cache_dir(cachedir);
+
+    /* nothing has been compiled yet */
+    assert(load_schedule_cache(filename, &statbuf, hash) == NULL);
+
+    /* compile the schedule, and load it back in again */
+    assert(save_schedule_cache(filename, &statbuf, hash, entries, 4) == 0);
+    assert(access(cachename, R_OK) == 0);
+    assert((cache = load_schedule_cache(filename, &statbuf, hash)) != NULL);
+    assert(cache->count == 4);
+    for ( i = 0; i < cache->count; i++ ) {
+        check_entry(&entries[i], &cache->entries[i]);
+    }
+
+    /* scheduling modifies the target strings, which mustn't change the file */
+    cache->entries[0].targets[1][12] = '\0';
+    free_schedule_cache(cache);
+    assert((cache = load_schedule_cache(filename, &statbuf, hash)) != NULL);
+    check_entry(&entries[0], &cache->entries[0]);
+    free_schedule_cache(cache);
+
+    /* a different hash means the contents have changed */
+    assert(load_schedule_cache(filename, &statbuf, hash + 1) == NULL);
+
+    /* a changed schedule file makes the compiled schedule stale */
+    hash = write_file(filename, "tests: [ ]\n", &statbuf);
+    assert(load_schedule_cache(filename, &statbuf, hash) == NULL);
+
+    /* an empty schedule can be compiled */
+    assert(save_schedule_cache(filename, &statbuf, hash, entries, 0) == 0);
+    assert((cache = load_schedule_cache(filename, &statbuf, hash)) != NULL);
+    assert(cache->count == 0);
+    free_schedule_cache(cache);
+
+    /* a truncated compiled schedule should be ignored */
+    assert(save_schedule_cache(filename, &statbuf, hash, entries, 4) == 0);
+    assert(truncate(cachename, sizeof(schedule_cache_header_t) + 8) == 0);
+    assert(load_schedule_cache(filename, &statbuf, hash) == NULL);
+
+    /* as should one that isn't a compiled schedule at all */
+    assert((out = fopen(cachename, "w")) != NULL);
+    fputs("not a compiled schedule, but long enough to have a header", out);
+    fclose(out);
+    assert(load_schedule_cache(filename, &statbuf, hash) == NULL);
+
+    /* compiled schedules for files that have gone away are removed */
+    assert(save_schedule_cache(filename, &statbuf, hash, entries, 4) == 0);
+    assert(save_schedule_cache(other, &statbuf, hash, entries, 4) == 0);
+    assert(access(othername, R_OK) == 0);
+    prune_schedule_cache(dir, current, 1);
+    assert(access(cachename, R_OK) == 0);
+    assert(access(othername, R_OK) < 0);
+
+    /* but those for other schedule directories are left alone */
+    prune_schedule_cache("/tmp", NULL, 0);
+    assert(access(cachename, R_OK) == 0);
+    prune_schedule_cache(dir, NULL, 0);
+    assert(access(cachename, R_OK) < 0);
+
+    set_schedule_cache_dir(NULL);
+    unlink(filename);
+    rmdir(dir);
+    rmdir(cachedir);
+
+    return 0;
+}
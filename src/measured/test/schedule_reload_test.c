@@ -0,0 +1,213 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <assert.h>
+#include <netdb.h>
+#include <libwandevent.h>
+
+#include "schedule.h"
+#include "schedule_cache.h"
+#include "nametable.h"
+#include "timerheap.h"
+#include "modules.h"
+
+
+/*
+ * Add a single address to the nametable under the given name.
+ */
+static void add_name(char *name, char *address) {
+    struct addrinfo hints, *addr;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_NUMERICHOST;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    assert(getaddrinfo(address, NULL, &hints, &addr) == 0);
+    nametable_test_insert_nametable_entry(name, addr);
+}
+
+
+
+/*
+ * Write out a schedule file containing the given tests.
+ */
+static void write_schedule(char *filename, char *tests) {
+    FILE *out;
+
+    assert((out = fopen(filename, "w")) != NULL);
+    fprintf(out, "tests:\n%s", tests);
+    fclose(out);
+}
+
+
+
+/*
+ * Find the scheduled test with the given frequency (in seconds).
+ */
+static amp_timer_t *find_test(wand_event_handler_t *ev_hdl, int frequency) {
+    amp_timer_heap_t *heap = get_schedule_timers(ev_hdl);
+    schedule_item_t *item;
+    uint32_t i;
+
+    for ( i = 0; i < heap->count; i++ ) {
+        item = (schedule_item_t *)heap->timers[i]->data;
+        if ( item->type == EVENT_RUN_TEST &&
+                item->data.test->interval.tv_sec == frequency ) {
+            return heap->timers[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * Reload the schedule in the same way that measured does.
+ */
+static void reload_schedule(wand_event_handler_t *ev_hdl, char *dir,
+        amp_test_meta_t *meta) {
+    begin_schedule_reload(ev_hdl);
+    clear_nametable();
+    add_name("first", "192.0.2.1");
+    add_name("second", "192.0.2.2");
+    read_schedule_dir(ev_hdl, dir, meta);
+    finish_schedule_reload(ev_hdl);
+}
+
+
+
+/*
+ * Check that reloading the test schedule keeps the timers for tests that
+ * haven't changed, and only adds or removes those that have.
+ */
+int main(void) {
+    wand_event_handler_t *ev_hdl;
+    amp_test_meta_t meta;
+    test_t test;
+    amp_timer_t *unchanged, *changed;
+    schedule_item_t *item;
+    char dir[] = "/tmp/amp-reload-XXXXXX";
+    char filename[sizeof(dir) + 16];
+    char cachename[sizeof(dir) + 64];
+
+    /* fake up a test module that the schedule can refer to */
+    memset(&test, 0, sizeof(test));
+    test.id = AMP_TEST_ICMP;
+    test.name = "icmp";
+    test.min_targets = 1;
+    amp_tests[AMP_TEST_ICMP] = &test;
+
+    memset(&meta, 0, sizeof(meta));
+    meta.ampname = "localhost";
+
+    assert(mkdtemp(dir) != NULL);
+    snprintf(filename, sizeof(filename), "%s/test.sched", dir);
+    snprintf(cachename, sizeof(cachename), "%s/%016" PRIx64 "-test.sched.cache",
+            dir, hash_schedule_contents(dir, strlen(dir)));
+
+    /* keep the compiled schedules alongside the schedule for the test */
+    set_schedule_cache_dir(dir);
+
+    wand_event_init();
+    ev_hdl = wand_create_event_handler();
+
+    /* initial load of two tests */
+    add_name("first", "192.0.2.1");
+    add_name("second", "192.0.2.2");
+    write_schedule(filename,
+            "  - test: icmp\n    frequency: 60\n    target: first\n"
+            "  - test: icmp\n    frequency: 120\n    target: second\n");
+    read_schedule_dir(ev_hdl, dir, &meta);
+    assert(get_schedule_timers(ev_hdl)->count == 2);
+    /* the next reload should use the compiled copy of the schedule */
+    assert(access(cachename, R_OK) == 0);
+    assert((unchanged = find_test(ev_hdl, 60)) != NULL);
+    assert(find_test(ev_hdl, 120) != NULL);
+
+    /* reloading the same schedule should keep everything */
+    item = (schedule_item_t *)unchanged->data;
+    reload_schedule(ev_hdl, dir, &meta);
+    assert(get_schedule_timers(ev_hdl)->count == 2);
+    assert(find_test(ev_hdl, 60) == unchanged);
+    assert(unchanged->data == item);
+    assert(item->data.test->dest_count == 1);
+    assert(strcmp(item->data.test->dests[0]->ai_canonname, "first") == 0);
+    changed = find_test(ev_hdl, 120);
+
+    /* changing the targets of a test should replace it */
+    write_schedule(filename,
+            "  - test: icmp\n    frequency: 60\n    target: first\n"
+            "  - test: icmp\n    frequency: 120\n    target: first\n"
+            "  - test: icmp\n    frequency: 300\n    target: unknown\n");
+    reload_schedule(ev_hdl, dir, &meta);
+    assert(get_schedule_timers(ev_hdl)->count == 3);
+    assert(find_test(ev_hdl, 60) == unchanged);
+    assert(find_test(ev_hdl, 120) != changed);
+    assert(find_test(ev_hdl, 300) != NULL);
+
+    /* removing tests from the schedule should remove their timers */
+    write_schedule(filename,
+            "  - test: icmp\n    frequency: 300\n    target: unknown\n");
+    reload_schedule(ev_hdl, dir, &meta);
+    assert(get_schedule_timers(ev_hdl)->count == 1);
+    assert(find_test(ev_hdl, 60) == NULL);
+    assert(find_test(ev_hdl, 300) != NULL);
+
+    /* the compiled schedule goes once the schedule file does */
+    unlink(filename);
+    reload_schedule(ev_hdl, dir, &meta);
+    assert(get_schedule_timers(ev_hdl)->count == 0);
+    assert(access(cachename, R_OK) < 0);
+    set_schedule_cache_dir(NULL);
+
+    clear_test_schedule(ev_hdl, 1);
+    clear_nametable();
+    wand_destroy_event_handler(ev_hdl);
+
+    rmdir(dir);
+
+    return 0;
+}
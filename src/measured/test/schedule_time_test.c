@@ -40,6 +40,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <netdb.h>
+#include <arpa/inet.h>
 #include "schedule.h"
 
 
@@ -334,6 +336,81 @@ static void check_next_schedule_time(void) {
 
 
 
+/*
+ * Make sure that tests with the same schedule only get the same spread
+ * offset if they could be merged, and that tests which can't be merged are
+ * moved apart based on their destinations.
+ */
+static void check_spread_offset(void) {
+    test_schedule_item_t first, second;
+    resolve_dest_t first_name, second_name;
+    struct sockaddr_in first_addr, second_addr;
+    struct addrinfo first_dest, second_dest;
+    struct addrinfo *first_dests[] = { &first_dest };
+    struct addrinfo *second_dests[] = { &second_dest };
+    amp_test_meta_t meta;
+
+    memset(&meta, 0, sizeof(meta));
+    meta.ampname = "client.example.com";
+
+    /* hourly tests that could start at any time in the hour */
+    memset(&first, 0, sizeof(first));
+    first.period = SCHEDULE_PERIOD_HOURLY;
+    first.end = 3600 * 1000000ULL;
+    first.test_id = AMP_TEST_ICMP;
+    first.meta = &meta;
+    second = first;
+
+    /* split instances with different names to resolve */
+    memset(&first_name, 0, sizeof(first_name));
+    first_name.name = "www.example.com";
+    first.resolve = &first_name;
+    first.resolve_count = 1;
+    memset(&second_name, 0, sizeof(second_name));
+    second_name.name = "www.example.org";
+    second.resolve = &second_name;
+    second.resolve_count = 1;
+
+    assert(amp_test_get_spread_offset(&first, 1) ==
+            amp_test_get_spread_offset(&second, 1));
+    assert(amp_test_get_spread_offset(&first, 0) !=
+            amp_test_get_spread_offset(&second, 0));
+    assert(amp_test_get_spread_offset(&first, 0) % 1000000 == 0);
+    assert(amp_test_get_spread_offset(&first, 0) < first.end);
+
+    /* single target tests to different addresses */
+    memset(&first_addr, 0, sizeof(first_addr));
+    first_addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "192.0.2.1", &first_addr.sin_addr);
+    second_addr = first_addr;
+    inet_pton(AF_INET, "192.0.2.2", &second_addr.sin_addr);
+
+    memset(&first_dest, 0, sizeof(first_dest));
+    first_dest.ai_family = AF_INET;
+    first_dest.ai_addr = (struct sockaddr *)&first_addr;
+    first_dest.ai_addrlen = sizeof(first_addr);
+    second_dest = first_dest;
+    second_dest.ai_addr = (struct sockaddr *)&second_addr;
+
+    first.resolve = NULL;
+    first.resolve_count = 0;
+    first.dests = first_dests;
+    first.dest_count = 1;
+    second.resolve = NULL;
+    second.resolve_count = 0;
+    second.dests = second_dests;
+    second.dest_count = 1;
+
+    assert(amp_test_get_spread_offset(&first, 0) !=
+            amp_test_get_spread_offset(&second, 0));
+
+    /* the same test always gets the same offset */
+    assert(amp_test_get_spread_offset(&first, 0) ==
+            amp_test_get_spread_offset(&first, 0));
+}
+
+
+
 /*
  * Test the timing functions used in scheduling.
  */
@@ -342,6 +419,7 @@ int main(void) {
     check_period_time();
     check_time_parsing();
     check_next_schedule_time();
+    check_spread_offset();
 
     return 0;
 }
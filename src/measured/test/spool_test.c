@@ -0,0 +1,343 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "spool.h"
+#include "tests.h"
+
+#define MAX_RESULTS 1000
+#define RESULT_LENGTH 100
+
+static int replayed[MAX_RESULTS];
+static int replayed_count = 0;
+static int refuse = 0;
+
+/* confirm results straight away, or save them to be confirmed later */
+static int auto_confirm = 1;
+static uint64_t unconfirmed_seq[MAX_RESULTS];
+static uint64_t unconfirmed_offset[MAX_RESULTS];
+static int unconfirmed_count = 0;
+
+
+
+/*
+ * Replayed results are normally queued to be published, instead record
+ * which result it was so that the order can be checked.
+ */
+int queue_spooled_result_for_broker(test_type_t type,
+        amp_test_result_t *result, uint64_t seq, uint64_t offset) {
+    if ( refuse ) {
+        return -1;
+    }
+
+    assert(type == AMP_TEST_ICMP);
+    assert(result->len == RESULT_LENGTH);
+    assert(replayed_count < MAX_RESULTS);
+    assert(result->timestamp == (uint64_t)((int *)result->data)[0]);
+    assert(seq > 0);
+
+    replayed[replayed_count++] = ((int *)result->data)[0];
+    free(result->data);
+
+    if ( auto_confirm ) {
+        confirm_spooled_result(seq, offset);
+    } else {
+        unconfirmed_seq[unconfirmed_count] = seq;
+        unconfirmed_offset[unconfirmed_count] = offset;
+        unconfirmed_count++;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Replaying is driven directly by the test rather than by a timer.
+ */
+int get_publish_capacity(void) {
+    return 0;
+}
+
+
+
+/*
+ * Spool a result that can be identified by the given id.
+ */
+static void spool_id(int id) {
+    amp_test_result_t result;
+    char data[RESULT_LENGTH];
+
+    memset(data, id & 0xff, sizeof(data));
+    memcpy(data, &id, sizeof(id));
+    result.timestamp = id;
+    result.len = sizeof(data);
+    result.data = data;
+
+    assert(spool_result(AMP_TEST_ICMP, &result) == 0);
+}
+
+
+
+/*
+ * Check that the results replayed so far are the given range of ids.
+ */
+static void check_replayed(int first, int count) {
+    int i;
+
+    assert(replayed_count == count);
+    for ( i = 0; i < count; i++ ) {
+        assert(replayed[i] == first + i);
+    }
+
+    replayed_count = 0;
+}
+
+
+
+/*
+ * Count the segment files in the spool directory.
+ */
+static int count_segments(char *dir) {
+    DIR *dirp;
+    struct dirent *entry;
+    int count = 0;
+
+    assert((dirp = opendir(dir)) != NULL);
+    while ( (entry = readdir(dirp)) != NULL ) {
+        if ( strstr(entry->d_name, SPOOL_SEGMENT_SUFFIX) != NULL ) {
+            count++;
+        }
+    }
+    closedir(dirp);
+
+    return count;
+}
+
+
+
+/*
+ * Append some junk to the newest segment, like a write cut short by a crash.
+ */
+static void corrupt_newest_segment(char *dir) {
+    DIR *dirp;
+    struct dirent *entry;
+    char newest[256] = "";
+    char path[512];
+    char junk[10];
+    int fd;
+
+    assert((dirp = opendir(dir)) != NULL);
+    while ( (entry = readdir(dirp)) != NULL ) {
+        if ( strstr(entry->d_name, SPOOL_SEGMENT_SUFFIX) != NULL &&
+                strcmp(entry->d_name, newest) > 0 ) {
+            snprintf(newest, sizeof(newest), "%s", entry->d_name);
+        }
+    }
+    closedir(dirp);
+
+    assert(strlen(newest) > 0);
+    snprintf(path, sizeof(path), "%s/%s", dir, newest);
+    memset(junk, 0x41, sizeof(junk));
+    assert((fd = open(path, O_WRONLY | O_APPEND)) >= 0);
+    assert(write(fd, junk, sizeof(junk)) == sizeof(junk));
+    close(fd);
+}
+
+
+
+/*
+ * Check that results are spooled to disk and replayed in order, that the
+ * spool stays within its size limit and that partial writes are detected.
+ */
+int main(void) {
+    char dir[] = "/tmp/amp-spool-XXXXXX";
+    char path[512];
+    amp_spool_t config;
+    spool_stats_t stats;
+    int child_status;
+    pid_t pid;
+    int i;
+
+    assert(mkdtemp(dir) != NULL);
+
+    /* spooling is disabled until it is configured */
+    assert(amp_test_drain_spool(10) == 0);
+
+    config.enabled = 1;
+    config.directory = dir;
+    config.max_size = 64 * 1024;
+    config.segment_size = 1024;
+    config.sync_records = 4;
+    config.drain_rate = 10;
+    set_spool_config(NULL, &config);
+
+    /* results are replayed in the order they were spooled */
+    for ( i = 0; i < 50; i++ ) {
+        spool_id(i);
+    }
+    assert(count_segments(dir) > 1);
+    assert(amp_test_drain_spool(MAX_RESULTS) == 50);
+    check_replayed(0, 50);
+    assert(count_segments(dir) == 0);
+
+    /* replaying stops at the limit, and carries on from the same place */
+    for ( i = 0; i < 5; i++ ) {
+        spool_id(i);
+    }
+    assert(amp_test_drain_spool(2) == 2);
+    check_replayed(0, 2);
+    assert(amp_test_drain_spool(10) == 3);
+    check_replayed(2, 3);
+
+    /* results that can't be queued stay in the spool */
+    for ( i = 0; i < 3; i++ ) {
+        spool_id(i);
+    }
+    refuse = 1;
+    assert(amp_test_drain_spool(10) == 0);
+    refuse = 0;
+    assert(amp_test_drain_spool(10) == 3);
+    check_replayed(0, 3);
+    assert(count_segments(dir) == 0);
+
+    /* test processes can spool results for the main process to replay */
+    spool_id(0);
+    if ( (pid = fork()) == 0 ) {
+        spool_id(1);
+        exit(0);
+    }
+    assert(waitpid(pid, &child_status, 0) == pid);
+    assert(WIFEXITED(child_status) && WEXITSTATUS(child_status) == 0);
+    spool_id(2);
+    assert(amp_test_drain_spool(10) == 3);
+    check_replayed(0, 3);
+
+    /* a partial result left at the end of a segment by a crash is skipped */
+    spool_id(3);
+    corrupt_newest_segment(dir);
+    close_spool();
+    set_spool_config(NULL, &config);
+    spool_id(4);
+    assert(amp_test_drain_spool(10) == 2);
+    check_replayed(3, 2);
+    get_spool_stats(&stats);
+    assert(stats.corrupt == 1);
+    assert(count_segments(dir) == 0);
+    close_spool();
+
+    /* segments are kept until the broker confirms everything in them */
+    set_spool_config(NULL, &config);
+    auto_confirm = 0;
+    for ( i = 0; i < 5; i++ ) {
+        spool_id(i);
+    }
+    assert(amp_test_drain_spool(10) == 5);
+    check_replayed(0, 5);
+    assert(count_segments(dir) == 1);
+    assert(amp_test_drain_spool(10) == 0);
+
+    /* a restart replays everything that wasn't confirmed */
+    close_spool();
+    set_spool_config(NULL, &config);
+    unconfirmed_count = 0;
+    assert(amp_test_drain_spool(10) == 5);
+    check_replayed(0, 5);
+
+    /* and carries on after results that were, even if out of order */
+    confirm_spooled_result(unconfirmed_seq[1], unconfirmed_offset[1]);
+    confirm_spooled_result(unconfirmed_seq[0], unconfirmed_offset[0]);
+    confirm_spooled_result(unconfirmed_seq[3], unconfirmed_offset[3]);
+    close_spool();
+    set_spool_config(NULL, &config);
+    unconfirmed_count = 0;
+    assert(amp_test_drain_spool(10) == 3);
+    check_replayed(2, 3);
+
+    /* results thrown away by the publishing queue are read again */
+    rewind_spool();
+    unconfirmed_count = 0;
+    assert(amp_test_drain_spool(10) == 3);
+    check_replayed(2, 3);
+
+    /* the segment is removed once everything has been confirmed */
+    for ( i = 0; i < unconfirmed_count; i++ ) {
+        confirm_spooled_result(unconfirmed_seq[i], unconfirmed_offset[i]);
+    }
+    unconfirmed_count = 0;
+    assert(amp_test_drain_spool(10) == 0);
+    assert(count_segments(dir) == 0);
+    auto_confirm = 1;
+    close_spool();
+
+    /* when the spool is full the oldest results are thrown away */
+    config.max_size = 4096;
+    set_spool_config(NULL, &config);
+    for ( i = 0; i < 200; i++ ) {
+        spool_id(i);
+    }
+    get_spool_stats(&stats);
+    assert(stats.size <= config.max_size);
+    assert(stats.evicted_segments > 0);
+    assert(amp_test_drain_spool(MAX_RESULTS) > 0);
+    assert(replayed_count < 200);
+    check_replayed(200 - replayed_count, replayed_count);
+    assert(count_segments(dir) == 0);
+
+    /* spooling can be turned off */
+    close_spool();
+    config.enabled = 0;
+    set_spool_config(NULL, &config);
+    assert(spool_result(AMP_TEST_ICMP, &(amp_test_result_t){0, 0, NULL}) < 0);
+
+    snprintf(path, sizeof(path), "%s/%s", dir, SPOOL_POSITION_FILE);
+    unlink(path);
+    rmdir(dir);
+
+    return 0;
+}
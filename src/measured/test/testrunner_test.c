@@ -0,0 +1,319 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "testrunner.h"
+
+
+
+/*
+ * Make sure two addrinfo structures describe the same address.
+ */
+static void check_addrinfo(struct addrinfo *a, struct addrinfo *b) {
+    assert(a->ai_family == b->ai_family);
+    assert(a->ai_socktype == b->ai_socktype);
+    assert(a->ai_protocol == b->ai_protocol);
+    assert(a->ai_addrlen == b->ai_addrlen);
+    assert(memcmp(a->ai_addr, b->ai_addr, a->ai_addrlen) == 0);
+    if ( a->ai_canonname == NULL ) {
+        assert(b->ai_canonname == NULL);
+    } else {
+        assert(strcmp(a->ai_canonname, b->ai_canonname) == 0);
+    }
+}
+
+
+
+/*
+ * Make sure optional strings survive being serialised, including NULLs.
+ */
+static void check_string(char *a, char *b) {
+    if ( a == NULL ) {
+        assert(b == NULL);
+    } else {
+        assert(b != NULL && strcmp(a, b) == 0);
+    }
+}
+
+
+
+/*
+ * Read everything currently waiting on a socket into the buffer, returning
+ * the new amount of data in it.
+ */
+static uint32_t read_available(int fd, uint8_t *data, uint32_t length,
+        uint32_t size) {
+    ssize_t bytes;
+
+    while ( (bytes = recv(fd, data + length, size - length,
+                    MSG_DONTWAIT)) > 0 ) {
+        length += bytes;
+    }
+
+    assert(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    return length;
+}
+
+
+
+/*
+ * Check that tests are only handed to runners that can take them without
+ * blocking measured: a full runner is skipped so the test can be forked
+ * directly, and a partly sent test is finished before anything else.
+ */
+static void check_runner_sockets(test_schedule_item_t *item) {
+    test_schedule_item_t *unpacked;
+    test_runner_header_t header;
+    uint8_t *data;
+    char junk[4096];
+    char *big;
+    char *params[] = { "-s", NULL, NULL };
+    uint32_t length, size;
+    int sv[2], small[2];
+    int sndbuf = 4096;
+
+    /* a runner with room in the socket gets the test straight away */
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    amp_test_add_test_runner(sv[0]);
+    assert(run_test_on_runner(item, 1) == 1);
+    assert(recv(sv[1], &header, sizeof(header), 0) == sizeof(header));
+    assert(header.type == TEST_RUNNER_RUN && header.id == 1);
+    data = malloc(header.length);
+    assert(recv(sv[1], data, header.length, MSG_WAITALL) ==
+            (ssize_t)header.length);
+    unpacked = unpack_test_item(data, header.length);
+    assert(unpacked && unpacked->test_id == item->test_id);
+    free_unpacked_test_item(unpacked);
+    free(data);
+
+    /* once the runner socket is full the test should be run directly */
+    memset(junk, 0, sizeof(junk));
+    while ( send(sv[0], junk, sizeof(junk), MSG_DONTWAIT) > 0 ) {
+        /* nothing, just filling the socket */
+    }
+    assert(run_test_on_runner(item, 2) == 0);
+
+    /* a test too big for the socket is finished once it drains */
+    big = malloc(65536);
+    memset(big, 'x', 65535);
+    big[65535] = '\0';
+    params[1] = big;
+    item->params = params;
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, small) == 0);
+    assert(setsockopt(small[0], SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                sizeof(sndbuf)) == 0);
+    amp_test_add_test_runner(small[0]);
+    assert(run_test_on_runner(item, 3) == 1);
+
+    /* both runners are now busy, the next test can't wait for them */
+    item->params = NULL;
+    assert(run_test_on_runner(item, 4) == 0);
+
+    /* the reload has to wait until the partly sent test is finished */
+    reload_test_runners();
+
+    size = 2 * sizeof(header) + 2 * 65536;
+    data = malloc(size);
+    length = 0;
+    do {
+        length = read_available(small[1], data, length, size);
+    } while ( amp_test_flush_test_runner(1) > 0 );
+    length = read_available(small[1], data, length, size);
+
+    memcpy(&header, data, sizeof(header));
+    assert(header.type == TEST_RUNNER_RUN && header.id == 3);
+    assert(length == 2 * sizeof(header) + header.length);
+    unpacked = unpack_test_item(data + sizeof(header), header.length);
+    assert(unpacked && strcmp(unpacked->params[1], big) == 0);
+    free_unpacked_test_item(unpacked);
+
+    memcpy(&header, data + sizeof(header) + header.length, sizeof(header));
+    assert(header.type == TEST_RUNNER_RELOAD);
+
+    free(data);
+    free(big);
+    stop_test_runners();
+    close(sv[1]);
+    close(small[1]);
+}
+
+
+
+/*
+ * Check that a test description sent to a test runner is unpacked into the
+ * same test that was packed, and that truncated descriptions are rejected.
+ */
+int main(void) {
+    test_schedule_item_t item, *unpacked;
+    test_runner_buffer_t buffer;
+    amp_test_meta_t meta;
+    struct addrinfo addr4, addr6, *dests[2];
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+    resolve_dest_t resolve1, resolve2, *resolve;
+    char *params[] = { "-s", "84", "-r", NULL };
+    uint32_t length;
+    int i;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    inet_pton(AF_INET, "192.0.2.1", &sin.sin_addr);
+    memset(&addr4, 0, sizeof(addr4));
+    addr4.ai_family = AF_INET;
+    addr4.ai_addrlen = sizeof(sin);
+    addr4.ai_addr = (struct sockaddr *)&sin;
+    addr4.ai_canonname = "foo.example.com";
+
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "2001:db8::1", &sin6.sin6_addr);
+    memset(&addr6, 0, sizeof(addr6));
+    addr6.ai_family = AF_INET6;
+    addr6.ai_socktype = SOCK_DGRAM;
+    addr6.ai_addrlen = sizeof(sin6);
+    addr6.ai_addr = (struct sockaddr *)&sin6;
+    addr6.ai_canonname = NULL;
+
+    dests[0] = &addr4;
+    dests[1] = &addr6;
+
+    resolve1.name = "bar.example.com";
+    resolve1.family = AF_INET6;
+    resolve1.count = 2;
+    resolve1.addr = NULL;
+    resolve1.next = &resolve2;
+    resolve2.name = "baz.example.com";
+    resolve2.family = AF_UNSPEC;
+    resolve2.count = 0;
+    resolve2.addr = NULL;
+    resolve2.next = NULL;
+
+    memset(&meta, 0, sizeof(meta));
+    meta.interface = "eth0";
+    meta.sourcev4 = NULL;
+    meta.sourcev6 = "2001:db8::2";
+    meta.ampname = "amplet";
+    meta.inter_packet_delay = 1000;
+    meta.dscp = 46;
+
+    memset(&item, 0, sizeof(item));
+    item.test_id = AMP_TEST_ICMP;
+    item.dest_count = 2;
+    item.dests = dests;
+    item.resolve_count = 2;
+    item.resolve = &resolve1;
+    item.meta = &meta;
+    item.params = params;
+
+    memset(&buffer, 0, sizeof(buffer));
+    assert(pack_test_item(&buffer, &item) == 0);
+    assert(buffer.length > 0);
+
+    unpacked = unpack_test_item(buffer.data, buffer.length);
+    assert(unpacked);
+
+    assert(unpacked->test_id == item.test_id);
+    assert(unpacked->dest_count == item.dest_count);
+    assert(unpacked->resolve_count == item.resolve_count);
+
+    for ( i = 0; i < 2; i++ ) {
+        check_addrinfo(item.dests[i], unpacked->dests[i]);
+    }
+
+    /* the resolve list should be in the same order it was sent */
+    resolve = unpacked->resolve;
+    assert(resolve && strcmp(resolve->name, resolve1.name) == 0);
+    assert(resolve->family == resolve1.family);
+    assert(resolve->count == resolve1.count);
+    resolve = resolve->next;
+    assert(resolve && strcmp(resolve->name, resolve2.name) == 0);
+    assert(resolve->family == resolve2.family);
+    assert(resolve->count == resolve2.count);
+    assert(resolve->next == NULL);
+
+    check_string(meta.interface, unpacked->meta->interface);
+    check_string(meta.sourcev4, unpacked->meta->sourcev4);
+    check_string(meta.sourcev6, unpacked->meta->sourcev6);
+    check_string(meta.ampname, unpacked->meta->ampname);
+    assert(unpacked->meta->inter_packet_delay == meta.inter_packet_delay);
+    assert(unpacked->meta->dscp == meta.dscp);
+
+    for ( i = 0; params[i] != NULL; i++ ) {
+        assert(strcmp(params[i], unpacked->params[i]) == 0);
+    }
+    assert(unpacked->params[i] == NULL);
+
+    free_unpacked_test_item(unpacked);
+
+    /* every truncated version of the description should be rejected */
+    for ( length = 0; length < buffer.length; length++ ) {
+        assert(unpack_test_item(buffer.data, length) == NULL);
+    }
+
+    free(buffer.data);
+
+    /* a test with no destinations or parameters should also work */
+    memset(&buffer, 0, sizeof(buffer));
+    item.dest_count = 0;
+    item.dests = NULL;
+    item.resolve_count = 0;
+    item.resolve = NULL;
+    item.params = NULL;
+    assert(pack_test_item(&buffer, &item) == 0);
+    unpacked = unpack_test_item(buffer.data, buffer.length);
+    assert(unpacked);
+    assert(unpacked->dest_count == 0 && unpacked->dests == NULL);
+    assert(unpacked->resolve_count == 0 && unpacked->resolve == NULL);
+    assert(unpacked->params == NULL);
+    free_unpacked_test_item(unpacked);
+    free(buffer.data);
+
+    check_runner_sockets(&item);
+
+    return 0;
+}
@@ -0,0 +1,232 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <libwandevent.h>
+#include "timerheap.h"
+
+#define TIMER_COUNT 1000
+
+/* order that the timer callbacks were run in */
+static int fired[TIMER_COUNT];
+static int fired_count = 0;
+
+
+/*
+ * Record that a timer fired so the order can be checked later.
+ */
+static void record_callback(wand_event_handler_t *ev_hdl, void *data) {
+    (void)ev_hdl;
+    fired[fired_count++] = (int)(long)data;
+}
+
+
+
+/*
+ * Add a new timer from inside a callback, it shouldn't run in the same pass.
+ */
+static void readd_callback(wand_event_handler_t *ev_hdl, void *data) {
+    amp_timer_heap_t *heap = (amp_timer_heap_t *)data;
+    (void)ev_hdl;
+    fired_count++;
+    amp_add_timer(heap, 0, 0, heap, readd_callback);
+}
+
+
+
+/*
+ * Check that every parent in the heap expires no later than its children.
+ */
+static void check_heap_property(amp_timer_heap_t *heap) {
+    uint32_t i;
+
+    for ( i = 0; i < heap->count; i++ ) {
+        assert(heap->timers[i]->index == i);
+        if ( i > 0 ) {
+            assert(!timercmp(&heap->timers[i]->expire,
+                        &heap->timers[(i - 1) / 2]->expire, <));
+        }
+    }
+}
+
+
+
+/*
+ * Check that timers added in a random order are run in expiry order, and
+ * that timers expiring at the same time run in the order they were added.
+ */
+static void check_ordering(wand_event_handler_t *ev_hdl) {
+    amp_timer_heap_t *heap;
+    struct timeval now;
+    int i;
+
+    heap = amp_timer_heap_create(ev_hdl);
+    assert(heap);
+    assert(amp_timer_heap_peek(heap) == NULL);
+
+    srandom(1);
+    for ( i = 0; i < TIMER_COUNT; i++ ) {
+        /* only a small number of distinct times, so lots of ties */
+        int offset = random() % 50;
+        long value = (offset * TIMER_COUNT) + i;
+        assert(amp_add_timer(heap, offset, 0, (void*)value, record_callback));
+    }
+
+    assert(heap->count == TIMER_COUNT);
+    check_heap_property(heap);
+
+    /* only the single earliest timer should be registered with libwandevent */
+    assert(heap->wakeup);
+    assert(ev_hdl->timers == heap->wakeup && heap->wakeup->next == NULL);
+
+    /* run everything, the values given to the callback should be increasing */
+    now = wand_calc_expire(ev_hdl, 100, 0);
+    fired_count = 0;
+    assert(amp_timer_heap_run_expired(heap, &now) == TIMER_COUNT);
+    assert(fired_count == TIMER_COUNT);
+    for ( i = 1; i < TIMER_COUNT; i++ ) {
+        assert(fired[i - 1] < fired[i]);
+    }
+
+    assert(heap->count == 0);
+    assert(heap->wakeup == NULL);
+    assert(ev_hdl->timers == NULL);
+
+    amp_timer_heap_destroy(heap);
+}
+
+
+
+/*
+ * Check that timers can be deleted from anywhere in the heap.
+ */
+static void check_delete(wand_event_handler_t *ev_hdl) {
+    amp_timer_heap_t *heap;
+    amp_timer_t *timers[TIMER_COUNT];
+    struct timeval now;
+    int i;
+
+    heap = amp_timer_heap_create(ev_hdl);
+
+    for ( i = 0; i < TIMER_COUNT; i++ ) {
+        timers[i] = amp_add_timer(heap, (TIMER_COUNT - i) % 97, i,
+                (void*)(long)i, record_callback);
+    }
+
+    /* remove every odd timer */
+    for ( i = 1; i < TIMER_COUNT; i += 2 ) {
+        amp_del_timer(heap, timers[i]);
+        check_heap_property(heap);
+    }
+
+    assert(heap->count == TIMER_COUNT / 2);
+
+    /* the wakeup should still match the earliest remaining timer */
+    assert(timercmp(&heap->wakeup->expire,
+                &amp_timer_heap_peek(heap)->expire, ==));
+
+    now = wand_calc_expire(ev_hdl, 100, 0);
+    fired_count = 0;
+    amp_timer_heap_run_expired(heap, &now);
+    assert(fired_count == TIMER_COUNT / 2);
+    for ( i = 0; i < fired_count; i++ ) {
+        assert(fired[i] % 2 == 0);
+    }
+
+    amp_timer_heap_destroy(heap);
+}
+
+
+
+/*
+ * Check that only timers that have expired get run, and that timers added
+ * while running expired timers are left for the next pass.
+ */
+static void check_expiry(wand_event_handler_t *ev_hdl) {
+    amp_timer_heap_t *heap;
+    struct timeval now;
+
+    heap = amp_timer_heap_create(ev_hdl);
+
+    amp_add_timer(heap, 10, 0, (void*)1, record_callback);
+    amp_add_timer(heap, 20, 0, (void*)2, record_callback);
+
+    now = wand_calc_expire(ev_hdl, 15, 0);
+    fired_count = 0;
+    assert(amp_timer_heap_run_expired(heap, &now) == 1);
+    assert(fired[0] == 1);
+    assert(heap->count == 1);
+
+    /* the wakeup should have moved on to the remaining timer */
+    assert(timercmp(&heap->wakeup->expire, &heap->timers[0]->expire, ==));
+    amp_timer_heap_destroy(heap);
+
+    /* a timer that immediately adds itself again should only run once */
+    heap = amp_timer_heap_create(ev_hdl);
+    amp_add_timer(heap, 0, 0, heap, readd_callback);
+    now = wand_calc_expire(ev_hdl, 1, 0);
+    fired_count = 0;
+    assert(amp_timer_heap_run_expired(heap, &now) == 1);
+    assert(fired_count == 1);
+    assert(heap->count == 1);
+    amp_timer_heap_destroy(heap);
+}
+
+
+
+/*
+ * Test the timer heap used to schedule tests.
+ */
+int main(void) {
+    wand_event_handler_t *ev_hdl;
+
+    wand_event_init();
+    ev_hdl = wand_create_event_handler();
+
+    check_ordering(ev_hdl);
+    check_delete(ev_hdl);
+    check_expiry(ev_hdl);
+
+    wand_destroy_event_handler(ev_hdl);
+
+    return 0;
+}
@@ -0,0 +1,356 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "whoissession.h"
+#include "asn.h"
+#include "iptrie.h"
+
+/* how the fake whois server should behave */
+static int refuse = 0;
+static int close_after = -1;
+static int received = 0;
+static int answered = 0;
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/*
+ * Pretend to be the whois server in bulk mode, answering each address with
+ * a line containing the AS number. Addresses in 192.0.2.0/24 get an error,
+ * and the connection is closed after close_after answers if that is set.
+ */
+static void *fake_server(void *data) {
+    int fd = *(int *)data;
+    char buffer[4096];
+    char reply[256];
+    char *line, *end;
+    int offset = 0;
+    ssize_t bytes;
+    int count = 0;
+    int limit;
+
+    free(data);
+
+    pthread_mutex_lock(&server_lock);
+    limit = close_after;
+    pthread_mutex_unlock(&server_lock);
+
+    strcpy(reply, "Bulk mode; whois.cymru.com [2016-01-01 00:00:00 +0000]\n");
+    assert(send(fd, reply, strlen(reply), MSG_NOSIGNAL) > 0);
+
+    while ( (bytes = recv(fd, buffer + offset,
+                    sizeof(buffer) - offset - 1, 0)) > 0 ) {
+        offset += bytes;
+        buffer[offset] = '\0';
+
+        while ( (end = strchr(buffer, '\n')) != NULL ) {
+            *end = '\0';
+            line = buffer;
+
+            pthread_mutex_lock(&server_lock);
+            received++;
+            pthread_mutex_unlock(&server_lock);
+
+            if ( limit >= 0 && count >= limit ) {
+                close(fd);
+                return NULL;
+            }
+
+            if ( strncmp(line, "192.0.2.", 8) == 0 ) {
+                snprintf(reply, sizeof(reply),
+                        "Error: no ASN or IP match on line %d.\n", count + 1);
+            } else {
+                snprintf(reply, sizeof(reply), "%d | %.64s | ZZ\n",
+                        64500 + atoi(strrchr(line, '.') + 1), line);
+            }
+            assert(send(fd, reply, strlen(reply), MSG_NOSIGNAL) > 0);
+            count++;
+
+            offset -= (end - buffer) + 1;
+            memmove(buffer, end + 1, offset + 1);
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+
+
+/*
+ * Connect the session to a new fake server, unless told to refuse.
+ */
+static int fake_connect(void) {
+    pthread_t thread;
+    int fds[2];
+    int *server;
+
+    pthread_mutex_lock(&server_lock);
+    if ( refuse ) {
+        pthread_mutex_unlock(&server_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&server_lock);
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    server = malloc(sizeof(int));
+    *server = fds[1];
+    assert(pthread_create(&thread, NULL, fake_server, server) == 0);
+    pthread_detach(thread);
+
+    return fds[0];
+}
+
+
+
+/*
+ * Count batches of answers being added to the cache.
+ */
+static void count_answered(void) {
+    pthread_mutex_lock(&server_lock);
+    answered++;
+    pthread_mutex_unlock(&server_lock);
+}
+
+
+
+/*
+ * Add an IPv4 address to a trie of addresses to look up.
+ */
+static void add_address(struct iptrie *trie, char *address) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    assert(inet_pton(AF_INET, address, &addr.sin_addr) == 1);
+    iptrie_add(trie, (struct sockaddr *)&addr, 24, 0);
+}
+
+
+
+/*
+ * Find the AS number for an IPv4 address in a result trie.
+ */
+static int64_t find_address(struct iptrie *trie, char *address) {
+    struct sockaddr_in addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    assert(inet_pton(AF_INET, address, &addr.sin_addr) == 1);
+    return iptrie_lookup_as(trie, (struct sockaddr *)&addr);
+}
+
+
+
+/*
+ * Get the number of queries the fake servers have seen.
+ */
+static int get_received(void) {
+    int count;
+
+    pthread_mutex_lock(&server_lock);
+    count = received;
+    received = 0;
+    pthread_mutex_unlock(&server_lock);
+
+    return count;
+}
+
+
+
+/*
+ * Make the server end the session, and wait for the session to notice.
+ */
+static void disconnect(whois_session_t *session) {
+    int fd;
+
+    pthread_mutex_lock(&session->lock);
+    if ( session->fd >= 0 ) {
+        shutdown(session->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    do {
+        usleep(1000);
+        pthread_mutex_lock(&session->lock);
+        fd = session->fd;
+        pthread_mutex_unlock(&session->lock);
+    } while ( fd >= 0 );
+}
+
+
+
+/*
+ * Check that lookups from several waiters share a single query per prefix,
+ * that answers get back to every waiter, that a lost connection is made
+ * again for the unanswered queries, and that an unreachable server fails
+ * lookups quickly rather than making them wait.
+ */
+int main(void) {
+    struct iptrie first = { NULL, NULL, NULL };
+    struct iptrie second = { NULL, NULL, NULL };
+    struct iptrie result = { NULL, NULL, NULL };
+    whois_session_stats_t stats;
+    whois_waiter_t *a, *b;
+    whois_session_t *session;
+    struct amp_asn_info *info;
+
+    info = calloc(1, sizeof(struct amp_asn_info));
+    info->trie = calloc(1, sizeof(struct iptrie));
+    info->mutex = malloc(sizeof(pthread_mutex_t));
+    pthread_mutex_init(info->mutex, NULL);
+
+    session = amp_test_whois_session_start(info, count_answered,
+            fake_connect);
+    assert(session);
+
+    /* both waiters want 10.0.1.0/24, it should only be asked about once */
+    add_address(&first, "10.0.1.1");
+    add_address(&first, "10.0.2.2");
+    add_address(&first, "192.0.2.1");
+    add_address(&second, "10.0.1.200");
+    add_address(&second, "10.0.3.3");
+
+    a = whois_session_lookup(session, &first);
+    b = whois_session_lookup(session, &second);
+    assert(a && b);
+
+    assert(whois_waiter_wait(a, 5) == 0);
+    assert(whois_waiter_wait(b, 5) == 0);
+
+    assert(whois_waiter_collect(a, &result) == 0);
+    assert(find_address(&result, "10.0.1.1") == 64501);
+    assert(find_address(&result, "10.0.2.2") == 64502);
+    /* errors are a failed query, not an answer */
+    assert(find_address(&result, "192.0.2.1") == -1);
+    iptrie_clear(&result);
+
+    assert(whois_waiter_collect(b, &result) == 0);
+    assert(find_address(&result, "10.0.1.1") == 64501);
+    assert(find_address(&result, "10.0.3.3") == 64503);
+    iptrie_clear(&result);
+
+    whois_waiter_release(a);
+    whois_waiter_release(b);
+
+    /* the answers went into the cache as well */
+    assert(iptrie_lookup_as(info->trie, (struct sockaddr *)&(struct
+                    sockaddr_in){ .sin_family = AF_INET,
+                    .sin_addr.s_addr = htonl(0x0a000305) }) == 64503);
+
+    whois_session_get_stats(session, &stats);
+    assert(get_received() == 4);
+    assert(stats.connects == 1);
+    assert(stats.queries == 4);
+    assert(stats.deduplicated == 1);
+    assert(stats.answers == 3);
+    assert(stats.failures == 1);
+    assert(answered > 0);
+
+    /* the server closes the idle connection */
+    disconnect(session);
+
+    /* each connection only answers one query, the rest are asked again */
+    pthread_mutex_lock(&server_lock);
+    close_after = 1;
+    pthread_mutex_unlock(&server_lock);
+
+    iptrie_clear(&first);
+    add_address(&first, "10.0.4.4");
+    add_address(&first, "10.0.5.5");
+    add_address(&first, "10.0.6.6");
+
+    a = whois_session_lookup(session, &first);
+    assert(a);
+    assert(whois_waiter_wait(a, 5) == 0);
+    assert(whois_waiter_collect(a, &result) == 0);
+    assert(find_address(&result, "10.0.4.4") == 64504);
+    assert(find_address(&result, "10.0.5.5") == 64505);
+    assert(find_address(&result, "10.0.6.6") == 64506);
+    iptrie_clear(&result);
+    whois_waiter_release(a);
+
+    whois_session_get_stats(session, &stats);
+    assert(stats.connects == 4);
+    assert(stats.disconnects == 2);
+    assert(stats.connect_failures == 0);
+    assert(stats.answers == 6);
+
+    /* when the server can't be reached, lookups fail straight away */
+    disconnect(session);
+
+    pthread_mutex_lock(&server_lock);
+    refuse = 1;
+    pthread_mutex_unlock(&server_lock);
+
+    a = whois_session_lookup(session, &second);
+    assert(a);
+    assert(whois_waiter_wait(a, 5) == 0);
+    assert(whois_waiter_collect(a, &result) == 0);
+    assert(result.ipv4 == NULL);
+    whois_waiter_release(a);
+
+    /* ...and the next attempt is delayed, so nothing is accepted for now */
+    assert(whois_session_lookup(session, &second) == NULL);
+
+    whois_session_get_stats(session, &stats);
+    assert(stats.connect_failures == 1);
+
+    iptrie_clear(&first);
+    iptrie_clear(&second);
+    whois_session_free(session);
+
+    iptrie_clear(info->trie);
+    free(info->trie);
+    pthread_mutex_destroy(info->mutex);
+    free(info->mutex);
+    free(info);
+
+    return EXIT_SUCCESS;
+}
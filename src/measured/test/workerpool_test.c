@@ -0,0 +1,360 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "workerpool.h"
+
+#define TEST_THREADS 3
+#define TEST_DEADLINE 200
+#define TEST_CONNECTIONS 100
+
+/* what the test service has seen, shared with the worker threads */
+static pthread_mutex_t test_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t test_cond = PTHREAD_COND_INITIALIZER;
+static worker_thread_t *owners[TEST_THREADS];
+static int started = 0;
+static int finished = 0;
+static int expired = 0;
+static int shared = 0;
+static int woken = 0;
+static worker_conn_t *waiting = NULL;
+
+
+
+/*
+ * Remember which worker each connection was given to.
+ */
+static int test_start(worker_conn_t *conn) {
+    pthread_mutex_lock(&test_lock);
+    if ( started < TEST_THREADS ) {
+        owners[started] = conn->worker;
+    }
+    started++;
+    pthread_mutex_unlock(&test_lock);
+
+    return WORKER_CONN_KEEP;
+}
+
+
+
+/*
+ * Read a single command byte from the test and act on it: 'e' echoes it
+ * back and closes, 'd' sets a deadline, 'w' waits to be woken up, and
+ * anything else just keeps the connection open.
+ */
+static int test_ready(worker_conn_t *conn, int fd, uint32_t events) {
+    char command;
+
+    assert(fd == conn->fd);
+    assert(events & EPOLLIN);
+
+    if ( recv(fd, &command, sizeof(command), MSG_DONTWAIT) != 1 ) {
+        return WORKER_CONN_CLOSE;
+    }
+
+    switch ( command ) {
+        case 'e':
+            assert(send(fd, &command, sizeof(command), 0) == 1);
+            return WORKER_CONN_CLOSE;
+
+        case 'd':
+            conn->deadline = worker_get_time() + TEST_DEADLINE;
+            break;
+
+        case 'w':
+            conn->polling = 1;
+            pthread_mutex_lock(&test_lock);
+            waiting = conn;
+            pthread_cond_signal(&test_cond);
+            pthread_mutex_unlock(&test_lock);
+            break;
+    };
+
+    return WORKER_CONN_KEEP;
+}
+
+
+
+/*
+ * Finish the waiting connection once the test has woken it up.
+ */
+static int test_poll(worker_conn_t *conn) {
+    char reply = 'w';
+    int ready;
+
+    pthread_mutex_lock(&test_lock);
+    ready = woken;
+    pthread_mutex_unlock(&test_lock);
+
+    if ( !ready ) {
+        return WORKER_CONN_KEEP;
+    }
+
+    assert(send(conn->fd, &reply, sizeof(reply), 0) == 1);
+
+    return WORKER_CONN_CLOSE;
+}
+
+
+
+/*
+ * Count connections that reach their deadline.
+ */
+static int test_expire(__attribute__((unused))worker_conn_t *conn) {
+    pthread_mutex_lock(&test_lock);
+    expired++;
+    pthread_mutex_unlock(&test_lock);
+
+    return WORKER_CONN_CLOSE;
+}
+
+
+
+/*
+ * Empty the shared descriptor and count how often it was read.
+ */
+static void test_shared_ready(void *data) {
+    char buffer[64];
+
+    if ( read(*(int *)data, buffer, sizeof(buffer)) > 0 ) {
+        pthread_mutex_lock(&test_lock);
+        shared++;
+        pthread_cond_signal(&test_cond);
+        pthread_mutex_unlock(&test_lock);
+    }
+}
+
+
+
+/*
+ * Count connections that have been tidied up.
+ */
+static void test_finish(__attribute__((unused))worker_conn_t *conn) {
+    pthread_mutex_lock(&test_lock);
+    finished++;
+    pthread_mutex_unlock(&test_lock);
+}
+
+
+
+/*
+ * Create a connection to the worker threads, returning the client end.
+ */
+static int connect_worker(worker_pool_t *pool) {
+    int sockets[2];
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    assert(worker_pool_add_connection(pool, sockets[1]) == 0);
+
+    return sockets[0];
+}
+
+
+
+/*
+ * Wait for a single byte from the worker threads, returning it or -1 if the
+ * connection was closed, or 0 if nothing arrived before the timeout.
+ */
+static int wait_reply(int fd, int timeout) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    char reply;
+    ssize_t bytes;
+
+    if ( poll(&pfd, 1, timeout) == 0 ) {
+        return 0;
+    }
+
+    /* closing with unread data resets the connection rather than ending it */
+    bytes = recv(fd, &reply, sizeof(reply), 0);
+    assert(bytes >= 0 || errno == ECONNRESET);
+
+    return bytes <= 0 ? -1 : reply;
+}
+
+
+
+/*
+ * Wait until the number of finished connections reaches the given count.
+ */
+static void wait_finished(int count) {
+    int done;
+    int i;
+
+    for ( i = 0; i < 1000; i++ ) {
+        pthread_mutex_lock(&test_lock);
+        done = finished;
+        pthread_mutex_unlock(&test_lock);
+
+        if ( done >= count ) {
+            return;
+        }
+        usleep(1000);
+    }
+
+    assert(0);
+}
+
+
+
+/*
+ * Check that connections are spread across the workers and run through to
+ * completion, that deadlines expire connections, that connections can be
+ * woken by other threads, and that stopping the pool closes everything.
+ */
+int main(void) {
+    worker_service_t service;
+    worker_pool_t *pool;
+    int fds[TEST_CONNECTIONS];
+    int shared_fds[2];
+    uint64_t start;
+    char command;
+    int fd;
+    int i;
+
+    assert(pipe(shared_fds) == 0);
+
+    memset(&service, 0, sizeof(service));
+    service.name = "test";
+    service.data = &shared_fds[0];
+    service.shared_fd = shared_fds[0];
+    service.poll_interval = 0;
+    service.start = test_start;
+    service.ready = test_ready;
+    service.poll = test_poll;
+    service.expire = test_expire;
+    service.shared_ready = test_shared_ready;
+    service.finish = test_finish;
+
+    pool = create_worker_pool(&service, TEST_THREADS);
+    assert(pool);
+
+    /* connections held open at the same time go to different workers */
+    for ( i = 0; i < TEST_THREADS; i++ ) {
+        fds[i] = connect_worker(pool);
+    }
+    command = 'e';
+    for ( i = 0; i < TEST_THREADS; i++ ) {
+        assert(send(fds[i], &command, sizeof(command), 0) == 1);
+        assert(wait_reply(fds[i], 1000) == 'e');
+        assert(wait_reply(fds[i], 1000) == -1);
+        close(fds[i]);
+    }
+    wait_finished(TEST_THREADS);
+    assert(owners[0] != owners[1]);
+    assert(owners[0] != owners[2]);
+    assert(owners[1] != owners[2]);
+
+    /* lots of connections all get handed over and answered */
+    for ( i = 0; i < TEST_CONNECTIONS; i++ ) {
+        fds[i] = connect_worker(pool);
+        assert(send(fds[i], &command, sizeof(command), 0) == 1);
+    }
+    for ( i = 0; i < TEST_CONNECTIONS; i++ ) {
+        assert(wait_reply(fds[i], 1000) == 'e');
+        close(fds[i]);
+    }
+    wait_finished(TEST_THREADS + TEST_CONNECTIONS);
+    assert(started == TEST_THREADS + TEST_CONNECTIONS);
+
+    /* connections are closed once their deadline passes, and not before */
+    fd = connect_worker(pool);
+    command = 'd';
+    start = worker_get_time();
+    assert(send(fd, &command, sizeof(command), 0) == 1);
+    assert(wait_reply(fd, 2000) == -1);
+    assert(worker_get_time() - start >= TEST_DEADLINE);
+    assert(expired == 1);
+    close(fd);
+
+    /* polling connections are only polled when the worker is woken up */
+    fd = connect_worker(pool);
+    command = 'w';
+    assert(send(fd, &command, sizeof(command), 0) == 1);
+    pthread_mutex_lock(&test_lock);
+    while ( waiting == NULL ) {
+        pthread_cond_wait(&test_cond, &test_lock);
+    }
+    pthread_mutex_unlock(&test_lock);
+    assert(wait_reply(fd, 100) == 0);
+
+    pthread_mutex_lock(&test_lock);
+    woken = 1;
+    pthread_mutex_unlock(&test_lock);
+    worker_conn_wake(waiting);
+    assert(wait_reply(fd, 1000) == 'w');
+    close(fd);
+
+    /* the shared descriptor is read by one of the workers */
+    assert(write(shared_fds[1], "x", 1) == 1);
+    pthread_mutex_lock(&test_lock);
+    while ( shared == 0 ) {
+        pthread_cond_wait(&test_cond, &test_lock);
+    }
+    pthread_mutex_unlock(&test_lock);
+    assert(shared == 1);
+
+    /* stopping the pool closes connections that are still open */
+    wait_finished(TEST_THREADS + TEST_CONNECTIONS + 2);
+    command = 'h';
+    for ( i = 0; i < TEST_THREADS; i++ ) {
+        fds[i] = connect_worker(pool);
+        assert(send(fds[i], &command, sizeof(command), 0) == 1);
+    }
+    destroy_worker_pool(pool);
+    for ( i = 0; i < TEST_THREADS; i++ ) {
+        assert(wait_reply(fds[i], 1000) == -1);
+        close(fds[i]);
+    }
+    assert(finished + TEST_THREADS >= started);
+
+    close(shared_fds[0]);
+    close(shared_fds[1]);
+
+    return 0;
+}
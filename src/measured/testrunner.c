@@ -0,0 +1,1068 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <libwandevent.h>
+
+#include "config.h"
+#include "testrunner.h"
+#include "run.h"
+#include "debug.h"
+#include "modules.h"
+#include "testlib.h"
+#include "global.h"
+#include "admission.h"
+
+/* marks a NULL string when serialising test descriptions */
+#define NULL_STRING_LENGTH 0xffffffff
+
+/* read position when unpacking a serialised test description */
+struct unpack_cursor {
+    uint8_t *data;
+    uint32_t length;
+    uint32_t offset;
+};
+
+/* sockets used to talk to each of the test runners, -1 if not running */
+static int runner_fds[MAX_TEST_RUNNERS];
+static pid_t runner_pids[MAX_TEST_RUNNERS];
+static int runner_count = 0;
+static int runner_next = 0;
+/* messages partially written to a runner, sent once the socket drains */
+static test_runner_buffer_t runner_pending[MAX_TEST_RUNNERS];
+static uint32_t runner_pending_offset[MAX_TEST_RUNNERS];
+static wand_event_handler_t *runner_ev_hdl = NULL;
+
+/* tests started by this process, when running as a test runner */
+static test_runner_child_t *children = NULL;
+static int child_count = 0;
+static int child_size = 0;
+
+
+
+/*
+ * Append raw bytes to the buffer, doubling the space whenever it runs out.
+ */
+static void pack_bytes(test_runner_buffer_t *buffer, const void *data,
+        uint32_t length) {
+
+    if ( buffer->length + length > buffer->size ) {
+        if ( buffer->size == 0 ) {
+            buffer->size = 1024;
+        }
+        while ( buffer->length + length > buffer->size ) {
+            buffer->size *= 2;
+        }
+        buffer->data = realloc(buffer->data, buffer->size);
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+
+
+/*
+ * Append a single 32 bit value to the buffer, in host byte order (both ends
+ * of the socket are on the same machine).
+ */
+static void pack_uint32(test_runner_buffer_t *buffer, uint32_t value) {
+    pack_bytes(buffer, &value, sizeof(value));
+}
+
+
+
+/*
+ * Append a length prefixed string to the buffer. NULL strings are given a
+ * special length so they can be recreated as NULL at the other end.
+ */
+static void pack_string(test_runner_buffer_t *buffer, char *str) {
+    if ( str == NULL ) {
+        pack_uint32(buffer, NULL_STRING_LENGTH);
+        return;
+    }
+
+    pack_uint32(buffer, strlen(str));
+    pack_bytes(buffer, str, strlen(str));
+}
+
+
+
+/*
+ * Copy raw bytes out of the serialised description, making sure not to go
+ * past the end of it.
+ */
+static int unpack_bytes(struct unpack_cursor *cursor, void *out,
+        uint32_t length) {
+
+    if ( length > cursor->length - cursor->offset ) {
+        Log(LOG_WARNING, "Truncated test description from measured");
+        return -1;
+    }
+
+    memcpy(out, cursor->data + cursor->offset, length);
+    cursor->offset += length;
+
+    return 0;
+}
+
+
+
+/*
+ * Read a single 32 bit value from the serialised description.
+ */
+static int unpack_uint32(struct unpack_cursor *cursor, uint32_t *value) {
+    return unpack_bytes(cursor, value, sizeof(uint32_t));
+}
+
+
+
+/*
+ * Read a length prefixed string from the serialised description, allocating
+ * memory for it. NULL strings are set to NULL.
+ */
+static int unpack_string(struct unpack_cursor *cursor, char **str) {
+    uint32_t length;
+
+    *str = NULL;
+
+    if ( unpack_uint32(cursor, &length) < 0 ) {
+        return -1;
+    }
+
+    if ( length == NULL_STRING_LENGTH ) {
+        return 0;
+    }
+
+    if ( length > cursor->length - cursor->offset ) {
+        Log(LOG_WARNING, "Truncated string in test description from measured");
+        return -1;
+    }
+
+    *str = malloc(length + 1);
+    memcpy(*str, cursor->data + cursor->offset, length);
+    (*str)[length] = '\0';
+    cursor->offset += length;
+
+    return 0;
+}
+
+
+
+/*
+ * Serialise everything the test process needs to know about a scheduled
+ * test so that it can be sent to a test runner. Pre-resolved destinations
+ * are sent as addresses so the runner doesn't need a copy of the nametable.
+ */
+int pack_test_item(test_runner_buffer_t *buffer, test_schedule_item_t *item) {
+    resolve_dest_t *resolve;
+    uint32_t param_count = 0;
+    uint32_t i;
+
+    assert(buffer);
+    assert(item);
+    assert(item->meta);
+
+    if ( item->params != NULL ) {
+        for ( param_count = 0; item->params[param_count] != NULL;
+                param_count++ ) {
+            /* nothing, just counting */
+        }
+    }
+
+    pack_uint32(buffer, item->test_id);
+    pack_uint32(buffer, item->dest_count);
+    pack_uint32(buffer, item->resolve_count);
+    pack_uint32(buffer, param_count);
+
+    pack_uint32(buffer, item->meta->inter_packet_delay);
+    pack_uint32(buffer, item->meta->dscp);
+    pack_string(buffer, item->meta->interface);
+    pack_string(buffer, item->meta->sourcev4);
+    pack_string(buffer, item->meta->sourcev6);
+    pack_string(buffer, item->meta->ampname);
+
+    for ( i = 0; i < item->dest_count; i++ ) {
+        struct addrinfo *addr = item->dests[i];
+        pack_uint32(buffer, addr->ai_family);
+        pack_uint32(buffer, addr->ai_socktype);
+        pack_uint32(buffer, addr->ai_protocol);
+        pack_uint32(buffer, addr->ai_addrlen);
+        pack_bytes(buffer, addr->ai_addr, addr->ai_addrlen);
+        pack_string(buffer, addr->ai_canonname);
+    }
+
+    for ( resolve = item->resolve; resolve != NULL; resolve = resolve->next ) {
+        pack_string(buffer, resolve->name);
+        pack_uint32(buffer, resolve->family);
+        pack_uint32(buffer, resolve->count);
+    }
+
+    for ( i = 0; i < param_count; i++ ) {
+        pack_string(buffer, item->params[i]);
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Free a test description that was created by unpack_test_item().
+ */
+void free_unpacked_test_item(test_schedule_item_t *item) {
+    uint32_t i;
+
+    if ( item == NULL ) {
+        return;
+    }
+
+    if ( item->meta ) {
+        free(item->meta->interface);
+        free(item->meta->sourcev4);
+        free(item->meta->sourcev6);
+        free(item->meta->ampname);
+        free(item->meta);
+    }
+
+    if ( item->dests ) {
+        for ( i = 0; i < item->dest_count; i++ ) {
+            if ( item->dests[i] ) {
+                free(item->dests[i]->ai_addr);
+                free(item->dests[i]->ai_canonname);
+                free(item->dests[i]);
+            }
+        }
+        free(item->dests);
+    }
+
+    while ( item->resolve != NULL ) {
+        resolve_dest_t *tmp = item->resolve;
+        item->resolve = item->resolve->next;
+        free(tmp->name);
+        free(tmp);
+    }
+
+    if ( item->params ) {
+        for ( i = 0; item->params[i] != NULL; i++ ) {
+            free(item->params[i]);
+        }
+        free(item->params);
+    }
+
+    free(item);
+}
+
+
+
+/*
+ * Recreate a test schedule item from the serialised description sent by
+ * measured. Returns NULL if the description is invalid.
+ */
+test_schedule_item_t *unpack_test_item(uint8_t *data, uint32_t length) {
+    struct unpack_cursor cursor;
+    test_schedule_item_t *item;
+    resolve_dest_t **tail;
+    uint32_t test_id, dscp, param_count, resolve_count;
+    uint32_t i;
+
+    assert(data);
+
+    cursor.data = data;
+    cursor.length = length;
+    cursor.offset = 0;
+
+    item = calloc(1, sizeof(test_schedule_item_t));
+    item->meta = calloc(1, sizeof(amp_test_meta_t));
+
+    if ( unpack_uint32(&cursor, &test_id) < 0 ||
+            unpack_uint32(&cursor, &item->dest_count) < 0 ||
+            unpack_uint32(&cursor, &resolve_count) < 0 ||
+            unpack_uint32(&cursor, &param_count) < 0 ||
+            unpack_uint32(&cursor, &item->meta->inter_packet_delay) < 0 ||
+            unpack_uint32(&cursor, &dscp) < 0 ||
+            unpack_string(&cursor, &item->meta->interface) < 0 ||
+            unpack_string(&cursor, &item->meta->sourcev4) < 0 ||
+            unpack_string(&cursor, &item->meta->sourcev6) < 0 ||
+            unpack_string(&cursor, &item->meta->ampname) < 0 ) {
+        goto error;
+    }
+
+    if ( test_id >= AMP_TEST_LAST || item->dest_count > length ||
+            resolve_count > length || param_count >= MAX_TEST_ARGS ) {
+        Log(LOG_WARNING, "Invalid test description from measured");
+        goto error;
+    }
+
+    item->test_id = test_id;
+    item->meta->dscp = dscp;
+
+    if ( item->dest_count > 0 ) {
+        item->dests = calloc(item->dest_count, sizeof(struct addrinfo *));
+    }
+
+    for ( i = 0; i < item->dest_count; i++ ) {
+        struct addrinfo *addr = calloc(1, sizeof(struct addrinfo));
+        uint32_t family, socktype, protocol, addrlen;
+
+        item->dests[i] = addr;
+
+        if ( unpack_uint32(&cursor, &family) < 0 ||
+                unpack_uint32(&cursor, &socktype) < 0 ||
+                unpack_uint32(&cursor, &protocol) < 0 ||
+                unpack_uint32(&cursor, &addrlen) < 0 ||
+                addrlen > sizeof(struct sockaddr_storage) ) {
+            goto error;
+        }
+
+        addr->ai_family = family;
+        addr->ai_socktype = socktype;
+        addr->ai_protocol = protocol;
+        addr->ai_addrlen = addrlen;
+        addr->ai_addr = calloc(1, sizeof(struct sockaddr_storage));
+
+        if ( unpack_bytes(&cursor, addr->ai_addr, addrlen) < 0 ||
+                unpack_string(&cursor, &addr->ai_canonname) < 0 ) {
+            goto error;
+        }
+    }
+
+    /* keep the resolve list in the same order it was sent */
+    tail = &item->resolve;
+    for ( i = 0; i < resolve_count; i++ ) {
+        resolve_dest_t *resolve = calloc(1, sizeof(resolve_dest_t));
+        uint32_t family, count;
+
+        *tail = resolve;
+        tail = &resolve->next;
+        item->resolve_count++;
+
+        if ( unpack_string(&cursor, &resolve->name) < 0 ||
+                unpack_uint32(&cursor, &family) < 0 ||
+                unpack_uint32(&cursor, &count) < 0 ) {
+            goto error;
+        }
+
+        resolve->family = family;
+        resolve->count = count;
+    }
+
+    if ( param_count > 0 ) {
+        item->params = calloc(param_count + 1, sizeof(char *));
+        for ( i = 0; i < param_count; i++ ) {
+            if ( unpack_string(&cursor, &item->params[i]) < 0 ||
+                    item->params[i] == NULL ) {
+                goto error;
+            }
+        }
+    }
+
+    return item;
+
+error:
+    free_unpacked_test_item(item);
+    return NULL;
+}
+
+
+
+/*
+ * Read exactly length bytes from the socket. Returns 1 on success, 0 if the
+ * socket was closed and -1 on error. A non-blocking socket is waited on if
+ * it runs dry part way through a message, the rest is already on its way.
+ */
+static int read_full(int fd, void *data, uint32_t length) {
+    struct pollfd pfd;
+    uint32_t total = 0;
+    ssize_t bytes;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while ( total < length ) {
+        if ( (bytes = read(fd, (uint8_t*)data + total, length - total)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                if ( poll(&pfd, 1, -1) < 0 && errno != EINTR ) {
+                    return -1;
+                }
+                continue;
+            }
+            return -1;
+        }
+
+        if ( bytes == 0 ) {
+            return 0;
+        }
+
+        total += bytes;
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Write exactly length bytes to the socket. Returns 0 on success, -1 if
+ * the socket failed (the runner has probably gone away).
+ */
+static int write_full(int fd, void *data, uint32_t length) {
+    uint32_t total = 0;
+    ssize_t bytes;
+
+    while ( total < length ) {
+        /* don't let a dead test runner take measured down with SIGPIPE */
+        if ( (bytes = send(fd, (uint8_t*)data + total, length - total,
+                        MSG_NOSIGNAL)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+
+        total += bytes;
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Start a single test process from the test runner, using the serialised
+ * description from measured.
+ */
+static void start_test(int fd, uint32_t id, uint8_t *data, uint32_t length) {
+    test_schedule_item_t *item;
+    pid_t pid;
+
+    if ( (pid = fork()) < 0 ) {
+        Log(LOG_WARNING, "Test runner failed to fork: %s", strerror(errno));
+        return;
+    } else if ( pid > 0 ) {
+        /* remember the test so we can tell measured when it finishes */
+        if ( child_count == child_size ) {
+            child_size = child_size == 0 ? 16 : child_size * 2;
+            children = realloc(children,
+                    sizeof(test_runner_child_t) * child_size);
+        }
+        children[child_count].pid = pid;
+        children[child_count].id = id;
+        child_count++;
+        return;
+    }
+
+    /* the test doesn't need the connection to measured */
+    close(fd);
+
+    /* restore default signal handlers, some tests wait for children */
+    if ( unblock_signals() < 0 ) {
+        Log(LOG_WARNING, "Failed to unblock signals, aborting");
+        exit(1);
+    }
+
+    if ( (item = unpack_test_item(data, length)) == NULL ) {
+        Log(LOG_WARNING, "Failed to unpack test description, aborting");
+        exit(1);
+    }
+
+    if ( amp_tests[item->test_id] == NULL ) {
+        Log(LOG_WARNING, "Test runner has no test with id %d", item->test_id);
+        exit(1);
+    }
+
+    run_test(item, NULL);
+
+    Log(LOG_WARNING, "%s test failed to run", amp_tests[item->test_id]->name);
+    exit(1);
+}
+
+
+
+/*
+ * Reap any tests that have finished and tell measured about them, so that
+ * it knows that they are no longer running.
+ */
+static int report_finished_tests(int fd) {
+    test_runner_header_t header;
+    pid_t pid;
+    int i;
+
+    while ( (pid = waitpid(-1, NULL, WNOHANG)) > 0 ) {
+        for ( i = 0; i < child_count; i++ ) {
+            if ( children[i].pid != pid ) {
+                continue;
+            }
+
+            header.type = TEST_RUNNER_DONE;
+            header.id = children[i].id;
+            header.length = 0;
+            children[i] = children[--child_count];
+
+            if ( write_full(fd, &header, sizeof(header)) < 0 ) {
+                return -1;
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Empty signal handler, SIGCHLD only needs to interrupt poll().
+ */
+static void child_signal(__attribute__((unused))int signum) {
+}
+
+
+
+/*
+ * Main loop of a test runner process. Wait for test descriptions from
+ * measured and fork a new process to run each of them. The runner is forked
+ * before measured loads the nametable and schedule, so it is much cheaper
+ * to fork than measured itself.
+ */
+static void test_runner_main(int fd) {
+    test_runner_header_t header;
+    struct sigaction action;
+    struct pollfd pfd;
+    uint8_t *data;
+    int res = 0;
+
+    /* start with default signal handlers, not the ones measured uses */
+    if ( unblock_signals() < 0 ) {
+        Log(LOG_WARNING, "Failed to unblock signals in test runner");
+        exit(1);
+    }
+
+    /* go away if measured does, so we don't end up running orphaned */
+    if ( prctl(PR_SET_PDEATHSIG, SIGTERM) < 0 ) {
+        Log(LOG_WARNING, "Failed to set parent death signal: %s",
+                strerror(errno));
+    }
+
+    /* wake up from poll() as soon as a test finishes */
+    action.sa_flags = 0;
+    action.sa_handler = child_signal;
+    sigemptyset(&action.sa_mask);
+    if ( sigaction(SIGCHLD, &action, NULL) < 0 ) {
+        Log(LOG_WARNING, "Failed to set SIGCHLD handler in test runner: %s",
+                strerror(errno));
+        exit(1);
+    }
+
+    if ( register_tests(AMP_TEST_DIRECTORY) == -1 ) {
+        Log(LOG_ALERT, "Test runner failed to register tests, aborting");
+        exit(1);
+    }
+
+    Log(LOG_DEBUG, "Test runner %d waiting for tests", getpid());
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    while ( 1 ) {
+        if ( report_finished_tests(fd) < 0 ) {
+            res = -1;
+            break;
+        }
+
+        /* time out occasionally in case SIGCHLD arrived before poll() */
+        if ( (res = poll(&pfd, 1, TEST_RUNNER_POLL_INTERVAL)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            break;
+        }
+
+        if ( res == 0 ) {
+            continue;
+        }
+
+        if ( (res = read_full(fd, &header, sizeof(header))) <= 0 ) {
+            break;
+        }
+
+        switch ( header.type ) {
+            case TEST_RUNNER_RUN:
+                data = malloc(header.length);
+                if ( (res = read_full(fd, data, header.length)) <= 0 ) {
+                    free(data);
+                    goto end;
+                }
+                start_test(fd, header.id, data, header.length);
+                free(data);
+                break;
+
+            case TEST_RUNNER_RELOAD:
+                Log(LOG_DEBUG, "Test runner %d reloading tests", getpid());
+                unregister_tests();
+                if ( register_tests(AMP_TEST_DIRECTORY) == -1 ) {
+                    Log(LOG_ALERT, "Test runner failed to register tests");
+                    res = -1;
+                    goto end;
+                }
+                break;
+
+            default:
+                Log(LOG_WARNING, "Unknown message type %d for test runner",
+                        header.type);
+                res = -1;
+                goto end;
+        };
+    }
+
+end:
+    Log(LOG_DEBUG, "Test runner %d exiting", getpid());
+    close(fd);
+    unregister_tests();
+    exit(res < 0 ? 1 : 0);
+}
+
+
+
+/*
+ * Stop using a test runner that we can't talk to any more. Tests will still
+ * run, but they will be forked directly from measured.
+ */
+static void close_test_runner(int index) {
+    Log(LOG_WARNING, "Lost connection to test runner %d, disabling",
+            runner_pids[index]);
+    if ( runner_ev_hdl ) {
+        wand_del_fd(runner_ev_hdl, runner_fds[index]);
+    }
+    close(runner_fds[index]);
+    runner_fds[index] = -1;
+
+    free(runner_pending[index].data);
+    memset(&runner_pending[index], 0, sizeof(test_runner_buffer_t));
+    runner_pending_offset[index] = 0;
+}
+
+
+
+/*
+ * Write as much as the test runner socket will take without blocking.
+ * Returns the number of bytes written (possibly zero if the socket is full),
+ * or -1 if the socket failed.
+ */
+static ssize_t write_to_test_runner(int index, uint8_t *data,
+        uint32_t length) {
+    ssize_t bytes;
+
+    while ( (bytes = send(runner_fds[index], data, length,
+                    MSG_NOSIGNAL)) < 0 ) {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            return 0;
+        }
+        if ( errno != EINTR ) {
+            return -1;
+        }
+    }
+
+    return bytes;
+}
+
+
+
+static void runner_event_callback(wand_event_handler_t *ev_hdl, int fd,
+        void *data, enum wand_eventtype_t ev);
+
+/*
+ * Watch a test runner socket for reading, and also for writing while there
+ * is still part of a message waiting to be sent to it.
+ */
+static void watch_test_runner(int index, int events) {
+    if ( runner_ev_hdl == NULL ) {
+        return;
+    }
+
+    wand_del_fd(runner_ev_hdl, runner_fds[index]);
+    wand_add_fd(runner_ev_hdl, runner_fds[index], events, (void*)(long)index,
+            runner_event_callback);
+}
+
+
+
+/*
+ * Keep the part of a message that the test runner socket wouldn't take, and
+ * send it once the socket drains. The runner is busy until then, and won't
+ * be given any more tests.
+ */
+static void queue_for_test_runner(int index, uint8_t *data, uint32_t length) {
+    if ( runner_pending[index].length == 0 ) {
+        watch_test_runner(index, EV_READ | EV_WRITE);
+    }
+
+    pack_bytes(&runner_pending[index], data, length);
+}
+
+
+
+/*
+ * Send more of the queued message now that the test runner socket has
+ * room. Returns 0 on success (even if some is still queued), or -1 if the
+ * socket failed.
+ */
+static int flush_test_runner(int index) {
+    test_runner_buffer_t *pending = &runner_pending[index];
+    ssize_t bytes;
+
+    bytes = write_to_test_runner(index,
+            pending->data + runner_pending_offset[index],
+            pending->length - runner_pending_offset[index]);
+
+    if ( bytes < 0 ) {
+        return -1;
+    }
+
+    runner_pending_offset[index] += bytes;
+
+    if ( runner_pending_offset[index] == pending->length ) {
+        free(pending->data);
+        memset(pending, 0, sizeof(test_runner_buffer_t));
+        runner_pending_offset[index] = 0;
+        watch_test_runner(index, EV_READ);
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Read messages from a test runner telling us which tests have finished,
+ * and send any queued message once the socket has room for it.
+ */
+static void runner_event_callback(__attribute__((unused))
+        wand_event_handler_t *ev_hdl, int fd, void *data,
+        enum wand_eventtype_t ev) {
+
+    test_runner_header_t header;
+    int index = (int)(long)data;
+    ssize_t bytes;
+
+    if ( (ev & EV_WRITE) && flush_test_runner(index) < 0 ) {
+        close_test_runner(index);
+        return;
+    }
+
+    if ( !(ev & EV_READ) ) {
+        return;
+    }
+
+    /* the socket is non-blocking, read everything that is available */
+    while ( 1 ) {
+        if ( (bytes = recv(fd, &header, sizeof(header), 0)) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return;
+            }
+            break;
+        }
+
+        if ( bytes == 0 ) {
+            break;
+        }
+
+        if ( (size_t)bytes < sizeof(header) && read_full(fd,
+                    (uint8_t*)&header + bytes, sizeof(header) - bytes) <= 0 ) {
+            break;
+        }
+
+        if ( header.type != TEST_RUNNER_DONE ) {
+            break;
+        }
+
+        release_test_slot_by_id(header.id);
+    }
+
+    close_test_runner(index);
+}
+
+
+
+/*
+ * Fork the test runner processes. This should be done before loading large
+ * data structures (nametable, schedule, ASN information) so that the runners
+ * stay small and cheap to fork.
+ */
+int start_test_runners(wand_event_handler_t *ev_hdl, int count) {
+    int sv[2];
+    pid_t pid;
+    int i;
+
+    runner_ev_hdl = ev_hdl;
+
+    if ( count > MAX_TEST_RUNNERS ) {
+        Log(LOG_WARNING, "Too many test runners (%d), limiting to %d", count,
+                MAX_TEST_RUNNERS);
+        count = MAX_TEST_RUNNERS;
+    }
+
+    for ( runner_count = 0; runner_count < count; runner_count++ ) {
+        if ( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0 ) {
+            Log(LOG_WARNING, "Failed to create test runner socket: %s",
+                    strerror(errno));
+            return -1;
+        }
+
+        if ( (pid = fork()) < 0 ) {
+            Log(LOG_WARNING, "Failed to fork test runner: %s",
+                    strerror(errno));
+            close(sv[0]);
+            close(sv[1]);
+            return -1;
+        } else if ( pid == 0 ) {
+            /* only keep our own connection, not those to other runners */
+            for ( i = 0; i < runner_count; i++ ) {
+                if ( runner_fds[i] >= 0 ) {
+                    close(runner_fds[i]);
+                }
+            }
+            close(sv[0]);
+            close(vars.asnsock_fd);
+            close(vars.nssock_fd);
+            close(vars.brokersock_fd);
+            test_runner_main(sv[1]);
+        }
+
+        close(sv[1]);
+
+        /* a stuck runner must never block the main event loop */
+        if ( fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK) < 0 ) {
+            Log(LOG_WARNING, "Failed to make test runner socket non-blocking: "
+                    "%s", strerror(errno));
+            close(sv[0]);
+            return -1;
+        }
+
+        runner_fds[runner_count] = sv[0];
+        runner_pids[runner_count] = pid;
+        wand_add_fd(ev_hdl, sv[0], EV_READ, (void*)(long)runner_count,
+                runner_event_callback);
+    }
+
+    Log(LOG_DEBUG, "Started %d test runners", runner_count);
+
+    return 0;
+}
+
+
+
+/*
+ * Close the connections to all the test runners, which will then exit.
+ */
+void stop_test_runners(void) {
+    int i;
+
+    for ( i = 0; i < runner_count; i++ ) {
+        if ( runner_fds[i] >= 0 ) {
+            if ( runner_ev_hdl ) {
+                wand_del_fd(runner_ev_hdl, runner_fds[i]);
+            }
+            close(runner_fds[i]);
+            runner_fds[i] = -1;
+        }
+
+        free(runner_pending[i].data);
+        memset(&runner_pending[i], 0, sizeof(test_runner_buffer_t));
+        runner_pending_offset[i] = 0;
+    }
+
+    runner_count = 0;
+}
+
+
+
+/*
+ * Tell all the test runners to reload the test modules. Runners that are
+ * busy will get the message after whatever is already queued for them.
+ */
+void reload_test_runners(void) {
+    test_runner_header_t header;
+    ssize_t bytes;
+    int i;
+
+    header.type = TEST_RUNNER_RELOAD;
+    header.id = 0;
+    header.length = 0;
+
+    for ( i = 0; i < runner_count; i++ ) {
+        if ( runner_fds[i] < 0 ) {
+            continue;
+        }
+
+        if ( runner_pending[i].length > 0 ) {
+            queue_for_test_runner(i, (uint8_t*)&header, sizeof(header));
+            continue;
+        }
+
+        if ( (bytes = write_to_test_runner(i, (uint8_t*)&header,
+                        sizeof(header))) < 0 ) {
+            close_test_runner(i);
+            continue;
+        }
+
+        if ( (size_t)bytes < sizeof(header) ) {
+            queue_for_test_runner(i, (uint8_t*)&header + bytes,
+                    sizeof(header) - bytes);
+        }
+    }
+}
+
+
+
+/*
+ * Send a test to the next available test runner. Returns 1 if the test was
+ * handed off, or 0 if there are no runners that can take it right now and
+ * it should be run directly. The runner will report back using the id when
+ * the test has finished.
+ */
+int run_test_on_runner(test_schedule_item_t *item, uint32_t id) {
+    test_runner_buffer_t buffer;
+    test_runner_header_t header;
+    ssize_t bytes;
+    int attempts;
+    int index;
+    int sent = 0;
+
+    if ( runner_count == 0 ) {
+        return 0;
+    }
+
+    /* the header goes first, its length is filled in once the test is */
+    memset(&header, 0, sizeof(header));
+    memset(&buffer, 0, sizeof(buffer));
+    pack_bytes(&buffer, &header, sizeof(header));
+    pack_test_item(&buffer, item);
+
+    header.type = TEST_RUNNER_RUN;
+    header.id = id;
+    header.length = buffer.length - sizeof(header);
+    memcpy(buffer.data, &header, sizeof(header));
+
+    /*
+     * Hand tests out round robin, skipping any runners that have died or
+     * are busy. If a runner socket is full then try the next one rather than
+     * wait, measured can always fork the test itself.
+     */
+    for ( attempts = 0; attempts < runner_count && !sent; attempts++ ) {
+        index = runner_next;
+        runner_next = (runner_next + 1) % runner_count;
+
+        if ( runner_fds[index] < 0 || runner_pending[index].length > 0 ) {
+            continue;
+        }
+
+        if ( (bytes = write_to_test_runner(index, buffer.data,
+                        buffer.length)) < 0 ) {
+            close_test_runner(index);
+            continue;
+        }
+
+        if ( bytes == 0 ) {
+            continue;
+        }
+
+        /* the runner has started reading this test, it has to finish it */
+        if ( (uint32_t)bytes < buffer.length ) {
+            queue_for_test_runner(index, buffer.data + bytes,
+                    buffer.length - bytes);
+        }
+
+        sent = 1;
+    }
+
+    free(buffer.data);
+
+    return sent;
+}
+
+
+
+#if UNIT_TEST
+/*
+ * Use an existing socket as the connection to a test runner, without
+ * forking a runner process or watching it with an event handler.
+ */
+void amp_test_add_test_runner(int fd) {
+    assert(runner_count < MAX_TEST_RUNNERS);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    runner_fds[runner_count] = fd;
+    runner_pids[runner_count] = 0;
+    runner_count++;
+}
+
+
+
+/*
+ * Send as much of the message queued for a test runner as will fit, as if
+ * the event handler had seen the socket become writable. Returns the number
+ * of bytes still queued.
+ */
+uint32_t amp_test_flush_test_runner(int index) {
+    if ( runner_pending[index].length > 0 && flush_test_runner(index) < 0 ) {
+        close_test_runner(index);
+    }
+
+    return runner_pending[index].length - runner_pending_offset[index];
+}
+#endif
@@ -0,0 +1,105 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_TESTRUNNER_H
+#define _MEASURED_TESTRUNNER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <libwandevent.h>
+
+#include "schedule.h"
+
+/* default number of pre-forked processes used to start scheduled tests */
+#define DEFAULT_TEST_RUNNERS 2
+/* upper limit on the number of test runner processes */
+#define MAX_TEST_RUNNERS 64
+
+/* how often a test runner checks for finished tests (in milliseconds) */
+#define TEST_RUNNER_POLL_INTERVAL 1000
+
+/* message types sent from measured to a test runner */
+#define TEST_RUNNER_RUN 1
+#define TEST_RUNNER_RELOAD 2
+/* message types sent from a test runner to measured */
+#define TEST_RUNNER_DONE 3
+
+/*
+ * Every message between measured and a test runner starts with this header,
+ * followed by length bytes of serialised test description (if any). The id
+ * identifies the test run so measured can be told when it has finished.
+ */
+typedef struct test_runner_header {
+    uint32_t type;
+    uint32_t id;
+    uint32_t length;
+} test_runner_header_t;
+
+/*
+ * Test process started by a test runner, so it can report when it is done.
+ */
+typedef struct test_runner_child {
+    pid_t pid;
+    uint32_t id;
+} test_runner_child_t;
+
+/*
+ * Growable buffer used to serialise a test description.
+ */
+typedef struct test_runner_buffer {
+    uint8_t *data;
+    uint32_t length;
+    uint32_t size;
+} test_runner_buffer_t;
+
+int start_test_runners(wand_event_handler_t *ev_hdl, int count);
+void stop_test_runners(void);
+void reload_test_runners(void);
+int run_test_on_runner(test_schedule_item_t *item, uint32_t id);
+
+int pack_test_item(test_runner_buffer_t *buffer, test_schedule_item_t *item);
+test_schedule_item_t *unpack_test_item(uint8_t *data, uint32_t length);
+void free_unpacked_test_item(test_schedule_item_t *item);
+
+#if UNIT_TEST
+void amp_test_add_test_runner(int fd);
+uint32_t amp_test_flush_test_runner(int index);
+#endif
+
+#endif
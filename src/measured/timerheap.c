@@ -0,0 +1,372 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+#include <libwandevent.h>
+
+#include "timerheap.h"
+#include "debug.h"
+
+
+
+/*
+ * Compare the expiry time of two timers, using the order they were added to
+ * break ties so that timers due at the same time run in the order they were
+ * added (the same as the libwandevent timer list).
+ */
+static int timer_before(amp_timer_t *a, amp_timer_t *b) {
+    if ( timercmp(&a->expire, &b->expire, !=) ) {
+        return timercmp(&a->expire, &b->expire, <);
+    }
+
+    return a->sequence < b->sequence;
+}
+
+
+
+/*
+ * Put a timer into the given slot of the heap array and update the index
+ * the timer keeps so that it can be found again when deleting it.
+ */
+static void set_slot(amp_timer_heap_t *heap, uint32_t index,
+        amp_timer_t *timer) {
+    heap->timers[index] = timer;
+    timer->index = index;
+}
+
+
+
+/*
+ * Move a timer up the heap until it is later than its parent.
+ */
+static void sift_up(amp_timer_heap_t *heap, uint32_t index) {
+    amp_timer_t *timer = heap->timers[index];
+
+    while ( index > 0 ) {
+        uint32_t parent = (index - 1) / 2;
+
+        if ( !timer_before(timer, heap->timers[parent]) ) {
+            break;
+        }
+
+        set_slot(heap, index, heap->timers[parent]);
+        index = parent;
+    }
+
+    set_slot(heap, index, timer);
+}
+
+
+
+/*
+ * Move a timer down the heap until it is earlier than both its children.
+ */
+static void sift_down(amp_timer_heap_t *heap, uint32_t index) {
+    amp_timer_t *timer = heap->timers[index];
+
+    while ( 1 ) {
+        uint32_t child = (index * 2) + 1;
+
+        if ( child >= heap->count ) {
+            break;
+        }
+
+        /* pick the earlier of the two children */
+        if ( child + 1 < heap->count &&
+                timer_before(heap->timers[child + 1], heap->timers[child]) ) {
+            child++;
+        }
+
+        if ( !timer_before(heap->timers[child], timer) ) {
+            break;
+        }
+
+        set_slot(heap, index, heap->timers[child]);
+        index = child;
+    }
+
+    set_slot(heap, index, timer);
+}
+
+
+
+/*
+ * Remove the timer at the given index, filling the hole with the last timer
+ * in the heap and moving it to wherever it now belongs.
+ */
+static void remove_at(amp_timer_heap_t *heap, uint32_t index) {
+    amp_timer_t *last;
+
+    assert(index < heap->count);
+
+    heap->count--;
+
+    if ( index == heap->count ) {
+        return;
+    }
+
+    last = heap->timers[heap->count];
+    set_slot(heap, index, last);
+
+    if ( index > 0 && timer_before(last, heap->timers[(index - 1) / 2]) ) {
+        sift_up(heap, index);
+    } else {
+        sift_down(heap, index);
+    }
+}
+
+
+
+static void wakeup_callback(wand_event_handler_t *ev_hdl, void *data);
+
+/*
+ * Make sure that the single libwandevent timer we use is set to expire at
+ * the same time as the earliest timer in the heap.
+ */
+static void update_wakeup(amp_timer_heap_t *heap) {
+    amp_timer_t *first;
+    struct timeval now, offset;
+
+    /* the wakeup is updated once all the expired timers have been run */
+    if ( heap->firing ) {
+        return;
+    }
+
+    first = amp_timer_heap_peek(heap);
+
+    /* nothing has changed, the wakeup is already for the earliest timer */
+    if ( first && heap->wakeup &&
+            timercmp(&heap->wakeup->expire, &first->expire, ==) ) {
+        return;
+    }
+
+    if ( heap->wakeup ) {
+        wand_del_timer(heap->ev_hdl, heap->wakeup);
+        heap->wakeup = NULL;
+    }
+
+    if ( first == NULL ) {
+        return;
+    }
+
+    /* libwandevent wants a relative time, so work out how far away it is */
+    now = wand_get_monotonictime(heap->ev_hdl);
+    if ( timercmp(&first->expire, &now, >) ) {
+        timersub(&first->expire, &now, &offset);
+    } else {
+        timerclear(&offset);
+    }
+
+    if ( (heap->wakeup = wand_add_timer(heap->ev_hdl, offset.tv_sec,
+                    offset.tv_usec, heap, wakeup_callback)) == NULL ) {
+        Log(LOG_ALERT, "Failed to add wakeup timer for timer heap");
+    }
+}
+
+
+
+/*
+ * Fired by libwandevent when the earliest timer in the heap is due.
+ */
+static void wakeup_callback(wand_event_handler_t *ev_hdl, void *data) {
+    amp_timer_heap_t *heap = (amp_timer_heap_t *)data;
+    struct timeval now;
+
+    assert(heap);
+
+    /* libwandevent is done with this timer and will free it */
+    heap->wakeup = NULL;
+
+    now = wand_get_monotonictime(ev_hdl);
+    amp_timer_heap_run_expired(heap, &now);
+}
+
+
+
+/*
+ * Create a new, empty timer heap driven by the given event handler.
+ */
+amp_timer_heap_t *amp_timer_heap_create(wand_event_handler_t *ev_hdl) {
+    amp_timer_heap_t *heap;
+
+    assert(ev_hdl);
+
+    heap = (amp_timer_heap_t *)calloc(1, sizeof(amp_timer_heap_t));
+    heap->ev_hdl = ev_hdl;
+    heap->size = TIMER_HEAP_INITIAL_SIZE;
+    heap->timers = (amp_timer_t **)malloc(sizeof(amp_timer_t *) * heap->size);
+
+    return heap;
+}
+
+
+
+/*
+ * Free the timer heap and all the timers in it. Any data attached to the
+ * timers is the responsibility of the caller and should be freed first.
+ */
+void amp_timer_heap_destroy(amp_timer_heap_t *heap) {
+    uint32_t i;
+
+    if ( heap == NULL ) {
+        return;
+    }
+
+    if ( heap->wakeup ) {
+        wand_del_timer(heap->ev_hdl, heap->wakeup);
+    }
+
+    for ( i = 0; i < heap->count; i++ ) {
+        free(heap->timers[i]);
+    }
+
+    free(heap->timers);
+    free(heap);
+}
+
+
+
+/*
+ * Add a new timer that will fire in sec seconds and usec microseconds. Uses
+ * the same arguments as wand_add_timer().
+ */
+amp_timer_t *amp_add_timer(amp_timer_heap_t *heap, int sec, int usec,
+        void *data, void (*callback)(wand_event_handler_t *, void *)) {
+    amp_timer_t *timer;
+
+    assert(heap);
+    assert(callback);
+
+    if ( sec < 0 || usec < 0 ) {
+        Log(LOG_WARNING, "Refusing to add timer with negative offset");
+        return NULL;
+    }
+
+    /* double the space available whenever we run out */
+    if ( heap->count == heap->size ) {
+        heap->size *= 2;
+        heap->timers = (amp_timer_t **)realloc(heap->timers,
+                sizeof(amp_timer_t *) * heap->size);
+    }
+
+    timer = (amp_timer_t *)malloc(sizeof(amp_timer_t));
+    timer->expire = wand_calc_expire(heap->ev_hdl, sec, usec);
+    timer->sequence = heap->sequence++;
+    timer->data = data;
+    timer->callback = callback;
+
+    set_slot(heap, heap->count++, timer);
+    sift_up(heap, timer->index);
+
+    update_wakeup(heap);
+
+    return timer;
+}
+
+
+
+/*
+ * Remove a timer from the heap before it fires.
+ */
+void amp_del_timer(amp_timer_heap_t *heap, amp_timer_t *timer) {
+    assert(heap);
+    assert(timer);
+    assert(timer->index < heap->count && heap->timers[timer->index] == timer);
+
+    remove_at(heap, timer->index);
+    free(timer);
+
+    update_wakeup(heap);
+}
+
+
+
+/*
+ * Return the timer that will fire next, without removing it.
+ */
+amp_timer_t *amp_timer_heap_peek(amp_timer_heap_t *heap) {
+    assert(heap);
+
+    if ( heap->count == 0 ) {
+        return NULL;
+    }
+
+    return heap->timers[0];
+}
+
+
+
+/*
+ * Run the callbacks for every timer that expires at or before the given
+ * monotonic time. Timers added by the callbacks themselves won't be run
+ * until the next time this is called, even if they have already expired.
+ * Returns the number of timers that were run.
+ */
+int amp_timer_heap_run_expired(amp_timer_heap_t *heap, struct timeval *now) {
+    amp_timer_t *timer;
+    uint64_t last;
+    int fired = 0;
+
+    assert(heap);
+    assert(now);
+
+    heap->firing = 1;
+    last = heap->sequence;
+
+    while ( (timer = amp_timer_heap_peek(heap)) != NULL &&
+            timercmp(&timer->expire, now, <=) && timer->sequence < last ) {
+        void (*callback)(wand_event_handler_t *, void *) = timer->callback;
+        void *data = timer->data;
+
+        /* remove the timer first, the callback may well add a new one */
+        remove_at(heap, 0);
+        free(timer);
+
+        callback(heap->ev_hdl, data);
+        fired++;
+    }
+
+    heap->firing = 0;
+    update_wakeup(heap);
+
+    return fired;
+}
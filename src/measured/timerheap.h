@@ -0,0 +1,86 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_TIMERHEAP_H
+#define _MEASURED_TIMERHEAP_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <libwandevent.h>
+
+/* initial number of slots allocated for the heap array */
+#define TIMER_HEAP_INITIAL_SIZE 64
+
+/*
+ * A single timer held in the timer heap. These behave the same way as a
+ * libwandevent timer, but are stored in a binary heap rather than a sorted
+ * list so that adding and removing them is O(log n) rather than O(n).
+ */
+typedef struct amp_timer {
+    struct timeval expire;          /* monotonic time the timer should fire */
+    uint64_t sequence;              /* insertion order, breaks expiry ties */
+    uint32_t index;                 /* current position in the heap array */
+    void *data;                     /* user data given to the callback */
+    void (*callback)(wand_event_handler_t *ev_hdl, void *data);
+} amp_timer_t;
+
+/*
+ * Binary min-heap of timers ordered by expiry time. Only the earliest timer
+ * is registered with libwandevent, which wakes us up to run everything that
+ * has expired.
+ */
+typedef struct amp_timer_heap {
+    wand_event_handler_t *ev_hdl;   /* event handler driving the heap */
+    struct wand_timer_t *wakeup;    /* libwandevent timer for the first item */
+    amp_timer_t **timers;           /* heap array, earliest timer first */
+    uint32_t count;                 /* number of timers in the heap */
+    uint32_t size;                  /* number of slots allocated */
+    uint64_t sequence;              /* sequence number for the next timer */
+    int firing;                     /* true while expired timers are run */
+} amp_timer_heap_t;
+
+amp_timer_heap_t *amp_timer_heap_create(wand_event_handler_t *ev_hdl);
+void amp_timer_heap_destroy(amp_timer_heap_t *heap);
+amp_timer_t *amp_add_timer(amp_timer_heap_t *heap, int sec, int usec,
+        void *data, void (*callback)(wand_event_handler_t *, void *));
+void amp_del_timer(amp_timer_heap_t *heap, amp_timer_t *timer);
+amp_timer_t *amp_timer_heap_peek(amp_timer_heap_t *heap);
+int amp_timer_heap_run_expired(amp_timer_heap_t *heap, struct timeval *now);
+
+#endif
@@ -48,6 +48,7 @@
 
 #include "watchdog.h"
 #include "debug.h"
+#include "admission.h"
 
 
 
@@ -159,6 +160,9 @@ void child_reaper(__attribute__((unused))wand_event_handler_t *ev_hdl,
 
         Log(LOG_DEBUG, "child terminated, pid: %d\n", infop.si_pid);
 
+        /* if this was a scheduled test, it is no longer using a slot */
+        release_test_slot_by_pid(infop.si_pid);
+
         switch ( infop.si_code ) {
             case CLD_EXITED:
                 /* exited, status is the exit code */
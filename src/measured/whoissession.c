@@ -0,0 +1,823 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A single long lived bulk mode connection to the Team Cymru whois server,
+ * shared by all the asn threads and the thread that refreshes the cache.
+ * The server rate limits clients, so rather than every batch of lookups
+ * opening its own connection, lookups for the same prefix are merged into
+ * one query, queries are pipelined onto the shared connection as they
+ * arrive, and the answers are handed back to everyone waiting on them.
+ *
+ * The server answers queries in the order they were sent, one line each
+ * (errors included), so queries are kept in a ring in that order. If the
+ * connection is lost after it has answered something, the unanswered
+ * queries are sent again on a new connection straight away. Otherwise the
+ * server is treated as unavailable: the queries fail, and the next attempt
+ * to connect is delayed by an amount that doubles after each failure.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <assert.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "whoissession.h"
+#include "debug.h"
+
+/* data needed while adding the addresses in a lookup to the session */
+struct lookup_data {
+    whois_session_t *session;
+    whois_waiter_t *waiter;
+};
+
+
+
+/*
+ * Get the query with the given sequence number from the ring.
+ */
+static struct whois_query *get_query(whois_session_t *session, uint64_t seq) {
+    return &session->queries[seq % WHOIS_SESSION_MAX_QUERIES];
+}
+
+
+
+/*
+ * Wake the session thread, because there is something new for it to do.
+ */
+static void wake_session(whois_session_t *session) {
+    uint64_t value = 1;
+
+    if ( write(session->wakefd, &value, sizeof(value)) < 0 ) {
+        Log(LOG_WARNING, "Failed to wake whois session: %s", strerror(errno));
+    }
+}
+
+
+
+/*
+ * Drop a reference to a waiter, freeing it once nobody needs it any more.
+ * Must be called with the session lock held.
+ */
+static void put_waiter(whois_waiter_t *waiter) {
+    if ( --waiter->refs == 0 ) {
+        iptrie_clear(&waiter->result);
+        free(waiter);
+    }
+}
+
+
+
+/*
+ * Finish the oldest query, giving the AS number (or -1 if there wasn't an
+ * answer) to everyone waiting on it. Must be called with the session lock
+ * held.
+ */
+static void pop_query(whois_session_t *session, int64_t as) {
+    struct whois_query *query = get_query(session, session->head);
+    struct whois_wait *wait;
+    uint8_t prefix;
+
+    assert(session->head < session->tail);
+
+    prefix = (query->address.ss_family == AF_INET) ? 24 : 64;
+
+    while ( (wait = query->waiters) != NULL ) {
+        query->waiters = wait->next;
+
+        if ( as >= 0 ) {
+            iptrie_add(&wait->waiter->result,
+                    (struct sockaddr *)&query->address, prefix, as);
+        }
+
+        if ( --wait->waiter->outstanding == 0 ) {
+            pthread_cond_broadcast(&session->done);
+        }
+
+        put_waiter(wait->waiter);
+        free(wait);
+    }
+
+    session->head++;
+    if ( session->sent < session->head ) {
+        session->sent = session->head;
+    }
+
+    /* prefixes can't be removed one at a time, empty it while it's unused */
+    if ( session->head == session->tail ) {
+        iptrie_clear(&session->pending);
+        session->pending_prefixes = 0;
+    }
+}
+
+
+
+/*
+ * Give up on every query that hasn't been answered yet.
+ */
+static void fail_queries(whois_session_t *session) {
+    while ( session->head < session->tail ) {
+        session->stats.failures++;
+        pop_query(session, -1);
+    }
+}
+
+
+
+/*
+ * Rebuild the trie used to find queries by prefix so that it only holds the
+ * queries that are still waiting. Normally it is emptied whenever nothing is
+ * waiting, but that might not happen if the session is always busy.
+ */
+static void rebuild_pending(whois_session_t *session) {
+    struct whois_query *query;
+    uint64_t seq;
+
+    iptrie_clear(&session->pending);
+    session->pending_prefixes = 0;
+
+    for ( seq = session->head; seq < session->tail; seq++ ) {
+        query = get_query(session, seq);
+        iptrie_add(&session->pending, (struct sockaddr *)&query->address,
+                (query->address.ss_family == AF_INET) ? 24 : 64, seq);
+        session->pending_prefixes++;
+    }
+}
+
+
+
+/*
+ * Add an address to the session on behalf of a waiter, joining the query
+ * that is already waiting for the same prefix if there is one.
+ */
+static int add_lookup(iptrie_node_t *node, void *data) {
+    struct lookup_data *lookup = (struct lookup_data *)data;
+    whois_session_t *session = lookup->session;
+    struct whois_query *query;
+    struct whois_wait *wait;
+    iptrie_node_t *existing;
+    uint8_t prefix;
+    size_t length;
+
+    switch ( node->address->sa_family ) {
+        case AF_INET: prefix = 24; length = sizeof(struct sockaddr_in); break;
+        case AF_INET6: prefix = 64; length = sizeof(struct sockaddr_in6);
+                       break;
+        default: Log(LOG_WARNING, "Unknown address family in ASN lookup");
+                 return 0;
+    };
+
+    existing = iptrie_lookup(&session->pending, node->address);
+
+    if ( existing != NULL && (uint64_t)existing->as >= session->head &&
+            (uint64_t)existing->as < session->tail ) {
+        query = get_query(session, existing->as);
+        session->stats.deduplicated++;
+    } else {
+        if ( session->tail - session->head >= WHOIS_SESSION_MAX_QUERIES ) {
+            session->stats.dropped++;
+            return 0;
+        }
+
+        if ( session->pending_prefixes >= WHOIS_SESSION_MAX_QUERIES * 4 ) {
+            rebuild_pending(session);
+        }
+
+        query = get_query(session, session->tail);
+        memset(query, 0, sizeof(struct whois_query));
+        memcpy(&query->address, node->address, length);
+        query->seq = session->tail++;
+
+        iptrie_add(&session->pending, node->address, prefix, query->seq);
+        session->pending_prefixes++;
+    }
+
+    wait = malloc(sizeof(struct whois_wait));
+    wait->waiter = lookup->waiter;
+    wait->next = query->waiters;
+    query->waiters = wait;
+
+    lookup->waiter->outstanding++;
+    lookup->waiter->refs++;
+
+    return 0;
+}
+
+
+
+/*
+ * Delay the next connection to the server, doubling the delay each time,
+ * and give up on the current queries rather than make them wait for it.
+ */
+static void connection_failed(whois_session_t *session) {
+    Log(LOG_WARNING, "whois server unavailable, trying again in %us",
+            session->backoff);
+
+    session->retry = time(NULL) + session->backoff;
+    session->backoff *= 2;
+    if ( session->backoff > WHOIS_RECONNECT_MAX ) {
+        session->backoff = WHOIS_RECONNECT_MAX;
+    }
+
+    fail_queries(session);
+}
+
+
+
+/*
+ * Connect to the whois server in bulk mode. The lock is released while
+ * connecting, as it can take a while. Any queries that weren't answered on
+ * the last connection are sent again.
+ */
+static void open_connection(whois_session_t *session) {
+    int fd;
+
+    pthread_mutex_unlock(&session->lock);
+    fd = session->connect();
+    pthread_mutex_lock(&session->lock);
+
+    if ( fd < 0 ) {
+        session->stats.connect_failures++;
+        connection_failed(session);
+        return;
+    }
+
+    Log(LOG_DEBUG, "Opened whois session");
+
+    session->fd = fd;
+    session->progress = 0;
+    session->sent = session->head;
+    session->offset = 0;
+    session->last_activity = time(NULL);
+    session->stats.connects++;
+    worker_buffer_free(&session->output);
+}
+
+
+
+/*
+ * Close the connection to the server. If it was lost while queries were
+ * waiting, and it had answered some, a new connection is made straight away
+ * for the rest. If it hadn't answered anything the server is treated as
+ * unavailable for a while.
+ */
+static void close_connection(whois_session_t *session, int lost) {
+    close(session->fd);
+    session->fd = -1;
+    session->offset = 0;
+    session->sent = session->head;
+    worker_buffer_free(&session->output);
+
+    if ( !lost ) {
+        Log(LOG_DEBUG, "Closed idle whois session");
+        return;
+    }
+
+    session->stats.disconnects++;
+
+    if ( session->progress > 0 ) {
+        Log(LOG_DEBUG, "Lost whois session, reconnecting");
+        session->retry = 0;
+    } else {
+        connection_failed(session);
+    }
+}
+
+
+
+/*
+ * Write any queries that haven't been written yet to the output buffer, and
+ * send as much of it as possible. Returns -1 if the connection failed.
+ */
+static int send_queries(whois_session_t *session) {
+    char addrstr[INET6_ADDRSTRLEN + 1];
+    struct whois_query *query;
+    void *addrptr;
+
+    while ( session->sent < session->tail ) {
+        query = get_query(session, session->sent++);
+
+        if ( query->address.ss_family == AF_INET ) {
+            addrptr = &((struct sockaddr_in *)&query->address)->sin_addr;
+        } else {
+            addrptr = &((struct sockaddr_in6 *)&query->address)->sin6_addr;
+        }
+
+        inet_ntop(query->address.ss_family, addrptr, addrstr,
+                INET6_ADDRSTRLEN);
+
+        /* need a newline between addresses */
+        worker_buffer_append(&session->output, addrstr, strlen(addrstr));
+        worker_buffer_append(&session->output, "\n", 1);
+        session->stats.queries++;
+    }
+
+    if ( session->output.offset == session->output.length ) {
+        return 0;
+    }
+
+    switch ( worker_buffer_send(&session->output, session->fd) ) {
+        case 0: return 0;
+        case 1: session->output.offset = 0;
+                session->output.length = 0;
+                session->last_activity = time(NULL);
+                return 0;
+        default: Log(LOG_WARNING, "Error writing to whois session: %s",
+                         strerror(errno));
+                 return -1;
+    };
+}
+
+
+
+/*
+ * Deal with a single line of output from the server, which should be the
+ * answer to the oldest query. Returns 1 if the answer was added to the
+ * cache.
+ */
+static int answer_query(whois_session_t *session, char *line) {
+    struct iptrie answer = { NULL, NULL, NULL };
+    struct whois_query *query;
+    int64_t as = -1;
+
+    /* the banner sent when bulk mode starts isn't an answer */
+    if ( *line == '\0' || strncmp(line, "Bulk", 4) == 0 ) {
+        return 0;
+    }
+
+    if ( session->head == session->sent ) {
+        Log(LOG_WARNING, "Unexpected line from whois server: %s", line);
+        return 0;
+    }
+
+    query = get_query(session, session->head);
+
+    if ( strncmp(line, "Error", 5) == 0 || strchr(line, '|') == NULL ) {
+        Log(LOG_DEBUG, "whois server couldn't answer query: %s", line);
+    } else {
+        /* this adds the answer to the cache too */
+        add_parsed_line(&answer, line, session->info);
+        as = iptrie_lookup_as(&answer, (struct sockaddr *)&query->address);
+        iptrie_clear(&answer);
+
+        if ( as < 0 ) {
+            Log(LOG_WARNING, "Answer from whois server doesn't match query");
+        }
+    }
+
+    if ( as < 0 ) {
+        session->stats.failures++;
+    } else {
+        session->stats.answers++;
+        session->progress++;
+        session->backoff = WHOIS_RECONNECT_MIN;
+    }
+
+    pop_query(session, as);
+
+    return as >= 0;
+}
+
+
+
+/*
+ * Read answers from the server and give them to whoever is waiting for
+ * them. Returns -1 if the connection was closed or failed.
+ */
+static int read_answers(whois_session_t *session) {
+    ssize_t bytes;
+    char *end;
+    int answered = 0;
+    int length;
+
+    bytes = recv(session->fd, session->buffer + session->offset,
+            sizeof(session->buffer) - session->offset - 1, MSG_DONTWAIT);
+
+    if ( bytes < 0 && (errno == EAGAIN || errno == EINTR) ) {
+        return 0;
+    }
+
+    if ( bytes <= 0 ) {
+        if ( bytes < 0 ) {
+            Log(LOG_WARNING, "Error receiving from whois session: %s",
+                    strerror(errno));
+        } else {
+            Log(LOG_DEBUG, "whois server closed the session");
+        }
+        return -1;
+    }
+
+    session->offset += bytes;
+    session->buffer[session->offset] = '\0';
+    session->last_activity = time(NULL);
+
+    while ( (end = memchr(session->buffer, '\n', session->offset)) != NULL ) {
+        *end = '\0';
+        if ( end > session->buffer && *(end - 1) == '\r' ) {
+            *(end - 1) = '\0';
+        }
+
+        answered += answer_query(session, session->buffer);
+
+        length = end - session->buffer + 1;
+        memmove(session->buffer, end + 1, session->offset - length);
+        session->offset -= length;
+        session->buffer[session->offset] = '\0';
+    }
+
+    /* no answer should ever be this long, throw it away */
+    if ( session->offset >= (int)sizeof(session->buffer) - 1 ) {
+        Log(LOG_WARNING, "Line from whois server too long, discarding");
+        session->offset = 0;
+    }
+
+    if ( answered > 0 && session->answered ) {
+        session->answered();
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Look after the connection to the whois server: connect when there are
+ * queries to send, send them, read the answers, and close the connection if
+ * it stops answering or isn't needed for a while.
+ */
+static void *whois_session_thread(void *data) {
+    whois_session_t *session = (whois_session_t *)data;
+    struct pollfd fds[2];
+    uint64_t value;
+    time_t now;
+    int timeout;
+    int nfds;
+
+    pthread_mutex_lock(&session->lock);
+
+    while ( !session->stop ) {
+        now = time(NULL);
+
+        if ( session->fd < 0 ) {
+            if ( session->head < session->tail && now >= session->retry ) {
+                open_connection(session);
+                continue;
+            }
+
+            /* wait for queries, or until we're allowed to connect again */
+            timeout = (session->head < session->tail) ?
+                (session->retry - now) * 1000 : -1;
+        } else {
+            if ( send_queries(session) < 0 ) {
+                close_connection(session, 1);
+                continue;
+            }
+
+            if ( session->head < session->tail ) {
+                timeout = session->last_activity + WHOIS_SESSION_TIMEOUT - now;
+            } else {
+                timeout = session->last_activity + WHOIS_SESSION_IDLE - now;
+            }
+
+            if ( timeout <= 0 ) {
+                if ( session->head < session->tail ) {
+                    Log(LOG_WARNING, "whois server stopped answering");
+                }
+                close_connection(session, session->head < session->tail);
+                continue;
+            }
+
+            timeout *= 1000;
+        }
+
+        fds[0].fd = session->wakefd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        nfds = 1;
+
+        if ( session->fd >= 0 ) {
+            fds[1].fd = session->fd;
+            fds[1].events = POLLIN;
+            fds[1].revents = 0;
+            if ( session->output.offset < session->output.length ) {
+                fds[1].events |= POLLOUT;
+            }
+            nfds = 2;
+        }
+
+        pthread_mutex_unlock(&session->lock);
+        if ( poll(fds, nfds, timeout) < 0 && errno != EINTR ) {
+            Log(LOG_WARNING, "Error waiting on whois session: %s",
+                    strerror(errno));
+        }
+        pthread_mutex_lock(&session->lock);
+
+        if ( fds[0].revents & POLLIN ) {
+            if ( read(session->wakefd, &value, sizeof(value)) < 0 ) {
+                /* nothing to do, it's only there to wake us */
+            }
+        }
+
+        if ( nfds > 1 && session->fd == fds[1].fd &&
+                (fds[1].revents & (POLLIN | POLLERR | POLLHUP)) &&
+                read_answers(session) < 0 ) {
+            close_connection(session, session->head < session->tail);
+        }
+    }
+
+    if ( session->fd >= 0 ) {
+        close_connection(session, 0);
+    }
+
+    /* nobody is going to answer these now */
+    fail_queries(session);
+
+    pthread_mutex_unlock(&session->lock);
+
+    return NULL;
+}
+
+
+
+/*
+ * Create the session and start the thread looking after it. The connection
+ * isn't made until there is something to look up.
+ */
+static whois_session_t *create_whois_session(struct amp_asn_info *info,
+        void (*answered)(void), int (*connect)(void)) {
+    whois_session_t *session;
+
+    session = calloc(1, sizeof(whois_session_t));
+    session->info = info;
+    session->answered = answered;
+    session->connect = connect;
+    session->fd = -1;
+    session->backoff = WHOIS_RECONNECT_MIN;
+    session->queries = calloc(WHOIS_SESSION_MAX_QUERIES,
+            sizeof(struct whois_query));
+    pthread_mutex_init(&session->lock, NULL);
+    pthread_cond_init(&session->done, NULL);
+
+    if ( (session->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ) {
+        Log(LOG_WARNING, "Failed to create eventfd for whois session: %s",
+                strerror(errno));
+        whois_session_free(session);
+        return NULL;
+    }
+
+    if ( pthread_create(&session->thread, NULL, whois_session_thread,
+                session) != 0 ) {
+        Log(LOG_WARNING, "Failed to start whois session thread");
+        whois_session_free(session);
+        return NULL;
+    }
+
+    session->running = 1;
+
+    return session;
+}
+
+
+
+/*
+ * Start a session with the whois server. Answers are added to the cache,
+ * and the callback is called after each batch of them.
+ */
+whois_session_t *whois_session_start(struct amp_asn_info *info,
+        void (*answered)(void)) {
+    return create_whois_session(info, answered, connect_to_whois_server);
+}
+
+
+
+/*
+ * Stop the session thread. Any queries still waiting fail, and no more
+ * lookups will be accepted.
+ */
+void whois_session_stop(whois_session_t *session) {
+    if ( session == NULL || !session->running ) {
+        return;
+    }
+
+    pthread_mutex_lock(&session->lock);
+    session->stop = 1;
+    pthread_mutex_unlock(&session->lock);
+
+    wake_session(session);
+    pthread_join(session->thread, NULL);
+    session->running = 0;
+}
+
+
+
+/*
+ * Stop and free the session. Every waiter must have been released first.
+ */
+void whois_session_free(whois_session_t *session) {
+    if ( session == NULL ) {
+        return;
+    }
+
+    whois_session_stop(session);
+
+    if ( session->wakefd >= 0 ) {
+        close(session->wakefd);
+    }
+
+    iptrie_clear(&session->pending);
+    worker_buffer_free(&session->output);
+    pthread_cond_destroy(&session->done);
+    pthread_mutex_destroy(&session->lock);
+    free(session->queries);
+    free(session);
+}
+
+
+
+/*
+ * Get a copy of the session counters.
+ */
+void whois_session_get_stats(whois_session_t *session,
+        whois_session_stats_t *stats) {
+    assert(stats);
+
+    if ( session == NULL ) {
+        memset(stats, 0, sizeof(whois_session_stats_t));
+        return;
+    }
+
+    pthread_mutex_lock(&session->lock);
+    memcpy(stats, &session->stats, sizeof(whois_session_stats_t));
+    pthread_mutex_unlock(&session->lock);
+}
+
+
+
+/*
+ * Ask the whois server about all the addresses in the trie. Returns a waiter
+ * that will collect the answers, which must be released once finished with,
+ * or NULL if the server is currently unavailable.
+ */
+whois_waiter_t *whois_session_lookup(whois_session_t *session,
+        struct iptrie *addresses) {
+    struct lookup_data lookup;
+    whois_waiter_t *waiter;
+    int outstanding;
+
+    assert(session);
+    assert(addresses);
+
+    pthread_mutex_lock(&session->lock);
+
+    /* don't make anyone wait on a server we know we can't talk to */
+    if ( session->stop ||
+            (session->fd < 0 && time(NULL) < session->retry) ) {
+        pthread_mutex_unlock(&session->lock);
+        Log(LOG_DEBUG, "whois session unavailable, ignoring");
+        return NULL;
+    }
+
+    waiter = calloc(1, sizeof(whois_waiter_t));
+    waiter->session = session;
+    waiter->refs = 1;
+
+    lookup.session = session;
+    lookup.waiter = waiter;
+    iptrie_on_all_leaves(addresses, add_lookup, &lookup);
+    outstanding = waiter->outstanding;
+
+    pthread_mutex_unlock(&session->lock);
+
+    if ( outstanding > 0 ) {
+        wake_session(session);
+    }
+
+    return waiter;
+}
+
+
+
+/*
+ * Copy an answer into the trie belonging to the waiter's owner.
+ */
+static int collect_answer(iptrie_node_t *node, void *data) {
+    iptrie_add((struct iptrie *)data, node->address, node->prefix, node->as);
+    return 0;
+}
+
+
+
+/*
+ * Move any answers that have arrived into the result trie. Returns the
+ * number of queries that are still waiting for an answer.
+ */
+int whois_waiter_collect(whois_waiter_t *waiter, struct iptrie *result) {
+    int outstanding;
+
+    assert(waiter);
+    assert(result);
+
+    pthread_mutex_lock(&waiter->session->lock);
+    iptrie_on_all_leaves(&waiter->result, collect_answer, result);
+    iptrie_clear(&waiter->result);
+    outstanding = waiter->outstanding;
+    pthread_mutex_unlock(&waiter->session->lock);
+
+    return outstanding;
+}
+
+
+
+/*
+ * Block for up to timeout seconds waiting for all the queries to be
+ * answered. Returns the number of queries that are still waiting.
+ */
+int whois_waiter_wait(whois_waiter_t *waiter, int timeout) {
+    struct timespec deadline;
+    int outstanding;
+
+    assert(waiter);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    pthread_mutex_lock(&waiter->session->lock);
+    while ( waiter->outstanding > 0 &&
+            pthread_cond_timedwait(&waiter->session->done,
+                &waiter->session->lock, &deadline) != ETIMEDOUT ) {
+        /* keep waiting */
+    }
+    outstanding = waiter->outstanding;
+    pthread_mutex_unlock(&waiter->session->lock);
+
+    return outstanding;
+}
+
+
+
+/*
+ * Finish with a waiter. Queries it was waiting on are still answered, as
+ * someone else might want them, and the answers still go in the cache.
+ */
+void whois_waiter_release(whois_waiter_t *waiter) {
+    whois_session_t *session;
+
+    if ( waiter == NULL ) {
+        return;
+    }
+
+    session = waiter->session;
+
+    pthread_mutex_lock(&session->lock);
+    put_waiter(waiter);
+    pthread_mutex_unlock(&session->lock);
+}
+
+
+
+#if UNIT_TEST
+whois_session_t *amp_test_whois_session_start(struct amp_asn_info *info,
+        void (*answered)(void), int (*connect)(void)) {
+    return create_whois_session(info, answered, connect);
+}
+#endif
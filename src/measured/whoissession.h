@@ -0,0 +1,161 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_WHOISSESSION_H
+#define _MEASURED_WHOISSESSION_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "iptrie.h"
+#include "asn.h"
+#include "workerpool.h"
+
+/* most queries that can be waiting for an answer at once */
+#define WHOIS_SESSION_MAX_QUERIES 4096
+/* first delay before connecting again after a failure (seconds) */
+#define WHOIS_RECONNECT_MIN 1
+/* the delay doubles after each failure, up to this (seconds) */
+#define WHOIS_RECONNECT_MAX 300
+/* time to wait for the server to answer outstanding queries (seconds) */
+#define WHOIS_SESSION_TIMEOUT 30
+/* close the connection if it hasn't been used for this long (seconds) */
+#define WHOIS_SESSION_IDLE 300
+/* size of the buffer holding partial answers from the server */
+#define WHOIS_SESSION_BUFFER 4096
+
+typedef struct whois_session whois_session_t;
+typedef struct whois_waiter whois_waiter_t;
+
+/*
+ * A set of addresses that someone is waiting to have looked up. It belongs to
+ * the session, and is freed once the owner has released it and all of its
+ * queries have been answered or have failed.
+ */
+struct whois_waiter {
+    whois_session_t *session;
+    int outstanding;                /* queries still waiting for an answer */
+    int refs;                       /* the owner, and each query it waits on */
+    struct iptrie result;           /* answers not yet collected */
+};
+
+/*
+ * Someone waiting on the answer to a query.
+ */
+struct whois_wait {
+    whois_waiter_t *waiter;
+    struct whois_wait *next;
+};
+
+/*
+ * A prefix that has been (or will be) asked about. Only one query is made for
+ * each prefix no matter how many waiters want it.
+ */
+struct whois_query {
+    uint64_t seq;                   /* position in the order queries are sent */
+    struct sockaddr_storage address;
+    struct whois_wait *waiters;
+};
+
+/*
+ * Counters describing how the session is being used.
+ */
+typedef struct whois_session_stats {
+    uint64_t connects;              /* connections made to the server */
+    uint64_t connect_failures;      /* connections that couldn't be made */
+    uint64_t disconnects;           /* connections that were lost */
+    uint64_t queries;               /* queries sent to the server */
+    uint64_t deduplicated;          /* lookups joined to an existing query */
+    uint64_t answers;               /* queries the server answered */
+    uint64_t failures;              /* queries given up on */
+    uint64_t dropped;               /* lookups refused as the queue was full */
+} whois_session_stats_t;
+
+/*
+ * A single long lived bulk mode connection to the whois server, shared by
+ * everything that needs to look up AS numbers. Queries are kept in a ring in
+ * the order they were sent, as the server answers them in the same order.
+ */
+struct whois_session {
+    struct amp_asn_info *info;      /* cache that answers are added to */
+    void (*answered)(void);         /* called after answers are added */
+    int (*connect)(void);           /* opens a connection in bulk mode */
+    pthread_mutex_t lock;
+    pthread_cond_t done;            /* signalled when a waiter is finished */
+    pthread_t thread;
+    int running;
+    int stop;
+    int wakefd;                     /* wakes the thread for new queries */
+    int fd;                         /* connection to the server, or -1 */
+    int progress;                   /* answers received on this connection */
+    struct whois_query *queries;
+    uint64_t head;                  /* oldest query without an answer */
+    uint64_t sent;                  /* oldest query not yet written */
+    uint64_t tail;                  /* sequence number for the next query */
+    struct iptrie pending;          /* prefix to sequence number of query */
+    uint32_t pending_prefixes;      /* prefixes added to pending trie */
+    worker_buffer_t output;         /* queries waiting to be sent */
+    char buffer[WHOIS_SESSION_BUFFER]; /* partial answers from the server */
+    int offset;                     /* bytes of data in the answer buffer */
+    time_t last_activity;           /* last time anything was answered/sent */
+    time_t retry;                   /* don't connect again before this */
+    uint32_t backoff;               /* delay after the next failure */
+    whois_session_stats_t stats;
+};
+
+whois_session_t *whois_session_start(struct amp_asn_info *info,
+        void (*answered)(void));
+void whois_session_stop(whois_session_t *session);
+void whois_session_free(whois_session_t *session);
+void whois_session_get_stats(whois_session_t *session,
+        whois_session_stats_t *stats);
+
+whois_waiter_t *whois_session_lookup(whois_session_t *session,
+        struct iptrie *addresses);
+int whois_waiter_collect(whois_waiter_t *waiter, struct iptrie *result);
+int whois_waiter_wait(whois_waiter_t *waiter, int timeout);
+void whois_waiter_release(whois_waiter_t *waiter);
+
+#if UNIT_TEST
+whois_session_t *amp_test_whois_session_start(struct amp_asn_info *info,
+        void (*answered)(void), int (*connect)(void));
+#endif
+#endif
@@ -0,0 +1,682 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fixed size pool of threads serving connections on the local sockets that
+ * tests use to resolve names and look up AS numbers. Each thread has its own
+ * epoll instance and runs the connections it owns as state machines, so the
+ * number of threads doesn't grow with the number of tests that are running
+ * at the same time.
+ *
+ * New connections are accepted by the main process and handed to the least
+ * busy thread, which owns the connection until it is closed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "debug.h"
+#include "workerpool.h"
+
+/*
+ * A single worker thread and the connections it owns.
+ */
+struct worker_thread {
+    worker_pool_t *pool;            /* pool this thread belongs to */
+    pthread_t thread;
+    int epoll_fd;
+    int wakeup_fd;                  /* eventfd used to signal the thread */
+    worker_watch_t wakeup;
+    worker_watch_t shared;
+    pthread_mutex_t lock;           /* protects incoming, count and stop */
+    worker_conn_t *incoming;        /* connections waiting to be started */
+    worker_conn_t *conns;           /* connections owned by this thread */
+    uint32_t count;                 /* number of connections owned */
+    int stop;
+};
+
+/*
+ * A pool of worker threads all running the same service.
+ */
+struct worker_pool {
+    worker_service_t service;
+    worker_thread_t *workers;
+    int count;
+};
+
+
+
+/*
+ * Get the current monotonic time in milliseconds.
+ */
+uint64_t worker_get_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+
+
+/*
+ * Start watching a descriptor for the given events on behalf of a
+ * connection, or change the events if it is already being watched.
+ */
+int worker_watch_fd(worker_conn_t *conn, int fd, uint32_t events) {
+    struct epoll_event event;
+    worker_watch_t *watch = NULL, *empty = NULL;
+    int i;
+
+    for ( i = 0; i < WORKER_MAX_WATCHES; i++ ) {
+        if ( conn->watches[i].fd == fd ) {
+            watch = &conn->watches[i];
+            break;
+        }
+        if ( empty == NULL && conn->watches[i].fd == -1 ) {
+            empty = &conn->watches[i];
+        }
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+
+    if ( watch != NULL ) {
+        event.data.ptr = watch;
+        return epoll_ctl(conn->worker->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    }
+
+    if ( empty == NULL ) {
+        Log(LOG_WARNING, "Too many descriptors watched by one connection");
+        return -1;
+    }
+
+    event.data.ptr = empty;
+    if ( epoll_ctl(conn->worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0 ) {
+        Log(LOG_WARNING, "Failed to watch descriptor %d: %s", fd,
+                strerror(errno));
+        return -1;
+    }
+
+    empty->fd = fd;
+    empty->conn = conn;
+
+    return 0;
+}
+
+
+
+/*
+ * Stop watching a descriptor on behalf of a connection.
+ */
+void worker_unwatch_fd(worker_conn_t *conn, int fd) {
+    int i;
+
+    for ( i = 0; i < WORKER_MAX_WATCHES; i++ ) {
+        if ( conn->watches[i].fd == fd ) {
+            epoll_ctl(conn->worker->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            conn->watches[i].fd = -1;
+            return;
+        }
+    }
+}
+
+
+
+/*
+ * Mark a connection as finished. It stops receiving events straight away,
+ * but isn't freed until the worker has dealt with all the current events
+ * in case any of them refer to it.
+ */
+static void close_connection(worker_conn_t *conn) {
+    int i;
+
+    if ( conn->closed ) {
+        return;
+    }
+
+    for ( i = 0; i < WORKER_MAX_WATCHES; i++ ) {
+        if ( conn->watches[i].fd != -1 ) {
+            worker_unwatch_fd(conn, conn->watches[i].fd);
+        }
+    }
+
+    conn->closed = 1;
+    conn->polling = 0;
+    conn->deadline = 0;
+}
+
+
+
+/*
+ * Free a closed connection, letting the service tidy up its state first.
+ */
+static void free_connection(worker_thread_t *worker, worker_conn_t *conn) {
+    worker_service_t *service = &worker->pool->service;
+
+    close_connection(conn);
+
+    if ( service->finish ) {
+        service->finish(conn);
+    }
+
+    close(conn->fd);
+
+    if ( conn->prev ) {
+        conn->prev->next = conn->next;
+    } else {
+        worker->conns = conn->next;
+    }
+
+    if ( conn->next ) {
+        conn->next->prev = conn->prev;
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    worker->count--;
+    pthread_mutex_unlock(&worker->lock);
+
+    free(conn);
+}
+
+
+
+/*
+ * Take ownership of any new connections that have been handed to this
+ * worker, and start them running. Returns -1 if the worker should stop.
+ */
+static int start_new_connections(worker_thread_t *worker) {
+    worker_service_t *service = &worker->pool->service;
+    worker_conn_t *incoming, *conn;
+    uint64_t value;
+    int stop;
+
+    if ( read(worker->wakeup_fd, &value, sizeof(value)) < 0 &&
+            errno != EAGAIN ) {
+        Log(LOG_WARNING, "Failed to read %s worker wakeup: %s",
+                service->name, strerror(errno));
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    incoming = worker->incoming;
+    worker->incoming = NULL;
+    stop = worker->stop;
+    pthread_mutex_unlock(&worker->lock);
+
+    while ( incoming != NULL ) {
+        conn = incoming;
+        incoming = incoming->next;
+
+        conn->prev = NULL;
+        conn->next = worker->conns;
+        if ( worker->conns ) {
+            worker->conns->prev = conn;
+        }
+        worker->conns = conn;
+
+        if ( worker_watch_fd(conn, conn->fd, EPOLLIN) < 0 ) {
+            close_connection(conn);
+            continue;
+        }
+
+        if ( service->start && service->start(conn) != WORKER_CONN_KEEP ) {
+            close_connection(conn);
+        }
+    }
+
+    return stop ? -1 : 0;
+}
+
+
+
+/*
+ * Poll any connections that want it, expire any connections that have
+ * passed their deadline, and free any that are finished.
+ */
+static void check_connections(worker_thread_t *worker) {
+    worker_service_t *service = &worker->pool->service;
+    worker_conn_t *conn, *next;
+    uint64_t now = 0;
+
+    for ( conn = worker->conns; conn != NULL; conn = next ) {
+        next = conn->next;
+
+        if ( !conn->closed && conn->polling && service->poll &&
+                service->poll(conn) != WORKER_CONN_KEEP ) {
+            close_connection(conn);
+        }
+
+        if ( !conn->closed && conn->deadline > 0 ) {
+            if ( now == 0 ) {
+                now = worker_get_time();
+            }
+            if ( now >= conn->deadline ) {
+                conn->deadline = 0;
+                if ( service->expire == NULL ||
+                        service->expire(conn) != WORKER_CONN_KEEP ) {
+                    close_connection(conn);
+                }
+            }
+        }
+
+        if ( conn->closed ) {
+            free_connection(worker, conn);
+        }
+    }
+}
+
+
+
+/*
+ * Work out how long the worker can sleep before it needs to poll or expire
+ * one of its connections.
+ */
+static int get_worker_timeout(worker_thread_t *worker) {
+    worker_conn_t *conn;
+    uint64_t now = 0;
+    int timeout = -1;
+    int wait;
+
+    for ( conn = worker->conns; conn != NULL; conn = conn->next ) {
+        if ( conn->polling && worker->pool->service.poll_interval > 0 ) {
+            wait = worker->pool->service.poll_interval;
+        } else if ( conn->deadline > 0 ) {
+            if ( now == 0 ) {
+                now = worker_get_time();
+            }
+            wait = (conn->deadline > now) ? (int)(conn->deadline - now) : 0;
+        } else {
+            continue;
+        }
+
+        if ( timeout < 0 || wait < timeout ) {
+            timeout = wait;
+        }
+    }
+
+    return timeout;
+}
+
+
+
+/*
+ * Main loop for a worker thread, wait for events on any of the descriptors
+ * and pass them to the service to deal with.
+ */
+static void *worker_thread_main(void *data) {
+    worker_thread_t *worker = (worker_thread_t *)data;
+    worker_service_t *service = &worker->pool->service;
+    struct epoll_event events[WORKER_MAX_EVENTS];
+    worker_watch_t *watch;
+    int stop = 0;
+    int count;
+    int i;
+
+    Log(LOG_DEBUG, "Starting %s worker thread", service->name);
+
+    while ( !stop ) {
+        count = epoll_wait(worker->epoll_fd, events, WORKER_MAX_EVENTS,
+                get_worker_timeout(worker));
+
+        if ( count < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            Log(LOG_WARNING, "Error waiting for %s events: %s",
+                    service->name, strerror(errno));
+            break;
+        }
+
+        for ( i = 0; i < count; i++ ) {
+            watch = (worker_watch_t *)events[i].data.ptr;
+
+            if ( watch == &worker->wakeup ) {
+                if ( start_new_connections(worker) < 0 ) {
+                    stop = 1;
+                }
+            } else if ( watch == &worker->shared ) {
+                service->shared_ready(service->data);
+            } else if ( !watch->conn->closed &&
+                    service->ready(watch->conn, watch->fd,
+                        events[i].events) != WORKER_CONN_KEEP ) {
+                close_connection(watch->conn);
+            }
+        }
+
+        check_connections(worker);
+    }
+
+    /* tidy up any connections that are still around */
+    while ( worker->conns != NULL ) {
+        free_connection(worker, worker->conns);
+    }
+
+    Log(LOG_DEBUG, "Stopping %s worker thread", service->name);
+
+    return NULL;
+}
+
+
+
+/*
+ * Create the epoll instance and wakeup descriptor for a worker thread.
+ */
+static int initialise_worker(worker_pool_t *pool, worker_thread_t *worker) {
+    struct epoll_event event;
+
+    worker->pool = pool;
+    worker->epoll_fd = -1;
+    worker->wakeup_fd = -1;
+    pthread_mutex_init(&worker->lock, NULL);
+
+    if ( (worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+        Log(LOG_WARNING, "Failed to create epoll instance for %s: %s",
+                pool->service.name, strerror(errno));
+        return -1;
+    }
+
+    if ( (worker->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ) {
+        Log(LOG_WARNING, "Failed to create eventfd for %s: %s",
+                pool->service.name, strerror(errno));
+        return -1;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &worker->wakeup;
+    worker->wakeup.fd = worker->wakeup_fd;
+    if ( epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wakeup_fd,
+                &event) < 0 ) {
+        Log(LOG_WARNING, "Failed to watch eventfd for %s: %s",
+                pool->service.name, strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Every worker watches the shared descriptor and any of them can read
+     * it, but only one needs to be woken up each time it becomes readable.
+     */
+    if ( pool->service.shared_fd >= 0 ) {
+#ifdef EPOLLEXCLUSIVE
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+#endif
+        event.data.ptr = &worker->shared;
+        worker->shared.fd = pool->service.shared_fd;
+        if ( epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD,
+                    pool->service.shared_fd, &event) < 0 ) {
+            Log(LOG_WARNING, "Failed to watch shared descriptor for %s: %s",
+                    pool->service.name, strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * Wake a worker thread up so that it checks for new connections, or to
+ * tell it to stop.
+ */
+static void wake_worker(worker_thread_t *worker) {
+    uint64_t value = 1;
+
+    if ( write(worker->wakeup_fd, &value, sizeof(value)) < 0 ) {
+        Log(LOG_WARNING, "Failed to wake %s worker: %s",
+                worker->pool->service.name, strerror(errno));
+    }
+}
+
+
+
+/*
+ * Wake up the worker that owns a connection so that it polls the connection.
+ * This can be called from any thread, e.g. when an answer that the
+ * connection was waiting for has been processed by another worker.
+ */
+void worker_conn_wake(worker_conn_t *conn) {
+    assert(conn);
+    assert(conn->worker);
+
+    wake_worker(conn->worker);
+}
+
+
+
+/*
+ * Create a pool of threads to run the given service.
+ */
+worker_pool_t *create_worker_pool(worker_service_t *service, int threads) {
+    worker_pool_t *pool;
+    int i;
+
+    assert(service);
+    assert(service->ready);
+    assert(service->shared_fd < 0 || service->shared_ready);
+
+    if ( threads < 1 ) {
+        threads = 1;
+    } else if ( threads > MAX_WORKER_THREADS ) {
+        threads = MAX_WORKER_THREADS;
+    }
+
+    pool = calloc(1, sizeof(worker_pool_t));
+    memcpy(&pool->service, service, sizeof(worker_service_t));
+    pool->workers = calloc(threads, sizeof(worker_thread_t));
+
+    for ( i = 0; i < threads; i++ ) {
+        if ( initialise_worker(pool, &pool->workers[i]) < 0 ||
+                pthread_create(&pool->workers[i].thread, NULL,
+                    worker_thread_main, &pool->workers[i]) != 0 ) {
+            Log(LOG_WARNING, "Failed to start %s worker thread",
+                    service->name);
+            if ( pool->workers[i].epoll_fd >= 0 ) {
+                close(pool->workers[i].epoll_fd);
+            }
+            if ( pool->workers[i].wakeup_fd >= 0 ) {
+                close(pool->workers[i].wakeup_fd);
+            }
+            pthread_mutex_destroy(&pool->workers[i].lock);
+            destroy_worker_pool(pool);
+            return NULL;
+        }
+        pool->count++;
+    }
+
+    Log(LOG_DEBUG, "Started %d %s worker threads", pool->count,
+            service->name);
+
+    return pool;
+}
+
+
+
+/*
+ * Stop all the threads in a pool, closing any connections they still have.
+ */
+void destroy_worker_pool(worker_pool_t *pool) {
+    worker_thread_t *worker;
+    worker_conn_t *conn;
+    int i;
+
+    if ( pool == NULL ) {
+        return;
+    }
+
+    for ( i = 0; i < pool->count; i++ ) {
+        worker = &pool->workers[i];
+        pthread_mutex_lock(&worker->lock);
+        worker->stop = 1;
+        pthread_mutex_unlock(&worker->lock);
+        wake_worker(worker);
+    }
+
+    for ( i = 0; i < pool->count; i++ ) {
+        worker = &pool->workers[i];
+        pthread_join(worker->thread, NULL);
+
+        /* connections handed over after the worker stopped never started */
+        while ( (conn = worker->incoming) != NULL ) {
+            worker->incoming = conn->next;
+            close(conn->fd);
+            free(conn);
+        }
+
+        close(worker->epoll_fd);
+        close(worker->wakeup_fd);
+        pthread_mutex_destroy(&worker->lock);
+    }
+
+    free(pool->workers);
+    free(pool);
+}
+
+
+
+/*
+ * Hand a newly accepted connection to the least busy worker thread.
+ */
+int worker_pool_add_connection(worker_pool_t *pool, int fd) {
+    worker_thread_t *worker = NULL;
+    worker_conn_t *conn;
+    uint32_t count, least = 0;
+    int i;
+
+    assert(pool);
+
+    for ( i = 0; i < pool->count; i++ ) {
+        pthread_mutex_lock(&pool->workers[i].lock);
+        count = pool->workers[i].count;
+        pthread_mutex_unlock(&pool->workers[i].lock);
+
+        if ( worker == NULL || count < least ) {
+            worker = &pool->workers[i];
+            least = count;
+        }
+    }
+
+    if ( worker == NULL ) {
+        return -1;
+    }
+
+    conn = calloc(1, sizeof(worker_conn_t));
+    conn->fd = fd;
+    conn->worker = worker;
+    conn->service_data = pool->service.data;
+    for ( i = 0; i < WORKER_MAX_WATCHES; i++ ) {
+        conn->watches[i].fd = -1;
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    conn->next = worker->incoming;
+    worker->incoming = conn;
+    worker->count++;
+    pthread_mutex_unlock(&worker->lock);
+
+    wake_worker(worker);
+
+    return 0;
+}
+
+
+
+/*
+ * Add data to the end of a buffer waiting to be sent.
+ */
+void worker_buffer_append(worker_buffer_t *buffer, const void *data,
+        size_t length) {
+
+    if ( buffer->length + length > buffer->size ) {
+        while ( buffer->length + length > buffer->size ) {
+            buffer->size = buffer->size ? buffer->size * 2 : 1024;
+        }
+        buffer->data = realloc(buffer->data, buffer->size);
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+
+
+/*
+ * Send as much of a buffer as possible without blocking. Returns 1 if the
+ * whole buffer has been sent, 0 if there is more to send once the
+ * descriptor is writable, or -1 on error.
+ */
+int worker_buffer_send(worker_buffer_t *buffer, int fd) {
+    ssize_t bytes;
+
+    while ( buffer->offset < buffer->length ) {
+        bytes = send(fd, buffer->data + buffer->offset,
+                buffer->length - buffer->offset, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if ( bytes < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return 0;
+            }
+            return -1;
+        }
+
+        buffer->offset += bytes;
+    }
+
+    return 1;
+}
+
+
+
+/*
+ * Free the data held by a buffer, leaving it empty and ready to reuse.
+ */
+void worker_buffer_free(worker_buffer_t *buffer) {
+    free(buffer->data);
+    memset(buffer, 0, sizeof(worker_buffer_t));
+}
@@ -0,0 +1,139 @@
+/*
+ * This file is part of amplet2.
+ *
+ * Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+ *
+ * Author: Brendon Jones
+ *
+ * All rights reserved.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * amplet2 is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations including
+ * the two.
+ *
+ * You must obey the GNU General Public License in all respects for all
+ * of the code used other than OpenSSL. If you modify file(s) with this
+ * exception, you may extend this exception to your version of the
+ * file(s), but you are not obligated to do so. If you do not wish to do
+ * so, delete this exception statement from your version. If you delete
+ * this exception statement from all source files in the program, then
+ * also delete it here.
+ *
+ * amplet2 is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEASURED_WORKERPOOL_H
+#define _MEASURED_WORKERPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* default number of threads serving each local socket */
+#define DEFAULT_WORKER_THREADS 4
+/* upper limit on the number of threads serving each local socket */
+#define MAX_WORKER_THREADS 64
+/* maximum number of events dealt with each time a worker wakes up */
+#define WORKER_MAX_EVENTS 64
+/* maximum number of file descriptors a single connection can watch */
+#define WORKER_MAX_WATCHES 2
+
+/* returned by service callbacks to keep or close the connection */
+#define WORKER_CONN_KEEP 0
+#define WORKER_CONN_CLOSE 1
+
+typedef struct worker_pool worker_pool_t;
+typedef struct worker_thread worker_thread_t;
+typedef struct worker_conn worker_conn_t;
+
+/*
+ * A file descriptor being watched by a worker thread, and the connection
+ * that it belongs to (or NULL if it is the shared descriptor).
+ */
+typedef struct worker_watch {
+    int fd;
+    worker_conn_t *conn;
+} worker_watch_t;
+
+/*
+ * A connection from a test process, owned by a single worker thread for its
+ * whole life. Only the owning thread ever touches it, other threads can use
+ * worker_conn_wake() to have it polled.
+ */
+struct worker_conn {
+    int fd;                         /* connection to the test process */
+    worker_thread_t *worker;        /* thread that owns this connection */
+    void *state;                    /* service specific connection state */
+    void *service_data;             /* data shared by the whole service */
+    uint64_t deadline;              /* time (ms) to expire it, 0 for never */
+    int polling;                    /* poll it every time the worker wakes */
+    int closed;                     /* finished, to be freed by the worker */
+    worker_watch_t watches[WORKER_MAX_WATCHES];
+    struct worker_conn *prev;
+    struct worker_conn *next;
+};
+
+/*
+ * Callbacks that implement a service as a state machine driven by events
+ * on the connection. Any that return a value should return WORKER_CONN_KEEP
+ * to keep the connection open, or WORKER_CONN_CLOSE once it is finished.
+ */
+typedef struct worker_service {
+    char *name;                     /* name of the service, for logging */
+    void *data;                     /* data shared by all connections */
+    int shared_fd;                  /* descriptor every worker watches, or -1 */
+    int poll_interval;              /* ms between polling, 0 if only woken */
+
+    /* new connection has arrived, the test process fd is already watched */
+    int (*start)(worker_conn_t *conn);
+    /* a descriptor watched by the connection has events */
+    int (*ready)(worker_conn_t *conn, int fd, uint32_t events);
+    /* connection is polling and the worker woke up or was woken for it */
+    int (*poll)(worker_conn_t *conn);
+    /* connection deadline has passed */
+    int (*expire)(worker_conn_t *conn);
+    /* the shared descriptor is readable */
+    void (*shared_ready)(void *data);
+    /* free any connection state, the test process fd is closed after */
+    void (*finish)(worker_conn_t *conn);
+} worker_service_t;
+
+/*
+ * Simple growable buffer of data waiting to be sent.
+ */
+typedef struct worker_buffer {
+    char *data;
+    size_t length;                  /* bytes of data in the buffer */
+    size_t size;                    /* bytes allocated */
+    size_t offset;                  /* bytes already sent */
+} worker_buffer_t;
+
+worker_pool_t *create_worker_pool(worker_service_t *service, int threads);
+void destroy_worker_pool(worker_pool_t *pool);
+int worker_pool_add_connection(worker_pool_t *pool, int fd);
+int worker_watch_fd(worker_conn_t *conn, int fd, uint32_t events);
+void worker_conn_wake(worker_conn_t *conn);
+void worker_unwatch_fd(worker_conn_t *conn, int fd);
+uint64_t worker_get_time(void);
+
+void worker_buffer_append(worker_buffer_t *buffer, const void *data,
+        size_t length);
+int worker_buffer_send(worker_buffer_t *buffer, int fd);
+void worker_buffer_free(worker_buffer_t *buffer);
+
+#endif
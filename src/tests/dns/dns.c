@@ -77,6 +77,7 @@ static struct option long_options[] = {
     {"payload", required_argument, 0, 'z'},
     {"dscp", required_argument, 0, 'Q'},
     {"interpacketgap", required_argument, 0, 'Z'},
+    {"burst", required_argument, 0, 'B'},
     {"interface", required_argument, 0, 'I'},
     {"ipv4", required_argument, 0, '4'},
     {"ipv6", required_argument, 0, '6'},
@@ -264,7 +265,8 @@ static void process_opt_rr(char *rr, struct info_t *info) {
  * claims to have?
  */
 static void process_packet(struct dnsglobals_t *globals, char *packet,
-        __attribute__((unused))uint32_t bytes, struct timeval *now) {
+        __attribute__((unused))uint32_t bytes, struct timeval *now,
+        int source) {
 
     struct dns_t *header;
     uint16_t recv_ident;
@@ -390,6 +392,11 @@ static void process_packet(struct dnsglobals_t *globals, char *packet,
     } else {
         info[index].delay = 0;
     }
+
+    /* the rtt is only as good as the worst of the two timestamps */
+    if ( source < info[index].timestamp_source ) {
+        info[index].timestamp_source = source;
+    }
     globals->outstanding--;
 }
 
@@ -402,31 +409,30 @@ static void process_packet(struct dnsglobals_t *globals, char *packet,
 static void receive_probe_callback(wand_event_handler_t *ev_hdl,
         int fd, void *data, enum wand_eventtype_t ev) {
 
-    char *packet;
-    int buflen;
-    ssize_t bytes;
-    int wait;
+    struct batch_packet_t packets[MAX_PACKET_BATCH];
     struct timeval now;
-    struct socket_t sockets;
+    int received;
+    int wait;
+    int i;
     struct dnsglobals_t *globals = (struct dnsglobals_t*)data;
 
     assert(fd > 0);
     assert(ev == EV_READ);
 
-    if ( globals->options.udp_payload_size > 0 ) {
-        buflen = globals->options.udp_payload_size;
-    } else {
-        buflen = DEFAULT_UDP_PAYLOAD_SIZE;
-    }
-
     wait = 0;
-    sockets.socket = fd;
-    sockets.socket6 = -1;
 
-    packet = calloc(1, buflen);
+    for ( i = 0; i < MAX_PACKET_BATCH; i++ ) {
+        packets[i].buf = globals->buffer + (i * globals->buflen);
+        packets[i].size = globals->buflen;
+    }
+
+    /* read every response that is waiting on the socket in one go */
+    received = get_packet_batch(fd, packets, MAX_PACKET_BATCH, &wait);
 
-    if ( (bytes=get_packet(&sockets, packet, buflen, NULL, &wait, &now)) > 0 ) {
-        process_packet(globals, packet, bytes, &now);
+    for ( i = 0; i < received; i++ ) {
+        now = TV_FROM_TS(packets[i].time);
+        process_packet(globals, packets[i].buf, packets[i].length, &now,
+                packets[i].time_source);
     }
 
     if ( globals->outstanding == 0 && globals->index == globals->count ) {
@@ -434,8 +440,6 @@ static void receive_probe_callback(wand_event_handler_t *ev_hdl,
         ev_hdl->running = false;
         Log(LOG_DEBUG, "All expected DNS responses received");
     }
-
-    free(packet);
 }
 
 
@@ -532,14 +536,22 @@ static char *create_dns_query(uint16_t ident, uint32_t *len, struct opt_t *opt){
 
 
 /*
- * Send a DNS packet and record information about when it was sent.
+ * Send DNS queries to as many destinations as are currently due, as a single
+ * batch per address family, and record information about when they were
+ * sent.
  */
 static void send_packet(wand_event_handler_t *ev_hdl, void *data) {
 
-    int sock;
+    /* packets to send are grouped by family, ipv4 first then ipv6 */
+    struct batch_packet_t packets[2][MAX_PACKET_BATCH];
+    int seqs[2][MAX_PACKET_BATCH];
+    int queued[2] = {0, 0};
+    int sock[2];
+    int batch;
     int delay;
-    char *qbuf;
+    int family;
     int seq;
+    int i;
     uint16_t ident;
     struct addrinfo *dest;
     struct opt_t *opt;
@@ -548,60 +560,91 @@ static void send_packet(wand_event_handler_t *ev_hdl, void *data) {
 
     globals = (struct dnsglobals_t *)data;
     info = globals->info;
-    seq = globals->index;
     ident = globals->ident;
-    dest = globals->dests[seq];
     opt = &globals->options;
-    qbuf = NULL;
+    sock[0] = globals->sockets.socket;
+    sock[1] = globals->sockets.socket6;
+
+    /* send as many packets as the inter packet delay allows right now */
+    batch = globals->count - globals->index;
+    batch = pacer_get_batch(&globals->pacer,
+            batch < MAX_PACKET_BATCH ? batch : MAX_PACKET_BATCH, &delay);
+
+    if ( batch == 0 ) {
+        /* send event triggered early, wait the remaining time and try again */
+        globals->nextpackettimer = wand_add_timer(ev_hdl, S_FROM_US(delay),
+                US_FROM_US(delay), globals, send_packet);
+        return;
+    }
 
-    /*
-     * Set initial values for the info block for this test - it has already
-     * been memset to zero, so only need to set those that have values. Do
-     * this before any return statements, so we have a little bit of info
-     * in case we abort early.
-     */
-    info[seq].addr = dest;
-
-    /* determine the appropriate socket to use and port field to set */
-    switch ( dest->ai_family ) {
-	case AF_INET:
-	    sock = globals->sockets.socket;
-	    ((struct sockaddr_in*)dest->ai_addr)->sin_port = htons(53);
-	    break;
-	case AF_INET6:
-	    sock = globals->sockets.socket6;
-	    ((struct sockaddr_in6*)dest->ai_addr)->sin6_port = htons(53);
-	    break;
-	default:
-	    Log(LOG_WARNING, "Unknown address family: %d", dest->ai_family);
-	    goto next;
-    };
+    for ( i = 0; i < batch; i++ ) {
+        seq = globals->index + i;
+        dest = globals->dests[seq];
 
-    if ( sock < 0 ) {
-	Log(LOG_WARNING, "Unable to test to %s, socket wasn't opened",
-                dest->ai_canonname);
-	goto next;
-    }
+        /*
+         * Set initial values for the info block for this test - it has
+         * already been memset to zero, so only need to set those that have
+         * values. Do this before any continue statements, so we have a
+         * little bit of info in case we abort early.
+         */
+        info[seq].addr = dest;
+
+        /* determine the appropriate socket to use and port field to set */
+        switch ( dest->ai_family ) {
+            case AF_INET:
+                family = 0;
+                ((struct sockaddr_in*)dest->ai_addr)->sin_port = htons(53);
+                break;
+            case AF_INET6:
+                family = 1;
+                ((struct sockaddr_in6*)dest->ai_addr)->sin6_port = htons(53);
+                break;
+            default:
+                Log(LOG_WARNING, "Unknown address family: %d",
+                        dest->ai_family);
+                continue;
+        };
 
-    //XXX pass in buffer, return useful length like icmp test?
-    qbuf = create_dns_query(seq + ident, &(info[seq].query_length), opt);
+        if ( sock[family] < 0 ) {
+            Log(LOG_WARNING, "Unable to test to %s, socket wasn't opened",
+                    dest->ai_canonname);
+            continue;
+        }
 
-    while ( (delay = delay_send_packet(sock, qbuf, info[seq].query_length,
-                    dest, opt->inter_packet_delay,
-                    &(info[seq].time_sent))) > 0 ) {
-        usleep(delay);
+        //XXX pass in buffer, return useful length like icmp test?
+        packets[family][queued[family]].buf = create_dns_query(seq + ident,
+                &(info[seq].query_length), opt);
+        packets[family][queued[family]].length = info[seq].query_length;
+        packets[family][queued[family]].dest = dest;
+        seqs[family][queued[family]] = seq;
+        queued[family]++;
     }
 
-    if ( delay < 0 ) {
-        /* mark this as done if the packet failed to send properly */
-        info[seq].reply = 1;
-        memset(&(info[seq].time_sent), 0, sizeof(struct timeval));
-    } else {
-        globals->outstanding++;
+    /* send each batch of packets and record when they were sent */
+    for ( family = 0; family < 2; family++ ) {
+        if ( queued[family] == 0 ) {
+            continue;
+        }
+
+        send_packet_batch(sock[family], packets[family], queued[family]);
+        pacer_sent(&globals->pacer, queued[family]);
+
+        for ( i = 0; i < queued[family]; i++ ) {
+            seq = seqs[family][i];
+            if ( packets[family][i].length < 0 ) {
+                /* mark this as done if the packet failed to send properly */
+                info[seq].reply = 1;
+                memset(&(info[seq].time_sent), 0, sizeof(struct timeval));
+            } else {
+                info[seq].time_sent = TV_FROM_TS(packets[family][i].time);
+                info[seq].timestamp_source = packets[family][i].time_source;
+                globals->outstanding++;
+            }
+            free(packets[family][i].buf);
+        }
     }
 
-next:
-    globals->index++;
+    globals->index += batch;
 
     /* create timer for sending the next packet if there are still more to go */
     if ( globals->index == globals->count ) {
@@ -610,14 +653,10 @@ next:
         globals->losstimer = wand_add_timer(ev_hdl, LOSS_TIMEOUT, 0, globals,
                 halt_test);
     } else {
-        globals->nextpackettimer = wand_add_timer(ev_hdl,
-                (int) (globals->options.inter_packet_delay / 1000000),
-                (globals->options.inter_packet_delay % 1000000),
-                globals, send_packet);
-    }
-
-    if ( qbuf ) {
-        free(qbuf);
+        /* schedule against the next deadline, not the time we finished */
+        delay = pacer_get_delay(&globals->pacer);
+        globals->nextpackettimer = wand_add_timer(ev_hdl, S_FROM_US(delay),
+                US_FROM_US(delay), globals, send_packet);
     }
 }
 
@@ -705,6 +744,8 @@ static Amplet2__Dns__Item* report_destination(struct info_t *info) {
         item->rtt = info->delay;
         item->has_ttl = 1;
         item->ttl = info->ttl;
+        item->has_timestamp_source = 1;
+        item->timestamp_source = info->timestamp_source;
         item->has_response_size = 1;
         item->response_size = info->bytes;
         item->has_total_answer = 1;
@@ -725,6 +766,7 @@ static Amplet2__Dns__Item* report_destination(struct info_t *info) {
         /* don't report any of these fields without a response to our query */
         item->has_rtt = 0;
         item->has_ttl = 0;
+        item->has_timestamp_source = 0;
         item->has_response_size = 0;
         item->has_total_answer = 0;
         item->has_total_authority = 0;
@@ -745,7 +787,7 @@ static Amplet2__Dns__Item* report_destination(struct info_t *info) {
  * results for each destination address.
  */
 static amp_test_result_t* report_results(struct timeval *start_time, int count,
-	struct info_t info[], struct opt_t *opt) {
+	struct info_t info[], struct opt_t *opt, struct pacer_t *pacer) {
 
     int i;
     amp_test_result_t *result = calloc(1, sizeof(amp_test_result_t));
@@ -774,6 +816,18 @@ static amp_test_result_t* report_results(struct timeval *start_time, int count,
     header.has_dscp = 1;
     header.dscp = opt->dscp;
 
+    /* report how closely the requested packet spacing was achieved */
+    if ( pacer != NULL && pacer->packets > 1 ) {
+        header.has_target_spacing = 1;
+        header.target_spacing = pacer->interval;
+        header.has_achieved_spacing = 1;
+        header.achieved_spacing = pacer_get_mean_gap(pacer) + 0.5;
+        header.has_mean_lateness = 1;
+        header.mean_lateness = pacer_get_mean_lateness(pacer) + 0.5;
+        header.has_max_lateness = 1;
+        header.max_lateness = pacer->max_lateness;
+    }
+
     /* build up the repeated reports section with each of the results */
     reports = malloc(sizeof(Amplet2__Dns__Item*) * count);
     for ( i = 0; i < count; i++ ) {
@@ -939,7 +993,7 @@ static void usage(void) {
     fprintf(stderr,
             "Usage: amp-dns [-hrnsvx] [-c class] [-p perturbate] [-q query]\n"
             "               [-t type] [-z size]\n"
-            "               [-Q codepoint] [-Z interpacketgap]\n"
+            "               [-Q codepoint] [-Z interpacketgap] [-B burst]\n"
             "               [-I interface] [-4 sourcev4] [-6 sourcev6]\n"
             "               [-- destination1 [ destination2 ... destinationN]]"
             "\n\n");
@@ -963,6 +1017,7 @@ static void usage(void) {
             "UDP payload size (default: %d, 0 to disable)\n",
             DEFAULT_UDP_PAYLOAD_SIZE);
 
+    print_probe_usage();
     print_interface_usage();
     print_generic_usage();
 }
@@ -1003,13 +1058,14 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
     options->nsid = 0;
     options->perturbate = 0;
     options->inter_packet_delay = MIN_INTER_PACKET_DELAY;
+    options->burst = DEFAULT_PACKET_BURST;
     options->dscp = DEFAULT_DSCP_VALUE;
     sourcev4 = NULL;
     sourcev6 = NULL;
     device = NULL;
     local_resolv = 0;
 
-    while ( (opt = getopt_long(argc, argv, "c:np:q:rst:z:I:Q:Z:4:6:hvx",
+    while ( (opt = getopt_long(argc, argv, "c:np:q:rst:z:I:Q:B:Z:4:6:hvx",
                     long_options, NULL)) != -1 ) {
         switch ( opt ) {
             case '4': sourcev4 = get_numeric_address(optarg, NULL); break;
@@ -1021,6 +1077,7 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
                       }
                       break;
             case 'Z': options->inter_packet_delay = atoi(optarg); break;
+            case 'B': options->burst = atoi(optarg); break;
             case 'c': options->query_class = get_query_class(optarg); break;
             case 'n': options->nsid = 1; break;
             case 'p': options->perturbate = atoi(optarg); break;
@@ -1122,6 +1179,9 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
         exit(-1);
     }
 
+    /* not fatal, send times will be taken by the test if this fails */
+    set_tx_timestamp_socket_options(&globals->sockets);
+
     if ( set_dscp_socket_options(&globals->sockets, options->dscp) < 0 ) {
         Log(LOG_ERR, "Failed to set DSCP socket options, aborting test");
         exit(-1);
@@ -1152,6 +1212,14 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
     globals->info = (struct info_t *)malloc(sizeof(struct info_t) * count);
     memset(globals->info, 0, sizeof(struct info_t) * count);
 
+    /* allocate space to receive a full batch of responses at once */
+    if ( options->udp_payload_size > 0 ) {
+        globals->buflen = options->udp_payload_size;
+    } else {
+        globals->buflen = DEFAULT_UDP_PAYLOAD_SIZE;
+    }
+    globals->buffer = malloc(globals->buflen * MAX_PACKET_BATCH);
+
     globals->index = 0;
     globals->outstanding = 0;
     globals->count = count;
@@ -1168,6 +1236,9 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
     wand_add_fd(ev_hdl, globals->sockets.socket6, EV_READ, globals,
             receive_probe_callback);
 
+    pacer_init(&globals->pacer, options->inter_packet_delay,
+            options->burst);
+
     /* schedule the first probe packet to be sent immediately */
     wand_add_timer(ev_hdl, 0, 0, globals, send_packet);
 
@@ -1185,6 +1256,8 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
 
     wand_destroy_event_handler(ev_hdl);
 
+    pacer_report(&globals->pacer, "DNS");
+
     if ( globals->sockets.socket > 0 ) {
 	close(globals->sockets.socket);
     }
@@ -1202,10 +1275,12 @@ amp_test_result_t* run_dns(int argc, char *argv[], int count,
     }
 
     /* send report */
-    result = report_results(&start_time, count, globals->info, options);
+    result = report_results(&start_time, count, globals->info, options,
+            &globals->pacer);
 
     free(options->query_string);
     free(globals->info);
+    free(globals->buffer);
     free(globals);
 
     /* free any addresses we've had to make ourselves */
@@ -1252,6 +1327,13 @@ void print_dns(amp_test_result_t *result) {
             msg->header->dscp);
     printf("\n");
 
+    if ( msg->header->has_achieved_spacing ) {
+        printf("achieved packet spacing %uus (target %uus), mean "
+                "lateness %uus (max %uus)\n", msg->header->achieved_spacing,
+                msg->header->target_spacing,
+                msg->header->mean_lateness, msg->header->max_lateness);
+    }
+
     if ( msg->header->recurse || msg->header->dnssec || msg->header->nsid ) {
 	printf("global options:");
 	if ( msg->header->recurse ) printf(" +recurse");
@@ -1360,8 +1442,9 @@ char *amp_test_dns_decode(char *result, char *data, char *start) {
 }
 
 amp_test_result_t* amp_test_report_results(struct timeval *start_time,
-        int count, struct info_t info[], struct opt_t *opt) {
-    return report_results(start_time, count, info, opt);
+        int count, struct info_t info[], struct opt_t *opt,
+        struct pacer_t *pacer) {
+    return report_results(start_time, count, info, opt, pacer);
 }
 
 #endif
@@ -178,6 +178,7 @@ struct info_t {
     uint8_t dnssec_response;
     uint8_t addr_count;
     uint8_t ttl;
+    uint8_t timestamp_source;		/* least accurate of send/recv times */
 };
 
 
@@ -195,6 +196,7 @@ struct opt_t {
     int nsid;
     int perturbate;
     uint32_t inter_packet_delay;
+    uint32_t burst;
     uint8_t dscp;
 };
 
@@ -205,6 +207,9 @@ struct dnsglobals_t {
     struct socket_t sockets;
     struct addrinfo **dests;
     struct info_t *info;
+    char *buffer;               /* space to receive a batch of responses */
+    int buflen;                 /* space for each response in the buffer */
+    struct pacer_t pacer;       /* spaces out the queries being sent */
     uint16_t ident;
     int index;
     int count;
@@ -225,7 +230,8 @@ test_t *register_test(void);
 char *amp_test_dns_encode(char *query);
 char *amp_test_dns_decode(char *result, char *data, char *start);
 amp_test_result_t* amp_test_report_results(struct timeval *start_time,
-        int count, struct info_t info[], struct opt_t *opt);
+        int count, struct info_t info[], struct opt_t *opt,
+        struct pacer_t *pacer);
 #endif
 
 
@@ -53,6 +53,7 @@
 struct info_t *info;
 unsigned int count;
 struct opt_t *options;
+struct pacer_t *pacer;
 
 
 
@@ -80,6 +81,31 @@ static void verify_header(struct opt_t *a, Amplet2__Dns__Header *b) {
 
 
 
+/*
+ * Check that the achieved packet spacing is only reported when the test
+ * has pacing information, and that it matches what the pacer measured.
+ */
+static void verify_pacing(struct pacer_t *a, Amplet2__Dns__Header *b) {
+    if ( a == NULL || a->packets < 2 ) {
+        assert(!b->has_target_spacing);
+        assert(!b->has_achieved_spacing);
+        assert(!b->has_mean_lateness);
+        assert(!b->has_max_lateness);
+        return;
+    }
+
+    assert(b->has_target_spacing);
+    assert(b->has_achieved_spacing);
+    assert(b->has_mean_lateness);
+    assert(b->has_max_lateness);
+    assert(b->target_spacing == a->interval);
+    assert(b->achieved_spacing == (uint32_t)(pacer_get_mean_gap(a) + 0.5));
+    assert(b->mean_lateness == (uint32_t)(pacer_get_mean_lateness(a) + 0.5));
+    assert(b->max_lateness == (uint32_t)a->max_lateness);
+}
+
+
+
 /*
  * Check that the address in the result item matches the address that the
  * test tried to report.
@@ -202,6 +228,7 @@ static void verify_message(amp_test_result_t *result) {
     assert(msg->n_reports == count);
 
     verify_header(options, msg->header);
+    verify_pacing(pacer, msg->header);
 
     /* check each of the test results */
     for ( i = 0; i < msg->n_reports; i++ ) {
@@ -249,6 +276,7 @@ static void build_info(struct info_t *item, struct addrinfo *addr,
  *
  */
 int main(void) {
+    struct pacer_t pacing;
     unsigned int i;
     struct timeval start_time;
     struct addrinfo *addr = get_numeric_address("192.168.0.254", NULL);
@@ -327,9 +355,22 @@ int main(void) {
     for ( i = 0; i < sizeof(full_options) / sizeof(struct opt_t); i++ ) {
         options = &full_options[i];
         verify_message(amp_test_report_results(&start_time, count, info,
-                    options));
+                    options, pacer));
     }
 
+    /* the achieved packet spacing is reported when the test knows it */
+    memset(&pacing, 0, sizeof(pacing));
+    pacing.interval = 1000;
+    pacing.packets = 11;
+    pacing.first = 5000;
+    pacing.last = 15500;
+    pacing.lateness = 2222;
+    pacing.max_lateness = 900;
+    pacer = &pacing;
+    verify_message(amp_test_report_results(&start_time, count, info,
+                options, pacer));
+    pacer = NULL;
+
     free(info);
     freeaddrinfo(addr);
     return 0;
@@ -80,6 +80,7 @@ static struct option long_options[] = {
     {"size", required_argument, 0, 's'},
     {"dscp", required_argument, 0, 'Q'},
     {"interpacketgap", required_argument, 0, 'Z'},
+    {"burst", required_argument, 0, 'B'},
     {"interface", required_argument, 0, 'I'},
     {"ipv4", required_argument, 0, '4'},
     {"ipv6", required_argument, 0, '6'},
@@ -201,7 +202,7 @@ static int icmp_error(char *packet, int bytes, uint16_t ident,
  * a request we have sent. If so then record the time it took to get the reply.
  */
 static int process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
-        uint32_t bytes, struct timeval *now) {
+        uint32_t bytes, struct timeval *now, int source) {
 
     struct iphdr *ip;
     struct icmphdr *icmp;
@@ -266,6 +267,11 @@ static int process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
         globals->info[seq].delay = 0;
     }
 
+    /* the rtt is only as good as the worst of the two timestamps */
+    if ( source < globals->info[seq].timestamp_source ) {
+        globals->info[seq].timestamp_source = source;
+    }
+
     Log(LOG_DEBUG, "Good ICMP ECHOREPLY");
     return 0;
 }
@@ -278,7 +284,7 @@ static int process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
  * want? Should record errors for both protocols, or neither?
  */
 static int process_ipv6_packet(struct icmpglobals_t *globals, char *packet,
-        uint32_t bytes, struct timeval *now) {
+        uint32_t bytes, struct timeval *now, int source) {
 
     struct icmp6_hdr *icmp;
     uint16_t seq;
@@ -316,6 +322,11 @@ static int process_ipv6_packet(struct icmpglobals_t *globals, char *packet,
         globals->info[seq].delay = 0;
     }
 
+    /* the rtt is only as good as the worst of the two timestamps */
+    if ( source < globals->info[seq].timestamp_source ) {
+        globals->info[seq].timestamp_source = source;
+    }
+
     Log(LOG_DEBUG, "Good ICMP6 ECHOREPLY");
     return 0;
 }
@@ -329,12 +340,13 @@ static int process_ipv6_packet(struct icmpglobals_t *globals, char *packet,
 static void receive_probe_callback(wand_event_handler_t *ev_hdl,
         int fd, void *data, enum wand_eventtype_t ev) {
 
-    char packet[RESPONSE_BUFFER_LEN];
-    struct timeval now;
+    char buffer[MAX_PACKET_BATCH][RESPONSE_BUFFER_LEN];
+    struct batch_packet_t packets[MAX_PACKET_BATCH];
     struct iphdr *ip;
-    ssize_t bytes;
+    struct timeval now;
+    int received;
     int wait;
-    struct socket_t sockets;
+    int i;
     struct icmpglobals_t *globals = (struct icmpglobals_t*)data;
 
     assert(fd > 0);
@@ -342,23 +354,29 @@ static void receive_probe_callback(wand_event_handler_t *ev_hdl,
 
     wait = 0;
 
-    /* the socket used here doesn't matter as the family isn't used anywhere */
-    sockets.socket = fd;
-    sockets.socket6 = -1;
+    for ( i = 0; i < MAX_PACKET_BATCH; i++ ) {
+        packets[i].buf = buffer[i];
+        packets[i].size = RESPONSE_BUFFER_LEN;
+    }
+
+    /* read every response that is waiting on the socket in one go */
+    received = get_packet_batch(fd, packets, MAX_PACKET_BATCH, &wait);
 
-    if ( (bytes=get_packet(&sockets, packet, RESPONSE_BUFFER_LEN, NULL, &wait,
-                    &now)) > 0 ) {
+    for ( i = 0; i < received; i++ ) {
 	/*
 	 * this check isn't as nice as it could be - should we explicitly ask
 	 * for the icmp6 header to be returned so we can be sure we are
 	 * checking the right things?
 	 */
-        ip = (struct iphdr*)packet;
+        ip = (struct iphdr*)packets[i].buf;
+        now = TV_FROM_TS(packets[i].time);
         switch ( ip->version ) {
-	    case 4: process_ipv4_packet(globals, packet, bytes, &now);
+	    case 4: process_ipv4_packet(globals, packets[i].buf,
+                            packets[i].length, &now, packets[i].time_source);
 		    break;
 	    default: /* unless we ask we don't have an ipv6 header here */
-		    process_ipv6_packet(globals, packet, bytes, &now);
+		    process_ipv6_packet(globals, packets[i].buf,
+                            packets[i].length, &now, packets[i].time_source);
 		    break;
 	};
     }
@@ -409,15 +427,22 @@ static int build_probe(uint8_t family, void *packet, uint16_t packet_size,
 
 
 /*
- * Construct and send an icmp echo request packet.
+ * Construct and send icmp echo request packets to as many destinations as
+ * are currently due, sending them as a single batch per address family.
  */
 static void send_packet(wand_event_handler_t *ev_hdl, void *data) {
 
-    char *packet;
-    int sock;
-    int length;
+    /* packets to send are grouped by family, ipv4 first then ipv6 */
+    struct batch_packet_t packets[2][MAX_PACKET_BATCH];
+    int seqs[2][MAX_PACKET_BATCH];
+    int queued[2] = {0, 0};
+    int sock[2];
+    char *buffer;
+    int batch;
     int delay;
+    int family;
     int seq;
+    int i;
     uint16_t ident;
     struct addrinfo *dest;
     struct opt_t *opt;
@@ -426,52 +451,85 @@ static void send_packet(wand_event_handler_t *ev_hdl, void *data) {
 
     globals = (struct icmpglobals_t *)data;
     info = globals->info;
-    seq = globals->index;
     ident = globals->ident;
-    dest = globals->dests[seq];
     opt = &globals->options;
-    packet = NULL;
-
-    /* save information about this packet so we can track the response */
-    memset(&info[seq], 0, sizeof(info[seq]));
-    info[seq].addr = dest;
-    info[seq].magic = rand();
+    sock[0] = globals->sockets.socket;
+    sock[1] = globals->sockets.socket6;
+
+    /* send as many packets as the inter packet delay allows right now */
+    batch = globals->count - globals->index;
+    batch = pacer_get_batch(&globals->pacer,
+            batch < MAX_PACKET_BATCH ? batch : MAX_PACKET_BATCH, &delay);
+
+    if ( batch == 0 ) {
+        /* send event triggered early, wait the remaining time and try again */
+        globals->nextpackettimer = wand_add_timer(ev_hdl, S_FROM_US(delay),
+                US_FROM_US(delay), globals, send_packet);
+        return;
+    }
 
-    /* determine which socket we should use, ipv4 or ipv6 */
-    switch ( dest->ai_family ) {
-	case AF_INET: sock = globals->sockets.socket; break;
-	case AF_INET6: sock = globals->sockets.socket6; break;
-	default: Log(LOG_WARNING, "Unknown address family: %d",dest->ai_family);
-                 goto next;
-    };
+    buffer = calloc(batch, opt->packet_size);
+
+    for ( i = 0; i < batch; i++ ) {
+        seq = globals->index + i;
+        dest = globals->dests[seq];
+
+        /* save information about this packet so we can track the response */
+        memset(&info[seq], 0, sizeof(info[seq]));
+        info[seq].addr = dest;
+        info[seq].magic = rand();
+
+        /* determine which socket we should use, ipv4 or ipv6 */
+        switch ( dest->ai_family ) {
+            case AF_INET: family = 0; break;
+            case AF_INET6: family = 1; break;
+            default: Log(LOG_WARNING, "Unknown address family: %d",
+                             dest->ai_family);
+                     continue;
+        };
+
+        if ( sock[family] < 0 ) {
+            Log(LOG_WARNING, "Unable to test to %s, socket wasn't opened",
+                    dest->ai_canonname);
+            continue;
+        }
 
-    if ( sock < 0 ) {
-	Log(LOG_WARNING, "Unable to test to %s, socket wasn't opened",
-                dest->ai_canonname);
-        goto next;
+        /* build the probe packet */
+        packets[family][queued[family]].buf = buffer + (i * opt->packet_size);
+        packets[family][queued[family]].length = build_probe(dest->ai_family,
+                packets[family][queued[family]].buf, opt->packet_size, seq,
+                ident, info[seq].magic);
+        packets[family][queued[family]].dest = dest;
+        seqs[family][queued[family]] = seq;
+        queued[family]++;
     }
 
-    /* build the probe packet */
-    packet = calloc(1, opt->packet_size);
-    length = build_probe(dest->ai_family, packet, opt->packet_size, seq, ident,
-            info[seq].magic);
+    /* send each batch of packets and record when they were sent */
+    for ( family = 0; family < 2; family++ ) {
+        if ( queued[family] == 0 ) {
+            continue;
+        }
+
+        send_packet_batch(sock[family], packets[family], queued[family]);
+        pacer_sent(&globals->pacer, queued[family]);
 
-    /* send packet with appropriate inter packet delay */
-    while ( (delay = delay_send_packet(sock, packet, length, dest,
-                    opt->inter_packet_delay, &(info[seq].time_sent))) > 0 ) {
-        usleep(delay);
+        for ( i = 0; i < queued[family]; i++ ) {
+            seq = seqs[family][i];
+            if ( packets[family][i].length < 0 ) {
+                /* mark this as done if the packet failed to send properly */
+                info[seq].reply = 1;
+                memset(&(info[seq].time_sent), 0, sizeof(struct timeval));
+            } else {
+                info[seq].time_sent = TV_FROM_TS(packets[family][i].time);
+                info[seq].timestamp_source = packets[family][i].time_source;
+                globals->outstanding++;
+            }
+        }
     }
 
-    if ( delay < 0 ) {
-        /* mark this as done if the packet failed to send properly */
-        info[seq].reply = 1;
-        memset(&(info[seq].time_sent), 0, sizeof(struct timeval));
-    } else {
-        globals->outstanding++;
-    }
+    free(buffer);
 
-next:
-    globals->index++;
+    globals->index += batch;
 
     /* create timer for sending the next packet if there are still more to go */
     if ( globals->index == globals->count ) {
@@ -480,14 +538,10 @@ next:
         globals->losstimer = wand_add_timer(ev_hdl, LOSS_TIMEOUT, 0, globals,
                 halt_test);
     } else {
-        globals->nextpackettimer = wand_add_timer(ev_hdl,
-                (int) (globals->options.inter_packet_delay / 1000000),
-                (globals->options.inter_packet_delay % 1000000),
-                globals, send_packet);
-    }
-
-    if ( packet ) {
-        free(packet);
+        /* schedule against the next deadline, not the time we finished */
+        delay = pacer_get_delay(&globals->pacer);
+        globals->nextpackettimer = wand_add_timer(ev_hdl, S_FROM_US(delay),
+                US_FROM_US(delay), globals, send_packet);
     }
 }
 
@@ -549,10 +603,13 @@ static Amplet2__Icmp__Item* report_destination(struct info_t *info) {
         item->rtt = info->delay;
         item->has_ttl = 1;
         item->ttl = info->ttl;
+        item->has_timestamp_source = 1;
+        item->timestamp_source = info->timestamp_source;
     } else {
         /* don't send an rtt if there wasn't a valid one recorded */
         item->has_rtt = 0;
         item->has_ttl = 0;
+        item->has_timestamp_source = 0;
     }
 
     if ( item->has_rtt || info->err_type > 0 ) {
@@ -580,7 +637,7 @@ static Amplet2__Icmp__Item* report_destination(struct info_t *info) {
  * results for each destination address.
  */
 static amp_test_result_t* report_results(struct timeval *start_time, int count,
-        struct info_t info[], struct opt_t *opt) {
+        struct info_t info[], struct opt_t *opt, struct pacer_t *pacer) {
 
     int i;
     amp_test_result_t *result = calloc(1, sizeof(amp_test_result_t));
@@ -600,6 +657,18 @@ static amp_test_result_t* report_results(struct timeval *start_time, int count,
     header.has_dscp = 1;
     header.dscp = opt->dscp;
 
+    /* report how closely the requested packet spacing was achieved */
+    if ( pacer != NULL && pacer->packets > 1 ) {
+        header.has_target_spacing = 1;
+        header.target_spacing = pacer->interval;
+        header.has_achieved_spacing = 1;
+        header.achieved_spacing = pacer_get_mean_gap(pacer) + 0.5;
+        header.has_mean_lateness = 1;
+        header.mean_lateness = pacer_get_mean_lateness(pacer) + 0.5;
+        header.has_max_lateness = 1;
+        header.max_lateness = pacer->max_lateness;
+    }
+
     /* build up the repeated reports section with each of the results */
     reports = malloc(sizeof(Amplet2__Icmp__Item*) * count);
     for ( i = 0; i < count; i++ ) {
@@ -635,7 +704,7 @@ static amp_test_result_t* report_results(struct timeval *start_time, int count,
 static void usage(void) {
     fprintf(stderr,
             "Usage: amp-icmp [-hrvx] [-p perturbate] [-s packetsize]\n"
-            "                [-Q codepoint] [-Z interpacketgap]\n"
+            "                [-Q codepoint] [-Z interpacketgap] [-B burst]\n"
             "                [-I interface] [-4 sourcev4] [-6 sourcev6]\n"
             "                -- destination1 [destination2 ... destinationN]"
             "\n\n");
@@ -680,6 +749,7 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
     /* set some sensible defaults */
     globals->options.dscp = DEFAULT_DSCP_VALUE;
     globals->options.inter_packet_delay = MIN_INTER_PACKET_DELAY;
+    globals->options.burst = DEFAULT_PACKET_BURST;
     globals->options.packet_size = DEFAULT_ICMP_ECHO_REQUEST_LEN;
     globals->options.random = 0;
     globals->options.perturbate = 0;
@@ -687,7 +757,7 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
     sourcev6 = NULL;
     device = NULL;
 
-    while ( (opt = getopt_long(argc, argv, "p:rs:I:Q:Z:4:6:hvx",
+    while ( (opt = getopt_long(argc, argv, "p:rs:I:Q:B:Z:4:6:hvx",
                     long_options, NULL)) != -1 ) {
 	switch ( opt ) {
             case '4': sourcev4 = get_numeric_address(optarg, NULL); break;
@@ -700,6 +770,7 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
                       }
                       break;
             case 'Z': globals->options.inter_packet_delay = atoi(optarg); break;
+            case 'B': globals->options.burst = atoi(optarg); break;
             case 'p': globals->options.perturbate = atoi(optarg); break;
             case 'r': globals->options.random = 1; break;
             case 's': globals->options.packet_size = atoi(optarg); break;
@@ -751,6 +822,9 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
         exit(-1);
     }
 
+    /* not fatal, send times will be taken by the test if this fails */
+    set_tx_timestamp_socket_options(&globals->sockets);
+
     if ( set_dscp_socket_options(&globals->sockets,globals->options.dscp) < 0 ){
         Log(LOG_ERR, "Failed to set DSCP socket options, aborting test");
         exit(-1);
@@ -795,6 +869,9 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
     wand_add_fd(ev_hdl, globals->sockets.socket6, EV_READ, globals,
             receive_probe_callback);
 
+    pacer_init(&globals->pacer, globals->options.inter_packet_delay,
+            globals->options.burst);
+
     /* schedule the first probe packet to be sent immediately */
     wand_add_timer(ev_hdl, 0, 0, globals, send_packet);
 
@@ -812,6 +889,8 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
 
     wand_destroy_event_handler(ev_hdl);
 
+    pacer_report(&globals->pacer, "ICMP");
+
     if ( globals->sockets.socket > 0 ) {
 	close(globals->sockets.socket);
     }
@@ -830,7 +909,7 @@ amp_test_result_t* run_icmp(int argc, char *argv[], int count,
 
     /* send report */
     result = report_results(&start_time, count, globals->info,
-            &globals->options);
+            &globals->options, &globals->pacer);
 
     free(globals->info);
     free(globals);
@@ -871,6 +950,13 @@ void print_icmp(amp_test_result_t *result) {
     printf(", DSCP %s (0x%0x)\n", dscp_to_str(msg->header->dscp),
             msg->header->dscp);
 
+    if ( msg->header->has_achieved_spacing ) {
+        printf("achieved packet spacing %uus (target %uus), mean "
+                "lateness %uus (max %uus)\n", msg->header->achieved_spacing,
+                msg->header->target_spacing,
+                msg->header->mean_lateness, msg->header->max_lateness);
+    }
+
     /* print each of the test results */
     for ( i = 0; i < msg->n_reports; i++ ) {
         item = msg->reports[i];
@@ -941,11 +1027,13 @@ test_t *register_test() {
 #if UNIT_TEST
 int amp_test_process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
         uint32_t bytes, struct timeval *now) {
-    return process_ipv4_packet(globals, packet, bytes, now);
+    return process_ipv4_packet(globals, packet, bytes, now,
+            TIMESTAMP_SOURCE_USERSPACE);
 }
 
 amp_test_result_t* amp_test_report_results(struct timeval *start_time,
-        int count, struct info_t info[], struct opt_t *opt) {
-    return report_results(start_time, count, info, opt);
+        int count, struct info_t info[], struct opt_t *opt,
+        struct pacer_t *pacer) {
+    return report_results(start_time, count, info, opt, pacer);
 }
 #endif
@@ -80,6 +80,7 @@ struct opt_t {
     uint8_t dscp;               /* diffserv codepoint to set */
     uint16_t packet_size;	/* use this packet size (bytes) */
     uint32_t inter_packet_delay;/* minimum gap between packets (usec) */
+    uint32_t burst;             /* packets allowed back to back when behind */
 };
 
 
@@ -97,6 +98,7 @@ struct info_t {
     uint8_t err_type;		/* type of ICMP error reply or 0 if no error */
     uint8_t err_code;		/* code of ICMP error reply, else undefined */
     uint8_t ttl;		/* TTL or hop limit of response packet */
+    uint8_t timestamp_source;	/* least accurate source of send/recv times */
 };
 
 
@@ -109,6 +111,7 @@ struct icmpglobals_t {
     struct socket_t sockets;
     struct addrinfo **dests;
     struct info_t *info;
+    struct pacer_t pacer;
     uint16_t ident;
     int index;
     int count;
@@ -128,7 +131,8 @@ test_t *register_test(void);
 int amp_test_process_ipv4_packet(struct icmpglobals_t *globals, char *packet,
         uint32_t bytes, struct timeval *now);
 amp_test_result_t* amp_test_report_results(struct timeval *start_time,
-        int count, struct info_t info[], struct opt_t *opt);
+        int count, struct info_t info[], struct opt_t *opt,
+        struct pacer_t *pacer);
 #endif
 
 
@@ -38,6 +38,9 @@
 #
 
 import socket
+import zlib
+from ampsave.exceptions import AmpUnknownCompression
+from ampsave.exceptions import AmpUncompressedLengthMismatch
 
 def getPrintableAddress(family, address):
     """
@@ -105,3 +108,24 @@ def getPrintableDscp(value):
     if value == 0b101110:
         return "EF"
     return "0x%.02x" % value
+
+def getUncompressedData(data, headers):
+    """
+    Decompress the result data if the amplet compressed it before sending,
+    based on the compression headers in the AMQP message properties
+    """
+    if headers is None or "x-amp-compression" not in headers:
+        return data
+
+    compression = headers["x-amp-compression"]
+
+    if compression == "zlib":
+        data = zlib.decompress(data)
+    else:
+        raise AmpUnknownCompression(compression)
+
+    length = headers.get("x-amp-uncompressed-length")
+    if length is not None and len(data) != length:
+        raise AmpUncompressedLengthMismatch(len(data), length)
+
+    return data
@@ -44,3 +44,16 @@ class AmpTestVersionMismatch(Exception):
     def __str__(self):
         return "%d != %d" % (self.got, self.expected)
 
+class AmpUnknownCompression(Exception):
+    def __init__(self, compression):
+        self.compression = compression
+    def __str__(self):
+        return "Unknown result compression '%s'" % self.compression
+
+class AmpUncompressedLengthMismatch(Exception):
+    def __init__(self, got, expected):
+        self.got = got
+        self.expected = expected
+    def __str__(self):
+        return "Decompressed result is %d bytes, expected %d" % (
+                self.got, self.expected)
@@ -82,6 +82,7 @@ def get_data(data):
                     "ra": i.flags.ra,
                 } if i.HasField("rtt") and i.HasField("flags") else {},
                 "ttl": i.ttl if i.HasField("ttl") else None,
+                "timestamp_source": i.timestamp_source if i.HasField("timestamp_source") else None,
                 }
             )
 
@@ -94,6 +95,10 @@ def get_data(data):
         "dnssec": msg.header.dnssec,
         "nsid": msg.header.nsid,
         "dscp": getPrintableDscp(msg.header.dscp),
+        "target_spacing": msg.header.target_spacing if msg.header.HasField("target_spacing") else None,
+        "achieved_spacing": msg.header.achieved_spacing if msg.header.HasField("achieved_spacing") else None,
+        "mean_lateness": msg.header.mean_lateness if msg.header.HasField("mean_lateness") else None,
+        "max_lateness": msg.header.max_lateness if msg.header.HasField("max_lateness") else None,
         "results": results,
     }
 
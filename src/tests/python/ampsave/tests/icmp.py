@@ -63,6 +63,11 @@ def get_data(data):
                 "random": msg.header.random,
                 "loss": 0 if i.HasField("rtt") else 1,
                 "dscp": getPrintableDscp(msg.header.dscp),
+                "target_spacing": msg.header.target_spacing if msg.header.HasField("target_spacing") else None,
+                "achieved_spacing": msg.header.achieved_spacing if msg.header.HasField("achieved_spacing") else None,
+                "mean_lateness": msg.header.mean_lateness if msg.header.HasField("mean_lateness") else None,
+                "max_lateness": msg.header.max_lateness if msg.header.HasField("max_lateness") else None,
+                "timestamp_source": i.timestamp_source if i.HasField("timestamp_source") else None,
             }
         )
 
@@ -63,6 +63,7 @@ def build_summary(data):
         "minimum": data.minimum,
         "mean": data.mean,
         "samples": data.samples,
+        "timestamp_source": data.timestamp_source if data.HasField("timestamp_source") else None,
     }
 
 def build_voip(data):
@@ -0,0 +1,115 @@
+#
+# This file is part of amplet2.
+#
+# Copyright (c) 2013-2016 The University of Waikato, Hamilton, New Zealand.
+#
+# Author: Brendon Jones
+#
+# All rights reserved.
+#
+# This code has been developed by the University of Waikato WAND
+# research group. For further information please see http://www.wand.net.nz/
+#
+# amplet2 is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# In addition, as a special exception, the copyright holders give
+# permission to link the code of portions of this program with the
+# OpenSSL library under certain conditions as described in each
+# individual source file, and distribute linked combinations including
+# the two.
+#
+# You must obey the GNU General Public License in all respects for all
+# of the code used other than OpenSSL. If you modify file(s) with this
+# exception, you may extend this exception to your version of the
+# file(s), but you are not obligated to do so. If you do not wish to do
+# so, delete this exception statement from your version. If you delete
+# this exception statement from all source files in the program, then
+# also delete it here.
+#
+# amplet2 is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with amplet2. If not, see <http://www.gnu.org/licenses/>.
+
+import os
+import unittest
+import zlib
+from ampsave.common import getUncompressedData
+from ampsave.exceptions import AmpUnknownCompression
+from ampsave.exceptions import AmpUncompressedLengthMismatch
+
+# same as DEFAULT_COMPRESS_THRESHOLD and DEFAULT_COMPRESS_LEVEL in measured
+COMPRESS_THRESHOLD = 1024
+COMPRESS_LEVEL = 6
+
+def compressResult(data):
+    """
+    Compress a result the same way that measured does before publishing
+    it, returning the message body and headers
+    """
+    headers = {"x-amp-test-type": "icmp"}
+
+    if len(data) < COMPRESS_THRESHOLD:
+        return data, headers
+
+    compressed = zlib.compress(data, COMPRESS_LEVEL)
+    if len(compressed) >= len(data):
+        return data, headers
+
+    headers["x-amp-compression"] = "zlib"
+    headers["x-amp-uncompressed-length"] = len(data)
+    return compressed, headers
+
+class TestUncompressedData(unittest.TestCase):
+    def test_large_result(self):
+        data = b"abcdefgh" * 8192
+        body, headers = compressResult(data)
+        self.assertEqual(headers["x-amp-compression"], "zlib")
+        self.assertEqual(headers["x-amp-uncompressed-length"], len(data))
+        self.assertLess(len(body), len(data))
+        self.assertEqual(getUncompressedData(body, headers), data)
+
+    def test_threshold(self):
+        data = b"abcdefgh" * (COMPRESS_THRESHOLD // 8)
+        body, headers = compressResult(data)
+        self.assertIn("x-amp-compression", headers)
+        self.assertEqual(getUncompressedData(body, headers), data)
+
+    def test_small_result(self):
+        data = b"abcdefgh"
+        body, headers = compressResult(data)
+        self.assertNotIn("x-amp-compression", headers)
+        self.assertEqual(getUncompressedData(body, headers), data)
+
+    def test_not_smaller(self):
+        data = os.urandom(64 * 1024)
+        body, headers = compressResult(data)
+        self.assertNotIn("x-amp-compression", headers)
+        self.assertNotIn("x-amp-uncompressed-length", headers)
+        self.assertEqual(getUncompressedData(body, headers), data)
+
+    def test_no_headers(self):
+        self.assertEqual(getUncompressedData(b"result", None), b"result")
+
+    def test_length_mismatch(self):
+        data = b"abcdefgh" * 8192
+        body, headers = compressResult(data)
+        headers["x-amp-uncompressed-length"] = len(data) + 1
+        with self.assertRaises(AmpUncompressedLengthMismatch) as context:
+            getUncompressedData(body, headers)
+        self.assertEqual(context.exception.got, len(data))
+        self.assertEqual(context.exception.expected, len(data) + 1)
+
+    def test_unknown_compression(self):
+        body, headers = compressResult(b"abcdefgh" * 8192)
+        headers["x-amp-compression"] = "lzma"
+        with self.assertRaises(AmpUnknownCompression):
+            getUncompressedData(body, headers)
+
+if __name__ == "__main__":
+    unittest.main()
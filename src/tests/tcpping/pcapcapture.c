@@ -45,7 +45,6 @@
 #include <netinet/icmp6.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <ifaddrs.h>
 #include <libwandevent.h>
 #include <arpa/inet.h>
 #include <malloc.h>
@@ -59,88 +58,12 @@
 #include "testlib.h"
 #include "pcapcapture.h"
 #include "debug.h"
-
-struct ifaddrs *ifaddrlist = NULL;
-struct ifaddrs *ifaddrorig = NULL;
+#include "ifsnapshot.h"
 
 struct pcapdevice *pcaps = NULL;
 
 
 
-/*
- * Find the start of the real addresses in the list of addresses belonging
- * to an interface. This assumes that all the AF_PACKET addresses are at the
- * beginning, followed by the AF_INET and AF_INET6 addresses.
- */
-static int get_interface_addresses(void) {
-    struct ifaddrs *ifa;
-
-    if ( getifaddrs(&ifaddrorig) == -1 ) {
-        Log(LOG_ERR, "Unable to fetch interface addresses, aborting test");
-        return -1;
-    }
-
-    /* Loop over address list and skip past all the AF_PACKET addresses */
-    for ( ifa = ifaddrorig; ifa != NULL; ifa = ifa->ifa_next ) {
-        int family;
-
-        if ( ifa->ifa_addr == NULL ) {
-            continue;
-        }
-
-        family = ifa->ifa_addr->sa_family;
-
-        if ( family == AF_INET || family == AF_INET6 ) {
-            ifaddrlist = ifa;
-            break;
-        }
-    }
-
-    return 0;
-}
-
-
-
-/*
- * Determine which interface a given address belongs to.
- */
-static char *find_address_interface(struct sockaddr *sin) {
-    struct ifaddrs *ifa;
-
-    for ( ifa = ifaddrlist; ifa != NULL; ifa = ifa->ifa_next ) {
-        if ( ifa->ifa_addr == NULL ) {
-            continue;
-        }
-
-        if ( ifa->ifa_addr->sa_family != sin->sa_family ) {
-            continue;
-        }
-
-        if ( ifa->ifa_addr->sa_family == AF_INET ) {
-            struct sockaddr_in *sin4 = (struct sockaddr_in *)sin;
-            struct sockaddr_in *ifa4 = (struct sockaddr_in *)(ifa->ifa_addr);
-
-            if ( sin4->sin_addr.s_addr == ifa4->sin_addr.s_addr ) {
-                return ifa->ifa_name;
-            }
-        }
-
-        if ( ifa->ifa_addr->sa_family == AF_INET6 ) {
-            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sin;
-            struct sockaddr_in6 *ifa6 = (struct sockaddr_in6 *)(ifa->ifa_addr);
-
-            if ( memcmp(&sin6->sin6_addr.s6_addr, &ifa6->sin6_addr.s6_addr,
-                        sizeof(struct in6_addr)) == 0 ) {
-                return ifa->ifa_name;
-            }
-        }
-    }
-
-    return NULL;
-}
-
-
-
 /*
  * Create a pcap filter that will match only traffic between the ports we
  * are using for this test.
@@ -313,19 +236,15 @@ int pcap_listen(struct sockaddr *address, uint16_t srcportv4,
                 int fd, void *data, enum wand_eventtype_t ev)) {
 
     struct pcapdevice *p;
+    char ifname[IF_NAMESIZE];
 
-    /* If we don't have a list of all addresses on this machine, get them. */
-    if ( ifaddrorig == NULL && get_interface_addresses() == -1 ) {
-        return 0;
-    }
-
+    /* find the interface with our address, measured keeps a list of them */
     if ( device == NULL ) {
-        device = find_address_interface(address);
-
-        if ( device == NULL ) {
+        if ( amp_interface_name(address, ifname, sizeof(ifname)) < 0 ) {
             Log(LOG_ERR, "Failed to find interface to add BPF filter");
             return 0;
         }
+        device = ifname;
     }
 
     /* Find the device in our list of existing pcap devices */
@@ -502,8 +421,6 @@ void pcap_cleanup(wand_event_handler_t *ev_hdl) {
         p = p->next;
         free(tmp);
     }
-
-    freeifaddrs(ifaddrorig);
 }
 
 /* vim: set sw=4 tabstop=4 softtabstop=4 expandtab : */
@@ -77,6 +77,7 @@ static struct option long_options[] = {
     {"size", required_argument, 0, 's'},
     {"dscp", required_argument, 0, 'Q'},
     {"interpacketgap", required_argument, 0, 'Z'},
+    {"burst", required_argument, 0, 'B'},
     {"interface", required_argument, 0, 'I'},
     {"ipv4", required_argument, 0, '4'},
     {"ipv6", required_argument, 0, '6'},
@@ -161,6 +162,9 @@ static int open_sockets(struct tcppingglobals *tcpping) {
         return 0;
     }
 
+    /* not fatal, send times will be taken by the test if this fails */
+    set_tx_timestamp_socket_options(&tcpping->raw_sockets);
+
     if ( tcpping->device ) {
         if ( bind_sockets_to_device(&tcpping->raw_sockets,
                 tcpping->device) < 0 ) {
@@ -744,11 +748,18 @@ static void send_packet(wand_event_handler_t *ev_hdl, void *evdata) {
     uint16_t srcport;
     int packet_size;
     char *packet = NULL;
-    int bytes_sent;
+    struct batch_packet_t probe;
     int sock;
-    struct timeval tv;
+    int delay;
     struct sockaddr *srcaddr;
 
+    if ( pacer_get_batch(&tp->pacer, 1, &delay) == 0 ) {
+        /* send event triggered early, wait the remaining time and try again */
+        tp->nextpackettimer = wand_add_timer(ev_hdl, S_FROM_US(delay),
+                US_FROM_US(delay), tp, send_packet);
+        return;
+    }
+
     /* Grab the next available destination */
     assert(tp->destindex < tp->destcount);
     dest = tp->dests[tp->destindex];
@@ -761,6 +772,7 @@ static void send_packet(wand_event_handler_t *ev_hdl, void *evdata) {
     tp->info[tp->destindex].replyflags = 0;
     tp->info[tp->destindex].icmptype = 0;
     tp->info[tp->destindex].icmpcode = 0;
+    tp->info[tp->destindex].timestamp_source = TIMESTAMP_SOURCE_USERSPACE;
 
     if ( dest->ai_family == AF_INET ) {
         srcport = tp->sourceportv4;
@@ -803,23 +815,20 @@ static void send_packet(wand_event_handler_t *ev_hdl, void *evdata) {
         goto nextdest;
     }
 
-    if ( gettimeofday(&tv, NULL) == -1 ) {
-        Log(LOG_WARNING, "Error calling gettimeofday during TCPPing test");
-        goto nextdest;
-    }
-
-    /* record time just before sending the packet */
-    tp->info[tp->destindex].time_sent = tv;
-
-    /* Send the packet */
-    bytes_sent = sendto(sock, packet, packet_size, 0, dest->ai_addr,
-            dest->ai_addrlen);
+    /* Send the packet, recording the time it left (kernel time if we can) */
+    probe.buf = packet;
+    probe.length = packet_size;
+    probe.dest = dest;
+    send_packet_batch(sock, &probe, 1);
+    pacer_sent(&tp->pacer, 1);
 
     /* TODO Handle partial sends and error cases better */
-    if ( bytes_sent != packet_size ) {
-        Log(LOG_DEBUG, "TCPPing: only sent %d of %d bytes", bytes_sent,
-                packet_size);
+    if ( probe.length != packet_size ) {
+        Log(LOG_DEBUG, "TCPPing: failed to send %d bytes", packet_size);
+        memset(&tp->info[tp->destindex].time_sent, 0, sizeof(struct timeval));
     } else {
+        tp->info[tp->destindex].time_sent = TV_FROM_TS(probe.time);
+        tp->info[tp->destindex].timestamp_source = probe.time_source;
         tp->outstanding ++;
     }
 
@@ -832,10 +841,10 @@ nextdest:
         tp->nextpackettimer = NULL;
         tp->losstimer = wand_add_timer(ev_hdl, LOSS_TIMEOUT, 0, tp, halt_test);
     } else {
-        tp->nextpackettimer = wand_add_timer(ev_hdl,
-                (int) (tp->options.inter_packet_delay / 1000000),
-                (tp->options.inter_packet_delay % 1000000),
-                tp, send_packet);
+        /* schedule against the next deadline, not the time we finished */
+        delay = pacer_get_delay(&tp->pacer);
+        tp->nextpackettimer = wand_add_timer(ev_hdl, S_FROM_US(delay),
+                US_FROM_US(delay), tp, send_packet);
     }
 
     if ( packet ) {
@@ -875,6 +884,9 @@ static Amplet2__Tcpping__Item* report_destination(struct info_t *info) {
 
             item->has_rtt = 1;
             item->rtt = info->delay;
+            /* the response time always comes from pcap, in the kernel */
+            item->has_timestamp_source = 1;
+            item->timestamp_source = info->timestamp_source;
 
             amplet2__tcpping__tcp_flags__init(item->flags);
 
@@ -934,7 +946,7 @@ static Amplet2__Tcpping__Item* report_destination(struct info_t *info) {
  * results for each destination address.
  */
 static amp_test_result_t* report_results(struct timeval *start_time, int count,
-        struct info_t info[], struct opt_t *opt) {
+        struct info_t info[], struct opt_t *opt, struct pacer_t *pacer) {
 
     int i;
     amp_test_result_t *result = calloc(1, sizeof(amp_test_result_t));
@@ -952,6 +964,18 @@ static amp_test_result_t* report_results(struct timeval *start_time, int count,
     header.has_dscp = 1;
     header.dscp = opt->dscp;
 
+    /* report how closely the requested packet spacing was achieved */
+    if ( pacer != NULL && pacer->packets > 1 ) {
+        header.has_target_spacing = 1;
+        header.target_spacing = pacer->interval;
+        header.has_achieved_spacing = 1;
+        header.achieved_spacing = pacer_get_mean_gap(pacer) + 0.5;
+        header.has_mean_lateness = 1;
+        header.mean_lateness = pacer_get_mean_lateness(pacer) + 0.5;
+        header.has_max_lateness = 1;
+        header.max_lateness = pacer->max_lateness;
+    }
+
     /* build up the repeated reports section with each of the results */
     reports = malloc(sizeof(Amplet2__Tcpping__Item*) * count);
     for ( i = 0; i < count; i++ ) {
@@ -991,7 +1015,8 @@ static amp_test_result_t* report_results(struct timeval *start_time, int count,
 static void usage(void) {
     fprintf(stderr,
             "Usage: amp-tcpping [-hrvx] [-p perturbate] [-s packetsize]\n"
-            "                   [-P port] [-Q codepoint] [-Z interpacketgap]\n"
+            "                   [-P port] [-Q codepoint]\n"
+            "                   [-Z interpacketgap] [-B burst]\n"
             "                   [-I interface] [-4 sourcev4] [-6 sourcev6]\n"
             "                   -- destination1 [destination2 ... destinationN]"
             "\n\n");
@@ -1034,6 +1059,7 @@ amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
 
     /* Set defaults before processing options */
     globals->options.inter_packet_delay = MIN_INTER_PACKET_DELAY;
+    globals->options.burst = DEFAULT_PACKET_BURST;
     globals->options.dscp = DEFAULT_DSCP_VALUE;
     globals->options.packet_size = MIN_TCPPING_PROBE_LEN;
     globals->options.random = 0;
@@ -1043,7 +1069,7 @@ amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
     globals->sourcev6 = NULL;
     globals->device = NULL;
 
-    while ( (opt = getopt_long(argc, argv, "P:p:rs:I:Q:Z:4:6:hvx",
+    while ( (opt = getopt_long(argc, argv, "P:p:rs:I:Q:B:Z:4:6:hvx",
                 long_options, NULL)) != -1 ) {
         switch (opt) {
             case '4':
@@ -1058,6 +1084,7 @@ amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
                       }
                       break;
             case 'Z': globals->options.inter_packet_delay = atoi(optarg); break;
+            case 'B': globals->options.burst = atoi(optarg); break;
             case 'P': globals->options.port = atoi(optarg); break;
             case 'p': globals->options.perturbate = atoi(optarg); break;
             case 'r': globals->options.random = 1; break;
@@ -1104,6 +1131,9 @@ amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
     globals->nextpackettimer = NULL;
     globals->losstimer = NULL;
 
+    pacer_init(&globals->pacer, globals->options.inter_packet_delay,
+            globals->options.burst);
+
     /* catch a SIGINT and end the test early */
     wand_add_signal(SIGINT, NULL, interrupt_test);
 
@@ -1129,9 +1159,11 @@ amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
 
     close_sockets(globals);
 
+    pacer_report(&globals->pacer, "TCPPing");
+
     /* send report */
     result = report_results(&start_time, globals->destcount, globals->info,
-            &globals->options);
+            &globals->options, &globals->pacer);
 
     free(globals->device);
     free(globals->info);
@@ -1176,6 +1208,13 @@ void print_tcpping(amp_test_result_t *result) {
     printf("    DSCP %s (0x%0x)\n", dscp_to_str(msg->header->dscp),
             msg->header->dscp);
 
+    if ( msg->header->has_achieved_spacing ) {
+        printf("    achieved packet spacing %uus (target %uus), mean "
+                "lateness %uus (max %uus)\n", msg->header->achieved_spacing,
+                msg->header->target_spacing,
+                msg->header->mean_lateness, msg->header->max_lateness);
+    }
+
     /* print each of the test results */
     for ( i = 0; i < msg->n_reports; i++ ) {
         item = msg->reports[i];
@@ -1241,8 +1280,9 @@ test_t *register_test() {
 
 #if UNIT_TEST
 amp_test_result_t* amp_test_report_results(struct timeval *start_time,
-        int count, struct info_t info[], struct opt_t *opt) {
-    return report_results(start_time, count, info, opt);
+        int count, struct info_t info[], struct opt_t *opt,
+        struct pacer_t *pacer) {
+    return report_results(start_time, count, info, opt, pacer);
 }
 #endif
 
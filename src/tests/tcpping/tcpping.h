@@ -82,6 +82,7 @@ struct opt_t {
     uint16_t packet_size;       /* Use this particular packet size (bytes) */
     uint16_t port;              /* Target port number */
     uint32_t inter_packet_delay;/* minimum gap between packets (usec) */
+    uint32_t burst;             /* packets allowed back to back when behind */
     uint8_t dscp;
 };
 
@@ -96,6 +97,7 @@ struct tcppingglobals {
     struct socket_t raw_sockets;
     struct socket_t tcp_sockets;
     struct info_t *info;
+    struct pacer_t pacer;
     int destindex;
     int destcount;
     char *device;
@@ -145,6 +147,7 @@ struct info_t {
     uint8_t replyflags;         /* TCP control bits set in the reply */
     uint8_t icmptype;           /* ICMP type of the reply */
     uint8_t icmpcode;           /* ICMP code of the reply */
+    uint8_t timestamp_source;   /* Where the send time was taken */
 };
 
 amp_test_result_t* run_tcpping(int argc, char *argv[], int count,
@@ -154,7 +157,8 @@ test_t *register_test(void);
 
 #if UNIT_TEST
 amp_test_result_t* amp_test_report_results(struct timeval *start_time,
-        int count, struct info_t info[], struct opt_t *opt);
+        int count, struct info_t info[], struct opt_t *opt,
+        struct pacer_t *pacer);
 #endif
 
 #endif
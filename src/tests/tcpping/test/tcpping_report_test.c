@@ -53,6 +53,7 @@
 struct info_t *info;
 struct opt_t options;
 unsigned int count;
+struct pacer_t *pacer;
 
 
 
@@ -71,6 +72,31 @@ static void verify_header(struct opt_t *a, Amplet2__Tcpping__Header *b) {
 
 
 
+/*
+ * Check that the achieved packet spacing is only reported when the test
+ * has pacing information, and that it matches what the pacer measured.
+ */
+static void verify_pacing(struct pacer_t *a, Amplet2__Tcpping__Header *b) {
+    if ( a == NULL || a->packets < 2 ) {
+        assert(!b->has_target_spacing);
+        assert(!b->has_achieved_spacing);
+        assert(!b->has_mean_lateness);
+        assert(!b->has_max_lateness);
+        return;
+    }
+
+    assert(b->has_target_spacing);
+    assert(b->has_achieved_spacing);
+    assert(b->has_mean_lateness);
+    assert(b->has_max_lateness);
+    assert(b->target_spacing == a->interval);
+    assert(b->achieved_spacing == (uint32_t)(pacer_get_mean_gap(a) + 0.5));
+    assert(b->mean_lateness == (uint32_t)(pacer_get_mean_lateness(a) + 0.5));
+    assert(b->max_lateness == (uint32_t)a->max_lateness);
+}
+
+
+
 /*
  * Check that the address in the result item matches the address that the
  * test tried to report.
@@ -214,6 +240,7 @@ static void verify_message(amp_test_result_t *result) {
     assert(msg->n_reports == count);
 
     verify_header(&options, msg->header);
+    verify_pacing(pacer, msg->header);
 
     /* check each of the test results */
     for ( i = 0; i < msg->n_reports; i++ ) {
@@ -247,6 +274,7 @@ static void build_info(struct info_t *item, struct addrinfo *addr,
  *
  */
 int main(void) {
+    struct pacer_t pacing;
     struct timeval start_time;
     struct addrinfo *addr = get_numeric_address("192.168.0.254", NULL);
     addr->ai_canonname = strdup("foo.bar.baz");
@@ -288,37 +316,60 @@ int main(void) {
     options.packet_size = 0;
     options.random = 0;
     options.port = 22;
-    verify_message(amp_test_report_results(&start_time, count, info, &options));
+    verify_message(amp_test_report_results(&start_time, count, info,
+                &options, pacer));
     options.random = 1;
-    verify_message(amp_test_report_results(&start_time, count, info, &options));
+    verify_message(amp_test_report_results(&start_time, count, info,
+                &options, pacer));
 
     options.packet_size = 64;
     options.random = 0;
     options.port = 53;
-    verify_message(amp_test_report_results(&start_time, count, info, &options));
+    verify_message(amp_test_report_results(&start_time, count, info,
+                &options, pacer));
     options.random = 1;
-    verify_message(amp_test_report_results(&start_time, count, info, &options));
+    verify_message(amp_test_report_results(&start_time, count, info,
+                &options, pacer));
 
     options.packet_size = 84;
     options.random = 0;
     options.port = 80;
-    verify_message(amp_test_report_results(&start_time, count, info, &options));
+    verify_message(amp_test_report_results(&start_time, count, info,
+                &options, pacer));
     options.random = 1;
-    verify_message(amp_test_report_results(&start_time, count, info, &options));
+    verify_message(amp_test_report_results(&start_time, count, info,
+                &options, pacer));
 
     options.packet_size = 1500;
     options.random = 0;
     options.port = 443;
-    verify_message(amp_test_report_results(&start_time, count, info, &options));
+    verify_message(amp_test_report_results(&start_time, count, info,
+                &options, pacer));
     options.random = 1;
-    verify_message(amp_test_report_results(&start_time, count, info, &options));
+    verify_message(amp_test_report_results(&start_time, count, info,
+                &options, pacer));
 
     options.packet_size = 9000;
     options.random = 0;
     options.port = 65535;
-    verify_message(amp_test_report_results(&start_time, count, info, &options));
+    verify_message(amp_test_report_results(&start_time, count, info,
+                &options, pacer));
     options.random = 1;
-    verify_message(amp_test_report_results(&start_time, count, info, &options));
+    verify_message(amp_test_report_results(&start_time, count, info,
+                &options, pacer));
+
+    /* the achieved packet spacing is reported when the test knows it */
+    memset(&pacing, 0, sizeof(pacing));
+    pacing.interval = 1000;
+    pacing.packets = 11;
+    pacing.first = 5000;
+    pacing.last = 15500;
+    pacing.lateness = 2222;
+    pacing.max_lateness = 900;
+    pacer = &pacing;
+    verify_message(amp_test_report_results(&start_time, count, info,
+                &options, pacer));
+    pacer = NULL;
 
     free(info);
     freeaddrinfo(addr);
@@ -78,6 +78,7 @@ static struct option long_options[] = {
     {"window", required_argument, 0, 'w'},
     {"dscp", required_argument, 0, 'Q'},
     {"interpacketgap", required_argument, 0, 'Z'},
+    {"burst", required_argument, 0, 'B'},
     {"interface", required_argument, 0, 'I'},
     {"ipv4", required_argument, 0, '4'},
     {"ipv6", required_argument, 0, '6'},
@@ -147,16 +148,17 @@ static int build_ipv6_probe(void *packet, uint16_t packet_size, int id,
  * Send the next probe packet towards a given destination.
  */
 static int send_probe(struct socket_t *ip_sockets, uint16_t ident,
-        uint16_t packet_size, uint32_t inter_packet_delay, uint8_t dscp,
+        uint16_t packet_size, struct pacer_t *pacer, uint8_t dscp,
         struct dest_info_t *info) {
 
     char packet[packet_size];
-    long int delay;
+    int bytes_sent;
     uint16_t id;
     int sock;
     int length;
 
     assert(ip_sockets);
+    assert(pacer);
     assert(info);
 
     memset(packet, 0, sizeof(packet));
@@ -188,19 +190,19 @@ static int send_probe(struct socket_t *ip_sockets, uint16_t ident,
 	    return -1;
     };
 
-    /* send packet with appropriate inter packet delay */
-    while ( (delay = delay_send_packet(sock, packet, length, info->addr,
-                    inter_packet_delay,
-                    &(info->hop[info->ttl - 1].time_sent))) > 0 ) {
-        Log(LOG_DEBUG, "Sleeping for %ldus - send event triggered early",delay);
-        usleep(delay);
-    }
+    /* send packet once the pacer allows, in case the timer fired early */
+    pacer_wait(pacer);
+    gettimeofday(&(info->hop[info->ttl - 1].time_sent), NULL);
+    bytes_sent = sendto(sock, packet, length, 0, info->addr->ai_addr,
+            info->addr->ai_addrlen);
+    pacer_sent(pacer, 1);
 
     info->probes++;
     Log(LOG_DEBUG, "Sending probe to destination %d (ttl %d, attempt %d)\n",
             info->id, info->ttl, info->attempts);
 
-    if ( delay < 0 ) {
+    if ( bytes_sent != length ) {
+        Log(LOG_DEBUG, "Only sent %d of %d bytes", bytes_sent, length);
         /*
          * Mark this as done if the packet failed to send properly, we
          * don't want to wait for a response that will never arrive. We
@@ -1123,7 +1125,7 @@ static void usage(void) {
     fprintf(stderr,
             "Usage: amp-trace [-abhfrvx] [-p perturbate] [-s packetsize]\n"
             "                 [-w windowsize]\n"
-            "                 [-Q codepoint] [-Z interpacketgap]\n"
+            "                 [-Q codepoint] [-Z interpacketgap] [-B burst]\n"
             "                 [-I interface] [-4 sourcev4] [-6 sourcev6]\n"
             "                 -- destination1 [destination2 ... destinationN]"
             "\n\n");
@@ -1151,30 +1153,15 @@ static void usage(void) {
 
 /*
  * Determine the time until we are allowed to send the next probe onto the
- * network - must always wait at least the inter packet delay.
+ * network, according to the deadline kept by the pacer.
  */
-static struct timeval get_next_send_time(struct timeval *last, uint32_t delay) {
-    struct timeval tmp = {0, 0};
-    struct timeval now;
-
-    /*
-     * Use gettimeofday so that we are using the same clock that set the last
-     * sent time for the probe. It's different to the clock used by
-     * libwandevent but we are only interested in the difference between values
-     * so that's ok.
-     */
-    gettimeofday(&now, NULL);
-
-    if ( last ) {
-        /* determine how long it was since we sent a probe */
-        int64_t diff = DIFF_TV_US(now, *last);
+static struct timeval get_next_send_time(struct pacer_t *pacer) {
+    struct timeval tmp;
+    int delay;
 
-        /* if it hasn't been long enough then wait the remaining time */
-        if ( diff < delay ) {
-            tmp.tv_sec = S_FROM_US(delay - diff);
-            tmp.tv_usec = US_FROM_US(delay - diff);
-        }
-    }
+    delay = pacer_get_delay(pacer);
+    tmp.tv_sec = S_FROM_US(delay);
+    tmp.tv_usec = US_FROM_US(delay);
 
     return tmp;
 }
@@ -1244,8 +1231,7 @@ static void send_probe_callback(wand_event_handler_t *ev_hdl, void *data) {
     /* send probe to the destination at the appropriate TTL */
     if ( send_probe(probelist->sockets, probelist->ident,
                 probelist->opts->packet_size,
-                probelist->opts->inter_packet_delay,
-                probelist->opts->dscp, item) < 0 ) {
+                &probelist->pacer, probelist->opts->dscp, item) < 0 ) {
         /* failed to send probe, mark the whole path as done */
         set_done_item(probelist, item);
         enqueue_next_pending(probelist);
@@ -1254,8 +1240,7 @@ static void send_probe_callback(wand_event_handler_t *ev_hdl, void *data) {
             return;
         }
     } else {
-        /* probe sent ok, keep track of when the most recent probe was sent */
-        probelist->last_probe = &item->hop[item->ttl-1].time_sent;
+        /* probe sent ok */
         probelist->total_probes++;
 
         /* set a timeout if one hasn't already been set for an earlier probe */
@@ -1276,8 +1261,7 @@ static void send_probe_callback(wand_event_handler_t *ev_hdl, void *data) {
         struct timeval delay;
         assert(probelist->sendtimer == NULL);
 
-        delay = get_next_send_time(probelist->last_probe,
-                probelist->opts->inter_packet_delay);
+        delay = get_next_send_time(&probelist->pacer);
 
         probelist->sendtimer = wand_add_timer(ev_hdl,
                 delay.tv_sec, delay.tv_usec,
@@ -1288,49 +1272,50 @@ static void send_probe_callback(wand_event_handler_t *ev_hdl, void *data) {
 
 
 /*
- * Callback function used when receiving a packet.
+ * Callback function used when receiving packets, processes every packet
+ * that is waiting on the socket.
  */
 static void recv_probe_callback(wand_event_handler_t *ev_hdl,
         int fd, void *data, __attribute__((unused))enum wand_eventtype_t ev) {
-    char packet[2048];
-    struct timeval now;
+    char buffer[MAX_PACKET_BATCH][2048];
+    struct batch_packet_t packets[MAX_PACKET_BATCH];
     struct probe_list_t *probelist = (struct probe_list_t*)data;
-    struct sockaddr_storage addr;
-    socklen_t socklen = sizeof(addr);
     struct dest_info_t *item;
-    struct socket_t sockets;
+    int received;
+    int ready;
     int wait;
+    int i;
 
     Log(LOG_DEBUG, "Got a packet");
 
-    /*
-     * determine the address family of the socket, so we can properly get
-     * the source address from the get_packet() call
-     */
-    if ( getsockname(fd, (struct sockaddr*)&addr, &socklen) < 0 ) {
-        Log(LOG_WARNING, "getsockname() failed in receive callback: %s",
-                strerror(errno));
-        return;
-    }
-
     wait = 0;
-    sockets.socket = (addr.ss_family == AF_INET) ? fd : -1;
-    sockets.socket6 = (addr.ss_family == AF_INET6) ? fd : -1;
 
-    if ( get_packet(&sockets, packet, sizeof(packet), (struct sockaddr*)&addr,
-                &wait, &now) < 1 ) {
+    for ( i = 0; i < MAX_PACKET_BATCH; i++ ) {
+        packets[i].buf = buffer[i];
+        packets[i].size = sizeof(buffer[i]);
+    }
+
+    if ( (received = get_packet_batch(fd, packets, MAX_PACKET_BATCH,
+                    &wait)) < 1 ) {
         Log(LOG_WARNING, "Failed to get packet data");
         return;
     }
 
     item = probelist->outstanding;
+    ready = 0;
+
+    for ( i = 0; i < received; i++ ) {
+        if ( process_packet((struct sockaddr*)&packets[i].source,
+                    packets[i].buf, TV_FROM_TS(packets[i].time), data) > 0 ) {
+            ready = 1;
+        }
+    }
 
-    if ( process_packet((struct sockaddr*)&addr, packet, now, data) > 0 ) {
+    /* schedule sending any new probes that the responses have made ready */
+    if ( ready && probelist->sendtimer == NULL ) {
         struct timeval delay;
-        assert(probelist->sendtimer == NULL);
 
-        delay = get_next_send_time(probelist->last_probe,
-                probelist->opts->inter_packet_delay);
+        delay = get_next_send_time(&probelist->pacer);
 
         probelist->sendtimer = wand_add_timer(ev_hdl,
                 delay.tv_sec, delay.tv_usec,
@@ -1410,8 +1395,7 @@ static void probe_timeout_callback(wand_event_handler_t *ev_hdl, void *data) {
         struct timeval delay;
         assert(probelist->sendtimer == NULL);
 
-        delay = get_next_send_time(probelist->last_probe,
-                probelist->opts->inter_packet_delay);
+        delay = get_next_send_time(&probelist->pacer);
 
         probelist->sendtimer = wand_add_timer(ev_hdl,
                 delay.tv_sec, delay.tv_usec,
@@ -1511,6 +1495,7 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
     /* set some sensible defaults */
     options.dscp = DEFAULT_DSCP_VALUE;
     options.inter_packet_delay = MIN_INTER_PACKET_DELAY;
+    options.burst = DEFAULT_PACKET_BURST;
     options.packet_size = DEFAULT_TRACEROUTE_PROBE_LEN;
     options.random = 0;
     options.perturbate = 0;
@@ -1521,7 +1506,7 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
     device = NULL;
     window = INITIAL_WINDOW;
 
-    while ( (opt = getopt_long(argc, argv, "abfp:rs:w:I:Q:Z:4:6:hvx",
+    while ( (opt = getopt_long(argc, argv, "abfp:rs:w:I:Q:B:Z:4:6:hvx",
                     long_options, NULL)) != -1 ) {
         switch ( opt ) {
             case '4': sourcev4 = get_numeric_address(optarg, NULL); break;
@@ -1533,6 +1518,7 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
                       }
                       break;
             case 'Z': options.inter_packet_delay = atoi(optarg); break;
+            case 'B': options.burst = atoi(optarg); break;
             case 'a': options.as = 1; break;
             case 'b': options.ip = 0; break;
             case 'f': /* deprecated probeall option */; break;
@@ -1637,7 +1623,7 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
     probelist.opts = &options;
     probelist.total_probes = 0;
     probelist.done_count = 0;
-    probelist.last_probe = NULL;
+    pacer_init(&probelist.pacer, options.inter_packet_delay, options.burst);
 
     /* create all info blocks and place them in the send queue */
     for ( i = 0; i < count; i++ ) {
@@ -1684,6 +1670,8 @@ amp_test_result_t* run_traceroute(int argc, char *argv[], int count,
 
     wand_destroy_event_handler(ev_hdl);
 
+    pacer_report(&probelist.pacer, "Traceroute");
+
     /* sockets aren't needed any longer */
     if ( icmp_sockets.socket > 0 ) {
 	close(icmp_sockets.socket);
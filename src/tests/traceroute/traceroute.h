@@ -119,6 +119,7 @@ struct opt_t {
     int as;                     /* lookup the AS number of each address */
     uint16_t packet_size;	/* use this packet size (bytes) */
     uint32_t inter_packet_delay;/* minimum gap between packets (usec) */
+    uint32_t burst;             /* packets allowed back to back when behind */
     uint8_t dscp;
 };
 
@@ -175,7 +176,7 @@ struct probe_list_t {
     uint16_t ident;
     struct opt_t *opts;
     int total_probes;
-    struct timeval *last_probe;	        /* when most recent probe was sent */
+    struct pacer_t pacer;               /* spaces out the probes sent */
 };
 
 #endif
@@ -126,6 +126,8 @@ static void verify_summary(struct summary_t *a,
     assert(a->mean == b->mean);
     assert(b->has_samples);
     assert(a->samples == b->samples);
+    assert(b->has_timestamp_source);
+    assert(a->timestamp_source == b->timestamp_source);
 }
 
 
@@ -146,6 +146,7 @@ struct summary_t {
     uint32_t minimum;
     uint32_t mean;
     uint32_t samples;
+    uint8_t timestamp_source; /* least accurate source of any sample times */
 };
 
 
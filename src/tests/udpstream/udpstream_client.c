@@ -169,6 +169,7 @@ static struct summary_t *extract_summary(ProtobufCBinaryData *data) {
         stats->minimum = item->rtt->minimum;
         stats->mean = item->rtt->mean;
         stats->samples = item->rtt->samples;
+        stats->timestamp_source = item->rtt->timestamp_source;
     }
 
     amplet2__udpstream__item__free_unpacked(item, NULL);
@@ -158,7 +158,9 @@ struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
     struct payload_t *payload;
     size_t payload_len;
     char response[MAXIMUM_UDPSTREAM_PACKET_LENGTH];
-    ssize_t bytes;
+    struct batch_packet_t probe, reflected;
+    struct timespec *sent_times = NULL;
+    uint8_t *sent_sources = NULL;
     uint32_t i;
     struct socket_t sockets;
     struct summary_t *rtt = NULL;
@@ -169,7 +171,8 @@ struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
             options->packet_spacing);
 
     /* wrap the socket in a socket_t so we can call other amp functions */
-    memset(&sockets, 0, sizeof(sockets));
+    sockets.socket = -1;
+    sockets.socket6 = -1;
     switch ( remote->ai_family ) {
         case AF_INET:
             sockets.socket = sock;
@@ -194,6 +197,13 @@ struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
     if ( options->rtt_samples > 0 ) {
         rtt = calloc(1, sizeof(struct summary_t));
         rtt->minimum = UINT32_MAX;
+        rtt->timestamp_source = TIMESTAMP_SOURCE_KERNEL;
+        /* keep the send times of packets that will be reflected */
+        sent_times = calloc(options->packet_count, sizeof(struct timespec));
+        sent_sources = calloc(options->packet_count, sizeof(uint8_t));
+        /* not fatal, send times will be taken by the test if this fails */
+        set_default_socket_options(&sockets);
+        set_tx_timestamp_socket_options(&sockets);
     }
 
     //XXX put a pattern in the payload?
@@ -208,13 +218,17 @@ struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
         payload->sec = htobe64(now.tv_sec);
         payload->usec = htobe64(now.tv_usec);
 
-        if ( sendto(sock, payload, payload_len, 0,
-                    remote->ai_addr, remote->ai_addrlen) < 0 ) {
-            Log(LOG_WARNING, "Error sending udpstream packet: %s",
-                    strerror(errno));
+        probe.buf = (char*)payload;
+        probe.length = payload_len;
+        probe.dest = remote;
+        if ( send_packet_batch(sock, &probe, 1) != 1 ) {
+            Log(LOG_WARNING, "Error sending udpstream packet");
             if ( rtt ) {
                 free(rtt);
+                free(sent_times);
+                free(sent_sources);
             }
+            free(payload);
             return NULL;
         }
 
@@ -225,22 +239,43 @@ struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
              */
             int wait = options->packet_spacing;
 
+            sent_times[i] = probe.time;
+            sent_sources[i] = probe.time_source;
+
+            reflected.buf = response;
+            reflected.size = MAXIMUM_UDPSTREAM_PACKET_LENGTH;
+
             /* TODO timing won't be super accurate, but good enough for now */
-            while ( (bytes = get_packet(&sockets, response,
-                            MAXIMUM_UDPSTREAM_PACKET_LENGTH,
-                            NULL, &wait, &now)) > 0 ) {
+            while ( get_packet_batch(sock, &reflected, 1, &wait) > 0 ) {
                 struct payload_t *recv_payload;
                 struct timeval sent_time;
+                uint32_t index;
                 uint32_t value;
                 double delta;
 
                 //XXX check that this is actually a related packet
 
                 recv_payload = (struct payload_t*)&response;
-                /* this should cast appropriately whether 32 or 64 bit */
-                sent_time.tv_sec = (time_t)be64toh(recv_payload->sec);
-                sent_time.tv_usec = (time_t)be64toh(recv_payload->usec);
-                value = DIFF_TV_US(now, sent_time);
+                index = ntohl(recv_payload->index);
+
+                if ( index <= i ) {
+                    /* use the time we recorded, possibly from the kernel */
+                    value = DIFF_TS_US(reflected.time, sent_times[index]);
+                    if ( sent_sources[index] < rtt->timestamp_source ) {
+                        rtt->timestamp_source = sent_sources[index];
+                    }
+                } else {
+                    /* this should cast appropriately whether 32 or 64 bit */
+                    sent_time.tv_sec = (time_t)be64toh(recv_payload->sec);
+                    sent_time.tv_usec = (time_t)be64toh(recv_payload->usec);
+                    now = TV_FROM_TS(reflected.time);
+                    value = DIFF_TV_US(now, sent_time);
+                    rtt->timestamp_source = TIMESTAMP_SOURCE_USERSPACE;
+                }
+
+                if ( reflected.time_source < rtt->timestamp_source ) {
+                    rtt->timestamp_source = reflected.time_source;
+                }
                 if ( value > rtt->maximum ) {
                     rtt->maximum = value;
                 }
@@ -261,6 +296,8 @@ struct summary_t* send_udp_stream(int sock, struct addrinfo *remote,
     }
 
     free(payload);
+    free(sent_times);
+    free(sent_sources);
 
     return rtt;
 }
@@ -437,6 +474,8 @@ Amplet2__Udpstream__SummaryStats* report_summary(struct summary_t *summary) {
     stats->mean = summary->mean;
     stats->has_samples = 1;
     stats->samples = summary->samples;
+    stats->has_timestamp_source = 1;
+    stats->timestamp_source = summary->timestamp_source;
 
     return stats;
 }